@@ -0,0 +1,59 @@
+import argparse
+import time
+
+import numpy as np
+import pandas as pd
+
+import custom_api_cpp
+
+# Reuse-distance analysis of a binary trace (generate_input.py, --save-trace) with custom_api_cpp.analyze_trace,
+# and the noise it implies per table: DP-SGD(F) samples noise for every row in every iteration, EANA for the
+# unique rows of each iteration only, and LazyDP for the unique rows of each iteration (the delayed noise of a
+# row is one sample of sqrt(delay) std) plus one flush of every row at the end of training.
+# The csv files in this directory are per-iteration summaries of experiment_access.py, not accesses.
+parser = argparse.ArgumentParser()
+parser.add_argument("--trace", type=str, required=True)
+parser.add_argument("--dim", type=int, default=128) # embedding dimension, for the noise bytes (fp32)
+parser.add_argument("--max-delay", type=int, default=1000) # longer delays share the last bin of the histogram
+parser.add_argument("--nthreads", type=int, default=32)
+parser.add_argument("--output", type=str, default=None) # prefix of <output>_summary.csv and <output>_delays.csv
+args = parser.parse_args()
+
+start = time.time()
+reader = custom_api_cpp.TraceReader(args.trace)
+table_sizes = np.array(reader.table_sizes())
+n_batches = reader.n_batches()
+unique_rows, delays = custom_api_cpp.analyze_trace(args.trace, args.max_delay, args.nthreads)
+unique_rows = unique_rows.numpy()
+delays = delays.numpy()
+
+summary = pd.DataFrame(index=pd.RangeIndex(len(table_sizes), name="table"))
+summary["rows"] = table_sizes
+summary["unique_rows_mean"] = unique_rows.mean(axis=1)
+for q in [50, 99]:
+    summary["unique_rows_p%d" % q] = np.percentile(unique_rows, q, axis=1)
+summary["touched_rows"] = delays[:, 0]
+# mean delay of the re-touched rows, the ones beyond max_delay counted as max_delay + 1
+bins = np.arange(args.max_delay + 2)
+retouched = delays[:, 1:].sum(axis=1)
+summary["delay_mean"] = (delays[:, 1:] * bins[1:]).sum(axis=1) / np.maximum(retouched, 1)
+summary["delay_1_fraction"] = delays[:, 1] / np.maximum(retouched, 1)
+noise_rows = {
+    "dpsgd_f": table_sizes * n_batches,
+    "eana": unique_rows.sum(axis=1),
+    "lazydp": unique_rows.sum(axis=1) + table_sizes,
+}
+for mode, rows in noise_rows.items():
+    summary["%s_noise_rows" % mode] = rows
+    summary["%s_noise_bytes" % mode] = rows * args.dim * 4
+summary["lazydp_saving"] = noise_rows["dpsgd_f"] / noise_rows["lazydp"]
+
+pd.set_option("display.width", 200)
+print(summary)
+total = {mode: rows.sum() for mode, rows in noise_rows.items()}
+print("%d batches, noise rows: dpsgd_f %.3e, eana %.3e, lazydp %.3e (%.1fx less than dpsgd_f), %.1f s"
+      % (n_batches, total["dpsgd_f"], total["eana"], total["lazydp"], total["dpsgd_f"] / total["lazydp"], time.time() - start))
+
+if args.output is not None:
+    summary.to_csv("%s_summary.csv" % args.output)
+    pd.DataFrame(delays.T, index=pd.Index(bins, name="delay")).to_csv("%s_delays.csv" % args.output)
@@ -1,63 +1,62 @@
+import argparse
+import time
+
 import numpy as np
+import pandas as pd
 import torch
-import pdb
-import time
 
-table_size="39884406-39043-17289-7420-20263-3-7120-1543-63-38532951-2953546-403346-10-2208-11938-155-4-976-14-39979771-25641295-39664984-585935-12972-108-36"
-ln_emb = np.fromstring(table_size, dtype=int, sep="-")
-ln_emb = torch.from_numpy(ln_emb)
-batch_size = 4096
-pooling_factor = 60
+import custom_api_cpp
 
-num_gathers_list = torch.zeros(len(ln_emb), dtype=torch.int64)
-for i in range(len(ln_emb)):
-    if ln_emb[i].item() < pooling_factor:
-        num_gathers_list[i] = ln_emb[i].item()
-    else:
-        num_gathers_list[i] = pooling_factor
-        
-access_pdfs = list()    
-for i in range(len(ln_emb)):
-    pdf = np.ones(ln_emb[i].item())/ln_emb[i].item()
-    access_pdfs.append(pdf)
+# Pre-generates the sparse features of a benchmark into a binary trace (custom_api_cpp.TraceWriter),
+# replayed by dlrm_s_pytorch_lazydp.py --load-trace, so that every run of a sweep sees the same batches
+# at no generation cost.
+parser = argparse.ArgumentParser()
+parser.add_argument("--arch-embedding-size", type=str, default="39884406-39043-17289-7420-20263-3-7120-1543-63-38532951-2953546-403346-10-2208-11938-155-4-976-14-39979771-25641295-39664984-585935-12972-108-36")
+parser.add_argument("--mini-batch-size", type=int, default=4096)
+parser.add_argument("--num-indices-per-lookup", type=int, default=1)
+parser.add_argument("--num-batches", type=int, default=100)
+parser.add_argument("--locality", type=str, default="uniform") # uniform / zipf_<a> / kaggle_<table>
+parser.add_argument("--path-lazydp", type=str, default="..")
+parser.add_argument("--seed", type=int, default=123)
+parser.add_argument("--nthreads", type=int, default=32)
+parser.add_argument("--raw", action="store_true", default=False) # raw int32/int64 blocks instead of delta varints
+parser.add_argument("--output", type=str, required=True)
+args = parser.parse_args()
 
+table_sizes = np.fromstring(args.arch_embedding_size, dtype=int, sep="-").tolist()
+pooling_factors = [min(size, args.num_indices_per_lookup) for size in table_sizes]
 
-pdb.set_trace()
-start = time.time()
+def convert_pmf(original_pmf, new_length):
+    # same as dlrm_s_pytorch_lazydp.py: the cdf is interpolated to "new_length" rows
+    original_x = np.linspace(0, 1, len(original_pmf) + 1)
+    original_cdf = np.insert(np.cumsum(original_pmf), 0, 0)
+    new_cdf = np.interp(np.linspace(0, 1, new_length + 1), original_x, original_cdf)
+    return np.diff(new_cdf)
+
+sampler = None
+if args.locality.startswith("zipf"):
+    a = float(args.locality.split("_")[-1])
+    pdfs = [1/((np.arange(size) + 1) ** a) for size in table_sizes]
+    sampler = custom_api_cpp.AliasSampler([torch.from_numpy(pdf / pdf.sum()) for pdf in pdfs], args.nthreads)
+elif args.locality.startswith("kaggle"):
+    df = pd.read_csv("%s/Kaggle_train_distribution.csv" %args.path_lazydp)
+    counts = df.iloc[:, int(args.locality.split("_")[-1])].dropna().values.astype(float)
+    sampler = custom_api_cpp.AliasSampler([torch.from_numpy(convert_pmf(counts/counts.sum(), size)) for size in table_sizes], args.nthreads)
+elif args.locality != "uniform":
+    assert False, "Wrong locality"
 
-# lS_i = list()
-# for i in range(len(ln_emb)):
-#     lS_i_table = list()
-#     for j in range(batch_size):
-#         lS_i_example = None
-        
-#         goal = num_gathers_list[i].item()
-#         num = 0
-#         while num < goal:
-#             tmp = torch.randint(0, ln_emb[i].item(), (goal-num, ), dtype=torch.int64)
-#             if lS_i_example != None:
-#                 lS_i_example = torch.cat([lS_i_example, tmp]).unique()
-#             else:
-#                 lS_i_example = tmp.unique()
-#             num = lS_i_example.shape[0]
-        
-#         lS_i_table.append(lS_i_example)
-#     lS_i.append(torch.cat(lS_i_table))
-    
-"""
-lS_i = list()
-for i in range(len(ln_emb)):
-    print(i)
-    lS_i_table = list()
-    for j in range(batch_size):
-        tmp = np.random.choice(ln_emb[i].item(), num_gathers_list[i].item(), replace=False, p=access_pdfs[i])
-        lS_i_table.append(tmp)
-    lS_i.append(torch.from_numpy(np.concatenate(lS_i_table)))
-"""
+start = time.time()
+torch.manual_seed(args.seed)
+writer = custom_api_cpp.TraceWriter(args.output, table_sizes, pooling_factors, args.mini_batch_size, not args.raw)
+for k in range(args.num_batches):
+    seed = int(torch.randint(0, 2**62, (1,)).item())
+    if sampler is None:
+        lS_i, _ = custom_api_cpp.multi_hot_indices(table_sizes, pooling_factors, args.mini_batch_size, seed, args.nthreads)
+    else:
+        lS_i, _ = sampler.sample(args.mini_batch_size, pooling_factors, seed, args.nthreads)
+    for i in range(len(lS_i)):
+        assert lS_i[i].shape[0] == pooling_factors[i] * args.mini_batch_size
+    writer.append(lS_i, args.nthreads)
+writer.close()
 
 print("time: %2f" %(time.time() - start))
-for i in range(len(lS_i)):
-    assert lS_i[i].shape[0] == num_gathers_list[i].item()  * batch_size, "%d, %d" %(lS_i[i].shape[0], num_gathers_list[i].item())
-    
-pdb.set_trace()
-assert True
\ No newline at end of file
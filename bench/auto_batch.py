@@ -0,0 +1,93 @@
+import argparse
+import os
+import subprocess
+import sys
+
+import pandas as pd
+
+# Largest feasible mini-batch per training mode: each candidate batch is probed with a short run
+# (--probe-batches iterations with --report-throughput), which is infeasible if it fails (e.g., an OOM of
+# the GPU activations or of the host per-sample gradients / noise staging) or if its peak RSS / GPU memory
+# exceeds --host-mem-gb / --gpu-mem-gb. The batch is doubled from --start-batch until a probe fails, then
+# binary-searched down to --granularity, and the largest feasible batch is run for --num-batches.
+# merged_result/<description>_auto_batch.csv has a column per mode with that batch, its samples/sec and
+# its peak memory. The arguments after "--" are passed to every run (model, system, locality, ...), e.g.
+#   python auto_batch.py --description=auto_batch --modes=sgd,dpsgd_f,lazydp -- $model_cmd --use-gpu ...
+# With --table-server among them, the probes map the staged tables instead of reading them.
+parser = argparse.ArgumentParser()
+parser.add_argument("--description", type=str, default="auto_batch")
+parser.add_argument("--modes", type=str, default="sgd,dpsgd_f,lazydp")
+parser.add_argument("--start-batch", type=int, default=1024)
+parser.add_argument("--max-batch", type=int, default=1 << 20)
+parser.add_argument("--granularity", type=int, default=256)
+parser.add_argument("--probe-batches", type=int, default=4) # iterations of a probe (LazyDP reports all but the last one)
+parser.add_argument("--num-batches", type=int, default=30) # iterations of the final run
+parser.add_argument("--host-mem-gb", type=float, default=0) # 0: no limit besides the failures
+parser.add_argument("--gpu-mem-gb", type=float, default=0)
+parser.add_argument("--path-lazydp", type=str, default=os.environ.get("PATH_LAZYDP"))
+args, run_args = parser.parse_known_args()
+if len(run_args) > 0 and run_args[0] == "--":
+    run_args = run_args[1:]
+
+dlrm_path = os.path.join(os.path.dirname(os.path.dirname(os.path.abspath(__file__))), "dlrm")
+merged_path = "%s/result/merged_result" % args.path_lazydp
+
+def run(mode, batch_size, num_batches, description):
+    # (samples/sec, peak RSS MB, peak GPU MB) of the run, None if it failed
+    throughput_path = "%s/%s_throughput.csv" % (merged_path, description)
+    for path in ["%s/%s.csv" % (merged_path, description), throughput_path]:
+        if os.path.isfile(path):
+            os.remove(path)
+    script = "dlrm_s_pytorch_lazydp.py" if mode == "lazydp" else "dlrm_s_pytorch.py"
+    command = [sys.executable, os.path.join(dlrm_path, script)] + run_args + [
+        "--dpsgd-mode=%s" % mode, "--mini-batch-size=%d" % batch_size, "--num-batches=%d" % num_batches,
+        "--description=%s" % description, "--path-lazydp=%s" % args.path_lazydp, "--report-throughput"]
+    result = subprocess.run(command, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, text=True)
+    if result.returncode != 0 or not os.path.isfile(throughput_path):
+        print(">> %s, batch %d: failed (%s)" % (mode, batch_size, (result.stderr.strip().splitlines() or ["no output"])[-1]), flush=True)
+        return None
+    column = pd.read_csv(throughput_path, header=0, index_col=0).iloc[:, -1]
+    return column["Samples/sec"], column["Peak RSS (MB)"], column["Peak GPU memory (MB)"]
+
+def feasible(mode, batch_size):
+    result = run(mode, batch_size, args.probe_batches, "%s_probe" % args.description)
+    if result is None:
+        return False
+    _, rss, gpu = result
+    within = (args.host_mem_gb <= 0 or rss <= args.host_mem_gb * 1024) and (args.gpu_mem_gb <= 0 or gpu <= args.gpu_mem_gb * 1024)
+    print(">> %s, batch %d: peak RSS %.0f MB, peak GPU %.0f MB%s" % (mode, batch_size, rss, gpu, "" if within else " (over the limit)"), flush=True)
+    return within
+
+summary = dict()
+for mode in args.modes.split(","):
+    low, high = 0, None # largest feasible / smallest infeasible batch so far
+    batch_size = args.start_batch
+    while high is None and batch_size <= args.max_batch:
+        if feasible(mode, batch_size):
+            low = batch_size
+            batch_size *= 2
+        else:
+            high = batch_size
+    if high is not None:
+        while high - low > args.granularity:
+            middle = (low + high) // 2 // args.granularity * args.granularity
+            if middle <= low:
+                break
+            if feasible(mode, middle):
+                low = middle
+            else:
+                high = middle
+    if low == 0:
+        print(">> %s: no feasible batch from %d" % (mode, args.start_batch), flush=True)
+        summary[mode] = [0, 0, 0, 0]
+        continue
+    result = run(mode, low, args.num_batches, args.description)
+    summary[mode] = [low] + (list(result) if result is not None else [0, 0, 0])
+    print(">> %s: largest batch %d, %.0f samples/sec" % (mode, low, summary[mode][1]), flush=True)
+
+for path in ["%s/%s_probe.csv" % (merged_path, args.description), "%s/%s_probe_throughput.csv" % (merged_path, args.description)]:
+    if os.path.isfile(path):
+        os.remove(path)
+df = pd.DataFrame(summary, index=["Batch size", "Samples/sec", "Peak RSS (MB)", "Peak GPU memory (MB)"])
+df.to_csv("%s/%s_auto_batch.csv" % (merged_path, args.description))
+print(df)
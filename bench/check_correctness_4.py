@@ -0,0 +1,43 @@
+import torch
+import argparse
+import math
+
+def run():
+    parser = argparse.ArgumentParser(
+        description="Correctness test 4: LazyDP (baseline) vs LazyDP (optimized) with the same Philox noise"
+    )
+    parser.add_argument("--path-model-weight", type=str, default="/")
+    parser.add_argument("--baseline-tag", type=str, default="baseline")
+    parser.add_argument("--optimized-tag", type=str, default="optimized")
+    # the noise is bit-identical, only the order of the summation of the noise and the gradient differs
+    parser.add_argument("--rtol", type=float, default=1e-05)
+    parser.add_argument("--atol", type=float, default=1e-06)
+    args = parser.parse_args()
+    
+    path_model_weight = args.path_model_weight
+    
+    param_list_b = torch.load("%s/dlrm_lazydp_%s" %(path_model_weight, args.baseline_tag))
+    param_list_o = torch.load("%s/dlrm_lazydp_%s" %(path_model_weight, args.optimized_tag))
+        
+    assert len(param_list_b) == len(param_list_o)
+    
+    length = len(param_list_b)
+    
+    for i in range(length):
+        param_b = param_list_b[i]
+        param_o = param_list_o[i].to(param_b.dtype)
+        
+        assert param_b.shape == param_o.shape
+        
+        cmp_b_o = torch.isclose(param_b, param_o, rtol=args.rtol, atol=args.atol)
+        
+        if not torch.all(cmp_b_o):
+            print("Correctness fail: LazyDP (%s) and LazyDP (%s), max. error %e of parameter %d" %(args.baseline_tag, args.optimized_tag, (param_o - param_b).abs().max().item(), i))
+            assert False
+        else:
+            continue
+        
+    print("Correctness success.")
+    
+if __name__ == "__main__":
+    run()
@@ -0,0 +1,131 @@
+import torch
+import argparse
+import time
+import os
+import numpy as np
+import pandas as pd
+
+import custom_api_cpp
+
+# Microbenchmark of the custom_api_cpp kernels of the DP-SGD update against their torch baselines,
+# swept over rows, embedding dim, access distribution (duplicate ratio of the indices) and threads.
+# Each row of the output reports the time (ms), the achieved bandwidth (GB/s) and the speedup over torch.
+
+def measure(func, warmup, repeat):
+    for _ in range(warmup):
+        func()
+    start = time.perf_counter()
+    for _ in range(repeat):
+        func()
+    return (time.perf_counter() - start) / repeat * 1000
+
+def access_pmf(locality, n_rows, path_lazydp):
+    if locality.startswith("zipf"):
+        a = float(locality.split("_")[-1])
+        pmf = 1/((np.arange(n_rows) + 1) ** a)
+        return pmf / pmf.sum()
+    elif locality.startswith("kaggle"):
+        # same as dlrm_s_pytorch_lazydp.py: the cdf of a Kaggle table is interpolated to "n_rows" rows
+        df = pd.read_csv("%s/Kaggle_train_distribution.csv" %path_lazydp)
+        counts = df.iloc[:, int(locality.split("_")[-1])].dropna().values.astype(float)
+        original_x = np.linspace(0, 1, len(counts) + 1)
+        original_cdf = np.insert(np.cumsum(counts / counts.sum()), 0, 0)
+        return np.diff(np.interp(np.linspace(0, 1, n_rows + 1), original_x, original_cdf))
+    else:
+        assert False, "Wrong locality"
+
+def sample_indices(locality, n_rows, n_indices, path_lazydp, nthreads):
+    if locality == "uniform":
+        return torch.randint(0, n_rows, (n_indices,), dtype=torch.int64)
+    sampler = custom_api_cpp.AliasSampler([torch.from_numpy(access_pmf(locality, n_rows, path_lazydp))], nthreads)
+    lS_i, _ = sampler.sample(n_indices, [1], 123, nthreads)
+    return lS_i[0]
+
+def run():
+    parser = argparse.ArgumentParser(
+        description="Microbenchmark of the custom_api_cpp kernels (noise sampling, unique, coalesce) vs. torch"
+    )
+    parser.add_argument("--rows-list", type=str, default="1000000-16000000") # rows of the table
+    parser.add_argument("--indices-list", type=str, default="262144") # indices of a batch (batch size x pooling factor)
+    parser.add_argument("--dim-list", type=str, default="16-64-128-256")
+    parser.add_argument("--locality-list", type=str, default="uniform-zipf_1.0-zipf_1.1-zipf_1.2-kaggle_0") # "-" separated
+    parser.add_argument("--nthreads-list", type=str, default="8-16-32")
+    parser.add_argument("--kernels", type=str, default="normal-normal_with_extra-unique-coalesce")
+    parser.add_argument("--warmup", type=int, default=2)
+    parser.add_argument("--repeat", type=int, default=5)
+    parser.add_argument("--path-lazydp", type=str, default=".")
+    parser.add_argument("--description", type=str, default="microbench")
+    args = parser.parse_args()
+
+    rows_list = [int(x) for x in args.rows_list.split("-")]
+    indices_list = [int(x) for x in args.indices_list.split("-")]
+    dim_list = [int(x) for x in args.dim_list.split("-")]
+    locality_list = args.locality_list.split("-")
+    nthreads_list = [int(x) for x in args.nthreads_list.split("-")]
+    kernels = args.kernels.split("-")
+
+    results = list()
+    def report(kernel, variant, rows, n_indices, dim, locality, nthreads, ms, n_bytes, baseline_ms):
+        results.append([kernel, variant, rows, n_indices, dim, locality, nthreads, ms, n_bytes / ms / 1e6, baseline_ms / ms])
+        print("%-16s %-12s rows=%-9d indices=%-8d dim=%-4d %-10s threads=%-3d %9.3f ms %7.2f GB/s x%.2f" % tuple(results[-1]))
+
+    for nthreads in nthreads_list:
+        torch.set_num_threads(nthreads)
+        for dim in dim_list:
+            for n_indices in indices_list:
+                # noise kernels do not depend on the rows of the table or the indices
+                std = 1.0
+                if "normal" in kernels:
+                    n_bytes = n_indices * dim * 4
+                    baseline = measure(lambda: torch.normal(0, std, (n_indices, dim)), args.warmup, args.repeat)
+                    report("normal", "torch", 0, n_indices, dim, "-", nthreads, baseline, n_bytes, baseline)
+                    ms = measure(lambda: custom_api_cpp.normal_multi_thread(std, n_indices, dim, nthreads), args.warmup, args.repeat)
+                    report("normal", "custom", 0, n_indices, dim, "-", nthreads, ms, n_bytes, baseline)
+                if "normal_with_extra" in kernels:
+                    # stds of the delayed noise, followed by as many rows for the gradient
+                    stds = torch.rand(n_indices) * 4
+                    n_bytes = (2 * n_indices * dim + n_indices) * 4
+                    def torch_with_extra():
+                        torch.cat([torch.normal(torch.zeros(n_indices, dim), stds.view(-1, 1).expand(n_indices, dim)), torch.empty(n_indices, dim)])
+                    baseline = measure(torch_with_extra, args.warmup, args.repeat)
+                    report("normal_with_extra", "torch", 0, n_indices, dim, "-", nthreads, baseline, n_bytes, baseline)
+                    ms = measure(lambda: custom_api_cpp.normal_multi_thread_with_extra(stds, dim, n_indices, nthreads), args.warmup, args.repeat)
+                    report("normal_with_extra", "custom", 0, n_indices, dim, "-", nthreads, ms, n_bytes, baseline)
+
+                for rows in rows_list:
+                    for locality in locality_list:
+                        indices = sample_indices(locality, rows, n_indices, args.path_lazydp, nthreads)
+                        n_unique = torch.unique(indices).numel()
+                        if "unique" in kernels and dim == dim_list[0]:
+                            n_bytes = (n_indices + n_unique) * 8
+                            baseline = measure(lambda: torch.unique(indices), args.warmup, args.repeat)
+                            report("unique", "torch", rows, n_indices, 0, locality, nthreads, baseline, n_bytes, baseline)
+                            ms = measure(lambda: custom_api_cpp.unique_multi_thread(indices), args.warmup, args.repeat)
+                            report("unique", "custom", rows, n_indices, 0, locality, nthreads, ms, n_bytes, baseline)
+                        if "coalesce" in kernels:
+                            # uncoalesced sparse gradient of a table, as produced by the EmbeddingBag backward
+                            grad = torch.sparse_coo_tensor(indices.view(1, -1), torch.rand(n_indices, dim), (rows, dim))
+                            n_bytes = n_indices * (dim * 4 + 8) + n_unique * (dim * 4 + 8)
+                            expected = grad.coalesce()
+                            baseline = measure(lambda: grad.coalesce(), args.warmup, args.repeat)
+                            report("coalesce", "torch", rows, n_indices, dim, locality, nthreads, baseline, n_bytes, baseline)
+                            variants = {
+                                "openmp": lambda: custom_api_cpp.coalesce_multi_thread_openmp(grad, nthreads),
+                                "embeddingbag": lambda: custom_api_cpp.coalesce_multi_thread_embeddingbag(grad, nthreads),
+                                "radix": lambda: custom_api_cpp.coalesce_radix(grad, nthreads),
+                                "hash": lambda: custom_api_cpp.coalesce_hash(grad, True, nthreads),
+                            }
+                            for variant, func in variants.items():
+                                output = func()
+                                assert torch.equal(output._indices(), expected._indices()), variant
+                                assert torch.allclose(output._values(), expected._values(), rtol=1e-04, atol=1e-05), variant
+                                ms = measure(func, args.warmup, args.repeat)
+                                report("coalesce", variant, rows, n_indices, dim, locality, nthreads, ms, n_bytes, baseline)
+
+    result_path = "%s/result/merged_result" %args.path_lazydp
+    os.makedirs(result_path, exist_ok=True)
+    columns = ["kernel", "variant", "rows", "indices", "dim", "locality", "nthreads", "time_ms", "GB/s", "speedup"]
+    pd.DataFrame(results, columns=columns).to_csv("%s/%s.csv" %(result_path, args.description), index=False)
+
+if __name__ == "__main__":
+    run()
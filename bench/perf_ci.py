@@ -0,0 +1,70 @@
+import argparse
+import json
+import os
+import sys
+
+import pandas as pd
+
+# Converts the merged result of run_perf_ci.sh (stages x runs, ms) into a JSON of stage timings per
+# training mode and compares it against a stored baseline: a stage regresses when it is slower than
+# the baseline by more than "tolerance" (relative), stages below "min-ms" in both are not compared.
+
+MODES = ["sgd", "dpsgd_b", "dpsgd_r", "dpsgd_f", "eana", "lazydp"]
+
+def load_timings(merged_result):
+    df = pd.read_csv(merged_result, header=0, index_col=0)
+    timings = dict()
+    for column in df.columns:
+        modes = [mode for mode in MODES if column.endswith("_" + mode)]
+        assert len(modes) == 1, "Unknown training mode of %s" % column
+        timings[modes[0]] = {stage: float(df.loc[stage, column]) for stage in df.index if stage != "test"}
+    return timings
+
+def compare(timings, baseline, tolerance, min_ms):
+    regressions = []
+    for mode, stages in baseline.items():
+        if mode not in timings:
+            regressions.append("%s: missing" % mode)
+            continue
+        for stage, base_ms in stages.items():
+            ms = timings[mode].get(stage, 0)
+            if max(ms, base_ms) < min_ms:
+                continue
+            ratio = ms / base_ms if base_ms > 0 else float("inf")
+            status = "REGRESSION" if ratio > 1 + tolerance else "ok"
+            print("%-8s %-28s %10.3f ms (baseline %10.3f ms) x%.2f %s" % (mode, stage, ms, base_ms, ratio, status))
+            if status != "ok":
+                regressions.append("%s %s: %.3f ms vs. %.3f ms" % (mode, stage, ms, base_ms))
+    return regressions
+
+def run():
+    parser = argparse.ArgumentParser(description="Performance regression check against a stored baseline")
+    parser.add_argument("--merged-result", type=str, required=True)
+    parser.add_argument("--output", type=str, required=True) # JSON of the stage timings of this run
+    parser.add_argument("--baseline", type=str, default="perf_ci_baseline.json")
+    parser.add_argument("--tolerance", type=float, default=0.25)
+    parser.add_argument("--min-ms", type=float, default=1.0)
+    parser.add_argument("--update-baseline", action="store_true", default=False)
+    args = parser.parse_args()
+
+    timings = load_timings(args.merged_result)
+    with open(args.output, "w") as f:
+        json.dump(timings, f, indent=1)
+
+    if args.update_baseline or not os.path.exists(args.baseline):
+        # the first run on a machine (or an intended change of performance) becomes the baseline
+        with open(args.baseline, "w") as f:
+            json.dump(timings, f, indent=1)
+        print("Baseline saved to %s" % args.baseline)
+        return
+
+    with open(args.baseline) as f:
+        baseline = json.load(f)
+    regressions = compare(timings, baseline, args.tolerance, args.min_ms)
+    if len(regressions) > 0:
+        print("%d regression(s):\n%s" % (len(regressions), "\n".join(regressions)))
+        sys.exit(1)
+    print("No regression")
+
+if __name__ == "__main__":
+    run()
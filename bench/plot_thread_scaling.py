@@ -0,0 +1,54 @@
+import argparse
+import re
+import pandas as pd
+
+# Scaling curves of the update sub-stages from the merged result of bench/run_thread_scaling.sh,
+# whose columns are "<result name>_<placement>_t<threads>"
+def run():
+    parser = argparse.ArgumentParser(
+        description="Thread scaling of the update sub-stages per NUMA placement"
+    )
+    parser.add_argument("--path-lazydp", type=str, default=".")
+    parser.add_argument("--description", type=str, default="thread_scaling")
+    args = parser.parse_args()
+
+    result_path = "%s/result/merged_result" %args.path_lazydp
+    merged = pd.read_csv("%s/%s.csv" %(result_path, args.description), header=0, index_col=0)
+    stages = ["Update", "Gradient coalesce", "Noise sampling", "Noisy gradient generation", "Model parameter update", "Overhead"]
+
+    rows = list()
+    for column in merged.columns:
+        match = re.match(r"(.*)_(single|interleave|cross|partitioned)_t(\d+)$", column)
+        if match is None:
+            continue
+        for stage in stages:
+            rows.append([match.group(2), int(match.group(3)), stage, merged.loc[stage, column]])
+    scaling = pd.DataFrame(rows, columns=["placement", "nthreads", "stage", "time_ms"])
+    # speedup over the fewest threads of the same placement and stage
+    base = scaling[scaling.nthreads == scaling.nthreads.min()].set_index(["placement", "stage"]).time_ms
+    scaling["speedup"] = [base[(p, s)] / t for p, s, t in zip(scaling.placement, scaling.stage, scaling.time_ms)]
+    scaling = scaling.sort_values(["stage", "placement", "nthreads"])
+    scaling.to_csv("%s/%s_scaling.csv" %(result_path, args.description), index=False)
+    best = scaling.loc[scaling.groupby(["stage", "placement"]).time_ms.idxmin()]
+    print(best.to_string(index=False))
+
+    try:
+        import matplotlib
+        matplotlib.use("Agg")
+        import matplotlib.pyplot as plt
+    except ImportError:
+        print("matplotlib is not available, only %s_scaling.csv is written" %args.description)
+        return
+    fig, axes = plt.subplots(1, len(stages), figsize=(4 * len(stages), 3.5))
+    for ax, stage in zip(axes, stages):
+        for placement, curve in scaling[scaling.stage == stage].groupby("placement"):
+            ax.plot(curve.nthreads, curve.time_ms, marker="o", label=placement)
+        ax.set_title(stage)
+        ax.set_xlabel("threads")
+        ax.set_ylabel("ms")
+    axes[0].legend()
+    fig.tight_layout()
+    fig.savefig("%s/%s_scaling.png" %(result_path, args.description))
+
+if __name__ == "__main__":
+    run()
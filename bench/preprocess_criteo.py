@@ -0,0 +1,46 @@
+import argparse
+import os
+import sys
+import time
+
+import numpy as np
+
+# Preprocesses the raw Criteo logs straight into the binary dataset of --data-generation criteo_bin with
+# custom_api_cpp.preprocess_criteo (parallel over the chunks of each day and over the tables), instead of
+# data_utils.getCriteoAdData (.npz per day) followed by data_loader_terabyte.numpy_to_binary, e.g.
+#   Terabyte: python preprocess_criteo.py --raw-data-file=./input/day --days=24 --output-directory=./input/terabyte_bin --max-ind-range=10000000 --nthreads=64
+#   Kaggle:   python preprocess_criteo.py --raw-data-file=./input/train.txt --days=7 --output-directory=./input/kaggle_bin --nthreads=64
+# then run with --processed-data-file=<output directory>/train_data.bin --criteo-bin-counts=<output directory>/day_fea_count.npz
+parser = argparse.ArgumentParser()
+parser.add_argument("--raw-data-file", type=str, required=True) # train.txt (Kaggle), or the prefix of day_0, ..., day_{days - 1} (Terabyte)
+parser.add_argument("--days", type=int, default=24) # Terabyte: the days of the prefix (the last is held out); Kaggle: the splits of train.txt (the last is held out)
+parser.add_argument("--output-directory", type=str, required=True)
+parser.add_argument("--max-ind-range", type=int, default=-1) # hash the categorical features into [0, max_ind_range) before renumbering them
+parser.add_argument("--data-sub-sample-rate", type=float, default=0.0) # in [0, 1), drop rate of the training rows of label 0
+parser.add_argument("--seed", type=int, default=0)
+parser.add_argument("--nthreads", type=int, default=32)
+parser.add_argument("--cpu-list", type=str, default=None) # pin the worker pool (e.g., "0-31")
+args = parser.parse_args()
+
+sys.path.append(os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+import custom_api_cpp
+from custom_utils import init_pool
+
+if args.cpu_list is not None:
+    init_pool(args.cpu_list)
+if os.path.isfile(args.raw_data_file):
+    paths = [args.raw_data_file]
+else:
+    paths = ["%s_%d" % (args.raw_data_file, day) for day in range(args.days)]
+for path in paths:
+    assert os.path.isfile(path), "missing raw data file %s" % path
+os.makedirs(args.output_directory, exist_ok=True)
+
+start = time.time()
+counts = custom_api_cpp.preprocess_criteo(paths, args.output_directory, args.days, args.max_ind_range, args.data_sub_sample_rate, args.seed, args.nthreads)
+# the counts file of data_utils (the rows of each embedding table)
+np.savez_compressed(os.path.join(args.output_directory, "day_fea_count.npz"), counts=np.array(counts, dtype=np.int32))
+for split in ["train", "val", "test"]:
+    size = os.path.getsize(os.path.join(args.output_directory, "%s_data.bin" % split))
+    print(">> %s_data.bin: %d samples" % (split, size // (40 * 4)))
+print(">> preprocessed %.1f GB in %.1f s, counts %s" % (sum(os.path.getsize(path) for path in paths) / 2**30, time.time() - start, list(counts)), flush=True)
@@ -0,0 +1,80 @@
+import argparse
+import os
+import sys
+import time
+
+import pandas as pd
+import torch
+
+# Replays the update stage of a LazyDP run recorded with --record-unique-sets, without the model, the data
+# or the GPU: in iteration k, every table goes through custom_api_cpp.fused_delayed_noise_sgd_update with the
+# recorded unique rows of iteration k as the noise rows (std = sqrt(delay) * the std scale of the run) and
+# an uncoalesced gradient over the rows of iteration k - 1, each repeated as many times as it was looked up
+# (random values). The tables are initialized like the model's (custom_api_cpp.init_table), so the kernel
+# sees the same rows, delays and gradient shapes as in the run, e.g.
+#   python replay_update.py --recording=unique_sets.bin --nthreads=32 --precision=bf16
+parser = argparse.ArgumentParser()
+parser.add_argument("--recording", type=str, required=True)
+parser.add_argument("--iters", type=int, default=0) # 0: all the recorded iterations
+parser.add_argument("--warmup", type=int, default=2) # iterations excluded from the percentiles
+parser.add_argument("--nthreads", type=int, default=32)
+parser.add_argument("--cpu-list", type=str, default=None) # pin the worker pool (e.g., "0-31")
+parser.add_argument("--precision", type=str, default="fp32", choices=["fp32", "bf16", "fp16"]) # storage of the tables (the gradient is fp32, as in the run)
+parser.add_argument("--noise-rng", type=str, default="philox", choices=["philox", "torch"])
+parser.add_argument("--output", type=str, default=None) # csv of the time of each iteration
+args = parser.parse_args()
+
+sys.path.append(os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+import custom_api_cpp
+from custom_utils import init_pool
+
+if args.cpu_list is not None:
+    init_pool(args.cpu_list)
+reader = custom_api_cpp.UniqueSetReader(args.recording)
+n_iters = reader.n_iters() if args.iters <= 0 else min(args.iters, reader.n_iters())
+assert n_iters > args.warmup, "too few iterations"
+table_sizes, dims = reader.table_sizes(), reader.dims()
+std_scale, lr = reader.std_scale(), reader.lr()
+dtype = {"fp32": torch.float, "bf16": torch.bfloat16, "fp16": torch.float16}[args.precision]
+seed = 0 if args.noise_rng == "philox" else -1
+
+tables = []
+for t, (n_rows, dim) in enumerate(zip(table_sizes, dims)):
+    bound = 1.0 / n_rows ** 0.5 # the uniform initialization of the embedding tables
+    tables.append(custom_api_cpp.init_table(n_rows, dim, False, -bound, bound, 0, t, args.nthreads).to(dtype))
+print(">> %d tables, %.1f GB, %d iterations, std scale %.3e, lr %.3e" % (len(tables), sum(table.numel() * table.element_size() for table in tables) / 2**30, n_iters, std_scale, lr), flush=True)
+
+values = dict() # random gradient values per dim, grown to the largest gradient
+def gradient(t, rows, counts):
+    dim = dims[t]
+    indices = torch.repeat_interleave(rows, counts)
+    if dim not in values or values[dim].shape[0] < indices.numel():
+        values[dim] = torch.randn(max(indices.numel(), 1) * 2, dim)
+    return torch.sparse_coo_tensor(indices.view(1, -1), values[dim][:indices.numel()], (table_sizes[t], dim))
+
+previous = None
+times, n_rows, n_bytes = [], [], []
+for k in range(n_iters):
+    uniques, delays, counts = reader.read(k, args.nthreads)
+    stds = [(delay.float().sqrt() * std_scale) for delay in delays]
+    if previous is None:
+        grads = [gradient(t, torch.empty(0, dtype=torch.int64), torch.empty(0, dtype=torch.int64)) for t in range(len(tables))]
+    else:
+        grads = [gradient(t, previous[0][t], previous[1][t]) for t in range(len(tables))]
+    start = time.perf_counter()
+    for t, table in enumerate(tables):
+        custom_api_cpp.fused_delayed_noise_sgd_update(table, uniques[t], stds[t], grads[t], lr, False, seed, t, k + 1, -1, args.nthreads)
+    times.append(time.perf_counter() - start)
+    rows = sum(unique.numel() + grad._nnz() for unique, grad in zip(uniques, grads))
+    n_rows.append(rows)
+    # the noise and gradient rows read and written once, the gradient values read once
+    n_bytes.append(sum((2 * (unique.numel() + grad._nnz()) * dims[t] * tables[t].element_size() + grad._values().numel() * grad._values().element_size())
+                       for t, (unique, grad) in enumerate(zip(uniques, grads))))
+    previous = (uniques, counts)
+
+df = pd.DataFrame({"iteration": range(n_iters), "time (ms)": [1000 * s for s in times], "rows": n_rows, "bytes": n_bytes})
+steady = df.iloc[args.warmup:]
+print(">> update: p50 %.3f ms, p99 %.3f ms, %.1f M rows/s, %.1f GB/s" % (steady["time (ms)"].quantile(0.5), steady["time (ms)"].quantile(0.99),
+      steady["rows"].sum() / (steady["time (ms)"].sum() / 1000) / 1e6, steady["bytes"].sum() / (steady["time (ms)"].sum() / 1000) / 1e9))
+if args.output is not None:
+    df.to_csv(args.output, index=False)
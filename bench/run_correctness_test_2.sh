@@ -8,6 +8,11 @@ description="correctness_test_2"
 numactl_use=1
 locality="uniform"
 numa_cmd=""
+# extra arguments for LazyDP, e.g., "--delayed-noise-update-optimize=merge --noise-precision=bf16"
+# or "--delayed-noise-update-optimize=fused --emb-precision=bf16 --stochastic-rounding"
+# with check_args="--rtol=2e-02 --atol=1e-05 --max-mean-error=1e-03" (looser for --emb-precision=int8)
+lazydp_args=""
+check_args=""
 
 result_path="$PATH_LAZYDP/result"
 if [ -e "$result_path/merged_result/${description}.csv" ]; then
@@ -35,11 +40,11 @@ do
     for training_mode in $training_mode_list
     do
         if [ $training_mode == "lazydp" ] ; then
-            $numa_cmd python $pdb_cmd ../dlrm/dlrm_s_pytorch_lazydp.py $model_cmd --emb-scale=$emb_scale --num-batches=$iterations --mini-batch-size=$batch_size --use-gpu   --num-indices-per-lookup=$num_gathers --num-indices-per-lookup-fixed=True --dpsgd-mode=$training_mode --disable-poisson-sampling --system=$system --description=$description --path-lazydp=$PATH_LAZYDP --locality=$locality --path-model-weight=$PATH_MODEL_WEIGHT --is-debugging --debugging-type=one_as_noise
+            $numa_cmd python $pdb_cmd ../dlrm/dlrm_s_pytorch_lazydp.py $model_cmd --emb-scale=$emb_scale --num-batches=$iterations --mini-batch-size=$batch_size --use-gpu   --num-indices-per-lookup=$num_gathers --num-indices-per-lookup-fixed=True --dpsgd-mode=$training_mode --disable-poisson-sampling --system=$system --description=$description --path-lazydp=$PATH_LAZYDP --locality=$locality --path-model-weight=$PATH_MODEL_WEIGHT --is-debugging --debugging-type=one_as_noise $lazydp_args
         else
             $numa_cmd python $pdb_cmd ../dlrm/dlrm_s_pytorch.py $model_cmd --emb-scale=$emb_scale --num-batches=$iterations --mini-batch-size=$batch_size --use-gpu --num-indices-per-lookup=$num_gathers --num-indices-per-lookup-fixed=True --dpsgd-mode=$training_mode  --disable-poisson-sampling --system=$system --description=$description --path-lazydp=$PATH_LAZYDP --locality=$locality --path-model-weight=$PATH_MODEL_WEIGHT --is-debugging --debugging-type=one_as_noise
         fi
     done
 done
 
-python check_correctness_2.py --path-model-weight=$PATH_MODEL_WEIGHT
\ No newline at end of file
+python check_correctness_2.py --path-model-weight=$PATH_MODEL_WEIGHT $check_args
\ No newline at end of file
@@ -0,0 +1,55 @@
+# This script compares the model parameters trained by LazyDP with the baseline kernels and with the
+# optimized ones, both with the real noise: the counter-based generator (--noise-rng=philox) keyed by
+# a fixed seed gives the same noise for any kernel and any number of threads
+
+system="cpu_gpu"
+iterations=30
+num_gathers=1
+batch_size=2048
+description="correctness_test_4"
+numactl_use=1
+locality="uniform"
+numa_cmd=""
+noise_seed=1234
+# the same noise in both runs: Philox for the tables and the (fused) MLP update, all noise settled at the end
+noise_args="--noise-rng=philox --noise-seed=$noise_seed --mlp-noise-optimize=fused --flush-noise-at-end --save-model-weight"
+baseline_args="--delayed-noise-update-optimize=baseline --noise-nthreads=1"
+# e.g., "--delayed-noise-update-optimize=fused --noise-nthreads=16"
+optimized_args="--delayed-noise-update-optimize=merge --noise-nthreads=16"
+check_args=""
+
+result_path="$PATH_LAZYDP/result"
+if [ -e "$result_path/merged_result/${description}.csv" ]; then
+    rm "$result_path/merged_result/${description}.csv"
+fi
+
+# MLPerf DLRM training configuration
+model_config="mlperf"
+arch_emb_size="39884406-39043-17289-7420-20263-3-7120-1543-63-38532951-2953546-403346-10-2208-11938-155-4-976-14-39979771-25641295-39664984-585935-12972-108-36"
+arch_mlp_bot="13-512-256-128"
+arch_mlp_top="1024-1024-512-256-1"
+arch_sparse_feature_size=128
+model_cmd="--model-config=$model_config --arch-sparse-feature-size=$arch_sparse_feature_size --arch-embedding-size=$arch_emb_size --arch-mlp-bot=$arch_mlp_bot --arch-mlp-top=$arch_mlp_top"
+
+emb_scale_list="
+            0.01
+            "
+
+run_tag_list="
+            baseline
+            optimized
+            "
+for emb_scale in $emb_scale_list
+do
+    for run_tag in $run_tag_list
+    do
+        if [ $run_tag == "baseline" ] ; then
+            kernel_args=$baseline_args
+        else
+            kernel_args=$optimized_args
+        fi
+        $numa_cmd python $pdb_cmd ../dlrm/dlrm_s_pytorch_lazydp.py $model_cmd --emb-scale=$emb_scale --num-batches=$iterations --mini-batch-size=$batch_size --use-gpu   --num-indices-per-lookup=$num_gathers --num-indices-per-lookup-fixed=True --dpsgd-mode=lazydp --disable-poisson-sampling --system=$system --description=$description --path-lazydp=$PATH_LAZYDP --locality=$locality --path-model-weight=$PATH_MODEL_WEIGHT --run-tag=$run_tag $noise_args $kernel_args
+    done
+done
+
+python check_correctness_4.py --path-model-weight=$PATH_MODEL_WEIGHT $check_args
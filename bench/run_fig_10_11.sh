@@ -10,9 +10,12 @@ locality="uniform"
 numa_cmd="numactl --cpunodebind=0 --membind=0"
 
 result_path="$PATH_LAZYDP/result"
-if [ -e "$result_path/merged_result/${description}.csv" ]; then
-    rm "$result_path/merged_result/${description}.csv"
-fi
+for csv in ${description} ${description}_per_layer
+do
+    if [ -e "$result_path/merged_result/${csv}.csv" ]; then
+        rm "$result_path/merged_result/${csv}.csv"
+    fi
+done
 
 # MLPerf DLRM training configuration
 model_config="mlperf"
@@ -32,16 +35,26 @@ training_mode_list="
                     sgd
                     lazydp
                     dpsgd_f
+                    lazydp_per_layer
+                    dpsgd_f_per_layer
                     "
 
 for training_mode in $training_mode_list
     do
+    # "<mode>_per_layer": per-layer clipping in the hooks of the single backward (--clip-backward=per_layer)
+    dpsgd_mode=${training_mode%_per_layer}
+    clip_cmd=""
+    run_description=$description
+    if [ $dpsgd_mode != $training_mode ] ; then
+        clip_cmd="--clip-backward=per_layer"
+        run_description=${description}_per_layer
+    fi
     for batch_size in $batch_size_list
     do
-        if [ $training_mode == "lazydp" ] ; then
-            $numa_cmd python $pdb_cmd ../dlrm/dlrm_s_pytorch_lazydp.py $model_cmd --emb-scale=$emb_scale --num-batches=$iterations --mini-batch-size=$batch_size --use-gpu   --num-indices-per-lookup=$num_gathers --num-indices-per-lookup-fixed=True --dpsgd-mode=$training_mode --disable-poisson-sampling --system=$system --description=$description --path-lazydp=$PATH_LAZYDP --locality=$locality --path-model-weight=$PATH_MODEL_WEIGHT
+        if [ $dpsgd_mode == "lazydp" ] ; then
+            $numa_cmd python $pdb_cmd ../dlrm/dlrm_s_pytorch_lazydp.py $model_cmd --emb-scale=$emb_scale --num-batches=$iterations --mini-batch-size=$batch_size --use-gpu   --num-indices-per-lookup=$num_gathers --num-indices-per-lookup-fixed=True --dpsgd-mode=$dpsgd_mode --disable-poisson-sampling --system=$system --description=$run_description --path-lazydp=$PATH_LAZYDP --locality=$locality --path-model-weight=$PATH_MODEL_WEIGHT $clip_cmd
         else
-            $numa_cmd python $pdb_cmd ../dlrm/dlrm_s_pytorch.py $model_cmd --emb-scale=$emb_scale --num-batches=$iterations --mini-batch-size=$batch_size --use-gpu --num-indices-per-lookup=$num_gathers --num-indices-per-lookup-fixed=True --dpsgd-mode=$training_mode  --disable-poisson-sampling --system=$system --description=$description --path-lazydp=$PATH_LAZYDP --locality=$locality --path-model-weight=$PATH_MODEL_WEIGHT
+            $numa_cmd python $pdb_cmd ../dlrm/dlrm_s_pytorch.py $model_cmd --emb-scale=$emb_scale --num-batches=$iterations --mini-batch-size=$batch_size --use-gpu --num-indices-per-lookup=$num_gathers --num-indices-per-lookup-fixed=True --dpsgd-mode=$dpsgd_mode  --disable-poisson-sampling --system=$system --description=$run_description --path-lazydp=$PATH_LAZYDP --locality=$locality --path-model-weight=$PATH_MODEL_WEIGHT $clip_cmd
         fi
     done
 done
\ No newline at end of file
@@ -0,0 +1,36 @@
+#!/bin/bash
+# LazyDP with the HT, the delays and the noise of the next rows on the CPU (all-CPU) or on the GPU
+# (--ht-device=gpu, noise rows shipped to the CPU for the update of the tables), cpu_gpu system.
+# The stage timings of both are merged into $PATH_LAZYDP/result/merged_result/<description>.csv
+
+description=${1:-"ht_device"}
+system="cpu_gpu"
+iterations=30
+emb_scale=1
+batch_size=2048
+num_gathers=1
+locality="uniform"
+numa_cmd="numactl --cpunodebind=0 --membind=0"
+
+result_path="$PATH_LAZYDP/result"
+if [ -e "$result_path/merged_result/${description}.csv" ]; then
+    rm "$result_path/merged_result/${description}.csv"
+fi
+
+# MLPerf DLRM training configuration
+model_config="mlperf"
+arch_emb_size="39884406-39043-17289-7420-20263-3-7120-1543-63-38532951-2953546-403346-10-2208-11938-155-4-976-14-39979771-25641295-39664984-585935-12972-108-36"
+arch_mlp_bot="13-512-256-128"
+arch_mlp_top="1024-1024-512-256-1"
+arch_sparse_feature_size=128
+model_cmd="--model-config=$model_config --arch-sparse-feature-size=$arch_sparse_feature_size --arch-embedding-size=$arch_emb_size --arch-mlp-bot=$arch_mlp_bot --arch-mlp-top=$arch_mlp_top"
+
+ht_device_list="
+                cpu
+                gpu
+                "
+
+for ht_device in $ht_device_list
+do
+    $numa_cmd python ../dlrm/dlrm_s_pytorch_lazydp.py $model_cmd --emb-scale=$emb_scale --num-batches=$iterations --mini-batch-size=$batch_size --use-gpu --num-indices-per-lookup=$num_gathers --num-indices-per-lookup-fixed=True --dpsgd-mode=lazydp --disable-poisson-sampling --system=$system --description=$description --path-lazydp=$PATH_LAZYDP --locality=$locality --path-model-weight=$PATH_MODEL_WEIGHT --noise-rng=philox --ht-device=$ht_device --run-tag=ht_$ht_device
+done
@@ -0,0 +1,34 @@
+#!/bin/bash
+# Hybrid-parallel LazyDP: one rank per GPU, the MLPs data-parallel on the GPUs (gradients summed over the
+# ranks under the reweighted clipping of the second backward), the embedding tables in the CPU DRAM split
+# over all the ranks of all the nodes (--dist-table-split=rows). The pooled embeddings of a rank's tables
+# and their gradients go through the alltoall (nccl), and only the owner of a table derives its HT, its
+# delayed noise and its update, on its share of the cores of the host (--split-cpus-per-local-rank).
+# Run on every node with its index, with the address of node 0 as MASTER_ADDR, e.g. on 2 nodes of 8 GPUs:
+#   MASTER_ADDR=node0 ./run_hybrid.sh 2 8 0    (on node0)
+#   MASTER_ADDR=node0 ./run_hybrid.sh 2 8 1    (on node1)
+# Each rank merges its stage timings into $PATH_LAZYDP/result/merged_result/<description>.csv
+
+n_nodes=${1:-1}
+gpus_per_node=${2:-8}
+node_rank=${3:-0}
+description=${4:-"hybrid"}
+system="cpu_gpu"
+iterations=30
+emb_scale=1
+batch_size=16384
+num_gathers=1
+locality="uniform"
+pool_cpus=${POOL_CPUS:-"16-111"} # the cores of the host, split over its ranks
+torch_cpus=${TORCH_CPUS:-"0-15"}
+
+# MLPerf DLRM training configuration
+model_config="mlperf"
+arch_emb_size="39884406-39043-17289-7420-20263-3-7120-1543-63-38532951-2953546-403346-10-2208-11938-155-4-976-14-39979771-25641295-39664984-585935-12972-108-36"
+arch_mlp_bot="13-512-256-128"
+arch_mlp_top="1024-1024-512-256-1"
+arch_sparse_feature_size=128
+model_cmd="--model-config=$model_config --arch-sparse-feature-size=$arch_sparse_feature_size --arch-embedding-size=$arch_emb_size --arch-mlp-bot=$arch_mlp_bot --arch-mlp-top=$arch_mlp_top"
+
+torchrun --nnodes=$n_nodes --nproc_per_node=$gpus_per_node --node_rank=$node_rank --master_addr=${MASTER_ADDR:-127.0.0.1} --master_port=${MASTER_PORT:-29500} \
+    ../dlrm/dlrm_s_pytorch_lazydp.py $model_cmd --emb-scale=$emb_scale --num-batches=$iterations --mini-batch-size=$batch_size --use-gpu --num-indices-per-lookup=$num_gathers --num-indices-per-lookup-fixed=True --dpsgd-mode=lazydp --disable-poisson-sampling --system=$system --description=$description --path-lazydp=$PATH_LAZYDP --locality=$locality --path-model-weight=$PATH_MODEL_WEIGHT --noise-rng=philox --dist-backend=nccl --dist-mode=model_parallel --dist-table-split=rows --dist-mlp-allreduce=overlapped --pool-cpus=$pool_cpus --torch-cpus=$torch_cpus --split-cpus-per-local-rank --run-tag=nodes_${n_nodes}_gpus_$gpus_per_node
@@ -0,0 +1,25 @@
+#!/bin/bash
+# Microbenchmark of the custom_api_cpp kernels vs. torch (time, GB/s and speedup per configuration)
+
+description=${1:-"microbench"}
+numactl_use=${2:-1}
+kernels=${3:-"normal-normal_with_extra-unique-coalesce"}
+
+rows_list="1000000-16000000"
+indices_list="4096-262144"
+dim_list="16-64-128-256"
+locality_list="uniform-zipf_1.0-zipf_1.1-zipf_1.2-kaggle_0"
+nthreads_list="8-16-32"
+
+result_path="$PATH_LAZYDP/result"
+if [ -e "$result_path/merged_result/${description}.csv" ]; then
+    rm "$result_path/merged_result/${description}.csv"
+fi
+
+if [ $numactl_use == 1 ] ; then
+    numa_cmd="numactl --cpunodebind=0 --membind=0"
+else
+    numa_cmd=""
+fi
+
+$numa_cmd python microbench_kernels.py --rows-list=$rows_list --indices-list=$indices_list --dim-list=$dim_list --locality-list=$locality_list --nthreads-list=$nthreads_list --kernels=$kernels --path-lazydp=$PATH_LAZYDP --description=$description
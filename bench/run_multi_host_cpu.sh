@@ -0,0 +1,36 @@
+#!/bin/bash
+# Multi-host CPU-only LazyDP: the tables are split over the hosts (--dist-table-split=rows, about the same
+# rows per host), each host runs the HT, the delayed noise and the update of its own tables, and the pooled
+# embeddings and their gradients go through the alltoall of a CPU backend (gloo or MPI).
+# Run on every host with its rank, with the address of rank 0 as MASTER_ADDR, e.g. on 2 hosts:
+#   MASTER_ADDR=host0 ./run_multi_host_cpu.sh 2 0    (on host0)
+#   MASTER_ADDR=host0 ./run_multi_host_cpu.sh 2 1    (on host1)
+# or once through MPI, which gives the ranks: mpirun -np 2 -hosts host0,host1 ./run_multi_host_cpu.sh 2 -1 mpi
+# Each host merges its stage timings into $PATH_LAZYDP/result/merged_result/<description>.csv (a column per rank)
+
+n_hosts=${1:-2}
+rank=${2:--1} # -1: from the MPI launcher
+backend=${3:-gloo} # gloo / mpi
+description=${4:-"multi_host_cpu"}
+system="cpu_only"
+iterations=30
+emb_scale=1
+batch_size=2048
+num_gathers=1
+locality="uniform"
+pool_cpus=${POOL_CPUS:-"8-63"}
+torch_cpus=${TORCH_CPUS:-"0-7"}
+
+if [ $rank -ge 0 ]; then
+    export WORLD_SIZE=$n_hosts RANK=$rank
+fi
+
+# MLPerf DLRM training configuration
+model_config="mlperf"
+arch_emb_size="39884406-39043-17289-7420-20263-3-7120-1543-63-38532951-2953546-403346-10-2208-11938-155-4-976-14-39979771-25641295-39664984-585935-12972-108-36"
+arch_mlp_bot="13-512-256-128"
+arch_mlp_top="1024-1024-512-256-1"
+arch_sparse_feature_size=128
+model_cmd="--model-config=$model_config --arch-sparse-feature-size=$arch_sparse_feature_size --arch-embedding-size=$arch_emb_size --arch-mlp-bot=$arch_mlp_bot --arch-mlp-top=$arch_mlp_top"
+
+python ../dlrm/dlrm_s_pytorch_lazydp.py $model_cmd --emb-scale=$emb_scale --num-batches=$iterations --mini-batch-size=$batch_size --num-indices-per-lookup=$num_gathers --num-indices-per-lookup-fixed=True --dpsgd-mode=lazydp --disable-poisson-sampling --system=$system --description=$description --path-lazydp=$PATH_LAZYDP --locality=$locality --path-model-weight=$PATH_MODEL_WEIGHT --noise-rng=philox --pool-cpus=$pool_cpus --torch-cpus=$torch_cpus --dist-backend=$backend --dist-mode=model_parallel --dist-table-split=rows --run-tag=hosts_$n_hosts
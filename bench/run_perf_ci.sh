@@ -0,0 +1,56 @@
+#!/bin/bash
+# Small-scale performance regression check (CPU-only, emb_scale=0.01, every training mode).
+# The stage timings are written to $PATH_LAZYDP/result/merged_result/<description>.json and compared
+# against perf_ci_baseline.json (perf_ci.py exits with 1 on a regression; "update" stores a new baseline)
+
+description=${1:-"perf_ci"}
+update_baseline=${2:-0}
+tolerance=${3:-0.25} # relative slowdown allowed per stage
+min_ms=${4:-1.0} # stages faster than this are not compared (timer noise)
+
+model_config="mlperf"
+arch_emb_size="39884406-39043-17289-7420-20263-3-7120-1543-63-38532951-2953546-403346-10-2208-11938-155-4-976-14-39979771-25641295-39664984-585935-12972-108-36"
+arch_mlp_bot="13-512-256-128"
+arch_mlp_top="1024-1024-512-256-1"
+arch_sparse_feature_size=128
+model_cmd="--model-config=$model_config --arch-sparse-feature-size=$arch_sparse_feature_size --arch-embedding-size=$arch_emb_size --arch-mlp-bot=$arch_mlp_bot --arch-mlp-top=$arch_mlp_top"
+
+emb_scale=0.01
+batch_size=256
+iterations=20 # the merged result averages the last 10 (LazyDP: all but the last one)
+num_gathers=1
+nthreads=8
+training_mode_list="
+                    sgd
+                    dpsgd_b
+                    dpsgd_r
+                    dpsgd_f
+                    eana
+                    lazydp
+                    "
+
+result_path="$PATH_LAZYDP/result"
+if [ -e "$result_path/merged_result/${description}.csv" ]; then
+    rm "$result_path/merged_result/${description}.csv"
+fi
+model_weight_path=$(mktemp -d)
+
+# no --use-gpu: CPU tensors only, and "events" timing does not synchronize a (missing) device
+common_cmd="$model_cmd --emb-scale=$emb_scale --num-batches=$iterations --mini-batch-size=$batch_size --num-indices-per-lookup=$num_gathers --num-indices-per-lookup-fixed=True --disable-poisson-sampling --system=cpu_gpu --profiler-timing=events --description=$description --path-lazydp=$PATH_LAZYDP --path-model-weight=$model_weight_path"
+
+for training_mode in $training_mode_list
+do
+    if [ $training_mode == "lazydp" ] ; then
+        OMP_NUM_THREADS=$nthreads python ../dlrm/dlrm_s_pytorch_lazydp.py $common_cmd --dpsgd-mode=$training_mode || exit 1
+    else
+        OMP_NUM_THREADS=$nthreads python ../dlrm/dlrm_s_pytorch.py $common_cmd --dpsgd-mode=$training_mode || exit 1
+    fi
+done
+rm -rf $model_weight_path
+
+if [ $update_baseline == 1 ] ; then
+    update_cmd="--update-baseline"
+else
+    update_cmd=""
+fi
+python perf_ci.py --merged-result=$result_path/merged_result/${description}.csv --output=$result_path/merged_result/${description}.json --baseline=perf_ci_baseline.json --tolerance=$tolerance --min-ms=$min_ms $update_cmd
@@ -22,6 +22,7 @@ nsight_use=${3:-0}
 model_config=${4:-"mlperf"} # basic / mlperf / rmc1 / rmc2 / rmc3
 pdb_use=${5:-0}
 locality=${6:-uniform} # uniform / kaggle_n / zipf_f
+malloc=${7:-glibc} # glibc / tbbmalloc (all allocations of the process, preloaded tbbmalloc_proxy)
 
 result_path="$PATH_LAZYDP/result"
 if [ -e "$result_path/merged_result/${description}.csv" ]; then
@@ -75,6 +76,11 @@ else # basic model configuration
 fi
 
 numa_cmd="numactl --cpunodebind=0 --membind=0"
+if [ $malloc == "tbbmalloc" ] ; then
+    malloc_cmd="env LD_PRELOAD=$PATH_LAZYDP/tbb/build/linux_intel64_gcc_cc9.4.0_libc2.27_kernel4.15.0_release/libtbbmalloc_proxy.so.2"
+else
+    malloc_cmd=""
+fi
 
 for batch_size in $batch_size_list
 do
@@ -83,9 +89,9 @@ do
         for training_mode in $training_mode_list
         do
             if [ $training_mode == "lazydp" ] ; then
-                $numa_cmd python $pdb_cmd ../dlrm/dlrm_s_pytorch_lazydp.py $model_cmd --emb-scale=$emb_scale --num-batches=$iterations --mini-batch-size=$batch_size --use-gpu   --num-indices-per-lookup=$num_gathers --num-indices-per-lookup-fixed=True --dpsgd-mode=$training_mode --disable-poisson-sampling --system=$system --description=$description --path-lazydp=$PATH_LAZYDP --locality=$locality --path-model-weight=$PATH_MODEL_WEIGHT
+                $numa_cmd $malloc_cmd python $pdb_cmd ../dlrm/dlrm_s_pytorch_lazydp.py $model_cmd --emb-scale=$emb_scale --num-batches=$iterations --mini-batch-size=$batch_size --use-gpu   --num-indices-per-lookup=$num_gathers --num-indices-per-lookup-fixed=True --dpsgd-mode=$training_mode --disable-poisson-sampling --system=$system --description=$description --path-lazydp=$PATH_LAZYDP --locality=$locality --path-model-weight=$PATH_MODEL_WEIGHT
             else
-                $numa_cmd python $pdb_cmd ../dlrm/dlrm_s_pytorch.py $model_cmd --emb-scale=$emb_scale --num-batches=$iterations --mini-batch-size=$batch_size --use-gpu --num-indices-per-lookup=$num_gathers --num-indices-per-lookup-fixed=True --dpsgd-mode=$training_mode  --disable-poisson-sampling --system=$system --description=$description --path-lazydp=$PATH_LAZYDP --locality=$locality --path-model-weight=$PATH_MODEL_WEIGHT
+                $numa_cmd $malloc_cmd python $pdb_cmd ../dlrm/dlrm_s_pytorch.py $model_cmd --emb-scale=$emb_scale --num-batches=$iterations --mini-batch-size=$batch_size --use-gpu --num-indices-per-lookup=$num_gathers --num-indices-per-lookup-fixed=True --dpsgd-mode=$training_mode  --disable-poisson-sampling --system=$system --description=$description --path-lazydp=$PATH_LAZYDP --locality=$locality --path-model-weight=$PATH_MODEL_WEIGHT
             fi
         done
     done
@@ -0,0 +1,95 @@
+#!/bin/bash
+# Thread scaling of the update sub-stages (coalesce, noise sampling, noisy gradient generation, parameter update)
+# over NUMA placements: every run is a column "<result name>_<placement>_t<threads>" of the merged result,
+# and plot_thread_scaling.py turns them into scaling curves (result/merged_result/<description>_scaling.csv/png)
+
+system="cpu_gpu"
+num_gathers=1
+iterations=30
+batch_size=2048
+emb_scale=1
+
+description=${1:-"thread_scaling"}
+training_mode=${2:-"lazydp"} # dpsgd_b, dpsgd_r, dpsgd_f, eana, lazydp
+locality=${3:-uniform} # uniform / kaggle_n / zipf_f
+malloc=${4:-glibc} # glibc / tbbmalloc (all allocations of the process, preloaded tbbmalloc_proxy)
+
+nthreads_list="
+            4
+            8
+            16
+            24
+            32
+            48
+            64
+            "
+# single: cores and memory of socket 0, interleave: cores of socket 0 with memory interleaved over
+# the sockets, cross: cores of socket 1 with memory of socket 0, partitioned: half of the threads on
+# each socket with the tables split over the sockets (--numa-tables=rows)
+placement_list="
+            single
+            interleave
+            cross
+            partitioned
+            "
+
+result_path="$PATH_LAZYDP/result"
+if [ -e "$result_path/merged_result/${description}.csv" ]; then
+    rm "$result_path/merged_result/${description}.csv"
+fi
+
+# MLPerf DLRM training configuration
+model_config="mlperf"
+arch_emb_size="39884406-39043-17289-7420-20263-3-7120-1543-63-38532951-2953546-403346-10-2208-11938-155-4-976-14-39979771-25641295-39664984-585935-12972-108-36"
+arch_mlp_bot="13-512-256-128"
+arch_mlp_top="1024-1024-512-256-1"
+arch_sparse_feature_size=128
+model_cmd="--model-config=$model_config --arch-sparse-feature-size=$arch_sparse_feature_size --arch-embedding-size=$arch_emb_size --arch-mlp-bot=$arch_mlp_bot --arch-mlp-top=$arch_mlp_top"
+
+# "n" / 2 cores of each of the sockets 0 and 1, as a --pool-cpus list
+socket_cpus() {
+    python3 -c "
+import sys
+n = int(sys.argv[1])
+cpus = []
+for node in range(2):
+    node_cpus = []
+    for token in open('/sys/devices/system/node/node%d/cpulist' % node).read().strip().split(','):
+        first, last = (token.split('-') + [token])[:2]
+        node_cpus += list(range(int(first), int(last) + 1))
+    cpus += node_cpus[:n // 2]
+print(','.join(str(cpu) for cpu in cpus))
+" $1
+}
+
+if [ $malloc == "tbbmalloc" ] ; then
+    malloc_cmd="env LD_PRELOAD=$PATH_LAZYDP/tbb/build/linux_intel64_gcc_cc9.4.0_libc2.27_kernel4.15.0_release/libtbbmalloc_proxy.so.2"
+else
+    malloc_cmd=""
+fi
+
+for placement in $placement_list
+do
+    numa_tables_cmd=""
+    if [ $placement == "single" ] ; then
+        numa_cmd="numactl --cpunodebind=0 --membind=0"
+    elif [ $placement == "interleave" ] ; then
+        numa_cmd="numactl --cpunodebind=0 --interleave=all"
+    elif [ $placement == "cross" ] ; then
+        numa_cmd="numactl --cpunodebind=1 --membind=0"
+    else
+        numa_cmd=""
+    fi
+
+    for nthreads in $nthreads_list
+    do
+        threads_cmd="--coalesce-nthreads=$nthreads --noise-nthreads=$nthreads --unique-nthreads=$nthreads --ht-nthreads=$nthreads"
+        if [ $placement == "partitioned" ] ; then
+            numa_tables_cmd="--numa-tables=rows --pool-cpus=$(socket_cpus $nthreads)"
+        fi
+        # the per-stage thread flags and the run tag are options of the LazyDP driver (all DP-SGD modes)
+        $numa_cmd $malloc_cmd python ../dlrm/dlrm_s_pytorch_lazydp.py $model_cmd $threads_cmd $numa_tables_cmd --run-tag=${placement}_t${nthreads} --emb-scale=$emb_scale --num-batches=$iterations --mini-batch-size=$batch_size --use-gpu --num-indices-per-lookup=$num_gathers --num-indices-per-lookup-fixed=True --dpsgd-mode=$training_mode --disable-poisson-sampling --system=$system --description=$description --path-lazydp=$PATH_LAZYDP --locality=$locality --path-model-weight=$PATH_MODEL_WEIGHT
+    done
+done
+
+python plot_thread_scaling.py --path-lazydp=$PATH_LAZYDP --description=$description
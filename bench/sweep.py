@@ -0,0 +1,76 @@
+import argparse
+import gc
+import importlib
+import os
+import runpy
+import shlex
+import sys
+import time
+import traceback
+
+# Runs the configurations of a sweep back to back in this process instead of one process per configuration,
+# e.g. the loops of run_fig_13_*.sh: the imports, the CUDA context, the worker pools and the access
+# distributions (--access-cache-dir, mapped) are set up once. The raw table files of each cached model are
+# staged once in --table-dir (a tmpfs) and every run maps them copy-on-write (custom_utils.staged_table_files),
+# so a run starts from the pristine tables without reading them and its updates are dropped with the mapping.
+#
+# Each line of --sweep is a command line of the bench scripts, with ${VAR} expanded and "#" comments, e.g.
+#   python ../dlrm/dlrm_s_pytorch_lazydp.py --emb-scale=0.5 --dpsgd-mode=lazydp ...
+# NUMA binding (numactl) applies to the whole sweep: numactl --cpunodebind=0 --membind=0 python sweep.py ...
+parser = argparse.ArgumentParser()
+parser.add_argument("--sweep", type=str, required=True)
+parser.add_argument("--table-dir", type=str, default="/dev/shm/lazydp_sweep")
+parser.add_argument("--stop-on-error", action="store_true", default=False)
+args = parser.parse_args()
+
+sys.path.append(os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+import torch
+import config
+import custom_utils
+
+runs = []
+with open(args.sweep) as f:
+    for line in f:
+        tokens = shlex.split(os.path.expandvars(line), comments=True)
+        if len(tokens) == 0:
+            continue
+        if tokens[0].startswith("python"):
+            tokens = tokens[1:]
+        runs.append(tokens)
+
+failed = []
+start = time.time()
+for k, tokens in enumerate(runs):
+    script = os.path.abspath(tokens[0])
+    # the flags of a run are set on a fresh config, the script itself runs in a fresh namespace as __main__
+    importlib.reload(config)
+    config.sweep_table_dir = args.table_dir
+    sys.argv = [script] + tokens[1:]
+    sys.path.insert(0, os.path.dirname(script))
+    run_start = time.time()
+    print(">> Sweep %d/%d: %s" % (k + 1, len(runs), " ".join(tokens)), flush=True)
+    error = None
+    try:
+        runpy.run_path(script, run_name="__main__")
+    except SystemExit as exit:
+        error = exit if exit.code not in [None, 0] else None
+    except Exception as exception:
+        error = exception
+        traceback.print_exc()
+    finally:
+        sys.path.remove(os.path.dirname(script))
+        gc.collect()
+        if torch.cuda.is_available():
+            torch.cuda.empty_cache()
+    print(">> Sweep %d/%d %s in %.1f s" % (k + 1, len(runs), "failed" if error is not None else "done", time.time() - run_start), flush=True)
+    if error is not None:
+        failed.append(k + 1)
+        if args.stop_on_error:
+            break
+
+for stage in custom_utils.staged_models.values():
+    for name in os.listdir(args.table_dir):
+        if name.startswith(os.path.basename(stage) + ".emb"):
+            os.remove(os.path.join(args.table_dir, name))
+print(">> Sweep of %d runs in %.1f min, failed: %s" % (len(runs), (time.time() - start) / 60, failed if failed else "none"))
+sys.exit(1 if failed else 0)
@@ -0,0 +1,115 @@
+import argparse
+import json
+import os
+import socketserver
+import sys
+import threading
+import time
+
+# Resident server of the initial embedding tables: the raw table files of each cached model (the key is the
+# model path, i.e., model_config, emb_scale and the QR/MD tricks) are staged once in --dir, a tmpfs
+# (/dev/shm) or a hugetlbfs mount, and the training / benchmark processes given --table-server=<socket>
+# map them copy-on-write (custom_utils.served_table_files). A process then starts without reading the
+# tables and only pays for the pages it modifies (the touched rows under LazyDP), and concurrent processes
+# of the same model (seeds, configurations) share one physical copy.
+#
+# A model is held while a connection that requested it is open, and the models no process holds are
+# removed (least recently used first) when staging another one would exceed --capacity-gb.
+parser = argparse.ArgumentParser()
+parser.add_argument("--socket", type=str, default="/dev/shm/lazydp_table_server.sock")
+parser.add_argument("--dir", type=str, default="/dev/shm/lazydp_tables")
+parser.add_argument("--capacity-gb", type=float, default=0) # 0: no limit
+args = parser.parse_args()
+
+sys.path.append(os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+from custom_utils import copy_table_files
+
+class StagedModel:
+    def __init__(self, stage, n_tables):
+        self.stage = stage
+        self.n_tables = n_tables
+        self.n_bytes = 0
+        self.holders = 0
+        self.last_used = time.time()
+        self.ready = threading.Event()
+        self.failed = False
+
+models = dict() # model path -> StagedModel
+lock = threading.Lock()
+
+def evict(n_bytes):
+    # removes the models no process holds until "n_bytes" more fit in --capacity-gb (called with "lock")
+    if args.capacity_gb <= 0:
+        return
+    capacity = args.capacity_gb * 2**30
+    idle = sorted([(model.last_used, path) for path, model in models.items() if model.holders == 0 and model.ready.is_set()])
+    for _, path in idle:
+        if sum(model.n_bytes for model in models.values()) + n_bytes <= capacity:
+            break
+        model = models.pop(path)
+        for k in range(model.n_tables):
+            os.remove("%s.emb%d" %(model.stage, k))
+        print(">> Removed %s" % path, flush=True)
+
+def acquire(path, n_tables):
+    with lock:
+        model = models.get(path)
+        staging = model is None
+        if staging:
+            n_bytes = sum(os.path.getsize("%s.emb%d" %(path, k)) for k in range(n_tables))
+            evict(n_bytes)
+            model = StagedModel("%s/%s" %(args.dir, os.path.basename(path)), n_tables)
+            model.n_bytes = n_bytes
+            models[path] = model
+        model.holders += 1
+        model.last_used = time.time()
+    if staging:
+        start = time.time()
+        try:
+            copy_table_files(path, model.stage, n_tables)
+            print(">> Staged %s (%.1f GB) in %.1f s" % (path, model.n_bytes / 2**30, time.time() - start), flush=True)
+        except Exception:
+            model.failed = True
+            with lock:
+                models.pop(path)
+        model.ready.set()
+    model.ready.wait()
+    if model.failed:
+        release(model)
+        raise RuntimeError("staging %s failed" % path)
+    return model
+
+def release(model):
+    with lock:
+        model.holders -= 1
+        model.last_used = time.time()
+
+class Handler(socketserver.StreamRequestHandler):
+    def handle(self):
+        held = []
+        try:
+            for line in self.rfile:
+                request = json.loads(line)
+                try:
+                    model = acquire(request["path"], request["n_tables"])
+                except Exception as error:
+                    self.wfile.write((json.dumps({"error": str(error)}) + "\n").encode())
+                    continue
+                held.append(model)
+                self.wfile.write((json.dumps({"stage": model.stage}) + "\n").encode())
+        finally:
+            # the client exited (or closed the connection)
+            for model in held:
+                release(model)
+
+os.makedirs(args.dir, exist_ok=True)
+if os.path.exists(args.socket):
+    os.remove(args.socket)
+server = socketserver.ThreadingUnixStreamServer(args.socket, Handler)
+server.daemon_threads = True
+print(">> Serving the tables of %s on %s" % (args.dir, args.socket), flush=True)
+try:
+    server.serve_forever()
+finally:
+    server.server_close()
+    os.remove(args.socket)
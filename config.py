@@ -14,10 +14,21 @@ num_gathers_list = None
 dpsgd_mode = MODE_DPSGD_B
 batch_size = 4
 cur_batch_size = 4
+cur_num_indices_list = None # number of indices (gradient rows) of each table in the current batch
+dist_batch_slice = None # distributed LazyDP: the samples of the batch in the MLPs and the loss of this rank
+dist_mode = "model_parallel" # distributed LazyDP: model_parallel (tables split over the ranks) / data_parallel (replicated tables)
+dist_sparse_grad = "all_gather" # data-parallel tables: exchange of the sparse gradients, all_gather / alltoallv (by row-range owner)
+dist_mlp_allreduce = "serial" # distributed LazyDP: sum of the MLP gradients, serial (after add_noise) / overlapped (bucketed, during the second backward)
+dist_bucket_mb = 25 # dist_mlp_allreduce == "overlapped": size of a bucket of gradients
+dist_table_split = "count" # model-parallel tables: contiguous tables per rank, count (same number) / rows (about the same rows, e.g., multi-host CPU-only)
+dist_table_rows = None # model-parallel tables: rows of all the tables, split over the ranks by dist_table_split
 data_size = 1
 
 # Device to use
 use_cpu = True # True for cpu-gpu system, False for gpu-only system
+# cpu-only system (LazyDP): tables and MLPs in the host memory (device is the CPU, use_cpu is True), the MLPs
+# in bf16 through oneDNN (mlp_amp, AMX GEMMs where available) on their own cores apart from the worker pool
+cpu_only = False
 device = torch.device('cpu')
 
 # Profiler
@@ -25,11 +36,190 @@ profiler = None
 
 # Customized pytorch functions
 coalesce_nthreads = 32
-coalesce_optimize = "baseline" # "baseline" / "multi_thread_openmp" / "multi_thread_embeddingbag"
+coalesce_optimize = "baseline" # "baseline" / "multi_thread_openmp" / "multi_thread_embeddingbag" / "radix" / "hash" / "hash_unsorted" / "dense" / "auto"
+# when set (custom_utils.CoalesceTuner), the kernel and threads of each table are chosen on the warmup
+# iterations instead of "coalesce_optimize" and "coalesce_nthreads"
+coalesce_tuner = None
+# LazyDP "baseline" update: the coalescing of each table is launched on the inter-op thread pool
+# (custom_api_cpp.coalesce_async) while the noise of the next table is sampled, and waited for at the end
+coalesce_async = False
 
 noise_base_nthreads = 32
 noise_base_optimize = "multi_thread" # "baseline" / "multi_thread"
 noise_final_nthreads = 32 # always execute in multi-threaded manner
+# EANA only: "fused" samples the noise of the tables into their coalesced gradient while coalescing
+# (custom_api_cpp.coalesce_radix_with_noise, noise_rng == "philox", keyed by row instead of position)
+eana_noise_optimize = "baseline" # "baseline" / "fused"
+# DP-SGD(B, R, F) only: "streaming" updates the CPU-resident tables with the dense noise sampled in chunks
+# of rows (custom_api_cpp.dense_noise_sgd_update) instead of a table-sized noise tensor (vanilla SGD)
+dense_noise_optimize = "baseline" # "baseline" / "streaming"
+# "fused": noise, gradient and SGD update of all MLP parameters on the GPU with a single multi-tensor
+# kernel (custom_api_cuda.noise_sgd_update_multi_tensor, Philox keyed by (noise_seed, parameter, element / 4, step))
+mlp_noise_optimize = "baseline" # "baseline" / "fused"
+
+# Random number generator for the noise of CPU-resident tables
+# "torch": per-thread torch generators seeded by rand() (depends on the number of threads)
+# "philox": counter-based generator keyed by (noise_seed, table, row, iteration)
+# "pool": NOT secure, reads the noise from a Gaussian pool of noise_pool_size samples at offsets hashed
+# from (noise_seed, table, row, iteration) (custom_api_cpp.normal_pool_with_extra), the samples overlap
+# and repeat. Only an upper bound of the update speed without the RNG cost, never for private training
+noise_rng = "torch" # "torch" / "philox" / "pool"
+noise_seed = None # None: drawn from torch's default generator
+noise_pool_size = 1 << 24 # power of 2
+
+# LazyDP only: "fused" samples the delayed noise, coalesces the gradient and updates
+# the embedding tables in a single pass (custom_api_cpp.fused_delayed_noise_sgd_update),
+# "merge" merges the delayed noise with the raw gradient into a coalesced gradient directly
+# (custom_api_cpp.merge_noise_and_grad), "batched" is same as "baseline" but processes all
+# tables with a single call of the multi-table kernels (and updates the fp32 CPU tables with one longest-first
+# scheduled call, custom_api_cpp.sparse_sgd_update_multi_table), "sharded" is same as "fused" for all tables
+# at once with their rows split into shards of "shard_rows" rows which run in parallel
+# (custom_api_cpp.sharded_delayed_noise_sgd_update, fp32 tables and ht_optimize == "baseline"), "global" is same
+# as "baseline" with a single call over the global rows of the concatenated tables (emb_layout == "concat"),
+# "graph" is same as "sharded" with per-table nodes of a TBB flow graph (custom_api_cpp.IterationGraph) run
+# by teams of "graph_nthreads" threads, started by the step and waited for by set_HT_increase_cnt_iter(), "engine"
+# is same as "fused" for all tables with a native engine (custom_api_cpp.LazyDPEmbeddingEngine) holding the tables,
+# the HT and the unique rows, called once by set_lS_i() (prepare_next) and once by the step (step)
+delayed_noise_update_optimize = "baseline" # "baseline" / "fused" / "merge" / "batched" / "sharded" / "global" / "graph" / "engine"
+# LazyDP with delayed_noise_update_optimize == "merge" (fp32 CPU tables, vanilla SGD): "rows" keeps the gradient of
+# each table as its rows and values (custom_utils.RowSparseGrad) from the batched bag gradient (emb_backward == "batched")
+# through the merge with the noise (custom_api_cpp.merge_noise_and_grad_rows) to the SGD step (custom_api_cpp.sparse_sgd_update),
+# without building, validating and unpacking the COO tensors of p.grad
+emb_grad_format = "coo" # "coo" / "rows"
+shard_rows = 1 << 20
+graph_nthreads = 4
+# LazyDP with delayed_noise_update_optimize == "fused" (fp32 tables): "fused" also pools the bags of the
+# next batch from each row as soon as it is updated (custom_api_cpp.fused_delayed_noise_sgd_update_and_pool),
+# and the next forward takes these outputs instead of gathering the rows from DRAM again
+update_pool_optimize = "baseline" # "baseline" / "fused"
+# LazyDP under a learning-rate schedule: "prefix_sum" keeps the prefix sums of lr^2 over the iterations,
+# so a row skipped since iteration h takes the delayed noise of variance sum(lr_t^2, t = h+1 ~ cnt_iter) / lr^2
+# of the current lr instead of (cnt_iter - h) iterations, an O(1) lookup per row. "constant" assumes a constant lr
+lr_schedule_noise = "constant" # "constant" / "prefix_sum"
+# LazyDP with vanilla SGD: L2 weight decay of the embedding rows (0 to disable), applied lazily with the HT: a row
+# skipped since iteration h is decayed by (1 - lr*wd)^(cnt_iter - h) when it is next updated, and takes the delayed
+# noise of those iterations decayed accordingly, of variance sum((1 - lr*wd)^(2k), k < cnt_iter - h) iterations
+emb_weight_decay = 0.0
+# LazyDP only: after set_lS_i(), a background thread loads the unique rows of the next iteration (and their
+# HT counters) into the last-level cache while the GPU runs the MLPs (custom_api_cpp.LLCPrefetcher), at most
+# llc_prefetch_bytes of rows, until the update starts
+llc_prefetch = False
+llc_prefetch_bytes = 16 << 20
+# "fused" samples the delayed noise directly from the HT counters (custom_api_cpp.delayed_noise_with_extra),
+# without the std tensor of set_emb_to_noise_update (delayed_noise_update_optimize "baseline"/"merge" with fp32 noise).
+# "grouped" also derives the stds from the HT, but reorders the noise rows by delay so that each delay shared by at
+# least noise_group_min_rows rows is filled with a single scalar std (custom_api_cpp.delayed_noise_grouped_with_extra,
+# delayed_noise_update_optimize "baseline" with the torch generators), and keeps the histogram of the delays
+noise_std_optimize = "baseline" # "baseline" / "fused" / "grouped"
+noise_group_min_rows = 64
+# LazyDP only: per-table counters of the delayed noise (optimizer.stats()): unique rows noised, delayed
+# iterations aggregated, noise elements avoided compared to DP-SGD(F) and the histogram of cnt_iter - HT[row]
+# (the last bin for all delays >= delay_stats_max_delay), saved as "<result_name>_delay_stats.csv" next to
+# the detailed breakdown
+delay_stats = False
+delay_stats_max_delay = 4096
+# LazyDP only: path of a recording of the unique rows of every update, their delays and their lookups
+# (custom_api_cpp.UniqueSetWriter), which bench/replay_update.py replays through the update kernel alone
+record_unique_sets = None
+
+# Precision of the staged delayed noise, only with delayed_noise_update_optimize == "merge"
+# (the noise is upcasted to fp32 when merged with the gradient)
+noise_precision = "fp32" # "fp32" / "bf16" / "fp16"
+
+# LazyDP only (delayed_noise_update_optimize == "fused"): storage precision of the embedding tables.
+# The update is done in fp32 by the fused kernel and rounded once per stored element,
+# stochastically if "stochastic_rounding" is set. "int8" is row-wise int8 with fp32 scale and bias
+# per row (custom_utils.RowwiseInt8Table), requantized only when a row is touched
+emb_precision = "fp32" # "fp32" / "bf16" / "fp16" / "int8"
+stochastic_rounding = False
+
+# cpu-gpu system: DPOptimizer.step() updates the CPU-resident embedding tables in a host worker thread
+# concurrently with the (asynchronous) noise and update of the GPU-resident MLPs
+concurrent_step = False
+
+# LazyDP ("fused" update): step() updates only the rows looked up by the next batch (with their delayed
+# noise), the other rows of the gradient are updated by a worker thread during the next forward pass
+async_emb_update = False
+# LazyDP (delayed_noise_update_optimize == "engine"): step() updates the tables in a worker thread from the
+# smallest to the largest, and the next forward pass looks up each table as soon as its own update is done
+emb_early_release = False
+
+# cpu-gpu system: "pinned" transfers the embedding outputs (and their gradients) packed into a single
+# pinned staging buffer with an asynchronous copy on a dedicated stream (custom_utils.EmbOutputTransfer),
+# "baseline" copies each table's output from pageable memory on the default stream
+emb_transfer = "baseline" # "baseline" / "pinned"
+# "pinned" only: dtype of the embedding outputs and their gradients on the bus, upcast to fp32 on arrival
+# (the per-example norms of the gradients are taken in fp32 on the GPU before the downcast)
+emb_transfer_dtype = "fp32" # "fp32" / "bf16" / "fp16"
+# "pinned" only: per-example norms of the gradients of the embedding outputs (the ghost norms of the
+# CPU-resident nn.EmbeddingBag), "host" by the hooks from the copied gradients, "device" by one reduction
+# over the gradients of all tables on the GPU, kept there for the clipping factors
+emb_ghost_norms = "host" # "host" / "device"
+# lookups of the CPU-resident tables: "per_table" calls F.embedding_bag for each table, "batched" pools
+# all tables with a single call of custom_api_cpp.embedding_bag_multi_table (fp32 tables without a row
+# cache, sum pooling, no per-sample weights), whose outputs are then attached to each EmbeddingBag,
+# "tbe" is same as "batched" with the CPU kernel of FBGEMM's table-batched embeddings over the buffer of
+# emb_layout == "concat" (custom_utils.TBELookup), "dedup" reads each distinct row of a table once per batch:
+# its unique rows are gathered into a compact buffer and the bags are pooled from it through the inverse of
+# the indices (the sets of set_lS_i() with LazyDP and unique_optimize == "multi_thread_inverse"), so the
+# gradient of the table is coalesced over the unique rows by its backward
+emb_forward = "per_table" # "per_table" / "batched" / "tbe" / "dedup"
+emb_forward_nthreads = 32
+# gradients of the CPU-resident tables with clip_backward "cached": "per_table" builds the uncoalesced
+# sparse gradient of each table (coalesced later), "batched" derives the coalesced gradients of all tables
+# with a single call of custom_api_cpp.bag_grad_multi_table
+emb_backward = "per_table" # "per_table" / "batched"
+
+# DP-SGD(F)/LazyDP/EANA: how the clipped summed gradients are derived once the clipping factors are known,
+# "reweight" backpropagates the re-weighted loss sum(losses * clip_factor) a second time,
+# "cached" reuses the activations and backprops captured by the first backward
+# (a single GEMM per nn.Linear weight, fp32 nn.EmbeddingBag tables without GPU cache only),
+# "per_layer" switches to per-layer clipping (max_grad_norm split equally over the parameters), each
+# parameter clipped by its own norm inside the hook of the first backward (same layers as "cached")
+clip_backward = "reweight" # "reweight" / "cached" / "per_layer"
+
+# "dot" interaction of DLRM: "fused" packs the lower triangle of the pairwise dot products (and its backward)
+# with a single CUDA kernel each way (custom_utils.fused_dot_interaction), "baseline" is cat + bmm + gather + cat
+interaction_optimize = "baseline" # "baseline" / "fused"
+
+# LazyDP (cpu_gpu system, fixed batch size): the dense forward, the loss and both backward passes of the MLPs are
+# captured into CUDA graphs once and replayed (custom_utils.DenseStepGraph), the tables run eagerly on the CPU
+cuda_graph = False
+
+# DP-SGD(F)/LazyDP/EANA: the GPU MLPs and the interaction under autocast (custom_utils.mlp_autocast) with fp32
+# master weights; the ghost norms and the clip factors stay fp32, and for "fp16" both backward passes run on the
+# loss scaled by amp_loss_scale (static), which the hooks take out of the backprops and the optimizer out of the gradients
+mlp_amp = "none" # "none" / "bf16" / "fp16"
+amp_loss_scale = 1.0
+
+# DP-SGD(F)/LazyDP/EANA: layers of the MLPs, "dp_linear" is opacus.layers.DPLinear whose own autograd Function
+# derives the ghost norms (one fused kernel on the GPU) without the module hooks of GradSampleModule
+mlp_layer = "linear" # "linear" / "dp_linear"
+
+# DP-SGD(F)/LazyDP/EANA: adaptive clipping (arXiv:1905.03871) on the ghost norms, the threshold starts at
+# max_grad_norm and follows the target quantile of unclipped examples within [adaclip_min_clipbound, max_grad_norm];
+# on the GPU the clip factors and the threshold update are a single kernel (custom_api_cuda.adaptive_clip_factor)
+adaptive_clipping = False
+adaclip_target_unclipped_quantile = 0.5
+adaclip_clipbound_learning_rate = 0.2
+adaclip_unclipped_num_std = 1.0
+adaclip_min_clipbound = 0.01
+
+# LazyDP only: derive unique indices of the next iteration and the stds of their delayed noise
+# in a background worker during forward/backward (custom_api_cpp.NextIterationPrefetcher)
+pipeline_lS_i = False
+
+# LazyDP only: sample the delayed noise into reusable (pinned) double buffers in the background
+# as soon as set_lS_i() knows the rows (custom_api_cpp.NoiseProducer)
+noise_producer = False
+noise_producer_pinned = False # True for pinned memory (cpu-gpu system)
+
+# LazyDP only: background drain of stale delayed noise on spare cores. After each iteration,
+# "noise_drain_rows" rows are scanned and rows whose delay >= "noise_drain_threshold" are settled
+noise_drain = False
+noise_drain_nthreads = 4
+noise_drain_rows = 1 << 20
+noise_drain_threshold = 64 # >= 2
 
 # when this variable sets to 1,
 # 1) add 1 instead of noise
@@ -37,4 +227,136 @@ noise_final_nthreads = 32 # always execute in multi-threaded manner
 is_debugging = False
 debugging_type = "without_noise"
 
-unique_optimize = "baseline" # "baseline" / "multi_thread"
\ No newline at end of file
+# LazyDP History Table (HT): "baseline" holds a torch.int tensor per table,
+# "native" holds all tables in custom_api_cpp.HistoryTable with batched gather/scatter kernels,
+# "inline" is the HT in the entries of the dynamic tables (dynamic_emb_tables), exchanged when the ids of
+# the next batch are mapped to their rows
+ht_nthreads = 32
+ht_optimize = "baseline" # "baseline" / "native" / "inline"
+# "native" only: 32-bit counters, or 16/8-bit delta counters relative to a base iteration per
+# block of rows (blocks which overflow are rebased by flushing their delayed noise)
+ht_bits = 32 # 32 / 16 / 8
+# "native" with 16/8-bit counters only: two-level HT for tables whose rows are clustered by their accesses
+# (reorder_rows): the last iteration and the lagging rows of each group of 64 rows, plus the lag of these rows
+ht_blocked = False
+# "native" with 32-bit counters only: the rows of the last iteration of each table are held in a bitmap (hot set),
+# so rows accessed in consecutive iterations take delay 1 without reading the HT, and their counters are only
+# written when they are not accessed again
+ht_hot_set = False
+# Tables of at most dense_emb_rows rows (e.g., the tables of 3 ~ 108 rows of the MLPerf Criteo config) are dense
+# parameters next to the MLPs (DLRM_Net.dense_emb_l): dense gradient and noise every iteration like the MLPs,
+# without the unique, the HT and the coalescing of the tables. 0 to disable
+dense_emb_rows = 0
+# cpu_gpu system, "baseline" HT only: "gpu" keeps the HT in HBM with the derivation of the delays and the
+# noise of the next rows (custom_api_cuda), the noise rows are shipped to the CPU for the update of the tables
+ht_device = "cpu" # "cpu" / "gpu"
+# cpu_gpu system, LazyDP only: "auto" moves the tables of the largest predicted saving per byte into HBM
+# (custom_utils.place_emb_tables) within placement_hbm_bytes, the others stay in the CPU DRAM. The time of a
+# table is predicted from the bytes of its lookup, noise and update per iteration over the bandwidths below,
+# plus the transfer of its outputs and gradients over PCIe when it is in the CPU DRAM
+# "managed" allocates every table in CUDA Unified Memory instead (custom_utils.move_emb_to_managed_memory), the
+# pages being migrated by the driver (HBM can be oversubscribed): the rows of the next batch (lS_i_nxt) are
+# prefetched to HBM by groups of um_group_bytes, and every um_advise_interval iterations the groups touched in
+# the last um_hot_window iterations (by their HT, the most recent first within placement_hbm_bytes) prefer HBM,
+# the others the CPU DRAM, where the GPU reads them over PCIe
+table_placement = "none" # "none" / "auto" / "managed"
+placement_hbm_bytes = 0 # 0: half of the free HBM
+um_group_bytes = 65536
+um_advise_interval = 100
+um_hot_window = 100
+placement_cpu_bw = 100e9 # bytes/s
+placement_gpu_bw = 1000e9
+placement_pcie_bw = 16e9
+
+# backing of the embedding tables, the HT and the optimizer state of the embedding tables (CPU only):
+# "thp" for transparent huge pages (madvise), "hugetlb" for pre-reserved huge pages (MAP_HUGETLB)
+huge_pages = "none" # "none" / "thp" / "hugetlb"
+
+# pages of the CPU embedding tables, the HT and the optimizer state touched in parallel before the first
+# iteration (custom_utils.prefault_emb_tables), so that the iterations take no first-touch or major faults:
+# "read" maps them (copy-on-write table files stay shared), "write" also allocates the private pages;
+# mlock_tables then locks them in memory (within RLIMIT_MEMLOCK)
+prefault_tables = "none" # "none" / "read" / "write"
+mlock_tables = False
+
+# NUMA-partitioned tables (custom_utils.home_emb_on_numa_nodes, needs a pinned worker pool over the
+# nodes): "table" homes each table on a node, "rows" also splits the tables of at least
+# "numa_split_rows" rows over the nodes; lookups, noise and updates of a row run on its node
+numa_tables = "none" # "none" / "table" / "rows"
+numa_split_rows = 1000000
+# read-mostly structures replicated on every node of the pinned worker pool (custom_utils.replicate_read_mostly),
+# read by each thread from the copy of its node instead of across the interconnect: the alias tables of the
+# access distributions, and the CPU tables of at most numa_replica_bytes read by the "batched" lookups, whose
+# replicas take the update of every step at its end (custom_utils.sync_numa_replicas)
+numa_replicas = False
+numa_replica_bytes = 4 << 20
+
+# "concat" keeps all tables (of the same dimension) in one buffer with a row offset per table, like the TBE of
+# FBGEMM (custom_utils.concat_emb_tables): the weight of a table is a view of its rows, and its row r is the
+# global row r + offset. LazyDP then derives the unique rows, the HT, the noise and the update of all tables
+# with one call over the global rows (delayed_noise_update_optimize == "global")
+emb_layout = "per_table" # "per_table" / "concat"
+
+# embedding tables are generated in parallel by custom_api_cpp.init_table (first-touched by the filling threads)
+parallel_emb_init = False
+emb_init_seed = 123
+emb_init_nthreads = 32
+# embedding tables are virtual (custom_api_cpp.VirtualTable): the weights of init_table, each row initialized on
+# first access (the rows of a batch before its lookup and its update), so startup is immediate and the memory
+# follows the rows seen. LazyDP or plain SGD only, as any other mode noises every row of every iteration
+virtual_emb_tables = False
+# embedding tables over unbounded id spaces (custom_api_cpp.DynamicEmbeddingTable): the sparse features are raw
+# ids (>= 0), mapped by a hash map per table to the rows of an arena of dynamic_emb_capacity rows; the
+# arguments of the table sizes only set the range of the initial weights. LazyDP keeps the HT inline with
+# the entries of the map (ht_optimize == "inline")
+dynamic_emb_tables = False
+dynamic_emb_capacity = 1 << 22
+# LazyDP eviction of the dynamic tables (DynamicEmbeddingTable.enable_eviction), run on a background thread
+# per table after the ids of each batch are mapped, over dynamic_evict_scan entries of the map: the ids not
+# accessed for more than dynamic_evict_ttl iterations, and the ids accessed less than dynamic_evict_lfu
+# times (decayed by half per scan) while more than dynamic_evict_high_water x capacity rows are live (0
+# disables either). Evicted rows get their delayed noise settled and go to a file per table in
+# dynamic_evict_cold_dir, from which returning ids are restored; None drops them
+dynamic_evict_ttl = 0
+dynamic_evict_lfu = 0
+dynamic_evict_high_water = 0.9
+dynamic_evict_scan = 1 << 16
+dynamic_evict_cold_dir = None
+# LazyDP cold tier of the embedding tables (custom_api_cpp.ColdRowStore), "none" / "bf16" / "int8": blocks of
+# cold_rows_block rows all last accessed (HT) more than cold_rows_min_age iterations ago are packed and their
+# pages released, cold_rows_scan blocks per table and iteration on a background thread; the blocks of the rows
+# of a batch are unpacked before its lookups and update (materialize_emb_rows), the noise applied in fp32
+cold_rows = "none"
+cold_rows_min_age = 1000
+cold_rows_block = 64
+cold_rows_scan = 1 << 14
+cold_rows_nthreads = 4
+
+# synthetic multi-hot sparse features (custom_api_cpp.multi_hot_indices)
+data_gen_nthreads = 32
+# dtype of the sparse features (lS_i, lS_o) from the generators to the lookups, the unique indices
+# and the ("native") HT gathers/scatters. The per-sample gradients, the coalesced gradients and the
+# noise update take int64 (torch sparse tensors are indexed with int64)
+index_dtype = "int64" # "int64" / "int32"
+# LazyDP only: when > 0, the sparse features of the next "batch_queue" batches and their unique indices
+# are prepared by "batch_queue_producers" background threads (custom_api_cpp.BatchQueue)
+batch_queue = 0
+batch_queue_producers = 2
+
+unique_nthreads = 32
+# "multi_thread_inverse" also keeps the inverse mapping and counts of the indices, so that
+# their gradient is coalesced in the next iteration without sorting again (LazyDP only)
+# "sort_plan" keeps the stable sort permutation of the indices and the segment of each unique index
+# (custom_api_cpp.sort_plan), emitted by the producers of batch_queue when enabled, so that their gradient
+# is coalesced in the next iteration by a segmented reduction only (LazyDP only)
+# "multi_thread_batched" processes all tables with a single call (custom_api_cpp.unique_multi_table)
+# "bitmap" sets the indices in a bitmap of the table instead of sorting them, for the tables of up to
+# 8M rows (custom_api_cpp.unique_auto, "multi_thread" for the larger ones)
+unique_optimize = "baseline" # "baseline" / "multi_thread" / "multi_thread_inverse" / "sort_plan" / "multi_thread_batched" / "bitmap"
+
+# in-process sweeps (bench/sweep.py, which sets it after reloading this module for each run): the raw table
+# files of the cached model are staged in this tmpfs directory and mapped copy-on-write by every run
+sweep_table_dir = None
+# socket of the table server (bench/table_server.py): the raw table files of the cached model are staged by
+# the server in /dev/shm or a hugetlbfs and mapped copy-on-write, shared by the processes of the same model
+table_server = None
@@ -9,238 +9,8317 @@
 #include <execution>
 #include <numeric>
 #include <stdlib.h>
+#include <math.h>
+#include <stdint.h>
+#include <memory>
+#include <thread>
+#include <sched.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <dirent.h>
+#include <linux/perf_event.h>
+#include <dlfcn.h>
+#include <mutex>
+#include <map>
+#include <unordered_map>
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <future>
+#include <type_traits>
+#include <ATen/Parallel.h>
+#include "tbb/task_arena.h"
+#include "tbb/task_scheduler_observer.h"
+#include "tbb/global_control.h"
+#include "tbb/flow_graph.h"
+#ifdef LAZYDP_TBBMALLOC
+#include "tbb/scalable_allocator.h"
+#endif
+#ifdef LAZYDP_NVTX
+#include <nvtx3/nvToolsExt.h>
+#endif
+#ifdef LAZYDP_ITT
+#include "ittnotify.h"
+#endif
 
 using namespace at;
 using namespace torch;
 
+// Built with LAZYDP_ISA=portable (setup.py), this module targets a baseline x86-64 (x86-64-v2), and the hot
+// kernels marked ISA_CLONES (noise sampling, pooling, radix coalescing, row updates) are also built for AVX2
+// and AVX-512F, together with their OpenMP regions and the row kernels inlined into them. The clone of each
+// kernel is picked by cpuid when the module is loaded (GNU ifunc), so one build uses the widest vectors of
+// every host. Otherwise (LAZYDP_ISA=native), the whole module is built for the build host (-march=native).
+#ifdef LAZYDP_ISA_CLONES
+#define ISA_CLONES __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define ISA_CLONES
+#endif
+
+// The clones of the hot kernels picked on this host: "avx512f", "avx2" or "default" ("native" for a build
+// for the build host)
+std::string kernel_isa(){
+#ifdef LAZYDP_ISA_CLONES
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx512f")){
+    return "avx512f";
+  }
+  if(__builtin_cpu_supports("avx2")){
+    return "avx2";
+  }
+  return "default";
+#else
+  return "native";
+#endif
+}
+
+
+// Persistent worker pool shared by all kernels of this module.
+// OpenMP keeps the threads of a team alive between parallel regions of the same size, so
+// once init_pool() is called, every kernel runs with the same (pinned) team size and reuses
+// the same threads and their RNG state, regardless of "n_cores" given to each kernel.
+// Kernels are bound with the GIL released, so they may be called concurrently from several Python
+// threads: each call then runs its own team, the generators of the pool are shared between the teams
+// (torch::normal_out locks a generator for each fill), and the other shared state of this module
+// (workspace, scratch pools, NUMA layouts, traces) is guarded by its mutex. init_pool() and
+// seed_generators() keep the GIL and must not run concurrently with kernels, and an object
+// (HistoryTable, the background workers) is used by one thread at a time.
+struct worker_pool{
+  int n_threads = 0; // 0: not initialized, kernels use their own "n_cores"
+  std::vector<torch::Generator> generators; // per-thread RNG state, kept alive across calls
+  std::vector<int> nodes; // NUMA node of the core of each thread (empty if the pool is not pinned)
+};
+worker_pool pool;
+
+// Team size of the kernels called by this thread while a scoped_team is alive (0: none), e.g., the
+// kernels of the nodes of IterationGraph, which run concurrently and split the cores between them
+thread_local int team_override = 0;
+
+inline int pool_threads(int n_cores){
+  if(team_override > 0){
+    return team_override;
+  }
+  return pool.n_threads > 0 ? pool.n_threads : n_cores;
+}
+
+struct scoped_team{
+  int previous;
+
+  scoped_team(int n_threads) : previous(team_override){
+    team_override = n_threads;
+  }
+
+  ~scoped_team(){
+    team_override = previous;
+  }
+};
+
+inline torch::Generator new_generator(){
+  torch::Generator generator = make_generator<CPUGeneratorImpl>();
+  generator.set_current_seed(rand());
+  return generator;
+}
+
+// Generator of the calling OpenMP thread (a new one seeded by rand() if the pool is not initialized)
+inline torch::Generator thread_generator(){
+  int t = omp_get_thread_num();
+  if(t < (int)pool.generators.size()){
+    return pool.generators[t];
+  }
+  return new_generator();
+}
+
+// Seed rand() and the generators of the worker pool from "seed" (DPOptimizer.noise_seed), so that the
+// noise of the torch generators (noise_rng == "torch") replays for the same number of threads. The
+// generators created per call are still claimed in the order the threads reach them: only the Philox
+// noise (noise_rng == "philox") is bit-identical for any number of threads.
+void seed_generators(long int seed){
+  srand((unsigned int)seed);
+  for(int t = 0; t < (int)pool.generators.size(); t++){
+    pool.generators[t].set_current_seed((uint64_t)seed * 0x9E3779B97F4A7C15ULL + t);
+  }
+}
+
+// NUMA node of a core (from sysfs, 0 on a machine without NUMA information)
+int cpu_node(int cpu){
+  for(int node = 0; node < 64; node++){
+    std::string path = "/sys/devices/system/node/node" + std::to_string(node) + "/cpu" + std::to_string(cpu);
+    if(access(path.c_str(), F_OK) == 0){
+      return node;
+    }
+  }
+  return 0;
+}
+
+inline void pin_current_thread(int cpu){
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  CPU_SET(cpu, &cpu_set);
+  int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpu_set);
+  assert(ret == 0);
+}
+
+void init_pool(int n_threads, const std::vector<int> &cpu_list){
+  assert(n_threads > 0);
+  assert(cpu_list.empty() || (int)cpu_list.size() >= n_threads);
+
+  pool.n_threads = n_threads;
+  pool.generators.clear();
+  for(int t = 0; t < n_threads; t++){
+    torch::Generator generator = make_generator<CPUGeneratorImpl>();
+    generator.set_current_seed(rand());
+    pool.generators.push_back(generator);
+  }
+
+  // Pin each thread of the team to its core (e.g., the cores of one NUMA node)
+  if(!cpu_list.empty()){
+    #pragma omp parallel num_threads(n_threads)
+    {
+      pin_current_thread(cpu_list[omp_get_thread_num()]);
+    }
+  }
+  pool.nodes.clear();
+  for(int t = 0; t < (int)cpu_list.size() && t < n_threads; t++){
+    pool.nodes.push_back(cpu_node(cpu_list[t]));
+  }
+}
+
+// NUMA node of each thread of the pool, e.g., to home the rows of the tables on the nodes in use
+std::vector<int> numa_nodes(){
+  return pool.nodes;
+}
+
+// NUMA node of the calling OpenMP thread (-1 if the pool is not pinned)
+inline int thread_node(){
+  int t = omp_get_thread_num();
+  return t < (int)pool.nodes.size() ? pool.nodes[t] : -1;
+}
+
+// Arena of the parallel STL calls of this module (std::execution::par_unseq, backed by the vendored TBB).
+// Without init_tbb_arena() they run in the implicit arena of TBB with a thread per core, on top of the
+// OpenMP team of the worker pool and the intra-op threads of PyTorch. With it, TBB is limited to
+// "n_threads" (global_control) and its workers are pinned to "cpu_list" (one core per arena slot) when
+// they join the arena, so that the three thread pools can be given disjoint cores
+struct tbb_pinning_observer : public tbb::task_scheduler_observer{
+  std::vector<int> cpus;
+
+  tbb_pinning_observer(tbb::task_arena &arena, const std::vector<int> &cpus) : tbb::task_scheduler_observer(arena), cpus(cpus){
+    observe(true);
+  }
+
+  void on_scheduler_entry(bool is_worker) override{
+    int slot = tbb::this_task_arena::current_thread_index();
+    if(is_worker && slot >= 0 && !cpus.empty()){
+      pin_current_thread(cpus[slot % cpus.size()]);
+    }
+  }
+};
+
+struct tbb_setup{
+  std::unique_ptr<tbb::global_control> control;
+  std::unique_ptr<tbb::task_arena> arena;
+  std::unique_ptr<tbb_pinning_observer> observer;
+};
+tbb_setup tbb_pool;
+
+void init_tbb_arena(int n_threads, const std::vector<int> &cpu_list){
+  assert(n_threads > 0);
+  assert(cpu_list.empty() || (int)cpu_list.size() >= n_threads);
+  tbb_pool.observer.reset();
+  tbb_pool.arena.reset();
+  tbb_pool.control = std::make_unique<tbb::global_control>(tbb::global_control::max_allowed_parallelism, n_threads);
+  tbb_pool.arena = std::make_unique<tbb::task_arena>(n_threads);
+  tbb_pool.arena->initialize();
+  tbb_pool.observer = std::make_unique<tbb_pinning_observer>(*tbb_pool.arena, cpu_list);
+}
+
+// Runs "f" (a parallel STL call) in the arena of init_tbb_arena() if any, and returns its result
+template<typename F>
+auto in_tbb_arena(F f) -> decltype(f()){
+  if(tbb_pool.arena == nullptr){
+    return f();
+  }
+  return tbb_pool.arena->execute(f);
+}
+
+// Pins the intra-op threads of PyTorch (at::parallel_for, a separate OpenMP runtime from the one of this
+// module in the PyTorch wheels) to "cpu_list", one core per thread, and sets their number to its size.
+// The calling thread (thread 0 of every team) keeps its affinity, which init_pool() may have set
+void pin_torch_threads(const std::vector<int> &cpu_list){
+  assert(!cpu_list.empty());
+  int n_threads = cpu_list.size();
+  at::set_num_threads(n_threads);
+  at::parallel_for(0, n_threads, 1, [&](int64_t begin, int64_t end){
+    int t = at::get_thread_num();
+    if(t > 0 && t < n_threads){
+      pin_current_thread(cpu_list[t]);
+    }
+  });
+}
+
+
+// NUMA-partitioned tables (e.g., dual-socket servers): numa_home_rows() binds row ranges of a table
+// to NUMA nodes (mbind, pages already touched are migrated) and records the layout of the table, so
+// that the kernels which walk the rows of the table (the lookups of embedding_bag_multi_table, the
+// fused delayed noise update, sparse_sgd_update) hand each block of rows to the threads of the node
+// which homes it (numa_block_queue). The layout is keyed by the data pointer of the table, so a
+// table has to be homed after its final (re-)allocation
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+#ifndef MPOL_MF_MOVE
+#define MPOL_MF_MOVE (1 << 1)
+#endif
+
+struct numa_row_range{
+  long int row_end; // rows [previous row_end, row_end) are homed on "node"
+  int node;
+};
+std::map<const void *, std::vector<numa_row_range>> numa_layouts;
+std::mutex numa_layouts_mutex;
+
+void numa_home_rows(torch::Tensor &tensor, const std::vector<long int> &row_ends, const std::vector<int> &nodes){
+  assert(tensor.is_contiguous() && tensor.dim() >= 1);
+  assert(row_ends.size() == nodes.size() && !row_ends.empty() && row_ends.back() == tensor.sizes()[0]);
+  long int page_bytes = sysconf(_SC_PAGESIZE);
+  long int row_bytes = tensor.numel() / std::max((long int)tensor.sizes()[0], 1L) * tensor.element_size();
+  uintptr_t base = (uintptr_t)tensor.data_ptr();
+  uintptr_t end = base + tensor.sizes()[0] * row_bytes;
+
+  std::vector<numa_row_range> layout;
+  long int row_start = 0;
+  for(int r = 0; r < (int)row_ends.size(); r++){
+    assert(row_ends[r] >= row_start && nodes[r] >= 0 && nodes[r] < 64);
+    // the ranges are rounded down to pages, the last one up to the end of the table, so every page
+    // of the table is bound once (a page across two ranges goes to the first of them)
+    uintptr_t first = (base + row_start * row_bytes) / page_bytes * page_bytes;
+    uintptr_t last = r + 1 < (int)row_ends.size() ? (base + row_ends[r] * row_bytes) / page_bytes * page_bytes : (end + page_bytes - 1) / page_bytes * page_bytes;
+    first = std::max(first, base / page_bytes * page_bytes);
+    if(last > first){
+      unsigned long node_mask = 1UL << nodes[r];
+      long int ret = syscall(SYS_mbind, (void *)first, last - first, MPOL_BIND, &node_mask, sizeof(node_mask) * 8, MPOL_MF_MOVE);
+      assert(ret == 0);
+    }
+    layout.push_back({row_ends[r], nodes[r]});
+    row_start = row_ends[r];
+  }
+  std::lock_guard<std::mutex> lock(numa_layouts_mutex);
+  numa_layouts[tensor.data_ptr()] = layout;
+}
+
+void numa_forget_rows(const torch::Tensor &tensor){
+  std::lock_guard<std::mutex> lock(numa_layouts_mutex);
+  numa_layouts.erase(tensor.data_ptr());
+}
+
+// Layout of a table (nullptr if it is not homed), looked up once per kernel
+const std::vector<numa_row_range> *numa_layout_of(const void *data){
+  std::lock_guard<std::mutex> lock(numa_layouts_mutex);
+  auto it = numa_layouts.find(data);
+  return it == numa_layouts.end() ? nullptr : &it->second;
+}
+
+inline int numa_row_node(const std::vector<numa_row_range> *layout, long int row){
+  if(layout == nullptr){
+    return -1;
+  }
+  auto it = std::upper_bound(layout->begin(), layout->end(), row, [](long int r, const numa_row_range &range){ return r < range.row_end; });
+  return it == layout->end() ? -1 : it->node;
+}
+
+// Blocks of a parallel region claimed dynamically by its threads: a thread takes the blocks homed on
+// its own node first, then the blocks of no node (-1), then steals the blocks of the other nodes once
+// its own are exhausted. Without homed blocks (or an unpinned pool) it is schedule(dynamic, 1)
+struct numa_block_queue{
+  std::vector<std::vector<long int>> blocks; // per node, the blocks of no node last
+  std::unique_ptr<std::atomic<long int>[]> cursors;
+
+  numa_block_queue(const std::vector<int> &block_nodes){
+    int n_nodes = 0;
+    for(int node : pool.nodes){
+      n_nodes = std::max(n_nodes, node + 1);
+    }
+    blocks.resize(n_nodes + 1);
+    for(long int b = 0; b < (long int)block_nodes.size(); b++){
+      int node = block_nodes[b];
+      blocks[node >= 0 && node < n_nodes ? node : n_nodes].push_back(b);
+    }
+    cursors.reset(new std::atomic<long int>[blocks.size()]);
+    for(int q = 0; q < (int)blocks.size(); q++){
+      cursors[q] = 0;
+    }
+  }
+
+  // a block of queue "q", -1 if the queue is exhausted
+  long int claim(int q){
+    if(cursors[q].load(std::memory_order_relaxed) >= (long int)blocks[q].size()){
+      return -1;
+    }
+    long int i = cursors[q].fetch_add(1);
+    return i < (long int)blocks[q].size() ? blocks[q][i] : -1;
+  }
+
+  // next block of the calling thread, -1 once all blocks are claimed
+  long int next(){
+    int shared = blocks.size() - 1;
+    int own = thread_node();
+    own = own >= 0 && own < shared ? own : shared;
+    long int b = claim(own);
+    if(b < 0 && own != shared){
+      b = claim(shared);
+    }
+    for(int q = 0; b < 0 && q < shared; q++){
+      b = q == own ? -1 : claim(q);
+    }
+    return b;
+  }
+};
+
+// Node of each block of a kernel walking the rows of "table": that of the first row of the block
+// ("first_row(b)"), -1 for every block if the table is not homed
+template<typename F>
+std::vector<int> numa_block_nodes(const void *table, long int n_blocks, F first_row){
+  std::vector<int> block_nodes(n_blocks, -1);
+  const std::vector<numa_row_range> *layout = numa_layout_of(table);
+  if(layout != nullptr && !pool.nodes.empty()){
+    for(long int b = 0; b < n_blocks; b++){
+      block_nodes[b] = numa_row_node(layout, first_row(b));
+    }
+  }
+  return block_nodes;
+}
+
+
+// Accounting of the memory held by this module (memory_stats()), per category: the huge-page backed
+// tensors (tables and optimizer state), the native HT, the pooled workspace buffers and scratch
+// vectors, the slots of NoiseProducer and the per-node replicas of numa_replicate(). Each category keeps its current bytes and its high-water
+// mark since the last memory_reset_peak(), e.g., per iteration.
+enum memory_category{MEMORY_HUGE_PAGES, MEMORY_HISTORY_TABLE, MEMORY_WORKSPACE, MEMORY_SCRATCH, MEMORY_NOISE_PRODUCER, MEMORY_NUMA_REPLICAS, MEMORY_N_CATEGORIES};
+const char *MEMORY_CATEGORY_NAMES[MEMORY_N_CATEGORIES] = {"huge_pages", "history_table", "workspace", "scratch", "noise_producer", "numa_replicas"};
+
+struct memory_counter{
+  std::atomic<long int> current{0};
+  std::atomic<long int> peak{0};
+};
+memory_counter memory_counters[MEMORY_N_CATEGORIES];
+
+void memory_account(int category, long int n_bytes){
+  memory_counter &counter = memory_counters[category];
+  long int current = counter.current.fetch_add(n_bytes, std::memory_order_relaxed) + n_bytes;
+  long int peak = counter.peak.load(std::memory_order_relaxed);
+  while(current > peak && !counter.peak.compare_exchange_weak(peak, current, std::memory_order_relaxed)){}
+}
+
+// category -> (current bytes, high-water bytes)
+std::map<std::string, std::pair<long int, long int>> memory_stats(){
+  std::map<std::string, std::pair<long int, long int>> stats;
+  for(int c = 0; c < MEMORY_N_CATEGORIES; c++){
+    stats[MEMORY_CATEGORY_NAMES[c]] = std::make_pair(memory_counters[c].current.load(), memory_counters[c].peak.load());
+  }
+  return stats;
+}
+
+void memory_reset_peak(){
+  for(int c = 0; c < MEMORY_N_CATEGORIES; c++){
+    memory_counters[c].peak.store(memory_counters[c].current.load());
+  }
+}
+
+
+// Workspace of the per-iteration temporaries (noise buffers, unique/coalesce outputs and their
+// staging vectors). Their sizes are almost the same across iterations (cur_batch_size * num_gathers
+// of each table), so buffers are kept alive and reused once they are released, and the steady state
+// does no malloc/free and touches no new pages. Buffers are pooled per slot (a call site) by size,
+// so the tables of different sizes get their own buffers.
+const int WORKSPACE_MAX_BUFFERS = 64; // per slot, larger working sets are allocated as usual
+const long int WORKSPACE_MIN_NUMEL = 4096; // smaller temporaries are not worth pooling
+
+struct workspace_pool{
+  std::mutex mutex;
+  std::map<std::pair<std::string, int>, std::vector<torch::Tensor>> buffers; // (slot, dtype) -> buffers
+};
+workspace_pool workspace;
+
+// An uninitialized tensor of "sizes" viewing a pooled buffer. A buffer is free when no tensor
+// views it anymore (only the pool holds its storage); the smallest free one which fits is reused
+torch::Tensor workspace_empty(const std::string &slot, at::IntArrayRef sizes, ScalarType type){
+  long int numel = 1;
+  for(long int size : sizes){
+    numel *= size;
+  }
+  if(numel < WORKSPACE_MIN_NUMEL){
+    return torch::empty(sizes, type);
+  }
+
+  std::lock_guard<std::mutex> lock(workspace.mutex);
+  std::vector<torch::Tensor> &buffers = workspace.buffers[std::make_pair(slot, (int)type)];
+  torch::Tensor *best = nullptr;
+  for(torch::Tensor &buffer : buffers){
+    if(buffer.storage().use_count() == 1 && buffer.numel() >= numel && buffer.numel() <= 2 * numel){
+      if(best == nullptr || buffer.numel() < best->numel()){
+        best = &buffer;
+      }
+    }
+  }
+  if(best == nullptr){
+    // 1/8 headroom for the iterations with a few more indices (e.g., Poisson sampling)
+    torch::Tensor buffer = torch::empty({numel + numel / 8}, type);
+    if((int)buffers.size() >= WORKSPACE_MAX_BUFFERS){
+      return buffer.narrow(0, 0, numel).view(sizes);
+    }
+    buffers.push_back(buffer);
+    memory_account(MEMORY_WORKSPACE, buffer.numel() * buffer.element_size());
+    best = &buffers.back();
+  }
+  return best->narrow(0, 0, numel).view(sizes);
+}
+
+// Free all pooled buffers (the ones in use are freed with their last view)
+void workspace_release(){
+  std::lock_guard<std::mutex> lock(workspace.mutex);
+  for(auto &slot : workspace.buffers){
+    for(torch::Tensor &buffer : slot.second){
+      memory_account(MEMORY_WORKSPACE, -buffer.numel() * buffer.element_size());
+    }
+  }
+  workspace.buffers.clear();
+}
+
+// Allocator of the containers that the kernels create per call and per thread (hash maps of coalesce_hash,
+// (index, position) pairs of coalesce_multi_table, noise and row buffers of the update kernels). Built with
+// LAZYDP_TBBMALLOC=1 (setup.py) these come from tbbmalloc, whose per-thread heaps avoid the arena locks and
+// the trimming (madvise) of glibc malloc; otherwise from std::allocator
+#ifdef LAZYDP_TBBMALLOC
+template<typename T> using kernel_allocator = tbb::scalable_allocator<T>;
+#else
+template<typename T> using kernel_allocator = std::allocator<T>;
+#endif
+template<typename T> using kernel_vector = std::vector<T, kernel_allocator<T>>;
+
+// A std::vector leased from the pool of its slot for the scope of a kernel, keeping the capacity
+// of the previous calls. Leasing is thread-safe, e.g., with NextIterationPrefetcher. The capacity
+// is accounted (MEMORY_SCRATCH) when the vector is returned
+template<typename T>
+struct scratch_pool{
+  static std::mutex mutex;
+  static std::map<std::string, std::vector<std::vector<T>>> vectors;
+};
+template<typename T> std::mutex scratch_pool<T>::mutex;
+template<typename T> std::map<std::string, std::vector<std::vector<T>>> scratch_pool<T>::vectors;
+
+template<typename T>
+class scratch_vector{
+public:
+  scratch_vector(const std::string &slot, size_t n) : slot(slot){
+    {
+      std::lock_guard<std::mutex> lock(scratch_pool<T>::mutex);
+      std::vector<std::vector<T>> &free_vectors = scratch_pool<T>::vectors[slot];
+      if(!free_vectors.empty()){
+        vec.swap(free_vectors.back());
+        free_vectors.pop_back();
+      }
+    }
+    leased_bytes = vec.capacity() * sizeof(T);
+    vec.clear();
+    vec.resize(n);
+  }
+
+  ~scratch_vector(){
+    std::lock_guard<std::mutex> lock(scratch_pool<T>::mutex);
+    std::vector<std::vector<T>> &free_vectors = scratch_pool<T>::vectors[slot];
+    long int n_bytes = vec.capacity() * sizeof(T);
+    memory_account(MEMORY_SCRATCH, n_bytes - leased_bytes);
+    if((int)free_vectors.size() < WORKSPACE_MAX_BUFFERS){
+      free_vectors.push_back(std::move(vec));
+    }else{
+      memory_account(MEMORY_SCRATCH, -n_bytes);
+    }
+  }
+
+  std::vector<T> vec;
+
+private:
+  std::string slot;
+  long int leased_bytes;
+};
+
+
+// Native tracing of the hot paths (trace_enable()) exported as Chrome trace / Perfetto JSON (trace_dump()).
+// A scoped_trace records a complete event with the rows processed and the bytes moved into a buffer of
+// its own thread, so recording takes no lock and per-thread busy time shows up as the lanes of the trace.
+// Buffers are only read by trace_dump()/trace_clear(), which must not run concurrently with the kernels.
+// Built with LAZYDP_NVTX=1 (setup.py), each scoped_trace is also an NVTX range of its thread, named as the
+// event, so that Nsight Systems shows the kernels of this module under the stages of LatencyMeter (--nvtx).
+// Without a tool attached, NVTX calls return immediately.
+// Built with LAZYDP_ITT=1 (setup.py), each scoped_trace is also an ITT task of the "LazyDP" domain while
+// itt_enable() is on (--itt), so that the VTune analyses attribute the OpenMP regions to these names.
+struct trace_event{
+  const char *name;
+  int tid;
+  long int start_ns;
+  long int duration_ns;
+  long int rows;
+  long int bytes;
+};
+
+std::atomic<bool> trace_enabled(false);
+std::atomic<int> trace_n_threads(0);
+std::mutex trace_mutex;
+std::vector<std::shared_ptr<std::vector<trace_event>>> trace_buffers;
+
+inline long int trace_now(){
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct thread_trace{
+  int tid;
+  std::shared_ptr<std::vector<trace_event>> events;
+
+  thread_trace() : tid(trace_n_threads++), events(std::make_shared<std::vector<trace_event>>()){
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    trace_buffers.push_back(events);
+  }
+};
+
+inline thread_trace &local_trace(){
+  thread_local thread_trace trace;
+  return trace;
+}
+
+#ifdef LAZYDP_ITT
+std::atomic<bool> itt_enabled(false);
+__itt_domain *itt_domain = __itt_domain_create("LazyDP");
+
+// the string handles of this thread by the (static) names of the events, created once per name
+inline __itt_string_handle *itt_handle(const char *name){
+  thread_local std::map<const char *, __itt_string_handle *> handles;
+  auto it = handles.find(name);
+  if(it == handles.end()){
+    it = handles.emplace(name, __itt_string_handle_create(name)).first;
+  }
+  return it->second;
+}
+#endif
+
+class scoped_trace{
+public:
+  scoped_trace(const char *name, long int rows = 0, long int bytes = 0) : name(name), rows(rows), bytes(bytes), start(trace_enabled.load(std::memory_order_relaxed) ? trace_now() : -1){
+#ifdef LAZYDP_NVTX
+    nvtxRangePushA(name);
+#endif
+#ifdef LAZYDP_ITT
+    itt_begun = itt_enabled.load(std::memory_order_relaxed);
+    if(itt_begun){
+      __itt_task_begin(itt_domain, __itt_null, __itt_null, itt_handle(name));
+    }
+#endif
+  }
+
+  void add(long int more_rows, long int more_bytes){
+    rows += more_rows;
+    bytes += more_bytes;
+  }
+
+  // ends the event before the end of the scope
+  void stop(){
+    if(start >= 0){
+      thread_trace &trace = local_trace();
+      trace.events->push_back({name, trace.tid, start, trace_now() - start, rows, bytes});
+      start = -1;
+    }
+#ifdef LAZYDP_NVTX
+    if(!nvtx_popped){
+      nvtxRangePop();
+      nvtx_popped = true;
+    }
+#endif
+#ifdef LAZYDP_ITT
+    if(itt_begun){
+      __itt_task_end(itt_domain);
+      itt_begun = false;
+    }
+#endif
+  }
+
+  ~scoped_trace(){
+    stop();
+  }
+
+private:
+  const char *name;
+  long int rows;
+  long int bytes;
+  long int start;
+#ifdef LAZYDP_NVTX
+  bool nvtx_popped = false;
+#endif
+#ifdef LAZYDP_ITT
+  bool itt_begun = false;
+#endif
+};
+
+bool nvtx_built(){
+#ifdef LAZYDP_NVTX
+  return true;
+#else
+  return false;
+#endif
+}
+
+// false if this module is not built with LAZYDP_ITT=1
+bool itt_enable(bool enable){
+#ifdef LAZYDP_ITT
+  itt_enabled = enable;
+  return true;
+#else
+  return false;
+#endif
+}
+
+void trace_enable(bool enable){
+  trace_enabled = enable;
+}
+
+void trace_clear(){
+  std::lock_guard<std::mutex> lock(trace_mutex);
+  for(auto &events : trace_buffers){
+    events->clear();
+  }
+}
+
+void trace_dump(const std::string &path){
+  std::lock_guard<std::mutex> lock(trace_mutex);
+  long int origin = -1;
+  for(auto &events : trace_buffers){
+    for(const trace_event &e : *events){
+      origin = origin < 0 ? e.start_ns : std::min(origin, e.start_ns);
+    }
+  }
+  std::ofstream out(path);
+  assert(out.is_open());
+  out << "{\"traceEvents\": [";
+  bool first = true;
+  for(auto &events : trace_buffers){
+    for(const trace_event &e : *events){
+      out << (first ? "\n" : ",\n");
+      out << "{\"name\": \"" << e.name << "\", \"ph\": \"X\", \"pid\": 0, \"tid\": " << e.tid;
+      out << ", \"ts\": " << (e.start_ns - origin) / 1000.0 << ", \"dur\": " << e.duration_ns / 1000.0;
+      out << ", \"args\": {\"rows\": " << e.rows << ", \"bytes\": " << e.bytes;
+      out << ", \"GB/s\": " << (e.duration_ns > 0 ? (double)e.bytes / e.duration_ns : 0.0) << "}}";
+      first = false;
+    }
+  }
+  out << "\n], \"displayTimeUnit\": \"ms\"}\n";
+}
+
+
+// Achievable memory bandwidth (GB/s) of the STREAM triad a[i] = b[i] + s * c[i] over arrays of "n_bytes" in total
+// (first touched by the same threads), the best of a few repetitions. It is the roofline against which
+// the achieved bandwidth of each update stage is reported (LatencyMeter)
+double stream_triad_bandwidth(long int n_bytes, int n_cores){
+  const int n_repeats = 5;
+  long int n = std::max(n_bytes / (3 * (long int)sizeof(double)), 1L);
+  std::unique_ptr<double[]> a(new double[n]);
+  std::unique_ptr<double[]> b(new double[n]);
+  std::unique_ptr<double[]> c(new double[n]);
+  #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(static)
+  for(long int i = 0; i < n; i++){
+    a[i] = 0;
+    b[i] = 1;
+    c[i] = 2;
+  }
+
+  double best = 0;
+  for(int r = 0; r < n_repeats; r++){
+    long int start = trace_now();
+    #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(static)
+    for(long int i = 0; i < n; i++){
+      a[i] = b[i] + 3.0 * c[i];
+    }
+    long int elapsed = std::max(trace_now() - start, 1L);
+    best = std::max(best, 3.0 * n * sizeof(double) / elapsed);
+  }
+  return best;
+}
+
+
+// Hardware performance counters of this process (perf_event_open), read around the stages of LatencyMeter.
+// The core events ("cycles", "instructions", "llc_misses", "dtlb_misses") are opened for every thread that
+// exists at construction with inherit, so the threads created later by them (OpenMP teams, background
+// workers) are counted too, and their sum is read. "mem_read_bytes"/"mem_write_bytes" are the CAS counts of
+// the uncore memory controllers (uncore_imc_* of Intel servers, 64 bytes each) of the whole system, which
+// need perf_event_paranoid <= 0 (or CAP_PERFMON). Events that cannot be opened are dropped (events()).
+// Counts are scaled by enabled / running time when the PMU multiplexes them.
+class PerfCounters{
+public:
+  PerfCounters(const std::vector<std::string> &names){
+    std::vector<int> tids = thread_ids();
+    for(const std::string &name : names){
+      std::vector<int> fds;
+      double scale = 1;
+      if(name == "mem_read_bytes" || name == "mem_write_bytes"){
+        fds = open_uncore_imc(name == "mem_read_bytes" ? 0x03 : 0x0c);
+        scale = 64;
+      }
+      else{
+        uint32_t type;
+        uint64_t config;
+        if(name == "cycles"){
+          type = PERF_TYPE_HARDWARE;
+          config = PERF_COUNT_HW_CPU_CYCLES;
+        }
+        else if(name == "instructions"){
+          type = PERF_TYPE_HARDWARE;
+          config = PERF_COUNT_HW_INSTRUCTIONS;
+        }
+        else if(name == "llc_misses"){
+          type = PERF_TYPE_HARDWARE;
+          config = PERF_COUNT_HW_CACHE_MISSES;
+        }
+        else if(name == "dtlb_misses"){
+          type = PERF_TYPE_HW_CACHE;
+          config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        }
+        else{
+          assert(false);
+        }
+        for(int tid : tids){
+          int fd = open_event(type, config, tid, -1, true);
+          if(fd < 0){
+            close_all(fds);
+            fds.clear();
+            break;
+          }
+          fds.push_back(fd);
+        }
+      }
+      if(fds.empty()){
+        continue;
+      }
+      event_names.push_back(name);
+      event_fds.push_back(fds);
+      scales.push_back(scale);
+    }
+  }
+
+  ~PerfCounters(){
+    for(auto &fds : event_fds){
+      close_all(fds);
+    }
+  }
+
+  std::vector<std::string> events() const{
+    return event_names;
+  }
+
+  // cumulative counts of events() since the construction
+  torch::Tensor read() const{
+    torch::Tensor counts = torch::zeros({(long int)event_fds.size()}, torch::kFloat64);
+    double *counts_ptr = counts.data<double>();
+    for(size_t e = 0; e < event_fds.size(); e++){
+      for(int fd : event_fds[e]){
+        uint64_t value[3]; // value, time enabled, time running
+        if(::read(fd, value, sizeof(value)) != sizeof(value) || value[2] == 0){
+          continue;
+        }
+        counts_ptr[e] += value[0] * ((double)value[1] / value[2]) * scales[e];
+      }
+    }
+    return counts;
+  }
+
+private:
+  static std::vector<int> thread_ids(){
+    std::vector<int> tids;
+    DIR *dir = opendir("/proc/self/task");
+    assert(dir != nullptr);
+    while(struct dirent *entry = readdir(dir)){
+      if(entry->d_name[0] != '.'){
+        tids.push_back(atoi(entry->d_name));
+      }
+    }
+    closedir(dir);
+    return tids;
+  }
+
+  static int open_event(uint32_t type, uint64_t config, int pid, int cpu, bool inherit){
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.inherit = inherit;
+    attr.exclude_kernel = pid >= 0; // the uncore counters have no privilege filter
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return syscall(SYS_perf_event_open, &attr, pid, cpu, -1, 0);
+  }
+
+  // the CAS count event (0x04) with "umask" of every memory controller, on the first CPU of each socket
+  static std::vector<int> open_uncore_imc(int umask){
+    std::vector<int> fds;
+    const std::string root = "/sys/bus/event_source/devices";
+    DIR *dir = opendir(root.c_str());
+    if(dir == nullptr){
+      return fds;
+    }
+    while(struct dirent *entry = readdir(dir)){
+      std::string device = entry->d_name;
+      if(device.rfind("uncore_imc_", 0) != 0 || device.find("free_running") != std::string::npos){
+        continue;
+      }
+      std::ifstream type_file(root + "/" + device + "/type");
+      std::ifstream cpumask_file(root + "/" + device + "/cpumask");
+      uint32_t type;
+      std::string cpumask;
+      if(!(type_file >> type) || !(cpumask_file >> cpumask)){
+        continue;
+      }
+      std::stringstream cpus(cpumask); // "0,28" (one CPU per socket)
+      std::string cpu;
+      while(std::getline(cpus, cpu, ',')){
+        int fd = open_event(type, 0x04 | (umask << 8), -1, atoi(cpu.c_str()), false);
+        if(fd < 0){
+          closedir(dir);
+          close_all(fds);
+          return {};
+        }
+        fds.push_back(fd);
+      }
+    }
+    closedir(dir);
+    return fds;
+  }
+
+  static void close_all(const std::vector<int> &fds){
+    for(int fd : fds){
+      close(fd);
+    }
+  }
+
+  std::vector<std::string> event_names;
+  std::vector<std::vector<int>> event_fds;
+  std::vector<double> scales;
+};
+
+// Energy counters of the machine, read around the stages of LatencyMeter: the RAPL zones of the powercap
+// sysfs (a "package-<k>" zone per socket and its "dram" subzone, readable by root on recent kernels) and
+// the total energy of each GPU from NVML (Volta or later, libnvidia-ml loaded at runtime so that the module
+// does not depend on it). Counters that cannot be read are dropped (domains()). RAPL counters wrap around
+// at max_energy_range_uj and are updated about every millisecond, so stages shorter than that are noisy.
+class EnergyCounters{
+public:
+  EnergyCounters(){
+    const std::string root = "/sys/class/powercap";
+    DIR *dir = opendir(root.c_str());
+    if(dir != nullptr){
+      std::vector<std::string> zones;
+      while(struct dirent *entry = readdir(dir)){
+        std::string zone = entry->d_name;
+        if(zone.rfind("intel-rapl:", 0) == 0){
+          zones.push_back(zone);
+        }
+      }
+      closedir(dir);
+      std::sort(zones.begin(), zones.end());
+      for(const std::string &zone : zones){
+        std::string name;
+        long int range = 0;
+        std::ifstream name_file(root + "/" + zone + "/name");
+        std::ifstream range_file(root + "/" + zone + "/max_energy_range_uj");
+        if(!(name_file >> name) || !(range_file >> range)){
+          continue;
+        }
+        int socket = atoi(zone.c_str() + strlen("intel-rapl:")); // "intel-rapl:<socket>[:<subzone>]"
+        if(name.rfind("package", 0) == 0){
+          name = "cpu_package" + std::to_string(socket);
+        }
+        else if(name == "dram"){
+          name = "dram" + std::to_string(socket);
+        }
+        else{
+          continue; // core / uncore are part of the package
+        }
+        int fd = open((root + "/" + zone + "/energy_uj").c_str(), O_RDONLY);
+        long int value;
+        if(fd < 0 || !read_rapl(fd, value)){
+          if(fd >= 0){
+            close(fd);
+          }
+          continue;
+        }
+        names.push_back(name);
+        rapl.push_back({fd, range, value});
+      }
+    }
+
+    nvml = dlopen("libnvidia-ml.so.1", RTLD_NOW | RTLD_LOCAL);
+    if(nvml != nullptr){
+      auto init = (int (*)())dlsym(nvml, "nvmlInit_v2");
+      auto count = (int (*)(unsigned int *))dlsym(nvml, "nvmlDeviceGetCount_v2");
+      auto handle = (int (*)(unsigned int, void **))dlsym(nvml, "nvmlDeviceGetHandleByIndex_v2");
+      gpu_energy = (int (*)(void *, unsigned long long *))dlsym(nvml, "nvmlDeviceGetTotalEnergyConsumption");
+      unsigned int n_gpus = 0;
+      if(init != nullptr && count != nullptr && handle != nullptr && gpu_energy != nullptr && init() == 0 && count(&n_gpus) == 0){
+        for(unsigned int g = 0; g < n_gpus; g++){
+          void *device;
+          unsigned long long mj;
+          if(handle(g, &device) == 0 && gpu_energy(device, &mj) == 0){
+            names.push_back("gpu" + std::to_string(g));
+            gpus.push_back(device);
+            gpu_origin_mj.push_back(mj);
+            gpu_total_mj.push_back(0);
+          }
+        }
+      }
+    }
+  }
+
+  ~EnergyCounters(){
+    for(rapl_zone &zone : rapl){
+      close(zone.fd);
+    }
+    if(nvml != nullptr){
+      auto shutdown = (int (*)())dlsym(nvml, "nvmlShutdown");
+      if(shutdown != nullptr){
+        shutdown();
+      }
+      dlclose(nvml);
+    }
+  }
+
+  std::vector<std::string> domains() const{
+    return names;
+  }
+
+  // cumulative joules of domains() since the construction
+  torch::Tensor read(){
+    std::lock_guard<std::mutex> lock(mutex);
+    torch::Tensor joules = torch::zeros({(long int)names.size()}, torch::kFloat64);
+    double *joules_ptr = joules.data<double>();
+    size_t d = 0;
+    for(rapl_zone &zone : rapl){
+      long int value;
+      if(read_rapl(zone.fd, value)){
+        zone.total_uj += value >= zone.last_uj ? value - zone.last_uj : value + zone.range_uj - zone.last_uj;
+        zone.last_uj = value;
+      }
+      joules_ptr[d++] = zone.total_uj / 1e6;
+    }
+    for(size_t g = 0; g < gpus.size(); g++){
+      unsigned long long mj;
+      if(gpu_energy(gpus[g], &mj) == 0){
+        gpu_total_mj[g] = mj - gpu_origin_mj[g];
+      }
+      joules_ptr[d++] = gpu_total_mj[g] / 1e3;
+    }
+    return joules;
+  }
+
+private:
+  struct rapl_zone{
+    int fd;
+    long int range_uj;
+    long int last_uj;
+    long int total_uj = 0;
+  };
+
+  static bool read_rapl(int fd, long int &value){
+    char buffer[32];
+    long int n = pread(fd, buffer, sizeof(buffer) - 1, 0);
+    if(n <= 0){
+      return false;
+    }
+    buffer[n] = 0;
+    value = atol(buffer);
+    return true;
+  }
+
+  std::mutex mutex;
+  std::vector<std::string> names; // RAPL zones, then GPUs
+  std::vector<rapl_zone> rapl;
+  void *nvml = nullptr;
+  int (*gpu_energy)(void *, unsigned long long *) = nullptr;
+  std::vector<void *> gpus;
+  std::vector<unsigned long long> gpu_origin_mj;
+  std::vector<unsigned long long> gpu_total_mj;
+};
+
+// Allocation of "n_bytes" for large random-access tensors (embedding tables, HT, optimizer state):
+// "thp" asks for transparent huge pages (madvise(MADV_HUGEPAGE)), "hugetlb" maps pre-reserved huge
+// pages (MAP_HUGETLB, falling back to "thp" when none are available) and "none" is a plain mapping.
+// Pages are zero and are placed by the first touch.
+const long int HUGE_PAGE_BYTES = 2L << 20;
+
+std::shared_ptr<void> huge_page_alloc(long int n_bytes, const std::string &mode, int category = MEMORY_HUGE_PAGES){
+  assert(mode == "none" || mode == "thp" || mode == "hugetlb");
+  long int size = std::max((n_bytes + HUGE_PAGE_BYTES - 1) / HUGE_PAGE_BYTES, 1L) * HUGE_PAGE_BYTES;
+  void *ptr = MAP_FAILED;
+  if(mode == "hugetlb"){
+    ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  }
+  if(ptr == MAP_FAILED){
+    ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(ptr != MAP_FAILED);
+    if(mode != "none"){
+      madvise(ptr, size, MADV_HUGEPAGE);
+    }
+  }
+  memory_account(category, size);
+  return std::shared_ptr<void>(ptr, [size, category](void *p){
+    munmap(p, size);
+    memory_account(category, -size);
+  });
+}
+
+// A tensor of the same shape and dtype with "src" backed by huge_page_alloc(), holding a copy
+// of "src" ("copy" is true) or zeros
+torch::Tensor huge_pages_like(const torch::Tensor &src, const std::string &mode, bool copy){
+  std::shared_ptr<void> allocation = huge_page_alloc(src.numel() * src.element_size(), mode);
+  torch::Tensor output = torch::from_blob(allocation.get(), src.sizes(), [allocation](void *){}, src.options());
+  if(copy){
+    output.copy_(src);
+  }
+  return output;
+}
+
+// Read-mostly structures replicated on every NUMA node of the pool (e.g., dual-socket servers): the alias
+// tables of AliasSampler and the small tables read by every lookup would otherwise sit on the node which
+// first touched them, and the threads of the other nodes would read them across the interconnect.
+// numa_replicate() copies a CPU tensor into an allocation bound (mbind) to each node and records the copies
+// under the data pointer of the tensor, so that the readers read the copy of the node of the calling thread
+// (numa_local()). The tensor itself stays the copy which is written, numa_sync_replicas() copies it into the
+// replicas again (e.g., the small tables after their update)
+struct numa_replica_set{
+  std::vector<std::shared_ptr<void>> allocations;
+  std::vector<void *> by_node; // indexed by node, nullptr for the nodes without a replica
+  long int n_bytes;
+};
+std::map<const void *, numa_replica_set> numa_replicas;
+std::mutex numa_replicas_mutex;
+
+// NUMA node of each CPU (sysfs), read once
+const std::vector<int> &cpu_nodes(){
+  static std::vector<int> nodes = [](){
+    std::vector<int> nodes(std::max(sysconf(_SC_NPROCESSORS_CONF), 1L));
+    for(int cpu = 0; cpu < (int)nodes.size(); cpu++){
+      nodes[cpu] = cpu_node(cpu);
+    }
+    return nodes;
+  }();
+  return nodes;
+}
+
+// NUMA node of the core the calling thread runs on (any thread, e.g., the producers of BatchQueue)
+inline int current_node(){
+  int cpu = sched_getcpu();
+  const std::vector<int> &nodes = cpu_nodes();
+  return cpu >= 0 && cpu < (int)nodes.size() ? nodes[cpu] : -1;
+}
+
+long int numa_replicate(const torch::Tensor &tensor){
+  assert(tensor.device().is_cpu() && tensor.is_contiguous());
+  std::vector<int> nodes = pool.nodes;
+  std::sort(nodes.begin(), nodes.end());
+  nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+  assert(!nodes.empty() && "NUMA replicas need a pinned worker pool");
+  std::unique_lock<std::mutex> lock(numa_replicas_mutex);
+  if(numa_replicas.count(tensor.data_ptr())){
+    // already replicated, e.g., an alias table shared by several tables
+    return nodes.size();
+  }
+  lock.unlock();
+  numa_replica_set replicas;
+  replicas.n_bytes = tensor.numel() * tensor.element_size();
+  replicas.by_node.assign(nodes.back() + 1, nullptr);
+  long int page_bytes = sysconf(_SC_PAGESIZE);
+  for(int node : nodes){
+    assert(node >= 0 && node < 64);
+    std::shared_ptr<void> allocation = huge_page_alloc(replicas.n_bytes, "none", MEMORY_NUMA_REPLICAS);
+    // bound before the first touch, so the copy below places every page on the node
+    long int size = (std::max(replicas.n_bytes, 1L) + page_bytes - 1) / page_bytes * page_bytes;
+    unsigned long node_mask = 1UL << node;
+    long int ret = syscall(SYS_mbind, allocation.get(), size, MPOL_BIND, &node_mask, sizeof(node_mask) * 8, 0);
+    assert(ret == 0);
+    (void)ret;
+    memcpy(allocation.get(), tensor.data_ptr(), replicas.n_bytes);
+    replicas.by_node[node] = allocation.get();
+    replicas.allocations.push_back(allocation);
+  }
+  lock.lock();
+  numa_replicas[tensor.data_ptr()] = replicas;
+  return nodes.size();
+}
+
+void numa_forget_replicas(const torch::Tensor &tensor){
+  std::lock_guard<std::mutex> lock(numa_replicas_mutex);
+  numa_replicas.erase(tensor.data_ptr());
+}
+
+// Replicas of a tensor indexed by node (empty if it is not replicated), looked up once per kernel
+std::vector<void *> numa_replicas_of(const void *data){
+  std::lock_guard<std::mutex> lock(numa_replicas_mutex);
+  auto it = numa_replicas.find(data);
+  return it == numa_replicas.end() ? std::vector<void *>() : it->second.by_node;
+}
+
+// The replica of the node of the calling thread, "data" itself without one
+template<typename T>
+inline const T *numa_local(const std::vector<void *> &replicas, const T *data){
+  if(replicas.empty()){
+    return data;
+  }
+  int node = current_node();
+  return node >= 0 && node < (int)replicas.size() && replicas[node] != nullptr ? (const T *)replicas[node] : data;
+}
+
+const long int NUMA_SYNC_CHUNK = 256L << 10;
+
+// Copies the tensors into their replicas, each chunk of a replica by the threads of its node
+void numa_sync_replicas(const std::vector<torch::Tensor> &tensors, int n_cores){
+  // (source, replica, bytes) of the chunks
+  std::vector<std::tuple<const char *, char *, long int>> chunks;
+  std::vector<int> chunk_nodes;
+  {
+    std::lock_guard<std::mutex> lock(numa_replicas_mutex);
+    for(const torch::Tensor &tensor : tensors){
+      auto it = numa_replicas.find(tensor.data_ptr());
+      assert(it != numa_replicas.end() && it->second.n_bytes == tensor.numel() * tensor.element_size());
+      const char *src = (const char *)tensor.data_ptr();
+      for(int node = 0; node < (int)it->second.by_node.size(); node++){
+        char *dst = (char *)it->second.by_node[node];
+        for(long int start = 0; dst != nullptr && start < it->second.n_bytes; start += NUMA_SYNC_CHUNK){
+          chunks.emplace_back(src + start, dst + start, std::min(NUMA_SYNC_CHUNK, it->second.n_bytes - start));
+          chunk_nodes.push_back(node);
+        }
+      }
+    }
+  }
+  scoped_trace trace("numa_sync_replicas", chunks.size(), (long int)chunks.size() * NUMA_SYNC_CHUNK);
+  numa_block_queue queue(chunk_nodes);
+  #pragma omp parallel num_threads(pool_threads(n_cores))
+  for(long int c = queue.next(); c >= 0; c = queue.next()){
+    memcpy(std::get<1>(chunks[c]), std::get<0>(chunks[c]), std::get<2>(chunks[c]));
+  }
+}
+
+// Parallel prefault of CPU tensors (embedding tables, HT, optimizer state) before the first iteration,
+// whose random rows would otherwise take the first-touch faults (zero fill, THP compaction) or the major
+// faults (file mappings) of their pages during the measured iterations. The tensors are split into
+// PREFAULT_CHUNK chunks which the threads of the pool request with madvise(MADV_WILLNEED) (readahead of a
+// file mapping) and then touch page by page: "write" writes back the byte it reads, so the private pages
+// (anonymous memory, copy-on-write mappings) are allocated as well, "read" only maps them (the pages of a
+// copy-on-write mapping stay shared). With "lock", the chunks are then locked in memory (mlock).
+// Returns the bytes locked, fewer than those of the tensors where mlock failed (e.g., RLIMIT_MEMLOCK)
+const long int PREFAULT_CHUNK = 2L << 20;
+
+long int prefault_tensors(const std::vector<torch::Tensor> &tensors, bool write, bool lock, int n_cores){
+  const uintptr_t page = sysconf(_SC_PAGESIZE);
+  // (start, end) of the chunks, the bytes outside the tensors are never touched
+  std::vector<std::pair<uintptr_t, uintptr_t>> chunks;
+  long int n_bytes = 0;
+  for(const torch::Tensor &tensor : tensors){
+    assert(tensor.device().is_cpu() && tensor.is_contiguous());
+    uintptr_t start = (uintptr_t)tensor.data_ptr();
+    uintptr_t end = start + tensor.numel() * tensor.element_size();
+    for(uintptr_t chunk = start; chunk < end; chunk = (chunk + PREFAULT_CHUNK) / PREFAULT_CHUNK * PREFAULT_CHUNK){
+      chunks.emplace_back(chunk, std::min(end, (chunk + PREFAULT_CHUNK) / PREFAULT_CHUNK * PREFAULT_CHUNK));
+    }
+    n_bytes += end - start;
+  }
+  scoped_trace trace("prefault_tensors", chunks.size(), n_bytes);
+
+  std::atomic<long int> n_locked(0);
+  #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(dynamic,1)
+  for(size_t c = 0; c < chunks.size(); c++){
+    uintptr_t start = chunks[c].first;
+    uintptr_t end = chunks[c].second;
+    uintptr_t aligned = start / page * page;
+    madvise((void *)aligned, end - aligned, MADV_WILLNEED);
+    for(uintptr_t address = start; address < end; address = (address + page) / page * page){
+      volatile char *byte = (volatile char *)address;
+      char value = *byte;
+      if(write){
+        *byte = value;
+      }
+    }
+    if(lock && mlock((void *)aligned, end - aligned) == 0){
+      n_locked += end - start;
+    }
+  }
+  return n_locked.load();
+}
+
+
+// Pooled (sum) lookups of all tables at once into a single (B, T * dim) tensor, i.e., the layout of
+// the concatenated embedding outputs. Each thread owns blocks of bags (contiguous rows of the output)
+// and goes over all tables for them, so a team covers the whole batch instead of one table at a time.
+// The row of the index EMB_PREFETCH_DISTANCE ahead is prefetched while the current one is pooled
+// (the rows of large tables are random DRAM accesses); the pooling loops are vectorized (-march=native).
+const long int EMB_BAG_BLOCK = 32;
+const long int EMB_PREFETCH_DISTANCE = 8;
+
+template<typename index_t>
+ISA_CLONES void embedding_bag_multi_table_into(float *output, const std::vector<torch::Tensor> &weights, const std::vector<torch::Tensor> &indices, const std::vector<torch::Tensor> &offsets, long int batch_size, int dim, int n_cores){
+  int n_tables = weights.size();
+  long int out_dim = (long int)n_tables * dim;
+  long int n_blocks = (batch_size + EMB_BAG_BLOCK - 1) / EMB_BAG_BLOCK;
+
+  // the small tables replicated on every node (numa_replicate) are read from the replica of the thread's node
+  std::vector<std::vector<void *>> replicas(n_tables);
+  for(int t = 0; t < n_tables; t++){
+    replicas[t] = numa_replicas_of(weights[t].data_ptr());
+  }
+
+  // Bags [block * EMB_BAG_BLOCK, +EMB_BAG_BLOCK) of table "t"
+  auto pool_bags = [&](long int block, int t){
+    long int bag_start = block * EMB_BAG_BLOCK;
+    long int bag_end = std::min(bag_start + EMB_BAG_BLOCK, batch_size);
+    const float *weight = numa_local(replicas[t], weights[t].data<float>());
+    const index_t *idx = indices[t].data<index_t>();
+    const index_t *off = offsets[t].data<index_t>();
+    long int n_indices = indices[t].numel();
+    long int last = bag_end < batch_size ? (long int)off[bag_end] : n_indices;
+    long int j = off[bag_start];
+    for(long int b = bag_start; b < bag_end; b++){
+      float *out = output + b * out_dim + (long int)t * dim;
+      #pragma omp simd
+      for(int d = 0; d < dim; d++){
+        out[d] = 0;
+      }
+      long int end = b + 1 < batch_size ? (long int)off[b + 1] : n_indices;
+      for(; j < end; j++){
+        if(j + EMB_PREFETCH_DISTANCE < last){
+          const float *ahead = weight + (long int)idx[j + EMB_PREFETCH_DISTANCE] * dim;
+          for(int d = 0; d < dim; d += 16){ // a cache line of floats
+            __builtin_prefetch(ahead + d);
+          }
+        }
+        const float *row = weight + (long int)idx[j] * dim;
+        #pragma omp simd
+        for(int d = 0; d < dim; d++){
+          out[d] += row[d];
+        }
+      }
+    }
+  };
+
+  // Tables homed on a single node (numa_home_rows) are pooled by the threads of that node, one
+  // (block, table) at a time; tables split over the nodes gather from all of them anyway
+  std::vector<int> table_nodes(n_tables, -1);
+  bool homed = false;
+  for(int t = 0; t < n_tables && !pool.nodes.empty(); t++){
+    const std::vector<numa_row_range> *layout = numa_layout_of(weights[t].data_ptr());
+    if(layout != nullptr){
+      table_nodes[t] = layout->front().node;
+      for(const numa_row_range &range : *layout){
+        table_nodes[t] = range.node == table_nodes[t] ? table_nodes[t] : -1;
+      }
+      homed = true;
+    }
+  }
+  if(homed){
+    std::vector<int> unit_nodes(n_blocks * n_tables);
+    for(long int u = 0; u < n_blocks * n_tables; u++){
+      unit_nodes[u] = table_nodes[u / n_blocks];
+    }
+    numa_block_queue unit_queue(unit_nodes);
+    #pragma omp parallel num_threads(pool_threads(n_cores))
+    for(long int u = unit_queue.next(); u >= 0; u = unit_queue.next()){
+      pool_bags(u % n_blocks, u / n_blocks);
+    }
+    return;
+  }
+
+  #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(dynamic, 1)
+  for(long int block = 0; block < n_blocks; block++){
+    for(int t = 0; t < n_tables; t++){
+      pool_bags(block, t);
+    }
+  }
+}
+
+torch::Tensor embedding_bag_multi_table(const std::vector<torch::Tensor> &weights, const std::vector<torch::Tensor> &indices, const std::vector<torch::Tensor> &offsets, int n_cores){
+  int n_tables = weights.size();
+  assert(n_tables > 0 && (int)indices.size() == n_tables && (int)offsets.size() == n_tables);
+  long int batch_size = offsets[0].numel();
+  int dim = weights[0].sizes()[1];
+  ScalarType index_type = indices[0].scalar_type();
+  assert(index_type == torch::kInt64 || index_type == torch::kInt);
+  for(int t = 0; t < n_tables; t++){
+    assert(weights[t].scalar_type() == torch::kFloat && weights[t].is_contiguous() && weights[t].sizes()[1] == dim);
+    assert(indices[t].scalar_type() == index_type && indices[t].is_contiguous());
+    assert(offsets[t].scalar_type() == index_type && offsets[t].is_contiguous() && offsets[t].numel() == batch_size);
+  }
+
+  torch::Tensor output = torch::empty({batch_size, (long int)n_tables * dim}, torch::kFloat);
+  if(batch_size == 0){
+    return output;
+  }
+  scoped_trace trace("embedding_bag_multi_table", batch_size * n_tables, output.numel() * sizeof(float));
+  if(index_type == torch::kInt){
+    embedding_bag_multi_table_into<int>(output.data<float>(), weights, indices, offsets, batch_size, dim, n_cores);
+  }else{
+    embedding_bag_multi_table_into<long int>(output.data<float>(), weights, indices, offsets, batch_size, dim, n_cores);
+  }
+  return output;
+}
+
+// Pooled lookups of all tables at once like embedding_bag_multi_table, from tables quantized row-wise in
+// the layouts of torch.ops.quantized.embedding_bag_{byte,4bit}_prepack (the serving tables of
+// custom_utils.export_serving_model): an 8-bit row is "dim" uint8 followed by a float scale and bias, a
+// 4-bit row is (dim + 1) / 2 bytes (the even element in the low nibble) followed by a fp16 scale and bias.
+// An element is q * scale + bias, dequantized while the row is accumulated.
+template<typename index_t>
+ISA_CLONES void embedding_bag_rowwise_multi_table_into(float *output, const std::vector<torch::Tensor> &weights, const std::vector<torch::Tensor> &indices, const std::vector<torch::Tensor> &offsets, long int batch_size, int bits, int dim, int n_cores){
+  int n_tables = weights.size();
+  long int out_dim = (long int)n_tables * dim;
+  long int n_blocks = (batch_size + EMB_BAG_BLOCK - 1) / EMB_BAG_BLOCK;
+  long int row_bytes = weights[0].sizes()[1];
+  long int value_bytes = bits == 8 ? dim : (dim + 1) / 2;
+
+  #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(dynamic, 1)
+  for(long int block = 0; block < n_blocks; block++){
+    long int bag_start = block * EMB_BAG_BLOCK;
+    long int bag_end = std::min(bag_start + EMB_BAG_BLOCK, batch_size);
+    for(int t = 0; t < n_tables; t++){
+      const uint8_t *weight = weights[t].data<uint8_t>();
+      const index_t *idx = indices[t].data<index_t>();
+      const index_t *off = offsets[t].data<index_t>();
+      long int n_indices = indices[t].numel();
+      long int last = bag_end < batch_size ? (long int)off[bag_end] : n_indices;
+      long int j = off[bag_start];
+      for(long int b = bag_start; b < bag_end; b++){
+        float *out = output + b * out_dim + (long int)t * dim;
+        #pragma omp simd
+        for(int d = 0; d < dim; d++){
+          out[d] = 0;
+        }
+        long int end = b + 1 < batch_size ? (long int)off[b + 1] : n_indices;
+        for(; j < end; j++){
+          if(j + EMB_PREFETCH_DISTANCE < last){
+            const uint8_t *ahead = weight + (long int)idx[j + EMB_PREFETCH_DISTANCE] * row_bytes;
+            for(long int c = 0; c < row_bytes; c += 64){
+              __builtin_prefetch(ahead + c);
+            }
+          }
+          const uint8_t *row = weight + (long int)idx[j] * row_bytes;
+          if(bits == 8){
+            float scale = ((const float *)(row + value_bytes))[0];
+            float bias = ((const float *)(row + value_bytes))[1];
+            #pragma omp simd
+            for(int d = 0; d < dim; d++){
+              out[d] += row[d] * scale + bias;
+            }
+          }else{
+            float scale = (float)((const at::Half *)(row + value_bytes))[0];
+            float bias = (float)((const at::Half *)(row + value_bytes))[1];
+            #pragma omp simd
+            for(int d = 0; d < dim; d++){
+              out[d] += ((row[d >> 1] >> ((d & 1) << 2)) & 0xf) * scale + bias;
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+torch::Tensor embedding_bag_rowwise_multi_table(const std::vector<torch::Tensor> &weights, const std::vector<torch::Tensor> &indices, const std::vector<torch::Tensor> &offsets, int bits, int dim, int n_cores){
+  int n_tables = weights.size();
+  assert(n_tables > 0 && (int)indices.size() == n_tables && (int)offsets.size() == n_tables);
+  assert(bits == 8 || bits == 4);
+  long int batch_size = offsets[0].numel();
+  long int row_bytes = bits == 8 ? dim + 2 * sizeof(float) : (dim + 1) / 2 + 2 * sizeof(at::Half);
+  ScalarType index_type = indices[0].scalar_type();
+  assert(index_type == torch::kInt64 || index_type == torch::kInt);
+  for(int t = 0; t < n_tables; t++){
+    assert(weights[t].scalar_type() == torch::kByte && weights[t].is_contiguous() && weights[t].sizes()[1] == row_bytes);
+    assert(indices[t].scalar_type() == index_type && indices[t].is_contiguous());
+    assert(offsets[t].scalar_type() == index_type && offsets[t].is_contiguous() && offsets[t].numel() == batch_size);
+  }
+
+  torch::Tensor output = torch::empty({batch_size, (long int)n_tables * dim}, torch::kFloat);
+  if(batch_size == 0){
+    return output;
+  }
+  scoped_trace trace("embedding_bag_rowwise_multi_table", batch_size * n_tables, output.numel() * sizeof(float));
+  if(index_type == torch::kInt){
+    embedding_bag_rowwise_multi_table_into<int>(output.data<float>(), weights, indices, offsets, batch_size, bits, dim, n_cores);
+  }else{
+    embedding_bag_rowwise_multi_table_into<long int>(output.data<float>(), weights, indices, offsets, batch_size, bits, dim, n_cores);
+  }
+  return output;
+}
+
+
+// Row kernels of the coalescing, noise and update loops with the embedding width as a template parameter:
+// for the common widths of dispatch_dim(), the compiler fully unrolls the loop and keeps the row in
+// registers. DIM == 0 is the generic loop over the runtime "dim"
+template<int DIM>
+inline void copy_row(float *__restrict__ out, const float *__restrict__ in, int dim){
+  const int n = DIM > 0 ? DIM : dim;
+  #pragma omp simd
+  for(int k = 0; k < n; k++){
+    out[k] = in[k];
+  }
+}
+
+template<int DIM>
+inline void add_row(float *__restrict__ out, const float *__restrict__ in, int dim){
+  const int n = DIM > 0 ? DIM : dim;
+  #pragma omp simd
+  for(int k = 0; k < n; k++){
+    out[k] += in[k];
+  }
+}
+
+// out += a * in
+template<int DIM>
+inline void axpy_row(float *__restrict__ out, float a, const float *__restrict__ in, int dim){
+  const int n = DIM > 0 ? DIM : dim;
+  #pragma omp simd
+  for(int k = 0; k < n; k++){
+    out[k] += a * in[k];
+  }
+}
+
+template<int DIM>
+inline void scale_row(float *row, float s, int dim){
+  const int n = DIM > 0 ? DIM : dim;
+  #pragma omp simd
+  for(int k = 0; k < n; k++){
+    row[k] *= s;
+  }
+}
+
+// Calls f(std::integral_constant<int, DIM>()) with DIM = dim for 16, 32, 64 and 128, DIM = 0 otherwise
+template<typename F>
+inline void dispatch_dim(int dim, F f){
+  switch(dim){
+    case 16: f(std::integral_constant<int, 16>()); break;
+    case 32: f(std::integral_constant<int, 32>()); break;
+    case 64: f(std::integral_constant<int, 64>()); break;
+    case 128: f(std::integral_constant<int, 128>()); break;
+    default: f(std::integral_constant<int, 0>()); break;
+  }
+}
+
 
 torch::Tensor normal_multi_thread(float std, int n_emb, int dim, int n_cores){
   int unit = n_emb / n_cores;
   int remain = n_emb % n_cores;
 
-  // allocate a memory space for output tensor
-  torch::Tensor output = torch::empty({n_emb, dim}, torch::kFloat);
-  auto output_a = output.accessor<float, 2>();
+  // allocate a memory space for output tensor
+  torch::Tensor output = torch::empty({n_emb, dim}, torch::kFloat);
+  auto output_a = output.accessor<float, 2>();
+
+  #pragma omp parallel for num_threads(pool_threads(n_cores))
+  for(int i = 0; i < n_cores; i++){
+    torch::Generator generator = thread_generator();
+    long int n_chunk_rows = unit + (i == n_cores - 1 ? remain : 0);
+    scoped_trace trace("normal_multi_thread/chunk", n_chunk_rows, n_chunk_rows * dim * sizeof(float));
+    if(i == n_cores - 1 && remain != 0){
+      torch::Tensor output_slice = output.index({torch::indexing::Slice(unit*i, unit*(i+1) + remain)});
+      torch::normal_out(output_slice, 0, std, {unit + remain, dim}, generator);
+    }
+    else{
+      torch::Tensor output_slice = output.index({torch::indexing::Slice(unit*i, unit*(i+1))});
+      torch::normal_out(output_slice, 0, std, {unit, dim}, generator);
+    }
+  }
+  return output;
+}
+
+
+ISA_CLONES torch::Tensor normal_multi_thread_with_extra(const torch::Tensor &std, int dim, int extra, int n_cores){
+  int n_emb = std.sizes()[0]; // dimension of std: (n_emb)
+  int unit = n_emb / n_cores;
+  int remain = n_emb % n_cores;
+
+  // allocate a memory space for output tensor
+  torch::Tensor output = workspace_empty("noise", {n_emb + extra, dim}, torch::kFloat);
+
+  #pragma omp parallel for num_threads(pool_threads(n_cores))
+  for(int i = 0; i < n_cores; i++){
+    torch::Generator generator = thread_generator();
+    long int n_chunk_rows = unit + (i == n_cores - 1 ? remain : 0);
+    scoped_trace trace("normal_multi_thread_with_extra/chunk", n_chunk_rows, n_chunk_rows * dim * sizeof(float));
+    if(i == n_cores - 1 && remain != 0){
+      torch::Tensor output_slice = output.index({torch::indexing::Slice(unit*i, unit*(i+1) + remain)});
+      torch::normal_out(output_slice, 0, 1, {unit + remain, dim}, generator);
+    }
+    else{
+      torch::Tensor output_slice = output.index({torch::indexing::Slice(unit*i, unit*(i+1))});
+      torch::normal_out(output_slice, 0, 1, {unit, dim}, generator);
+    }
+  }
+  // rows scaled by their std in place (no broadcast of std by ATen)
+  scoped_trace scale_trace("normal_multi_thread_with_extra/scale", n_emb, 2L * n_emb * dim * sizeof(float));
+  torch::Tensor std_contiguous = std.contiguous();
+  float *output_ptr = output.data<float>();
+  const float *std_ptr = std_contiguous.data<float>();
+  dispatch_dim(dim, [&](auto D){
+    constexpr int DIM = decltype(D)::value;
+    #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(static)
+    for(int i = 0; i < n_emb; i++){
+      scale_row<DIM>(output_ptr + (long int)i * dim, std_ptr[i], dim);
+    }
+  });
+  return output;
+}
+
+
+// Counter-based Gaussian RNG: Philox4x32-10 (Salmon et al., SC'11) + Box-Muller transform.
+// A row of noise only depends on (seed, table, row, iteration), not on which thread
+// generates it, so the noise is reproducible regardless of the number of threads.
+// Counters are processed in PHILOX_LANES-wide batches so that the compiler can
+// vectorize the rounds and the transform with AVX2/AVX-512.
+const int PHILOX_LANES = 16;
+const uint32_t PHILOX_M0 = 0xD2511F53;
+const uint32_t PHILOX_M1 = 0xCD9E8D57;
+const uint32_t PHILOX_W0 = 0x9E3779B9;
+const uint32_t PHILOX_W1 = 0xBB67AE85;
+
+inline void philox4x32_10(uint32_t (&c)[4][PHILOX_LANES], uint32_t k0, uint32_t k1){
+  for(int round = 0; round < 10; round++){
+    uint32_t rk0 = k0 + round * PHILOX_W0;
+    uint32_t rk1 = k1 + round * PHILOX_W1;
+    #pragma omp simd
+    for(int l = 0; l < PHILOX_LANES; l++){
+      uint64_t p0 = (uint64_t)PHILOX_M0 * c[0][l];
+      uint64_t p1 = (uint64_t)PHILOX_M1 * c[2][l];
+      uint32_t n0 = (uint32_t)(p1 >> 32) ^ c[1][l] ^ rk0;
+      uint32_t n1 = (uint32_t)p1;
+      uint32_t n2 = (uint32_t)(p0 >> 32) ^ c[3][l] ^ rk1;
+      uint32_t n3 = (uint32_t)p0;
+      c[0][l] = n0;
+      c[1][l] = n1;
+      c[2][l] = n2;
+      c[3][l] = n3;
+    }
+  }
+}
+
+// Fill "out[0:dim]" with samples of N(0, scale^2) for a given row
+// key = (seed, table), counter = (column block, row (low), row (high), iteration)
+ISA_CLONES void philox_normal_row(float *out, int dim, float scale, uint32_t seed, uint32_t table, uint64_t row, uint32_t iteration){
+  const float two_pi = 6.283185307179586f;
+  const float inv_2_24 = 1.0f / 16777216.0f;
+  int n_counters = (dim + 3) / 4;
+  uint32_t c[4][PHILOX_LANES];
+  float z[4][PHILOX_LANES];
+
+  for(int base = 0; base < n_counters; base += PHILOX_LANES){
+    for(int l = 0; l < PHILOX_LANES; l++){
+      c[0][l] = base + l;
+      c[1][l] = (uint32_t)row;
+      c[2][l] = (uint32_t)(row >> 32);
+      c[3][l] = iteration;
+    }
+    philox4x32_10(c, seed, table);
+
+    // uniform (0, 1] for log, [0, 1) for angle
+    #pragma omp simd
+    for(int l = 0; l < PHILOX_LANES; l++){
+      float u0 = ((c[0][l] >> 8) + 1.0f) * inv_2_24;
+      float u1 = (c[1][l] >> 8) * inv_2_24;
+      float u2 = ((c[2][l] >> 8) + 1.0f) * inv_2_24;
+      float u3 = (c[3][l] >> 8) * inv_2_24;
+      float r0 = scale * sqrtf(-2.0f * logf(u0));
+      float r1 = scale * sqrtf(-2.0f * logf(u2));
+      z[0][l] = r0 * cosf(two_pi * u1);
+      z[1][l] = r0 * sinf(two_pi * u1);
+      z[2][l] = r1 * cosf(two_pi * u3);
+      z[3][l] = r1 * sinf(two_pi * u3);
+    }
+
+    int n_valid = std::min(PHILOX_LANES, n_counters - base);
+    for(int l = 0; l < n_valid; l++){
+      int col = (base + l) * 4;
+      for(int j = 0; j < 4 && col + j < dim; j++){
+        out[col + j] = z[j][l];
+      }
+    }
+  }
+}
+
+// Secure-mode noise (PrivacyEngine(secure_mode=True)): every element is the sum of 4 samples of
+// N(0, scale^2) divided by 2, the construction of _generate_noise against the floating-point attacks
+// (https://arxiv.org/abs/2107.10138, section 5.1, n = 2). The 4 samples of an element are the 2
+// Box-Muller pairs of one Philox block and are summed in registers, so the output is written once.
+// key = 64-bit seed (drawn from the secure generator), counter = (column, row, table, iteration)
+ISA_CLONES void philox_secure_normal_row(float *out, int dim, float scale, uint64_t seed, uint32_t table, uint32_t row, uint32_t iteration){
+  const float two_pi = 6.283185307179586f;
+  const float inv_2_24 = 1.0f / 16777216.0f;
+  uint32_t c[4][PHILOX_LANES];
+  float z[PHILOX_LANES];
+
+  for(int base = 0; base < dim; base += PHILOX_LANES){
+    for(int l = 0; l < PHILOX_LANES; l++){
+      c[0][l] = base + l;
+      c[1][l] = row;
+      c[2][l] = table;
+      c[3][l] = iteration;
+    }
+    philox4x32_10(c, (uint32_t)seed, (uint32_t)(seed >> 32));
+
+    #pragma omp simd
+    for(int l = 0; l < PHILOX_LANES; l++){
+      float u0 = ((c[0][l] >> 8) + 1.0f) * inv_2_24;
+      float u1 = (c[1][l] >> 8) * inv_2_24;
+      float u2 = ((c[2][l] >> 8) + 1.0f) * inv_2_24;
+      float u3 = (c[3][l] >> 8) * inv_2_24;
+      float r0 = sqrtf(-2.0f * logf(u0));
+      float r1 = sqrtf(-2.0f * logf(u2));
+      z[l] = 0.5f * scale * (r0 * (cosf(two_pi * u1) + sinf(two_pi * u1)) + r1 * (cosf(two_pi * u3) + sinf(two_pi * u3)));
+    }
+
+    int n_valid = std::min(PHILOX_LANES, dim - base);
+    for(int l = 0; l < n_valid; l++){
+      out[base + l] = z[l];
+    }
+  }
+}
+
+// Fill "out[0:dim]" with samples of U[low, high) for a given row, keyed as philox_normal_row
+ISA_CLONES void philox_uniform_row(float *out, int dim, float low, float high, uint32_t seed, uint32_t table, uint64_t row, uint32_t iteration){
+  const float inv_2_24 = 1.0f / 16777216.0f;
+  int n_counters = (dim + 3) / 4;
+  uint32_t c[4][PHILOX_LANES];
+
+  for(int base = 0; base < n_counters; base += PHILOX_LANES){
+    for(int l = 0; l < PHILOX_LANES; l++){
+      c[0][l] = base + l;
+      c[1][l] = (uint32_t)row;
+      c[2][l] = (uint32_t)(row >> 32);
+      c[3][l] = iteration;
+    }
+    philox4x32_10(c, seed, table);
+
+    int n_valid = std::min(PHILOX_LANES, n_counters - base);
+    for(int l = 0; l < n_valid; l++){
+      int col = (base + l) * 4;
+      for(int j = 0; j < 4 && col + j < dim; j++){
+        out[col + j] = low + (high - low) * ((c[j][l] >> 8) * inv_2_24);
+      }
+    }
+  }
+}
+
+// Initial weights of row "i" of an embedding table, U[a, b) or N(a, b^2) when "normal" is true,
+// keyed by (seed, table, row)
+inline void init_table_row(float *row, int dim, bool normal, float a, float b, long int seed, int table, long int i){
+  const uint32_t init_iteration = 0xffffffff; // never used by the noise of an iteration
+  if(normal){
+    philox_normal_row(row, dim, b, seed, table, i, init_iteration);
+    for(int k = 0; k < dim; k++){
+      row[k] += a;
+    }
+  }
+  else{
+    philox_uniform_row(row, dim, a, b, seed, table, i, init_iteration);
+  }
+}
+
+// Initial weights of an embedding table (init_table_row).
+// The pages of the output are not touched by torch::empty, so each page is first touched (and
+// placed on the NUMA node of, e.g., numactl --membind or a pinned pool) by the thread which fills it.
+// Rows are keyed by (seed, table, row), so the weights do not depend on the number of threads.
+torch::Tensor init_table(long int n_rows, int dim, bool normal, float a, float b, long int seed, int table, int n_cores){
+  torch::Tensor weight = torch::empty({n_rows, dim}, torch::kFloat);
+  float *weight_ptr = weight.data<float>();
+
+  #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(static)
+  for(long int i = 0; i < n_rows; i++){
+    init_table_row(weight_ptr + i * dim, dim, normal, a, b, seed, table, i);
+  }
+  return weight;
+}
+
+// Virtual embedding table: the weights of init_table, produced row by row on first access. The weight
+// is a tensor over an anonymous MAP_NORESERVE mapping, whose pages are only committed when written, and a
+// bitmap marks the rows already initialized. Under LazyDP a row which was never accessed was never updated
+// (its HT is 0, so its pending noise is that of every iteration so far), so the rows of a batch only need
+// to be materialized before their first lookup or update (materialize()); startup is immediate and the
+// memory follows the rows seen, in pages. Passes over the whole table (e.g., settling the noise of every
+// row) need materialize_all() first.
+class VirtualTable{
+public:
+  VirtualTable(long int n_rows, int dim, bool normal, float a, float b, long int seed, int table)
+    : n_rows(n_rows), dim(dim), normal(normal), a(a), b(b), seed(seed), table(table), initialized(new std::atomic<uint64_t>[(n_rows + 63) / 64]()){
+    size = std::max(n_rows * dim * (long int)sizeof(float), 1L);
+    void *base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    assert(base != MAP_FAILED);
+    long int n_bytes = size;
+    weight_ = torch::from_blob(base, {n_rows, dim}, [base, n_bytes](void *){ munmap(base, n_bytes); }, torch::kFloat);
+    data = (float *)base;
+  }
+
+  torch::Tensor weight() const{
+    return weight_;
+  }
+
+  long int n_materialized() const{
+    return n_initialized.load();
+  }
+
+  // initializes the rows of "indices" (int32 or int64 tensors, e.g., the bags of a batch)
+  // not initialized yet, and returns their number
+  long int materialize(const std::vector<torch::Tensor> &indices, int n_cores){
+    std::vector<torch::Tensor> inputs;
+    long int n_indices = 0;
+    for(const torch::Tensor &index : indices){
+      inputs.push_back(index.contiguous());
+      n_indices += index.numel();
+    }
+    scoped_trace trace("materialize", n_indices, 0);
+    long int n_rows_before = n_initialized.load();
+    for(const torch::Tensor &input : inputs){
+      if(input.scalar_type() == torch::kInt){
+        materialize_rows(input.data<int>(), input.numel(), n_cores);
+      }
+      else{
+        materialize_rows(input.data<long int>(), input.numel(), n_cores);
+      }
+    }
+    return n_initialized.load() - n_rows_before;
+  }
+
+  // initializes every row not initialized yet (the whole table is committed), and returns their number
+  long int materialize_all(int n_cores){
+    scoped_trace trace("materialize_all", n_rows, n_rows * dim * sizeof(float));
+    std::atomic<long int> count(0);
+    #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(static)
+    for(long int i = 0; i < n_rows; i++){
+      if(claim(i)){
+        count++;
+      }
+    }
+    n_initialized += count.load();
+    return count.load();
+  }
+
+private:
+  long int n_rows;
+  int dim;
+  bool normal;
+  float a, b;
+  long int seed;
+  int table;
+  long int size;
+  std::unique_ptr<std::atomic<uint64_t>[]> initialized;
+  std::atomic<long int> n_initialized{0};
+  torch::Tensor weight_;
+  float *data;
+
+  // initializes row "i" if no other thread did, true if this call did
+  bool claim(long int i){
+    uint64_t bit = 1ULL << (i % 64);
+    if(initialized[i / 64].load(std::memory_order_relaxed) & bit){
+      return false;
+    }
+    if(initialized[i / 64].fetch_or(bit) & bit){
+      return false;
+    }
+    init_table_row(data + i * dim, dim, normal, a, b, seed, table, i);
+    return true;
+  }
+
+  template<typename index_t>
+  void materialize_rows(const index_t *idx, long int n, int n_cores){
+    std::atomic<long int> count(0);
+    #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(static)
+    for(long int j = 0; j < n; j++){
+      assert(idx[j] >= 0 && idx[j] < n_rows);
+      if(claim(idx[j])){
+        count++;
+      }
+    }
+    n_initialized += count.load();
+  }
+};
+
+// Embedding table over an unbounded id space (e.g., raw 64-bit feature ids, not hashed into [0, rows)):
+// an open-addressing hash map (linear probing over 2x "capacity" entries) from the id to its row in an
+// arena of "capacity" rows. Rows are allocated in order of first appearance and initialized as
+// init_table_row keyed by the id, so the weights do not depend on the order of arrival. The arena is the
+// weight of the table (anonymous MAP_NORESERVE mappings, as VirtualTable, for the rows and the entries),
+// so the lookups, the per-sample gradients and the update run on the rows as on a static table.
+// The HT of LazyDP is inline with each entry: prepare_next() maps the ids of the next batch in one probe
+// per id, which also exchanges the HT of the entry with the iteration of the update, so the first probe
+// of an id in the batch yields its unique row and its delay, without a sort or a separate HT array.
+// With enable_eviction(), evict_async() scans a window of the entries on a background thread after the ids
+// of each batch are prepared, and evicts the ids not prepared for more than a TTL of iterations, or whose
+// (decayed) access count is below an LFU threshold while the arena is above a high-water mark. Only ids
+// idle for at least 2 iterations are evicted, so the rows of the batch in flight and of the next batch are
+// never touched; the entries are only mutated by the evictor until the next map() or prepare_next() waits
+// for it, so the map is erased in place by backward shift (no tombstones) and the rows are recycled.
+// Evicted rows get their delayed noise settled (iteration "cnt_iter", keyed as the update) and are appended
+// to a cold tier file, from which they are restored (with HT "cnt_iter") when their id comes back; without
+// a cold tier they are dropped, and a returning id restarts from its initial row with HT 0.
+class DynamicEmbeddingTable{
+public:
+  DynamicEmbeddingTable(long int capacity, int dim, float a, float b, long int seed, int table)
+    : capacity(capacity), dim(dim), a(a), b(b), seed(seed), table(table), row_ids(capacity){
+    assert(capacity > 0 && capacity < (1L << 31));
+    n_buckets = 1;
+    while(n_buckets < 2 * capacity){
+      n_buckets <<= 1;
+    }
+    entries_bytes = n_buckets * sizeof(entry);
+    entries = (entry *)mmap(nullptr, entries_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    assert(entries != MAP_FAILED);
+    long int n_bytes = capacity * dim * sizeof(float);
+    void *base = mmap(nullptr, n_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    assert(base != MAP_FAILED);
+    weight_ = torch::from_blob(base, {capacity, dim}, [base, n_bytes](void *){ munmap(base, n_bytes); }, torch::kFloat);
+    data = (float *)base;
+  }
+
+  ~DynamicEmbeddingTable(){
+    wait_eviction();
+    munmap(entries, entries_bytes);
+    if(cold_fd >= 0){
+      close(cold_fd);
+    }
+  }
+
+  // the ("capacity", "dim") fp32 arena, of which rows [0, n_rows()) are allocated
+  torch::Tensor weight() const{
+    return weight_;
+  }
+
+  long int n_rows() const{
+    return std::min(next_row.load(), capacity);
+  }
+
+  // id of each allocated row, -1 for the rows of evicted ids not reallocated yet
+  torch::Tensor ids(){
+    wait_eviction();
+    return torch::from_blob((void *)row_ids.data(), {n_rows()}, torch::kInt64).clone();
+  }
+
+  // rows of the ids (int64 >= 0), allocated and initialized for the ids seen for the first time; the HT is untouched
+  torch::Tensor map(const torch::Tensor &ids, int n_cores){
+    wait_eviction();
+    torch::Tensor input = ids.contiguous().to(torch::kInt64);
+    const long int *id = input.data<long int>();
+    long int n = input.numel();
+    scoped_trace trace("dynamic_map", n, n * sizeof(long int));
+    torch::Tensor rows = torch::empty(input.sizes(), torch::kInt64);
+    long int *rows_ptr = rows.data<long int>();
+    #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(static)
+    for(long int j = 0; j < n; j++){
+      rows_ptr[j] = row_of(probe(id[j]));
+    }
+    return rows;
+  }
+
+  // (rows of the ids, unique rows) of the next batch, whose delayed noise is added by the update of
+  // iteration "cnt_iter": the HT of every entry becomes "cnt_iter", and delays() are cnt_iter - HT of the
+  // unique rows before (an id never seen has HT 0). The unique rows are in the order of their first ids
+  // per thread, which is the order of the ids with a single thread
+  std::tuple<torch::Tensor, torch::Tensor> prepare_next(const torch::Tensor &ids, int cnt_iter, int n_cores){
+    wait_eviction();
+    torch::Tensor input = ids.contiguous().to(torch::kInt64);
+    const long int *id = input.data<long int>();
+    long int n = input.numel();
+    scoped_trace trace("dynamic_prepare_next", n, n * sizeof(long int));
+    torch::Tensor rows = torch::empty(input.sizes(), torch::kInt64);
+    long int *rows_ptr = rows.data<long int>();
+    int n_threads = pool_threads(n_cores);
+    std::vector<std::vector<long int>> local_rows(n_threads);
+    std::vector<std::vector<int>> local_delays(n_threads);
+    #pragma omp parallel num_threads(n_threads)
+    {
+      int tid = omp_get_thread_num();
+      #pragma omp for schedule(static)
+      for(long int j = 0; j < n; j++){
+        entry &e = probe(id[j]);
+        rows_ptr[j] = row_of(e);
+        e.count.fetch_add(1, std::memory_order_relaxed);
+        // the entry holds HT + 1, 0 for an id never prepared
+        int last = e.last.exchange(cnt_iter + 1);
+        if(last != cnt_iter + 1){
+          local_rows[tid].push_back(rows_ptr[j]);
+          local_delays[tid].push_back(cnt_iter - std::max(last - 1, 0));
+        }
+      }
+    }
+    long int n_unique = 0;
+    for(int t = 0; t < n_threads; t++){
+      n_unique += local_rows[t].size();
+    }
+    torch::Tensor uniques = torch::empty({n_unique}, torch::kInt64);
+    delays_ = torch::empty({n_unique}, torch::kInt32);
+    long int offset = 0;
+    for(int t = 0; t < n_threads; t++){
+      std::copy(local_rows[t].begin(), local_rows[t].end(), uniques.data<long int>() + offset);
+      std::copy(local_delays[t].begin(), local_delays[t].end(), delays_.data<int>() + offset);
+      offset += local_rows[t].size();
+    }
+    iteration_ = cnt_iter;
+    return std::make_tuple(rows, uniques);
+  }
+
+  // delays of the unique rows of the last prepare_next()
+  torch::Tensor delays() const{
+    return delays_;
+  }
+
+  // "cnt_iter" of the last prepare_next()
+  int iteration() const{
+    return iteration_;
+  }
+
+  // evicts the ids idle for more than "ttl" iterations (0: no TTL), and the ids whose access count (halved
+  // each time the evictor scans them) is below "lfu_min_count" while more than "high_water" x capacity rows
+  // are live (0: no LFU), scanning "scan_buckets" entries per evict_async(). Evicted rows are settled with
+  // N(0, (sqrt(delay) * "scale")^2) keyed by ("noise_seed", table, row, cnt_iter) and appended to the file
+  // "cold_path" (empty: dropped)
+  void enable_eviction(int ttl, int lfu_min_count, double high_water, long int scan_buckets, const std::string &cold_path, float scale, long int noise_seed){
+    assert(ttl >= 0 && lfu_min_count >= 0 && ttl + lfu_min_count > 0);
+    assert(high_water >= 0 && high_water <= 1 && scan_buckets > 0);
+    wait_eviction();
+    this->ttl = ttl;
+    this->lfu_min_count = lfu_min_count;
+    this->high_water = high_water;
+    this->scan_buckets = std::min(scan_buckets, n_buckets);
+    this->scale = scale;
+    this->noise_seed = noise_seed;
+    if(!cold_path.empty()){
+      cold_fd = open(cold_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+      assert(cold_fd >= 0);
+    }
+    eviction = true;
+  }
+
+  // starts the eviction of the next window of entries on a background thread, after the prepare_next() of
+  // iteration "cnt_iter" and before its update of learning rate "lr"; a no-op without enable_eviction()
+  void evict_async(int cnt_iter, float lr){
+    if(!eviction){
+      return;
+    }
+    wait_eviction();
+    // the free rows taken by the probes since the last eviction are the last ones
+    free_rows.resize(free_available - std::min(free_taken.load(), free_available));
+    free_available = free_rows.size();
+    free_taken = 0;
+    evictor = std::thread([this, cnt_iter, lr](){ evict(cnt_iter, lr); });
+  }
+
+  // waits for the eviction in flight, if any, and offers its freed rows to the next probes
+  void wait_eviction(){
+    if(evictor.joinable()){
+      evictor.join();
+      free_available = free_rows.size();
+      free_taken = 0;
+    }
+  }
+
+  // counters of the eviction: live rows, evicted ids, rows written to / restored from the cold tier,
+  // bytes of the cold tier file, entries scanned
+  std::map<std::string, long int> eviction_stats(){
+    wait_eviction();
+    return {{"live", n_live.load()}, {"evicted", n_evicted}, {"cold", n_cold}, {"restored", n_restored.load()},
+            {"cold_bytes", cold_end}, {"scanned", n_scanned}};
+  }
+
+private:
+  // key is id + 1 and row is row + 1 once initialized, so that the zero pages of the mapping are empty entries;
+  // count is the access count of the LFU eviction
+  struct entry{
+    std::atomic<uint64_t> key;
+    std::atomic<int> row;
+    std::atomic<int> last;
+    std::atomic<int> count;
+  };
+
+  // record of the cold tier file, followed by the "dim" floats of the row
+  struct cold_record{
+    long int id;
+    long int iteration; // the iteration up to which the noise of the row is settled
+  };
+
+  long int capacity;
+  int dim;
+  float a, b;
+  long int seed;
+  int table;
+  long int n_buckets;
+  long int entries_bytes;
+  entry *entries;
+  std::atomic<long int> next_row{0};
+  std::vector<long int> row_ids;
+  torch::Tensor weight_;
+  float *data;
+  torch::Tensor delays_ = torch::empty({0}, torch::kInt32);
+  int iteration_ = -1;
+  std::atomic<long int> n_live{0};
+
+  // eviction (enable_eviction)
+  bool eviction = false;
+  int ttl = 0;
+  int lfu_min_count = 0;
+  double high_water = 1;
+  long int scan_buckets = 0;
+  float scale = 0;
+  long int noise_seed = 0;
+  std::thread evictor;
+  uint64_t cursor = 0;
+  long int n_evicted = 0;
+  long int n_cold = 0;
+  long int n_scanned = 0;
+  std::atomic<long int> n_restored{0};
+  // rows of evicted ids: the probes take free_rows[free_available - 1 - k] for the k-th free_taken
+  std::vector<long int> free_rows;
+  long int free_available = 0;
+  std::atomic<long int> free_taken{0};
+  // cold tier: id -> (offset of its last record, iteration of the record), only written by the evictor
+  int cold_fd = -1;
+  long int cold_end = 0;
+  std::unordered_map<long int, std::pair<long int, int>> cold_index;
+
+  uint64_t bucket_of(uint64_t key) const{
+    // the finalizer of splitmix64
+    uint64_t h = key * 0x9E3779B97F4A7C15ULL;
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+    return (h ^ (h >> 31)) & (n_buckets - 1);
+  }
+
+  long int allocate_row(){
+    long int k = free_taken.fetch_add(1);
+    if(k < free_available){
+      return free_rows[free_available - 1 - k];
+    }
+    long int row = next_row.fetch_add(1);
+    assert(row < capacity);
+    return row;
+  }
+
+  entry &probe(long int id){
+    assert(id >= 0);
+    uint64_t key = (uint64_t)id + 1;
+    for(uint64_t bucket = bucket_of(key);; bucket = (bucket + 1) & (n_buckets - 1)){
+      entry &e = entries[bucket];
+      uint64_t current = e.key.load(std::memory_order_acquire);
+      if(current == 0 && e.key.compare_exchange_strong(current, key)){
+        // this thread inserted the id: allocate its row, restored from the cold tier or initialized
+        long int row = allocate_row();
+        float *row_ptr = data + row * dim;
+        auto cold = cold_fd >= 0 ? cold_index.find(id) : cold_index.end();
+        if(cold != cold_index.end()){
+          long int n_bytes = dim * sizeof(float);
+          long int n_read = pread(cold_fd, row_ptr, n_bytes, cold->second.first + sizeof(cold_record));
+          assert(n_read == n_bytes);
+          e.last.store(cold->second.second + 1, std::memory_order_relaxed);
+          n_restored++;
+        }
+        else{
+          init_table_row(row_ptr, dim, false, a, b, seed, table, id);
+        }
+        row_ids[row] = id;
+        n_live++;
+        e.row.store(row + 1, std::memory_order_release);
+        return e;
+      }
+      if(current == key){
+        return e;
+      }
+    }
+  }
+
+  // waits for the row of an entry being inserted by another thread
+  long int row_of(entry &e){
+    int row;
+    for(int spin = 0; (row = e.row.load(std::memory_order_acquire)) == 0; spin++){
+      if(spin >= 64){
+        std::this_thread::yield();
+      }
+    }
+    return row - 1;
+  }
+
+  // the eviction of the window of "scan_buckets" entries from the cursor (evictor thread)
+  void evict(int cnt_iter, float lr){
+    scoped_trace trace("dynamic_evict", scan_buckets, 0);
+    long int live_limit = (long int)(high_water * capacity);
+    std::vector<float> noise(dim);
+    for(long int s = 0; s < scan_buckets; s++){
+      entry &e = entries[cursor];
+      uint64_t key = e.key.load(std::memory_order_relaxed);
+      if(key != 0){
+        int delay = cnt_iter - std::max(e.last.load(std::memory_order_relaxed) - 1, 0);
+        int count = e.count.load(std::memory_order_relaxed);
+        bool expired = ttl > 0 && delay > ttl;
+        bool infrequent = lfu_min_count > 0 && count < lfu_min_count && n_live.load() > live_limit;
+        if(delay >= 2 && (expired || infrequent)){
+          evict_entry(e, key - 1, delay, cnt_iter, lr, noise.data());
+          erase(cursor);
+          // the bucket now holds the next entry of its cluster, if any
+          continue;
+        }
+        e.count.store(count >> 1, std::memory_order_relaxed);
+      }
+      cursor = (cursor + 1) & (n_buckets - 1);
+    }
+    n_scanned += scan_buckets;
+  }
+
+  void evict_entry(entry &e, long int id, int delay, int cnt_iter, float lr, float *noise){
+    long int row = e.row.load(std::memory_order_relaxed) - 1;
+    float *row_ptr = data + row * dim;
+    if(cold_fd >= 0){
+      // the noise of iterations HT + 1 ~ cnt_iter, as the update of the row would have added it
+      philox_normal_row(noise, dim, sqrtf((float)delay) * scale, noise_seed, table, row, cnt_iter);
+      #pragma omp simd
+      for(int k = 0; k < dim; k++){
+        row_ptr[k] -= lr * noise[k];
+      }
+      cold_record record = {id, cnt_iter};
+      long int n_bytes = dim * sizeof(float);
+      bool written = pwrite(cold_fd, &record, sizeof(record), cold_end) == (long int)sizeof(record)
+                  && pwrite(cold_fd, row_ptr, n_bytes, cold_end + sizeof(record)) == n_bytes;
+      assert(written);
+      cold_index[id] = std::make_pair(cold_end, cnt_iter);
+      cold_end += sizeof(record) + n_bytes;
+      n_cold++;
+    }
+    row_ids[row] = -1;
+    free_rows.push_back(row);
+    n_live--;
+    n_evicted++;
+  }
+
+  // removes the entry of "bucket", shifting back the entries of its cluster which may take the hole
+  void erase(uint64_t bucket){
+    uint64_t mask = n_buckets - 1;
+    for(uint64_t j = (bucket + 1) & mask;; j = (j + 1) & mask){
+      uint64_t key = entries[j].key.load(std::memory_order_relaxed);
+      if(key == 0){
+        break;
+      }
+      // the entry at j may move to the hole unless its home bucket lies (cyclically) after the hole
+      if(((j - bucket_of(key)) & mask) >= ((j - bucket) & mask)){
+        entry &hole = entries[bucket];
+        hole.key.store(key, std::memory_order_relaxed);
+        hole.row.store(entries[j].row.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        hole.last.store(entries[j].last.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        hole.count.store(entries[j].count.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        bucket = j;
+      }
+    }
+    entry &hole = entries[bucket];
+    hole.key.store(0, std::memory_order_relaxed);
+    hole.row.store(0, std::memory_order_relaxed);
+    hole.last.store(0, std::memory_order_relaxed);
+    hole.count.store(0, std::memory_order_relaxed);
+  }
+};
+
+
+// 64-bit random stream of a bag of the synthetic sparse features (splitmix64)
+struct splitmix64{
+  uint64_t state;
+
+  explicit splitmix64(uint64_t seed) : state(seed){}
+
+  uint64_t next(){
+    uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+  }
+
+  // uniform in [0, n)
+  uint64_t below(uint64_t n){
+    return (uint64_t)(((unsigned __int128)next() * n) >> 64);
+  }
+
+  // uniform in [0, 1)
+  double uniform(){
+    return (next() >> 11) * (1.0 / 9007199254740992.0);
+  }
+};
+
+template<typename index_t>
+inline bool bag_contains(const index_t *bag, long int n, long int index){
+  for(long int i = 0; i < n; i++){
+    if(bag[i] == index){
+      return true;
+    }
+  }
+  return false;
+}
+
+// Walker/Vose alias table of an access distribution: O(1) per sample with a float32 probability and a
+// uint32 alias per row (8 bytes per row, half of a float64 pmf with its cdf)
+struct alias_table{
+  // float32 probability and uint32 alias (as int32) of each row, held as tensors so that the tables of the
+  // same access distribution can be shared, or be loaded from a cache (e.g., mmapped .npy files)
+  torch::Tensor prob;
+  torch::Tensor alias;
+  const float *prob_ptr;
+  const uint32_t *alias_ptr;
+  long int n;
+  // replicas of prob and alias indexed by node (AliasSampler::replicate), empty without them
+  std::vector<void *> node_prob;
+  std::vector<void *> node_alias;
+
+  explicit alias_table(const torch::Tensor &pmf){
+    torch::Tensor p = pmf.to(torch::kDouble).contiguous();
+    const double *p_ptr = p.data<double>();
+    n = p.numel();
+    assert(n > 0 && n <= (long int)UINT32_MAX);
+    double sum = std::accumulate(p_ptr, p_ptr + n, 0.0);
+    prob = torch::empty({n}, torch::kFloat);
+    alias = torch::empty({n}, torch::kInt);
+    float *prob_w = prob.data<float>();
+    uint32_t *alias_w = (uint32_t *)alias.data<int>();
+    std::vector<double> scaled(n);
+    std::vector<uint32_t> small, large;
+    for(long int i = 0; i < n; i++){
+      scaled[i] = p_ptr[i] * n / sum;
+      (scaled[i] < 1 ? small : large).push_back(i);
+    }
+    while(!small.empty() && !large.empty()){
+      uint32_t s = small.back();
+      uint32_t l = large.back();
+      small.pop_back();
+      prob_w[s] = scaled[s];
+      alias_w[s] = l;
+      scaled[l] -= 1 - scaled[s];
+      if(scaled[l] < 1){
+        large.pop_back();
+        small.push_back(l);
+      }
+    }
+    // leftovers are 1 up to rounding
+    for(uint32_t i : large){
+      prob_w[i] = 1;
+      alias_w[i] = i;
+    }
+    for(uint32_t i : small){
+      prob_w[i] = 1;
+      alias_w[i] = i;
+    }
+    prob_ptr = prob_w;
+    alias_ptr = alias_w;
+  }
+
+  // a table built before (alias_tables()), not copied
+  alias_table(const torch::Tensor &prob, const torch::Tensor &alias) : prob(prob.contiguous()), alias(alias.contiguous()){
+    assert(this->prob.scalar_type() == torch::kFloat && this->alias.scalar_type() == torch::kInt);
+    n = this->prob.numel();
+    assert(n > 0 && this->alias.numel() == n);
+    prob_ptr = this->prob.data<float>();
+    alias_ptr = (const uint32_t *)this->alias.data<int>();
+  }
+
+  long int size() const{
+    return n;
+  }
+
+  // a row drawn with "prob" and "alias", those of the table or their replica on a node
+  long int draw(splitmix64 &rng, const float *prob, const uint32_t *alias) const{
+    long int i = rng.below(n);
+    return rng.uniform() < prob[i] ? i : alias[i];
+  }
+};
+
+// "m" distinct indices of [0, n) in "bag" (sorted), uniform (Floyd's algorithm) or drawn from "table" if not null
+template<typename index_t>
+void fill_multi_hot_bag(index_t *bag, long int n, long int m, const alias_table *table, splitmix64 &rng){
+  long int count = 0;
+  if(m == n){
+    // every row of the table
+    for(; count < m; count++){
+      bag[count] = count;
+    }
+  }
+  else if(table == nullptr){
+    // Floyd: a uniform m-subset of [0, n) with m draws
+    for(long int j = n - m; j < n; j++){
+      long int candidate = rng.below(j + 1);
+      bag[count] = bag_contains(bag, count, candidate) ? j : candidate;
+      count++;
+    }
+  }
+  else{
+    // the replicas of the node of the calling thread, if any (AliasSampler::replicate)
+    const float *prob = numa_local(table->node_prob, table->prob_ptr);
+    const uint32_t *alias = numa_local(table->node_alias, table->alias_ptr);
+    while(count < m){
+      long int candidate = table->draw(rng, prob, alias);
+      if(!bag_contains(bag, count, candidate)){
+        bag[count++] = candidate;
+      }
+    }
+  }
+  std::sort(bag, bag + m);
+}
+
+// Sparse features of a batch packed as a jagged tensor (as a KeyedJaggedTensor): the indices of all
+// tables are one allocation, of which the indices of table t ("lengths"[t] entries) are a view, so a
+// batch is produced, transferred (custom_utils.JaggedSparse) and released at once
+std::vector<torch::Tensor> jagged_tables(const std::vector<long int> &lengths, const torch::TensorOptions &options){
+  long int n_values = 0;
+  for(long int length : lengths){
+    n_values += length;
+  }
+  torch::Tensor values = torch::empty({n_values}, options);
+  std::vector<torch::Tensor> tables;
+  long int offset = 0;
+  for(long int length : lengths){
+    tables.push_back(values.narrow(0, offset, length));
+    offset += length;
+  }
+  return tables;
+}
+
+// Synthetic multi-hot sparse features of a batch for all tables at once: each bag of table t holds
+// "pooling_factors"[t] distinct indices (sorted), uniform over [0, "table_sizes"[t]) by Floyd's algorithm,
+// or drawn from the alias table of the table ("tables" is not null) with the indices already in the bag
+// rejected. Bags are processed in parallel with a stream keyed by (seed, table, example), so the output
+// does not depend on the number of threads.
+// Returns (lS_i: indices of each table, views of one buffer (jagged_tables), lS_o: (n_tables, batch_size)
+// offsets), int32 if "int32_indices" (int64 otherwise), in pinned memory if "pinned"
+std::tuple<std::vector<torch::Tensor>, torch::Tensor> multi_hot_bags(const std::vector<long int> &table_sizes, const std::vector<long int> &pooling_factors, int batch_size, const std::vector<alias_table> *tables, long int seed, int n_cores, bool pinned = false, bool int32_indices = false){
+  int n_tables = table_sizes.size();
+  assert((int)pooling_factors.size() == n_tables);
+  assert(tables == nullptr || (int)tables->size() == n_tables);
+  torch::TensorOptions options = torch::TensorOptions().dtype(int32_indices ? torch::kInt : torch::kInt64).pinned_memory(pinned);
+  torch::Tensor offsets = torch::empty({n_tables, batch_size}, options);
+  std::vector<long int> lengths(n_tables);
+  for(int t = 0; t < n_tables; t++){
+    assert(pooling_factors[t] <= table_sizes[t]);
+    assert(tables == nullptr || (*tables)[t].size() == table_sizes[t]);
+    assert(!int32_indices || table_sizes[t] <= INT32_MAX);
+    lengths[t] = batch_size * pooling_factors[t];
+  }
+  std::vector<torch::Tensor> indices = jagged_tables(lengths, options);
+
+  auto fill = [&](auto *offsets_ptr){
+    typedef typename std::remove_pointer<decltype(offsets_ptr)>::type index_t;
+    std::vector<index_t *> indices_ptr(n_tables);
+    for(int t = 0; t < n_tables; t++){
+      indices_ptr[t] = (index_t *)indices[t].data_ptr();
+      for(int b = 0; b < batch_size; b++){
+        offsets_ptr[(long int)t * batch_size + b] = (long int)b * pooling_factors[t];
+      }
+    }
+
+    #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(dynamic, 64) collapse(2)
+    for(int t = 0; t < n_tables; t++){
+      for(int b = 0; b < batch_size; b++){
+        splitmix64 rng(((uint64_t)seed * 0x100000001B3ULL) ^ ((uint64_t)t << 40) ^ (uint64_t)b);
+        fill_multi_hot_bag(indices_ptr[t] + (long int)b * pooling_factors[t], table_sizes[t], pooling_factors[t], tables == nullptr ? nullptr : &(*tables)[t], rng);
+      }
+    }
+  };
+  if(int32_indices){
+    fill(offsets.data<int>());
+  }
+  else{
+    fill(offsets.data<long int>());
+  }
+  return std::make_tuple(indices, offsets);
+}
+
+std::tuple<std::vector<torch::Tensor>, torch::Tensor> multi_hot_indices(const std::vector<long int> &table_sizes, const std::vector<long int> &pooling_factors, int batch_size, long int seed, int n_cores, bool int32_indices){
+  return multi_hot_bags(table_sizes, pooling_factors, batch_size, nullptr, seed, n_cores, false, int32_indices);
+}
+
+// Alias tables of the access distributions of all tables, built once (in parallel over the tables)
+class AliasSampler{
+  friend class BatchQueue;
+public:
+  AliasSampler(const std::vector<torch::Tensor> &pmfs, int n_cores){
+    tables.reserve(pmfs.size());
+    std::vector<std::unique_ptr<alias_table>> built(pmfs.size());
+    #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(dynamic, 1)
+    for(size_t t = 0; t < pmfs.size(); t++){
+      built[t] = std::make_unique<alias_table>(pmfs[t]);
+    }
+    for(auto &table : built){
+      tables.push_back(std::move(*table));
+      table_sizes.push_back(tables.back().size());
+    }
+  }
+
+  // From the (prob, alias) of each table returned by alias_tables() before, without building them again
+  AliasSampler(const std::vector<torch::Tensor> &probs, const std::vector<torch::Tensor> &aliases){
+    assert(probs.size() == aliases.size());
+    tables.reserve(probs.size());
+    for(size_t t = 0; t < probs.size(); t++){
+      tables.emplace_back(probs[t], aliases[t]);
+      table_sizes.push_back(tables.back().size());
+    }
+  }
+
+  // (prob, alias) of each table, e.g., to cache them
+  std::vector<std::tuple<torch::Tensor, torch::Tensor>> alias_tables(){
+    std::vector<std::tuple<torch::Tensor, torch::Tensor>> result;
+    for(const alias_table &table : tables){
+      result.push_back(std::make_tuple(table.prob, table.alias));
+    }
+    return result;
+  }
+
+  // Replicas of the alias tables on every node of the pool (numa_replicate), from which the threads of
+  // sample() and of the producers of BatchQueue draw. Returns the number of nodes
+  long int replicate(){
+    long int n_nodes = 0;
+    for(alias_table &table : tables){
+      n_nodes = numa_replicate(table.prob);
+      numa_replicate(table.alias);
+      table.node_prob = numa_replicas_of(table.prob.data_ptr());
+      table.node_alias = numa_replicas_of(table.alias.data_ptr());
+    }
+    return n_nodes;
+  }
+
+  // (lS_i, lS_o) of a batch with "pooling_factors"[t] distinct indices per bag of table t
+  std::tuple<std::vector<torch::Tensor>, torch::Tensor> sample(int batch_size, const std::vector<long int> &pooling_factors, long int seed, int n_cores, bool pinned = false, bool int32_indices = false){
+    return multi_hot_bags(table_sizes, pooling_factors, batch_size, &tables, seed, n_cores, pinned, int32_indices);
+  }
+
+private:
+  std::vector<alias_table> tables;
+  std::vector<long int> table_sizes;
+};
+
+
+torch::Tensor normal_philox(float std, int n_emb, int dim, long int seed, int table, int iteration, int n_cores){
+  torch::Tensor output = torch::empty({n_emb, dim}, torch::kFloat);
+  float *output_ptr = output.data<float>();
+
+  #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(static)
+  for(long int i = 0; i < n_emb; i++){
+    philox_normal_row(output_ptr + i * dim, dim, std, seed, table, i, iteration);
+  }
+  return output;
+}
+
+
+torch::Tensor normal_philox_with_extra(const torch::Tensor &std, const torch::Tensor &indices, int dim, int extra, long int seed, int table, int iteration, int n_cores){
+  int n_emb = std.sizes()[0]; // dimension of std: (n_emb)
+  assert(indices.numel() == n_emb);
+
+  // allocate a memory space for output tensor
+  torch::Tensor output = workspace_empty("noise", {n_emb + extra, dim}, torch::kFloat);
+  float *output_ptr = output.data<float>();
+  float *std_ptr = std.data<float>();
+  long int *indices_ptr = indices.data<long int>();
+
+  // each row is keyed by its embedding index, not by its position in "indices"
+  #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(static)
+  for(int i = 0; i < n_emb; i++){
+    philox_normal_row(output_ptr + (long int)i * dim, dim, std_ptr[i], seed, table, indices_ptr[i], iteration);
+  }
+  return output;
+}
+
+
+// Secure-mode versions of normal_philox and normal_philox_with_extra (philox_secure_normal_row)
+torch::Tensor normal_secure(float std, int n_emb, int dim, long int seed, int table, int iteration, int n_cores){
+  assert(seed >= 0);
+  torch::Tensor output = torch::empty({n_emb, dim}, torch::kFloat);
+  float *output_ptr = output.data<float>();
+
+  #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(static)
+  for(int i = 0; i < n_emb; i++){
+    philox_secure_normal_row(output_ptr + (long int)i * dim, dim, std, seed, table, i, iteration);
+  }
+  return output;
+}
+
+
+torch::Tensor normal_secure_with_extra(const torch::Tensor &std, const torch::Tensor &indices, int dim, int extra, long int seed, int table, int iteration, int n_cores){
+  int n_emb = std.sizes()[0]; // dimension of std: (n_emb)
+  assert(indices.numel() == n_emb && seed >= 0);
+
+  torch::Tensor output = workspace_empty("noise", {n_emb + extra, dim}, torch::kFloat);
+  float *output_ptr = output.data<float>();
+  float *std_ptr = std.data<float>();
+  long int *indices_ptr = indices.data<long int>();
+
+  #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(static)
+  for(int i = 0; i < n_emb; i++){
+    philox_secure_normal_row(output_ptr + (long int)i * dim, dim, std_ptr[i], seed, table, indices_ptr[i], iteration);
+  }
+  return output;
+}
+
+
+// Experimental approximation of normal_philox_with_extra: the noise of each row is read from a
+// pre-sampled Gaussian "pool" (fp32, power-of-2 size) instead of being generated. Every block of
+// NOISE_POOL_LANES elements of a row starts at an offset of the pool drawn from a keyed hash of
+// (seed, table, row, iteration, block), so the result is deterministic but NOT a secure or
+// independent sampler: windows of the pool overlap and repeat across rows and iterations. It only
+// bounds the cost of the noisy update without the RNG, and must not be used to train private models.
+const int NOISE_POOL_LANES = 16;
+
+torch::Tensor normal_pool_with_extra(const torch::Tensor &std, const torch::Tensor &indices, const torch::Tensor &pool, int dim, int extra, long int seed, int table, int iteration, int n_cores){
+  int n_emb = std.sizes()[0]; // dimension of std: (n_emb)
+  long int pool_size = pool.numel();
+  assert(indices.numel() == n_emb);
+  assert(pool.scalar_type() == torch::kFloat && pool.is_contiguous());
+  assert(pool_size >= NOISE_POOL_LANES && (pool_size & (pool_size - 1)) == 0);
+  assert(seed >= 0);
+
+  torch::Tensor output = workspace_empty("noise", {n_emb + extra, dim}, torch::kFloat);
+  float *output_ptr = output.data<float>();
+  float *std_ptr = std.data<float>();
+  long int *indices_ptr = indices.data<long int>();
+  const float *pool_ptr = pool.data<float>();
+  uint64_t key_base = ((uint64_t)seed * 0x100000001B3ULL) ^ ((uint64_t)table << 40) ^ ((uint64_t)iteration << 20);
+
+  #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(static)
+  for(int i = 0; i < n_emb; i++){
+    float *row = output_ptr + (long int)i * dim;
+    float s = std_ptr[i];
+    for(int j = 0, block = 0; j < dim; j += NOISE_POOL_LANES, block++){
+      splitmix64 rng(key_base ^ ((uint64_t)indices_ptr[i] * 0xD1B54A32D192ED03ULL) ^ (uint64_t)block);
+      const float *src = pool_ptr + rng.below(pool_size - NOISE_POOL_LANES + 1);
+      int n_lanes = std::min(NOISE_POOL_LANES, dim - j);
+      for(int l = 0; l < n_lanes; l++){
+        row[j + l] = src[l] * s;
+      }
+    }
+  }
+  return output;
+}
+
+
+// Gaussian noise emitted in reduced precision (bf16/fp16), to halve the bandwidth of the noise
+// staging buffer. Rows are sampled in fp32 into a small thread-private buffer and converted.
+// Philox (keyed by "indices") is used when "seed" >= 0.
+template<typename T>
+void normal_reduced_precision_kernel(T *output_ptr, const float *std_ptr, const long int *indices_ptr, int n_emb, int dim, long int seed, int table, int iteration, int n_cores){
+  const int n_rows_per_block = 64;
+  int n_blocks = (n_emb + n_rows_per_block - 1) / n_rows_per_block;
+
+  #pragma omp parallel num_threads(pool_threads(n_cores))
+  {
+    torch::Generator generator = thread_generator();
+    std::vector<float> buffer(n_rows_per_block * dim);
+
+    #pragma omp for schedule(static)
+    for(int b = 0; b < n_blocks; b++){
+      int start = b * n_rows_per_block;
+      int end = std::min(start + n_rows_per_block, n_emb);
+      if(seed >= 0){
+        for(int i = start; i < end; i++){
+          philox_normal_row(buffer.data() + (i - start) * dim, dim, std_ptr[i], seed, table, indices_ptr[i], iteration);
+        }
+      }
+      else{
+        torch::Tensor buffer_slice = torch::from_blob(buffer.data(), {end - start, dim}, torch::kFloat);
+        torch::normal_out(buffer_slice, 0, 1, {end - start, dim}, generator);
+        for(int i = start; i < end; i++){
+          float *row = buffer.data() + (i - start) * dim;
+          #pragma omp simd
+          for(int k = 0; k < dim; k++){
+            row[k] *= std_ptr[i];
+          }
+        }
+      }
+      T *out = output_ptr + (long int)start * dim;
+      for(long int k = 0; k < (long int)(end - start) * dim; k++){
+        out[k] = T(buffer[k]);
+      }
+    }
+  }
+}
+
+torch::Tensor normal_reduced_precision(const torch::Tensor &std, const torch::Tensor &indices, int dim, bool bf16, long int seed, int table, int iteration, int n_cores){
+  int n_emb = std.sizes()[0]; // dimension of std: (n_emb)
+  assert(seed < 0 || indices.numel() == n_emb);
+  const long int *indices_ptr = seed >= 0 ? indices.data<long int>() : nullptr;
+
+  torch::Tensor output;
+  if(bf16){
+    output = torch::empty({n_emb, dim}, torch::kBFloat16);
+    normal_reduced_precision_kernel<at::BFloat16>(output.data<at::BFloat16>(), std.data<float>(), indices_ptr, n_emb, dim, seed, table, iteration, n_cores);
+  }
+  else{
+    output = torch::empty({n_emb, dim}, torch::kHalf);
+    normal_reduced_precision_kernel<at::Half>(output.data<at::Half>(), std.data<float>(), indices_ptr, n_emb, dim, seed, table, iteration, n_cores);
+  }
+  return output;
+}
+
+
+// Sorted unique indices in the storage of "output" (a copy of "input", int32 or int64) narrowed to them
+template<typename index_t>
+torch::Tensor sort_unique_into(torch::Tensor &output, const torch::Tensor &input, bool parallel){
+  long int n = input.numel();
+  index_t *output_ptr = (index_t *)output.data_ptr();
+  memcpy(output_ptr, input.data_ptr(), n * sizeof(index_t));
+  index_t *last;
+  if(parallel){
+    in_tbb_arena([&]{ std::sort(std::execution::par_unseq, output_ptr, output_ptr + n); });
+    last = in_tbb_arena([&]{ return std::unique(std::execution::par_unseq, output_ptr, output_ptr + n); });
+  }
+  else{
+    std::sort(output_ptr, output_ptr + n);
+    last = std::unique(output_ptr, output_ptr + n);
+  }
+  return output.narrow(0, 0, last - output_ptr);
+}
+
+// int32 indices are sorted as int32 (twice the keys per cache line)
+inline torch::Tensor sort_unique(const torch::Tensor &input, bool parallel){
+  assert(input.is_contiguous());
+  torch::Tensor output = workspace_empty("unique", {input.numel()}, input.scalar_type());
+  if(input.scalar_type() == torch::kInt){
+    return sort_unique_into<int>(output, input, parallel);
+  }
+  assert(input.scalar_type() == torch::kInt64);
+  return sort_unique_into<long int>(output, input, parallel);
+}
+
+torch::Tensor unique_multi_thread(const torch::Tensor &input){
+  // Sort and unique in the storage of the output (a copy of the input), which is then narrowed
+  return sort_unique(input.contiguous(), true);
+}
+
+// Tables of at most this many rows (a bitmap of 1 MB) are uniqued by unique_bitmap() with unique_auto()
+const long int BITMAP_UNIQUE_MAX_ROWS = 1L << 23;
+
+// Sorted unique indices of "input" (indices in [0, n_embs)) without sorting: the indices are set in
+// a bitmap of the table, and the set bits are written in order, each thread from the offset of its
+// range of words (popcount prefix sum). O(n + n_embs / 64)
+template<typename index_t>
+torch::Tensor bitmap_unique_into(torch::Tensor &output, const torch::Tensor &input, long int n_embs, int n_cores){
+  long int n = input.numel();
+  long int n_words = (n_embs + 63) / 64;
+  const index_t *input_ptr = input.data<index_t>();
+  index_t *output_ptr = output.data<index_t>();
+  scoped_trace trace("unique_bitmap", n, n * sizeof(index_t) + n_words * sizeof(unsigned long int));
+
+  scratch_vector<unsigned long int> bitmap_scratch("unique_bitmap", n_words);
+  unsigned long int *bitmap_ptr = bitmap_scratch.vec.data(); // zeroed by the lease
+  int n_threads = pool_threads(n_cores);
+  std::vector<long int> offsets(n_threads + 1, 0);
+
+  #pragma omp parallel num_threads(n_threads)
+  {
+    #pragma omp for schedule(static)
+    for(long int i = 0; i < n; i++){
+      long int row = input_ptr[i];
+      assert(row >= 0 && row < n_embs);
+      __atomic_fetch_or(&bitmap_ptr[row >> 6], 1UL << (row & 63), __ATOMIC_RELAXED);
+    }
+
+    // the words of thread t are [begin, end), its unique indices start at offsets[t]
+    int t = omp_get_thread_num();
+    int n_team = omp_get_num_threads();
+    long int begin = n_words * t / n_team;
+    long int end = n_words * (t + 1) / n_team;
+    long int count = 0;
+    for(long int w = begin; w < end; w++){
+      count += __builtin_popcountl(bitmap_ptr[w]);
+    }
+    offsets[t + 1] = count;
+    #pragma omp barrier
+    #pragma omp single
+    {
+      for(int u = 0; u < n_team; u++){
+        offsets[u + 1] += offsets[u];
+      }
+    }
+
+    long int r = offsets[t];
+    for(long int w = begin; w < end; w++){
+      for(unsigned long int bits = bitmap_ptr[w]; bits != 0; bits &= bits - 1){
+        output_ptr[r++] = (index_t)(w * 64 + __builtin_ctzl(bits));
+      }
+    }
+  }
+  return output.narrow(0, 0, offsets[n_threads]);
+}
+
+// Same as unique_multi_thread() for indices in [0, n_embs), with a bitmap of the table instead of a sort
+torch::Tensor unique_bitmap(const torch::Tensor &input, long int n_embs, int n_cores){
+  torch::Tensor input_contiguous = input.contiguous();
+  torch::Tensor output = workspace_empty("unique", {input.numel()}, input.scalar_type());
+  if(input.scalar_type() == torch::kInt){
+    return bitmap_unique_into<int>(output, input_contiguous, n_embs, n_cores);
+  }
+  assert(input.scalar_type() == torch::kInt64);
+  return bitmap_unique_into<long int>(output, input_contiguous, n_embs, n_cores);
+}
+
+// unique_bitmap() for tables of at most BITMAP_UNIQUE_MAX_ROWS rows, unique_multi_thread() otherwise
+torch::Tensor unique_auto(const torch::Tensor &input, long int n_embs, int n_cores){
+  if(n_embs <= BITMAP_UNIQUE_MAX_ROWS){
+    return unique_bitmap(input, n_embs, n_cores);
+  }
+  return unique_multi_thread(input);
+}
+
+
+typedef std::pair<long int, long int> int_pair;
+
+torch::Tensor coalesce_multi_thread_openmp(const torch::Tensor &input, int n_cores){
+  // If input tensor is already coalesced, just return
+  if(input.is_coalesced()){
+    return input;
+  }
+
+  torch::Tensor indices = input._indices();
+  torch::Tensor values = input._values();
+
+  // Set several variables
+  int n_embs = input.sizes()[0];
+  int n_rows = values.sizes()[0];
+  int dim = values.sizes()[1];
+  assert(dim == input.sizes()[1]);
+  assert(indices.sizes()[0] == 1);
+  assert(indices.sizes()[1] == n_rows);
+
+  // Create a vector of pairs (indices, new indices started from 0), read directly from the tensor
+  const long int *indices_ptr = indices.data<long int>();
+  scratch_vector<int_pair> pairs_scratch("coalesce_pairs", n_rows);
+  std::vector<int_pair> &indices_vector_with_index = pairs_scratch.vec;
+  for(int i = 0; i < n_rows; i++){
+    indices_vector_with_index[i].first = indices_ptr[i];
+    indices_vector_with_index[i].second = i;
+  }
+
+  // Sort that vector of pairs
+  in_tbb_arena([&]{ std::sort(std::execution::par_unseq, indices_vector_with_index.begin(), indices_vector_with_index.end(), [](const std::pair<long int, long int> lhs, const std::pair<long int, long int> rhs){
+    return lhs.first < rhs.first;
+  }); });
+  
+  // Do coalescing and derive start, end indices for each coalesced index
+  // Coalesced indices are written directly into the output indices (narrowed afterwards)
+  torch::Tensor out_indices = workspace_empty("coalesce_indices", {1, n_rows}, torch::kInt64);
+  long int *out_indices_ptr = out_indices.data<long int>();
+  int n_coalesced_rows = 0;
+  scratch_vector<long int> start_scratch("coalesce_starts", 0);
+  scratch_vector<long int> end_scratch("coalesce_ends", 0);
+  std::vector<long int> &start_indices = start_scratch.vec;
+  std::vector<long int> &end_indices = end_scratch.vec;
+  for(int i = 0; i < n_rows; i++){
+    if(i == 0 || indices_vector_with_index[i].first != indices_vector_with_index[i-1].first){
+      if(i != 0){
+        end_indices.push_back(i - 1);
+      }
+      out_indices_ptr[n_coalesced_rows++] = indices_vector_with_index[i].first;
+      start_indices.push_back(i);
+    }
+  }
+  end_indices.push_back(n_rows - 1);
+
+
+  // Derive coalesced values for each coalesced index
+  torch::Tensor out_values = workspace_empty("coalesce_values", {n_coalesced_rows, dim}, torch::kFloat);
+  assert(out_values.is_contiguous());
+  assert(values.is_contiguous());
+
+  // Accumulate through raw pointers (no per-row Tensor views / ATen dispatch), and schedule
+  // dynamically since hot indices of skewed (e.g., zipf) workloads have many more duplicates
+  float *out_values_ptr = out_values.data<float>();
+  float *values_ptr = values.data<float>();
+
+  dispatch_dim(dim, [&](auto D){
+    constexpr int DIM = decltype(D)::value;
+    #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(dynamic, 64)
+    for(int i = 0; i < n_coalesced_rows; i++){
+      float *out_row = out_values_ptr + (long int)i * dim;
+      copy_row<DIM>(out_row, values_ptr + indices_vector_with_index[start_indices[i]].second * dim, dim);
+      for(long int j = start_indices[i] + 1; j <= end_indices[i]; j++){
+        add_row<DIM>(out_row, values_ptr + indices_vector_with_index[j].second * dim, dim);
+      }
+    }
+  });
+
+  // 5
+  torch::Tensor output = torch::sparse_coo_tensor(out_indices.narrow(1, 0, n_coalesced_rows), out_values, {n_embs, dim});
+  output._coalesced_(true);
+  
+  return output;
+}
+
+
+torch::Tensor coalesce_multi_thread_embeddingbag(const torch::Tensor &input, int n_cores){
+  // If input tensor is already coalesced, just return
+  if(input.is_coalesced()){
+    return input;
+  }
+
+  torch::Tensor indices = input._indices();
+  torch::Tensor values = input._values();
+
+  // Set several variables
+  int n_embs = input.sizes()[0];
+  int n_rows = values.sizes()[0];
+  int dim = values.sizes()[1];
+  assert(dim == input.sizes()[1]);
+  assert(indices.sizes()[0] == 1);
+  assert(indices.sizes()[1] == n_rows);
+
+  scoped_trace trace("coalesce_embeddingbag", n_rows, (long int)n_rows * dim * sizeof(float));
+
+  // 1. Create a vector of pairs (indices, new indices started from 0), read directly from the tensor
+  scoped_trace pairs_trace("coalesce_embeddingbag/pairs", n_rows, n_rows * (sizeof(long int) + sizeof(int_pair)));
+  const long int *indices_ptr = indices.data<long int>();
+  scratch_vector<int_pair> pairs_scratch("coalesce_pairs", n_rows);
+  std::vector<int_pair> &indices_vector_with_index = pairs_scratch.vec;
+  in_tbb_arena([&]{ std::for_each(std::execution::par_unseq, indices_vector_with_index.begin(), indices_vector_with_index.end(), [&](int_pair &pair){
+    unsigned long int i = (uintptr_t(&pair) - uintptr_t(indices_vector_with_index.data())) / sizeof(int_pair); 
+    pair.first = indices_ptr[i];
+    pair.second = i;
+  }); });
+  pairs_trace.stop();
+
+  // 2. Sort that vector of pairs
+  scoped_trace sort_trace("coalesce_embeddingbag/sort", n_rows, 2 * n_rows * sizeof(int_pair));
+  in_tbb_arena([&]{ std::sort(std::execution::par_unseq, indices_vector_with_index.begin(), indices_vector_with_index.end(), [](const std::pair<long int, long int> lhs, const std::pair<long int, long int> rhs){
+    return lhs.first < rhs.first;
+  }); });
+  sort_trace.stop();
+  
+  // 3. Extract each elements, directly into the tensors given to embedding_bag
+  // (the sorted indices become the coalesced indices after unique())
+  scoped_trace scan_trace("coalesce_embeddingbag/scan", n_rows, n_rows * (sizeof(int_pair) + 5 * sizeof(long int)));
+  torch::Tensor coalesced_indices = workspace_empty("coalesce_indices", {1, n_rows}, torch::kInt64);
+  torch::Tensor embedding_idx_tensor = workspace_empty("coalesce_positions", {n_rows}, torch::kInt64);
+  long int *sorted_first = coalesced_indices.data<long int>();
+  long int *embedding_idx = embedding_idx_tensor.data<long int>();
+  in_tbb_arena([&]{ std::for_each(std::execution::par_unseq, indices_vector_with_index.begin(), indices_vector_with_index.end(), [&](const int_pair &pair){
+    unsigned long int i = (uintptr_t(&pair) - uintptr_t(indices_vector_with_index.data())) / sizeof(int_pair); 
+    sorted_first[i] = pair.first;
+    embedding_idx[i] = pair.second;
+  }); });
+  
+  // 4. Derive coalesced_indices by applying unique() to sorted_first
+  long int *last = in_tbb_arena([&]{ return std::unique(std::execution::par_unseq, sorted_first, sorted_first + n_rows); });
+  long int n_coalesced_rows = last - sorted_first;
+  
+  // 5. Derive embedding_offsets
+  torch::Tensor embedding_offset_tensor = workspace_empty("coalesce_offsets", {n_coalesced_rows}, torch::kInt64);
+  long int *embedding_offset = embedding_offset_tensor.data<long int>();
+  scratch_vector<long int> difference_scratch("coalesce_flags", n_rows);
+  scratch_vector<long int> scan_scratch("coalesce_scan", n_rows);
+  std::vector<long int> &difference_occur = difference_scratch.vec;
+  std::vector<long int> &result_exclusive_scan = scan_scratch.vec;
+  in_tbb_arena([&]{ std::for_each(std::execution::par_unseq, difference_occur.begin(), difference_occur.end(), [&](long int &e){
+    unsigned long int i = (uintptr_t(&e) - uintptr_t(difference_occur.data())) / sizeof(long int); 
+    if((i == 0) || (indices_vector_with_index[i-1].first != indices_vector_with_index[i].first)){
+      e = 1;
+    }else{
+      e = 0;
+    }
+  }); });
+  in_tbb_arena([&]{ std::exclusive_scan(std::execution::par_unseq, difference_occur.begin(), difference_occur.end(), result_exclusive_scan.begin(), 0); });
+  in_tbb_arena([&]{ std::for_each(std::execution::par_unseq, difference_occur.begin(), difference_occur.end(), [&](long int &e){
+    if(e == 1){
+      unsigned long int i = (uintptr_t(&e) - uintptr_t(difference_occur.data())) / sizeof(long int); 
+      embedding_offset[result_exclusive_scan[i]] = i;
+    }
+  }); });
+
+  scan_trace.stop();
+
+  // 6. Apply embedding_bag
+  scoped_trace bag_trace("coalesce_embeddingbag/embedding_bag", n_rows, ((long int)n_rows + n_coalesced_rows) * dim * sizeof(float));
+  torch::Tensor coalesced_values = std::get<0>(torch::_embedding_bag_forward_only(values, embedding_idx_tensor, embedding_offset_tensor));
+  bag_trace.stop();
+  
+  // 7. Form the answer as a sparse_coo_tensor
+  torch::Tensor output = torch::sparse_coo_tensor(coalesced_indices.narrow(1, 0, n_coalesced_rows), coalesced_values, {n_embs, dim});
+  output._coalesced_(true);
+  return output;
+}
+
+
+// Number of bits to represent values in [0, n)
+inline int bit_width(unsigned long int n){
+  if(n <= 1){
+    return 0;
+  }
+  int bits = 0;
+  while(bits < 64 && ((n - 1) >> bits) != 0){
+    bits++;
+  }
+  return bits;
+}
+
+// Parallel LSD radix sort of (index, position) pairs packed into 64-bit keys
+// (index in the upper bits, position in the lower "pos_bits" bits).
+// Only the bits which can be set by an index in [0, n_embs) are sorted, so small tables
+// need only a few passes. Because LSD radix sort is stable, positions stay in ascending
+// order within the same index. Returns false if a pair does not fit in 64 bits.
+const int RADIX_BITS = 8;
+const int RADIX_BUCKETS = 1 << RADIX_BITS;
+
+ISA_CLONES bool radix_sort_index_position(const long int *indices, long int n, long int n_embs, std::vector<unsigned long int> &keys, int &pos_bits, int n_cores){
+  pos_bits = bit_width(n);
+  int index_bits = bit_width(n_embs);
+  if(pos_bits + index_bits > 64){
+    return false;
+  }
+
+  keys.resize(n);
+  scratch_vector<unsigned long int> buffer_scratch("radix_buffer", n);
+  std::vector<unsigned long int> &buffer = buffer_scratch.vec;
+  #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(static)
+  for(long int i = 0; i < n; i++){
+    keys[i] = ((unsigned long int)indices[i] << pos_bits) | (unsigned long int)i;
+  }
+
+  // use a single thread for small inputs where fork/join dominates
+  int n_threads = std::max(1, std::min<int>(pool_threads(n_cores), n / 4096));
+  scratch_vector<long int> histogram_scratch("radix_histogram", (long int)n_threads * RADIX_BUCKETS);
+  std::vector<long int> &histogram = histogram_scratch.vec;
+  for(int shift = pos_bits; shift < pos_bits + index_bits; shift += RADIX_BITS){
+    #pragma omp parallel num_threads(n_threads)
+    {
+      int t = omp_get_thread_num();
+      long int begin = n * t / n_threads;
+      long int end = n * (t + 1) / n_threads;
+      long int *local = histogram.data() + (long int)t * RADIX_BUCKETS;
+
+      std::fill(local, local + RADIX_BUCKETS, 0);
+      for(long int i = begin; i < end; i++){
+        local[(keys[i] >> shift) & (RADIX_BUCKETS - 1)]++;
+      }
+      #pragma omp barrier
+
+      // exclusive scan in (bucket, thread) order keeps the sort stable
+      #pragma omp single
+      {
+        long int sum = 0;
+        for(int b = 0; b < RADIX_BUCKETS; b++){
+          for(int u = 0; u < n_threads; u++){
+            long int cnt = histogram[(long int)u * RADIX_BUCKETS + b];
+            histogram[(long int)u * RADIX_BUCKETS + b] = sum;
+            sum += cnt;
+          }
+        }
+      }
+
+      for(long int i = begin; i < end; i++){
+        buffer[local[(keys[i] >> shift) & (RADIX_BUCKETS - 1)]++] = keys[i];
+      }
+    }
+    keys.swap(buffer);
+  }
+  return true;
+}
+
+
+// Row-sparse gradient of an embedding table: its touched rows (sorted and unique, 1-D int64) and their
+// values (n_rows x dim), i.e., indices()/values() of a coalesced sparse_coo_tensor without the (1, nnz)
+// index dimension, the COO validation and the coalesced flag. The *_rows kernels take the raw gradient
+// as (indices, values) the same way, so the LazyDP update never builds nor unpacks a COO tensor
+typedef std::tuple<torch::Tensor, torch::Tensor> row_sparse;
+
+// The row-sparse gradient as a coalesced sparse_coo_tensor of a table of "n_embs" rows
+torch::Tensor row_sparse_to_coo(const row_sparse &grad, long int n_embs){
+  const torch::Tensor &rows = std::get<0>(grad);
+  const torch::Tensor &values = std::get<1>(grad);
+  torch::Tensor output = torch::sparse_coo_tensor(rows.view({1, -1}), values, {n_embs, values.sizes()[1]});
+  output._coalesced_(true);
+  return output;
+}
+
+ISA_CLONES row_sparse coalesce_radix_rows(const torch::Tensor &indices, const torch::Tensor &values, long int n_embs, int n_cores){
+  // Set several variables
+  int n_rows = values.sizes()[0];
+  int dim = values.sizes()[1];
+  assert(indices.numel() == n_rows);
+  assert(indices.is_contiguous());
+  assert(values.is_contiguous());
+
+  // 1. Sort (index, position) pairs by radix sort
+  scratch_vector<unsigned long int> keys_scratch("radix_keys", 0);
+  std::vector<unsigned long int> &keys = keys_scratch.vec;
+  int pos_bits;
+  if(!radix_sort_index_position(indices.data<long int>(), n_rows, n_embs, keys, pos_bits, n_cores)){
+    torch::Tensor output = coalesce_multi_thread_openmp(torch::sparse_coo_tensor(indices.view({1, -1}), values, {n_embs, dim}), n_cores);
+    return row_sparse(output._indices().view(-1), output._values());
+  }
+  unsigned long int pos_mask = (pos_bits == 64) ? ~0UL : ((1UL << pos_bits) - 1);
+
+  // 2. Derive start index of each coalesced index
+  scratch_vector<long int> start_scratch("coalesce_starts", 0);
+  std::vector<long int> &start_indices = start_scratch.vec;
+  for(int i = 0; i < n_rows; i++){
+    if(i == 0 || (keys[i] >> pos_bits) != (keys[i-1] >> pos_bits)){
+      start_indices.push_back(i);
+    }
+  }
+  int n_coalesced_rows = start_indices.size();
+  start_indices.push_back(n_rows);
+
+  // 3. Accumulate values of each coalesced index
+  torch::Tensor out_indices = workspace_empty("coalesce_indices", {n_coalesced_rows}, torch::kInt64);
+  torch::Tensor out_values = workspace_empty("coalesce_values", {n_coalesced_rows, dim}, torch::kFloat);
+  long int *out_indices_ptr = out_indices.data<long int>();
+  float *out_values_ptr = out_values.data<float>();
+  const float *values_ptr = values.data<float>();
+
+  dispatch_dim(dim, [&](auto D){
+    constexpr int DIM = decltype(D)::value;
+    #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(dynamic, 64)
+    for(int i = 0; i < n_coalesced_rows; i++){
+      out_indices_ptr[i] = keys[start_indices[i]] >> pos_bits;
+      float *out_row = out_values_ptr + (long int)i * dim;
+      copy_row<DIM>(out_row, values_ptr + (keys[start_indices[i]] & pos_mask) * dim, dim);
+      for(long int j = start_indices[i] + 1; j < start_indices[i+1]; j++){
+        add_row<DIM>(out_row, values_ptr + (keys[j] & pos_mask) * dim, dim);
+      }
+    }
+  });
+
+  return row_sparse(out_indices, out_values);
+}
+
+torch::Tensor coalesce_radix(const torch::Tensor &input, int n_cores){
+  // If input tensor is already coalesced, just return
+  if(input.is_coalesced()){
+    return input;
+  }
+  assert(input._indices().sizes()[0] == 1);
+  assert(input._values().sizes()[1] == input.sizes()[1]);
+  return row_sparse_to_coo(coalesce_radix_rows(input._indices().view(-1), input._values(), input.sizes()[0], n_cores), input.sizes()[0]);
+}
+
+
+// Same as coalesce_radix, with the Gaussian noise of EANA (std "std", Philox keyed by (seed, table,
+// row, iteration)) sampled into each coalesced row before its gradient rows are accumulated, so noising
+// the coalesced values takes no pass of its own. An already coalesced input is copied and noised
+ISA_CLONES torch::Tensor coalesce_radix_with_noise(const torch::Tensor &input, float std, long int seed, int table, int iteration, int n_cores){
+  assert(seed >= 0);
+  torch::Tensor indices = input._indices();
+  torch::Tensor values = input._values();
+
+  int n_embs = input.sizes()[0];
+  int n_rows = values.sizes()[0];
+  int dim = values.sizes()[1];
+  assert(dim == input.sizes()[1]);
+  assert(indices.sizes()[0] == 1);
+  assert(indices.sizes()[1] == n_rows);
+  assert(values.is_contiguous());
+
+  // 1. Sort (index, position) pairs by radix sort, or take them in order if already coalesced
+  scratch_vector<unsigned long int> keys_scratch("radix_keys", 0);
+  std::vector<unsigned long int> &keys = keys_scratch.vec;
+  int pos_bits;
+  if(input.is_coalesced()){
+    pos_bits = bit_width(n_rows);
+    assert(pos_bits + bit_width(n_embs) <= 64);
+    keys.resize(n_rows);
+    const long int *indices_ptr = indices.data<long int>();
+    for(long int i = 0; i < n_rows; i++){
+      keys[i] = ((unsigned long int)indices_ptr[i] << pos_bits) | (unsigned long int)i;
+    }
+  }
+  else if(!radix_sort_index_position(indices.data<long int>(), n_rows, n_embs, keys, pos_bits, n_cores)){
+    torch::Tensor coalesced = coalesce_multi_thread_openmp(input, n_cores);
+    return coalesce_radix_with_noise(coalesced, std, seed, table, iteration, n_cores);
+  }
+  unsigned long int pos_mask = (pos_bits == 64) ? ~0UL : ((1UL << pos_bits) - 1);
+
+  // 2. Derive start index of each coalesced index
+  scratch_vector<long int> start_scratch("coalesce_starts", 0);
+  std::vector<long int> &start_indices = start_scratch.vec;
+  for(int i = 0; i < n_rows; i++){
+    if(i == 0 || (keys[i] >> pos_bits) != (keys[i-1] >> pos_bits)){
+      start_indices.push_back(i);
+    }
+  }
+  int n_coalesced_rows = start_indices.size();
+  start_indices.push_back(n_rows);
+
+  // 3. Noise of each coalesced index, then its values are accumulated on top
+  torch::Tensor out_indices = workspace_empty("coalesce_indices", {1, n_coalesced_rows}, torch::kInt64);
+  torch::Tensor out_values = workspace_empty("coalesce_values", {n_coalesced_rows, dim}, torch::kFloat);
+  long int *out_indices_ptr = out_indices.data<long int>();
+  float *out_values_ptr = out_values.data<float>();
+  float *values_ptr = values.data<float>();
+
+  dispatch_dim(dim, [&](auto D){
+    constexpr int DIM = decltype(D)::value;
+    #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(dynamic, 64)
+    for(int i = 0; i < n_coalesced_rows; i++){
+      long int row = keys[start_indices[i]] >> pos_bits;
+      out_indices_ptr[i] = row;
+      float *out_row = out_values_ptr + (long int)i * dim;
+      philox_normal_row(out_row, dim, std, seed, table, row, iteration);
+      for(long int j = start_indices[i]; j < start_indices[i+1]; j++){
+        add_row<DIM>(out_row, values_ptr + (keys[j] & pos_mask) * dim, dim);
+      }
+    }
+  });
+
+  torch::Tensor output = torch::sparse_coo_tensor(out_indices, out_values, {n_embs, dim});
+  output._coalesced_(true);
+  return output;
+}
+
+
+std::tuple<torch::Tensor, torch::Tensor, torch::Tensor> unique_with_inverse_and_counts(const torch::Tensor &input, int n_cores){
+  assert(input.is_contiguous());
+  long int n = input.numel();
+  long int *input_ptr = input.data<long int>();
+
+  torch::Tensor inverse = workspace_empty("unique_inverse", input.sizes(), torch::kInt64);
+  if(n == 0){
+    return std::make_tuple(torch::empty({0}, torch::kInt64), inverse, torch::empty({0}, torch::kInt64));
+  }
+
+  // 1. Sort (index, position) pairs once with the radix sort, directly from the input tensor
+  long int max_index = 0;
+  #pragma omp parallel for num_threads(pool_threads(n_cores)) reduction(max:max_index)
+  for(long int i = 0; i < n; i++){
+    max_index = std::max(max_index, input_ptr[i]);
+  }
+  scratch_vector<unsigned long int> keys_scratch("radix_keys", 0);
+  std::vector<unsigned long int> &keys = keys_scratch.vec;
+  int pos_bits;
+  if(!radix_sort_index_position(input_ptr, n, max_index + 1, keys, pos_bits, n_cores)){
+    return torch::_unique2(input, true, true, true);
+  }
+  unsigned long int pos_mask = (pos_bits == 64) ? ~0UL : ((1UL << pos_bits) - 1);
+
+  // 2. Number the runs of the same index
+  scratch_vector<long int> run_ids_scratch("unique_runs", n);
+  std::vector<long int> &run_ids = run_ids_scratch.vec;
+  #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(static)
+  for(long int i = 0; i < n; i++){
+    run_ids[i] = (i == 0 || (keys[i] >> pos_bits) != (keys[i-1] >> pos_bits)) ? 1 : 0;
+  }
+  in_tbb_arena([&]{ std::inclusive_scan(std::execution::par_unseq, run_ids.begin(), run_ids.end(), run_ids.begin()); });
+  long int n_unique = run_ids[n - 1];
+
+  // 3. Derive unique indices, inverse mapping and counts from the runs
+  torch::Tensor unique = workspace_empty("unique", {n_unique}, torch::kInt64);
+  torch::Tensor counts = workspace_empty("unique_counts", {n_unique}, torch::kInt64);
+  long int *unique_ptr = unique.data<long int>();
+  long int *inverse_ptr = inverse.data<long int>();
+  long int *counts_ptr = counts.data<long int>();
+  scratch_vector<long int> run_starts_scratch("unique_starts", n_unique + 1);
+  std::vector<long int> &run_starts = run_starts_scratch.vec;
+  run_starts[n_unique] = n;
+
+  #pragma omp parallel num_threads(pool_threads(n_cores))
+  {
+    #pragma omp for schedule(static)
+    for(long int i = 0; i < n; i++){
+      long int u = run_ids[i] - 1;
+      inverse_ptr[keys[i] & pos_mask] = u;
+      if(i == 0 || run_ids[i] != run_ids[i-1]){
+        unique_ptr[u] = keys[i] >> pos_bits;
+        run_starts[u] = i;
+      }
+    }
+    #pragma omp for schedule(static)
+    for(long int u = 0; u < n_unique; u++){
+      counts_ptr[u] = run_starts[u + 1] - run_starts[u];
+    }
+  }
+  return std::make_tuple(unique, inverse, counts);
+}
+
+// Coalesce a sparse gradient whose indices were already processed by
+// unique_with_inverse_and_counts(), so no sort is required.
+// Falls back to coalesce_radix() if the gradient indices do not match "unique[inverse]".
+torch::Tensor coalesce_with_inverse(const torch::Tensor &input, const torch::Tensor &unique, const torch::Tensor &inverse, const torch::Tensor &counts, int n_cores){
+  // If input tensor is already coalesced, just return
+  if(input.is_coalesced()){
+    return input;
+  }
+
+  torch::Tensor indices = input._indices();
+  torch::Tensor values = input._values();
+
+  // Set several variables
+  int n_embs = input.sizes()[0];
+  long int n_rows = values.sizes()[0];
+  int dim = values.sizes()[1];
+  long int n_unique = unique.numel();
+  assert(values.is_contiguous());
+  assert(counts.numel() == n_unique);
+  if(inverse.numel() != n_rows){
+    return coalesce_radix(input, n_cores);
+  }
+
+  // 1. Check that the gradient is built from the same indices (in the same order)
+  long int *indices_ptr = indices.data<long int>();
+  long int *unique_ptr = unique.data<long int>();
+  long int *inverse_ptr = inverse.data<long int>();
+  long int *counts_ptr = counts.data<long int>();
+  long int n_mismatch = 0;
+  #pragma omp parallel for num_threads(pool_threads(n_cores)) reduction(+:n_mismatch)
+  for(long int j = 0; j < n_rows; j++){
+    n_mismatch += (indices_ptr[j] != unique_ptr[inverse_ptr[j]]);
+  }
+  if(n_mismatch != 0){
+    return coalesce_radix(input, n_cores);
+  }
+
+  // 2. Bucket positions by their unique index (counting sort with the known counts)
+  scratch_vector<long int> starts_scratch("coalesce_starts", n_unique + 1);
+  std::vector<long int> &starts = starts_scratch.vec;
+  for(long int u = 0; u < n_unique; u++){
+    starts[u + 1] = starts[u] + counts_ptr[u];
+  }
+  assert(starts[n_unique] == n_rows);
+  scratch_vector<long int> cursor_scratch("coalesce_cursor", 0);
+  scratch_vector<long int> positions_scratch("coalesce_positions", n_rows);
+  std::vector<long int> &cursor = cursor_scratch.vec;
+  std::vector<long int> &positions = positions_scratch.vec;
+  cursor.assign(starts.begin(), starts.end() - 1);
+  for(long int j = 0; j < n_rows; j++){
+    positions[cursor[inverse_ptr[j]]++] = j;
+  }
+
+  // 3. Accumulate values of each unique index
+  torch::Tensor out_values = workspace_empty("coalesce_values", {n_unique, dim}, torch::kFloat);
+  float *out_values_ptr = out_values.data<float>();
+  float *values_ptr = values.data<float>();
+
+  dispatch_dim(dim, [&](auto D){
+    constexpr int DIM = decltype(D)::value;
+    #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(dynamic, 64)
+    for(long int u = 0; u < n_unique; u++){
+      float *out_row = out_values_ptr + u * dim;
+      copy_row<DIM>(out_row, values_ptr + positions[starts[u]] * dim, dim);
+      for(long int j = starts[u] + 1; j < starts[u + 1]; j++){
+        add_row<DIM>(out_row, values_ptr + positions[j] * dim, dim);
+      }
+    }
+  });
+
+  torch::Tensor output = torch::sparse_coo_tensor(unique.view({1, -1}), out_values, {n_embs, dim});
+  output._coalesced_(true);
+  return output;
+}
+
+// Sort plan of the indices of a table (int64), derived once where the indices are produced: the unique
+// indices, the stable sort permutation of the positions ("perm", positions of the same index in order)
+// and the offsets of the segment of each unique index in "perm" ("starts", n_unique + 1)
+std::tuple<torch::Tensor, torch::Tensor, torch::Tensor> sort_plan(const torch::Tensor &input, int n_cores){
+  assert(input.is_contiguous() && input.scalar_type() == torch::kInt64);
+  long int n = input.numel();
+  const long int *input_ptr = input.data<long int>();
+  scoped_trace trace("sort_plan", n, 3 * n * sizeof(long int));
+  torch::Tensor perm = torch::empty({n}, torch::kInt64);
+  if(n == 0){
+    return std::make_tuple(torch::empty({0}, torch::kInt64), perm, torch::zeros({1}, torch::kInt64));
+  }
+
+  long int max_index = 0;
+  #pragma omp parallel for num_threads(pool_threads(n_cores)) reduction(max:max_index)
+  for(long int i = 0; i < n; i++){
+    max_index = std::max(max_index, input_ptr[i]);
+  }
+  scratch_vector<unsigned long int> keys_scratch("radix_keys", 0);
+  std::vector<unsigned long int> &keys = keys_scratch.vec;
+  int pos_bits;
+  if(!radix_sort_index_position(input_ptr, n, max_index + 1, keys, pos_bits, n_cores)){
+    // indices too wide to pack with their positions: a stable sort of the tensor
+    torch::Tensor sorted;
+    std::tie(sorted, perm) = torch::sort(input.view({-1}), true, 0, false);
+    torch::Tensor unique, counts;
+    std::tie(unique, std::ignore, counts) = torch::unique_consecutive(sorted, false, true);
+    return std::make_tuple(unique, perm, torch::cat({torch::zeros({1}, torch::kInt64), counts.cumsum(0)}));
+  }
+  unsigned long int pos_mask = (pos_bits == 64) ? ~0UL : ((1UL << pos_bits) - 1);
+
+  // the keys are (index, position), so the sort is stable
+  long int *perm_ptr = perm.data<long int>();
+  long int n_unique = 0;
+  #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(static) reduction(+:n_unique)
+  for(long int i = 0; i < n; i++){
+    perm_ptr[i] = keys[i] & pos_mask;
+    n_unique += (i == 0 || (keys[i] >> pos_bits) != (keys[i-1] >> pos_bits));
+  }
+  torch::Tensor unique = torch::empty({n_unique}, torch::kInt64);
+  torch::Tensor starts = torch::empty({n_unique + 1}, torch::kInt64);
+  long int *unique_ptr = unique.data<long int>();
+  long int *starts_ptr = starts.data<long int>();
+  long int u = 0;
+  for(long int i = 0; i < n; i++){
+    if(i == 0 || (keys[i] >> pos_bits) != (keys[i-1] >> pos_bits)){
+      unique_ptr[u] = keys[i] >> pos_bits;
+      starts_ptr[u++] = i;
+    }
+  }
+  starts_ptr[n_unique] = n;
+  return std::make_tuple(unique, perm, starts);
+}
+
+// Coalesce a sparse gradient whose indices are those of a sort plan (sort_plan()), in the same order:
+// the segmented reduction of the values along "perm", without sorting or bucketing the indices.
+// Falls back to coalesce_radix() if the gradient indices do not match the plan.
+torch::Tensor coalesce_with_sort_plan(const torch::Tensor &input, const torch::Tensor &unique, const torch::Tensor &perm, const torch::Tensor &starts, int n_cores){
+  // If input tensor is already coalesced, just return
+  if(input.is_coalesced()){
+    return input;
+  }
+
+  torch::Tensor indices = input._indices();
+  torch::Tensor values = input._values();
+  int n_embs = input.sizes()[0];
+  long int n_rows = values.sizes()[0];
+  int dim = values.sizes()[1];
+  long int n_unique = unique.numel();
+  assert(values.is_contiguous());
+  assert(starts.numel() == n_unique + 1);
+  if(perm.numel() != n_rows){
+    return coalesce_radix(input, n_cores);
+  }
+  scoped_trace trace("coalesce_with_sort_plan", n_rows, 2 * (long int)n_rows * dim * sizeof(float));
+
+  // 1. Check that the gradient is built from the same indices (in the same order)
+  const long int *indices_ptr = indices.data<long int>();
+  const long int *unique_ptr = unique.data<long int>();
+  const long int *perm_ptr = perm.data<long int>();
+  const long int *starts_ptr = starts.data<long int>();
+  long int n_mismatch = 0;
+  #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(static) reduction(+:n_mismatch)
+  for(long int u = 0; u < n_unique; u++){
+    for(long int j = starts_ptr[u]; j < starts_ptr[u + 1]; j++){
+      n_mismatch += (indices_ptr[perm_ptr[j]] != unique_ptr[u]);
+    }
+  }
+  if(n_mismatch != 0){
+    return coalesce_radix(input, n_cores);
+  }
+
+  // 2. Segmented reduction
+  torch::Tensor out_values = workspace_empty("coalesce_values", {n_unique, dim}, torch::kFloat);
+  float *out_values_ptr = out_values.data<float>();
+  float *values_ptr = values.data<float>();
+
+  dispatch_dim(dim, [&](auto D){
+    constexpr int DIM = decltype(D)::value;
+    #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(dynamic, 64)
+    for(long int u = 0; u < n_unique; u++){
+      float *out_row = out_values_ptr + u * dim;
+      copy_row<DIM>(out_row, values_ptr + perm_ptr[starts_ptr[u]] * dim, dim);
+      for(long int j = starts_ptr[u] + 1; j < starts_ptr[u + 1]; j++){
+        add_row<DIM>(out_row, values_ptr + perm_ptr[j] * dim, dim);
+      }
+    }
+  });
+
+  torch::Tensor output = torch::sparse_coo_tensor(unique.view({1, -1}), out_values, {n_embs, dim});
+  output._coalesced_(true);
+  return output;
+}
+
+
+// splitmix64 finalizer, used to spread embedding indices over threads and hash slots
+inline unsigned long int hash_index(long int key){
+  unsigned long int h = (unsigned long int)key + 0x9E3779B97F4A7C15UL;
+  h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9UL;
+  h = (h ^ (h >> 27)) * 0x94D049BB133111EBUL;
+  return h ^ (h >> 31);
+}
+
+torch::Tensor coalesce_hash(const torch::Tensor &input, bool sorted, int n_cores){
+  // If input tensor is already coalesced, just return
+  if(input.is_coalesced()){
+    return input;
+  }
+
+  torch::Tensor indices = input._indices();
+  torch::Tensor values = input._values();
+
+  // Set several variables
+  int n_embs = input.sizes()[0];
+  int n_rows = values.sizes()[0];
+  int dim = values.sizes()[1];
+  assert(dim == input.sizes()[1]);
+  assert(indices.sizes()[0] == 1);
+  assert(indices.sizes()[1] == n_rows);
+  assert(values.is_contiguous());
+
+  long int *indices_ptr = indices.data<long int>();
+  float *values_ptr = values.data<float>();
+  int n_threads = std::max(1, std::min(pool_threads(n_cores), n_rows / 1024));
+
+  // Each index is owned by exactly one thread (by its hash), so threads never
+  // write the same output row and no merge of per-thread maps is required
+  scratch_vector<unsigned short> owner_scratch("hash_owner", n_rows);
+  std::vector<unsigned short> &owner = owner_scratch.vec;
+  #pragma omp parallel for num_threads(n_threads) schedule(static)
+  for(int i = 0; i < n_rows; i++){
+    owner[i] = hash_index(indices_ptr[i]) % n_threads;
+  }
+
+  std::vector<kernel_vector<long int>> local_keys(n_threads); // index of each local slot
+  std::vector<kernel_vector<int_pair>> local_rows(n_threads); // (position, local slot)
+  std::vector<long int> offsets(n_threads + 1, 0);
+  kernel_vector<long int> rank; // global slot -> output row, only when "sorted"
+  torch::Tensor out_indices;
+  torch::Tensor out_values;
+
+  #pragma omp parallel num_threads(n_threads)
+  {
+    int t = omp_get_thread_num();
+    kernel_vector<long int> &keys = local_keys[t];
+    kernel_vector<int_pair> &rows = local_rows[t];
+
+    // 1. Collect positions owned by this thread
+    for(int i = 0; i < n_rows; i++){
+      if(owner[i] == t){
+        rows.push_back(int_pair(i, -1));
+      }
+    }
+
+    // 2. Map each index to a local slot with an open-addressing hash map (linear probing)
+    unsigned long int capacity = 16;
+    while(capacity < 2 * rows.size()){
+      capacity <<= 1;
+    }
+    unsigned long int mask = capacity - 1;
+    kernel_vector<long int> table_keys(capacity, -1);
+    kernel_vector<long int> table_slots(capacity);
+    for(int_pair &row : rows){
+      long int key = indices_ptr[row.first];
+      unsigned long int h = (hash_index(key) >> 16) & mask;
+      while(table_keys[h] != -1 && table_keys[h] != key){
+        h = (h + 1) & mask;
+      }
+      if(table_keys[h] == -1){
+        table_keys[h] = key;
+        table_slots[h] = keys.size();
+        keys.push_back(key);
+      }
+      row.second = table_slots[h];
+    }
+    offsets[t + 1] = keys.size();
+    #pragma omp barrier
+
+    #pragma omp single
+    {
+      for(int u = 0; u < n_threads; u++){
+        offsets[u + 1] += offsets[u];
+      }
+      long int n_coalesced_rows = offsets[n_threads];
+      out_indices = workspace_empty("coalesce_indices", {1, n_coalesced_rows}, torch::kInt64);
+      out_values = workspace_empty("coalesce_values", {n_coalesced_rows, dim}, torch::kFloat);
+
+      if(sorted){
+        kernel_vector<int_pair> key_slot(n_coalesced_rows);
+        for(int u = 0; u < n_threads; u++){
+          for(long int j = 0; j < (long int)local_keys[u].size(); j++){
+            key_slot[offsets[u] + j] = int_pair(local_keys[u][j], offsets[u] + j);
+          }
+        }
+        in_tbb_arena([&]{ std::sort(std::execution::par_unseq, key_slot.begin(), key_slot.end(), [](const int_pair lhs, const int_pair rhs){
+          return lhs.first < rhs.first;
+        }); });
+        rank.resize(n_coalesced_rows);
+        for(long int r = 0; r < n_coalesced_rows; r++){
+          rank[key_slot[r].second] = r;
+        }
+      }
+    }
+
+    // 3. Accumulate values of each local slot into its output row
+    long int *out_indices_ptr = out_indices.data<long int>();
+    float *out_values_ptr = out_values.data<float>();
+    kernel_vector<char> initialized(keys.size(), 0);
+    dispatch_dim(dim, [&](auto D){
+      constexpr int DIM = decltype(D)::value;
+      for(const int_pair &row : rows){
+        long int global_slot = offsets[t] + row.second;
+        long int out_row_idx = sorted ? rank[global_slot] : global_slot;
+        float *out_row = out_values_ptr + out_row_idx * dim;
+        float *in_row = values_ptr + row.first * dim;
+        if(!initialized[row.second]){
+          initialized[row.second] = 1;
+          out_indices_ptr[out_row_idx] = keys[row.second];
+          copy_row<DIM>(out_row, in_row, dim);
+        }
+        else{
+          add_row<DIM>(out_row, in_row, dim);
+        }
+      }
+    });
+  }
+
+  // When "sorted" is false, indices are unique but not sorted. The output is still marked as
+  // coalesced so that indices()/values() are accessible (e.g., by the optimizer step)
+  torch::Tensor output = torch::sparse_coo_tensor(out_indices, out_values, {n_embs, dim});
+  output._coalesced_(true);
+  return output;
+}
+
+
+// Tables of at most this many rows per gradient row are coalesced by coalesce_dense() with "auto"
+const long int DENSE_COALESCE_RATIO = 64;
+
+// Coalescing without sorting for tables that are small compared with the gradient (e.g., 20K-600K rows):
+// the touched rows are set in a bitmap of the table (one bit per row), and the rank of a row among the
+// touched ones (popcounts of the words before it, prefix-summed) is its output row. The output rows are
+// thus sorted, and each gradient row is scatter-added directly into its output row, i.e., a dense
+// accumulator of the table compacted to its touched rows. O(n_rows + n_embs / 64), no sort
+ISA_CLONES row_sparse coalesce_dense_rows(const torch::Tensor &indices, const torch::Tensor &values, long int n_embs, int n_cores){
+  // Set several variables
+  long int n_rows = values.sizes()[0];
+  int dim = values.sizes()[1];
+  long int n_words = (n_embs + 63) / 64;
+  assert(indices.numel() == n_rows);
+  assert(indices.is_contiguous());
+  assert(values.is_contiguous());
+  scoped_trace trace("coalesce_dense", n_rows, 2 * n_rows * dim * sizeof(float) + n_words * 2 * sizeof(long int));
+
+  const long int *indices_ptr = indices.data<long int>();
+  const float *values_ptr = values.data<float>();
+  int n_threads = pool_threads(n_cores);
+
+  // 1. Bitmap of the touched rows
+  scratch_vector<unsigned long int> bitmap_scratch("dense_bitmap", n_words);
+  scratch_vector<long int> word_rank_scratch("dense_word_rank", n_words + 1);
+  scratch_vector<long int> slot_scratch("dense_slots", n_rows);
+  std::vector<unsigned long int> &bitmap = bitmap_scratch.vec;
+  std::vector<long int> &word_rank = word_rank_scratch.vec;
+  std::vector<long int> &slot = slot_scratch.vec;
+  unsigned long int *bitmap_ptr = bitmap.data(); // zeroed by the lease
+
+  #pragma omp parallel for num_threads(n_threads) schedule(static)
+  for(long int i = 0; i < n_rows; i++){
+    long int row = indices_ptr[i];
+    assert(row >= 0 && row < n_embs);
+    __atomic_fetch_or(&bitmap_ptr[row >> 6], 1UL << (row & 63), __ATOMIC_RELAXED);
+  }
+
+  // 2. Output row of the first touched row of each word (popcount prefix sum)
+  word_rank[0] = 0;
+  for(long int w = 0; w < n_words; w++){
+    word_rank[w + 1] = word_rank[w] + __builtin_popcountl(bitmap_ptr[w]);
+  }
+  long int n_coalesced_rows = word_rank[n_words];
+
+  // 3. Sorted output indices, and the output row of each gradient row
+  torch::Tensor out_indices = workspace_empty("coalesce_indices", {n_coalesced_rows}, torch::kInt64);
+  torch::Tensor out_values = workspace_empty("coalesce_values", {n_coalesced_rows, dim}, torch::kFloat);
+  long int *out_indices_ptr = out_indices.data<long int>();
+  float *out_values_ptr = out_values.data<float>();
+
+  #pragma omp parallel for num_threads(n_threads) schedule(static)
+  for(long int w = 0; w < n_words; w++){
+    unsigned long int bits = bitmap_ptr[w];
+    for(long int r = word_rank[w]; bits != 0; r++, bits &= bits - 1){
+      out_indices_ptr[r] = w * 64 + __builtin_ctzl(bits);
+    }
+  }
+  #pragma omp parallel for num_threads(n_threads) schedule(static)
+  for(long int i = 0; i < n_rows; i++){
+    long int row = indices_ptr[i];
+    unsigned long int below = bitmap_ptr[row >> 6] & ((1UL << (row & 63)) - 1);
+    slot[i] = word_rank[row >> 6] + __builtin_popcountl(below);
+  }
+
+  // 4. Scatter-add: thread t owns the output rows [t * n_coalesced_rows / n_threads, (t + 1) * ...),
+  // zeroes them and adds the gradient rows landing in them, so threads never write the same row
+  dispatch_dim(dim, [&](auto D){
+    constexpr int DIM = decltype(D)::value;
+    #pragma omp parallel num_threads(n_threads)
+    {
+      int t = omp_get_thread_num();
+      int n_team = omp_get_num_threads();
+      long int begin = n_coalesced_rows * t / n_team;
+      long int end = n_coalesced_rows * (t + 1) / n_team;
+      std::fill(out_values_ptr + begin * dim, out_values_ptr + end * dim, 0.0f);
+      for(long int i = 0; i < n_rows; i++){
+        long int r = slot[i];
+        if(r >= begin && r < end){
+          add_row<DIM>(out_values_ptr + r * dim, values_ptr + i * dim, dim);
+        }
+      }
+    }
+  });
+
+  return row_sparse(out_indices, out_values);
+}
+
+torch::Tensor coalesce_dense(const torch::Tensor &input, int n_cores){
+  // If input tensor is already coalesced, just return
+  if(input.is_coalesced()){
+    return input;
+  }
+  assert(input._indices().sizes()[0] == 1);
+  assert(input._values().sizes()[1] == input.sizes()[1]);
+  return row_sparse_to_coo(coalesce_dense_rows(input._indices().view(-1), input._values(), input.sizes()[0], n_cores), input.sizes()[0]);
+}
+
+// Row-sparse coalescing of the raw gradient ("indices", "values") of a table of "n_embs" rows,
+// coalesce_dense_rows() or coalesce_radix_rows() as coalesce_auto() picks them
+row_sparse coalesce_rows(const torch::Tensor &indices, const torch::Tensor &values, long int n_embs, int n_cores){
+  torch::Tensor indices_contiguous = indices.view(-1).contiguous();
+  torch::Tensor values_contiguous = values.contiguous();
+  if(n_embs <= DENSE_COALESCE_RATIO * values.sizes()[0]){
+    return coalesce_dense_rows(indices_contiguous, values_contiguous, n_embs, n_cores);
+  }
+  return coalesce_radix_rows(indices_contiguous, values_contiguous, n_embs, n_cores);
+}
+
+// coalesce_dense() for a table of at most DENSE_COALESCE_RATIO rows per gradient row, coalesce_radix() otherwise
+torch::Tensor coalesce_auto(const torch::Tensor &input, int n_cores){
+  if(input.sizes()[0] <= DENSE_COALESCE_RATIO * input._values().sizes()[0]){
+    return coalesce_dense(input, n_cores);
+  }
+  return coalesce_radix(input, n_cores);
+}
+
+// Norm factor of each bag of a sum-pooled EmbeddingBag: the gradient of bag b puts c_k copies of
+// its backprop g on each distinct row k, so its norm is ||g|| * sqrt(sum_k c_k^2). With per-sample
+// weights ("weights", one per index, empty for unit weights), c_k is the sum of the weights of the
+// positions of row k in the bag, e.g., ||g|| * ||w_b||_2 for a bag without duplicate indices
+torch::Tensor bag_norm_factors(const torch::Tensor &indices, const torch::Tensor &offsets, const torch::Tensor &weights, int n_cores){
+  int n_bags = offsets.numel();
+  long int n_rows = indices.numel();
+  bool weighted = weights.numel() > 0;
+  assert(!weighted || weights.numel() == n_rows);
+  torch::Tensor indices_contiguous = indices.contiguous();
+  torch::Tensor offsets_contiguous = offsets.contiguous();
+  torch::Tensor weights_contiguous = weighted ? weights.to(torch::kFloat).contiguous() : weights;
+  const long int *indices_ptr = indices_contiguous.data<long int>();
+  const long int *offsets_ptr = offsets_contiguous.data<long int>();
+  const float *weights_ptr = weighted ? weights_contiguous.data<float>() : nullptr;
+  torch::Tensor output = torch::empty({n_bags}, torch::kFloat);
+  float *output_ptr = output.data<float>();
+
+  #pragma omp parallel num_threads(pool_threads(n_cores))
+  {
+    kernel_vector<long int> bag;
+    kernel_vector<std::pair<long int, float>> weighted_bag;
+    #pragma omp for schedule(dynamic, 64)
+    for(int b = 0; b < n_bags; b++){
+      long int start = offsets_ptr[b];
+      long int end = b + 1 < n_bags ? offsets_ptr[b + 1] : n_rows;
+      if(weighted){
+        // sum of the squared summed weights of the distinct indices
+        weighted_bag.clear();
+        for(long int j = start; j < end; j++){
+          weighted_bag.emplace_back(indices_ptr[j], weights_ptr[j]);
+        }
+        std::sort(weighted_bag.begin(), weighted_bag.end());
+        double sum_squares = 0;
+        for(size_t i = 0; i < weighted_bag.size();){
+          double c = 0;
+          size_t j = i;
+          for(; j < weighted_bag.size() && weighted_bag[j].first == weighted_bag[i].first; j++){
+            c += weighted_bag[j].second;
+          }
+          sum_squares += c * c;
+          i = j;
+        }
+        output_ptr[b] = (float)std::sqrt(sum_squares);
+        continue;
+      }
+      bag.assign(indices_ptr + start, indices_ptr + end);
+      std::sort(bag.begin(), bag.end());
+      // sum of the squared multiplicities of the distinct indices
+      long int sum_squares = 0;
+      for(size_t i = 0; i < bag.size();){
+        size_t j = i + 1;
+        while(j < bag.size() && bag[j] == bag[i]){
+          j++;
+        }
+        sum_squares += (long int)(j - i) * (j - i);
+        i = j;
+      }
+      output_ptr[b] = std::sqrt((float)sum_squares);
+    }
+  }
+  return output;
+}
+
+
+// Clipped and coalesced gradient of a sum-pooled EmbeddingBag from its per-bag representation:
+// the gradient of bag b is "backprops"[b] for every index of the bag (times its per-sample weight
+// with "weights", one per index, empty for unit weights), so out[row] = sum of "clip"[b] * w_j *
+// "backprops"[b] over the positions j of row in "indices" (bag b by "offsets"), without
+// materializing a row per index
+torch::Tensor coalesce_bag_gradient(const torch::Tensor &backprops, const torch::Tensor &clip, const torch::Tensor &indices, const torch::Tensor &offsets, const torch::Tensor &weights, long int n_embs, int n_cores){
+  int n_bags = backprops.sizes()[0];
+  int dim = backprops.sizes()[1];
+  long int n_rows = indices.numel();
+  bool weighted = weights.numel() > 0;
+  assert(backprops.is_contiguous());
+  assert(backprops.scalar_type() == torch::kFloat && clip.scalar_type() == torch::kFloat);
+  assert(clip.numel() == n_bags);
+  assert(offsets.numel() == n_bags);
+  assert(!weighted || weights.numel() == n_rows);
+  torch::Tensor indices_contiguous = indices.contiguous();
+  torch::Tensor offsets_contiguous = offsets.contiguous();
+  torch::Tensor weights_contiguous = weighted ? weights.to(torch::kFloat).contiguous() : weights;
+  const long int *indices_ptr = indices_contiguous.data<long int>();
+  const long int *offsets_ptr = offsets_contiguous.data<long int>();
+  const float *weights_ptr = weighted ? weights_contiguous.data<float>() : nullptr;
+
+  // 1. Bag of each position, and (index, position) pairs sorted by index
+  scratch_vector<int> bag_scratch("bag_of", n_rows);
+  scratch_vector<int_pair> pairs_scratch("coalesce_pairs", n_rows);
+  std::vector<int> &bag_of = bag_scratch.vec;
+  std::vector<int_pair> &pairs = pairs_scratch.vec;
+  #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(static)
+  for(int b = 0; b < n_bags; b++){
+    long int end = b + 1 < n_bags ? offsets_ptr[b + 1] : n_rows;
+    for(long int j = offsets_ptr[b]; j < end; j++){
+      bag_of[j] = b;
+      pairs[j] = int_pair(indices_ptr[j], j);
+    }
+  }
+  in_tbb_arena([&]{ std::sort(std::execution::par_unseq, pairs.begin(), pairs.end(), [](const int_pair lhs, const int_pair rhs){
+    return lhs.first < rhs.first;
+  }); });
+
+  // 2. Start position of each coalesced index
+  scratch_vector<long int> start_scratch("coalesce_starts", 0);
+  std::vector<long int> &start_indices = start_scratch.vec;
+  for(long int i = 0; i < n_rows; i++){
+    if(i == 0 || pairs[i].first != pairs[i-1].first){
+      start_indices.push_back(i);
+    }
+  }
+  long int n_coalesced_rows = start_indices.size();
+  start_indices.push_back(n_rows);
+
+  // 3. Accumulate the clipped backprops of each coalesced index
+  torch::Tensor out_indices = workspace_empty("coalesce_indices", {1, n_coalesced_rows}, torch::kInt64);
+  torch::Tensor out_values = workspace_empty("coalesce_values", {n_coalesced_rows, dim}, torch::kFloat);
+  long int *out_indices_ptr = out_indices.data<long int>();
+  float *out_values_ptr = out_values.data<float>();
+  const float *backprops_ptr = backprops.data<float>();
+  const float *clip_ptr = clip.data<float>();
+
+  #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(dynamic, 64)
+  for(long int i = 0; i < n_coalesced_rows; i++){
+    out_indices_ptr[i] = pairs[start_indices[i]].first;
+    float *out_row = out_values_ptr + i * dim;
+    std::fill(out_row, out_row + dim, 0);
+    for(long int j = start_indices[i]; j < start_indices[i+1]; j++){
+      int b = bag_of[pairs[j].second];
+      float c = weighted ? clip_ptr[b] * weights_ptr[pairs[j].second] : clip_ptr[b];
+      const float *row = backprops_ptr + (long int)b * dim;
+      #pragma omp simd
+      for(int k = 0; k < dim; k++){
+        out_row[k] += c * row[k];
+      }
+    }
+  }
+
+  torch::Tensor output = torch::sparse_coo_tensor(out_indices, out_values, {n_embs, dim});
+  output._coalesced_(true);
+  return output;
+}
+
+
+// A row of the embedding table touched by the delayed noise update, i.e., a row which
+// gets the delayed noise (noise_slot != -1), the gradient (grad_start <= grad_end), or both
+struct fused_update_row{
+  long int row;
+  long int noise_slot;
+  long int grad_start;
+  long int grad_end;
+};
+
+// Merge the sorted unique noise indices with the raw (uncoalesced) gradient indices, so that
+// every touched row appears exactly once in the returned (sorted) rows. The gradient is not
+// sorted again if it is already coalesced. "grad_pairs" gets the
+// sorted (index, position) pairs of the gradient which grad_start/grad_end refer to.
+void merge_noise_grad_rows(const torch::Tensor &noise_indices, const torch::Tensor &grad_indices, bool grad_is_coalesced, long int n_embs, std::vector<int_pair> &grad_pairs, std::vector<fused_update_row> &rows){
+  int n_rows_noise = noise_indices.numel();
+  int n_rows_grad = grad_indices.numel();
+
+  // 1. Sort (index, position) pairs of the raw gradient
+  long int *grad_indices_ptr = grad_indices.data<long int>();
+  grad_pairs.resize(n_rows_grad);
+  in_tbb_arena([&]{ std::for_each(std::execution::par_unseq, grad_pairs.begin(), grad_pairs.end(), [&](int_pair &pair){
+    unsigned long int i = (uintptr_t(&pair) - uintptr_t(grad_pairs.data())) / sizeof(int_pair);
+    pair.first = grad_indices_ptr[i];
+    pair.second = i;
+  }); });
+  if(!grad_is_coalesced){
+    in_tbb_arena([&]{ std::sort(std::execution::par_unseq, grad_pairs.begin(), grad_pairs.end(), [](const int_pair lhs, const int_pair rhs){
+      return lhs.first < rhs.first;
+    }); });
+  }
+
+  // 2. Two-pointer merge of the two sorted index lists
+  long int *noise_indices_ptr = n_rows_noise > 0 ? noise_indices.data<long int>() : nullptr;
+  rows.clear();
+  rows.reserve(n_rows_noise + n_rows_grad);
+  int p_noise = 0;
+  int p_grad = 0;
+  while(p_noise < n_rows_noise || p_grad < n_rows_grad){
+    long int row_noise = p_noise < n_rows_noise ? noise_indices_ptr[p_noise] : n_embs;
+    long int row_grad = p_grad < n_rows_grad ? grad_pairs[p_grad].first : n_embs;
+    fused_update_row r;
+    r.row = std::min(row_noise, row_grad);
+    r.noise_slot = -1;
+    r.grad_start = 0;
+    r.grad_end = -1;
+    if(row_noise == r.row){
+      assert(p_noise == 0 || noise_indices_ptr[p_noise - 1] < row_noise);
+      r.noise_slot = p_noise++;
+    }
+    if(row_grad == r.row){
+      r.grad_start = p_grad;
+      while(p_grad < n_rows_grad && grad_pairs[p_grad].first == r.row){
+        p_grad++;
+      }
+      r.grad_end = p_grad - 1;
+    }
+    rows.push_back(r);
+  }
+}
+
+// Load a row of fp32/bf16/fp16 noise as fp32 (upcast on the fly)
+inline void load_noise_row(float *out, const void *noise_ptr, ScalarType noise_type, long int row, int dim){
+  if(noise_type == torch::kBFloat16){
+    const at::BFloat16 *in = (const at::BFloat16 *)noise_ptr + row * dim;
+    for(int k = 0; k < dim; k++){
+      out[k] = float(in[k]);
+    }
+  }
+  else if(noise_type == torch::kHalf){
+    const at::Half *in = (const at::Half *)noise_ptr + row * dim;
+    for(int k = 0; k < dim; k++){
+      out[k] = float(in[k]);
+    }
+  }
+  else{
+    memcpy(out, (const float *)noise_ptr + row * dim, dim * sizeof(float));
+  }
+}
+
+// Row-sparse merge of the delayed noise and the raw gradient ("grad_indices", "grad_values"), which is
+// sorted again only if "grad_is_coalesced" is false
+ISA_CLONES row_sparse merge_noise_and_grad_rows(const torch::Tensor &noise_indices, const torch::Tensor &noise, const torch::Tensor &grad_indices, const torch::Tensor &grad_values, long int n_embs, bool grad_is_coalesced, int n_cores){
+  // Set several variables
+  int dim = grad_values.sizes()[1];
+  int n_rows_noise = noise_indices.numel();
+  int n_rows_grad = grad_values.sizes()[0];
+  assert(noise.is_contiguous());
+  assert(grad_values.is_contiguous());
+  assert(grad_indices.numel() == n_rows_grad);
+  assert(noise.sizes()[0] == n_rows_noise);
+  assert(n_rows_noise == 0 || noise.sizes()[1] == dim);
+
+  // 1. Derive the coalesced rows
+  scratch_vector<int_pair> grad_pairs_scratch("merge_pairs", 0);
+  scratch_vector<fused_update_row> rows_scratch("merge_rows", 0);
+  std::vector<int_pair> &grad_pairs = grad_pairs_scratch.vec;
+  std::vector<fused_update_row> &rows = rows_scratch.vec;
+  merge_noise_grad_rows(noise_indices, grad_indices.contiguous(), grad_is_coalesced, n_embs, grad_pairs, rows);
+  int n_rows = rows.size();
+  scoped_trace trace("merge_noise_and_grad", n_rows, ((long int)n_rows + n_rows_grad + n_rows_noise) * dim * sizeof(float));
+
+  // 2. out[row] = noise (if any) + sum of gradients, written directly into the coalesced output
+  torch::Tensor out_indices = workspace_empty("coalesce_indices", {n_rows}, torch::kInt64);
+  torch::Tensor out_values = workspace_empty("coalesce_values", {n_rows, dim}, torch::kFloat);
+  long int *out_indices_ptr = out_indices.data<long int>();
+  float *out_values_ptr = out_values.data<float>();
+  const void *noise_ptr = n_rows_noise > 0 ? noise.data_ptr() : nullptr;
+  ScalarType noise_type = noise.scalar_type();
+  assert(noise_type == torch::kFloat || noise_type == torch::kBFloat16 || noise_type == torch::kHalf);
+  float *values_ptr = n_rows_grad > 0 ? grad_values.data<float>() : nullptr;
+
+  dispatch_dim(dim, [&](auto D){
+    constexpr int DIM = decltype(D)::value;
+    #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(dynamic, 64)
+    for(int i = 0; i < n_rows; i++){
+      const fused_update_row &r = rows[i];
+      float *out_row = out_values_ptr + (long int)i * dim;
+      out_indices_ptr[i] = r.row;
+      if(r.noise_slot != -1){
+        load_noise_row(out_row, noise_ptr, noise_type, r.noise_slot, dim);
+      }
+      else{
+        std::fill(out_row, out_row + dim, 0);
+      }
+      for(long int j = r.grad_start; j <= r.grad_end; j++){
+        add_row<DIM>(out_row, values_ptr + grad_pairs[j].second * dim, dim);
+      }
+    }
+  });
+
+  return row_sparse(out_indices, out_values);
+}
+
+torch::Tensor merge_noise_and_grad(const torch::Tensor &noise_indices, const torch::Tensor &noise, const torch::Tensor &grad, int n_cores){
+  assert(grad._indices().sizes()[0] == 1);
+  assert(grad._values().sizes()[1] == grad.sizes()[1]);
+  return row_sparse_to_coo(merge_noise_and_grad_rows(noise_indices, noise, grad._indices().view(-1), grad._values(), grad.sizes()[0], grad.is_coalesced(), n_cores), grad.sizes()[0]);
+}
+
+// Stochastic rounding of "x" to bf16/fp16: rounds to the neighbor on the other side of "x" with
+// probability proportional to the distance from the nearest one, so the rounding is unbiased
+// and small updates are not lost (u in [0, 1))
+template<typename T>
+inline T round_stochastic(float x, float u){
+  T nearest = T(x);
+  float f_nearest = float(nearest);
+  if(f_nearest == x || !std::isfinite(f_nearest)){
+    return nearest;
+  }
+  // sign-magnitude: bits + 1 is the next larger magnitude, bits - 1 the next smaller one
+  uint16_t bits = nearest.x;
+  if(f_nearest == 0){
+    bits = (x < 0 ? 0x8000 : 0x0000) + 1;
+  }
+  else if(fabsf(x) > fabsf(f_nearest)){
+    bits++;
+  }
+  else{
+    bits--;
+  }
+  T other = T(bits, T::from_bits());
+  float p = (x - f_nearest) / (float(other) - f_nearest);
+  return u < p ? other : nearest;
+}
+
+// weight[row] -= lr * acc, accumulated in fp32 and stored in the precision of the table
+// ("u": uniform variables of the stochastic rounding, round to nearest if null)
+template<typename T>
+inline void sgd_update_row(T *weight_row, const float *acc, float lr, int dim, const float *u){
+  for(int k = 0; k < dim; k++){
+    float w = float(weight_row[k]) - lr * acc[k];
+    weight_row[k] = u != nullptr ? round_stochastic<T>(w, u[k]) : T(w);
+  }
+}
+
+template<>
+inline void sgd_update_row<float>(float *weight_row, const float *acc, float lr, int dim, const float *u){
+  for(int k = 0; k < dim; k++){
+    weight_row[k] -= lr * acc[k];
+  }
+}
+
+// Row-wise int8 row in the format of embedding_bag_byte_prepack: "dim" uint8 values followed by
+// fp32 scale and bias (value = q * scale + bias). The row is dequantized, updated in fp32
+// ("buffer") and requantized with the range of the updated row
+const int ROWWISE_INT8_EXTRA = 2 * sizeof(float);
+
+inline void sgd_update_row_int8(uint8_t *row, float *buffer, const float *acc, float lr, int dim, const float *u){
+  float scale_bias[2];
+  memcpy(scale_bias, row + dim, sizeof(scale_bias));
+  float w_min = INFINITY;
+  float w_max = -INFINITY;
+  for(int k = 0; k < dim; k++){
+    buffer[k] = row[k] * scale_bias[0] + scale_bias[1] - lr * acc[k];
+    w_min = std::min(w_min, buffer[k]);
+    w_max = std::max(w_max, buffer[k]);
+  }
+  float scale = (w_max - w_min) / 255.0f;
+  float inv_scale = 255.0f / (w_max - w_min + 1e-8f);
+  for(int k = 0; k < dim; k++){
+    float q = (buffer[k] - w_min) * inv_scale;
+    q = u != nullptr ? floorf(q + u[k]) : nearbyintf(q);
+    row[k] = (uint8_t)std::min(std::max(q, 0.0f), 255.0f);
+  }
+  scale_bias[0] = scale;
+  scale_bias[1] = w_min;
+  memcpy(row + dim, scale_bias, sizeof(scale_bias));
+}
+
+// Dense DP-SGD update of an fp32 table without a table-sized noise tensor: weight[row] -= lr * (noise + grad[row])
+// for every row, with noise ~ N(0, std^2) sampled into a buffer of DENSE_NOISE_CHUNK_ROWS rows per thread
+const long int DENSE_NOISE_CHUNK_ROWS = 4096;
+
+void dense_noise_sgd_update(torch::Tensor &weight, const torch::Tensor &grad, float std, float lr, long int seed, int table, int iteration, int n_cores){
+  assert(weight.dim() == 2 && weight.is_contiguous() && weight.scalar_type() == torch::kFloat);
+  assert(grad.is_coalesced());
+  long int n_rows = weight.sizes()[0];
+  int dim = weight.sizes()[1];
+  torch::Tensor values = grad._values().contiguous();
+  torch::Tensor indices = grad._indices().contiguous();
+  long int nnz = values.sizes()[0];
+  const long int *indices_ptr = indices.data<long int>();
+  const float *values_ptr = values.data<float>();
+  float *weight_ptr = weight.data<float>();
+  long int n_chunks = (n_rows + DENSE_NOISE_CHUNK_ROWS - 1) / DENSE_NOISE_CHUNK_ROWS;
+
+  #pragma omp parallel num_threads(pool_threads(n_cores))
+  {
+    torch::Generator generator = thread_generator();
+    kernel_vector<float> noise(DENSE_NOISE_CHUNK_ROWS * dim);
+    #pragma omp for schedule(dynamic)
+    for(long int c = 0; c < n_chunks; c++){
+      long int start = c * DENSE_NOISE_CHUNK_ROWS;
+      long int end = std::min(start + DENSE_NOISE_CHUNK_ROWS, n_rows);
+      if(seed < 0){
+        torch::Tensor noise_slice = torch::from_blob(noise.data(), {end - start, dim}, torch::kFloat);
+        torch::normal_out(noise_slice, 0, std, {end - start, dim}, generator);
+      }
+      // the (sorted) gradient rows within the chunk
+      long int j = std::lower_bound(indices_ptr, indices_ptr + nnz, start) - indices_ptr;
+      for(long int row = start; row < end; row++){
+        float *acc = noise.data() + (row - start) * dim;
+        if(seed >= 0){
+          philox_normal_row(acc, dim, std, seed, table, row, iteration);
+        }
+        if(j < nnz && indices_ptr[j] == row){
+          const float *grad_row = values_ptr + j * dim;
+          #pragma omp simd
+          for(int k = 0; k < dim; k++){
+            acc[k] += grad_row[k];
+          }
+          j++;
+        }
+        sgd_update_row<float>(weight_ptr + row * dim, acc, lr, dim, nullptr);
+      }
+    }
+  }
+}
+
+// Bags of the next batch pooled by fused_delayed_noise_sgd_update_and_pool: the positions of the bag
+// indices grouped by their slot in the (sorted, unique) noise indices, and the bag of each position
+struct bag_pool_plan{
+  std::vector<long int> slot_start; // positions of slot s: positions[slot_start[s]:slot_start[s + 1]]
+  std::vector<long int> positions;
+  std::vector<long int> bag_of;
+  std::vector<int> bag_length;
+  float *pooled_ptr;
+};
+
+void build_bag_pool_plan(bag_pool_plan &plan, const torch::Tensor &noise_indices, const torch::Tensor &bag_indices, const torch::Tensor &bag_offsets, torch::Tensor &pooled, int n_cores){
+  long int n_rows_noise = noise_indices.numel();
+  long int n_indices = bag_indices.numel();
+  long int n_bags = bag_offsets.numel();
+  assert(bag_indices.scalar_type() == torch::kInt64 && bag_offsets.scalar_type() == torch::kInt64);
+  assert(bag_indices.is_contiguous() && bag_offsets.is_contiguous());
+  assert(pooled.scalar_type() == torch::kFloat && pooled.is_contiguous() && pooled.sizes()[0] == n_bags);
+  const long int *noise_ptr = n_rows_noise > 0 ? noise_indices.data<long int>() : nullptr;
+  const long int *indices_ptr = n_indices > 0 ? bag_indices.data<long int>() : nullptr;
+  const long int *offsets_ptr = bag_offsets.data<long int>();
+
+  // every index of the batch is a noise row (lS_i_nxt), found by a binary search
+  std::vector<long int> slot_of(n_indices);
+  plan.bag_of.resize(n_indices);
+  plan.bag_length.resize(n_bags);
+  #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(static)
+  for(long int b = 0; b < n_bags; b++){
+    long int end = b + 1 < n_bags ? offsets_ptr[b + 1] : n_indices;
+    plan.bag_length[b] = end - offsets_ptr[b];
+    for(long int q = offsets_ptr[b]; q < end; q++){
+      const long int *found = std::lower_bound(noise_ptr, noise_ptr + n_rows_noise, indices_ptr[q]);
+      assert(found != noise_ptr + n_rows_noise && *found == indices_ptr[q]);
+      slot_of[q] = found - noise_ptr;
+      plan.bag_of[q] = b;
+    }
+  }
+
+  // counting sort of the positions by slot
+  plan.slot_start.assign(n_rows_noise + 1, 0);
+  for(long int q = 0; q < n_indices; q++){
+    plan.slot_start[slot_of[q] + 1]++;
+  }
+  for(long int s = 0; s < n_rows_noise; s++){
+    plan.slot_start[s + 1] += plan.slot_start[s];
+  }
+  std::vector<long int> cursor(plan.slot_start.begin(), plan.slot_start.end() - 1);
+  plan.positions.resize(n_indices);
+  for(long int q = 0; q < n_indices; q++){
+    plan.positions[cursor[slot_of[q]]++] = q;
+  }
+
+  // bags of a single index are stored, the others (and empty ones) accumulated from zero
+  plan.pooled_ptr = pooled.data<float>();
+  if(std::any_of(plan.bag_length.begin(), plan.bag_length.end(), [](int length){ return length != 1; })){
+    pooled.zero_();
+  }
+}
+
+// Pool the updated row (of noise slot "slot") into the bags of the next batch containing it
+inline void pool_updated_row(const bag_pool_plan &plan, const float *row, long int slot, int dim){
+  for(long int j = plan.slot_start[slot]; j < plan.slot_start[slot + 1]; j++){
+    long int b = plan.bag_of[plan.positions[j]];
+    float *out = plan.pooled_ptr + b * dim;
+    if(plan.bag_length[b] == 1){
+      std::copy(row, row + dim, out);
+      continue;
+    }
+    // other rows of the bag may be updated by other threads
+    for(int k = 0; k < dim; k++){
+      #pragma omp atomic
+      out[k] += row[k];
+    }
+  }
+}
+
+ISA_CLONES void fused_delayed_noise_sgd_update_impl(torch::Tensor &weight, const torch::Tensor &noise_indices, const torch::Tensor &std, const torch::Tensor &grad, float lr, bool constant_noise, long int seed, int table, int iteration, long int rounding_seed, int n_cores, const bag_pool_plan *pool_plan){
+  const int n_rows_per_block = 256;
+
+  // Set several variables
+  torch::Tensor grad_indices = grad._indices();
+  torch::Tensor grad_values = grad._values();
+  bool rowwise_int8 = weight.scalar_type() == torch::kByte;
+  int n_embs = weight.sizes()[0];
+  int dim = rowwise_int8 ? weight.sizes()[1] - ROWWISE_INT8_EXTRA : weight.sizes()[1];
+  long int row_bytes = weight.sizes()[1] * weight.element_size();
+  int n_rows_noise = noise_indices.numel();
+  int n_rows_grad = grad_values.sizes()[0];
+  assert(weight.is_contiguous());
+  assert(grad_values.is_contiguous());
+  assert(grad_indices.sizes()[0] == 1);
+  assert(grad_indices.sizes()[1] == n_rows_grad);
+  assert(std.numel() == n_rows_noise);
+  assert(n_rows_grad == 0 || grad_values.sizes()[1] == dim);
+
+  // 1-2. Merge the sorted (unique) noise indices and the sorted gradient indices,
+  // so that every touched row appears exactly once
+  scratch_vector<int_pair> grad_pairs_scratch("merge_pairs", 0);
+  scratch_vector<fused_update_row> rows_scratch("merge_rows", 0);
+  std::vector<int_pair> &grad_pairs = grad_pairs_scratch.vec;
+  std::vector<fused_update_row> &rows = rows_scratch.vec;
+  merge_noise_grad_rows(noise_indices, grad_indices, grad.is_coalesced(), n_embs, grad_pairs, rows);
+  int n_rows = rows.size();
+  int n_blocks = (n_rows + n_rows_per_block - 1) / n_rows_per_block;
+  scoped_trace trace("fused_delayed_noise_sgd_update", n_rows, 2L * n_rows * weight.sizes()[1] * weight.element_size() + (long int)n_rows_grad * dim * grad_values.element_size());
+
+  // 3. Update each row only once: weight[row] -= lr * (noise + sum of gradients)
+  // Noise is sampled block by block into a small thread-private buffer, so it never goes to DRAM.
+  // bf16/fp16/row-wise int8 tables (and bf16/fp16 gradients) are upcasted per row, so the update is
+  // done in fp32 and rounded once when stored back (stochastically if "rounding_seed" >= 0). Rows
+  // which are not touched are never requantized
+  const uint32_t rounding_stream = 0x80000000; // key of the rounding, never used by the noise
+  ScalarType weight_type = weight.scalar_type();
+  ScalarType grad_type = grad_values.scalar_type();
+  assert(weight_type == torch::kFloat || weight_type == torch::kBFloat16 || weight_type == torch::kHalf || weight_type == torch::kByte);
+  assert(grad_type == torch::kFloat || grad_type == torch::kBFloat16 || grad_type == torch::kHalf);
+  void *weight_ptr = weight.data_ptr();
+  const void *values_ptr = n_rows_grad > 0 ? grad_values.data_ptr() : nullptr;
+  float *std_ptr = n_rows_noise > 0 ? std.data<float>() : nullptr;
+  bool stochastic_rounding = rounding_seed >= 0 && weight_type != torch::kFloat;
+  numa_block_queue queue(numa_block_nodes(weight_ptr, n_blocks, [&](long int b){ return rows[b * n_rows_per_block].row; }));
+
+  #pragma omp parallel num_threads(pool_threads(n_cores))
+  {
+    torch::Generator generator = thread_generator();
+    kernel_vector<float> noise_buffer(n_rows_per_block * dim);
+    kernel_vector<float> acc(dim);
+    kernel_vector<float> grad_row(dim);
+    kernel_vector<float> u(stochastic_rounding ? dim : 0);
+    kernel_vector<float> dequantized(rowwise_int8 ? dim : 0);
+
+    for(long int b = queue.next(); b >= 0; b = queue.next()){
+      int start = b * n_rows_per_block;
+      int end = std::min(start + n_rows_per_block, n_rows);
+      scoped_trace block_trace("fused_delayed_noise_sgd_update/block", end - start, 2L * (end - start) * row_bytes);
+
+      int n_noise_in_block = 0;
+      for(int i = start; i < end; i++){
+        if(rows[i].noise_slot != -1){
+          n_noise_in_block++;
+        }
+      }
+      if(n_noise_in_block > 0 && !constant_noise && seed < 0){
+        torch::Tensor noise_slice = torch::from_blob(noise_buffer.data(), {n_noise_in_block, dim}, torch::kFloat);
+        torch::normal_out(noise_slice, 0, 1, {n_noise_in_block, dim}, generator);
+      }
+
+      int noise_offset = 0;
+      for(int i = start; i < end; i++){
+        const fused_update_row &r = rows[i];
+        if(r.noise_slot != -1){
+          float s = std_ptr[r.noise_slot];
+          if(constant_noise){
+            for(int k = 0; k < dim; k++){
+              acc[k] = s;
+            }
+          }
+          else if(seed >= 0){
+            philox_normal_row(acc.data(), dim, s, seed, table, r.row, iteration);
+          }
+          else{
+            float *noise_row = noise_buffer.data() + noise_offset * dim;
+            for(int k = 0; k < dim; k++){
+              acc[k] = s * noise_row[k];
+            }
+          }
+          noise_offset++;
+        }
+        else{
+          std::fill(acc.begin(), acc.end(), 0);
+        }
+
+        for(long int j = r.grad_start; j <= r.grad_end; j++){
+          if(grad_type == torch::kFloat){
+            const float *grad_row_fp32 = (const float *)values_ptr + grad_pairs[j].second * dim;
+            for(int k = 0; k < dim; k++){
+              acc[k] += grad_row_fp32[k];
+            }
+          }
+          else{
+            load_noise_row(grad_row.data(), values_ptr, grad_type, grad_pairs[j].second, dim);
+            for(int k = 0; k < dim; k++){
+              acc[k] += grad_row[k];
+            }
+          }
+        }
+
+        if(stochastic_rounding){
+          philox_uniform_row(u.data(), dim, 0, 1, rounding_seed, table ^ rounding_stream, r.row, iteration);
+        }
+        const float *u_ptr = stochastic_rounding ? u.data() : nullptr;
+        if(rowwise_int8){
+          sgd_update_row_int8((uint8_t *)weight_ptr + r.row * row_bytes, dequantized.data(), acc.data(), lr, dim, u_ptr);
+        }
+        else if(weight_type == torch::kBFloat16){
+          sgd_update_row((at::BFloat16 *)weight_ptr + r.row * dim, acc.data(), lr, dim, u_ptr);
+        }
+        else if(weight_type == torch::kHalf){
+          sgd_update_row((at::Half *)weight_ptr + r.row * dim, acc.data(), lr, dim, u_ptr);
+        }
+        else{
+          sgd_update_row((float *)weight_ptr + r.row * dim, acc.data(), lr, dim, u_ptr);
+          if(pool_plan != nullptr && r.noise_slot != -1){
+            // the row is still in the cache
+            pool_updated_row(*pool_plan, (float *)weight_ptr + r.row * dim, r.noise_slot, dim);
+          }
+        }
+      }
+    }
+  }
+}
+
+void fused_delayed_noise_sgd_update(torch::Tensor &weight, const torch::Tensor &noise_indices, const torch::Tensor &std, const torch::Tensor &grad, float lr, bool constant_noise, long int seed, int table, int iteration, long int rounding_seed, int n_cores){
+  fused_delayed_noise_sgd_update_impl(weight, noise_indices, std, grad, lr, constant_noise, seed, table, iteration, rounding_seed, n_cores, nullptr);
+}
+
+// Same as fused_delayed_noise_sgd_update for an fp32 table, which also sum-pools the bags of the next
+// batch ("bag_indices" and "bag_offsets", whose rows are all in "noise_indices") into "pooled" as soon
+// as each of their rows is updated, instead of gathering the rows again in the next forward
+void fused_delayed_noise_sgd_update_and_pool(torch::Tensor &weight, const torch::Tensor &noise_indices, const torch::Tensor &std, const torch::Tensor &grad, float lr, bool constant_noise, long int seed, int table, int iteration,
+                                             const torch::Tensor &bag_indices, const torch::Tensor &bag_offsets, torch::Tensor &pooled, int n_cores){
+  assert(weight.scalar_type() == torch::kFloat && pooled.sizes()[1] == weight.sizes()[1]);
+  bag_pool_plan plan;
+  build_bag_pool_plan(plan, noise_indices, bag_indices, bag_offsets, pooled, n_cores);
+  fused_delayed_noise_sgd_update_impl(weight, noise_indices, std, grad, lr, constant_noise, seed, table, iteration, -1, n_cores, &plan);
+}
+
+// weight[indices[i]] -= lr * values[i] for the (unique) rows of a coalesced sparse gradient, i.e., the
+// sparse SGD step, in parallel over blocks of rows. The rows of large tables are random DRAM (and TLB)
+// accesses, so the weight row SGD_PREFETCH_DISTANCE ahead is prefetched (for writing) while a row is updated
+const int SGD_PREFETCH_DISTANCE = 8;
+
+ISA_CLONES void sparse_sgd_update(torch::Tensor &weight, const torch::Tensor &indices, const torch::Tensor &values, float lr, int n_cores){
+  const long int n_rows_per_block = 256;
+  long int n_rows = indices.numel();
+  if(n_rows == 0){
+    return;
+  }
+  int dim = weight.sizes()[1];
+  assert(weight.scalar_type() == torch::kFloat && weight.is_contiguous());
+  assert(indices.scalar_type() == torch::kInt64 && indices.is_contiguous());
+  assert(values.is_contiguous() && values.sizes()[0] == n_rows && values.sizes()[1] == dim);
+  long int n_blocks = (n_rows + n_rows_per_block - 1) / n_rows_per_block;
+  scoped_trace trace("sparse_sgd_update", n_rows, 3 * n_rows * dim * sizeof(float));
+
+  float *weight_ptr = weight.data<float>();
+  const long int *indices_ptr = indices.data<long int>();
+  const float *values_ptr = values.data<float>();
+  numa_block_queue queue(numa_block_nodes(weight_ptr, n_blocks, [&](long int b){ return indices_ptr[b * n_rows_per_block]; }));
+
+  dispatch_dim(dim, [&](auto D){
+    constexpr int DIM = decltype(D)::value;
+    #pragma omp parallel num_threads(pool_threads(n_cores))
+    for(long int b = queue.next(); b >= 0; b = queue.next()){
+      long int start = b * n_rows_per_block;
+      long int end = std::min(start + n_rows_per_block, n_rows);
+      for(long int i = start; i < end; i++){
+        if(i + SGD_PREFETCH_DISTANCE < end){
+          float *ahead = weight_ptr + indices_ptr[i + SGD_PREFETCH_DISTANCE] * dim;
+          for(int k = 0; k < dim; k += 16){ // a cache line of floats
+            __builtin_prefetch(ahead + k, 1);
+          }
+        }
+        axpy_row<DIM>(weight_ptr + indices_ptr[i] * dim, -lr, values_ptr + i * dim, dim);
+      }
+    }
+  });
+}
+
+void sparse_rowwise_adagrad_update(torch::Tensor &weight, torch::Tensor &momentum, const torch::Tensor &indices, const torch::Tensor &values, const torch::Tensor &std, float lr, float eps, long int seed, int table, int iteration, int n_cores){
+  const int n_rows_per_block = 256;
+
+  // Set several variables
+  int n_rows = indices.numel();
+  int dim = weight.sizes()[1];
+  bool with_noise = std.numel() > 0;
+  assert(weight.is_contiguous());
+  assert(momentum.is_contiguous());
+  assert(values.is_contiguous());
+  assert(momentum.numel() == weight.sizes()[0]);
+  assert(n_rows == 0 || (values.sizes()[0] == n_rows && values.sizes()[1] == dim));
+  assert(!with_noise || std.numel() == n_rows);
+  int n_blocks = (n_rows + n_rows_per_block - 1) / n_rows_per_block;
+
+  float *weight_ptr = weight.data<float>();
+  float *momentum_ptr = momentum.data<float>();
+  long int *indices_ptr = n_rows > 0 ? indices.data<long int>() : nullptr;
+  float *values_ptr = n_rows > 0 ? values.data<float>() : nullptr;
+  float *std_ptr = with_noise ? std.data<float>() : nullptr;
+
+  // For each (unique) row in a single pass:
+  // g = values[i] + noise, momentum[row] += mean(g^2), weight[row] -= lr * g / (sqrt(momentum[row]) + eps)
+  #pragma omp parallel num_threads(pool_threads(n_cores))
+  {
+    torch::Generator generator = thread_generator();
+    kernel_vector<float> noise_buffer(n_rows_per_block * dim);
+    kernel_vector<float> acc(dim);
+
+    #pragma omp for schedule(dynamic)
+    for(int b = 0; b < n_blocks; b++){
+      int start = b * n_rows_per_block;
+      int end = std::min(start + n_rows_per_block, n_rows);
+      if(with_noise && seed < 0){
+        torch::Tensor noise_slice = torch::from_blob(noise_buffer.data(), {end - start, dim}, torch::kFloat);
+        torch::normal_out(noise_slice, 0, 1, {end - start, dim}, generator);
+      }
+
+      for(int i = start; i < end; i++){
+        long int row = indices_ptr[i];
+        float *value_row = values_ptr + (long int)i * dim;
+        if(with_noise && seed >= 0){
+          philox_normal_row(acc.data(), dim, std_ptr[i], seed, table, row, iteration);
+        }
+        else if(with_noise){
+          float *noise_row = noise_buffer.data() + (long int)(i - start) * dim;
+          for(int k = 0; k < dim; k++){
+            acc[k] = std_ptr[i] * noise_row[k];
+          }
+        }
+        else{
+          std::fill(acc.begin(), acc.end(), 0);
+        }
+
+        float sum_sq = 0;
+        #pragma omp simd reduction(+:sum_sq)
+        for(int k = 0; k < dim; k++){
+          acc[k] += value_row[k];
+          sum_sq += acc[k] * acc[k];
+        }
+        momentum_ptr[row] += sum_sq / dim;
+        float step = lr / (std::sqrt(momentum_ptr[row]) + eps);
+
+        float *weight_row = weight_ptr + row * dim;
+        #pragma omp simd
+        for(int k = 0; k < dim; k++){
+          weight_row[k] -= step * acc[k];
+        }
+      }
+    }
+  }
+}
+
+// Multi-table kernels: every table is processed by a single OpenMP team instead of
+// one call (and one fork/join) per table.
+
+// Work item of the multi-table kernels: rows [start, end) of the table "table"
+struct table_chunk{
+  int table;
+  long int start;
+  long int end;
+};
+
+// Split the rows of all tables into chunks of at most "chunk_rows" rows,
+// so that threads are balanced by row count regardless of the size of each table
+std::vector<table_chunk> split_table_rows(const std::vector<long int> &n_rows, long int chunk_rows){
+  std::vector<table_chunk> chunks;
+  for(int t = 0; t < (int)n_rows.size(); t++){
+    for(long int start = 0; start < n_rows[t]; start += chunk_rows){
+      chunks.push_back({t, start, std::min(start + chunk_rows, n_rows[t])});
+    }
+  }
+  return chunks;
+}
+
+// Tables in descending order of "n_rows" (largest first), for per-table work items
+std::vector<int> order_tables_by_rows(const std::vector<long int> &n_rows){
+  std::vector<int> order(n_rows.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](const int lhs, const int rhs){
+    return n_rows[lhs] > n_rows[rhs];
+  });
+  return order;
+}
+
+// Longest-processing-time-first work items of per-table work: table t costs n_rows[t] * row_costs[t]
+// (e.g., its unique rows x dim), tables costing more than 1/(4 * n_threads) of the total are split
+// into chunks of about that cost (at least "min_chunk_rows" rows), and the items are sorted by
+// descending cost. Taken in order by a dynamic schedule, the largest items start first and the
+// small ones fill the idle threads at the end, whatever the spread of the table sizes
+std::vector<table_chunk> schedule_lpt(const std::vector<long int> &n_rows, const std::vector<long int> &row_costs, int n_threads, long int min_chunk_rows){
+  assert(n_rows.size() == row_costs.size() && n_threads > 0);
+  long int total_cost = 0;
+  for(int t = 0; t < (int)n_rows.size(); t++){
+    total_cost += n_rows[t] * row_costs[t];
+  }
+  long int target_cost = std::max(1L, total_cost / (4L * n_threads));
+
+  std::vector<table_chunk> chunks;
+  std::vector<long int> costs;
+  for(int t = 0; t < (int)n_rows.size(); t++){
+    long int row_cost = std::max(1L, row_costs[t]);
+    long int chunk_rows = std::max(min_chunk_rows, target_cost / row_cost);
+    for(long int start = 0; start < n_rows[t]; start += chunk_rows){
+      chunks.push_back({t, start, std::min(start + chunk_rows, n_rows[t])});
+      costs.push_back((chunks.back().end - start) * row_cost);
+    }
+  }
+  std::vector<int> order(chunks.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](const int lhs, const int rhs){
+    return costs[lhs] > costs[rhs];
+  });
+  std::vector<table_chunk> sorted_chunks(chunks.size());
+  for(int c = 0; c < (int)order.size(); c++){
+    sorted_chunks[c] = chunks[order[c]];
+  }
+  return sorted_chunks;
+}
+
+// Fill the first rows of "outputs[t]" with the noise of "stds[t]" for every table with a single
+// thread team. With "background", it runs with its own team and generators (not the worker pool),
+// e.g., in a background thread while the main thread runs other kernels.
+ISA_CLONES void normal_multi_table_into(std::vector<torch::Tensor> &outputs, const std::vector<torch::Tensor> &stds, const std::vector<torch::Tensor> &indices, int dim, long int seed, int iteration, bool background, int n_cores){
+  const long int chunk_rows = 256;
+  int n_tables = stds.size();
+  assert((int)outputs.size() == n_tables);
+  assert(seed < 0 || (int)indices.size() == n_tables);
+
+  std::vector<long int> n_rows(n_tables);
+  for(int t = 0; t < n_tables; t++){
+    n_rows[t] = stds[t].sizes()[0];
+    assert(outputs[t].is_contiguous());
+    assert(outputs[t].sizes()[0] >= n_rows[t] && outputs[t].sizes()[1] == dim);
+  }
+  std::vector<table_chunk> chunks = split_table_rows(n_rows, chunk_rows);
+  int n_chunks = chunks.size();
+
+  #pragma omp parallel num_threads(background ? n_cores : pool_threads(n_cores))
+  {
+    torch::Generator generator = background ? new_generator() : thread_generator();
+
+    #pragma omp for schedule(dynamic)
+    for(int c = 0; c < n_chunks; c++){
+      const table_chunk &chunk = chunks[c];
+      float *output_ptr = outputs[chunk.table].data<float>();
+      float *std_ptr = stds[chunk.table].data<float>();
+      if(seed >= 0){
+        // each row is keyed by its embedding index (same as normal_philox_with_extra)
+        long int *indices_ptr = indices[chunk.table].data<long int>();
+        for(long int i = chunk.start; i < chunk.end; i++){
+          philox_normal_row(output_ptr + i * dim, dim, std_ptr[i], seed, chunk.table, indices_ptr[i], iteration);
+        }
+      }
+      else{
+        torch::Tensor output_slice = torch::from_blob(output_ptr + chunk.start * dim, {chunk.end - chunk.start, dim}, torch::kFloat);
+        torch::normal_out(output_slice, 0, 1, {chunk.end - chunk.start, dim}, generator);
+        dispatch_dim(dim, [&](auto D){
+          constexpr int DIM = decltype(D)::value;
+          for(long int i = chunk.start; i < chunk.end; i++){
+            scale_row<DIM>(output_ptr + i * dim, std_ptr[i], dim);
+          }
+        });
+      }
+    }
+  }
+}
+
+std::vector<torch::Tensor> normal_multi_table_with_extra(const std::vector<torch::Tensor> &stds, const std::vector<torch::Tensor> &indices, int dim, const std::vector<long int> &extras, long int seed, int iteration, int n_cores){
+  int n_tables = stds.size();
+  assert((int)extras.size() == n_tables);
+
+  // allocate a memory space for output tensors
+  std::vector<torch::Tensor> outputs(n_tables);
+  for(int t = 0; t < n_tables; t++){
+    outputs[t] = torch::empty({stds[t].sizes()[0] + extras[t], dim});
+  }
+  normal_multi_table_into(outputs, stds, indices, dim, seed, iteration, false, n_cores);
+  return outputs;
+}
+
+
+// Double-buffered producer of the delayed noise of LazyDP: produce() samples the noise of all
+// tables into a (pinned) buffer slot in a background thread, and consume() returns it. Buffers
+// are reused across iterations (grown when needed), and the slot being produced is never the
+// one returned by the previous consume().
+class NoiseProducer{
+public:
+  NoiseProducer(int n_slots, bool pinned, int n_cores) : buffers(n_slots), pinned(pinned), n_cores(n_cores){
+    assert(n_slots >= 1);
+  }
+
+  ~NoiseProducer(){
+    if(worker.joinable()){
+      worker.join();
+    }
+    for(std::vector<torch::Tensor> &slot : buffers){
+      for(torch::Tensor &buffer : slot){
+        if(buffer.defined()){
+          memory_account(MEMORY_NOISE_PRODUCER, -buffer.numel() * buffer.element_size());
+        }
+      }
+    }
+  }
+
+  // Noise of stds[t] followed by "extras[t]" uninitialized rows (for the gradient) per table
+  void produce(const std::vector<torch::Tensor> &stds, const std::vector<torch::Tensor> &indices, int dim, const std::vector<long int> &extras, long int seed, int iteration){
+    int n_tables = stds.size();
+    assert((int)extras.size() == n_tables);
+    if(worker.joinable()){
+      worker.join();
+    }
+
+    std::vector<torch::Tensor> &slot = buffers[next_slot];
+    slot.resize(n_tables);
+    outputs.resize(n_tables);
+    for(int t = 0; t < n_tables; t++){
+      long int n_elements = (stds[t].sizes()[0] + extras[t]) * dim;
+      if(!slot[t].defined() || slot[t].numel() < n_elements){
+        // 1/8 headroom, as in workspace_empty(), so that (Poisson-sampled) batches slightly larger than
+        // the previous ones do not reallocate the (pinned) buffer
+        if(slot[t].defined()){
+          memory_account(MEMORY_NOISE_PRODUCER, -slot[t].numel() * slot[t].element_size());
+        }
+        slot[t] = torch::empty({n_elements + n_elements / 8}, torch::TensorOptions().dtype(torch::kFloat).pinned_memory(pinned));
+        memory_account(MEMORY_NOISE_PRODUCER, slot[t].numel() * slot[t].element_size());
+      }
+      outputs[t] = slot[t].narrow(0, 0, n_elements).view({stds[t].sizes()[0] + extras[t], dim});
+    }
+    next_slot = (next_slot + 1) % buffers.size();
+
+    worker = std::thread([this, stds, indices, dim, seed, iteration](){
+      normal_multi_table_into(outputs, stds, indices, dim, seed, iteration, true, n_cores);
+    });
+  }
+
+  std::vector<torch::Tensor> consume(){
+    assert(worker.joinable());
+    worker.join();
+    return outputs;
+  }
+
+private:
+  std::vector<std::vector<torch::Tensor>> buffers;
+  bool pinned;
+  int n_cores;
+  int next_slot = 0;
+  std::thread worker;
+  std::vector<torch::Tensor> outputs;
+};
+
+std::vector<torch::Tensor> unique_multi_table(const std::vector<torch::Tensor> &inputs, int n_cores){
+  int n_tables = inputs.size();
+  std::vector<long int> n_rows(n_tables);
+  for(int t = 0; t < n_tables; t++){
+    n_rows[t] = inputs[t].numel();
+  }
+  std::vector<int> order = order_tables_by_rows(n_rows);
+
+  // each table is a work item, largest tables are scheduled first
+  std::vector<torch::Tensor> outputs(n_tables);
+  #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(dynamic, 1)
+  for(int o = 0; o < n_tables; o++){
+    int t = order[o];
+    // sorted and uniqued in the storage of the output, as unique_multi_thread
+    outputs[t] = sort_unique(inputs[t], false);
+  }
+  return outputs;
+}
+
+std::vector<torch::Tensor> coalesce_multi_table(const std::vector<torch::Tensor> &inputs, int n_cores){
+  const long int chunk_rows = 64;
+  int n_tables = inputs.size();
+  std::vector<long int> n_rows(n_tables);
+  for(int t = 0; t < n_tables; t++){
+    n_rows[t] = inputs[t].is_coalesced() ? 0 : inputs[t]._values().sizes()[0];
+  }
+  std::vector<int> order = order_tables_by_rows(n_rows);
+
+  std::vector<kernel_vector<int_pair>> pairs(n_tables);
+  std::vector<kernel_vector<long int>> start_indices(n_tables);
+  std::vector<torch::Tensor> out_indices(n_tables);
+  std::vector<torch::Tensor> out_values(n_tables);
+  std::vector<long int> n_coalesced_rows(n_tables, 0);
+
+  // 1. Sort (index, position) pairs and derive start index of each coalesced index, per table
+  #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(dynamic, 1)
+  for(int o = 0; o < n_tables; o++){
+    int t = order[o];
+    if(inputs[t].is_coalesced()){
+      continue;
+    }
+    torch::Tensor indices = inputs[t]._indices();
+    assert(indices.sizes()[0] == 1);
+    assert(indices.sizes()[1] == n_rows[t]);
+    assert(inputs[t]._values().is_contiguous());
+    long int *indices_ptr = indices.data<long int>();
+
+    kernel_vector<int_pair> &p = pairs[t];
+    p.resize(n_rows[t]);
+    for(long int i = 0; i < n_rows[t]; i++){
+      p[i] = int_pair(indices_ptr[i], i);
+    }
+    std::sort(p.begin(), p.end(), [](const int_pair lhs, const int_pair rhs){
+      return lhs.first < rhs.first;
+    });
+
+    kernel_vector<long int> &starts = start_indices[t];
+    for(long int i = 0; i < n_rows[t]; i++){
+      if(i == 0 || p[i].first != p[i-1].first){
+        starts.push_back(i);
+      }
+    }
+    n_coalesced_rows[t] = starts.size();
+    starts.push_back(n_rows[t]);
+
+    int dim = inputs[t].sizes()[1];
+    out_indices[t] = torch::empty({1, n_coalesced_rows[t]}, torch::kInt64);
+    out_values[t] = torch::empty({n_coalesced_rows[t], dim}, torch::kFloat);
+    long int *out_indices_ptr = out_indices[t].data<long int>();
+    for(long int i = 0; i < n_coalesced_rows[t]; i++){
+      out_indices_ptr[i] = p[starts[i]].first;
+    }
+  }
+
+  // 2. Accumulate values over chunks of coalesced rows of all tables
+  std::vector<table_chunk> chunks = split_table_rows(n_coalesced_rows, chunk_rows);
+  int n_chunks = chunks.size();
+
+  #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(dynamic)
+  for(int c = 0; c < n_chunks; c++){
+    const table_chunk &chunk = chunks[c];
+    int t = chunk.table;
+    int dim = inputs[t].sizes()[1];
+    const kernel_vector<int_pair> &p = pairs[t];
+    const kernel_vector<long int> &starts = start_indices[t];
+    float *values_ptr = inputs[t]._values().data<float>();
+    float *out_values_ptr = out_values[t].data<float>();
+
+    dispatch_dim(dim, [&](auto D){
+      constexpr int DIM = decltype(D)::value;
+      for(long int i = chunk.start; i < chunk.end; i++){
+        float *out_row = out_values_ptr + i * dim;
+        copy_row<DIM>(out_row, values_ptr + p[starts[i]].second * dim, dim);
+        for(long int j = starts[i] + 1; j < starts[i+1]; j++){
+          add_row<DIM>(out_row, values_ptr + p[j].second * dim, dim);
+        }
+      }
+    });
+  }
+
+  std::vector<torch::Tensor> outputs(n_tables);
+  for(int t = 0; t < n_tables; t++){
+    if(inputs[t].is_coalesced()){
+      outputs[t] = inputs[t];
+      continue;
+    }
+    outputs[t] = torch::sparse_coo_tensor(out_indices[t], out_values[t], {inputs[t].sizes()[0], inputs[t].sizes()[1]});
+    outputs[t]._coalesced_(true);
+  }
+  return outputs;
+}
+
+
+// sparse_sgd_update of all tables with a single thread team: weights[t][indices[t][i]] -= lrs[t] * values[t][i]
+// for the coalesced gradient of each table. The rows are scheduled longest-first across tables (schedule_lpt,
+// unique rows x dim), so a few large tables do not leave the threads idle as one call per table would
+ISA_CLONES void sparse_sgd_update_multi_table(std::vector<torch::Tensor> &weights, const std::vector<torch::Tensor> &indices, const std::vector<torch::Tensor> &values, const std::vector<double> &lrs, int n_cores){
+  const long int min_chunk_rows = 64;
+  int n_tables = weights.size();
+  assert((int)indices.size() == n_tables && (int)values.size() == n_tables && (int)lrs.size() == n_tables);
+  std::vector<long int> n_rows(n_tables);
+  std::vector<long int> dims(n_tables);
+  long int n_bytes = 0;
+  for(int t = 0; t < n_tables; t++){
+    assert(weights[t].scalar_type() == torch::kFloat && weights[t].is_contiguous());
+    assert(indices[t].scalar_type() == torch::kInt64 && indices[t].is_contiguous());
+    n_rows[t] = indices[t].numel();
+    dims[t] = weights[t].sizes()[1];
+    assert(n_rows[t] == 0 || (values[t].is_contiguous() && values[t].sizes()[0] == n_rows[t] && values[t].sizes()[1] == dims[t]));
+    n_bytes += 3 * n_rows[t] * dims[t] * sizeof(float);
+  }
+  int n_threads = pool_threads(n_cores);
+  std::vector<table_chunk> chunks = schedule_lpt(n_rows, dims, n_threads, min_chunk_rows);
+  int n_chunks = chunks.size();
+  scoped_trace trace("sparse_sgd_update_multi_table", n_chunks, n_bytes);
+
+  #pragma omp parallel for num_threads(n_threads) schedule(dynamic, 1)
+  for(int c = 0; c < n_chunks; c++){
+    const table_chunk &chunk = chunks[c];
+    int dim = dims[chunk.table];
+    float lr = lrs[chunk.table];
+    float *weight_ptr = weights[chunk.table].data<float>();
+    const long int *indices_ptr = indices[chunk.table].data<long int>();
+    const float *values_ptr = values[chunk.table].data<float>();
+    dispatch_dim(dim, [&](auto D){
+      constexpr int DIM = decltype(D)::value;
+      for(long int i = chunk.start; i < chunk.end; i++){
+        if(i + SGD_PREFETCH_DISTANCE < chunk.end){
+          float *ahead = weight_ptr + indices_ptr[i + SGD_PREFETCH_DISTANCE] * dim;
+          for(int k = 0; k < dim; k += 16){ // a cache line of floats
+            __builtin_prefetch(ahead + k, 1);
+          }
+        }
+        axpy_row<DIM>(weight_ptr + indices_ptr[i] * dim, -lr, values_ptr + i * dim, dim);
+      }
+    });
+  }
+}
+
+// Clipped and coalesced gradients of all embedding tables from the backprops of their bags
+// (config.clip_backward == "cached"), without the uncoalesced gradient of embedding_bag:
+// row u of table t sums clip_factor[b] * backprops[t][b] over the indices of bags b referring to it.
+// The indices are bucketed with the unique indices, inverse mapping and counts of set_lS_i() if given
+// (and built from the same indices), sorted otherwise. Values of all tables share one workspace buffer.
+// Returns the row-sparse gradients, see bag_grad_multi_table() for their COO tensors
+std::vector<row_sparse> bag_grad_multi_table_rows(const std::vector<torch::Tensor> &backprops, const torch::Tensor &clip_factor, const std::vector<torch::Tensor> &indices, const std::vector<torch::Tensor> &offsets,
+                                                  const std::vector<torch::Tensor> &uniques, const std::vector<torch::Tensor> &inverses, const std::vector<torch::Tensor> &counts, int n_cores){
+  const long int chunk_rows = 64;
+  int n_tables = backprops.size();
+  assert((int)indices.size() == n_tables && (int)offsets.size() == n_tables);
+  assert(uniques.empty() || ((int)uniques.size() == n_tables && (int)inverses.size() == n_tables && (int)counts.size() == n_tables));
+  assert(clip_factor.scalar_type() == torch::kFloat && clip_factor.is_contiguous());
+  const float *clip_ptr = clip_factor.data<float>();
+  long int batch_size = clip_factor.numel();
+
+  std::vector<long int> n_indices(n_tables);
+  for(int t = 0; t < n_tables; t++){
+    n_indices[t] = indices[t].numel();
+    assert(indices[t].scalar_type() == torch::kInt64 && indices[t].is_contiguous());
+    assert(offsets[t].scalar_type() == torch::kInt64 && offsets[t].numel() == batch_size);
+    assert(backprops[t].scalar_type() == torch::kFloat && backprops[t].is_contiguous() && backprops[t].sizes()[0] == batch_size);
+  }
+  std::vector<int> order = order_tables_by_rows(n_indices);
+
+  std::vector<std::vector<long int>> sorted_bags(n_tables); // bag of each index, grouped by row
+  std::vector<std::vector<long int>> start_indices(n_tables);
+  std::vector<torch::Tensor> out_indices(n_tables);
+  std::vector<long int> n_coalesced_rows(n_tables, 0);
+
+  // 1. Group the bags of each table by row: counting sort with the unique indices, or sort
+  #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(dynamic, 1)
+  for(int o = 0; o < n_tables; o++){
+    int t = order[o];
+    long int n = n_indices[t];
+    const long int *idx = indices[t].data<long int>();
+    const long int *off = offsets[t].data<long int>();
+    std::vector<long int> &bags = sorted_bags[t];
+    std::vector<long int> &starts = start_indices[t];
+    bags.resize(n);
+
+    bool use_inverse = !uniques.empty() && inverses[t].numel() == n;
+    if(use_inverse){
+      const long int *unique_ptr = uniques[t].data<long int>();
+      const long int *inverse_ptr = inverses[t].data<long int>();
+      for(long int j = 0; j < n && use_inverse; j++){
+        use_inverse = idx[j] == unique_ptr[inverse_ptr[j]];
+      }
+    }
+
+    if(use_inverse){
+      long int n_unique = uniques[t].numel();
+      const long int *inverse_ptr = inverses[t].data<long int>();
+      const long int *counts_ptr = counts[t].data<long int>();
+      starts.assign(n_unique + 1, 0);
+      for(long int u = 0; u < n_unique; u++){
+        starts[u + 1] = starts[u] + counts_ptr[u];
+      }
+      assert(starts[n_unique] == n);
+      std::vector<long int> cursor(starts.begin(), starts.end() - 1);
+      for(long int b = 0; b < batch_size; b++){
+        long int end = b + 1 < batch_size ? off[b + 1] : n;
+        for(long int j = off[b]; j < end; j++){
+          bags[cursor[inverse_ptr[j]]++] = b;
+        }
+      }
+      n_coalesced_rows[t] = n_unique;
+      out_indices[t] = uniques[t].view(-1);
+    }else{
+      std::vector<int_pair> p(n);
+      for(long int b = 0; b < batch_size; b++){
+        long int end = b + 1 < batch_size ? off[b + 1] : n;
+        for(long int j = off[b]; j < end; j++){
+          p[j] = int_pair(idx[j], b);
+        }
+      }
+      std::sort(p.begin(), p.end(), [](const int_pair lhs, const int_pair rhs){
+        return lhs.first < rhs.first;
+      });
+      starts.clear();
+      for(long int j = 0; j < n; j++){
+        if(j == 0 || p[j].first != p[j-1].first){
+          starts.push_back(j);
+        }
+        bags[j] = p[j].second;
+      }
+      n_coalesced_rows[t] = starts.size();
+      starts.push_back(n);
+      out_indices[t] = torch::empty({n_coalesced_rows[t]}, torch::kInt64);
+      long int *out_indices_ptr = out_indices[t].data<long int>();
+      for(long int u = 0; u < n_coalesced_rows[t]; u++){
+        out_indices_ptr[u] = p[starts[u]].first;
+      }
+    }
+  }
+
+  // 2. Accumulate the scaled backprops over chunks of coalesced rows of all tables, into one buffer
+  std::vector<long int> value_offsets(n_tables + 1, 0);
+  int dim = n_tables > 0 ? backprops[0].sizes()[1] : 0;
+  for(int t = 0; t < n_tables; t++){
+    assert(backprops[t].sizes()[1] == dim);
+    value_offsets[t + 1] = value_offsets[t] + n_coalesced_rows[t];
+  }
+  torch::Tensor values = workspace_empty("bag_grad_values", {value_offsets[n_tables], dim}, torch::kFloat);
+  float *values_ptr = values.data<float>();
+
+  std::vector<table_chunk> chunks = split_table_rows(n_coalesced_rows, chunk_rows);
+  int n_chunks = chunks.size();
+  #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(dynamic)
+  for(int c = 0; c < n_chunks; c++){
+    const table_chunk &chunk = chunks[c];
+    int t = chunk.table;
+    const std::vector<long int> &bags = sorted_bags[t];
+    const std::vector<long int> &starts = start_indices[t];
+    const float *backprops_ptr = backprops[t].data<float>();
+    for(long int u = chunk.start; u < chunk.end; u++){
+      float *out_row = values_ptr + (value_offsets[t] + u) * dim;
+      #pragma omp simd
+      for(int k = 0; k < dim; k++){
+        out_row[k] = 0;
+      }
+      for(long int j = starts[u]; j < starts[u + 1]; j++){
+        long int b = bags[j];
+        const float *row = backprops_ptr + b * dim;
+        float factor = clip_ptr[b];
+        #pragma omp simd
+        for(int k = 0; k < dim; k++){
+          out_row[k] += factor * row[k];
+        }
+      }
+    }
+  }
+
+  std::vector<row_sparse> outputs(n_tables);
+  for(int t = 0; t < n_tables; t++){
+    outputs[t] = row_sparse(out_indices[t], values.narrow(0, value_offsets[t], n_coalesced_rows[t]));
+  }
+  return outputs;
+}
+
+std::vector<torch::Tensor> bag_grad_multi_table(const std::vector<torch::Tensor> &backprops, const torch::Tensor &clip_factor, const std::vector<torch::Tensor> &indices, const std::vector<torch::Tensor> &offsets,
+                                                const std::vector<long int> &table_rows, const std::vector<torch::Tensor> &uniques, const std::vector<torch::Tensor> &inverses, const std::vector<torch::Tensor> &counts, int n_cores){
+  assert(table_rows.size() == backprops.size());
+  std::vector<row_sparse> grads = bag_grad_multi_table_rows(backprops, clip_factor, indices, offsets, uniques, inverses, counts, n_cores);
+  std::vector<torch::Tensor> outputs(grads.size());
+  for(int t = 0; t < (int)grads.size(); t++){
+    outputs[t] = row_sparse_to_coo(grads[t], table_rows[t]);
+  }
+  return outputs;
+}
+
+// Delayed noise of LazyDP sampled directly from the HT: row j of the output is Gaussian noise of
+// standard deviation sqrt(cnt_iter - HT[indices[j]]) * scale, computed in-register (no std tensor).
+// "last_update(row)" reads the HT. The output has "extra" more rows for the gradient.
+template<typename G>
+torch::Tensor delayed_noise_kernel(G last_update, const torch::Tensor &indices, int dim, int extra, int cnt_iter, float scale, long int seed, int table, int n_cores){
+  const int n_rows_per_block = 64;
+  assert(indices.is_contiguous());
+  int n_emb = indices.numel();
+  int n_blocks = (n_emb + n_rows_per_block - 1) / n_rows_per_block;
+  long int *indices_ptr = indices.data<long int>();
+
+  // allocate a memory space for output tensor
+  torch::Tensor output = torch::empty({n_emb + extra, dim});
+  float *output_ptr = output.data<float>();
+
+  #pragma omp parallel num_threads(pool_threads(n_cores))
+  {
+    torch::Generator generator = thread_generator();
+
+    #pragma omp for schedule(static)
+    for(int b = 0; b < n_blocks; b++){
+      int start = b * n_rows_per_block;
+      int end = std::min(start + n_rows_per_block, n_emb);
+      if(seed < 0){
+        torch::Tensor output_slice = torch::from_blob(output_ptr + (long int)start * dim, {end - start, dim}, torch::kFloat);
+        torch::normal_out(output_slice, 0, 1, {end - start, dim}, generator);
+      }
+      for(int i = start; i < end; i++){
+        float s = sqrtf((float)(cnt_iter - last_update(indices_ptr[i]))) * scale;
+        float *row = output_ptr + (long int)i * dim;
+        if(seed >= 0){
+          philox_normal_row(row, dim, s, seed, table, indices_ptr[i], cnt_iter);
+        }
+        else{
+          #pragma omp simd
+          for(int k = 0; k < dim; k++){
+            row[k] *= s;
+          }
+        }
+      }
+    }
+  }
+  return output;
+}
+
+torch::Tensor delayed_noise_with_extra(const torch::Tensor &HT, const torch::Tensor &indices, int dim, int extra, int cnt_iter, float scale, long int seed, int table, int n_cores){
+  assert(HT.scalar_type() == torch::kInt32);
+  assert(HT.is_contiguous());
+  const int *HT_ptr = HT.data<int>();
+  return delayed_noise_kernel([&](long int row){ return HT_ptr[row]; }, indices, dim, extra, cnt_iter, scale, seed, table, n_cores);
+}
+
+// Delayed noise of LazyDP grouped by delay: the rows of "indices" are reordered (stably) by their delay
+// cnt_iter - HT[row], and the rows of a delay shared by at least "min_group_rows" rows are filled by scalar-std
+// Gaussian fills of sqrt(delay) * "scale", without the per-row multiply. The other rows (and the delays of
+// NOISE_GROUP_MAX_DELAY or more) follow with a per-row std. Returns the reordered rows, their noise ("extra" more
+// rows for the gradient) and the histogram of the delays (the last bin counts all delays >= NOISE_GROUP_MAX_DELAY).
+const int NOISE_GROUP_MAX_DELAY = 4096;
+
+struct noise_group_block {
+  long int start;
+  long int end;
+  int slot;
+};
+
+std::vector<torch::Tensor> delayed_noise_grouped_with_extra(const torch::Tensor &HT, const torch::Tensor &indices, int dim, int extra, int cnt_iter, float scale, int min_group_rows, int n_cores){
+  const int n_rows_per_block = 64;
+  const int n_bins = NOISE_GROUP_MAX_DELAY + 1;
+  assert(HT.scalar_type() == torch::kInt32);
+  assert(HT.is_contiguous());
+  assert(indices.is_contiguous());
+  assert(min_group_rows > 0);
+  const int *HT_ptr = HT.data<int>();
+  const long int *indices_ptr = indices.data<long int>();
+  long int n_emb = indices.numel();
+  int n_chunks = std::max(1, pool_threads(n_cores));
+  scoped_trace trace("delayed_noise_grouped_with_extra", n_emb, (n_emb + extra) * dim * sizeof(float));
+
+  // 1. Delay of each row and the histogram of each chunk of rows
+  std::vector<int> delays(n_emb);
+  std::vector<long int> chunk_counts((long int)n_chunks * n_bins, 0);
+  #pragma omp parallel for num_threads(pool_threads(n_cores))
+  for(int t = 0; t < n_chunks; t++){
+    long int *counts = chunk_counts.data() + (long int)t * n_bins;
+    for(long int j = n_emb * t / n_chunks; j < n_emb * (t + 1) / n_chunks; j++){
+      int delay = cnt_iter - HT_ptr[indices_ptr[j]];
+      assert(delay >= 0);
+      delays[j] = delay;
+      counts[std::min(delay, NOISE_GROUP_MAX_DELAY)]++;
+    }
+  }
+
+  // 2. Slot of each bin: the groups in the order of delay, then the other rows
+  torch::Tensor histogram = torch::zeros({n_bins}, torch::kInt64);
+  long int *histogram_ptr = histogram.data<long int>();
+  for(int t = 0; t < n_chunks; t++){
+    for(int b = 0; b < n_bins; b++){
+      histogram_ptr[b] += chunk_counts[(long int)t * n_bins + b];
+    }
+  }
+  std::vector<int> bin_slot(n_bins);
+  std::vector<int> group_delay;
+  for(int b = 0; b < NOISE_GROUP_MAX_DELAY; b++){
+    bin_slot[b] = -1;
+    if(histogram_ptr[b] >= min_group_rows){
+      bin_slot[b] = group_delay.size();
+      group_delay.push_back(b);
+    }
+  }
+  int n_groups = group_delay.size();
+  int n_slots = n_groups + 1;
+  for(int b = 0; b < n_bins; b++){
+    if(b == NOISE_GROUP_MAX_DELAY || bin_slot[b] < 0){
+      bin_slot[b] = n_groups;
+    }
+  }
+
+  // offsets[t][slot]: first position of the rows of chunk t in the slot, so that the scatter is stable
+  std::vector<long int> offsets((long int)n_chunks * n_slots, 0);
+  for(int t = 0; t < n_chunks; t++){
+    for(int b = 0; b < n_bins; b++){
+      offsets[(long int)t * n_slots + bin_slot[b]] += chunk_counts[(long int)t * n_bins + b];
+    }
+  }
+  std::vector<long int> slot_start(n_slots + 1, 0);
+  long int position = 0;
+  for(int slot = 0; slot < n_slots; slot++){
+    slot_start[slot] = position;
+    for(int t = 0; t < n_chunks; t++){
+      long int count = offsets[(long int)t * n_slots + slot];
+      offsets[(long int)t * n_slots + slot] = position;
+      position += count;
+    }
+  }
+  slot_start[n_slots] = position;
+  assert(position == n_emb);
+
+  // 3. Stable scatter of the rows and their delays
+  torch::Tensor rows = torch::empty({n_emb}, torch::kInt64);
+  long int *rows_ptr = rows.data<long int>();
+  std::vector<int> row_delays(n_emb);
+  #pragma omp parallel for num_threads(pool_threads(n_cores))
+  for(int t = 0; t < n_chunks; t++){
+    long int *offset = offsets.data() + (long int)t * n_slots;
+    for(long int j = n_emb * t / n_chunks; j < n_emb * (t + 1) / n_chunks; j++){
+      long int p = offset[bin_slot[std::min(delays[j], NOISE_GROUP_MAX_DELAY)]]++;
+      rows_ptr[p] = indices_ptr[j];
+      row_delays[p] = delays[j];
+    }
+  }
+
+  // 4. Blocks of at most n_rows_per_block rows, which do not cross the groups
+  std::vector<noise_group_block> blocks;
+  for(int slot = 0; slot < n_slots; slot++){
+    for(long int start = slot_start[slot]; start < slot_start[slot + 1]; start += n_rows_per_block){
+      blocks.push_back({start, std::min(start + n_rows_per_block, slot_start[slot + 1]), slot});
+    }
+  }
+  long int n_blocks = blocks.size();
+
+  // allocate a memory space for output tensor
+  torch::Tensor output = torch::empty({n_emb + extra, dim});
+  float *output_ptr = output.data<float>();
+
+  #pragma omp parallel num_threads(pool_threads(n_cores))
+  {
+    torch::Generator generator = thread_generator();
+
+    #pragma omp for schedule(static)
+    for(long int b = 0; b < n_blocks; b++){
+      long int start = blocks[b].start;
+      long int end = blocks[b].end;
+      int slot = blocks[b].slot;
+      torch::Tensor output_slice = torch::from_blob(output_ptr + start * dim, {end - start, dim}, torch::kFloat);
+      if(slot < n_groups){
+        torch::normal_out(output_slice, 0, sqrtf((float)group_delay[slot]) * scale, {end - start, dim}, generator);
+        continue;
+      }
+      torch::normal_out(output_slice, 0, 1, {end - start, dim}, generator);
+      for(long int i = start; i < end; i++){
+        float s = sqrtf((float)row_delays[i]) * scale;
+        float *row = output_ptr + i * dim;
+        #pragma omp simd
+        for(int k = 0; k < dim; k++){
+          row[k] *= s;
+        }
+      }
+    }
+  }
+  return {rows, output, histogram};
+}
+
+
+// Settle the delayed noise of rows [row_start, row_end) (at most SETTLE_CHUNK_ROWS rows) whose
+// delay = delay_of(row) is at least "min_delay": weight[row] -= lr * noise, where
+// noise ~ N(0, (sqrt(delay) * scale)^2), or scale * delay when "constant_noise" (for debugging).
+// Philox keyed by (seed, table, row, cnt_iter) is used when "seed" >= 0. settled(row) is called
+// for each settled row. Returns the number of settled rows.
+const long int SETTLE_CHUNK_ROWS = 256;
+
+template<typename D, typename S>
+long int settle_chunk(float *weight_ptr, int dim, long int row_start, long int row_end, D delay_of, S settled, int cnt_iter, float lr, float scale, int min_delay, bool constant_noise, long int seed, int table, torch::Generator &generator, std::vector<float> &buffer){
+  assert(row_end - row_start <= SETTLE_CHUNK_ROWS);
+  buffer.resize(SETTLE_CHUNK_ROWS * dim);
+  bool sampled = false;
+  long int n_settled = 0;
+  for(long int row = row_start; row < row_end; row++){
+    int delay = delay_of(row);
+    assert(delay >= 0);
+    if(delay == 0 || delay < min_delay){
+      continue;
+    }
+    n_settled++;
+    settled(row);
+    if(scale == 0){
+      continue;
+    }
+
+    float *noise_row = buffer.data() + (row - row_start) * dim;
+    if(constant_noise){
+      std::fill(noise_row, noise_row + dim, scale * delay);
+    }
+    else if(seed >= 0){
+      philox_normal_row(noise_row, dim, sqrtf((float)delay) * scale, seed, table, row, cnt_iter);
+    }
+    else{
+      // rows of the chunk are sampled at once, only when the first row to settle is found
+      if(!sampled){
+        torch::Tensor noise_slice = torch::from_blob(buffer.data(), {row_end - row_start, dim}, torch::kFloat);
+        torch::normal_out(noise_slice, 0, 1, {row_end - row_start, dim}, generator);
+        sampled = true;
+      }
+      float s = sqrtf((float)delay) * scale;
+      for(int k = 0; k < dim; k++){
+        noise_row[k] *= s;
+      }
+    }
+    float *weight_row = weight_ptr + row * dim;
+    #pragma omp simd
+    for(int k = 0; k < dim; k++){
+      weight_row[k] -= lr * noise_row[k];
+    }
+  }
+  return n_settled;
+}
+
+// Settle the delayed noise of rows [row_start, row_end) of a table whose delay (cnt_iter - HT[row])
+// is at least "min_delay", and set their HT to "cnt_iter". Rows are streamed in chunks with a
+// thread-private buffer, so no table-sized temporary is allocated. Uses "n_cores" threads directly
+// (not the worker pool), since it may run on spare cores concurrently with other kernels.
+long int settle_delayed_noise(torch::Tensor &weight, torch::Tensor &HT, long int row_start, long int row_end, int cnt_iter, float lr, float scale, int min_delay, bool constant_noise, long int seed, int table, int n_cores){
+  assert(weight.is_contiguous());
+  assert(HT.is_contiguous());
+  assert(HT.scalar_type() == torch::kInt32);
+  assert(0 <= row_start && row_start <= row_end && row_end <= weight.sizes()[0]);
+  int dim = weight.sizes()[1];
+  float *weight_ptr = weight.data<float>();
+  int *HT_ptr = HT.data<int>();
+  long int n_chunks = (row_end - row_start + SETTLE_CHUNK_ROWS - 1) / SETTLE_CHUNK_ROWS;
+  long int n_settled = 0;
+
+  #pragma omp parallel num_threads(n_cores) reduction(+:n_settled)
+  {
+    torch::Generator generator = make_generator<CPUGeneratorImpl>();
+    generator.set_current_seed(rand());
+    std::vector<float> buffer;
+
+    #pragma omp for schedule(dynamic)
+    for(long int c = 0; c < n_chunks; c++){
+      long int start = row_start + c * SETTLE_CHUNK_ROWS;
+      long int end = std::min(start + SETTLE_CHUNK_ROWS, row_end);
+      n_settled += settle_chunk(weight_ptr, dim, start, end,
+        [&](long int row){ return cnt_iter - HT_ptr[row]; },
+        [&](long int row){ HT_ptr[row] = cnt_iter; },
+        cnt_iter, lr, scale, min_delay, constant_noise, seed, table, generator, buffer);
+    }
+  }
+  return n_settled;
+}
+
+
+// Delayed noise SGD update of all tables at once, with the rows of each table split into contiguous
+// shards of at most "shard_rows" rows, so that the largest tables are processed by many threads at
+// the same time and do not set the time of the update alone. A shard owns its rows of the table and
+// of its HT: the gradient rows are bucketed by shard in one counting pass per table (the noise rows
+// are sorted, so the rows of a shard are a range of them), then every touched row of a shard gets
+// weight[row] -= lr * (noise + sum of its gradients), with noise ~ N(0, (sqrt(cnt_iter - HT[row]) *
+// scale)^2) (scale * delay when "constant_noise", for debugging) keyed as the fused update when
+// "seed" >= 0, and HT[row] = cnt_iter for the noise rows. Shards are claimed largest first, by the
+// threads of the node homing them if the table is homed (numa_home_rows)
+void sharded_delayed_noise_sgd_update(std::vector<torch::Tensor> &weights, std::vector<torch::Tensor> &HTs, const std::vector<torch::Tensor> &noise_indices, const std::vector<torch::Tensor> &grads, const std::vector<double> &lrs, int cnt_iter, float scale, bool constant_noise, long int seed, long int shard_rows, int n_cores){
+  const long int n_rows_per_block = 256; // rows of a shard sampled at once (seed < 0)
+  int n_tables = weights.size();
+  bool with_noise = !noise_indices.empty();
+  assert((int)HTs.size() == n_tables && (int)grads.size() == n_tables && (int)lrs.size() == n_tables);
+  assert(!with_noise || (int)noise_indices.size() == n_tables);
+  assert(shard_rows > 0);
+  std::vector<long int> n_rows(n_tables);
+  std::vector<long int> grad_offsets(n_tables + 1, 0);
+  for(int t = 0; t < n_tables; t++){
+    assert(weights[t].scalar_type() == torch::kFloat && weights[t].is_contiguous());
+    assert(HTs[t].scalar_type() == torch::kInt32 && HTs[t].is_contiguous() && HTs[t].numel() == weights[t].sizes()[0]);
+    assert(grads[t]._indices().sizes()[0] == 1 && grads[t]._values().is_contiguous() && grads[t]._values().scalar_type() == torch::kFloat);
+    assert(!with_noise || (noise_indices[t].scalar_type() == torch::kInt64 && noise_indices[t].is_contiguous()));
+    n_rows[t] = weights[t].sizes()[0];
+    grad_offsets[t + 1] = grad_offsets[t] + grads[t]._values().sizes()[0];
+  }
+
+  // shards of table t are [first_shard[t], first_shard[t + 1]), shard k of a table starts at row k * shard_rows
+  std::vector<table_chunk> shards = split_table_rows(n_rows, shard_rows);
+  long int n_shards = shards.size();
+  std::vector<long int> first_shard(n_tables + 1, 0);
+  for(const table_chunk &shard : shards){
+    first_shard[shard.table + 1]++;
+  }
+  for(int t = 0; t < n_tables; t++){
+    first_shard[t + 1] += first_shard[t];
+  }
+  scoped_trace trace("sharded_delayed_noise_sgd_update", n_shards, grad_offsets[n_tables] * (long int)sizeof(long int));
+
+  // 1. Bucket the positions of the gradient rows by shard: bucket[bucket_start[s], bucket_start[s + 1])
+  // are the gradient rows of shard s (the bucket of the last shard of a table ends where the first of
+  // the next table starts). The noise rows of shard s end at noise_end[s] of its table.
+  scratch_vector<long int> bucket_scratch("shard_buckets", grad_offsets[n_tables]);
+  std::vector<long int> &bucket = bucket_scratch.vec;
+  std::vector<long int> bucket_start(n_shards + 1, 0);
+  std::vector<long int> noise_end(n_shards, 0);
+  std::vector<int> order = order_tables_by_rows(std::vector<long int>(grad_offsets.begin() + 1, grad_offsets.end()));
+  #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(dynamic, 1)
+  for(int o = 0; o < n_tables; o++){
+    int t = order[o];
+    const long int *indices_ptr = grads[t]._indices().data<long int>();
+    long int n_grad_rows = grad_offsets[t + 1] - grad_offsets[t];
+    std::vector<long int> cursor(first_shard[t + 1] - first_shard[t] + 1, 0);
+    for(long int j = 0; j < n_grad_rows; j++){
+      assert(indices_ptr[j] >= 0 && indices_ptr[j] < n_rows[t]);
+      cursor[indices_ptr[j] / shard_rows + 1]++;
+    }
+    for(long int k = 0; k + 1 < (long int)cursor.size(); k++){
+      cursor[k + 1] += cursor[k];
+      bucket_start[first_shard[t] + k + 1] = grad_offsets[t] + cursor[k + 1];
+    }
+    for(long int j = 0; j < n_grad_rows; j++){
+      bucket[grad_offsets[t] + cursor[indices_ptr[j] / shard_rows]++] = j;
+    }
+
+    const long int *noise_ptr = with_noise ? noise_indices[t].data<long int>() : nullptr;
+    long int n_noise_rows = with_noise ? noise_indices[t].numel() : 0;
+    for(long int s = first_shard[t]; s < first_shard[t + 1]; s++){
+      noise_end[s] = std::lower_bound(noise_ptr, noise_ptr + n_noise_rows, shards[s].end) - noise_ptr;
+    }
+  }
+  auto noise_begin_of = [&](long int s){
+    return s == first_shard[shards[s].table] ? 0 : noise_end[s - 1];
+  };
+
+  // 2. Shards in descending order of their touched rows, the empty ones are dropped
+  std::vector<long int> shard_order;
+  std::vector<long int> work(n_shards);
+  for(long int s = 0; s < n_shards; s++){
+    work[s] = (noise_end[s] - noise_begin_of(s)) + (bucket_start[s + 1] - bucket_start[s]);
+    if(work[s] > 0){
+      shard_order.push_back(s);
+    }
+  }
+  std::stable_sort(shard_order.begin(), shard_order.end(), [&](long int lhs, long int rhs){
+    return work[lhs] > work[rhs];
+  });
+  std::vector<const std::vector<numa_row_range> *> layouts(n_tables);
+  for(int t = 0; t < n_tables; t++){
+    layouts[t] = numa_layout_of(weights[t].data_ptr());
+  }
+  std::vector<int> block_nodes(shard_order.size());
+  for(long int q = 0; q < (long int)shard_order.size(); q++){
+    const table_chunk &shard = shards[shard_order[q]];
+    block_nodes[q] = pool.nodes.empty() ? -1 : numa_row_node(layouts[shard.table], shard.start);
+  }
+  numa_block_queue queue(block_nodes);
+
+  // 3. Update shard by shard, each row of a shard once
+  #pragma omp parallel num_threads(pool_threads(n_cores))
+  {
+    torch::Generator generator = thread_generator();
+    std::vector<int_pair> pairs;
+    std::vector<float> acc;
+    std::vector<float> noise_buffer;
+
+    for(long int q = queue.next(); q >= 0; q = queue.next()){
+      long int s = shard_order[q];
+      int t = shards[s].table;
+      int dim = weights[t].sizes()[1];
+      float lr = lrs[t];
+      float *weight_ptr = weights[t].data<float>();
+      int *HT_ptr = HTs[t].data<int>();
+      const long int *indices_ptr = grads[t]._indices().data<long int>();
+      const float *values_ptr = grads[t]._values().data<float>();
+      const long int *noise_ptr = with_noise ? noise_indices[t].data<long int>() : nullptr;
+      long int noise_begin = noise_begin_of(s);
+      long int noise_stop = noise_end[s];
+      acc.resize(dim);
+      noise_buffer.resize(n_rows_per_block * dim);
+
+      pairs.clear();
+      for(long int b = bucket_start[s]; b < bucket_start[s + 1]; b++){
+        pairs.push_back(int_pair(indices_ptr[bucket[b]], bucket[b]));
+      }
+      std::sort(pairs.begin(), pairs.end(), [](const int_pair lhs, const int_pair rhs){
+        return lhs.first < rhs.first;
+      });
+
+      long int i = noise_begin;
+      long int g = 0;
+      long int n_pairs = pairs.size();
+      while(i < noise_stop || g < n_pairs){
+        long int row = i < noise_stop ? noise_ptr[i] : pairs[g].first;
+        row = g < n_pairs ? std::min(row, (long int)pairs[g].first) : row;
+        if(i < noise_stop && noise_ptr[i] == row){
+          int delay = cnt_iter - HT_ptr[row];
+          if(constant_noise){
+            std::fill(acc.begin(), acc.end(), scale * delay);
+          }
+          else if(seed >= 0){
+            philox_normal_row(acc.data(), dim, sqrtf((float)delay) * scale, seed, t, row, cnt_iter);
+          }
+          else{
+            long int k = (i - noise_begin) % n_rows_per_block;
+            if(k == 0){
+              long int n_sampled = std::min(n_rows_per_block, noise_stop - i);
+              torch::Tensor noise_slice = torch::from_blob(noise_buffer.data(), {n_sampled, dim}, torch::kFloat);
+              torch::normal_out(noise_slice, 0, 1, {n_sampled, dim}, generator);
+            }
+            float s_row = sqrtf((float)delay) * scale;
+            const float *noise_row = noise_buffer.data() + k * dim;
+            for(int d = 0; d < dim; d++){
+              acc[d] = s_row * noise_row[d];
+            }
+          }
+          HT_ptr[row] = cnt_iter;
+          i++;
+        }
+        else{
+          std::fill(acc.begin(), acc.end(), 0);
+        }
+        for(; g < n_pairs && pairs[g].first == row; g++){
+          const float *grad_row = values_ptr + pairs[g].second * dim;
+          #pragma omp simd
+          for(int d = 0; d < dim; d++){
+            acc[d] += grad_row[d];
+          }
+        }
+        sgd_update_row(weight_ptr + row * dim, acc.data(), lr, dim, nullptr);
+      }
+    }
+  }
+}
+
+// History Table (HT) of LazyDP: the iteration each row of each table was last updated.
+// Counters of all tables are held in one allocation which is initialized by the worker
+// threads (first touch), so pages are spread over the NUMA nodes of the threads using them.
+//
+// With "bits" of 16 or 8, each counter is a delta to the base iteration of its block of
+// HT_BLOCK_ROWS rows. A delta which does not fit is stored as the escape value (the maximum)
+// and marks the block. rebase() must be called after scatter_iter() of the same iteration:
+// it flushes the delayed noise of every row in the marked blocks into the embedding tables,
+// so that the whole block is up to date and its base can be moved to the current iteration.
+//
+// With "hot_set" (32 bits only), the rows of the last scatter_iter() of each table form its hot set,
+// held as a bitmap and a compact list: their counter is the iteration of that scatter, read from the
+// bitmap instead of the HT, and their counter is only written when they are not scattered again (i.e.,
+// leave the hot set). Rows accessed in every iteration (e.g., the head of a Zipf distribution) then take
+// the delayed noise of delay 1 and their HT is neither read nor written while they stay hot.
+//
+// With "blocked" (16 or 8 bits), the HT has two levels for tables whose rows are clustered by their
+// accesses (e.g., reordered by hotness): each group of HT_GROUP_ROWS rows holds the last iteration any
+// of its rows was updated and a bitmap of the rows lagging behind it, and only the lagging rows read
+// their delta counter (the lag). Rows updated together leave the bitmap empty, so their gathers read the
+// group alone and their scatters write it alone. A lag which does not fit queues the row to be flushed
+// by rebase() (its delayed noise is applied and its counter becomes the iteration of the group).
+const long int HT_BLOCK_ROWS = 4096;
+const int HT_GROUP_ROWS = 64;
+
+struct alignas(16) HTGroup{
+  uint64_t lagging; // rows whose counter is iter - lag
+  int iter;         // last iteration any row of the group was updated
+};
+
+struct HTPendingRow{
+  int table;
+  long int row;
+  int iter; // the counter of the row before it was queued
+};
+
+class HistoryTable{
+public:
+  HistoryTable(const std::vector<long int> &n_rows, int bits, int n_cores, const std::string &huge_pages, bool hot_set, bool blocked) : n_rows(n_rows), bits(bits), n_cores(n_cores), hot_set(hot_set), blocked(blocked){
+    assert(bits == 32 || bits == 16 || bits == 8);
+    assert(!hot_set || bits == 32);
+    assert(!blocked || bits != 32);
+    escape = bits == 32 ? 0 : (1U << bits) - 1;
+    offsets.push_back(0);
+    block_offsets.push_back(0);
+    for(long int n : n_rows){
+      offsets.push_back(offsets.back() + n);
+      block_offsets.push_back(block_offsets.back() + (n + HT_BLOCK_ROWS - 1) / HT_BLOCK_ROWS);
+    }
+    long int n_bytes = offsets.back() * (bits / 8);
+    std::shared_ptr<void> allocation = huge_page_alloc(n_bytes, huge_pages, MEMORY_HISTORY_TABLE);
+    storage = std::shared_ptr<unsigned char[]>(allocation, (unsigned char *)allocation.get());
+    bases.assign(block_offsets.back(), 0);
+    marked.assign(block_offsets.back(), 0);
+    if(blocked){
+      group_offsets.push_back(0);
+      for(long int n : n_rows){
+        long int n_groups = (n + HT_GROUP_ROWS - 1) / HT_GROUP_ROWS;
+        group_offsets.push_back(group_offsets.back() + n_groups);
+        touched.emplace_back(n_groups, 0);
+      }
+      groups.assign(group_offsets.back(), HTGroup{0, 0});
+    }
+    if(hot_set){
+      for(long int n : n_rows){
+        hot_bits.emplace_back((n + 63) / 64, 0);
+        next_bits.emplace_back((n + 63) / 64, 0);
+      }
+      hot_rows.resize(n_rows.size());
+      hot_iters.assign(n_rows.size(), -1);
+    }
+
+    unsigned char *storage_ptr = storage.get();
+    #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(static)
+    for(long int i = 0; i < n_bytes; i++){
+      storage_ptr[i] = 0;
+    }
+  }
+
+  // Counters of a table as an int32 tensor: a view for 32 bits (valid while this object is
+  // alive), a decompressed copy otherwise. The counters of the hot set are written back first.
+  torch::Tensor table(int t){
+    assert(t >= 0 && t < (int)n_rows.size());
+    if(hot_set){
+      flush_hot(t);
+    }
+    if(bits == 32){
+      return torch::from_blob((int *)storage.get() + offsets[t], {n_rows[t]}, torch::kInt32);
+    }
+    torch::Tensor output = torch::empty({n_rows[t]}, torch::kInt32);
+    int *output_ptr = output.data<int>();
+    #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(static)
+    for(long int row = 0; row < n_rows[t]; row++){
+      output_ptr[row] = get(t, row);
+    }
+    return output;
+  }
+
+  // delays[t][j] = cnt_iter - HT[table_ids[t]][indices[t][j]]
+  std::vector<torch::Tensor> gather_delays(const std::vector<int> &table_ids, const std::vector<torch::Tensor> &indices, int cnt_iter){
+    assert(pending.empty()); // rebase() has to follow scatter_iter()
+    std::vector<torch::Tensor> delays = allocate_like(indices, torch::kInt32);
+    run_over_chunks(table_ids, indices, [&](int t, int table_id, const auto *idx, long int start, long int end){
+      int *out = delays[t].data<int>();
+      for(long int j = start; j < end; j++){
+        out[j] = cnt_iter - get(table_id, idx[j]);
+      }
+    });
+    return delays;
+  }
+
+  // stds[t][j] = sqrt(cnt_iter - HT[table_ids[t]][indices[t][j]]) * scale, i.e., the standard
+  // deviation of the delayed noise (scale: noise_multiplier * max_grad_norm)
+  std::vector<torch::Tensor> gather_stds(const std::vector<int> &table_ids, const std::vector<torch::Tensor> &indices, int cnt_iter, float scale){
+    assert(pending.empty());
+    std::vector<torch::Tensor> stds = allocate_like(indices, torch::kFloat);
+    run_over_chunks(table_ids, indices, [&](int t, int table_id, const auto *idx, long int start, long int end){
+      float *out = stds[t].data<float>();
+      for(long int j = start; j < end; j++){
+        out[j] = sqrtf((float)(cnt_iter - get(table_id, idx[j]))) * scale;
+      }
+    });
+    return stds;
+  }
+
+  // Same as delayed_noise_with_extra() for the table "table_id" of this HT
+  torch::Tensor delayed_noise_with_extra(int table_id, const torch::Tensor &indices, int dim, int extra, int cnt_iter, float scale, long int seed){
+    assert(table_id >= 0 && table_id < (int)n_rows.size());
+    return delayed_noise_kernel([&](long int row){ return get(table_id, row); }, indices, dim, extra, cnt_iter, scale, seed, table_id, n_cores);
+  }
+
+  // HT[table_ids[t]][indices[t][j]] = iter (indices of each table are expected to be unique)
+  void scatter_iter(const std::vector<int> &table_ids, const std::vector<torch::Tensor> &indices, int iter){
+    if(hot_set){
+      scatter_hot(table_ids, indices, iter);
+      return;
+    }
+    if(blocked){
+      scatter_blocked(table_ids, indices, iter);
+      return;
+    }
+    run_over_chunks(table_ids, indices, [&](int t, int table_id, const auto *idx, long int start, long int end){
+      for(long int j = start; j < end; j++){
+        set(table_id, idx[j], iter);
+      }
+    });
+  }
+
+  // Flush the delayed noise of the marked blocks, i.e.,
+  // weights[t][row] -= lrs[t] * noise(delay = cnt_iter - HT[t][row]) for every row of the blocks,
+  // where noise ~ N(0, (sqrt(delay) * scale)^2), or scale * delay when "constant_noise" (for debugging).
+  // Philox keyed by (seed, table, row, cnt_iter) is used when "seed" >= 0. Returns the number of flushed blocks
+  // (with "blocked", the queued rows are flushed with their counter before the queueing, and their number is returned).
+  int rebase(std::vector<torch::Tensor> &weights, const std::vector<float> &lrs, int cnt_iter, float scale, bool constant_noise, long int seed){
+    assert(weights.size() == n_rows.size());
+    assert(lrs.size() == n_rows.size());
+    if(bits == 32){
+      return 0;
+    }
+    if(blocked){
+      return flush_pending(weights, lrs, cnt_iter, scale, constant_noise, seed);
+    }
+
+    std::vector<std::pair<int, long int>> blocks; // (table, block in the table)
+    for(int t = 0; t < (int)n_rows.size(); t++){
+      for(long int b = block_offsets[t]; b < block_offsets[t + 1]; b++){
+        if(marked[b]){
+          blocks.push_back(std::make_pair(t, b - block_offsets[t]));
+        }
+      }
+    }
+    int n_blocks = blocks.size();
+
+    #pragma omp parallel num_threads(pool_threads(n_cores))
+    {
+      torch::Generator generator = thread_generator();
+      std::vector<float> buffer;
+
+      #pragma omp for schedule(dynamic)
+      for(int i = 0; i < n_blocks; i++){
+        int t = blocks[i].first;
+        long int b = block_offsets[t] + blocks[i].second;
+        assert(weights[t].is_contiguous());
+        float *weight_ptr = weights[t].data<float>();
+        int dim = weights[t].sizes()[1];
+        long int row_start = blocks[i].second * HT_BLOCK_ROWS;
+        long int row_end = std::min(row_start + HT_BLOCK_ROWS, n_rows[t]);
+
+        // escaped counters were set by scatter_iter() of this iteration (delay 0)
+        for(long int chunk = row_start; chunk < row_end; chunk += SETTLE_CHUNK_ROWS){
+          settle_chunk(weight_ptr, dim, chunk, std::min(chunk + SETTLE_CHUNK_ROWS, row_end),
+            [&](long int row){ unsigned int d = load(offsets[t] + row); return d == escape ? 0 : cnt_iter - (bases[b] + (int)d); },
+            [](long int row){},
+            cnt_iter, lrs[t], scale, 1, constant_noise, seed, t, generator, buffer);
+        }
+
+        // every row of the block is now up to date
+        for(long int row = row_start; row < row_end; row++){
+          store(offsets[t] + row, 0);
+        }
+        bases[b] = cnt_iter;
+        marked[b] = 0;
+      }
+    }
+    return n_blocks;
+  }
+
+  // Rows in the hot set of each table
+  std::vector<long int> hot_set_sizes(){
+    std::vector<long int> sizes;
+    for(int t = 0; t < (int)n_rows.size(); t++){
+      sizes.push_back(hot_set ? hot_rows[t].size() : 0);
+    }
+    return sizes;
+  }
+
+  // Same as settle_delayed_noise() for the table "table_id" of this HT. With 16/8-bit counters,
+  // rebase() has to follow since settled counters may escape.
+  long int settle(int table_id, torch::Tensor &weight, long int row_start, long int row_end, int cnt_iter, float lr, float scale, int min_delay, bool constant_noise, long int seed, int n_threads){
+    assert(table_id >= 0 && table_id < (int)n_rows.size());
+    assert(weight.is_contiguous());
+    assert(0 <= row_start && row_start <= row_end && row_end <= n_rows[table_id]);
+    int dim = weight.sizes()[1];
+    float *weight_ptr = weight.data<float>();
+    // chunks are aligned to SETTLE_CHUNK_ROWS, so each group of the blocked HT is settled by one thread
+    long int first = row_start / SETTLE_CHUNK_ROWS * SETTLE_CHUNK_ROWS;
+    long int n_chunks = (row_end - first + SETTLE_CHUNK_ROWS - 1) / SETTLE_CHUNK_ROWS;
+    long int n_settled = 0;
+
+    #pragma omp parallel num_threads(n_threads) reduction(+:n_settled)
+    {
+      torch::Generator generator = make_generator<CPUGeneratorImpl>();
+      generator.set_current_seed(rand());
+      std::vector<float> buffer;
+
+      #pragma omp for schedule(dynamic)
+      for(long int c = 0; c < n_chunks; c++){
+        long int start = std::max(row_start, first + c * SETTLE_CHUNK_ROWS);
+        long int end = std::min(first + (c + 1) * SETTLE_CHUNK_ROWS, row_end);
+        n_settled += settle_chunk(weight_ptr, dim, start, end,
+          [&](long int row){ return cnt_iter - get(table_id, row); },
+          [&](long int row){ set(table_id, row, cnt_iter); },
+          cnt_iter, lr, scale, min_delay, constant_noise, seed, table_id, generator, buffer);
+      }
+    }
+    return n_settled;
+  }
+
+private:
+  std::vector<long int> n_rows;
+  int bits;
+  int n_cores;
+  unsigned int escape;
+  std::vector<long int> offsets;        // first counter of each table
+  std::vector<long int> block_offsets;  // first block of each table
+  std::shared_ptr<unsigned char[]> storage;
+  std::vector<int> bases;               // base iteration of each block (16/8 bits only)
+  std::vector<unsigned char> marked;    // blocks which have an escaped counter
+  bool hot_set;
+  std::vector<std::vector<uint64_t>> hot_bits;  // bitmap of the hot set of each table
+  std::vector<std::vector<uint64_t>> next_bits; // bitmap of the next hot set, built by scatter_hot()
+  std::vector<std::vector<long int>> hot_rows;  // the rows of the hot set (a subset after set() of hot rows)
+  std::vector<int> hot_iters;                   // the counter of every hot row of each table
+  bool blocked;
+  std::vector<long int> group_offsets;          // first group of each table (blocked only)
+  std::vector<HTGroup> groups;
+  std::vector<std::vector<uint64_t>> touched;   // rows of each group scattered by scatter_blocked()
+  std::vector<HTPendingRow> pending;            // rows to be flushed by rebase()
+
+  inline bool is_hot(const std::vector<uint64_t> &bitmap, long int row) const{
+    return (bitmap[row >> 6] >> (row & 63)) & 1;
+  }
+
+  inline void set_bit(std::vector<uint64_t> &bitmap, long int row){
+    uint64_t mask = 1ULL << (row & 63);
+    #pragma omp atomic update
+    bitmap[row >> 6] |= mask;
+  }
+
+  inline void clear_bit(std::vector<uint64_t> &bitmap, long int row){
+    uint64_t mask = ~(1ULL << (row & 63));
+    #pragma omp atomic update
+    bitmap[row >> 6] &= mask;
+  }
+
+  // The rows of indices become the hot set of iteration "iter" (the hot set of a table scattered
+  // twice in an iteration grows), and the rows of the previous hot set which are not scattered again
+  // take their counter
+  void scatter_hot(const std::vector<int> &table_ids, const std::vector<torch::Tensor> &indices, int iter){
+    run_over_chunks(table_ids, indices, [&](int t, int table_id, const auto *idx, long int start, long int end){
+      if(hot_iters[table_id] == iter){
+        return;
+      }
+      for(long int j = start; j < end; j++){
+        set_bit(next_bits[table_id], idx[j]);
+      }
+    });
+
+    for(int k = 0; k < (int)table_ids.size(); k++){
+      int t = table_ids[k];
+      torch::Tensor idx = indices[k].to(torch::kInt64).contiguous();
+      const long int *idx_ptr = idx.data<long int>();
+      long int n_idx = idx.numel();
+      if(hot_iters[t] == iter){
+        for(long int j = 0; j < n_idx; j++){
+          if(!is_hot(hot_bits[t], idx_ptr[j])){
+            set_bit(hot_bits[t], idx_ptr[j]);
+            hot_rows[t].push_back(idx_ptr[j]);
+          }
+        }
+        continue;
+      }
+
+      std::vector<long int> &rows = hot_rows[t];
+      long int n_hot = rows.size();
+      int hot_iter = hot_iters[t];
+      #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(static)
+      for(long int j = 0; j < n_hot; j++){
+        long int row = rows[j];
+        if(!is_hot(hot_bits[t], row)){
+          continue;
+        }
+        if(!is_hot(next_bits[t], row)){
+          store_iter(t, row, hot_iter);
+        }
+        clear_bit(hot_bits[t], row);
+      }
+      std::swap(hot_bits[t], next_bits[t]);
+      rows.assign(idx_ptr, idx_ptr + n_idx);
+      hot_iters[t] = iter;
+    }
+  }
+
+  // The rows of each group in indices are first marked in "touched", then every touched group is
+  // advanced by the thread which marked it first
+  void scatter_blocked(const std::vector<int> &table_ids, const std::vector<torch::Tensor> &indices, int iter){
+    int n_threads = pool_threads(n_cores);
+    std::vector<std::vector<std::pair<int, long int>>> first_touches(n_threads);
+    run_over_chunks(table_ids, indices, [&](int t, int table_id, const auto *idx, long int start, long int end){
+      std::vector<std::pair<int, long int>> &first = first_touches[omp_get_thread_num()];
+      uint64_t *touched_ptr = touched[table_id].data();
+      for(long int j = start; j < end; j++){
+        long int row = idx[j];
+        if(__atomic_fetch_or(&touched_ptr[row / HT_GROUP_ROWS], 1UL << (row % HT_GROUP_ROWS), __ATOMIC_RELAXED) == 0){
+          first.push_back(std::make_pair(table_id, row / HT_GROUP_ROWS));
+        }
+      }
+    });
+
+    std::vector<std::pair<int, long int>> touched_groups;
+    for(const auto &first : first_touches){
+      touched_groups.insert(touched_groups.end(), first.begin(), first.end());
+    }
+    long int n_groups = touched_groups.size();
+    #pragma omp parallel for num_threads(n_threads) schedule(dynamic, 256)
+    for(long int i = 0; i < n_groups; i++){
+      int t = touched_groups[i].first;
+      long int g = touched_groups[i].second;
+      advance_group(t, g, touched[t][g], iter);
+      touched[t][g] = 0;
+    }
+  }
+
+  // The rows "mask" of the g-th group of table t are updated at iteration "iter": the group moves
+  // to "iter", and the lag of its other rows grows accordingly
+  void advance_group(int t, long int g, uint64_t mask, int iter){
+    HTGroup &group = groups[group_offsets[t] + g];
+    assert(iter >= group.iter);
+    if(iter == group.iter){
+      group.lagging &= ~mask;
+      return;
+    }
+    long int row_start = g * HT_GROUP_ROWS;
+    long int n = std::min((long int)HT_GROUP_ROWS, n_rows[t] - row_start);
+    uint64_t others = (n == HT_GROUP_ROWS ? ~0UL : (1UL << n) - 1) & ~mask;
+    long int shift = (long int)iter - group.iter;
+    uint64_t lagging = 0;
+    for(; others != 0; others &= others - 1){
+      int r = __builtin_ctzll(others);
+      long int row = row_start + r;
+      long int lag = shift + (((group.lagging >> r) & 1) ? load(offsets[t] + row) : 0);
+      if(lag < escape){
+        store(offsets[t] + row, lag);
+        lagging |= 1UL << r;
+      }
+      else{
+        #pragma omp critical(ht_pending)
+        pending.push_back(HTPendingRow{t, row, (int)(iter - lag)});
+      }
+    }
+    group.lagging = lagging;
+    group.iter = iter;
+  }
+
+  int flush_pending(std::vector<torch::Tensor> &weights, const std::vector<float> &lrs, int cnt_iter, float scale, bool constant_noise, long int seed){
+    long int n_pending = pending.size();
+    #pragma omp parallel num_threads(pool_threads(n_cores))
+    {
+      torch::Generator generator = thread_generator();
+      std::vector<float> buffer;
+
+      #pragma omp for schedule(dynamic, 64)
+      for(long int i = 0; i < n_pending; i++){
+        const HTPendingRow &p = pending[i];
+        assert(weights[p.table].is_contiguous());
+        settle_chunk(weights[p.table].data<float>(), weights[p.table].sizes()[1], p.row, p.row + 1,
+          [&](long int row){ return cnt_iter - p.iter; },
+          [](long int row){},
+          cnt_iter, lrs[p.table], scale, 1, constant_noise, seed, p.table, generator, buffer);
+      }
+    }
+    pending.clear();
+    return n_pending;
+  }
+
+  // Write back the counters of the hot set of table t, which becomes empty
+  void flush_hot(int t){
+    std::vector<long int> &rows = hot_rows[t];
+    long int n_hot = rows.size();
+    #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(static)
+    for(long int j = 0; j < n_hot; j++){
+      if(is_hot(hot_bits[t], rows[j])){
+        store_iter(t, rows[j], hot_iters[t]);
+        clear_bit(hot_bits[t], rows[j]);
+      }
+    }
+    rows.clear();
+  }
+
+  inline unsigned int load(long int i) const{
+    if(bits == 16){
+      return ((const uint16_t *)storage.get())[i];
+    }
+    return storage[i];
+  }
+
+  inline void store(long int i, unsigned int d){
+    if(bits == 16){
+      ((uint16_t *)storage.get())[i] = d;
+    }
+    else{
+      storage[i] = d;
+    }
+  }
+
+  inline int get(int t, long int row) const{
+    if(hot_set && is_hot(hot_bits[t], row)){
+      return hot_iters[t];
+    }
+    if(blocked){
+      const HTGroup &group = groups[group_offsets[t] + row / HT_GROUP_ROWS];
+      if(((group.lagging >> (row % HT_GROUP_ROWS)) & 1) == 0){
+        return group.iter;
+      }
+      return group.iter - (int)load(offsets[t] + row);
+    }
+    if(bits == 32){
+      return ((const int *)storage.get())[offsets[t] + row];
+    }
+    unsigned int d = load(offsets[t] + row);
+    assert(d != escape); // rebase() has to follow scatter_iter()
+    return bases[block_offsets[t] + row / HT_BLOCK_ROWS] + (int)d;
+  }
+
+  inline void set(int t, long int row, int iter){
+    if(hot_set && is_hot(hot_bits[t], row)){
+      // the row leaves the hot set (its entry of hot_rows is skipped)
+      clear_bit(hot_bits[t], row);
+    }
+    if(blocked){
+      advance_group(t, row / HT_GROUP_ROWS, 1UL << (row % HT_GROUP_ROWS), iter);
+      return;
+    }
+    store_iter(t, row, iter);
+  }
+
+  inline void store_iter(int t, long int row, int iter){
+    if(bits == 32){
+      ((int *)storage.get())[offsets[t] + row] = iter;
+      return;
+    }
+    long int b = block_offsets[t] + row / HT_BLOCK_ROWS;
+    long int d = (long int)iter - bases[b];
+    assert(d >= 0);
+    if(d >= escape){
+      store(offsets[t] + row, escape);
+      #pragma omp atomic write
+      marked[b] = 1;
+    }
+    else{
+      store(offsets[t] + row, d);
+    }
+  }
+
+  std::vector<torch::Tensor> allocate_like(const std::vector<torch::Tensor> &indices, ScalarType type){
+    std::vector<torch::Tensor> outputs;
+    for(const torch::Tensor &idx : indices){
+      outputs.push_back(torch::empty({idx.numel()}, type));
+    }
+    return outputs;
+  }
+
+  // Run "func" over chunks of the indices (int32 or int64) of all tables with a single thread team
+  template<typename F>
+  void run_over_chunks(const std::vector<int> &table_ids, const std::vector<torch::Tensor> &indices, F func){
+    const long int chunk_rows = 4096;
+    assert(table_ids.size() == indices.size());
+    std::vector<long int> n_indices;
+    for(const torch::Tensor &idx : indices){
+      assert(idx.is_contiguous());
+      n_indices.push_back(idx.numel());
+    }
+    std::vector<table_chunk> chunks = split_table_rows(n_indices, chunk_rows);
+    int n_chunks = chunks.size();
+
+    #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(dynamic)
+    for(int c = 0; c < n_chunks; c++){
+      const table_chunk &chunk = chunks[c];
+      int table_id = table_ids[chunk.table];
+      assert(table_id >= 0 && table_id < (int)n_rows.size());
+      const torch::Tensor &idx = indices[chunk.table];
+      if(idx.scalar_type() == torch::kInt){
+        func(chunk.table, table_id, idx.data<int>(), chunk.start, chunk.end);
+      }
+      else{
+        func(chunk.table, table_id, idx.data<long int>(), chunk.start, chunk.end);
+      }
+    }
+  }
+};
+
+
+// Background worker of LazyDP which derives the unique indices of the next iteration and the
+// standard deviations of their delayed noise (sqrt(cnt_iter - HT) * scale), while the main thread
+// runs forward/backward. The HT must not be updated between submit() and wait().
+class NextIterationPrefetcher{
+public:
+  NextIterationPrefetcher(int n_cores) : n_cores(n_cores){}
+
+  ~NextIterationPrefetcher(){
+    if(worker.joinable()){
+      worker.join();
+    }
+  }
+
+  // HT of each table as an int32 tensor
+  void submit(const std::vector<torch::Tensor> &lS_i_nxt, const std::vector<torch::Tensor> &HT, int cnt_iter, float scale){
+    assert(lS_i_nxt.size() == HT.size());
+    launch(lS_i_nxt, [=](const std::vector<torch::Tensor> &uniques){
+      std::vector<torch::Tensor> stds(uniques.size());
+      for(int t = 0; t < (int)uniques.size(); t++){
+        const int *HT_ptr = HT[t].data<int>();
+        const long int *idx = uniques[t].data<long int>();
+        stds[t] = torch::empty({uniques[t].numel()}, torch::kFloat);
+        float *out = stds[t].data<float>();
+        #pragma omp parallel for num_threads(n_cores) schedule(static)
+        for(long int j = 0; j < uniques[t].numel(); j++){
+          out[j] = sqrtf((float)(cnt_iter - HT_ptr[idx[j]])) * scale;
+        }
+      }
+      return stds;
+    });
+  }
+
+  // HT held by custom_api_cpp.HistoryTable (it must outlive wait())
+  void submit_native(const std::vector<torch::Tensor> &lS_i_nxt, HistoryTable &HT, int cnt_iter, float scale){
+    HistoryTable *HT_ptr = &HT;
+    launch(lS_i_nxt, [=](const std::vector<torch::Tensor> &uniques){
+      std::vector<int> table_ids(uniques.size());
+      std::iota(table_ids.begin(), table_ids.end(), 0);
+      return HT_ptr->gather_stds(table_ids, uniques, cnt_iter, scale);
+    });
+  }
+
+  // (unique indices, stds) of each table
+  std::tuple<std::vector<torch::Tensor>, std::vector<torch::Tensor>> wait(){
+    assert(worker.joinable());
+    worker.join();
+    return std::make_tuple(uniques, stds);
+  }
+
+private:
+  int n_cores;
+  std::thread worker;
+  std::vector<torch::Tensor> uniques;
+  std::vector<torch::Tensor> stds;
+
+  template<typename F>
+  void launch(const std::vector<torch::Tensor> &lS_i_nxt, F gather){
+    if(worker.joinable()){
+      worker.join();
+    }
+    std::vector<torch::Tensor> inputs;
+    for(const torch::Tensor &lS_i : lS_i_nxt){
+      inputs.push_back(lS_i.contiguous());
+    }
+    worker = std::thread([this, inputs, gather](){
+      uniques = unique_multi_table(inputs, n_cores);
+      stds = gather(uniques);
+    });
+  }
+};
+
+// The per-table work of the LazyDP update as a TBB flow graph (in the arena of init_tbb_arena() if any):
+// for each table, the stds of its noise rows are gathered from its HT, then the noise, the merge with the
+// gradient, the coalescing and the SGD update run as one node (fused_delayed_noise_sgd_update) while
+// another node sets HT[rows] = cnt_iter. The tables share no node, so the stages of different tables
+// overlap instead of running table after table. submit() starts the graph and returns, wait() blocks
+// until all nodes are done (and rethrows the error of a node). Each node runs its kernel with a team of
+// "n_cores" threads, so several tables are processed at once on the cores of the pool
+class IterationGraph{
+public:
+  IterationGraph(int n_cores) : n_cores(n_cores){}
+
+  ~IterationGraph(){
+    if(graph != nullptr){
+      graph->wait_for_all();
+    }
+  }
+
+  // "noise_indices" (int64, unique and sorted) of each table, or an empty list for no noise. The HT of
+  // each table is an int32 tensor, the tables are fp32. stds are sqrt(cnt_iter - HT[row]) * scale, or
+  // (cnt_iter - HT[row]) * scale with "constant_noise" (for debugging), as sharded_delayed_noise_sgd_update
+  void submit(std::vector<torch::Tensor> &weights, std::vector<torch::Tensor> &HTs, const std::vector<torch::Tensor> &noise_indices, const std::vector<torch::Tensor> &grads, const std::vector<double> &lrs, int cnt_iter, float scale, bool constant_noise, long int seed){
+    wait();
+    int n_tables = weights.size();
+    bool with_noise = !noise_indices.empty();
+    assert((int)HTs.size() == n_tables && (int)grads.size() == n_tables && (int)lrs.size() == n_tables);
+    assert(!with_noise || (int)noise_indices.size() == n_tables);
+    std::vector<long int> n_rows(n_tables);
+    for(int t = 0; t < n_tables; t++){
+      assert(weights[t].scalar_type() == torch::kFloat && weights[t].is_contiguous());
+      assert(HTs[t].scalar_type() == torch::kInt32 && HTs[t].is_contiguous() && HTs[t].numel() == weights[t].sizes()[0]);
+      assert(!with_noise || (noise_indices[t].scalar_type() == torch::kInt64 && noise_indices[t].is_contiguous()));
+      n_rows[t] = (with_noise ? noise_indices[t].numel() : 0) + grads[t]._values().sizes()[0];
+    }
+    // the tensors are held until the next submit(), the graph runs after this call returns
+    this->weights = weights;
+    this->HTs = HTs;
+    this->grads = grads;
+    this->noise_indices = with_noise ? noise_indices : std::vector<torch::Tensor>(n_tables, torch::empty({0}, torch::kInt64));
+    stds.assign(n_tables, torch::Tensor());
+
+    start.reset();
+    nodes.clear();
+    graph.reset();
+    in_tbb_arena([&]{ graph = std::make_unique<tbb::flow::graph>(); });
+    start = std::make_unique<tbb::flow::broadcast_node<tbb::flow::continue_msg>>(*graph);
+    // the largest tables are connected (and spawned) first
+    for(int t : order_tables_by_rows(n_rows)){
+      node_type &gather = add_node([=](){
+        stds[t] = gather_stds(t, cnt_iter, scale, constant_noise);
+      });
+      node_type &update = add_node([=](){
+        fused_delayed_noise_sgd_update(this->weights[t], this->noise_indices[t], stds[t], this->grads[t], lrs[t], constant_noise, seed, t, cnt_iter, -1, n_cores);
+      });
+      node_type &scatter = add_node([=](){
+        int *HT_ptr = this->HTs[t].data<int>();
+        const long int *idx = this->noise_indices[t].data<long int>();
+        for(long int j = 0; j < this->noise_indices[t].numel(); j++){
+          HT_ptr[idx[j]] = cnt_iter;
+        }
+      });
+      tbb::flow::make_edge(*start, gather);
+      tbb::flow::make_edge(gather, update);
+      tbb::flow::make_edge(gather, scatter);
+    }
+    start->try_put(tbb::flow::continue_msg());
+  }
+
+  void wait(){
+    if(graph != nullptr){
+      graph->wait_for_all();
+    }
+  }
+
+private:
+  typedef tbb::flow::continue_node<tbb::flow::continue_msg> node_type;
+
+  int n_cores;
+  std::unique_ptr<tbb::flow::graph> graph;
+  std::unique_ptr<tbb::flow::broadcast_node<tbb::flow::continue_msg>> start;
+  std::vector<std::unique_ptr<node_type>> nodes;
+  std::vector<torch::Tensor> weights;
+  std::vector<torch::Tensor> HTs;
+  std::vector<torch::Tensor> noise_indices;
+  std::vector<torch::Tensor> grads;
+  std::vector<torch::Tensor> stds;
+
+  template<typename F>
+  node_type &add_node(F body){
+    int n_threads = n_cores;
+    nodes.push_back(std::make_unique<node_type>(*graph, [body, n_threads](const tbb::flow::continue_msg &){
+      scoped_team team(n_threads);
+      body();
+    }));
+    return *nodes.back();
+  }
+
+  torch::Tensor gather_stds(int t, int cnt_iter, float scale, bool constant_noise){
+    const int *HT_ptr = HTs[t].data<int>();
+    const long int *idx = noise_indices[t].data<long int>();
+    long int n = noise_indices[t].numel();
+    torch::Tensor std = torch::empty({n}, torch::kFloat);
+    float *out = std.data<float>();
+    #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(static)
+    for(long int j = 0; j < n; j++){
+      float delay = (float)(cnt_iter - HT_ptr[idx[j]]);
+      out[j] = (constant_noise ? delay : sqrtf(delay)) * scale;
+    }
+    return std;
+  }
+};
+
+// The CPU side of the embedding tables of a LazyDP iteration behind two calls: prepare_next() takes the
+// sparse features of the next batch and derives their unique rows (the rows taking the delayed noise),
+// and step() updates every table in place (weight[row] -= lr * (delayed noise + sum of its gradients), the
+// fused kernel), sets the HT of the noise rows and advances the iteration. The engine holds the tables
+// (fp32, the storage of the parameters), their HT (int32), the Philox key of the noise and the unique rows
+// between the two calls, so an iteration crosses from Python twice instead of once per stage and table.
+//
+// step_async() runs the update on a background thread from the smallest table to the largest, and each
+// table is marked ready as soon as it is updated: wait_table() returns once a table is final, so the lookups
+// of the next forward pass start on the small tables while the large ones are still updated. The tables and
+// their HT must not be touched otherwise before wait()
+class LazyDPEmbeddingEngine{
+public:
+  // stds are sqrt(cnt_iter - HT[row]) * scale, or (cnt_iter - HT[row]) * scale with "constant_noise" (for
+  // debugging). "seed" < 0 samples the noise with the torch generators instead of Philox
+  LazyDPEmbeddingEngine(const std::vector<torch::Tensor> &weights, const std::vector<torch::Tensor> &HTs, float scale, bool constant_noise, long int seed, int cnt_iter, int n_cores)
+    : weights(weights), HTs(HTs), scale(scale), constant_noise(constant_noise), seed(seed), cnt_iter(cnt_iter), n_cores(n_cores),
+      updated(weights.size()), ready_iter(cnt_iter){
+    assert(HTs.size() == weights.size());
+    for(int t = 0; t < (int)weights.size(); t++){
+      assert(weights[t].scalar_type() == torch::kFloat && weights[t].is_contiguous());
+      assert(HTs[t].scalar_type() == torch::kInt32 && HTs[t].is_contiguous() && HTs[t].numel() == weights[t].sizes()[0]);
+      updated[t].store(cnt_iter, std::memory_order_relaxed);
+    }
+  }
+
+  ~LazyDPEmbeddingEngine(){
+    wait();
+  }
+
+  // Unique rows of "lS_i_nxt" (int64 or int32 indices of each table), returned as int64
+  std::vector<torch::Tensor> prepare_next(const std::vector<torch::Tensor> &lS_i_nxt){
+    int n_tables = weights.size();
+    assert((int)lS_i_nxt.size() == n_tables);
+    noise_indices.resize(n_tables);
+    for(int t = 0; t < n_tables; t++){
+      noise_indices[t] = unique_auto(lS_i_nxt[t], weights[t].sizes()[0], n_cores).to(torch::kInt64);
+    }
+    return noise_indices;
+  }
+
+  // The update of this iteration with the sparse gradient of each table, the noise rows being those of
+  // the last prepare_next() (none without it). The largest tables are updated first
+  void step(const std::vector<torch::Tensor> &grads, float lr){
+    wait();
+    update(grads, lr, take_noise_indices(grads.size()), false);
+    ready_iter = cnt_iter;
+  }
+
+  // Same as step() on a background thread, the smallest tables first (see wait_table())
+  void step_async(const std::vector<torch::Tensor> &grads, float lr){
+    wait();
+    ready_iter = cnt_iter + 1;
+    std::vector<torch::Tensor> indices = take_noise_indices(grads.size());
+    worker = std::thread([this, grads, lr, indices](){
+      update(grads, lr, indices, true);
+    });
+  }
+
+  // Waits until table t is updated by the last step_async()
+  void wait_table(int t){
+    assert(t >= 0 && t < (int)weights.size());
+    for(int spin = 0; updated[t].load(std::memory_order_acquire) < ready_iter; spin++){
+      if(spin >= 64){
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  // Waits for the update of the last step_async()
+  void wait(){
+    if(worker.joinable()){
+      worker.join();
+    }
+  }
+
+  // cnt_iter is advanced by the worker of step_async(), ready_iter is already the iteration after it
+  int iteration() const{
+    return ready_iter;
+  }
+
+private:
+  std::vector<torch::Tensor> weights;
+  std::vector<torch::Tensor> HTs;
+  std::vector<torch::Tensor> noise_indices; // of the next step(), empty before prepare_next()
+  float scale;
+  bool constant_noise;
+  long int seed;
+  int cnt_iter;
+  int n_cores;
+  std::vector<std::atomic<int>> updated; // the iteration up to which each table is updated
+  int ready_iter;                         // the iteration wait_table() waits for
+  std::thread worker;
+
+  std::vector<torch::Tensor> take_noise_indices(int n_tables){
+    assert(n_tables == (int)weights.size());
+    std::vector<torch::Tensor> indices;
+    indices.swap(noise_indices);
+    if(indices.empty()){
+      indices.assign(n_tables, torch::empty({0}, torch::kInt64));
+    }
+    return indices;
+  }
+
+  void update(const std::vector<torch::Tensor> &grads, float lr, const std::vector<torch::Tensor> &rows, bool smallest_first){
+    int n_tables = weights.size();
+    assert((int)grads.size() == n_tables);
+    std::vector<long int> n_rows(n_tables);
+    for(int t = 0; t < n_tables; t++){
+      n_rows[t] = rows[t].numel() + grads[t]._values().sizes()[0];
+    }
+    std::vector<int> order = order_tables_by_rows(n_rows);
+    if(smallest_first){
+      std::reverse(order.begin(), order.end());
+    }
+    for(int t : order){
+      long int n = rows[t].numel();
+      int *HT_ptr = HTs[t].data<int>();
+      const long int *idx = rows[t].data<long int>();
+      torch::Tensor std = workspace_empty("engine_stds", {n}, torch::kFloat);
+      float *std_ptr = std.data<float>();
+      #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(static)
+      for(long int j = 0; j < n; j++){
+        float delay = (float)(cnt_iter - HT_ptr[idx[j]]);
+        std_ptr[j] = (constant_noise ? delay : sqrtf(delay)) * scale;
+      }
+      fused_delayed_noise_sgd_update(weights[t], rows[t], std, grads[t], lr, constant_noise, seed, t, cnt_iter, -1, n_cores);
+      #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(static)
+      for(long int j = 0; j < n; j++){
+        HT_ptr[idx[j]] = cnt_iter;
+      }
+      updated[t].store(cnt_iter + 1, std::memory_order_release);
+    }
+    cnt_iter++;
+  }
+};
+
+// Background producers of the sparse features of the next synthetic batches. Batch k (counted from 0)
+// is generated with the seed (seed, k) by one of "n_producers" threads, together with its unique indices,
+// and published in slot k % capacity of a bounded ring: each slot has a sequence number (k when free for
+// batch k, k + 1 when batch k is ready), so producers and the consumer only synchronize through atomics.
+// Batches are popped in order, and they do not depend on the number of producers.
+class BatchQueue{
+public:
+  // "sampler" (uniform if null) must outlive the queue
+  BatchQueue(const std::vector<long int> &table_sizes, const std::vector<long int> &pooling_factors, int batch_size, AliasSampler *sampler, long int seed, int capacity, int n_producers, int n_cores, bool pinned, bool sort_plans)
+    : table_sizes(table_sizes), pooling_factors(pooling_factors), batch_size(batch_size), sampler(sampler), seed(seed), pinned(pinned), sort_plans(sort_plans), slots(capacity){
+    assert(capacity > 0 && n_producers > 0);
+    assert(sampler == nullptr || sampler->table_sizes == table_sizes);
+    for(int i = 0; i < capacity; i++){
+      slots[i].seq.store(i, std::memory_order_relaxed);
+    }
+    int cores_per_producer = std::max(1, n_cores / n_producers);
+    for(int p = 0; p < n_producers; p++){
+      producers.emplace_back([this, cores_per_producer](){
+        produce(cores_per_producer);
+      });
+    }
+  }
+
+  ~BatchQueue(){
+    stop.store(true, std::memory_order_release);
+    for(std::thread &producer : producers){
+      producer.join();
+    }
+  }
+
+  // (lS_i, lS_o, unique indices of each table, (perm, starts) of the sort plan of each table if "sort_plans",
+  // see sort_plan()) of the next batch
+  std::tuple<std::vector<torch::Tensor>, torch::Tensor, std::vector<torch::Tensor>, std::vector<std::tuple<torch::Tensor, torch::Tensor>>> pop(){
+    slot &s = slots[head % slots.size()];
+    wait_for(s.seq, head + 1);
+    std::tuple<std::vector<torch::Tensor>, torch::Tensor, std::vector<torch::Tensor>, std::vector<std::tuple<torch::Tensor, torch::Tensor>>> batch = std::move(s.batch);
+    s.batch = {};
+    s.seq.store(head + slots.size(), std::memory_order_release);
+    head++;
+    return batch;
+  }
+
+private:
+  struct slot{
+    std::atomic<long int> seq;
+    std::tuple<std::vector<torch::Tensor>, torch::Tensor, std::vector<torch::Tensor>, std::vector<std::tuple<torch::Tensor, torch::Tensor>>> batch;
+  };
+
+  std::vector<long int> table_sizes;
+  std::vector<long int> pooling_factors;
+  int batch_size;
+  AliasSampler *sampler;
+  long int seed;
+  bool pinned;
+  bool sort_plans;
+  std::vector<slot> slots;
+  std::atomic<long int> tail{0}; // next batch to claim by a producer
+  long int head = 0; // next batch to pop (single consumer)
+  std::atomic<bool> stop{false};
+  std::vector<std::thread> producers;
+
+  // spins (then yields) until "seq" reaches "target"; false if the queue is being destroyed
+  bool wait_for(const std::atomic<long int> &seq, long int target){
+    for(int spin = 0; seq.load(std::memory_order_acquire) != target; spin++){
+      if(stop.load(std::memory_order_acquire)){
+        return false;
+      }
+      if(spin < 64){
+        continue;
+      }
+      std::this_thread::sleep_for(std::chrono::microseconds(spin < 1024 ? 0 : 50));
+    }
+    return true;
+  }
+
+  void produce(int n_cores){
+    while(!stop.load(std::memory_order_acquire)){
+      long int k = tail.fetch_add(1, std::memory_order_relaxed);
+      long int batch_seed = (long int)(((uint64_t)seed * 0x9E3779B97F4A7C15ULL) ^ (uint64_t)k);
+      std::vector<torch::Tensor> indices;
+      torch::Tensor offsets;
+      if(sampler == nullptr){
+        std::tie(indices, offsets) = multi_hot_bags(table_sizes, pooling_factors, batch_size, nullptr, batch_seed, n_cores, pinned);
+      }
+      else{
+        std::tie(indices, offsets) = multi_hot_bags(table_sizes, pooling_factors, batch_size, &sampler->tables, batch_seed, n_cores, pinned);
+      }
+      std::vector<torch::Tensor> uniques;
+      std::vector<std::tuple<torch::Tensor, torch::Tensor>> plans;
+      if(sort_plans){
+        for(const torch::Tensor &index : indices){
+          torch::Tensor unique, perm, starts;
+          std::tie(unique, perm, starts) = sort_plan(index, n_cores);
+          uniques.push_back(unique);
+          plans.push_back(std::make_tuple(perm, starts));
+        }
+      }
+      else{
+        uniques = unique_multi_table(indices, n_cores);
+      }
+      slot &s = slots[k % slots.size()];
+      if(!wait_for(s.seq, k)){
+        return;
+      }
+      s.batch = std::make_tuple(indices, offsets, uniques, plans);
+      s.seq.store(k + 1, std::memory_order_release);
+    }
+  }
+};
+
+// Raw file of an embedding table: a header, the rows from TABLE_FILE_DATA_OFFSET (page aligned
+// so the rows can be mapped directly) and, when ht_offset != 0, the HT counters (int32 per row)
+const uint64_t TABLE_FILE_MAGIC = 0x5450594441505a4c; // "LZPADYPT"
+const long int TABLE_FILE_DATA_OFFSET = 4096;
+
+struct table_file_header{
+  uint64_t magic;
+  uint64_t rows;
+  uint64_t dim;
+  uint64_t dtype; // 0: fp32, 1: bf16, 2: fp16, 3: uint8 (row-wise quantized rows, dim is the bytes of a row)
+  uint64_t ht_offset; // 0 if the file has no HT
+};
+
+inline uint64_t table_file_dtype(ScalarType type){
+  if(type == torch::kFloat) return 0;
+  if(type == torch::kBFloat16) return 1;
+  if(type == torch::kHalf) return 2;
+  assert(type == torch::kByte);
+  return 3;
+}
+
+inline ScalarType table_file_type(uint64_t dtype){
+  const ScalarType types[] = {torch::kFloat, torch::kBFloat16, torch::kHalf, torch::kByte};
+  assert(dtype < 4);
+  return types[dtype];
+}
+
+void write_table_file(const std::string &path, const torch::Tensor &weight, const torch::Tensor &HT){
+  assert(weight.dim() == 2 && weight.is_contiguous());
+  assert(HT.numel() == 0 || (HT.numel() == weight.sizes()[0] && HT.scalar_type() == torch::kInt && HT.is_contiguous()));
+  long int weight_bytes = weight.numel() * weight.element_size();
+
+  table_file_header header;
+  header.magic = TABLE_FILE_MAGIC;
+  header.rows = weight.sizes()[0];
+  header.dim = weight.sizes()[1];
+  header.dtype = table_file_dtype(weight.scalar_type());
+  header.ht_offset = HT.numel() > 0 ? TABLE_FILE_DATA_OFFSET + weight_bytes : 0;
+
+  FILE *file = fopen(path.c_str(), "wb");
+  assert(file != nullptr);
+  std::vector<char> head(TABLE_FILE_DATA_OFFSET, 0);
+  memcpy(head.data(), &header, sizeof(header));
+  size_t n_written = fwrite(head.data(), 1, head.size(), file);
+  n_written += fwrite(weight.data_ptr(), 1, weight_bytes, file);
+  if(HT.numel() > 0){
+    n_written += fwrite(HT.data_ptr(), 1, HT.numel() * sizeof(int), file);
+  }
+  assert(n_written == head.size() + weight_bytes + HT.numel() * sizeof(int));
+  fclose(file);
+}
+
+// Maps a file written by write_table_file() and returns (weight, HT) viewing the mapping, so
+// nothing is read or copied until rows are touched and clean pages stay in the page cache across runs.
+// With "shared" false, the mapping is private (copy-on-write), i.e., updates are never written back to the file.
+// HT is empty if the file has no HT.
+std::tuple<torch::Tensor, torch::Tensor> map_table_file(const std::string &path, bool shared){
+  int fd = open(path.c_str(), shared ? O_RDWR : O_RDONLY);
+  assert(fd >= 0);
+  struct stat st;
+  fstat(fd, &st);
+  assert(st.st_size >= TABLE_FILE_DATA_OFFSET);
+  void *base = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, shared ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+  close(fd);
+  assert(base != MAP_FAILED);
+
+  table_file_header header;
+  memcpy(&header, base, sizeof(header));
+  assert(header.magic == TABLE_FILE_MAGIC);
+  ScalarType type = table_file_type(header.dtype);
+
+  // the mapping is unmapped once both tensors are freed
+  long int size = st.st_size;
+  std::shared_ptr<void> mapping(base, [size](void *ptr){ munmap(ptr, size); });
+  auto keep_mapping = [mapping](void *){};
+  torch::Tensor weight = torch::from_blob((char *)base + TABLE_FILE_DATA_OFFSET, {(long int)header.rows, (long int)header.dim}, keep_mapping, torch::TensorOptions().dtype(type));
+  assert(TABLE_FILE_DATA_OFFSET + weight.numel() * weight.element_size() <= size);
+  torch::Tensor HT = torch::empty({0}, torch::kInt);
+  if(header.ht_offset != 0){
+    assert((long int)(header.ht_offset + header.rows * sizeof(int)) <= size);
+    HT = torch::from_blob((char *)base + header.ht_offset, {(long int)header.rows}, keep_mapping, torch::TensorOptions().dtype(torch::kInt));
+  }
+  return std::make_tuple(weight, HT);
+}
+
+// Parallel writer / reader of raw table files (the format of write_table_file, without HT) for the
+// model cache: the files are split into TABLE_IO_CHUNK chunks which the threads transfer concurrently
+// with O_DIRECT, i.e., large aligned requests bypassing the page cache, through aligned bounce buffers
+const long int TABLE_IO_CHUNK = 8 << 20;
+const long int TABLE_IO_ALIGN = 4096;
+
+inline int open_direct(const std::string &path, int flags){
+  int fd = open(path.c_str(), flags | O_DIRECT, 0644);
+  if(fd < 0 && errno == EINVAL){
+    // file systems without O_DIRECT (e.g., tmpfs)
+    fd = open(path.c_str(), flags, 0644);
+  }
+  assert(fd >= 0);
+  return fd;
+}
+
+// Runs func(buffer, table, start, end) over the chunks [start, end) of the files of the given sizes,
+// with an aligned buffer of TABLE_IO_CHUNK bytes per thread
+template <typename F>
+void run_over_file_chunks(const std::vector<long int> &sizes, int n_cores, F func){
+  std::vector<std::pair<int, long int>> chunks;
+  for(int t = 0; t < (int)sizes.size(); t++){
+    for(long int start = 0; start < sizes[t]; start += TABLE_IO_CHUNK){
+      chunks.push_back({t, start});
+    }
+  }
+  #pragma omp parallel num_threads(pool_threads(n_cores))
+  {
+    void *buffer = nullptr;
+    int ret = posix_memalign(&buffer, TABLE_IO_ALIGN, TABLE_IO_CHUNK);
+    assert(ret == 0);
+    #pragma omp for schedule(dynamic)
+    for(long int c = 0; c < (long int)chunks.size(); c++){
+      int t = chunks[c].first;
+      long int start = chunks[c].second;
+      func((char *)buffer, t, start, std::min(start + TABLE_IO_CHUNK, sizes[t]));
+    }
+    free(buffer);
+  }
+}
+
+void write_table_files(const std::vector<std::string> &paths, const std::vector<torch::Tensor> &weights, int n_cores){
+  assert(paths.size() == weights.size());
+  int n_tables = paths.size();
+  std::vector<std::vector<char>> heads(n_tables, std::vector<char>(TABLE_FILE_DATA_OFFSET, 0));
+  std::vector<long int> sizes(n_tables);
+  std::vector<int> fds(n_tables);
+  for(int t = 0; t < n_tables; t++){
+    assert(weights[t].dim() == 2 && weights[t].is_contiguous());
+    table_file_header header;
+    header.magic = TABLE_FILE_MAGIC;
+    header.rows = weights[t].sizes()[0];
+    header.dim = weights[t].sizes()[1];
+    header.dtype = table_file_dtype(weights[t].scalar_type());
+    header.ht_offset = 0;
+    memcpy(heads[t].data(), &header, sizeof(header));
+    sizes[t] = TABLE_FILE_DATA_OFFSET + weights[t].numel() * weights[t].element_size();
+    fds[t] = open_direct(paths[t], O_WRONLY | O_CREAT | O_TRUNC);
+  }
+
+  run_over_file_chunks(sizes, n_cores, [&](char *buffer, int t, long int start, long int end){
+    // the header, then the rows
+    const char *rows = (const char *)weights[t].data_ptr() - TABLE_FILE_DATA_OFFSET;
+    for(long int offset = start; offset < end;){
+      long int n;
+      if(offset < TABLE_FILE_DATA_OFFSET){
+        n = std::min(end, TABLE_FILE_DATA_OFFSET) - offset;
+        memcpy(buffer + offset - start, heads[t].data() + offset, n);
+      }
+      else{
+        n = end - offset;
+        memcpy(buffer + offset - start, rows + offset, n);
+      }
+      offset += n;
+    }
+    // O_DIRECT writes whole blocks, the file is truncated to its size at the end
+    long int n_bytes = (end - start + TABLE_IO_ALIGN - 1) / TABLE_IO_ALIGN * TABLE_IO_ALIGN;
+    memset(buffer + end - start, 0, n_bytes - (end - start));
+    long int n_written = pwrite(fds[t], buffer, n_bytes, start);
+    assert(n_written == n_bytes);
+  });
+
+  for(int t = 0; t < n_tables; t++){
+    int ret = ftruncate(fds[t], sizes[t]);
+    assert(ret == 0);
+    close(fds[t]);
+  }
+}
+
+std::vector<torch::Tensor> read_table_files(const std::vector<std::string> &paths, int n_cores){
+  int n_tables = paths.size();
+  std::vector<torch::Tensor> weights(n_tables);
+  std::vector<long int> sizes(n_tables);
+  std::vector<int> fds(n_tables);
+  void *head = nullptr;
+  int ret = posix_memalign(&head, TABLE_IO_ALIGN, TABLE_FILE_DATA_OFFSET);
+  assert(ret == 0);
+  for(int t = 0; t < n_tables; t++){
+    fds[t] = open_direct(paths[t], O_RDONLY);
+    long int n_read = pread(fds[t], head, TABLE_FILE_DATA_OFFSET, 0);
+    assert(n_read == TABLE_FILE_DATA_OFFSET);
+    table_file_header header;
+    memcpy(&header, head, sizeof(header));
+    assert(header.magic == TABLE_FILE_MAGIC);
+    ScalarType type = table_file_type(header.dtype);
+    weights[t] = torch::empty({(long int)header.rows, (long int)header.dim}, torch::TensorOptions().dtype(type));
+    sizes[t] = weights[t].numel() * weights[t].element_size();
+  }
+  free(head);
+
+  // chunks of the rows, which start at the page-aligned TABLE_FILE_DATA_OFFSET
+  run_over_file_chunks(sizes, n_cores, [&](char *buffer, int t, long int start, long int end){
+    long int n_bytes = (end - start + TABLE_IO_ALIGN - 1) / TABLE_IO_ALIGN * TABLE_IO_ALIGN;
+    long int n_read = pread(fds[t], buffer, n_bytes, TABLE_FILE_DATA_OFFSET + start);
+    assert(n_read >= end - start);
+    memcpy((char *)weights[t].data_ptr() + start, buffer, end - start);
+  });
+
+  for(int t = 0; t < n_tables; t++){
+    close(fds[t]);
+  }
+  return weights;
+}
+
+// Pre-generated access trace: the sparse features (lS_i) of "n_batches" batches of fixed-size bags.
+// The header and a trace_table_info per table are followed by one block per (batch, table) holding the
+// batch_size * pooling indices of the table, and by the offsets of the blocks (index_offset, uint64 per
+// block plus the end). Blocks are raw int32/int64 ("width" of the table) with TRACE_RAW, or zigzag varints
+// of the difference to the previous index of the bag (0 for the first) with TRACE_DELTA_VARINT
+const uint64_t TRACE_FILE_MAGIC = 0x4543415254445a4c; // "LZDTRACE"
+const uint64_t TRACE_RAW = 0;
+const uint64_t TRACE_DELTA_VARINT = 1;
+
+struct trace_file_header{
+  uint64_t magic;
+  uint64_t n_tables;
+  uint64_t batch_size;
+  uint64_t n_batches;
+  uint64_t encoding;
+  uint64_t index_offset; // 0 until the trace is closed
+};
+
+struct trace_table_info{
+  uint64_t rows;
+  uint64_t pooling;
+  uint64_t width; // 4 or 8 bytes per raw index
+};
+
+inline void put_varint(std::vector<uint8_t> &out, uint64_t value){
+  while(value >= 0x80){
+    out.push_back((uint8_t)(value | 0x80));
+    value >>= 7;
+  }
+  out.push_back((uint8_t)value);
+}
+
+inline uint64_t get_varint(const uint8_t *&in){
+  uint64_t value = 0;
+  for(int shift = 0;; shift += 7){
+    uint8_t byte = *in++;
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    if(byte < 0x80){
+      return value;
+    }
+  }
+}
+
+// Appends batches to a trace file (the tables of a batch are encoded in parallel)
+class TraceWriter{
+public:
+  TraceWriter(const std::string &path, const std::vector<long int> &table_sizes, const std::vector<long int> &pooling_factors, int batch_size, bool compress){
+    assert(table_sizes.size() == pooling_factors.size());
+    header = {TRACE_FILE_MAGIC, table_sizes.size(), (uint64_t)batch_size, 0, compress ? TRACE_DELTA_VARINT : TRACE_RAW, 0};
+    for(size_t t = 0; t < table_sizes.size(); t++){
+      tables.push_back({(uint64_t)table_sizes[t], (uint64_t)pooling_factors[t], table_sizes[t] <= INT32_MAX ? 4ULL : 8ULL});
+    }
+    file = fopen(path.c_str(), "wb");
+    assert(file != nullptr);
+    size_t n_written = fwrite(&header, sizeof(header), 1, file);
+    n_written += fwrite(tables.data(), sizeof(trace_table_info), tables.size(), file);
+    assert(n_written == 1 + tables.size());
+    offsets.push_back(sizeof(header) + tables.size() * sizeof(trace_table_info));
+  }
+
+  ~TraceWriter(){
+    close();
+  }
+
+  void append(const std::vector<torch::Tensor> &lS_i, int n_cores){
+    assert(file != nullptr && lS_i.size() == tables.size());
+    std::vector<std::vector<uint8_t>> blocks(tables.size());
+    #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(dynamic, 1)
+    for(size_t t = 0; t < tables.size(); t++){
+      torch::Tensor indices = lS_i[t].to(torch::kInt64).contiguous();
+      const long int *idx = indices.data<long int>();
+      long int n = header.batch_size * tables[t].pooling;
+      assert(indices.numel() == n);
+      std::vector<uint8_t> &block = blocks[t];
+      if(header.encoding == TRACE_DELTA_VARINT){
+        block.reserve(n * 2);
+        for(long int j = 0; j < n; j++){
+          long int delta = idx[j] - (j % tables[t].pooling == 0 ? 0 : idx[j - 1]);
+          put_varint(block, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+        }
+      }
+      else if(tables[t].width == 4){
+        block.resize(n * sizeof(int));
+        int *out = (int *)block.data();
+        for(long int j = 0; j < n; j++){
+          out[j] = idx[j];
+        }
+      }
+      else{
+        block.resize(n * sizeof(long int));
+        memcpy(block.data(), idx, n * sizeof(long int));
+      }
+    }
+    for(const std::vector<uint8_t> &block : blocks){
+      size_t n_written = fwrite(block.data(), 1, block.size(), file);
+      assert(n_written == block.size());
+      offsets.push_back(offsets.back() + block.size());
+    }
+    header.n_batches++;
+  }
+
+  // writes the block offsets and the final header
+  void close(){
+    if(file == nullptr){
+      return;
+    }
+    header.index_offset = offsets.back();
+    size_t n_written = fwrite(offsets.data(), sizeof(uint64_t), offsets.size(), file);
+    fseek(file, 0, SEEK_SET);
+    n_written += fwrite(&header, sizeof(header), 1, file);
+    assert(n_written == offsets.size() + 1);
+    fclose(file);
+    file = nullptr;
+  }
+
+private:
+  FILE *file = nullptr;
+  trace_file_header header;
+  std::vector<trace_table_info> tables;
+  std::vector<uint64_t> offsets;
+};
+
+// Streams the batches of a trace file from a read-only mapping: only the blocks of the requested batch
+// are touched, and the blocks of the following batch are requested with madvise(MADV_WILLNEED)
+class TraceReader{
+public:
+  TraceReader(const std::string &path){
+    int fd = open(path.c_str(), O_RDONLY);
+    assert(fd >= 0);
+    struct stat st;
+    fstat(fd, &st);
+    size = st.st_size;
+    assert(size >= (long int)sizeof(trace_file_header));
+    base = (const uint8_t *)mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    assert(base != MAP_FAILED);
+    madvise((void *)base, size, MADV_SEQUENTIAL);
+
+    memcpy(&header, base, sizeof(header));
+    assert(header.magic == TRACE_FILE_MAGIC && header.index_offset != 0);
+    tables.resize(header.n_tables);
+    memcpy(tables.data(), base + sizeof(header), header.n_tables * sizeof(trace_table_info));
+    offsets = (const uint64_t *)(base + header.index_offset);
+    assert((long int)(header.index_offset + (header.n_batches * header.n_tables + 1) * sizeof(uint64_t)) <= size);
+  }
+
+  ~TraceReader(){
+    munmap((void *)base, size);
+  }
+
+  long int n_batches() const{
+    return header.n_batches;
+  }
+
+  int batch_size() const{
+    return header.batch_size;
+  }
+
+  std::vector<long int> table_sizes() const{
+    std::vector<long int> sizes;
+    for(const trace_table_info &table : tables){
+      sizes.push_back(table.rows);
+    }
+    return sizes;
+  }
+
+  std::vector<long int> pooling_factors() const{
+    std::vector<long int> factors;
+    for(const trace_table_info &table : tables){
+      factors.push_back(table.pooling);
+    }
+    return factors;
+  }
+
+  // (lS_i: views of one buffer (jagged_tables), lS_o: (n_tables, batch_size) offsets) of batch "k", int64
+  std::tuple<std::vector<torch::Tensor>, torch::Tensor> read(long int k, int n_cores){
+    assert(k >= 0 && k < (long int)header.n_batches);
+    int n_tables = header.n_tables;
+    long int B = header.batch_size;
+    if(k + 1 < (long int)header.n_batches){
+      uintptr_t page = sysconf(_SC_PAGESIZE);
+      uintptr_t start = ((uintptr_t)base + offsets[(k + 1) * n_tables]) / page * page;
+      madvise((void *)start, (uintptr_t)base + offsets[(k + 2) * n_tables] - start, MADV_WILLNEED);
+    }
+
+    torch::Tensor lS_o = torch::empty({n_tables, B}, torch::kInt64);
+    long int *lS_o_ptr = lS_o.data<long int>();
+    std::vector<long int> lengths(n_tables);
+    for(int t = 0; t < n_tables; t++){
+      lengths[t] = B * (long int)tables[t].pooling;
+    }
+    std::vector<torch::Tensor> indices = jagged_tables(lengths, torch::TensorOptions().dtype(torch::kInt64));
+    for(int t = 0; t < n_tables; t++){
+      for(long int b = 0; b < B; b++){
+        lS_o_ptr[t * B + b] = b * tables[t].pooling;
+      }
+    }
+    #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(dynamic, 1)
+    for(int t = 0; t < n_tables; t++){
+      decode(k, t, indices[t].data<long int>());
+    }
+    return std::make_tuple(indices, lS_o);
+  }
+
+  // the batch_size * pooling indices of table "t" in batch "k" into "out"
+  void decode(long int k, int t, long int *out) const{
+    int n_tables = header.n_tables;
+    const uint8_t *in = base + offsets[k * n_tables + t];
+    const uint8_t *end = base + offsets[k * n_tables + t + 1];
+    long int pooling = tables[t].pooling;
+    long int n = header.batch_size * pooling;
+    if(header.encoding == TRACE_DELTA_VARINT){
+      for(long int j = 0; j < n; j++){
+        uint64_t zigzag = get_varint(in);
+        long int delta = (long int)(zigzag >> 1) ^ -(long int)(zigzag & 1);
+        out[j] = (j % pooling == 0 ? 0 : out[j - 1]) + delta;
+      }
+      assert(in == end);
+    }
+    else if(tables[t].width == 4){
+      assert(end - in == n * (long int)sizeof(int));
+      const int *raw = (const int *)in;
+      for(long int j = 0; j < n; j++){
+        out[j] = raw[j];
+      }
+    }
+    else{
+      assert(end - in == n * (long int)sizeof(long int));
+      memcpy(out, in, n * sizeof(long int));
+    }
+  }
+
+private:
+  const uint8_t *base;
+  long int size;
+  trace_file_header header;
+  std::vector<trace_table_info> tables;
+  const uint64_t *offsets;
+};
+
+// Reuse-distance analysis of a trace (TraceReader), one pass over its batches per table (tables in
+// parallel). Per table it counts the unique rows of every batch and, for every unique row of a batch, the
+// delay since the batch that last touched it (in iterations), i.e., the delayed-noise span of LazyDP.
+// Returns (unique_rows: (n_tables, n_batches), delays: (n_tables, max_delay + 2)), int64. Bin 0 of delays
+// counts the first touches, bin d (1 <= d <= max_delay) the delays of d, and the last bin the longer ones
+std::tuple<torch::Tensor, torch::Tensor> analyze_trace(const std::string &path, long int max_delay, int n_cores){
+  assert(max_delay > 0);
+  TraceReader reader(path);
+  std::vector<long int> table_sizes = reader.table_sizes();
+  std::vector<long int> pooling_factors = reader.pooling_factors();
+  int n_tables = table_sizes.size();
+  long int n_batches = reader.n_batches();
+  assert(n_batches <= INT32_MAX);
+  torch::Tensor unique_rows = torch::zeros({n_tables, n_batches}, torch::kInt64);
+  torch::Tensor delays = torch::zeros({n_tables, max_delay + 2}, torch::kInt64);
+
+  #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(dynamic, 1)
+  for(int t = 0; t < n_tables; t++){
+    long int *unique_ptr = unique_rows.data<long int>() + t * n_batches;
+    long int *delays_ptr = delays.data<long int>() + t * (max_delay + 2);
+    kernel_vector<int> last_batch(table_sizes[t], -1);
+    kernel_vector<long int> indices(reader.batch_size() * pooling_factors[t]);
+    for(long int k = 0; k < n_batches; k++){
+      reader.decode(k, t, indices.data());
+      std::sort(indices.begin(), indices.end());
+      long int n_unique = std::unique(indices.begin(), indices.end()) - indices.begin();
+      unique_ptr[k] = n_unique;
+      for(long int j = 0; j < n_unique; j++){
+        long int row = indices[j];
+        assert(row >= 0 && row < table_sizes[t]);
+        long int delay = last_batch[row] < 0 ? 0 : std::min(k - last_batch[row], max_delay + 1);
+        delays_ptr[delay]++;
+        last_batch[row] = k;
+      }
+    }
+  }
+  return std::make_tuple(unique_rows, delays);
+}
+
+// Recording of the update stage of LazyDP: per iteration and table, the unique rows noised by the update
+// (lS_i_nxt), the delay of each (cnt_iter - HT[row]) and the number of lookups of each row in the batch
+// (the rows of the uncoalesced gradient of the next update). Each (iteration, table) block is a varint
+// count followed by the varint differences of the sorted rows (to 0 for the first), their delays and their
+// lookup counts, the block offsets follow at index_offset as in the trace files (TraceWriter)
+const uint64_t UNIQUE_SET_FILE_MAGIC = 0x5351494e55445a4c; // "LZDUNIQS"
+
+struct unique_set_file_header{
+  uint64_t magic;
+  uint64_t n_tables;
+  uint64_t n_iters;
+  uint64_t index_offset; // 0 until the recording is closed
+  double std_scale; // noise std of a row = sqrt(delay) * std_scale
+  double lr;
+};
+
+struct unique_set_table_info{
+  uint64_t rows;
+  uint64_t dim;
+};
+
+class UniqueSetWriter{
+public:
+  UniqueSetWriter(const std::string &path, const std::vector<long int> &table_sizes, const std::vector<long int> &dims, double std_scale, double lr){
+    assert(table_sizes.size() == dims.size());
+    header = {UNIQUE_SET_FILE_MAGIC, table_sizes.size(), 0, 0, std_scale, lr};
+    for(size_t t = 0; t < table_sizes.size(); t++){
+      tables.push_back({(uint64_t)table_sizes[t], (uint64_t)dims[t]});
+    }
+    file = fopen(path.c_str(), "wb");
+    assert(file != nullptr);
+    size_t n_written = fwrite(&header, sizeof(header), 1, file);
+    n_written += fwrite(tables.data(), sizeof(unique_set_table_info), tables.size(), file);
+    assert(n_written == 1 + tables.size());
+    offsets.push_back(sizeof(header) + tables.size() * sizeof(unique_set_table_info));
+  }
+
+  ~UniqueSetWriter(){
+    close();
+  }
+
+  // "uniques" (any order) and "delays" of an iteration, "lS_i" the lookups of the batch they come from
+  void append(const std::vector<torch::Tensor> &lS_i, const std::vector<torch::Tensor> &uniques, const std::vector<torch::Tensor> &delays, int n_cores){
+    assert(file != nullptr && uniques.size() == tables.size() && delays.size() == tables.size() && lS_i.size() == tables.size());
+    std::vector<std::vector<uint8_t>> blocks(tables.size());
+    #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(dynamic, 1)
+    for(size_t t = 0; t < tables.size(); t++){
+      torch::Tensor unique = uniques[t].to(torch::kInt64).contiguous();
+      torch::Tensor delay = delays[t].to(torch::kInt64).contiguous();
+      torch::Tensor lookups = lS_i[t].to(torch::kInt64).contiguous();
+      long int n = unique.numel();
+      assert(delay.numel() == n);
+      std::vector<std::pair<long int, long int>> rows(n);
+      for(long int j = 0; j < n; j++){
+        rows[j] = {unique.data<long int>()[j], delay.data<long int>()[j]};
+      }
+      std::sort(rows.begin(), rows.end());
+      std::vector<long int> sorted(lookups.data<long int>(), lookups.data<long int>() + lookups.numel());
+      std::sort(sorted.begin(), sorted.end());
+
+      std::vector<uint8_t> &block = blocks[t];
+      block.reserve(n * 4 + 8);
+      put_varint(block, n);
+      long int previous = 0;
+      for(long int j = 0; j < n; j++){
+        put_varint(block, rows[j].first - previous);
+        previous = rows[j].first;
+      }
+      for(long int j = 0; j < n; j++){
+        put_varint(block, rows[j].second);
+      }
+      // lookups of each row, from the run of the row in the sorted lookups
+      long int r = 0;
+      for(long int j = 0; j < n; j++){
+        long int start = r;
+        while(r < (long int)sorted.size() && sorted[r] == rows[j].first){
+          r++;
+        }
+        assert(r > start);
+        put_varint(block, r - start);
+      }
+      assert(r == (long int)sorted.size());
+    }
+    for(const std::vector<uint8_t> &block : blocks){
+      size_t n_written = fwrite(block.data(), 1, block.size(), file);
+      assert(n_written == block.size());
+      offsets.push_back(offsets.back() + block.size());
+    }
+    header.n_iters++;
+  }
+
+  // writes the block offsets and the final header
+  void close(){
+    if(file == nullptr){
+      return;
+    }
+    header.index_offset = offsets.back();
+    size_t n_written = fwrite(offsets.data(), sizeof(uint64_t), offsets.size(), file);
+    fseek(file, 0, SEEK_SET);
+    n_written += fwrite(&header, sizeof(header), 1, file);
+    assert(n_written == offsets.size() + 1);
+    fclose(file);
+    file = nullptr;
+  }
+
+private:
+  FILE *file = nullptr;
+  unique_set_file_header header;
+  std::vector<unique_set_table_info> tables;
+  std::vector<uint64_t> offsets;
+};
+
+// Reads a recording of UniqueSetWriter from a read-only mapping, one iteration at a time
+class UniqueSetReader{
+public:
+  UniqueSetReader(const std::string &path){
+    int fd = open(path.c_str(), O_RDONLY);
+    assert(fd >= 0);
+    struct stat st;
+    fstat(fd, &st);
+    size = st.st_size;
+    assert(size >= (long int)sizeof(unique_set_file_header));
+    base = (const uint8_t *)mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    assert(base != MAP_FAILED);
+    madvise((void *)base, size, MADV_SEQUENTIAL);
+
+    memcpy(&header, base, sizeof(header));
+    assert(header.magic == UNIQUE_SET_FILE_MAGIC && header.index_offset != 0);
+    tables.resize(header.n_tables);
+    memcpy(tables.data(), base + sizeof(header), header.n_tables * sizeof(unique_set_table_info));
+    offsets = (const uint64_t *)(base + header.index_offset);
+    assert((long int)(header.index_offset + (header.n_iters * header.n_tables + 1) * sizeof(uint64_t)) <= size);
+  }
+
+  ~UniqueSetReader(){
+    munmap((void *)base, size);
+  }
+
+  long int n_iters() const{
+    return header.n_iters;
+  }
+
+  double std_scale() const{
+    return header.std_scale;
+  }
+
+  double lr() const{
+    return header.lr;
+  }
+
+  std::vector<long int> table_sizes() const{
+    std::vector<long int> sizes;
+    for(const unique_set_table_info &table : tables){
+      sizes.push_back(table.rows);
+    }
+    return sizes;
+  }
+
+  std::vector<long int> dims() const{
+    std::vector<long int> dims;
+    for(const unique_set_table_info &table : tables){
+      dims.push_back(table.dim);
+    }
+    return dims;
+  }
+
+  // (uniques: sorted rows, delays, lookups of each row) of each table in iteration "k", int64
+  std::tuple<std::vector<torch::Tensor>, std::vector<torch::Tensor>, std::vector<torch::Tensor>> read(long int k, int n_cores){
+    assert(k >= 0 && k < (long int)header.n_iters);
+    int n_tables = header.n_tables;
+    std::vector<torch::Tensor> uniques(n_tables), delays(n_tables), counts(n_tables);
+    std::vector<long int> sizes(n_tables);
+    for(int t = 0; t < n_tables; t++){
+      const uint8_t *in = base + offsets[k * n_tables + t];
+      sizes[t] = get_varint(in);
+      uniques[t] = torch::empty({sizes[t]}, torch::kInt64);
+      delays[t] = torch::empty({sizes[t]}, torch::kInt64);
+      counts[t] = torch::empty({sizes[t]}, torch::kInt64);
+    }
+    #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(dynamic, 1)
+    for(int t = 0; t < n_tables; t++){
+      const uint8_t *in = base + offsets[k * n_tables + t];
+      get_varint(in);
+      long int *unique = uniques[t].data<long int>();
+      long int *delay = delays[t].data<long int>();
+      long int *count = counts[t].data<long int>();
+      long int previous = 0;
+      for(long int j = 0; j < sizes[t]; j++){
+        previous += get_varint(in);
+        unique[j] = previous;
+      }
+      for(long int j = 0; j < sizes[t]; j++){
+        delay[j] = get_varint(in);
+      }
+      for(long int j = 0; j < sizes[t]; j++){
+        count[j] = get_varint(in);
+      }
+      assert(in == base + offsets[k * n_tables + t + 1]);
+    }
+    return std::make_tuple(uniques, delays, counts);
+  }
+
+private:
+  const uint8_t *base;
+  long int size;
+  unique_set_file_header header;
+  std::vector<unique_set_table_info> tables;
+  const uint64_t *offsets;
+};
+
+const int CRITEO_N_DENSE = 13;
+const int CRITEO_N_SPARSE = 26;
+const int CRITEO_ROW_INTS = 1 + CRITEO_N_DENSE + CRITEO_N_SPARSE;
+
+typedef std::tuple<torch::Tensor, torch::Tensor, std::vector<torch::Tensor>, torch::Tensor> criteo_batch;
+
+// (X: (n, 13) log(1 + dense), lS_o: (26, n), lS_i: indices of each table (% max_ind_range if > 0), T: (n, 1))
+// of the n raw rows row(0), ..., row(n - 1), decoded in parallel
+template<typename F>
+criteo_batch decode_criteo_rows(long int n, F row, long int max_ind_range, bool int32_indices, int n_cores){
+  torch::Tensor X = torch::empty({n, CRITEO_N_DENSE}, torch::kFloat);
+  torch::Tensor T = torch::empty({n, 1}, torch::kFloat);
+  torch::Tensor lS_o = torch::empty({CRITEO_N_SPARSE, n}, torch::kInt64);
+  std::vector<torch::Tensor> lS_i(CRITEO_N_SPARSE);
+  std::vector<void *> lS_i_ptr(CRITEO_N_SPARSE);
+  for(int t = 0; t < CRITEO_N_SPARSE; t++){
+    lS_i[t] = torch::empty({n}, int32_indices ? torch::kInt : torch::kInt64);
+    lS_i_ptr[t] = lS_i[t].data_ptr();
+  }
+  float *X_ptr = X.data<float>();
+  float *T_ptr = T.data<float>();
+  long int *lS_o_ptr = lS_o.data<long int>();
+
+  #pragma omp parallel for num_threads(n_cores) schedule(static)
+  for(long int r = 0; r < n; r++){
+    const int *raw = row(r);
+    T_ptr[r] = raw[0];
+    for(int f = 0; f < CRITEO_N_DENSE; f++){
+      X_ptr[r * CRITEO_N_DENSE + f] = logf((float)raw[1 + f] + 1);
+    }
+    for(int t = 0; t < CRITEO_N_SPARSE; t++){
+      lS_o_ptr[t * n + r] = r;
+      long int index = raw[1 + CRITEO_N_DENSE + t];
+      if(max_ind_range > 0){
+        index %= max_ind_range;
+      }
+      if(int32_indices){
+        ((int *)lS_i_ptr[t])[r] = index;
+      }
+      else{
+        ((long int *)lS_i_ptr[t])[r] = index;
+      }
+    }
+  }
+  return std::make_tuple(X, lS_o, lS_i, T);
+}
+
+// Criteo binary dataset (data_loader_terabyte.numpy_to_binary: int32 rows of the label, 13 dense and
+// 26 categorical features) read from a read-only mapping. With "sample_rate" > 0, batch k is a Poisson
+// sample of the whole dataset (each row is taken independently with probability "sample_rate", drawn by
+// geometric skips with a stream keyed by (seed, k)); otherwise batch k is rows [k * B, (k + 1) * B).
+// The rows of a batch are decoded in parallel, and submit() decodes the next batch in the background.
+class CriteoBinReader{
+public:
+  CriteoBinReader(const std::string &path, int batch_size, long int max_ind_range, double sample_rate, long int seed, bool int32_indices, int n_cores)
+    : batch_size(batch_size), max_ind_range(max_ind_range), sample_rate(sample_rate), seed(seed), int32_indices(int32_indices), n_cores(n_cores){
+    assert(sample_rate >= 0 && sample_rate < 1);
+    int fd = open(path.c_str(), O_RDONLY);
+    assert(fd >= 0);
+    struct stat st;
+    fstat(fd, &st);
+    size = st.st_size;
+    base = (const int *)mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    assert(base != MAP_FAILED);
+    // sequential batches are read in order, Poisson samples touch random rows
+    madvise((void *)base, size, sample_rate > 0 ? MADV_RANDOM : MADV_SEQUENTIAL);
+  }
+
+  ~CriteoBinReader(){
+    if(worker.joinable()){
+      worker.join();
+    }
+    munmap((void *)base, size);
+  }
+
+  long int n_samples() const{
+    return size / (CRITEO_ROW_INTS * sizeof(int));
+  }
+
+  // batches of an epoch
+  long int n_batches() const{
+    return (n_samples() + batch_size - 1) / batch_size;
+  }
+
+  void submit(long int k){
+    if(worker.joinable()){
+      worker.join();
+    }
+    worker = std::thread([this, k](){
+      batch = read(k);
+    });
+  }
+
+  // batch of the last submit()
+  criteo_batch wait(){
+    assert(worker.joinable());
+    worker.join();
+    return std::move(batch);
+  }
+
+  // batch "k" (see decode_criteo_rows())
+  criteo_batch read(long int k){
+    std::vector<long int> rows = batch_rows(k);
+    const int *data = base;
+    return decode_criteo_rows(rows.size(), [&rows, data](long int r){ return data + rows[r] * CRITEO_ROW_INTS; }, max_ind_range, int32_indices, n_cores);
+  }
+
+private:
+  int batch_size;
+  long int max_ind_range;
+  double sample_rate;
+  long int seed;
+  bool int32_indices;
+  int n_cores;
+  const int *base;
+  long int size;
+  std::thread worker;
+  criteo_batch batch;
+
+  std::vector<long int> batch_rows(long int k){
+    long int N = n_samples();
+    std::vector<long int> rows;
+    if(sample_rate == 0){
+      for(long int r = (k % n_batches()) * batch_size; r < std::min(N, (k % n_batches() + 1) * batch_size); r++){
+        rows.push_back(r);
+      }
+      return rows;
+    }
+    // gaps between the sampled rows are geometric with parameter "sample_rate"
+    splitmix64 rng(((uint64_t)seed * 0xD1B54A32D192ED03ULL) ^ (uint64_t)k);
+    double log_q = log1p(-sample_rate);
+    rows.reserve(N * sample_rate * 1.1 + 64);
+    for(long int r = -1;;){
+      r += 1 + (long int)floor(log(1 - rng.uniform()) / log_q);
+      if(r >= N){
+        return rows;
+      }
+      rows.push_back(r);
+    }
+  }
+};
+
+// Streaming (out-of-core) mode of the Criteo binary dataset: the file is consumed in chunks of "chunk_rows"
+// rows, in a random order of the chunks per epoch, and each batch takes "batch_size" random rows of a
+// shuffle buffer of "buffer_rows" rows, which are refilled from the stream. Only the shuffle buffer and two
+// chunks are resident; the next chunk is read from the mapping by a background thread meanwhile.
+class CriteoBinStream{
+public:
+  CriteoBinStream(const std::string &path, int batch_size, long int buffer_rows, long int chunk_rows, long int max_ind_range, long int seed, bool int32_indices, int n_cores)
+    : batch_size(batch_size), buffer_rows(buffer_rows), chunk_rows(chunk_rows), max_ind_range(max_ind_range), int32_indices(int32_indices), n_cores(n_cores), rng(seed){
+    assert(batch_size <= buffer_rows && chunk_rows > 0);
+    int fd = open(path.c_str(), O_RDONLY);
+    assert(fd >= 0);
+    struct stat st;
+    fstat(fd, &st);
+    size = st.st_size;
+    base = (const int *)mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    assert(base != MAP_FAILED);
+    n_rows = size / (CRITEO_ROW_INTS * sizeof(int));
+    n_chunks = (n_rows + chunk_rows - 1) / chunk_rows;
+    assert(buffer_rows <= n_rows);
+
+    load_next_chunk();
+    buffer.resize(buffer_rows * CRITEO_ROW_INTS);
+    for(long int i = 0; i < buffer_rows; i++){
+      memcpy(&buffer[i * CRITEO_ROW_INTS], take_row(), CRITEO_ROW_INTS * sizeof(int));
+    }
+  }
+
+  ~CriteoBinStream(){
+    if(loader.joinable()){
+      loader.join();
+    }
+    munmap((void *)base, size);
+  }
+
+  long int n_samples() const{
+    return n_rows;
+  }
 
-  #pragma omp parallel for num_threads(n_cores)
-  for(int i = 0; i < n_cores; i++){
-    torch::Generator generator = make_generator<CPUGeneratorImpl>();
-    generator.set_current_seed(rand());
-    if(i == n_cores - 1 && remain != 0){
-      torch::Tensor output_slice = output.index({torch::indexing::Slice(unit*i, unit*(i+1) + remain)});
-      torch::normal_out(output_slice, 0, std, {unit + remain, dim}, generator);
+  // batches of an epoch
+  long int n_batches() const{
+    return (n_rows + batch_size - 1) / batch_size;
+  }
+
+  // next batch (see decode_criteo_rows())
+  criteo_batch next(){
+    std::vector<int> rows(batch_size * CRITEO_ROW_INTS);
+    for(int b = 0; b < batch_size; b++){
+      int *slot = &buffer[rng.below(buffer_rows) * CRITEO_ROW_INTS];
+      memcpy(&rows[b * CRITEO_ROW_INTS], slot, CRITEO_ROW_INTS * sizeof(int));
+      memcpy(slot, take_row(), CRITEO_ROW_INTS * sizeof(int));
+    }
+    const int *data = rows.data();
+    return decode_criteo_rows(batch_size, [data](long int r){ return data + r * CRITEO_ROW_INTS; }, max_ind_range, int32_indices, n_cores);
+  }
+
+private:
+  int batch_size;
+  long int buffer_rows;
+  long int chunk_rows;
+  long int max_ind_range;
+  bool int32_indices;
+  int n_cores;
+  splitmix64 rng;
+  const int *base;
+  long int size;
+  long int n_rows;
+  long int n_chunks;
+  std::vector<int> buffer;
+  std::vector<long int> order; // chunks of the current epoch
+  long int next_chunk = 0; // position in "order" of the chunk being loaded
+  std::vector<int> current, loading;
+  long int position = 0; // row of "current"
+  std::thread loader;
+
+  // waits for the chunk being loaded, makes it current, and starts loading the following one
+  void load_next_chunk(){
+    if(loader.joinable()){
+      loader.join();
+      std::swap(current, loading);
+      position = 0;
+    }
+    if(next_chunk == (long int)order.size()){
+      // a random order of the chunks for the next epoch
+      order.resize(n_chunks);
+      std::iota(order.begin(), order.end(), 0);
+      for(long int i = n_chunks - 1; i > 0; i--){
+        std::swap(order[i], order[rng.below(i + 1)]);
+      }
+      next_chunk = 0;
+    }
+    long int chunk = order[next_chunk++];
+    long int begin = chunk * chunk_rows;
+    long int rows = std::min(n_rows, begin + chunk_rows) - begin;
+    const int *src = base + begin * CRITEO_ROW_INTS;
+    loader = std::thread([this, src, rows](){
+      loading.resize(rows * CRITEO_ROW_INTS);
+      memcpy(loading.data(), src, rows * CRITEO_ROW_INTS * sizeof(int));
+    });
+    if(current.empty()){
+      // the very first chunk
+      load_next_chunk();
+    }
+  }
+
+  const int *take_row(){
+    if(position * CRITEO_ROW_INTS == (long int)current.size()){
+      load_next_chunk();
+    }
+    return &current[(position++) * CRITEO_ROW_INTS];
+  }
+};
+
+// Parallel preprocessing of the raw Criteo logs into the binary dataset of CriteoBinReader, i.e., what
+// data_utils.getCriteoAdData + data_loader_terabyte.numpy_to_binary do with one thread. The raw lines
+// are tab-separated (label, 13 dense, 26 hex categorical features; empty fields are 0); dense features
+// < 0 are clipped to 0 and the categorical features of each table (% max_ind_range if > 0) are renumbered
+// by their rank among the distinct values of the table (the order of np.unique in processCriteoAdData).
+// The inputs are mapped read-only and consumed in rounds of CRITEO_PREPROCESS_ROUND bytes, cut at line
+// boundaries into one chunk per thread. Each chunk is parsed into thread-local rows and distinct values;
+// the rows of a round are written at their prefix-sum offsets (training rows to train_data.bin, held-out
+// rows to test_data.bin), and the distinct values of each table are merged into its dictionary (in
+// parallel over the tables) once they outgrow it. A second pass renumbers the rows in place through a
+// writable mapping, then the first ceil(n / 2) held-out rows stay in test_data.bin and the rest move to
+// val_data.bin (the split of day 23 in numpy_to_binary).
+// The held-out rows are the last input (day 23 of Terabyte), or the last of "days" splits of a single
+// input (train.txt of Kaggle, as getCriteoAdData splits it). Training rows with label 0 are dropped with
+// probability "sub_sample_rate", drawn from a stream keyed by (seed, input, offset of the line), so the
+// output does not depend on the number of threads.
+const long int CRITEO_PREPROCESS_ROUND = 1L << 30;
+const long int CRITEO_ROW_BYTES = CRITEO_ROW_INTS * sizeof(int);
+
+// distinct values of a table: "values" are sorted, "pending" are the distinct values of the chunks since
+// the last merge
+struct criteo_dictionary{
+  std::vector<uint32_t> values;
+  std::vector<uint32_t> pending;
+
+  void merge(){
+    std::sort(pending.begin(), pending.end());
+    pending.erase(std::unique(pending.begin(), pending.end()), pending.end());
+    std::vector<uint32_t> merged;
+    merged.reserve(values.size() + pending.size());
+    std::set_union(values.begin(), values.end(), pending.begin(), pending.end(), std::back_inserter(merged));
+    values.swap(merged);
+    pending.clear();
+  }
+};
+
+// parses the line at "p" into "row" (the categorical features as uint32) and returns the next line
+inline const char *parse_criteo_line(const char *p, const char *end, int *row, long int max_ind_range){
+  for(int f = 0; f < CRITEO_ROW_INTS; f++){
+    if(f <= CRITEO_N_DENSE){
+      bool negative = p < end && *p == '-';
+      long int value = 0;
+      for(p += negative; p < end && *p >= '0' && *p <= '9'; p++){
+        value = value * 10 + (*p - '0');
+      }
+      row[f] = (f > 0 && negative) ? 0 : (int)(negative ? -value : value);
     }
     else{
-      torch::Tensor output_slice = output.index({torch::indexing::Slice(unit*i, unit*(i+1))});
-      torch::normal_out(output_slice, 0, std, {unit, dim}, generator);
+      uint32_t value = 0;
+      for(; p < end; p++){
+        char c = *p;
+        int digit = (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+        if(digit < 0){
+          break;
+        }
+        value = (value << 4) | digit;
+      }
+      if(max_ind_range > 0){
+        value %= max_ind_range;
+      }
+      row[f] = (int)value;
+    }
+    // a missing field is empty, so the fields left of a short line stay on its '\n'
+    while(p < end && *p != '\t' && *p != '\n'){
+      p++;
+    }
+    if(p < end && *p == '\t'){
+      p++;
     }
   }
-  return output;
+  const char *next = (const char *)memchr(p, '\n', end - p);
+  return next ? next + 1 : end;
 }
 
+// first line boundary at or after "offset"
+inline long int criteo_line_start(const char *base, long int size, long int offset){
+  if(offset <= 0 || offset >= size){
+    return std::min(std::max(offset, 0L), size);
+  }
+  const char *next = (const char *)memchr(base + offset - 1, '\n', size - offset + 1);
+  return next ? next + 1 - base : size;
+}
 
-torch::Tensor normal_multi_thread_with_extra(const torch::Tensor &std, int dim, int extra, int n_cores){
-  int n_emb = std.sizes()[0]; // dimension of std: (n_emb)
-  int unit = n_emb / n_cores;
-  int remain = n_emb % n_cores;
+void write_criteo_rows(int fd, const int *rows, long int n, long int first){
+  const char *data = (const char *)rows;
+  for(long int done = 0; done < n * CRITEO_ROW_BYTES;){
+    long int n_written = pwrite(fd, data + done, n * CRITEO_ROW_BYTES - done, first * CRITEO_ROW_BYTES + done);
+    assert(n_written > 0);
+    done += n_written;
+  }
+}
 
-  // allocate a memory space for output tensor
-  torch::Tensor output = torch::empty({n_emb + extra, dim});
+std::vector<long int> preprocess_criteo(const std::vector<std::string> &paths, const std::string &out_dir, int days, long int max_ind_range, double sub_sample_rate, long int seed, int n_cores){
+  int n_inputs = paths.size();
+  assert(n_inputs > 1 || days > 1);
+  assert(sub_sample_rate >= 0 && sub_sample_rate < 1);
+  int n_threads = pool_threads(n_cores);
+  std::vector<const char *> bases(n_inputs);
+  std::vector<long int> sizes(n_inputs);
+  long int n_bytes = 0;
+  for(int f = 0; f < n_inputs; f++){
+    int fd = open(paths[f].c_str(), O_RDONLY);
+    assert(fd >= 0);
+    struct stat st;
+    fstat(fd, &st);
+    sizes[f] = st.st_size;
+    bases[f] = sizes[f] > 0 ? (const char *)mmap(nullptr, sizes[f], PROT_READ, MAP_SHARED, fd, 0) : nullptr;
+    close(fd);
+    assert(bases[f] != MAP_FAILED);
+    if(sizes[f] > 0){
+      madvise((void *)bases[f], sizes[f], MADV_SEQUENTIAL);
+    }
+    n_bytes += sizes[f];
+  }
+  scoped_trace trace("preprocess_criteo", 0, n_bytes);
 
-  #pragma omp parallel for num_threads(n_cores)
-  for(int i = 0; i < n_cores; i++){
-    torch::Generator generator = make_generator<CPUGeneratorImpl>();
-    generator.set_current_seed(rand());
-    if(i == n_cores - 1 && remain != 0){
-      torch::Tensor output_slice = output.index({torch::indexing::Slice(unit*i, unit*(i+1) + remain)});
-      torch::normal_out(output_slice, 0, 1, {unit + remain, dim}, generator);
+  // 1. The held-out rows: lines of input "held_out_input" from byte "held_out_offset" on
+  int held_out_input = n_inputs - 1;
+  long int held_out_offset = 0;
+  if(n_inputs == 1){
+    // the last of "days" splits of the lines, which has floor(n / days) lines
+    const char *base = bases[0];
+    long int size = sizes[0];
+    std::vector<long int> lines(n_threads, 0);
+    #pragma omp parallel for num_threads(n_threads) schedule(static)
+    for(int c = 0; c < n_threads; c++){
+      for(const char *p = base + size * c / n_threads, *end = base + size * (c + 1) / n_threads; p < end; p++){
+        p = (const char *)memchr(p, '\n', end - p);
+        if(p == nullptr){
+          break;
+        }
+        lines[c]++;
+      }
+    }
+    long int n_lines = std::accumulate(lines.begin(), lines.end(), 0L);
+    if(size > 0 && base[size - 1] != '\n'){
+      n_lines++;
+    }
+    long int skip = n_lines - n_lines / days;
+    held_out_offset = size;
+    for(long int offset = 0; offset < size; offset = criteo_line_start(base, size, offset + 1)){
+      if(skip-- == 0){
+        held_out_offset = offset;
+        break;
+      }
+    }
+  }
+
+  // 2. Parse in rounds, write the raw rows, collect the distinct values
+  std::string train_path = out_dir + "/train_data.bin", test_path = out_dir + "/test_data.bin", val_path = out_dir + "/val_data.bin";
+  int train_fd = open(train_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  int test_fd = open(test_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  int val_fd = open(val_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  assert(train_fd >= 0 && test_fd >= 0 && val_fd >= 0);
+  std::vector<criteo_dictionary> dictionaries(CRITEO_N_SPARSE);
+  std::vector<std::vector<int>> train_rows(n_threads), held_out_rows(n_threads);
+  std::vector<std::vector<std::vector<uint32_t>>> distinct(n_threads, std::vector<std::vector<uint32_t>>(CRITEO_N_SPARSE));
+  long int n_train = 0, n_held_out = 0;
+  for(int f = 0; f < n_inputs; f++){
+    const char *base = bases[f];
+    long int size = sizes[f];
+    for(long int start = 0; start < size;){
+      long int stop = criteo_line_start(base, size, start + CRITEO_PREPROCESS_ROUND);
+      #pragma omp parallel for num_threads(n_threads) schedule(static)
+      for(int c = 0; c < n_threads; c++){
+        long int begin = criteo_line_start(base, size, start + (stop - start) * c / n_threads);
+        long int end = criteo_line_start(base, size, start + (stop - start) * (c + 1) / n_threads);
+        train_rows[c].clear();
+        held_out_rows[c].clear();
+        int row[CRITEO_ROW_INTS];
+        for(const char *p = base + begin; p < base + end;){
+          long int offset = p - base;
+          p = parse_criteo_line(p, base + end, row, max_ind_range);
+          bool held_out = f > held_out_input || (f == held_out_input && offset >= held_out_offset);
+          if(!held_out && row[0] == 0 && sub_sample_rate > 0){
+            splitmix64 rng(((uint64_t)seed * 0xD1B54A32D192ED03ULL) ^ ((uint64_t)f << 48) ^ (uint64_t)offset);
+            if(rng.uniform() < sub_sample_rate){
+              continue;
+            }
+          }
+          std::vector<int> &rows = held_out ? held_out_rows[c] : train_rows[c];
+          rows.insert(rows.end(), row, row + CRITEO_ROW_INTS);
+          for(int t = 0; t < CRITEO_N_SPARSE; t++){
+            distinct[c][t].push_back((uint32_t)row[1 + CRITEO_N_DENSE + t]);
+          }
+        }
+        for(int t = 0; t < CRITEO_N_SPARSE; t++){
+          std::sort(distinct[c][t].begin(), distinct[c][t].end());
+          distinct[c][t].erase(std::unique(distinct[c][t].begin(), distinct[c][t].end()), distinct[c][t].end());
+        }
+      }
+
+      // rows of the chunks after each other, in the order of the lines
+      std::vector<long int> train_first(n_threads), held_out_first(n_threads);
+      for(int c = 0; c < n_threads; c++){
+        train_first[c] = n_train;
+        held_out_first[c] = n_held_out;
+        n_train += train_rows[c].size() / CRITEO_ROW_INTS;
+        n_held_out += held_out_rows[c].size() / CRITEO_ROW_INTS;
+      }
+      #pragma omp parallel for num_threads(n_threads) schedule(dynamic,1)
+      for(int i = 0; i < n_threads + CRITEO_N_SPARSE; i++){
+        if(i < n_threads){
+          write_criteo_rows(train_fd, train_rows[i].data(), train_rows[i].size() / CRITEO_ROW_INTS, train_first[i]);
+          write_criteo_rows(test_fd, held_out_rows[i].data(), held_out_rows[i].size() / CRITEO_ROW_INTS, held_out_first[i]);
+          continue;
+        }
+        int t = i - n_threads;
+        criteo_dictionary &dictionary = dictionaries[t];
+        for(int c = 0; c < n_threads; c++){
+          dictionary.pending.insert(dictionary.pending.end(), distinct[c][t].begin(), distinct[c][t].end());
+          distinct[c][t].clear();
+        }
+        // amortized: the dictionary is rewritten once the pending values outgrow it
+        if(dictionary.pending.size() > std::max(dictionary.values.size(), (size_t)1 << 22)){
+          dictionary.merge();
+        }
+      }
+      start = stop;
+    }
+  }
+  #pragma omp parallel for num_threads(n_threads) schedule(dynamic,1)
+  for(int t = 0; t < CRITEO_N_SPARSE; t++){
+    dictionaries[t].merge();
+  }
+  for(int f = 0; f < n_inputs; f++){
+    if(sizes[f] > 0){
+      munmap((void *)bases[f], sizes[f]);
+    }
+  }
+
+  // 3. Renumber the categorical features in place, then split the held-out rows into test and val
+  for(auto [fd, n] : {std::make_pair(train_fd, n_train), std::make_pair(test_fd, n_held_out)}){
+    if(n == 0){
+      continue;
+    }
+    int *rows = (int *)mmap(nullptr, n * CRITEO_ROW_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    assert(rows != MAP_FAILED);
+    #pragma omp parallel for num_threads(n_threads) schedule(static)
+    for(long int r = 0; r < n; r++){
+      int *cat = rows + r * CRITEO_ROW_INTS + 1 + CRITEO_N_DENSE;
+      for(int t = 0; t < CRITEO_N_SPARSE; t++){
+        const std::vector<uint32_t> &values = dictionaries[t].values;
+        cat[t] = std::lower_bound(values.begin(), values.end(), (uint32_t)cat[t]) - values.begin();
+      }
+    }
+    if(fd == test_fd){
+      long int mid = (n + 1) / 2;
+      write_criteo_rows(val_fd, rows + mid * CRITEO_ROW_INTS, n - mid, 0);
+      munmap(rows, n * CRITEO_ROW_BYTES);
+      int ret = ftruncate(test_fd, mid * CRITEO_ROW_BYTES);
+      assert(ret == 0);
     }
     else{
-      torch::Tensor output_slice = output.index({torch::indexing::Slice(unit*i, unit*(i+1))});
-      torch::normal_out(output_slice, 0, 1, {unit, dim}, generator);
+      munmap(rows, n * CRITEO_ROW_BYTES);
     }
   }
-  output.index({torch::indexing::Slice(0, n_emb)}).mul_(std.view({-1, 1}));
-  return output;
+  close(train_fd);
+  close(test_fd);
+  close(val_fd);
+
+  std::vector<long int> counts;
+  for(const criteo_dictionary &dictionary : dictionaries){
+    counts.push_back(dictionary.values.size());
+  }
+  return counts;
 }
 
+// Readahead of the rows of file-backed tables (map_table_file with "shared"), which makes the storage
+// a tier below the page cache: untouched rows are never read, and the pages holding the rows of the
+// next iteration are requested with madvise(MADV_WILLNEED) from a background thread, so that the
+// kernel reads them asynchronously while the current iteration runs
+class RowReadahead{
+public:
+  ~RowReadahead(){
+    wait();
+  }
 
-torch::Tensor unique_multi_thread(const torch::Tensor &input){
-  std::vector<long int> input_vector(input.data<long int>(), input.data<long int>() + input.numel());
-  
-  std::sort(std::execution::par_unseq, input_vector.begin(), input_vector.end());
-  
-  auto last = std::unique(std::execution::par_unseq, input_vector.begin(), input_vector.end());
-  input_vector.erase(last, input_vector.end());
-  torch::Tensor output = torch::empty({input_vector.size()}, torch::kInt64);
-  memcpy(output.data<long int>(), &input_vector[0], input_vector.size() * sizeof(long int));
+  void submit(const std::vector<torch::Tensor> &weights, const std::vector<torch::Tensor> &indices){
+    assert(weights.size() == indices.size());
+    wait();
+    std::vector<torch::Tensor> inputs;
+    for(const torch::Tensor &index : indices){
+      inputs.push_back(index.contiguous());
+    }
+    worker = std::thread([weights, inputs](){
+      const uintptr_t page = sysconf(_SC_PAGESIZE);
+      for(int t = 0; t < (int)weights.size(); t++){
+        // 1. Pages touched by the rows (sorted, unique)
+        uintptr_t base = (uintptr_t)weights[t].data_ptr();
+        long int row_bytes = weights[t].sizes()[1] * weights[t].element_size();
+        const long int *idx = inputs[t].data<long int>();
+        std::vector<uintptr_t> pages;
+        for(long int j = 0; j < inputs[t].numel(); j++){
+          uintptr_t start = base + idx[j] * row_bytes;
+          for(uintptr_t p = start / page; p <= (start + row_bytes - 1) / page; p++){
+            pages.push_back(p);
+          }
+        }
+        std::sort(pages.begin(), pages.end());
+        pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
 
-  return output;
-}
+        // 2. One madvise() per run of consecutive pages
+        for(size_t j = 0; j < pages.size();){
+          size_t k = j + 1;
+          while(k < pages.size() && pages[k] == pages[k - 1] + 1){
+            k++;
+          }
+          madvise((void *)(pages[j] * page), (k - j) * page, MADV_WILLNEED);
+          j = k;
+        }
+      }
+    });
+  }
 
+  void wait(){
+    if(worker.joinable()){
+      worker.join();
+    }
+  }
 
-typedef std::pair<long int, long int> int_pair;
+private:
+  std::thread worker;
+};
 
-torch::Tensor coalesce_multi_thread_openmp(const torch::Tensor &input, int n_cores){
-  // If input tensor is already coalesced, just return
-  if(input.is_coalesced()){
-    return input;
+// Compressed cold tier of an fp32 table under LazyDP, driven by the age of the rows in the HT: a row
+// is only written when it is accessed (its update, and the delayed noise of the iteration before), so
+// a block of "block_rows" rows all last accessed more than "min_age" iterations ago is read-only until
+// one of them is accessed again. compact_async() scans the next "scan_blocks" blocks on a background
+// thread, packs the cold ones (bf16, or row-wise int8 as embedding_bag_byte_prepack) and releases the
+// pages they fully cover (MADV_DONTNEED, the table must be anonymous memory). restore() unpacks the
+// blocks of the rows of a batch before its lookups and its update, where their pending delayed noise is
+// then applied at full precision as for any other row; a restored block stays hot for "min_age"
+// iterations, so rows prepared ahead of their HT update are never packed again.
+class ColdRowStore{
+public:
+  ColdRowStore(torch::Tensor weight, long int block_rows, bool int8)
+    : weight_(weight), block_rows(block_rows), int8(int8){
+    assert(weight.scalar_type() == torch::kFloat && weight.is_contiguous() && block_rows > 0);
+    n_rows = weight.sizes()[0];
+    dim = weight.sizes()[1];
+    n_blocks = (n_rows + block_rows - 1) / block_rows;
+    blocks.resize(n_blocks);
+    restored_iter.assign(n_blocks, INT32_MIN / 2);
   }
 
-  // Convert data types of indices and values from torch::Tensor to std::vector<long int>
-  torch::Tensor indices = input._indices();
-  torch::Tensor values = input._values();
+  ~ColdRowStore(){
+    wait();
+  }
 
-  // Set several variables
-  int n_embs = input.sizes()[0];
-  int n_rows = values.sizes()[0];
-  int dim = values.sizes()[1];
-  assert(dim == input.sizes()[1]);
-  assert(indices.sizes()[0] == 1);
-  assert(indices.sizes()[1] == n_rows);
+  // starts packing the cold blocks of the next "scan_blocks" blocks on a background thread, after the
+  // previous compaction; "HT" (int32) holds the iteration of the last access of each row
+  void compact_async(torch::Tensor HT, int cnt_iter, int min_age, long int scan_blocks, int n_cores){
+    assert(HT.scalar_type() == torch::kInt && HT.numel() == n_rows && min_age > 0);
+    wait();
+    last_iter = cnt_iter;
+    compactor = std::thread([this, HT, cnt_iter, min_age, scan_blocks, n_cores](){
+      compact(HT.data<int>(), cnt_iter, min_age, std::min(scan_blocks, n_blocks), n_cores);
+    });
+  }
 
-  // Create a vector of pairs (indices, new indices started from 0)
-  std::vector<long int> indices_vector(indices.data<long int>(), indices.data<long int>() + indices.numel());
-  std::vector<std::pair<long int, long int>> indices_vector_with_index(n_rows);
-  for(int i = 0; i < n_rows; i++){
-    indices_vector_with_index[i].first = indices_vector[i];
-    indices_vector_with_index[i].second = i;
+  void wait(){
+    if(compactor.joinable()){
+      compactor.join();
+    }
   }
 
-  // Sort that vector of pairs
-  std::sort(std::execution::par_unseq, indices_vector_with_index.begin(), indices_vector_with_index.end(), [](const std::pair<long int, long int> lhs, const std::pair<long int, long int> rhs){
-    return lhs.first < rhs.first;
-  });
-  
-  // Do coalescing and derive start, end indices for each coalesced index
-  std::vector<long int> coalesced_indices_vector;
-  std::vector<long int> start_indices;
-  std::vector<long int> end_indices;
-  for(int i = 0; i < n_rows; i++){
-    if(i == 0 || indices_vector_with_index[i].first != indices_vector_with_index[i-1].first){
-      if(i != 0){
-        end_indices.push_back(i - 1);
+  // unpacks the cold blocks of the rows of "indices" (int32 or int64 tensors), and returns their number
+  long int restore(const std::vector<torch::Tensor> &indices, int n_cores){
+    wait();
+    std::vector<long int> touched;
+    for(const torch::Tensor &index : indices){
+      torch::Tensor input = index.contiguous();
+      if(input.scalar_type() == torch::kInt){
+        cold_blocks_of(input.data<int>(), input.numel(), touched);
       }
-      coalesced_indices_vector.push_back(indices_vector_with_index[i].first);
-      start_indices.push_back(i);
+      else{
+        cold_blocks_of(input.data<long int>(), input.numel(), touched);
+      }
+    }
+    std::sort(touched.begin(), touched.end());
+    touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+    scoped_trace trace("cold_restore", touched.size() * block_rows, touched.size() * block_rows * dim * sizeof(float));
+    #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(dynamic, 1)
+    for(size_t j = 0; j < touched.size(); j++){
+      unpack(touched[j]);
     }
+    n_restored += touched.size();
+    return touched.size();
   }
-  end_indices.push_back(n_rows - 1);
-  int n_coalesced_rows = coalesced_indices_vector.size();
 
+  // unpacks every cold block (e.g., before a pass over the whole table), and returns their number
+  long int restore_all(int n_cores){
+    wait();
+    std::vector<long int> cold;
+    for(long int b = 0; b < n_blocks; b++){
+      if(blocks[b] != nullptr){
+        cold.push_back(b);
+      }
+    }
+    #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(dynamic, 1)
+    for(size_t j = 0; j < cold.size(); j++){
+      unpack(cold[j]);
+    }
+    n_restored += cold.size();
+    return cold.size();
+  }
 
-  // Derive coalesced values for each coalesced index
-  torch::Tensor out_values = torch::empty({n_coalesced_rows, dim}, torch::kFloat);
-  assert(out_values.is_contiguous());
-  assert(values.is_contiguous());
+  // counters of the tier: cold blocks, blocks packed and restored so far, bytes of the packed blocks and
+  // of the pages released
+  std::map<std::string, long int> stats(){
+    wait();
+    return {{"cold_blocks", n_cold}, {"packed", n_packed}, {"restored", n_restored}, {"cold_bytes", cold_bytes}, {"released_bytes", released_bytes}};
+  }
+
+private:
+  torch::Tensor weight_;
+  long int n_rows;
+  long int dim;
+  long int block_rows;
+  long int n_blocks;
+  bool int8;
+  std::vector<std::unique_ptr<uint8_t[]>> blocks;
+  std::vector<int> restored_iter;
+  int last_iter = 0;
+  long int cursor = 0;
+  long int n_cold = 0;
+  long int n_packed = 0;
+  long int n_restored = 0;
+  long int cold_bytes = 0;
+  long int released_bytes = 0;
+  std::thread compactor;
+
+  long int row_bytes() const{
+    return int8 ? dim + ROWWISE_INT8_EXTRA : dim * (long int)sizeof(at::BFloat16);
+  }
+
+  long int rows_of(long int b) const{
+    return std::min(block_rows, n_rows - b * block_rows);
+  }
 
-  #pragma omp parallel for num_threads(n_cores)
-  for(int i = 0; i < n_coalesced_rows; i++){
-    memcpy(out_values.data<float>() + i * dim, values.data<float>() + indices_vector_with_index[start_indices[i]].second * dim, dim * sizeof(float));
-    if(end_indices[i] > start_indices[i]){
-      for(int j = start_indices[i] + 1; j <= end_indices[i]; j++){
-        out_values.index({i}).add_(values.index({indices_vector_with_index[j].second}));
+  template<typename index_t>
+  void cold_blocks_of(const index_t *idx, long int n, std::vector<long int> &touched){
+    for(long int j = 0; j < n; j++){
+      assert(idx[j] >= 0 && idx[j] < n_rows);
+      long int b = idx[j] / block_rows;
+      if(blocks[b] != nullptr){
+        touched.push_back(b);
       }
+      restored_iter[b] = last_iter;
     }
   }
 
-  // 5
-  torch::Tensor out_indices = torch::empty({1, coalesced_indices_vector.size()}, torch::kInt64);
-  memcpy(out_indices.data<long int>(), &coalesced_indices_vector[0], coalesced_indices_vector.size() * sizeof(long int));
-  torch::Tensor output = torch::sparse_coo_tensor(out_indices, out_values, {n_embs, dim});
-  output._coalesced_(true);
-  
-  return output;
-}
+  // [start, end) of the pages fully covered by the rows of block "b"
+  std::pair<uintptr_t, uintptr_t> pages_of(long int b) const{
+    const uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t begin = (uintptr_t)(weight_.data<float>() + b * block_rows * dim);
+    uintptr_t end = begin + rows_of(b) * dim * sizeof(float);
+    begin = (begin + page - 1) / page * page;
+    end = end / page * page;
+    return {begin, std::max(begin, end)};
+  }
 
+  void compact(const int *HT, int cnt_iter, int min_age, long int scan_blocks, int n_cores){
+    scoped_trace trace("cold_compact", scan_blocks * block_rows, 0);
+    std::atomic<long int> packed(0), packed_bytes(0), released(0);
+    #pragma omp parallel for num_threads(pool_threads(n_cores)) schedule(dynamic, 16)
+    for(long int j = 0; j < scan_blocks; j++){
+      long int b = (cursor + j) % n_blocks;
+      if(blocks[b] != nullptr || cnt_iter - restored_iter[b] <= min_age){
+        continue;
+      }
+      bool cold = true;
+      for(long int r = b * block_rows; r < b * block_rows + rows_of(b) && cold; r++){
+        cold = cnt_iter - HT[r] > min_age;
+      }
+      if(!cold){
+        continue;
+      }
+      pack(b);
+      std::pair<uintptr_t, uintptr_t> pages = pages_of(b);
+      if(pages.second > pages.first){
+        madvise((void *)pages.first, pages.second - pages.first, MADV_DONTNEED);
+      }
+      packed++;
+      packed_bytes += rows_of(b) * row_bytes();
+      released += pages.second - pages.first;
+    }
+    cursor = (cursor + scan_blocks) % n_blocks;
+    n_cold += packed.load();
+    n_packed += packed.load();
+    cold_bytes += packed_bytes.load();
+    released_bytes += released.load();
+  }
 
-torch::Tensor coalesce_multi_thread_embeddingbag(const torch::Tensor &input, int n_cores){
-  // If input tensor is already coalesced, just return
-  if(input.is_coalesced()){
-    return input;
+  void pack(long int b){
+    const float *rows = weight_.data<float>() + b * block_rows * dim;
+    long int n = rows_of(b);
+    uint8_t *packed = new uint8_t[n * row_bytes()];
+    for(long int r = 0; r < n; r++){
+      const float *row = rows + r * dim;
+      uint8_t *out = packed + r * row_bytes();
+      if(int8){
+        float w_min = INFINITY;
+        float w_max = -INFINITY;
+        for(long int k = 0; k < dim; k++){
+          w_min = std::min(w_min, row[k]);
+          w_max = std::max(w_max, row[k]);
+        }
+        float scale_bias[2] = {(w_max - w_min) / 255.0f, w_min};
+        float inv_scale = 255.0f / (w_max - w_min + 1e-8f);
+        for(long int k = 0; k < dim; k++){
+          out[k] = (uint8_t)std::min(std::max(nearbyintf((row[k] - w_min) * inv_scale), 0.0f), 255.0f);
+        }
+        memcpy(out + dim, scale_bias, sizeof(scale_bias));
+      }
+      else{
+        at::BFloat16 *values = (at::BFloat16 *)out;
+        for(long int k = 0; k < dim; k++){
+          values[k] = at::BFloat16(row[k]);
+        }
+      }
+    }
+    blocks[b].reset(packed);
   }
 
-  // Convert data types of indices and values from torch::Tensor to std::vector<long int>
-  torch::Tensor indices = input._indices();
-  torch::Tensor values = input._values();
+  void unpack(long int b){
+    float *rows = weight_.data<float>() + b * block_rows * dim;
+    long int n = rows_of(b);
+    const uint8_t *packed = blocks[b].get();
+    for(long int r = 0; r < n; r++){
+      float *row = rows + r * dim;
+      const uint8_t *in = packed + r * row_bytes();
+      if(int8){
+        float scale_bias[2];
+        memcpy(scale_bias, in + dim, sizeof(scale_bias));
+        for(long int k = 0; k < dim; k++){
+          row[k] = in[k] * scale_bias[0] + scale_bias[1];
+        }
+      }
+      else{
+        const at::BFloat16 *values = (const at::BFloat16 *)in;
+        for(long int k = 0; k < dim; k++){
+          row[k] = (float)values[k];
+        }
+      }
+    }
+    blocks[b].reset();
+    #pragma omp atomic
+    n_cold--;
+    #pragma omp atomic
+    cold_bytes -= n * row_bytes();
+  }
+};
 
-  // Set several variables
-  int n_embs = input.sizes()[0];
-  int n_rows = values.sizes()[0];
-  int dim = values.sizes()[1];
-  assert(dim == input.sizes()[1]);
-  assert(indices.sizes()[0] == 1);
-  assert(indices.sizes()[1] == n_rows);
+// Software prefetch of the rows of the next iteration (and of their HT counters) into the last-level
+// cache, by a background thread while the GPU runs the MLPs of the current iteration: a word of every
+// cache line of the (unique) rows of each table is loaded, table by table, until "budget_bytes" (a
+// share of the LLC) are used. stop() ends the pass when the update starts. Rows prefetched before
+// stop() over the rows requested approximate the LLC hit rate of the update (the hardware counters
+// give the real one)
+class LLCPrefetcher{
+public:
+  explicit LLCPrefetcher(long int budget_bytes) : budget_bytes(budget_bytes){}
 
-  // 1. Create a vector of pairs (indices, new indices started from 0)
-  std::vector<long int> indices_vector(indices.data<long int>(), indices.data<long int>() + indices.numel());
-  std::vector<int_pair> indices_vector_with_index(n_rows);
-  std::for_each(std::execution::par_unseq, indices_vector_with_index.begin(), indices_vector_with_index.end(), [&](int_pair &pair){
-    unsigned long int i = (uintptr_t(&pair) - uintptr_t(indices_vector_with_index.data())) / sizeof(int_pair); 
-    pair.first = indices_vector[i];
-    pair.second = i;
-  });
+  ~LLCPrefetcher(){
+    stop();
+  }
 
-  // 2. Sort that vector of pairs
-  std::sort(std::execution::par_unseq, indices_vector_with_index.begin(), indices_vector_with_index.end(), [](const std::pair<long int, long int> lhs, const std::pair<long int, long int> rhs){
-    return lhs.first < rhs.first;
-  });
-  
-  // 3. Extract each elements and form seperated vector
-  std::vector<long int> sorted_first(indices.numel());
-  std::vector<long int> embedding_idx(indices.numel());
-  std::for_each(std::execution::par_unseq, indices_vector_with_index.begin(), indices_vector_with_index.end(), [&](const int_pair &pair){
-    unsigned long int i = (uintptr_t(&pair) - uintptr_t(indices_vector_with_index.data())) / sizeof(int_pair); 
-    sorted_first[i] = pair.first;
-    embedding_idx[i] = pair.second;
-  });
-  
-  // 4. Derive coalesced_indices by applying unique() to sorted_first
-  auto last = std::unique(std::execution::par_unseq, sorted_first.begin(), sorted_first.end());
-  sorted_first.erase(last, sorted_first.end());
-  torch::Tensor coalesced_indices = torch::empty({1, sorted_first.size()}, torch::kInt64);
-  memcpy(coalesced_indices.data<long int>(), &sorted_first[0], sorted_first.size() * sizeof(long int));
-  
-  // 5. Derive embedding_offsets
-  std::vector<long int> embedding_offset(sorted_first.size());
-  std::vector<long int> difference_occur(n_rows);
-  std::vector<long int> result_exclusive_scan(n_rows);
-  std::for_each(std::execution::par_unseq, difference_occur.begin(), difference_occur.end(), [&](long int &e){
-    unsigned long int i = (uintptr_t(&e) - uintptr_t(difference_occur.data())) / sizeof(long int); 
-    if((i == 0) || (indices_vector_with_index[i-1].first != indices_vector_with_index[i].first)){
-      e = 1;
-    }else{
-      e = 0;
+  // "HTs": int32 counters of each table, or an empty list (e.g., the native HT)
+  void submit(const std::vector<torch::Tensor> &weights, const std::vector<torch::Tensor> &indices, const std::vector<torch::Tensor> &HTs){
+    assert(weights.size() == indices.size() && (HTs.empty() || HTs.size() == weights.size()));
+    stop();
+    std::vector<torch::Tensor> inputs;
+    for(const torch::Tensor &index : indices){
+      assert(index.scalar_type() == torch::kInt64);
+      inputs.push_back(index.contiguous());
+      n_requested += index.numel();
     }
-  });
-  std::exclusive_scan(std::execution::par_unseq, difference_occur.begin(), difference_occur.end(), result_exclusive_scan.begin(), 0);
-  std::for_each(std::execution::par_unseq, difference_occur.begin(), difference_occur.end(), [&](long int &e){
-    if(e == 1){
-      unsigned long int i = (uintptr_t(&e) - uintptr_t(difference_occur.data())) / sizeof(long int); 
-      embedding_offset[result_exclusive_scan[i]] = i;
+    stopping = false;
+    worker = std::thread([this, weights, inputs, HTs](){
+      const long int line = 64;
+      long int used = 0;
+      unsigned char sink = 0;
+      for(int t = 0; t < (int)weights.size(); t++){
+        const unsigned char *base = (const unsigned char *)weights[t].data_ptr();
+        const int *HT_ptr = HTs.empty() ? nullptr : HTs[t].data<int>();
+        long int row_bytes = weights[t].sizes()[1] * weights[t].element_size();
+        const long int *idx = inputs[t].data<long int>();
+        for(long int j = 0; j < inputs[t].numel(); j++){
+          if(stopping.load(std::memory_order_relaxed) || used + row_bytes > budget_bytes){
+            prefetch_sink = sink;
+            return;
+          }
+          const unsigned char *row = base + idx[j] * row_bytes;
+          for(long int offset = 0; offset < row_bytes; offset += line){
+            sink ^= *(volatile const unsigned char *)(row + offset);
+          }
+          if(HT_ptr != nullptr){
+            sink ^= (unsigned char)*(volatile const int *)(HT_ptr + idx[j]);
+          }
+          used += row_bytes;
+          n_prefetched.fetch_add(1, std::memory_order_relaxed);
+        }
+      }
+      prefetch_sink = sink;
+    });
+  }
+
+  void stop(){
+    stopping = true;
+    if(worker.joinable()){
+      worker.join();
+    }
+  }
+
+  // (rows requested, rows prefetched before stop()) since the creation
+  std::vector<long int> stats() const{
+    return {n_requested, n_prefetched.load()};
+  }
+
+private:
+  long int budget_bytes;
+  long int n_requested = 0;
+  std::atomic<long int> n_prefetched{0};
+  std::atomic<bool> stopping{false};
+  unsigned char prefetch_sink = 0; // keeps the loads
+  std::thread worker;
+};
+
+
+// Coalescing by the kernel named as config.coalesce_optimize (custom_utils.coalesce_with)
+torch::Tensor coalesce_by_name(const torch::Tensor &input, const std::string &kernel, int n_cores){
+  if(kernel == "baseline"){
+    return input.coalesce();
+  }
+  else if(kernel == "multi_thread_openmp"){
+    return coalesce_multi_thread_openmp(input, n_cores);
+  }
+  else if(kernel == "multi_thread_embeddingbag"){
+    return coalesce_multi_thread_embeddingbag(input, n_cores);
+  }
+  else if(kernel == "radix"){
+    return coalesce_radix(input, n_cores);
+  }
+  else if(kernel == "dense"){
+    return coalesce_dense(input, n_cores);
+  }
+  else if(kernel == "auto"){
+    return coalesce_auto(input, n_cores);
+  }
+  assert(kernel == "hash" || kernel == "hash_unsorted");
+  return coalesce_hash(input, kernel == "hash", n_cores);
+}
+
+// Result of a kernel launched on the inter-op thread pool (at::launch) by the *_async functions, so
+// that the caller can issue the work of the next table while this one runs. wait() blocks (without
+// the GIL) until the kernel is done and returns its outputs, or rethrows its error
+struct TensorFuture{
+  std::future<std::vector<torch::Tensor>> result;
+
+  std::vector<torch::Tensor> wait(){
+    assert(result.valid()); // the outputs are taken once
+    return result.get();
+  }
+
+  bool done() const{
+    return result.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+  }
+};
+
+template<typename F>
+std::unique_ptr<TensorFuture> launch_async(F kernel){
+  auto promise = std::make_shared<std::promise<std::vector<torch::Tensor>>>();
+  auto future = std::make_unique<TensorFuture>();
+  future->result = promise->get_future();
+  at::launch([promise, kernel](){
+    try{
+      promise->set_value(kernel());
+    }
+    catch(...){
+      promise->set_exception(std::current_exception());
     }
   });
+  return future;
+}
 
-  // 6. Convert vector to torch.tensor for embedding_bag
-  torch::Tensor embedding_idx_tensor = torch::empty({embedding_idx.size()}, torch::kInt64);
-  memcpy(embedding_idx_tensor.data<long int>(), &embedding_idx[0], embedding_idx.size() * sizeof(long int));
-  torch::Tensor embedding_offset_tensor = torch::empty({embedding_offset.size()}, torch::kInt64);
-  memcpy(embedding_offset_tensor.data<long int>(), &embedding_offset[0], embedding_offset.size() * sizeof(long int));
+std::unique_ptr<TensorFuture> normal_multi_thread_with_extra_async(const torch::Tensor &std, int dim, int extra, int n_cores){
+  return launch_async([=](){ return std::vector<torch::Tensor>{normal_multi_thread_with_extra(std, dim, extra, n_cores)}; });
+}
 
-  // 7. Apply embedding_bag
-  torch::Tensor coalesced_values = std::get<0>(torch::_embedding_bag_forward_only(values, embedding_idx_tensor, embedding_offset_tensor));
-  
-  // 8. Form the answer as a sparse_coo_tensor
-  torch::Tensor output = torch::sparse_coo_tensor(coalesced_indices, coalesced_values, {n_embs, dim});
-  output._coalesced_(true);
-  return output;
+std::unique_ptr<TensorFuture> normal_philox_with_extra_async(const torch::Tensor &std, const torch::Tensor &indices, int dim, int extra, long int seed, int table, int iteration, int n_cores){
+  return launch_async([=](){ return std::vector<torch::Tensor>{normal_philox_with_extra(std, indices, dim, extra, seed, table, iteration, n_cores)}; });
+}
+
+std::unique_ptr<TensorFuture> unique_multi_thread_async(const torch::Tensor &input){
+  return launch_async([=](){ return std::vector<torch::Tensor>{unique_multi_thread(input)}; });
+}
+
+std::unique_ptr<TensorFuture> coalesce_async(const torch::Tensor &input, const std::string &kernel, int n_cores){
+  return launch_async([=](){ return std::vector<torch::Tensor>{coalesce_by_name(input, kernel, n_cores)}; });
+}
+
+
+// The noise, unique and coalesce kernels as TORCH_LIBRARY ops (torch.ops.lazydp.*), so that they show up
+// in the op tables of torch.profiler and can be traced by torch.compile. The dispatcher takes int64_t and
+// double arguments, hence the thin wrappers; the pybind functions above stay the interface of the optimizer.
+// The noise ops have Meta kernels (shapes only); the outputs of unique and coalesce depend on the data,
+// their fake kernels are registered from Python with dynamic sizes (custom_utils.register_fake_lazydp_ops)
+namespace lazydp_ops{
+torch::Tensor normal_multi_thread(double std, int64_t n_emb, int64_t dim, int64_t n_cores){
+  return ::normal_multi_thread(std, n_emb, dim, n_cores);
+}
+torch::Tensor normal_multi_thread_with_extra(const torch::Tensor &std, int64_t dim, int64_t extra, int64_t n_cores){
+  return ::normal_multi_thread_with_extra(std, dim, extra, n_cores);
+}
+torch::Tensor normal_philox(double std, int64_t n_emb, int64_t dim, int64_t seed, int64_t table, int64_t iteration, int64_t n_cores){
+  return ::normal_philox(std, n_emb, dim, seed, table, iteration, n_cores);
+}
+torch::Tensor normal_philox_with_extra(const torch::Tensor &std, const torch::Tensor &indices, int64_t dim, int64_t extra, int64_t seed, int64_t table, int64_t iteration, int64_t n_cores){
+  return ::normal_philox_with_extra(std, indices, dim, extra, seed, table, iteration, n_cores);
+}
+torch::Tensor unique_multi_thread(const torch::Tensor &input){
+  return ::unique_multi_thread(input);
+}
+torch::Tensor coalesce_multi_thread_openmp(const torch::Tensor &input, int64_t n_cores){
+  return ::coalesce_multi_thread_openmp(input, n_cores);
+}
+torch::Tensor coalesce_multi_thread_embeddingbag(const torch::Tensor &input, int64_t n_cores){
+  return ::coalesce_multi_thread_embeddingbag(input, n_cores);
+}
+torch::Tensor coalesce_radix(const torch::Tensor &input, int64_t n_cores){
+  return ::coalesce_radix(input, n_cores);
+}
+torch::Tensor coalesce_radix_with_noise(const torch::Tensor &input, double std, int64_t seed, int64_t table, int64_t iteration, int64_t n_cores){
+  return ::coalesce_radix_with_noise(input, std, seed, table, iteration, n_cores);
+}
+torch::Tensor coalesce_with_inverse(const torch::Tensor &input, const torch::Tensor &unique, const torch::Tensor &inverse, const torch::Tensor &counts, int64_t n_cores){
+  return ::coalesce_with_inverse(input, unique, inverse, counts, n_cores);
+}
+torch::Tensor coalesce_hash(const torch::Tensor &input, bool sorted, int64_t n_cores){
+  return ::coalesce_hash(input, sorted, n_cores);
+}
+torch::Tensor coalesce_dense(const torch::Tensor &input, int64_t n_cores){
+  return ::coalesce_dense(input, n_cores);
+}
+std::vector<torch::Tensor> coalesce_multi_table(const std::vector<torch::Tensor> &inputs, int64_t n_cores){
+  return ::coalesce_multi_table(inputs, n_cores);
+}
+
+torch::Tensor normal_meta(double std, int64_t n_emb, int64_t dim, int64_t n_cores){
+  return torch::empty({n_emb, dim}, torch::TensorOptions().dtype(torch::kFloat).device(torch::kMeta));
+}
+torch::Tensor normal_with_extra_meta(const torch::Tensor &std, int64_t dim, int64_t extra, int64_t n_cores){
+  return torch::empty({std.sizes()[0] + extra, dim}, std.options().dtype(torch::kFloat));
+}
+torch::Tensor normal_philox_meta(double std, int64_t n_emb, int64_t dim, int64_t seed, int64_t table, int64_t iteration, int64_t n_cores){
+  return normal_meta(std, n_emb, dim, n_cores);
+}
+torch::Tensor normal_philox_with_extra_meta(const torch::Tensor &std, const torch::Tensor &indices, int64_t dim, int64_t extra, int64_t seed, int64_t table, int64_t iteration, int64_t n_cores){
+  return normal_with_extra_meta(std, dim, extra, n_cores);
+}
+}
+
+TORCH_LIBRARY(lazydp, m) {
+  m.def("normal_multi_thread(float std, int n_emb, int dim, int n_cores) -> Tensor");
+  m.def("normal_multi_thread_with_extra(Tensor std, int dim, int extra, int n_cores) -> Tensor");
+  m.def("normal_philox(float std, int n_emb, int dim, int seed, int table, int iteration, int n_cores) -> Tensor");
+  m.def("normal_philox_with_extra(Tensor std, Tensor indices, int dim, int extra, int seed, int table, int iteration, int n_cores) -> Tensor");
+  m.def("unique_multi_thread(Tensor input) -> Tensor");
+  m.def("coalesce_multi_thread_openmp(Tensor input, int n_cores) -> Tensor");
+  m.def("coalesce_multi_thread_embeddingbag(Tensor input, int n_cores) -> Tensor");
+  m.def("coalesce_radix(Tensor input, int n_cores) -> Tensor");
+  m.def("coalesce_radix_with_noise(Tensor input, float std, int seed, int table, int iteration, int n_cores) -> Tensor");
+  m.def("coalesce_with_inverse(Tensor input, Tensor unique, Tensor inverse, Tensor counts, int n_cores) -> Tensor");
+  m.def("coalesce_hash(Tensor input, bool sorted, int n_cores) -> Tensor");
+  m.def("coalesce_dense(Tensor input, int n_cores) -> Tensor");
+  m.def("coalesce_multi_table(Tensor[] inputs, int n_cores) -> Tensor[]");
+}
+
+// CompositeExplicitAutograd: the same kernel for the dense and the sparse (COO gradient) CPU tensors
+TORCH_LIBRARY_IMPL(lazydp, CompositeExplicitAutograd, m) {
+  m.impl("normal_multi_thread", &lazydp_ops::normal_multi_thread);
+  m.impl("normal_multi_thread_with_extra", &lazydp_ops::normal_multi_thread_with_extra);
+  m.impl("normal_philox", &lazydp_ops::normal_philox);
+  m.impl("normal_philox_with_extra", &lazydp_ops::normal_philox_with_extra);
+  m.impl("unique_multi_thread", &lazydp_ops::unique_multi_thread);
+  m.impl("coalesce_multi_thread_openmp", &lazydp_ops::coalesce_multi_thread_openmp);
+  m.impl("coalesce_multi_thread_embeddingbag", &lazydp_ops::coalesce_multi_thread_embeddingbag);
+  m.impl("coalesce_radix", &lazydp_ops::coalesce_radix);
+  m.impl("coalesce_radix_with_noise", &lazydp_ops::coalesce_radix_with_noise);
+  m.impl("coalesce_with_inverse", &lazydp_ops::coalesce_with_inverse);
+  m.impl("coalesce_hash", &lazydp_ops::coalesce_hash);
+  m.impl("coalesce_dense", &lazydp_ops::coalesce_dense);
+  m.impl("coalesce_multi_table", &lazydp_ops::coalesce_multi_table);
+}
+
+TORCH_LIBRARY_IMPL(lazydp, Meta, m) {
+  m.impl("normal_multi_thread", &lazydp_ops::normal_meta);
+  m.impl("normal_multi_thread_with_extra", &lazydp_ops::normal_with_extra_meta);
+  m.impl("normal_philox", &lazydp_ops::normal_philox_meta);
+  m.impl("normal_philox_with_extra", &lazydp_ops::normal_philox_with_extra_meta);
 }
 
 
 PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
-  m.def("normal_multi_thread", &normal_multi_thread, "This function samples the random variables that follow Gaussian distribution. It only supports the case whose mean is 0 and the standard devication is a fixed value. The output of this function is a 2D tensor whose shape is \"n_emb\"x\"dim\" and whose entries follow gaussain random variable of mean 0 and standard deviation \"std\".");
-  m.def("normal_multi_thread_with_extra", &normal_multi_thread_with_extra, "This function samples the random variables that follow Gaussian distribution. It allocates the larger memory space (the \"extra\") to store the gradients derived in backward propagation. Also, this function gets a 1D tensor, \"std\" as a input to generate Gaussian random variables with different stadard derivation in a row granularity");
-  m.def("unique_multi_thread", &unique_multi_thread, "This funciton does an exact same thing with torch.unique(), but using multiple threads.");
-  m.def("coalesce_multi_thread_openmp", &coalesce_multi_thread_openmp, "This funciton does an exact same things with torch.coalesce(), but using multiple threads. This function is implemented by C++ stadard library and OpenMP");
-  m.def("coalesce_multi_thread_embeddingbag", &coalesce_multi_thread_embeddingbag, "This funciton does an exact same things with torch.coalesce(), but using multiple threads. This function is implemented by C++ stadard library and \"torch::_embedding_bag_forward_only\"");
+  m.def("init_pool", &init_pool, "This function initializes the persistent worker pool used by all functions of this module: the number of threads, the cores each thread is pinned to (\"cpu_list\", no pinning if empty), and per-thread random number generators kept alive across calls. Once called, \"n_cores\" given to each function is ignored");
+  m.def("seed_generators", &seed_generators, "This function seeds rand() and the per-thread random number generators of the worker pool (and the ones init_pool creates afterwards) from \"seed\", so that the torch-generator noise replays for the same number of threads");
+  m.def("init_tbb_arena", &init_tbb_arena, "This function limits the TBB threads of the parallel STL calls of this module (std::execution::par_unseq: sorts, scans, for_each) to \"n_threads\", run in a dedicated arena whose workers are pinned to \"cpu_list\" (no pinning if empty)");
+  m.def("pin_torch_threads", &pin_torch_threads, "This function sets the number of the intra-op threads of PyTorch to the size of \"cpu_list\" and pins them to its cores (the calling thread keeps its affinity)");
+  m.def("numa_nodes", &numa_nodes, "This function returns the NUMA node of the core of each thread of the pool (empty if the pool is not pinned)");
+  m.def("numa_home_rows", &numa_home_rows, "This function binds the row ranges [row_ends[r - 1], row_ends[r]) of a CPU tensor to NUMA node nodes[r] (pages already touched are migrated) and records the layout, so that the lookups, the fused delayed noise update and the sparse SGD update of its rows run on the threads of the node homing them", py::call_guard<py::gil_scoped_release>());
+  m.def("numa_forget_rows", &numa_forget_rows, "This function drops the layout recorded by numa_home_rows for a tensor (e.g., before it is freed)", py::call_guard<py::gil_scoped_release>());
+  m.def("numa_replicate", &numa_replicate, "This function copies a CPU tensor onto every NUMA node of the pinned pool (mbind) and records the replicas, from which the lookups of embedding_bag_multi_table (and the alias tables, AliasSampler.replicate) read the copy of the node of the calling thread. The tensor stays the copy which is written. Returns the number of replicas", py::call_guard<py::gil_scoped_release>());
+  m.def("numa_sync_replicas", &numa_sync_replicas, "This function copies the replicated tensors into their replicas (numa_replicate), each replica by the threads of its node", py::call_guard<py::gil_scoped_release>());
+  m.def("numa_forget_replicas", &numa_forget_replicas, "This function drops the replicas of a tensor (numa_replicate)", py::call_guard<py::gil_scoped_release>());
+  m.def("normal_multi_thread", &normal_multi_thread, "This function samples the random variables that follow Gaussian distribution. It only supports the case whose mean is 0 and the standard devication is a fixed value. The output of this function is a 2D tensor whose shape is \"n_emb\"x\"dim\" and whose entries follow gaussain random variable of mean 0 and standard deviation \"std\".", py::call_guard<py::gil_scoped_release>());
+  m.def("normal_multi_thread_with_extra", &normal_multi_thread_with_extra, "This function samples the random variables that follow Gaussian distribution. It allocates the larger memory space (the \"extra\") to store the gradients derived in backward propagation. Also, this function gets a 1D tensor, \"std\" as a input to generate Gaussian random variables with different stadard derivation in a row granularity", py::call_guard<py::gil_scoped_release>());
+  m.def("normal_philox", &normal_philox, "This function does an exact same thing with \"normal_multi_thread\", but uses a vectorized counter-based generator (Philox4x32-10 and Box-Muller transform). Each row is keyed by (\"seed\", \"table\", row, \"iteration\"), so the output does not depend on the number of threads.", py::call_guard<py::gil_scoped_release>());
+  m.def("normal_philox_with_extra", &normal_philox_with_extra, "This function does an exact same thing with \"normal_multi_thread_with_extra\", but uses a vectorized counter-based generator (Philox4x32-10 and Box-Muller transform). Each row is keyed by (\"seed\", \"table\", \"indices\"[row], \"iteration\"), so the output does not depend on the number of threads.", py::call_guard<py::gil_scoped_release>());
+  m.def("normal_secure", &normal_secure, "This function does the same thing with \"normal_philox\" for the secure mode: each element is the sum of 4 Gaussian samples divided by 2 (robust to the floating-point attacks, https://arxiv.org/abs/2107.10138), sampled in a single pass. Philox is keyed by the 64-bit \"seed\" (which must be drawn from a secure generator) with the counter (column, row, \"table\", \"iteration\")", py::call_guard<py::gil_scoped_release>());
+  m.def("normal_secure_with_extra", &normal_secure_with_extra, "This function does the same thing with \"normal_philox_with_extra\" with the secure noise of \"normal_secure\", each row keyed by \"indices\"[row]", py::call_guard<py::gil_scoped_release>());
+  m.def("normal_pool_with_extra", &normal_pool_with_extra, "This function approximates \"normal_philox_with_extra\" by reading each block of 16 elements of a row from a pre-sampled Gaussian \"pool\" (fp32, power-of-2 size) at an offset hashed from (\"seed\", \"table\", \"indices\"[row], \"iteration\", block), scaled by \"std\". The samples overlap and repeat, so it is NOT a secure (or independent) sampler and is only meant for measuring the cost of the update without the RNG", py::call_guard<py::gil_scoped_release>());
+  m.def("init_table", &init_table, "This function creates the initial weights of an embedding table (\"n_rows\"x\"dim\"), uniform in [\"a\", \"b\") or Gaussian of mean \"a\" and standard deviation \"b\" when \"normal\" is true, filled in parallel by the counter-based generator keyed by (\"seed\", \"table\", row). Each page is first touched by the thread which fills it, so it is placed on the NUMA node of that thread (or the node given by numactl --membind)", py::call_guard<py::gil_scoped_release>());
+  m.def("unique_multi_thread", &unique_multi_thread, "This funciton does an exact same thing with torch.unique(), but using multiple threads.", py::call_guard<py::gil_scoped_release>());
+  m.def("unique_bitmap", &unique_bitmap, "This function returns the sorted unique indices of \"input\" (indices in [0, \"n_embs\")) without sorting, by setting them in a bitmap of the table and writing its set bits in order", py::call_guard<py::gil_scoped_release>());
+  m.def("unique_auto", &unique_auto, "This function is unique_bitmap for tables of at most 8M rows, and unique_multi_thread otherwise", py::call_guard<py::gil_scoped_release>());
+  m.def("coalesce_multi_thread_openmp", &coalesce_multi_thread_openmp, "This funciton does an exact same things with torch.coalesce(), but using multiple threads. This function is implemented by C++ stadard library and OpenMP", py::call_guard<py::gil_scoped_release>());
+  m.def("coalesce_multi_thread_embeddingbag", &coalesce_multi_thread_embeddingbag, "This funciton does an exact same things with torch.coalesce(), but using multiple threads. This function is implemented by C++ stadard library and \"torch::_embedding_bag_forward_only\"", py::call_guard<py::gil_scoped_release>());
+  m.def("coalesce_radix", &coalesce_radix, "This funciton does an exact same things with torch.coalesce(), but using multiple threads. This function sorts the indices by parallel LSD radix sort which only processes the bits required by the number of embeddings", py::call_guard<py::gil_scoped_release>());
+  m.def("coalesce_radix_with_noise", &coalesce_radix_with_noise, "This function coalesces a sparse gradient as coalesce_radix, with the Gaussian noise of EANA (std, Philox keyed by (seed, table, row, iteration)) sampled into each coalesced row in the same pass", py::call_guard<py::gil_scoped_release>());
+  m.def("unique_with_inverse_and_counts", &unique_with_inverse_and_counts, "This function does the same thing with torch.unique(sorted=True, return_inverse=True, return_counts=True) using a single parallel radix sort of the input", py::call_guard<py::gil_scoped_release>());
+  m.def("sort_plan", &sort_plan, "This function returns (unique indices, stable sort permutation, segment offsets of each unique index in the permutation) of the indices of a table, with the radix sort of unique_with_inverse_and_counts", py::call_guard<py::gil_scoped_release>());
+  m.def("coalesce_with_sort_plan", &coalesce_with_sort_plan, "This function does the same thing with torch.coalesce(), but reduces the values along the sort plan (sort_plan) of the gradient indices, so that indices are not sorted again", py::call_guard<py::gil_scoped_release>());
+  m.def("coalesce_with_inverse", &coalesce_with_inverse, "This function does the same thing with torch.coalesce(), but reuses the unique indices, inverse mapping and counts of the gradient indices derived by unique_with_inverse_and_counts, so that indices are not sorted again", py::call_guard<py::gil_scoped_release>());
+  m.def("coalesce_hash", &coalesce_hash, "This funciton does the same thing with torch.coalesce(), but using multiple threads without sorting the whole indices. Each thread owns the indices of a hash partition and aggregates their values via an open-addressing hash map. When \"sorted\" is false, the unique indices are emitted in an arbitrary order (only for consumers which do not depend on the order such as the optimizer step)", py::call_guard<py::gil_scoped_release>());
+  m.def("coalesce_dense", &coalesce_dense, "This function does the same thing with torch.coalesce() without sorting, for tables which are small compared with the gradient: the touched rows are marked in a bitmap of the table, and each row is scatter-added into its rank among the touched rows (popcount prefix sums)", py::call_guard<py::gil_scoped_release>());
+  m.def("coalesce_auto", &coalesce_auto, "This function coalesces with coalesce_dense when the table has at most 64 rows per gradient row, and with coalesce_radix otherwise", py::call_guard<py::gil_scoped_release>());
+  m.def("coalesce_rows", &coalesce_rows, "This function coalesces the raw gradient of a table of \"n_embs\" rows given as its indices and values (the row-sparse form, without a COO tensor) as coalesce_auto does, and returns the sorted unique rows (1-D) and their values", py::call_guard<py::gil_scoped_release>());
+  m.def("normal_reduced_precision", &normal_reduced_precision, "This function does the same thing with normal_multi_thread_with_extra (without the extra), but emits the noise in reduced precision, bf16 (\"bf16\" is true) or fp16, to halve the size of the noise staging buffer. Philox keyed by \"indices\" is used when \"seed\" >= 0", py::call_guard<py::gil_scoped_release>());
+  m.def("delayed_noise_with_extra", &delayed_noise_with_extra, "This function fuses the delayed noise derivation of LazyDP: it reads the HT (\"HT\", int32) for \"indices\" and samples Gaussian noise of standard deviation sqrt(cnt_iter - HT[index]) * \"scale\" for each row, without materializing the standard deviations. Same as normal_multi_thread_with_extra (normal_philox_with_extra with cnt_iter as the iteration when \"seed\" >= 0) otherwise", py::call_guard<py::gil_scoped_release>());
+  m.def("delayed_noise_grouped_with_extra", &delayed_noise_grouped_with_extra, "This function does the same thing with delayed_noise_with_extra (with the torch generators), but reorders the rows of \"indices\" by their delay so that each delay shared by at least \"min_group_rows\" rows is filled by scalar-std Gaussian fills without the per-row multiply. It returns the reordered rows (the order of the noise rows), the noise and the histogram of the delays", py::call_guard<py::gil_scoped_release>());
+  m.def("settle_delayed_noise", &settle_delayed_noise, "This function applies the delayed noise of LazyDP to rows [\"row_start\", \"row_end\") of \"weight\" whose delay (\"cnt_iter\" - \"HT\"[row]) is at least \"min_delay\", i.e., weight[row] -= lr * noise of standard deviation sqrt(delay) * \"scale\", and sets their HT to \"cnt_iter\". Rows are streamed in small chunks without a table-sized temporary. The GIL is released, so it can run in a background thread", py::call_guard<py::gil_scoped_release>());
+  m.def("sharded_delayed_noise_sgd_update", &sharded_delayed_noise_sgd_update, "This function does the delayed noise SGD update of LazyDP for all tables at once, with the rows of each table split into shards of at most \"shard_rows\" rows which run in parallel: each shard derives the delayed noise of its rows in \"noise_indices\" from its slice of the HT, adds the gradient rows bucketed to it, updates its rows of the table and sets their HT to \"cnt_iter\"", py::call_guard<py::gil_scoped_release>());
+  m.def("bag_norm_factors", &bag_norm_factors, "This function computes, for each bag of a sum-pooled EmbeddingBag (\"indices\", \"offsets\"), the factor sqrt(sum_k c_k^2) where c_k is the multiplicity of the k-th distinct index in the bag (the sum of its per-sample \"weights\" if not empty), so that the exact per-sample gradient norm is the norm of the bag's backprop times this factor even when a bag has duplicate indices", py::call_guard<py::gil_scoped_release>());
+  m.def("coalesce_bag_gradient", &coalesce_bag_gradient, "This function derives the clipped and coalesced gradient of a sum-pooled EmbeddingBag (\"n_embs\" rows) from its per-bag per-sample gradients: the gradient of bag b is \"backprops\"[b] for each of its indices (\"indices\", \"offsets\"), so every row gets the sum of \"clip\"[b] * \"backprops\"[b] (times the per-sample \"weights\" of the occurrences if not empty) over its occurrences, without materializing a row per index", py::call_guard<py::gil_scoped_release>());
+  m.def("merge_noise_and_grad", &merge_noise_and_grad, "This function merges the delayed noise of the sorted unique indices (\"noise_indices\", \"noise\") with the raw (uncoalesced) sparse gradient, and returns a coalesced sparse tensor directly without building the concatenated COO tensor. The noise can be fp32, bf16 or fp16 (upcasted on the fly)", py::call_guard<py::gil_scoped_release>());
+  m.def("merge_noise_and_grad_rows", &merge_noise_and_grad_rows, "This function does the same thing with merge_noise_and_grad for the raw gradient given as its indices and values (sorted again only if \"grad_is_coalesced\" is false) of a table of \"n_embs\" rows, and returns the sorted unique rows (1-D) and their values instead of a sparse tensor", py::call_guard<py::gil_scoped_release>());
+  m.def("normal_multi_table_with_extra", &normal_multi_table_with_extra, "This function does the same thing with normal_multi_thread_with_extra (or normal_philox_with_extra when \"seed\" >= 0) for a list of tables with a single thread team. Rows of all tables are distributed to threads in chunks", py::call_guard<py::gil_scoped_release>());
+  m.def("unique_multi_table", &unique_multi_table, "This function does the same thing with unique_multi_thread for a list of tables with a single thread team. Each table is a work item, and larger tables are scheduled first", py::call_guard<py::gil_scoped_release>());
+  m.def("coalesce_multi_table", &coalesce_multi_table, "This function does the same thing with torch.coalesce() for a list of sparse tensors with a single thread team. Coalesced rows of all tables are distributed to threads in chunks", py::call_guard<py::gil_scoped_release>());
+  m.def("sparse_rowwise_adagrad_update", &sparse_rowwise_adagrad_update, "Row-wise sparse Adagrad (dlrm/optim/rwsadagrad.py) over the unique rows \"indices\" and their gradients \"values\", with the accumulator \"momentum\" (one float per row of \"weight\"). In a single pass per row (parallelized across rows), it adds the Gaussian noise of standard deviation \"std\" (per row, no noise if empty), updates the accumulator by the mean square of the noisy gradient and applies \"weight[row] -= lr * g / (sqrt(momentum[row]) + eps)\" in-place. When \"seed\" is not negative, the noise is sampled by the counter-based generator keyed by (\"seed\", \"table\", row, \"iteration\")", py::call_guard<py::gil_scoped_release>());
+  m.def("dense_noise_sgd_update", &dense_noise_sgd_update, "This function does the dense SGD update of DP-SGD on an fp32 table in-place, \"weight[row] -= lr * (noise + grad[row])\" for every row with the Gaussian noise of standard deviation \"std\" and the coalesced sparse gradient \"grad\", streaming the noise in chunks of rows instead of materializing a table-sized noise tensor. When \"seed\" is not negative, the noise is sampled by the counter-based generator keyed by (\"seed\", \"table\", row, \"iteration\")", py::call_guard<py::gil_scoped_release>());
+  m.def("fused_delayed_noise_sgd_update", &fused_delayed_noise_sgd_update, "This function fuses the delayed noise sampling, the gradient coalescing and the SGD update of LazyDP. For every row in the union of \"noise_indices\" (sorted and unique) and the indices of the uncoalesced sparse gradient \"grad\", it does \"weight[row] -= lr * (noise + sum of gradients)\" in-place, touching each row only once without materializing the noise and the coalesced gradient. The noise of each row follows Gaussian distribution of mean 0 and standard deviation \"std\", or just becomes \"std\" itself when \"constant_noise\" is true (for debugging). When \"seed\" is not negative, the noise is sampled by the counter-based generator of \"normal_philox_with_extra\" keyed by (\"seed\", \"table\", row, \"iteration\"). The table (and the gradient) can also be bf16 or fp16, or the table can be row-wise int8 (uint8 in the format of embedding_bag_byte_prepack, requantized with the range of each updated row), in which case the update is done in fp32 and each element is rounded once when stored back, stochastically (by the counter-based generator keyed by \"rounding_seed\") when \"rounding_seed\" is not negative, to the nearest otherwise", py::call_guard<py::gil_scoped_release>());
+  m.def("fused_delayed_noise_sgd_update_and_pool", &fused_delayed_noise_sgd_update_and_pool, "This function does the same thing with \"fused_delayed_noise_sgd_update\" for an fp32 table, and sum-pools the bags of the next batch (\"bag_indices\" and \"bag_offsets\" as torch.nn.EmbeddingBag, int64, all rows in \"noise_indices\") from the updated rows into \"pooled\" (fp32, a row per bag) while each row is still in the cache", py::call_guard<py::gil_scoped_release>());
+  m.def("multi_hot_indices", &multi_hot_indices, "This function generates the synthetic multi-hot sparse features of a batch for all tables at once: each bag of table t has \"pooling_factors\"[t] distinct (sorted) indices, uniform over the table of \"table_sizes\"[t] rows (Floyd's algorithm), in parallel over the bags with streams keyed by (\"seed\", table, example). Returns (lS_i, lS_o), int32 if \"int32_indices\". See AliasSampler for non-uniform distributions",
+        py::arg("table_sizes"), py::arg("pooling_factors"), py::arg("batch_size"), py::arg("seed"), py::arg("n_cores"), py::arg("int32_indices") = false, py::call_guard<py::gil_scoped_release>());
+  m.def("stream_triad_bandwidth", &stream_triad_bandwidth, "This function measures the achievable memory bandwidth (GB/s) with the STREAM triad over arrays of \"n_bytes\" in total (the best of a few repetitions), i.e., the roofline of the memory-bound update stages", py::call_guard<py::gil_scoped_release>());
+  m.def("analyze_trace", &analyze_trace, "This function analyzes the reuse of the rows in an access trace (TraceWriter) in a single pass per table: returns the number of unique rows of each table in each batch, (n_tables, n_batches), and the histogram of the delay (in iterations) since the previous touch of each unique row, (n_tables, \"max_delay\" + 2) with the first touches in bin 0 and the delays above \"max_delay\" in the last bin",
+        py::arg("path"), py::arg("max_delay"), py::arg("n_cores"), py::call_guard<py::gil_scoped_release>());
+  m.def("nvtx_built", &nvtx_built, "This function returns whether this module is built with LAZYDP_NVTX=1, i.e., whether the traced hot paths of this module are also NVTX ranges (of the names of their trace events)");
+  m.def("kernel_isa", &kernel_isa, "This function returns the instruction set of the hot kernels on this host: \"avx512f\", \"avx2\" or \"default\" when this module is built with LAZYDP_ISA=portable (the clone picked at load time), \"native\" when it is built for the build host");
+  m.def("itt_enable", &itt_enable, "This function enables (or disables) the ITT tasks (domain \"LazyDP\") of the traced hot paths of this module, named as their trace events, for the VTune analyses; it returns false (and does nothing) unless this module is built with LAZYDP_ITT=1");
+  m.def("trace_enable", &trace_enable, "This function enables (or disables) the native tracing of the hot paths of this module (rows processed, bytes moved and busy time of each thread)");
+  m.def("trace_clear", &trace_clear, "This function drops the events recorded by the native tracing");
+  m.def("trace_dump", &trace_dump, "This function writes the events recorded by the native tracing to \"path\" as Chrome trace / Perfetto JSON (one lane per thread, rows/bytes/GB/s as the args of each event). It must not run concurrently with the kernels");
+  m.def("workspace_empty", [](const std::vector<long int> &sizes, const torch::Tensor &like){ return workspace_empty("python", sizes, like.scalar_type()); }, "This function returns an uninitialized tensor of \"sizes\" (and the dtype of \"like\") from the workspace of per-iteration temporaries, whose buffers are reused once no tensor views them anymore, so that the steady state does not allocate");
+  m.def("workspace_release", &workspace_release, "This function frees the pooled buffers of the workspace (e.g., after training)", py::call_guard<py::gil_scoped_release>());
+  m.def("embedding_bag_multi_table", &embedding_bag_multi_table, "This function pools (sums) the rows of every table for each bag, given the indices and offsets (int64 or int32) of each table, into a single (B, n_tables * dim) tensor with the outputs of the tables side by side (the order of the concatenated embedding outputs), with all threads working over the bags of all tables", py::call_guard<py::gil_scoped_release>());
+  m.def("embedding_bag_rowwise_multi_table", &embedding_bag_rowwise_multi_table, "This function pools (sums) the rows of every table for each bag like embedding_bag_multi_table, from uint8 tables quantized row-wise to \"bits\" (8 or 4) in the layouts of embedding_bag_byte_prepack / embedding_bag_4bit_prepack, dequantizing the rows of \"dim\" elements as they are accumulated", py::call_guard<py::gil_scoped_release>());
+  m.def("bag_grad_multi_table", &bag_grad_multi_table, "This function derives the clipped and coalesced gradient of every embedding table from the backprops of its bags, the clipping factor of each example and the indices/offsets of the bags (the gradient of the clipped loss without the backward pass), bucketing the indices with the unique indices, inverse mapping and counts of each table if given (else sorting them), with a single thread team and one value buffer for all tables", py::call_guard<py::gil_scoped_release>());
+  m.def("bag_grad_multi_table_rows", &bag_grad_multi_table_rows, "This function does the same thing with bag_grad_multi_table, and returns the sorted unique rows (1-D) and their values of each table instead of sparse tensors", py::call_guard<py::gil_scoped_release>());
+  m.def("sparse_sgd_update", &sparse_sgd_update, "This function applies the SGD step of a coalesced sparse gradient (weight[indices[i]] -= lr * values[i], unique indices) in parallel over its rows, prefetching the weight rows a few rows ahead", py::call_guard<py::gil_scoped_release>());
+  m.def("sparse_sgd_update_multi_table", &sparse_sgd_update_multi_table, "This function is sparse_sgd_update for all tables (\"indices\" and \"values\" of the coalesced gradient of each table, and their \"lrs\") with a single thread team, the rows of the tables being scheduled longest-first in chunks", py::call_guard<py::gil_scoped_release>());
+  m.def("memory_stats", &memory_stats, "This function returns the memory held by this module per category (huge_pages, history_table, workspace, scratch, noise_producer) as {category: (current bytes, high-water bytes since memory_reset_peak())}");
+  m.def("memory_reset_peak", &memory_reset_peak, "This function resets the high-water mark of each memory category to its current bytes (e.g., at every iteration)");
+  m.def("huge_pages_like", &huge_pages_like, "This function returns a tensor of the same shape and dtype with \"src\" (a copy of it if \"copy\" is true, zeros otherwise) backed by huge pages: \"thp\" for transparent huge pages via madvise(MADV_HUGEPAGE), \"hugetlb\" for pre-reserved huge pages via mmap(MAP_HUGETLB) (falls back to \"thp\"), or \"none\"", py::call_guard<py::gil_scoped_release>());
+  m.def("prefault_tensors", &prefault_tensors, "This function touches every page of the CPU tensors in parallel (after madvise(MADV_WILLNEED)), writing back the byte it reads if \"write\" is true, locks them in memory (mlock) if \"lock\" is true, and returns the bytes locked", py::call_guard<py::gil_scoped_release>());
+  m.def("write_table_file", &write_table_file, "This function writes an embedding table (and its HT, int32 per row, if not empty) to \"path\" as a raw table file: a small header (rows, dim, dtype, HT offset) followed by the page-aligned rows", py::call_guard<py::gil_scoped_release>());
+  m.def("write_table_files", &write_table_files, "This function writes embedding tables to raw table files (without HT) as write_table_file, with the chunks of all files written in parallel by \"n_cores\" threads with O_DIRECT", py::call_guard<py::gil_scoped_release>());
+  m.def("read_table_files", &read_table_files, "This function reads raw table files written by write_table_files (the HT is not read) into new tensors, with the chunks of all files read in parallel by \"n_cores\" threads with O_DIRECT", py::call_guard<py::gil_scoped_release>());
+  m.def("map_table_file", &map_table_file, "This function maps a raw table file written by write_table_file via mmap and returns (weight, HT) as tensors viewing the mapping without reading or copying the table. With \"shared\" false, the mapping is copy-on-write and the file is left unchanged. HT is empty if the file has none", py::call_guard<py::gil_scoped_release>());
+  py::class_<HistoryTable>(m, "HistoryTable")
+    .def(py::init<const std::vector<long int> &, int, int, const std::string &, bool, bool>(), "History Table (HT) of LazyDP for all tables in a single allocation. \"n_rows\" is the number of rows of each table, and \"bits\" is the size of each counter (32, or 16/8 for delta counters relative to the base iteration of each block). \"huge_pages\" is the backing of the allocation (see huge_pages_like). With \"hot_set\" (32 bits), the rows of the last scatter_iter() of each table are kept in a bitmap, and their counters are only read and written when they leave it. With \"blocked\" (16/8 bits), each group of 64 rows holds its last iteration and a bitmap of its rows lagging behind it, and the counters are the lags of these rows",
+         py::arg("n_rows"), py::arg("bits"), py::arg("n_cores"), py::arg("huge_pages") = "none", py::arg("hot_set") = false, py::arg("blocked") = false)
+    .def("table", &HistoryTable::table, "Counters of a table as an int32 tensor (a view valid while the HistoryTable is alive with 32 bits, a copy otherwise)", py::call_guard<py::gil_scoped_release>())
+    .def("gather_delays", &HistoryTable::gather_delays, "For each table, cnt_iter - HT[table][indices], using a single thread team across tables", py::call_guard<py::gil_scoped_release>())
+    .def("gather_stds", &HistoryTable::gather_stds, "For each table, sqrt(cnt_iter - HT[table][indices]) * scale, i.e., the standard deviation of the delayed noise", py::call_guard<py::gil_scoped_release>())
+    .def("scatter_iter", &HistoryTable::scatter_iter, "For each table, HT[table][indices] = iter, using a single thread team across tables", py::call_guard<py::gil_scoped_release>())
+    .def("hot_set_sizes", &HistoryTable::hot_set_sizes, "Rows in the hot set of each table (\"hot_set\")")
+    .def("delayed_noise_with_extra", &HistoryTable::delayed_noise_with_extra, "Same as custom_api_cpp.delayed_noise_with_extra() for a table of this HT", py::call_guard<py::gil_scoped_release>())
+    .def("settle", &HistoryTable::settle, "Same as custom_api_cpp.settle_delayed_noise() for a table of this HT (the GIL is released)", py::call_guard<py::gil_scoped_release>())
+    .def("rebase", &HistoryTable::rebase, "With 16/8-bit counters, flushes the delayed noise of the blocks which overflowed in scatter_iter() into \"weights\" and moves their base iteration to \"cnt_iter\". It has to be called after every scatter_iter() with the same iteration", py::call_guard<py::gil_scoped_release>());
+  py::class_<NextIterationPrefetcher>(m, "NextIterationPrefetcher")
+    .def(py::init<int>(), "Background worker of LazyDP which derives the unique indices of the next iteration and the standard deviations of their delayed noise while the main thread runs forward/backward")
+    .def("submit", &NextIterationPrefetcher::submit, "Starts deriving the unique indices of \"lS_i_nxt\" and sqrt(cnt_iter - HT[unique]) * scale with the HT of each table as an int32 tensor", py::call_guard<py::gil_scoped_release>())
+    .def("submit_native", &NextIterationPrefetcher::submit_native, "Same as submit() with the HT held by custom_api_cpp.HistoryTable", py::call_guard<py::gil_scoped_release>())
+    .def("wait", &NextIterationPrefetcher::wait, "Waits for the submitted work and returns (unique indices, stds) of each table", py::call_guard<py::gil_scoped_release>());
+  py::class_<IterationGraph>(m, "IterationGraph")
+    .def(py::init<int>(), "TBB flow graph of the LazyDP update of fp32 tables, with per-table nodes (HT gather of the stds, fused noise/coalesce/SGD update, HT scatter) run with teams of \"n_cores\" threads, so that the stages of different tables overlap")
+    .def("submit", &IterationGraph::submit, "Starts the update of every table (same arguments as sharded_delayed_noise_sgd_update without \"shard_rows\"), after waiting for the previous submit, and returns", py::call_guard<py::gil_scoped_release>())
+    .def("wait", &IterationGraph::wait, "Waits for the update started by submit() (tables updated and HT set)", py::call_guard<py::gil_scoped_release>());
+  py::class_<LazyDPEmbeddingEngine>(m, "LazyDPEmbeddingEngine")
+    .def(py::init<const std::vector<torch::Tensor> &, const std::vector<torch::Tensor> &, float, bool, long int, int, int>(), "Holds the fp32 tables and their int32 HT (shared with the caller), the noise scale (sqrt(delay) * \"scale\", or delay * \"scale\" with \"constant_noise\"), the Philox key \"seed\" (< 0 for the torch generators), the current iteration and the number of cores")
+    .def("prepare_next", &LazyDPEmbeddingEngine::prepare_next, "Derives the unique rows (int64) of the sparse features of the next batch of each table, which take the delayed noise in the next step(), and returns them", py::call_guard<py::gil_scoped_release>())
+    .def("step", &LazyDPEmbeddingEngine::step, "Updates every table with the delayed noise of the rows of prepare_next() and its sparse gradient (weight[row] -= lr * (noise + grad)), sets their HT to the current iteration and advances it", py::call_guard<py::gil_scoped_release>())
+    .def("step_async", &LazyDPEmbeddingEngine::step_async, "Same as step() on a background thread, from the smallest table to the largest; the gradients must stay alive until wait()", py::call_guard<py::gil_scoped_release>())
+    .def("wait_table", &LazyDPEmbeddingEngine::wait_table, "Waits until the table of the index is updated by the last step_async()", py::call_guard<py::gil_scoped_release>())
+    .def("wait", &LazyDPEmbeddingEngine::wait, "Waits for the update of the last step_async()", py::call_guard<py::gil_scoped_release>())
+    .def("iteration", &LazyDPEmbeddingEngine::iteration, "The iteration of the next step()");
+  py::class_<VirtualTable>(m, "VirtualTable")
+    .def(py::init<long int, int, bool, float, float, long int, int>(), "Embedding table of the weights of init_table (same arguments without \"n_cores\") whose rows are initialized on first access, over a sparsely committed anonymous mapping")
+    .def("weight", &VirtualTable::weight, "The (\"n_rows\", \"dim\") fp32 weight viewing the mapping, whose rows are zero until materialized")
+    .def("materialize", &VirtualTable::materialize, "Initializes the rows of the index tensors not initialized yet and returns their number", py::call_guard<py::gil_scoped_release>())
+    .def("materialize_all", &VirtualTable::materialize_all, "Initializes every row not initialized yet and returns their number", py::call_guard<py::gil_scoped_release>())
+    .def("n_materialized", &VirtualTable::n_materialized, "The number of rows initialized so far");
+  py::class_<DynamicEmbeddingTable>(m, "DynamicEmbeddingTable")
+    .def(py::init<long int, int, float, float, long int, int>(), "Embedding table of up to \"capacity\" rows of dimension \"dim\" over an unbounded id space: a hash map from the ids to the rows of an arena, initialized as init_table (U[a, b)) keyed by the id, with the HT of LazyDP inline with each entry")
+    .def("weight", &DynamicEmbeddingTable::weight, "The (\"capacity\", \"dim\") fp32 arena of the rows")
+    .def("n_rows", &DynamicEmbeddingTable::n_rows, "The number of rows allocated so far")
+    .def("ids", &DynamicEmbeddingTable::ids, "The id of each allocated row (int64), -1 for the rows of evicted ids not reallocated yet")
+    .def("map", &DynamicEmbeddingTable::map, "Returns the rows of the ids, allocating and initializing the rows of new ids, without touching the HT", py::call_guard<py::gil_scoped_release>())
+    .def("prepare_next", &DynamicEmbeddingTable::prepare_next, "Returns (rows of the ids, unique rows) of the next batch in one probe per id, and sets the HT of the ids to \"cnt_iter\" after keeping their delays (delays())", py::call_guard<py::gil_scoped_release>())
+    .def("delays", &DynamicEmbeddingTable::delays, "The delays (int32) of the unique rows of the last prepare_next()")
+    .def("iteration", &DynamicEmbeddingTable::iteration, "The \"cnt_iter\" of the last prepare_next()")
+    .def("enable_eviction", &DynamicEmbeddingTable::enable_eviction, "Enables the TTL / LFU eviction of the ids, with their delayed noise settled before they are written to the cold tier file (or dropped)")
+    .def("evict_async", &DynamicEmbeddingTable::evict_async, "Starts the eviction of the next window of entries on a background thread, waited for by the next map() or prepare_next()")
+    .def("wait_eviction", &DynamicEmbeddingTable::wait_eviction, "Waits for the eviction in flight, if any", py::call_guard<py::gil_scoped_release>())
+    .def("eviction_stats", &DynamicEmbeddingTable::eviction_stats, "Returns the counters of the eviction (live rows, evicted ids, cold tier rows and bytes, restored rows, scanned entries)", py::call_guard<py::gil_scoped_release>());
+  py::class_<ColdRowStore>(m, "ColdRowStore")
+    .def(py::init<torch::Tensor, long int, bool>(), "Compressed cold tier of the fp32 table \"weight\" (anonymous memory) in blocks of \"block_rows\" rows, packed as bf16 or row-wise int8")
+    .def("compact_async", &ColdRowStore::compact_async, "Starts packing the blocks of the next \"scan_blocks\" whose rows were all last accessed (\"HT\") more than \"min_age\" iterations before \"cnt_iter\", and releasing their pages, on a background thread", py::call_guard<py::gil_scoped_release>())
+    .def("wait", &ColdRowStore::wait, "Waits for the compaction in flight, if any", py::call_guard<py::gil_scoped_release>())
+    .def("restore", &ColdRowStore::restore, "Unpacks the cold blocks of the rows of the index tensors and returns their number", py::call_guard<py::gil_scoped_release>())
+    .def("restore_all", &ColdRowStore::restore_all, "Unpacks every cold block and returns their number", py::call_guard<py::gil_scoped_release>())
+    .def("stats", &ColdRowStore::stats, "Returns the counters of the tier (cold blocks, blocks packed and restored, packed and released bytes)", py::call_guard<py::gil_scoped_release>());
+  py::class_<RowReadahead>(m, "RowReadahead")
+    .def(py::init<>(), "Background readahead of the rows of file-backed tables (map_table_file with \"shared\"), i.e., an out-of-core tier whose DRAM cache is the page cache")
+    .def("submit", &RowReadahead::submit, "Starts requesting (madvise(MADV_WILLNEED)) the pages holding \"indices\" of each table of \"weights\" in a background thread, after waiting for the previous submit", py::call_guard<py::gil_scoped_release>())
+    .def("wait", &RowReadahead::wait, "Waits for the submitted readahead", py::call_guard<py::gil_scoped_release>());
+  py::class_<LLCPrefetcher>(m, "LLCPrefetcher")
+    .def(py::init<long int>(), "Background prefetch of the rows of the next iteration into the last-level cache, within \"budget_bytes\"")
+    .def("submit", &LLCPrefetcher::submit, "Starts loading the rows \"indices\" (int64, unique) of each table of \"weights\" and their counters of \"HTs\" (int32, or an empty list) in a background thread, after stopping the previous submit", py::call_guard<py::gil_scoped_release>())
+    .def("stop", &LLCPrefetcher::stop, "Stops the submitted prefetch (e.g., when the update starts)", py::call_guard<py::gil_scoped_release>())
+    .def("stats", &LLCPrefetcher::stats, "Returns the numbers of rows requested and prefetched before stop() since the creation");
+  py::class_<NoiseProducer>(m, "NoiseProducer")
+    .def(py::init<int, bool, int>(), "Double-buffered producer of the delayed noise of LazyDP with \"n_slots\" reusable (pinned if \"pinned\") buffer slots")
+    .def("produce", &NoiseProducer::produce, "Starts sampling the noise of \"stds\" (same as normal_multi_table_with_extra) into the next buffer slot in a background thread", py::call_guard<py::gil_scoped_release>())
+    .def("consume", &NoiseProducer::consume, "Waits for the noise started by produce() and returns it", py::call_guard<py::gil_scoped_release>());
+  py::class_<AliasSampler>(m, "AliasSampler")
+    .def(py::init<const std::vector<torch::Tensor> &, int>(), "Builds the Walker/Vose alias table (float32 probability, uint32 alias) of the access distribution (pmf) of each table")
+    .def(py::init<const std::vector<torch::Tensor> &, const std::vector<torch::Tensor> &>(), "Takes the alias tables (float32 probability, uint32 alias as int32) of alias_tables() of a sampler built before, e.g., loaded from a cache. They are held, not copied, and may be shared by the tables")
+    .def("alias_tables", &AliasSampler::alias_tables, "Returns the (probability, alias) tensors of the alias table of each table")
+    .def("replicate", &AliasSampler::replicate, "Replicates the alias tables on every NUMA node of the pinned pool (numa_replicate), the samples of a thread being drawn from the copy of its node, and returns the number of nodes", py::call_guard<py::gil_scoped_release>())
+    .def("sample", &AliasSampler::sample, "Same as custom_api_cpp.multi_hot_indices(), with the indices drawn from the access distributions (duplicates in a bag are rejected), O(1) per sample",
+         py::arg("batch_size"), py::arg("pooling_factors"), py::arg("seed"), py::arg("n_cores"), py::arg("pinned") = false, py::arg("int32_indices") = false, py::call_guard<py::gil_scoped_release>());
+  py::class_<TraceWriter>(m, "TraceWriter")
+    .def(py::init<const std::string &, const std::vector<long int> &, const std::vector<long int> &, int, bool>(), "Writes a binary access trace of batches with \"pooling_factors\"[t] indices per bag of table t (zigzag delta varints per bag if \"compress\", raw int32/int64 per table otherwise)")
+    .def("append", &TraceWriter::append, "Appends the indices (lS_i) of a batch, encoding the tables in parallel", py::call_guard<py::gil_scoped_release>())
+    .def("close", &TraceWriter::close, "Writes the block offsets and the header (also done when the writer is freed)", py::call_guard<py::gil_scoped_release>());
+  py::class_<UniqueSetWriter>(m, "UniqueSetWriter")
+    .def(py::init<const std::string &, const std::vector<long int> &, const std::vector<long int> &, double, double>(), "Records the unique rows of each LazyDP update, their delays and their lookups (sorted delta varints) for tables of \"table_sizes\" rows of \"dims\", with the noise scale (std = sqrt(delay) * \"std_scale\") and \"lr\" of the run")
+    .def("append", &UniqueSetWriter::append, "Appends the unique rows (any order) and the delays of an iteration with the lookups (lS_i) of their batch, encoding the tables in parallel", py::call_guard<py::gil_scoped_release>())
+    .def("close", &UniqueSetWriter::close, "Writes the block offsets and the header (also done when the writer is freed)", py::call_guard<py::gil_scoped_release>());
+  py::class_<UniqueSetReader>(m, "UniqueSetReader")
+    .def(py::init<const std::string &>(), "Maps a recording written by custom_api_cpp.UniqueSetWriter (read-only)")
+    .def("n_iters", &UniqueSetReader::n_iters)
+    .def("std_scale", &UniqueSetReader::std_scale)
+    .def("lr", &UniqueSetReader::lr)
+    .def("table_sizes", &UniqueSetReader::table_sizes)
+    .def("dims", &UniqueSetReader::dims)
+    .def("read", &UniqueSetReader::read, "Decodes iteration \"k\" (tables in parallel) and returns (uniques, delays, lookups), int64, the uniques sorted", py::call_guard<py::gil_scoped_release>());
+  py::class_<PerfCounters>(m, "PerfCounters")
+    .def(py::init<const std::vector<std::string> &>(), "Opens the hardware performance counters \"names\" (cycles, instructions, llc_misses, dtlb_misses, mem_read_bytes, mem_write_bytes) of this process, dropping the ones that are not available")
+    .def("events", &PerfCounters::events, "The names of the opened counters, in the order of read()")
+    .def("read", &PerfCounters::read, "The cumulative counts (float64) of events() since the construction, scaled for multiplexing");
+  py::class_<EnergyCounters>(m, "EnergyCounters")
+    .def(py::init<>(), "Opens the RAPL zones (package and DRAM of each socket) and the NVML energy counters of the GPUs that can be read")
+    .def("domains", &EnergyCounters::domains, "The names of the opened counters (cpu_package<k>, dram<k>, gpu<k>), in the order of read()")
+    .def("read", &EnergyCounters::read, "The cumulative joules (float64) of domains() since the construction");
+  py::class_<TraceReader>(m, "TraceReader")
+    .def(py::init<const std::string &>(), "Maps a trace written by custom_api_cpp.TraceWriter (read-only)")
+    .def("n_batches", &TraceReader::n_batches)
+    .def("batch_size", &TraceReader::batch_size)
+    .def("table_sizes", &TraceReader::table_sizes)
+    .def("pooling_factors", &TraceReader::pooling_factors)
+    .def("read", &TraceReader::read, "Decodes batch \"k\" (tables in parallel) and returns (lS_i, lS_o), int64, with a readahead of the next batch", py::call_guard<py::gil_scoped_release>());
+  py::class_<CriteoBinReader>(m, "CriteoBinReader")
+    .def(py::init<const std::string &, int, long int, double, long int, bool, int>(), "Maps a Criteo binary dataset (data_loader_terabyte.numpy_to_binary) for batches of \"batch_size\" rows, or Poisson samples with \"sample_rate\" > 0, with int32 indices if \"int32_indices\"",
+         py::arg("path"), py::arg("batch_size"), py::arg("max_ind_range"), py::arg("sample_rate"), py::arg("seed"), py::arg("int32_indices"), py::arg("n_cores"))
+    .def("n_samples", &CriteoBinReader::n_samples)
+    .def("n_batches", &CriteoBinReader::n_batches)
+    .def("read", &CriteoBinReader::read, "Decodes batch \"k\" and returns (X, lS_o, lS_i split per table, T)", py::call_guard<py::gil_scoped_release>())
+    .def("submit", &CriteoBinReader::submit, "Starts decoding batch \"k\" in the background", py::call_guard<py::gil_scoped_release>())
+    .def("wait", &CriteoBinReader::wait, "Waits for the batch of submit() and returns it as read()", py::call_guard<py::gil_scoped_release>());
+  py::class_<CriteoBinStream>(m, "CriteoBinStream")
+    .def(py::init<const std::string &, int, long int, long int, long int, long int, bool, int>(), "Streams a Criteo binary dataset in chunks of \"chunk_rows\" rows (random chunk order per epoch, read ahead in the background) through a shuffle buffer of \"buffer_rows\" rows",
+         py::arg("path"), py::arg("batch_size"), py::arg("buffer_rows"), py::arg("chunk_rows"), py::arg("max_ind_range"), py::arg("seed"), py::arg("int32_indices"), py::arg("n_cores"))
+    .def("n_samples", &CriteoBinStream::n_samples)
+    .def("n_batches", &CriteoBinStream::n_batches)
+    .def("next", &CriteoBinStream::next, "Returns the next batch (X, lS_o, lS_i split per table, T) of random rows of the shuffle buffer", py::call_guard<py::gil_scoped_release>());
+  py::class_<BatchQueue>(m, "BatchQueue")
+    .def(py::init<const std::vector<long int> &, const std::vector<long int> &, int, AliasSampler *, long int, int, int, int, bool, bool>(), "Background producers of the sparse features (multi_hot_indices, or AliasSampler.sample if \"sampler\" is not None) of the next batches and of their unique indices (and sort plans if \"sort_plans\"), in a bounded ring of \"capacity\" batches (in pinned memory if \"pinned\"). \"sampler\" must outlive the queue",
+         py::arg("table_sizes"), py::arg("pooling_factors"), py::arg("batch_size"), py::arg("sampler"), py::arg("seed"), py::arg("capacity"), py::arg("n_producers"), py::arg("n_cores"), py::arg("pinned"), py::arg("sort_plans") = false, py::keep_alive<1, 5>())
+    .def("pop", &BatchQueue::pop, "Waits for the next batch and returns (lS_i, lS_o, unique indices of each table, (perm, starts) of the sort plan of each table, empty without \"sort_plans\")", py::call_guard<py::gil_scoped_release>());
+  py::class_<TensorFuture>(m, "TensorFuture")
+    .def("wait", &TensorFuture::wait, "Waits for the kernel launched by a *_async function and returns its outputs (a list of tensors)", py::call_guard<py::gil_scoped_release>())
+    .def("done", &TensorFuture::done, "Whether the kernel is done (wait() does not block)");
+  m.def("normal_multi_thread_with_extra_async", &normal_multi_thread_with_extra_async, "This function launches normal_multi_thread_with_extra on the inter-op thread pool and returns a TensorFuture", py::call_guard<py::gil_scoped_release>());
+  m.def("normal_philox_with_extra_async", &normal_philox_with_extra_async, "This function launches normal_philox_with_extra on the inter-op thread pool and returns a TensorFuture", py::call_guard<py::gil_scoped_release>());
+  m.def("unique_multi_thread_async", &unique_multi_thread_async, "This function launches unique_multi_thread on the inter-op thread pool and returns a TensorFuture", py::call_guard<py::gil_scoped_release>());
+  m.def("coalesce_async", &coalesce_async, "This function launches the coalescing of a sparse tensor by the kernel named \"kernel\" (baseline, multi_thread_openmp, multi_thread_embeddingbag, radix, hash, hash_unsorted, dense, auto) on the inter-op thread pool and returns a TensorFuture", py::call_guard<py::gil_scoped_release>());
+  m.def("preprocess_criteo", &preprocess_criteo, "This function preprocesses the raw Criteo logs \"paths\" (the days of Terabyte, or train.txt of Kaggle split into \"days\") into train_data.bin, val_data.bin and test_data.bin of \"out_dir\" (the format of CriteoBinReader) in parallel, with the categorical features (% max_ind_range if > 0) renumbered per table and the training rows of label 0 sub-sampled at \"sub_sample_rate\", and returns the number of distinct values of each table", py::call_guard<py::gil_scoped_release>());
 }
@@ -0,0 +1,620 @@
+#include <torch/extension.h>
+#include <ATen/cuda/CUDAContext.h>
+#include <cub/cub.cuh>
+#include <assert.h>
+#include <stdint.h>
+#include <algorithm>
+#include <cstring>
+#ifdef LAZYDP_NVTX
+#include <nvtx3/nvToolsExt.h>
+#endif
+
+// CUDA kernels of LazyDP for the gpu_only system (embedding tables and the HT in HBM): the gather of
+// the stds / the scatter of the iteration of the HT, the delayed noise written into the noise rows
+// of the sparse buffer, and a radix-sort coalesce of the sparse gradients. The noise uses the same
+// counter-based generator as custom_api.cpp (Philox4x32-10 keyed by (seed, table, row, iteration)),
+// so that a row gets the same noise on the CPU and on the GPU.
+
+const int THREADS_PER_BLOCK = 256;
+
+// NVTX range of an entry point (built with LAZYDP_NVTX=1, see custom_api.cpp scoped_trace), so that Nsight
+// Systems shows the launches of this module under the stages of LatencyMeter (--nvtx)
+struct scoped_nvtx{
+  scoped_nvtx(const char *name){
+#ifdef LAZYDP_NVTX
+    nvtxRangePushA(name);
+#endif
+  }
+
+  ~scoped_nvtx(){
+#ifdef LAZYDP_NVTX
+    nvtxRangePop();
+#endif
+  }
+};
+
+inline int n_blocks_of(long int n){
+  return (int)((n + THREADS_PER_BLOCK - 1) / THREADS_PER_BLOCK);
+}
+
+__device__ __forceinline__ void philox4x32_10(uint32_t (&c)[4], uint32_t k0, uint32_t k1){
+  for(int round = 0; round < 10; round++){
+    uint32_t rk0 = k0 + round * 0x9E3779B9;
+    uint32_t rk1 = k1 + round * 0xBB67AE85;
+    uint32_t hi0 = __umulhi(0xD2511F53, c[0]);
+    uint32_t lo0 = 0xD2511F53 * c[0];
+    uint32_t hi1 = __umulhi(0xCD9E8D57, c[2]);
+    uint32_t lo1 = 0xCD9E8D57 * c[2];
+    c[0] = hi1 ^ c[1] ^ rk0;
+    c[1] = lo1;
+    c[2] = hi0 ^ c[3] ^ rk1;
+    c[3] = lo0;
+  }
+}
+
+// 4 samples of N(0, s^2) from the counter "c" (Box-Muller of the 4 words, as custom_api.cpp)
+__device__ __forceinline__ void philox_normal4(uint32_t (&c)[4], uint32_t k0, uint32_t k1, float s, float (&z)[4]){
+  const float two_pi = 6.283185307179586f;
+  const float inv_2_24 = 1.0f / 16777216.0f;
+  philox4x32_10(c, k0, k1);
+  float u0 = ((c[0] >> 8) + 1.0f) * inv_2_24;
+  float u1 = (c[1] >> 8) * inv_2_24;
+  float u2 = ((c[2] >> 8) + 1.0f) * inv_2_24;
+  float u3 = (c[3] >> 8) * inv_2_24;
+  float r0 = s * sqrtf(-2.0f * logf(u0));
+  float r1 = s * sqrtf(-2.0f * logf(u2));
+  z[0] = r0 * cosf(two_pi * u1);
+  z[1] = r0 * sinf(two_pi * u1);
+  z[2] = r1 * cosf(two_pi * u3);
+  z[3] = r1 * sinf(two_pi * u3);
+}
+
+// one thread per (row, counter): 4 columns of N(0, std^2) of the row, same counters as philox_normal_row
+// std = sqrt(cnt_iter - HT[rows[i]]) * scale if HT is given, stds[i] otherwise
+__global__ void delayed_noise_rows(float *out, const long int *rows, const int *HT, const float *stds, long int n_emb, int dim, int cnt_iter, float scale, uint32_t seed, uint32_t table, uint32_t iteration){
+  int n_counters = (dim + 3) / 4;
+  long int t = blockIdx.x * (long int)blockDim.x + threadIdx.x;
+  if(t >= n_emb * n_counters){
+    return;
+  }
+  long int i = t / n_counters;
+  int counter = t % n_counters;
+  long int row = rows[i];
+  float s = HT != nullptr ? sqrtf((float)(cnt_iter - HT[row])) * scale : stds[i];
+
+  uint32_t c[4] = {(uint32_t)counter, (uint32_t)row, (uint32_t)(row >> 32), iteration};
+  float z[4];
+  philox_normal4(c, seed, table, s, z);
+
+  float *out_row = out + i * dim;
+  for(int j = 0; j < 4 && counter * 4 + j < dim; j++){
+    out_row[counter * 4 + j] = z[j];
+  }
+}
+
+__global__ void gather_stds_rows(float *stds, const int *HT, const long int *rows, long int n_emb, int cnt_iter, float scale){
+  long int i = blockIdx.x * (long int)blockDim.x + threadIdx.x;
+  if(i < n_emb){
+    stds[i] = sqrtf((float)(cnt_iter - HT[rows[i]])) * scale;
+  }
+}
+
+__global__ void scatter_iter_rows(int *HT, const long int *rows, long int n_emb, int iter){
+  long int i = blockIdx.x * (long int)blockDim.x + threadIdx.x;
+  if(i < n_emb){
+    HT[rows[i]] = iter;
+  }
+}
+
+// Multi-tensor DP-SGD update, one thread per counter (4 elements) of all tensors:
+// param[e] -= lr * (grad[e] + N(0, std^2)). "meta" holds (param, grad, numel, key) per tensor followed
+// by the n_tensors + 1 offsets of their counters; the noise is keyed by (seed, key, counter, iteration)
+__global__ void noise_sgd_multi_tensor(const long int *meta, int n_tensors, long int n_counters, float std, float lr, uint32_t seed, uint32_t iteration){
+  long int t = blockIdx.x * (long int)blockDim.x + threadIdx.x;
+  if(t >= n_counters){
+    return;
+  }
+  const long int *offsets = meta + 4 * n_tensors;
+  int lo = 0, hi = n_tensors - 1;
+  while(lo < hi){
+    int mid = (lo + hi + 1) / 2;
+    if(offsets[mid] <= t){
+      lo = mid;
+    }
+    else{
+      hi = mid - 1;
+    }
+  }
+  float *param = (float *)meta[4 * lo];
+  const float *grad = (const float *)meta[4 * lo + 1];
+  long int numel = meta[4 * lo + 2];
+  long int counter = t - offsets[lo];
+
+  uint32_t c[4] = {(uint32_t)counter, (uint32_t)(counter >> 32), 0, iteration};
+  float z[4];
+  philox_normal4(c, seed, (uint32_t)meta[4 * lo + 3], std, z);
+  for(int j = 0; j < 4 && counter * 4 + j < numel; j++){
+    long int e = counter * 4 + j;
+    param[e] -= lr * (grad[e] + z[j]);
+  }
+}
+
+// one thread per (unique row, column): sums the values of the run of the row in the sorted order
+__global__ void sum_runs(float *out, const float *values, const long int *positions, const int *run_offsets, const int *run_counts, long int n_unique, int dim){
+  long int t = blockIdx.x * (long int)blockDim.x + threadIdx.x;
+  if(t >= n_unique * dim){
+    return;
+  }
+  long int u = t / dim;
+  int col = t % dim;
+  int start = run_offsets[u];
+  float acc = 0;
+  for(int k = start; k < start + run_counts[u]; k++){
+    acc += values[positions[k] * dim + col];
+  }
+  out[t] = acc;
+}
+
+// single block: clip factors of the examples against the threshold clipbound[0], then the threshold of the
+// next iteration from the noisy count of unclipped examples (adaptive clipping, arXiv:1905.03871),
+// C *= exp(-lr * (frac - quantile)) within [min_clipbound, max_clipbound]; the noise of the count is keyed
+// by (seed, ADACLIP_KEY, 0, iteration), so the threshold never leaves the GPU
+const uint32_t ADACLIP_KEY = 0xADAC1100;
+
+__global__ void adaptive_clip_factor_block(float *factors, float *clipbound, const float *norms, long int batch_size, float quantile, float lr, float unclipped_num_std, float min_clipbound, float max_clipbound, uint32_t seed, uint32_t iteration){
+  typedef cub::BlockReduce<int, THREADS_PER_BLOCK> BlockReduce;
+  __shared__ typename BlockReduce::TempStorage temp;
+  float C = clipbound[0];
+  int unclipped = 0;
+  for(long int i = threadIdx.x; i < batch_size; i += THREADS_PER_BLOCK){
+    float factor = fminf(C / (norms[i] + 1e-6f), 1.0f);
+    factors[i] = factor;
+    unclipped += factor >= 1.0f;
+  }
+  int total = BlockReduce(temp).Sum(unclipped);
+  if(threadIdx.x == 0){
+    uint32_t c[4] = {0, 0, 0, iteration};
+    float z[4];
+    philox_normal4(c, seed, ADACLIP_KEY, unclipped_num_std, z);
+    float frac = (total + z[0]) / (float)batch_size;
+    clipbound[0] = fminf(fmaxf(C * expf(-lr * (frac - quantile)), min_clipbound), max_clipbound);
+  }
+}
+
+// one warp per example: ||a|| and ||g|| of its activation and backprop rows in the same pass, written as the
+// ghost norms of nn.Linear, ||a|| * ||g|| (weight) and ||g|| (bias)
+__global__ void linear_ghost_norms_rows(float *weight_norms, float *bias_norms, const float *a, const float *g, long int batch_size, int d_in, int d_out){
+  long int row = (blockIdx.x * (long int)blockDim.x + threadIdx.x) / 32;
+  int lane = threadIdx.x % 32;
+  if(row >= batch_size){
+    return;
+  }
+  float a_sq = 0, g_sq = 0;
+  for(int k = lane; k < d_in; k += 32){
+    float v = a[row * d_in + k];
+    a_sq += v * v;
+  }
+  for(int k = lane; k < d_out; k += 32){
+    float v = g[row * d_out + k];
+    g_sq += v * v;
+  }
+  for(int offset = 16; offset > 0; offset /= 2){
+    a_sq += __shfl_down_sync(0xffffffff, a_sq, offset);
+    g_sq += __shfl_down_sync(0xffffffff, g_sq, offset);
+  }
+  if(lane == 0){
+    float g_norm = sqrtf(g_sq);
+    weight_norms[row] = sqrtf(a_sq) * g_norm;
+    bias_norms[row] = g_norm;
+  }
+}
+
+// DLRM dot interaction, one block per example with its n features (B x d each, pointers in "features")
+// staged in shared memory: R[b] = [x[b], <T_i, T_j> for i < n, j < i + offset] (offset 1 with the
+// interactions of a feature with itself), the lower triangle packed in row-major order
+__device__ __forceinline__ int tril_pair(int i, int j, int offset){
+  return i * (i - 1 + 2 * offset) / 2 + j;
+}
+
+__global__ void dot_interaction_forward_rows(float *R, const long int *features, int n, int d, int offset, int row_width){
+  extern __shared__ float T[];
+  long int b = blockIdx.x;
+  for(int t = threadIdx.x; t < n * d; t += blockDim.x){
+    float v = ((const float *)features[t / d])[b * d + t % d];
+    T[t] = v;
+    if(t < d){
+      R[b * row_width + t] = v;
+    }
+  }
+  __syncthreads();
+  for(int t = threadIdx.x; t < n * n; t += blockDim.x){
+    int i = t / n, j = t % n;
+    if(j >= i + offset){
+      continue;
+    }
+    float acc = 0;
+    for(int k = 0; k < d; k++){
+      acc += T[i * d + k] * T[j * d + k];
+    }
+    R[b * row_width + d + tril_pair(i, j, offset)] = acc;
+  }
+}
+
+// gradients of the features (n x B x d) from the gradient of R: dT_i = sum_j g_ij T_j over the pairs of i
+// (2 g_ii T_i for the pair of a feature with itself), plus the gradient of the dense part for T_0
+__global__ void dot_interaction_backward_rows(float *grads, const float *grad_R, const long int *features, long int batch_size, int n, int d, int offset, int row_width){
+  extern __shared__ float T[];
+  long int b = blockIdx.x;
+  for(int t = threadIdx.x; t < n * d; t += blockDim.x){
+    T[t] = ((const float *)features[t / d])[b * d + t % d];
+  }
+  __syncthreads();
+  const float *g = grad_R + b * row_width + d;
+  for(int t = threadIdx.x; t < n * d; t += blockDim.x){
+    int i = t / d, k = t % d;
+    float acc = i == 0 ? grad_R[b * row_width + k] : 0;
+    for(int j = 0; j < n; j++){
+      if(j < i){
+        acc += g[tril_pair(i, j, offset)] * T[j * d + k];
+      }
+      else if(j > i){
+        acc += g[tril_pair(j, i, offset)] * T[j * d + k];
+      }
+      else if(offset){
+        acc += 2 * g[tril_pair(i, i, offset)] * T[i * d + k];
+      }
+    }
+    grads[(i * batch_size + b) * d + k] = acc;
+  }
+}
+
+void check_HT_and_indices(const torch::Tensor &HT, const torch::Tensor &indices){
+  assert(HT.is_cuda() && indices.is_cuda());
+  assert(HT.scalar_type() == torch::kInt32 && indices.scalar_type() == torch::kInt64);
+  assert(HT.is_contiguous() && indices.is_contiguous());
+}
+
+// stds of the delayed noise: sqrt(cnt_iter - HT[indices[j]]) * scale
+torch::Tensor gather_stds(const torch::Tensor &HT, const torch::Tensor &indices, int cnt_iter, float scale){
+  scoped_nvtx range("cuda/gather_stds");
+  check_HT_and_indices(HT, indices);
+  long int n_emb = indices.numel();
+  torch::Tensor stds = torch::empty({n_emb}, indices.options().dtype(torch::kFloat));
+  if(n_emb > 0){
+    gather_stds_rows<<<n_blocks_of(n_emb), THREADS_PER_BLOCK, 0, at::cuda::getCurrentCUDAStream()>>>(stds.data<float>(), HT.data<int>(), indices.data<long int>(), n_emb, cnt_iter, scale);
+  }
+  return stds;
+}
+
+// HT[indices[j]] = iter (indices are expected to be unique)
+void scatter_iter(torch::Tensor &HT, const torch::Tensor &indices, int iter){
+  scoped_nvtx range("cuda/scatter_iter");
+  check_HT_and_indices(HT, indices);
+  long int n_emb = indices.numel();
+  if(n_emb > 0){
+    scatter_iter_rows<<<n_blocks_of(n_emb), THREADS_PER_BLOCK, 0, at::cuda::getCurrentCUDAStream()>>>(HT.data<int>(), indices.data<long int>(), n_emb, iter);
+  }
+}
+
+torch::Tensor noise_rows_with_extra(const int *HT_ptr, const float *stds_ptr, const torch::Tensor &indices, int dim, int extra, int cnt_iter, float scale, long int seed, int table){
+  assert(indices.is_cuda() && indices.is_contiguous() && indices.scalar_type() == torch::kInt64);
+  assert(seed >= 0);
+  long int n_emb = indices.numel();
+  torch::Tensor output = torch::empty({n_emb + extra, dim}, indices.options().dtype(torch::kFloat));
+  long int n_threads = n_emb * ((dim + 3) / 4);
+  if(n_threads > 0){
+    delayed_noise_rows<<<n_blocks_of(n_threads), THREADS_PER_BLOCK, 0, at::cuda::getCurrentCUDAStream()>>>(output.data<float>(), indices.data<long int>(), HT_ptr, stds_ptr, n_emb, dim, cnt_iter, scale, (uint32_t)seed, (uint32_t)table, (uint32_t)cnt_iter);
+  }
+  return output;
+}
+
+// same as custom_api_cpp.delayed_noise_with_extra: the stds are derived in-register from the HT
+torch::Tensor delayed_noise_with_extra(const torch::Tensor &HT, const torch::Tensor &indices, int dim, int extra, int cnt_iter, float scale, long int seed, int table){
+  scoped_nvtx range("cuda/delayed_noise_with_extra");
+  check_HT_and_indices(HT, indices);
+  return noise_rows_with_extra(HT.data<int>(), nullptr, indices, dim, extra, cnt_iter, scale, seed, table);
+}
+
+// same as custom_api_cpp.normal_philox_with_extra: row j has the standard deviation std[j]
+torch::Tensor normal_philox_with_extra(const torch::Tensor &std, const torch::Tensor &indices, int dim, int extra, long int seed, int table, int iteration){
+  scoped_nvtx range("cuda/normal_philox_with_extra");
+  assert(std.is_cuda() && std.is_contiguous() && std.numel() == indices.numel());
+  return noise_rows_with_extra(nullptr, std.data<float>(), indices, dim, extra, iteration, 1.0f, seed, table);
+}
+
+// one thread per element: the secure noise of custom_api_cpp.normal_secure (sum of the 4 samples of one
+// Philox block divided by 2), keyed by the 64-bit seed with the counter (column, row, table, iteration)
+__global__ void secure_normal(float *out, long int n_emb, int dim, float std, uint64_t seed, uint32_t table, uint32_t iteration){
+  long int t = blockIdx.x * (long int)blockDim.x + threadIdx.x;
+  if(t >= n_emb * dim){
+    return;
+  }
+  uint32_t c[4] = {(uint32_t)(t % dim), (uint32_t)(t / dim), table, iteration};
+  float z[4];
+  philox_normal4(c, (uint32_t)seed, (uint32_t)(seed >> 32), std, z);
+  out[t] = 0.5f * (z[0] + z[1] + z[2] + z[3]);
+}
+
+torch::Tensor normal_secure(float std, long int n_emb, int dim, long int seed, int table, int iteration){
+  scoped_nvtx range("cuda/normal_secure");
+  assert(seed >= 0);
+  torch::Tensor output = torch::empty({n_emb, dim}, torch::TensorOptions().dtype(torch::kFloat).device(torch::kCUDA));
+  if(n_emb * dim > 0){
+    secure_normal<<<n_blocks_of(n_emb * dim), THREADS_PER_BLOCK, 0, at::cuda::getCurrentCUDAStream()>>>(output.data<float>(), n_emb, dim, std, seed, table, iteration);
+  }
+  return output;
+}
+
+// Coalesce of a sparse COO gradient (n_rows x dim, fp32): the indices are radix-sorted (cub, only the
+// bits of n_rows) with their positions, the runs of equal indices are encoded and their values summed
+torch::Tensor coalesce_radix(const torch::Tensor &sparse_grad){
+  scoped_nvtx range("cuda/coalesce_radix");
+  assert(sparse_grad.is_cuda());
+  torch::Tensor indices = sparse_grad._indices().view({-1}).contiguous();
+  torch::Tensor values = sparse_grad._values().contiguous();
+  assert(values.scalar_type() == torch::kFloat);
+  long int n_rows = sparse_grad.size(0);
+  int dim = sparse_grad.size(1);
+  int nnz = indices.numel();
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  auto long_options = indices.options();
+  auto int_options = indices.options().dtype(torch::kInt32);
+
+  int end_bit = 1;
+  while(end_bit < 64 && (1L << end_bit) < n_rows){
+    end_bit++;
+  }
+
+  torch::Tensor positions = torch::arange(nnz, long_options);
+  torch::Tensor sorted_indices = torch::empty_like(indices);
+  torch::Tensor sorted_positions = torch::empty_like(positions);
+  torch::Tensor unique = torch::empty_like(indices);
+  torch::Tensor run_counts = torch::empty({nnz}, int_options);
+  torch::Tensor run_offsets = torch::empty({nnz}, int_options);
+  torch::Tensor n_runs = torch::zeros({1}, int_options);
+  const long int *indices_ptr = indices.data<long int>();
+  long int *sorted_indices_ptr = sorted_indices.data<long int>();
+
+  // a single temporary storage for the three cub calls
+  size_t sort_bytes = 0, encode_bytes = 0, scan_bytes = 0;
+  cub::DeviceRadixSort::SortPairs(nullptr, sort_bytes, indices_ptr, sorted_indices_ptr, positions.data<long int>(), sorted_positions.data<long int>(), nnz, 0, end_bit, stream);
+  cub::DeviceRunLengthEncode::Encode(nullptr, encode_bytes, sorted_indices_ptr, unique.data<long int>(), run_counts.data<int>(), n_runs.data<int>(), nnz, stream);
+  cub::DeviceScan::ExclusiveSum(nullptr, scan_bytes, run_counts.data<int>(), run_offsets.data<int>(), nnz, stream);
+  size_t temp_bytes = std::max(sort_bytes, std::max(encode_bytes, scan_bytes));
+  torch::Tensor temp = torch::empty({(long int)temp_bytes}, indices.options().dtype(torch::kByte));
+
+  if(nnz > 0){
+    cub::DeviceRadixSort::SortPairs(temp.data_ptr(), sort_bytes, indices_ptr, sorted_indices_ptr, positions.data<long int>(), sorted_positions.data<long int>(), nnz, 0, end_bit, stream);
+    cub::DeviceRunLengthEncode::Encode(temp.data_ptr(), encode_bytes, sorted_indices_ptr, unique.data<long int>(), run_counts.data<int>(), n_runs.data<int>(), nnz, stream);
+  }
+  long int n_unique = n_runs.item<int>();
+  if(n_unique > 0){
+    cub::DeviceScan::ExclusiveSum(temp.data_ptr(), scan_bytes, run_counts.data<int>(), run_offsets.data<int>(), (int)n_unique, stream);
+  }
+
+  torch::Tensor out_values = torch::empty({n_unique, dim}, values.options());
+  if(n_unique > 0){
+    sum_runs<<<n_blocks_of(n_unique * dim), THREADS_PER_BLOCK, 0, stream>>>(out_values.data<float>(), values.data<float>(), sorted_positions.data<long int>(), run_offsets.data<int>(), run_counts.data<int>(), n_unique, dim);
+  }
+  torch::Tensor output = torch::sparse_coo_tensor(unique.narrow(0, 0, n_unique).view({1, -1}), out_values, {n_rows, dim});
+  output._coalesced_(true);
+  return output;
+}
+
+// DP-SGD update of the (fp32) MLP parameters in one launch: params[k] -= lr * (grads[k] + noise), the
+// noise of params[k] keyed by (seed, keys[k], element / 4, iteration). Only the metadata is copied
+void noise_sgd_update_multi_tensor(std::vector<torch::Tensor> &params, const std::vector<torch::Tensor> &grads, const std::vector<int> &keys, float std, float lr, long int seed, int iteration){
+  scoped_nvtx range("cuda/noise_sgd_update_multi_tensor");
+  int n_tensors = params.size();
+  assert(grads.size() == params.size() && keys.size() == params.size() && seed >= 0);
+  if(n_tensors == 0){
+    return;
+  }
+  torch::Tensor meta = torch::empty({5 * n_tensors + 1}, torch::TensorOptions().dtype(torch::kInt64).pinned_memory(true));
+  long int *meta_ptr = meta.data<long int>();
+  long int n_counters = 0;
+  for(int k = 0; k < n_tensors; k++){
+    assert(params[k].is_cuda() && params[k].is_contiguous() && params[k].scalar_type() == torch::kFloat);
+    assert(grads[k].is_cuda() && grads[k].is_contiguous() && grads[k].numel() == params[k].numel());
+    meta_ptr[4 * k] = (long int)params[k].data_ptr();
+    meta_ptr[4 * k + 1] = (long int)grads[k].data_ptr();
+    meta_ptr[4 * k + 2] = params[k].numel();
+    meta_ptr[4 * k + 3] = keys[k];
+    meta_ptr[4 * n_tensors + k] = n_counters;
+    n_counters += (params[k].numel() + 3) / 4;
+  }
+  meta_ptr[5 * n_tensors] = n_counters;
+  torch::Tensor meta_device = meta.to(params[0].device(), /*non_blocking=*/true);
+  if(n_counters > 0){
+    noise_sgd_multi_tensor<<<n_blocks_of(n_counters), THREADS_PER_BLOCK, 0, at::cuda::getCurrentCUDAStream()>>>(meta_device.data<long int>(), n_tensors, n_counters, std, lr, (uint32_t)seed, (uint32_t)iteration);
+  }
+}
+
+
+// clip factors min(clipbound / (norms + 1e-6), 1) of the ghost norms, with clipbound (a CUDA fp32 tensor of
+// one element) updated in place for the next iteration by the same launch (adaptive_clip_factor_block)
+torch::Tensor adaptive_clip_factor(const torch::Tensor &norms, torch::Tensor &clipbound, float quantile, float lr, float unclipped_num_std, float min_clipbound, float max_clipbound, long int seed, int iteration){
+  scoped_nvtx range("cuda/adaptive_clip_factor");
+  assert(norms.is_cuda() && norms.is_contiguous() && norms.scalar_type() == torch::kFloat);
+  assert(clipbound.is_cuda() && clipbound.numel() == 1 && clipbound.scalar_type() == torch::kFloat && seed >= 0);
+  long int batch_size = norms.numel();
+  torch::Tensor factors = torch::empty_like(norms);
+  if(batch_size > 0){
+    adaptive_clip_factor_block<<<1, THREADS_PER_BLOCK, 0, at::cuda::getCurrentCUDAStream()>>>(factors.data<float>(), clipbound.data<float>(), norms.data<float>(), batch_size, quantile, lr, unclipped_num_std, min_clipbound, max_clipbound, (uint32_t)seed, (uint32_t)iteration);
+  }
+  return factors;
+}
+
+// ghost norms of nn.Linear (opacus.layers.DPLinear) from its (B x d_in) activations and (B x d_out) backprops
+std::vector<torch::Tensor> linear_ghost_norms(const torch::Tensor &activations, const torch::Tensor &backprops){
+  scoped_nvtx range("cuda/linear_ghost_norms");
+  assert(activations.is_cuda() && activations.is_contiguous() && activations.scalar_type() == torch::kFloat && activations.dim() == 2);
+  assert(backprops.is_cuda() && backprops.is_contiguous() && backprops.scalar_type() == torch::kFloat && backprops.dim() == 2);
+  long int batch_size = activations.size(0);
+  assert(backprops.size(0) == batch_size);
+  torch::Tensor weight_norms = torch::empty({batch_size}, activations.options());
+  torch::Tensor bias_norms = torch::empty({batch_size}, activations.options());
+  if(batch_size > 0){
+    linear_ghost_norms_rows<<<n_blocks_of(batch_size * 32), THREADS_PER_BLOCK, 0, at::cuda::getCurrentCUDAStream()>>>(weight_norms.data<float>(), bias_norms.data<float>(), activations.data<float>(), backprops.data<float>(), batch_size, activations.size(1), backprops.size(1));
+  }
+  return {weight_norms, bias_norms};
+}
+
+// device array of the data pointers of the (CUDA fp32, contiguous, B x d) features of the dot interaction
+torch::Tensor interaction_features_meta(const std::vector<torch::Tensor> &features){
+  int n = features.size();
+  assert(n > 0);
+  torch::Tensor meta = torch::empty({n}, torch::TensorOptions().dtype(torch::kInt64).pinned_memory(true));
+  for(int i = 0; i < n; i++){
+    assert(features[i].is_cuda() && features[i].is_contiguous() && features[i].scalar_type() == torch::kFloat);
+    assert(features[i].sizes() == features[0].sizes() && features[i].dim() == 2);
+    meta.data<long int>()[i] = (long int)features[i].data_ptr();
+  }
+  return meta.to(features[0].device(), /*non_blocking=*/true);
+}
+
+// R = [x, packed lower triangle of T T^T] of DLRM's interact_features() ("dot"), features = [x] + ly
+torch::Tensor dot_interaction_forward(const std::vector<torch::Tensor> &features, bool itself){
+  scoped_nvtx range("cuda/dot_interaction_forward");
+  torch::Tensor meta = interaction_features_meta(features);
+  int n = features.size(), offset = itself ? 1 : 0;
+  long int batch_size = features[0].size(0);
+  int d = features[0].size(1), row_width = d + n * (n - 1 + 2 * offset) / 2;
+  torch::Tensor R = torch::empty({batch_size, row_width}, features[0].options());
+  if(batch_size > 0){
+    dot_interaction_forward_rows<<<batch_size, THREADS_PER_BLOCK, n * d * sizeof(float), at::cuda::getCurrentCUDAStream()>>>(R.data<float>(), meta.data<long int>(), n, d, offset, row_width);
+  }
+  return R;
+}
+
+// gradients (n x B x d) of the features of dot_interaction_forward() from the gradient of R
+torch::Tensor dot_interaction_backward(const torch::Tensor &grad_R, const std::vector<torch::Tensor> &features, bool itself){
+  scoped_nvtx range("cuda/dot_interaction_backward");
+  torch::Tensor meta = interaction_features_meta(features);
+  int n = features.size(), offset = itself ? 1 : 0;
+  long int batch_size = features[0].size(0);
+  int d = features[0].size(1), row_width = d + n * (n - 1 + 2 * offset) / 2;
+  assert(grad_R.is_cuda() && grad_R.is_contiguous() && grad_R.scalar_type() == torch::kFloat);
+  assert(grad_R.size(0) == batch_size && grad_R.size(1) == row_width);
+  torch::Tensor grads = torch::empty({n, batch_size, d}, features[0].options());
+  if(batch_size > 0){
+    dot_interaction_backward_rows<<<batch_size, THREADS_PER_BLOCK, n * d * sizeof(float), at::cuda::getCurrentCUDAStream()>>>(grads.data<float>(), grad_R.data<float>(), meta.data<long int>(), batch_size, n, d, offset, row_width);
+  }
+  return grads;
+}
+
+// Unified Memory tables (config.table_placement == "managed"): the table is allocated with cudaMallocManaged
+// and the CUDA paths of the tables in HBM access it directly, the driver migrating its pages on demand (HBM
+// can be oversubscribed). The whole range is mapped for the device (cudaMemAdviseSetAccessedBy), so that the
+// pages preferred in the CPU DRAM are read over PCIe instead of migrating back and forth. The rows are
+// managed by groups of "group_rows" rows: managed_prefetch() migrates the groups of the rows of the next
+// batch ahead of their use, managed_advise() sets the preferred location of each group
+void check_managed(const torch::Tensor &weight){
+  assert(weight.is_cuda() && weight.is_contiguous() && weight.dim() == 2);
+  cudaPointerAttributes attributes;
+  cudaError_t error = cudaPointerGetAttributes(&attributes, weight.data_ptr());
+  assert(error == cudaSuccess && attributes.type == cudaMemoryTypeManaged);
+  (void)error;
+}
+
+// byte range [begin, end) of the row groups [first, last] of "weight"
+inline void group_range(const torch::Tensor &weight, long int group_rows, long int first, long int last, long int &begin, long int &end){
+  long int row_bytes = weight.sizes()[1] * weight.element_size();
+  begin = first * group_rows * row_bytes;
+  end = std::min((last + 1) * group_rows, (long int)weight.sizes()[0]) * row_bytes;
+}
+
+// managed copy of the CPU tensor "src" (2-D) for "device", filled on the host so that its pages start in
+// the CPU DRAM (HBM may be smaller than the table) and move to the device by prefetch or on demand
+torch::Tensor managed_from(const torch::Tensor &src, int device){
+  scoped_nvtx range("cuda/managed_from");
+  assert(src.device().is_cpu() && src.is_contiguous() && src.dim() == 2);
+  int concurrent = 0;
+  cudaDeviceGetAttribute(&concurrent, cudaDevAttrConcurrentManagedAccess, device);
+  assert(concurrent && "the device does not support concurrent access to managed memory");
+  long int n_bytes = std::max<long int>(src.numel() * src.element_size(), 1);
+  void *ptr = nullptr;
+  C10_CUDA_CHECK(cudaMallocManaged(&ptr, n_bytes, cudaMemAttachGlobal));
+  C10_CUDA_CHECK(cudaMemAdvise(ptr, n_bytes, cudaMemAdviseSetAccessedBy, device));
+  std::memcpy(ptr, src.data_ptr(), src.numel() * src.element_size());
+  return torch::from_blob(ptr, src.sizes(), [](void *ptr){ cudaFree(ptr); }, src.options().device(torch::Device(torch::kCUDA, device)));
+}
+
+// migrates the row groups of "rows" (int64 CPU) of the managed "weight" to its device on the current stream,
+// the runs of consecutive groups by one cudaMemPrefetchAsync each. Returns the bytes prefetched
+long int managed_prefetch(const torch::Tensor &weight, const torch::Tensor &rows, long int group_rows){
+  scoped_nvtx range("cuda/managed_prefetch");
+  check_managed(weight);
+  assert(rows.device().is_cpu() && rows.is_contiguous() && rows.scalar_type() == torch::kInt64 && group_rows > 0);
+  long int n = rows.numel();
+  const long int *rows_ptr = rows.data<long int>();
+  std::vector<long int> groups(n);
+  for(long int j = 0; j < n; j++){
+    groups[j] = rows_ptr[j] / group_rows;
+  }
+  std::sort(groups.begin(), groups.end());
+  groups.erase(std::unique(groups.begin(), groups.end()), groups.end());
+  char *base = (char *)weight.data_ptr();
+  cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+  long int n_bytes = 0;
+  for(size_t j = 0; j < groups.size();){
+    size_t k = j + 1;
+    while(k < groups.size() && groups[k] == groups[k - 1] + 1){
+      k++;
+    }
+    long int begin, end;
+    group_range(weight, group_rows, groups[j], groups[k - 1], begin, end);
+    cudaMemPrefetchAsync(base + begin, end - begin, weight.get_device(), stream);
+    n_bytes += end - begin;
+    j = k;
+  }
+  return n_bytes;
+}
+
+// preferred location of the row groups of the managed "weight" whose flag in "hot" (bool CPU, a flag per
+// group) differs from "previous": its device for the hot groups, the CPU DRAM for the others. Returns the
+// number of groups changed
+long int managed_advise(const torch::Tensor &weight, const torch::Tensor &hot, const torch::Tensor &previous, long int group_rows){
+  scoped_nvtx range("cuda/managed_advise");
+  check_managed(weight);
+  long int n_groups = (weight.sizes()[0] + group_rows - 1) / group_rows;
+  assert(hot.device().is_cpu() && hot.scalar_type() == torch::kBool && hot.is_contiguous() && hot.numel() == n_groups);
+  assert(previous.device().is_cpu() && previous.scalar_type() == torch::kBool && previous.is_contiguous() && previous.numel() == n_groups);
+  const bool *hot_ptr = hot.data<bool>();
+  const bool *previous_ptr = previous.data<bool>();
+  char *base = (char *)weight.data_ptr();
+  long int n_changed = 0;
+  for(long int g = 0; g < n_groups;){
+    if(hot_ptr[g] == previous_ptr[g]){
+      g++;
+      continue;
+    }
+    long int last = g;
+    while(last + 1 < n_groups && hot_ptr[last + 1] == hot_ptr[g] && hot_ptr[last + 1] != previous_ptr[last + 1]){
+      last++;
+    }
+    long int begin, end;
+    group_range(weight, group_rows, g, last, begin, end);
+    cudaMemAdvise(base + begin, end - begin, cudaMemAdviseSetPreferredLocation, hot_ptr[g] ? weight.get_device() : cudaCpuDeviceId);
+    n_changed += last - g + 1;
+    g = last + 1;
+  }
+  return n_changed;
+}
+
+PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
+  m.def("gather_stds", &gather_stds, "This function does an exact same thing with ((cnt_iter - HT[indices])**(1/2))*scale for a CUDA HT (int32) and CUDA indices (int64)");
+  m.def("scatter_iter", &scatter_iter, "This function sets HT[indices] = iter for a CUDA HT (int32) and unique CUDA indices (int64)");
+  m.def("delayed_noise_with_extra", &delayed_noise_with_extra, "This function does an exact same thing with custom_api_cpp.delayed_noise_with_extra (Philox keyed by (\"seed\", \"table\", \"indices\"[row], \"cnt_iter\"), \"seed\" >= 0) on the GPU: the noise rows of the HT delays are followed by \"extra\" rows for the gradient");
+  m.def("normal_philox_with_extra", &normal_philox_with_extra, "This function does an exact same thing with custom_api_cpp.normal_philox_with_extra on the GPU");
+  m.def("noise_sgd_update_multi_tensor", &noise_sgd_update_multi_tensor, "This function does the DP-SGD update of CUDA fp32 parameters in one launch, params[k] -= lr * (grads[k] + noise) with the Gaussian noise of standard deviation \"std\" sampled in-register (Philox keyed by (\"seed\", \"keys\"[k], element / 4, \"iteration\"), \"seed\" >= 0)");
+  m.def("normal_secure", &normal_secure, "This function does an exact same thing with custom_api_cpp.normal_secure on the GPU");
+  m.def("adaptive_clip_factor", &adaptive_clip_factor, "This function does an exact same thing with (clipbound / (norms + 1e-6)).clamp(max=1.0) for CUDA fp32 ghost norms in a single launch, which also updates the CUDA threshold \"clipbound\" in place from the count of unclipped examples plus N(0, \"unclipped_num_std\"^2) noise (Philox keyed by (\"seed\", \"iteration\")): clipbound *= exp(-lr * (frac - quantile)), clamped to [min_clipbound, max_clipbound]");
+  m.def("linear_ghost_norms", &linear_ghost_norms, "This function does an exact same thing with [activations.norm(2, dim=-1) * backprops.norm(2, dim=-1), backprops.norm(2, dim=-1)] (the per-sample gradient norms of the weight and the bias of nn.Linear) for CUDA fp32 2-D tensors in a single launch");
+  m.def("dot_interaction_forward", &dot_interaction_forward, "This function does an exact same thing with the \"dot\" interact_features() of DLRM (torch.cat of the features, torch.bmm(T, T^T), the gather of the lower triangle and the torch.cat with x) for CUDA fp32 features [x] + ly of the same shape, in a single launch");
+  m.def("dot_interaction_backward", &dot_interaction_backward, "This function derives the gradients (n x B x d) of the features of dot_interaction_forward from the gradient of its output in a single launch");
+  m.def("managed_from", &managed_from, "This function copies a CPU tensor (2-D) into CUDA managed memory of \"device\" (cudaMallocManaged, filled on the host), mapped for the device (cudaMemAdviseSetAccessedBy), as a CUDA tensor");
+  m.def("managed_prefetch", &managed_prefetch, "This function prefetches the groups of \"group_rows\" rows of the CPU int64 \"rows\" of a managed table to its device (cudaMemPrefetchAsync on the current stream) and returns the bytes prefetched");
+  m.def("managed_advise", &managed_advise, "This function sets the preferred location of the groups of \"group_rows\" rows of a managed table whose flag in \"hot\" differs from \"previous\" (bool CPU, a flag per group): its device when hot, the CPU otherwise, and returns the number of groups changed");
+  m.def("coalesce_radix", &coalesce_radix, "This function does an exact same thing with torch.coalesce() for a CUDA sparse gradient (fp32), by a radix sort (cub) of the indices whose runs of equal indices are summed");
+}
@@ -2,13 +2,42 @@ from setuptools import setup, Extension
 from torch.utils import cpp_extension
 import os
 
+# LAZYDP_TBBMALLOC=1: the containers the kernels allocate per call and per thread come from tbbmalloc
+# (kernel_allocator in custom_api.cpp). For all allocations of the process, preload libtbbmalloc_proxy.so.2
+# instead (the "malloc" option of the bench scripts)
+tbbmalloc = os.environ.get('LAZYDP_TBBMALLOC', '0') == '1'
+# LAZYDP_NVTX=1: the traced hot paths of custom_api.cpp and the entry points of custom_api_cuda.cu are also
+# NVTX ranges (the header-only NVTX3 of the CUDA toolkit), for Nsight Systems with --nvtx
+nvtx = os.environ.get('LAZYDP_NVTX', '0') == '1'
+nvtx_args = ['-DLAZYDP_NVTX', '-I%s/include' %cpp_extension.CUDA_HOME] if nvtx else []
+# LAZYDP_ITT=1: the traced hot paths of custom_api.cpp are also ITT tasks while custom_api_cpp.itt_enable() is on
+# (--itt), for VTune. The ITT collector stub (ittnotify_static.c of the vendored TBB, whose own copy is prefixed
+# __TBB_) is built into the module and loads the collector of VTune at the first call
+itt = os.environ.get('LAZYDP_ITT', '0') == '1'
+itt_path = '%s/tbb/src/tbb/tools_api' %os.environ['PATH_LAZYDP']
+# LAZYDP_ISA=portable: the module is built for a baseline x86-64 (x86-64-v2) with AVX2 and AVX-512F clones of the
+# hot kernels picked at load time (ISA_CLONES in custom_api.cpp, custom_api_cpp.kernel_isa()), so one build runs
+# on every host of a mixed fleet. "native" (default) builds the whole module for the build host
+isa = os.environ.get('LAZYDP_ISA', 'native')
+assert isa in ['native', 'portable']
+isa_args = ['-march=x86-64-v2', '-DLAZYDP_ISA_CLONES'] if isa == 'portable' else ['-march=native']
+
+ext_modules = [cpp_extension.CppExtension(
+                                    name='custom_api_cpp',
+                                    sources=['custom_api.cpp'] + (['%s/ittnotify_static.c' %itt_path] if itt else []),
+                                    extra_compile_args=['-fopenmp', '-O3', '-std=c++17', '-I%s/tbb/include' %os.environ['PATH_LAZYDP']] + isa_args + (['-DLAZYDP_TBBMALLOC'] if tbbmalloc else []) + nvtx_args + (['-DLAZYDP_ITT', '-I%s' %itt_path] if itt else []),
+                                    extra_link_args=['-Wl,-rpath,%s/tbb/build/linux_intel64_gcc_cc9.4.0_libc2.27_kernel4.15.0_release' %os.environ['PATH_LAZYDP']],
+                                    library_dirs=['%s/tbb/build/linux_intel64_gcc_cc9.4.0_libc2.27_kernel4.15.0_release' %os.environ['PATH_LAZYDP']],
+                                    libraries=['tbb'] + (['tbbmalloc'] if tbbmalloc else []) + (['dl'] if nvtx or itt else [])
+            )]
+# kernels of the gpu_only system (HT, delayed noise and coalesce in HBM), built when CUDA is found
+if cpp_extension.CUDA_HOME is not None:
+    ext_modules.append(cpp_extension.CUDAExtension(
+                                    name='custom_api_cuda',
+                                    sources=['custom_api_cuda.cu'],
+                                    extra_compile_args={'cxx': ['-O3', '-std=c++17'] + nvtx_args, 'nvcc': ['-O3', '-std=c++17'] + nvtx_args}
+            ))
+
 setup(name='custom_api_cpp',
-      ext_modules=[cpp_extension.CppExtension(
-                                          name='custom_api_cpp',
-                                          sources=['custom_api.cpp'],
-                                          extra_compile_args=['-fopenmp', '-O3','-std=c++17', '-I%s/tbb/include' %os.environ['PATH_LAZYDP']],
-                                          extra_link_args=['-Wl,-rpath,%s/tbb/build/linux_intel64_gcc_cc9.4.0_libc2.27_kernel4.15.0_release' %os.environ['PATH_LAZYDP']],
-                                          library_dirs=['%s/tbb/build/linux_intel64_gcc_cc9.4.0_libc2.27_kernel4.15.0_release' %os.environ['PATH_LAZYDP']],
-                                          libraries=['tbb']
-                  )],
+      ext_modules=ext_modules,
       cmdclass={'build_ext': cpp_extension.BuildExtension})
@@ -42,10 +42,1417 @@
 # Update = BW_zero_grad + set_lS_i + Update_entire - 2nd backprop
 
 import torch
+import torch.nn.functional as F
 import time
 import pandas as pd
 import os.path
+import shutil
+import mmap
+import socket
+import copy
+import threading
+import queue
+import collections
+import json
+import resource
+import warnings
+import numpy as np
+from typing import List, NamedTuple
 import custom_api_cpp
+import config
+try:
+    import custom_api_cuda # custom-extension/custom_api_cuda.cu, kernels of the gpu_only system
+except ImportError:
+    custom_api_cuda = None
+
+def register_fake_lazydp_ops():
+    # fake kernel of torch.ops.lazydp.unique_multi_thread (custom_api_cpp TORCH_LIBRARY ops) for torch.compile,
+    # whose length depends on the data; the noise ops have Meta kernels in C++
+    if not hasattr(torch.library, "register_fake") or not hasattr(torch.ops.lazydp, "unique_multi_thread"):
+        return
+    @torch.library.register_fake("lazydp::unique_multi_thread")
+    def _(input):
+        return input.new_empty(torch.library.get_ctx().new_dynamic_size())
+
+register_fake_lazydp_ops()
+
+def coalesce_with(sparse_grad: torch.Tensor, kernel: str, nthreads: int):
+    if kernel == "baseline":
+        return sparse_grad.coalesce()
+    elif kernel == "multi_thread_openmp":
+        return custom_api_cpp.coalesce_multi_thread_openmp(sparse_grad, nthreads)
+    elif kernel == "multi_thread_embeddingbag":
+        return custom_api_cpp.coalesce_multi_thread_embeddingbag(sparse_grad, nthreads)
+    elif kernel == "radix":
+        return custom_api_cpp.coalesce_radix(sparse_grad, nthreads)
+    elif kernel == "hash":
+        return custom_api_cpp.coalesce_hash(sparse_grad, True, nthreads)
+    elif kernel == "hash_unsorted": # unique but unsorted indices
+        return custom_api_cpp.coalesce_hash(sparse_grad, False, nthreads)
+    elif kernel == "dense": # bitmap of the touched rows, no sort (tables not much larger than the gradient)
+        return custom_api_cpp.coalesce_dense(sparse_grad, nthreads)
+    elif kernel == "auto": # "dense" or "radix" by the rows of the table per gradient row
+        return custom_api_cpp.coalesce_auto(sparse_grad, nthreads)
+    else:
+        assert False
+
+def coalesce(sparse_grad: torch.Tensor, table: int = None):
+    # Coalesce the sparse gradient of an embedding table with the method chosen by "config.coalesce_optimize",
+    # or by "config.coalesce_tuner" for the "table"-th table if autotuning
+    if sparse_grad.is_coalesced():
+        return sparse_grad
+    if sparse_grad.is_cuda:
+        # tables in HBM (gpu_only system)
+        return custom_api_cuda.coalesce_radix(sparse_grad)
+    if config.coalesce_tuner is not None and table is not None:
+        return config.coalesce_tuner.coalesce(table, sparse_grad)
+    return coalesce_with(sparse_grad, config.coalesce_optimize, config.coalesce_nthreads)
+
+class RowSparseGrad(NamedTuple):
+    # Row-sparse gradient of an embedding table of "n_rows" rows (config.emb_grad_format == "rows"): the rows
+    # (1-D int64) and their values, i.e., indices()/values() of a sparse_coo_tensor without the (1, nnz) index
+    # dimension. The rows are sorted and unique if "coalesced" (the gradient of the backward is not)
+    rows: torch.Tensor
+    values: torch.Tensor
+    n_rows: int
+    coalesced: bool = True
+
+    @staticmethod
+    def of(sparse_grad: torch.Tensor):
+        # views of the indices/values of a sparse gradient, no copy
+        return RowSparseGrad(sparse_grad._indices().view(-1), sparse_grad._values(), sparse_grad.shape[0], sparse_grad.is_coalesced())
+
+    def to_sparse_coo(self):
+        return torch.sparse_coo_tensor(self.rows.view(1, -1), self.values, (self.n_rows, self.values.shape[1]))._coalesced_(self.coalesced)
+
+class JaggedSparse(NamedTuple):
+    # Sparse features of a batch packed as a jagged tensor (like a KeyedJaggedTensor): the indices of all tables
+    # in one 1-D "values" buffer, of which the indices of table t are values[table_offsets[t]:table_offsets[t + 1]],
+    # and the (n_tables, batch_size) offsets of the bags of each table into its own indices (lS_o). The generators
+    # (custom_api_cpp.multi_hot_indices, AliasSampler, BatchQueue, TraceReader) already write lS_i as views of
+    # one buffer, which pack() takes without a copy; stages which take lS_i get the views of tables()
+    values: torch.Tensor
+    table_offsets: List[int]
+    offsets: torch.Tensor
+
+    @staticmethod
+    def pack(lS_i, lS_o):
+        table_offsets = [0]
+        for lS_i_table in lS_i:
+            table_offsets.append(table_offsets[-1] + lS_i_table.numel())
+        first = lS_i[0] if len(lS_i) > 0 else None
+        if first is not None and all(lS_i_table.dim() == 1 and lS_i_table.is_contiguous() and lS_i_table.dtype == first.dtype
+                                     and lS_i_table.untyped_storage().data_ptr() == first.untyped_storage().data_ptr()
+                                     and lS_i_table.data_ptr() == first.data_ptr() + table_offsets[t] * first.element_size()
+                                     for t, lS_i_table in enumerate(lS_i)):
+            # consecutive views of one buffer
+            values = first.as_strided((table_offsets[-1],), (1,))
+        else:
+            values = torch.cat([lS_i_table.reshape(-1) for lS_i_table in lS_i]) if first is not None else torch.empty(0, dtype=torch.int64)
+        return JaggedSparse(values, table_offsets, lS_o)
+
+    def lengths(self):
+        return [self.table_offsets[t + 1] - self.table_offsets[t] for t in range(len(self.table_offsets) - 1)]
+
+    def tables(self):
+        # lS_i: the indices of each table, views of "values"
+        return list(self.values.split(self.lengths()))
+
+    def to(self, device=None, dtype=None, non_blocking=False):
+        # one copy (and conversion) of all the indices, and one of the offsets
+        return JaggedSparse(self.values.to(device=device, dtype=dtype, non_blocking=non_blocking), self.table_offsets,
+                            self.offsets.to(device=device, dtype=dtype, non_blocking=non_blocking))
+
+class CoalesceTuner:
+    # Chooses the coalesce kernel and its number of threads per table: during the first "warmup_iters"
+    # calls for a table, every (kernel, nthreads) candidate coalesces its gradient and is timed, then the
+    # fastest one is locked in. Choices are cached in the json file "cache_path" under "key"
+    # (model config, locality, ...), so that later runs with the same key skip the warmup.
+    def __init__(self, n_tables, kernels, nthreads_list, warmup_iters, key, cache_path):
+        self.candidates = [("baseline", 1)] if "baseline" in kernels else []
+        self.candidates += [(k, n) for k in kernels if k != "baseline" for n in nthreads_list]
+        assert len(self.candidates) > 0 and warmup_iters > 0
+        self.warmup_iters = warmup_iters
+        self.key = key
+        self.cache_path = cache_path
+        self.times = [[0.0] * len(self.candidates) for _ in range(n_tables)]
+        self.calls = [0] * n_tables
+        self.choices = [None] * n_tables
+        self.saved = False
+
+        if cache_path is not None and os.path.exists(cache_path):
+            with open(cache_path) as f:
+                cached = json.load(f).get(key)
+            if cached is not None and len(cached) == n_tables:
+                self.choices = [tuple(choice) for choice in cached]
+                self.saved = True
+
+    def coalesce(self, table: int, sparse_grad: torch.Tensor):
+        if self.choices[table] is not None:
+            kernel, nthreads = self.choices[table]
+            return coalesce_with(sparse_grad, kernel, nthreads)
+
+        output = None
+        for c, (kernel, nthreads) in enumerate(self.candidates):
+            start = time.perf_counter()
+            output = coalesce_with(sparse_grad, kernel, nthreads)
+            self.times[table][c] += time.perf_counter() - start
+        self.calls[table] += 1
+        if self.calls[table] == self.warmup_iters:
+            best = int(np.argmin(self.times[table]))
+            self.choices[table] = self.candidates[best]
+            if all(choice is not None for choice in self.choices):
+                self.save()
+        return output
+
+    def save(self):
+        if self.saved or self.cache_path is None:
+            return
+        cache = dict()
+        if os.path.exists(self.cache_path):
+            with open(self.cache_path) as f:
+                cache = json.load(f)
+        cache[self.key] = [list(choice) for choice in self.choices]
+        os.makedirs(os.path.dirname(os.path.abspath(self.cache_path)), exist_ok=True)
+        with open(self.cache_path, "w") as f:
+            json.dump(cache, f, indent=1)
+        self.saved = True
+
+    def summary(self):
+        return ["%d: %s" %(i, "(tuning)" if choice is None else "%s x%d" %choice) for i, choice in enumerate(self.choices)]
+
+def parse_cpu_list(cpu_list: str):
+    # "0-3,8,10-11" -> [0, 1, 2, 3, 8, 10, 11]
+    cpus = []
+    for token in cpu_list.split(","):
+        if "-" in token:
+            first, last = token.split("-")
+            cpus += list(range(int(first), int(last) + 1))
+        else:
+            cpus.append(int(token))
+    return cpus
+
+def local_cpu_list(cpu_list: str, local_rank: int, local_size: int):
+    # contiguous share of "cpu_list" of the "local_rank"-th of the "local_size" ranks of a host (e.g., one per GPU),
+    # as a cpu list; "cpu_list" itself (None included) for a single rank
+    if cpu_list is None or local_size <= 1:
+        return cpu_list
+    cpus = parse_cpu_list(cpu_list)
+    assert len(cpus) >= local_size, "fewer cores than ranks on the host"
+    return ",".join(str(cpu) for cpu in cpus[len(cpus) * local_rank // local_size:len(cpus) * (local_rank + 1) // local_size])
+
+def init_pool(cpu_list: str, tbb_cpu_list: str = None, torch_cpu_list: str = None):
+    # Pin the worker pool of custom_api_cpp to "cpu_list" (e.g., the cores of one NUMA node).
+    # The TBB threads of its parallel STL calls and the intra-op threads of PyTorch are pinned to their
+    # own core sets if given, so that the three pools do not oversubscribe the same cores
+    cpus = parse_cpu_list(cpu_list)
+    custom_api_cpp.init_pool(len(cpus), cpus)
+    if tbb_cpu_list is not None:
+        tbb_cpus = parse_cpu_list(tbb_cpu_list)
+        custom_api_cpp.init_tbb_arena(len(tbb_cpus), tbb_cpus)
+    if torch_cpu_list is not None:
+        custom_api_cpp.pin_torch_threads(parse_cpu_list(torch_cpu_list))
+
+class StreamedParameterWriter:
+    # Writes a list of tensors to "path" as raw bytes, with their shapes and dtypes in "path.json".
+    # A tensor can be written row chunk by row chunk (begin / write_rows / end).
+    def __init__(self, path):
+        self.path = path
+        self.file = open(path, "wb")
+        self.entries = []
+
+    def begin(self, shape, dtype):
+        self.entries.append({"shape": list(shape), "dtype": str(dtype).replace("torch.", ""), "offset": self.file.tell()})
+
+    def write_rows(self, rows: torch.Tensor):
+        self.file.write(rows.detach().contiguous().numpy().tobytes())
+
+    def end(self):
+        entry = self.entries[-1]
+        n_bytes = self.file.tell() - entry["offset"]
+        assert n_bytes == np.prod(entry["shape"]) * np.dtype(entry["dtype"]).itemsize
+
+    def write(self, tensor: torch.Tensor):
+        self.begin(tensor.shape, tensor.dtype)
+        self.write_rows(tensor)
+        self.end()
+
+    def close(self):
+        self.file.close()
+        with open(self.path + ".json", "w") as f:
+            json.dump(self.entries, f)
+
+def load_streamed_parameters(path):
+    # Inverse of StreamedParameterWriter: returns the list of tensors (memory-mapped)
+    with open(path + ".json") as f:
+        entries = json.load(f)
+    tensors = []
+    for entry in entries:
+        array = np.memmap(path, dtype=entry["dtype"], mode="r", offset=entry["offset"], shape=tuple(entry["shape"]))
+        tensors.append(torch.from_numpy(np.array(array)))
+    return tensors
+
+def huge_pages_like(tensor: torch.Tensor, copy: bool = True):
+    # "tensor" (or zeros like it) backed by huge pages as chosen by "config.huge_pages"; CPU tensors only
+    if config.huge_pages == "none" or tensor.device.type != "cpu":
+        return tensor.clone() if copy else torch.zeros_like(tensor)
+    return custom_api_cpp.huge_pages_like(tensor, config.huge_pages, copy)
+
+def move_emb_to_huge_pages(model):
+    # re-allocate the embedding tables of "model" with huge pages (config.huge_pages)
+    if config.huge_pages == "none":
+        return
+    for emb in model.emb_l:
+        if emb.weight.device.type == "cpu":
+            emb.weight = torch.nn.Parameter(huge_pages_like(emb.weight.data))
+
+def prefault_emb_tables(model, optimizer=None):
+    # touch the pages of the CPU embedding tables of "model", and of the HT and the optimizer state of
+    # "optimizer", in parallel before the first iteration (config.prefault_tables), locked with config.mlock_tables
+    if config.prefault_tables == "none":
+        return
+    model = getattr(model, "_module", model)
+    weights = [emb.weight for emb in model.emb_l if emb.weight.device.type == "cpu"]
+    tensors = [weight.data for weight in weights]
+    if optimizer is not None:
+        if getattr(optimizer, "HT", None) is not None:
+            tensors += [HT for HT in optimizer.HT if torch.is_tensor(HT) and HT.device.type == "cpu" and HT.dim() > 0]
+        state = getattr(optimizer, "original_optimizer", optimizer).state
+        for weight in weights:
+            tensors += [v for v in state.get(weight, dict()).values() if torch.is_tensor(v) and v.device.type == "cpu" and v.dim() > 0]
+    n_bytes = sum(tensor.numel() * tensor.element_size() for tensor in tensors)
+    start = time.time()
+    n_locked = custom_api_cpp.prefault_tensors(tensors, config.prefault_tables == "write", config.mlock_tables, torch.get_num_threads())
+    print(">> Prefaulted %.2f GB in %.1f s%s" % (n_bytes / 2**30, time.time() - start,
+          ", %.2f GB locked" % (n_locked / 2**30) if config.mlock_tables else ""), flush=True)
+
+def materialize_emb_rows(model, lS_i):
+    # initialize the rows of "lS_i" (one index tensor per table of emb_l) of the virtual tables of "model"
+    # (config.virtual_emb_tables) not accessed yet, and unpack those in the cold tier (config.cold_rows)
+    if not config.virtual_emb_tables and config.cold_rows == "none":
+        return
+    model = getattr(model, "_module", model)
+    for emb, lS_i_table in zip(model.emb_l, lS_i):
+        virtual_table = getattr(emb, "virtual_table", None)
+        if virtual_table is not None:
+            virtual_table.materialize([lS_i_table], config.emb_init_nthreads)
+        cold_store = getattr(emb, "cold_store", None)
+        if cold_store is not None:
+            cold_store.restore([lS_i_table], config.cold_rows_nthreads)
+
+def move_emb_to_cold_tier(model):
+    # (config.cold_rows) a compressed cold tier per table of "model" (custom_api_cpp.ColdRowStore), over the
+    # final weights of the tables
+    if config.cold_rows == "none":
+        return
+    model = getattr(model, "_module", model)
+    for emb in model.emb_l:
+        emb.cold_store = custom_api_cpp.ColdRowStore(emb.weight.data, config.cold_rows_block, config.cold_rows == "int8")
+
+def compact_cold_rows(model, optimizer):
+    # starts packing the blocks of rows of "model" idle for more than config.cold_rows_min_age iterations by the
+    # HT of the LazyDP "optimizer", in the background until the next restore (after materialize_emb_rows() of the
+    # next batch, whose rows are kept hot)
+    if config.cold_rows == "none":
+        return
+    model = getattr(model, "_module", model)
+    for emb, HT in zip(model.emb_l, optimizer.HT):
+        emb.cold_store.compact_async(HT, optimizer.cnt_iter, config.cold_rows_min_age, config.cold_rows_scan, config.cold_rows_nthreads)
+
+def cold_tier_stats(model):
+    # the counters of the cold tiers of all tables of "model", summed
+    model = getattr(model, "_module", model)
+    stats = dict()
+    for emb in model.emb_l:
+        for key, value in emb.cold_store.stats().items():
+            stats[key] = stats.get(key, 0) + value
+    return stats
+
+def map_dynamic_ids(model, lS_i, uniques=None, optimizer=None):
+    # (rows, unique rows) of the raw ids "lS_i" of the dynamic tables of "model" (config.dynamic_emb_tables),
+    # rows of new ids being allocated. With the LazyDP "optimizer", the ids are those of the batch of its next
+    # set_lS_i(): their HT (inline with the entries) becomes its iteration, and the delays are kept by the tables;
+    # then the eviction of each table (config.dynamic_evict_*) runs in the background until its next mapping
+    if not config.dynamic_emb_tables:
+        return lS_i, uniques
+    model = getattr(model, "_module", model)
+    if optimizer is None:
+        return [emb.dynamic_table.map(ids, config.unique_nthreads) for emb, ids in zip(model.emb_l, lS_i)], None
+    rows, uniques = [], []
+    for emb, ids in zip(model.emb_l, lS_i):
+        rows_table, uniques_table = emb.dynamic_table.prepare_next(ids, optimizer.cnt_iter, config.unique_nthreads)
+        rows.append(rows_table)
+        uniques.append(uniques_table)
+    for i, emb in enumerate(model.emb_l):
+        emb.dynamic_table.evict_async(optimizer.cnt_iter, optimizer._get_lr(optimizer.emb_params[i]))
+    return rows, uniques
+
+def materialize_emb_tables(model):
+    # initialize every row of the virtual tables of "model" not accessed yet, before a pass over whole tables
+    # (the cold tiers are unpacked as well)
+    if config.cold_rows != "none":
+        for emb in getattr(model, "_module", model).emb_l:
+            emb.cold_store.restore_all(config.cold_rows_nthreads)
+    if not config.virtual_emb_tables:
+        return
+    model = getattr(model, "_module", model)
+    start = time.time()
+    n_seen, n_rows = 0, 0
+    for emb in model.emb_l:
+        virtual_table = getattr(emb, "virtual_table", None)
+        if virtual_table is not None:
+            n_seen += virtual_table.n_materialized()
+            n_rows += emb.weight.shape[0]
+            virtual_table.materialize_all(config.emb_init_nthreads)
+    print(">> Materialized the virtual tables in %.1f s (%d of %d rows were accessed)" % (time.time() - start, n_seen, n_rows), flush=True)
+
+def concat_emb_tables(model):
+    # All tables of "model" in one buffer (config.emb_layout == "concat"): the weight of i-th table becomes the
+    # view of rows [row_offsets[i], row_offsets[i + 1]) of model.emb_l.concat_buffer
+    if config.emb_layout == "per_table":
+        return
+    elif config.emb_layout != "concat":
+        assert False, "Wrong emb_layout"
+    row_offsets = [0]
+    for emb in model.emb_l:
+        row_offsets.append(row_offsets[-1] + emb.weight.shape[0])
+    buffer = huge_pages_like(torch.empty(row_offsets[-1], model.emb_l[0].weight.shape[1]), copy=False)
+    for i, emb in enumerate(model.emb_l):
+        rows = buffer[row_offsets[i]:row_offsets[i + 1]]
+        rows.copy_(emb.weight.data)
+        emb.weight = torch.nn.Parameter(rows)
+    model.emb_l.concat_buffer = buffer
+    model.emb_l.row_offsets = row_offsets
+
+class TBELookup:
+    # Lookups of all tables by the CPU kernel of FBGEMM's table-batched embeddings (config.emb_forward == "tbe"),
+    # which reads the rows of emb_l.concat_buffer (config.emb_layout == "concat") in place: fp32 rows of a multiple
+    # of 16 bytes have the same layout in the TBE. Only the pooling is done by the TBE, its fused backward and
+    # optimizer are not used: the gradients stay those of the EmbeddingBags, clipped and noised by LazyDP
+    def __init__(self, emb_l):
+        from fbgemm_gpu.split_embedding_configs import SparseType
+        from fbgemm_gpu.split_table_batched_embeddings_ops_common import EmbeddingLocation, PoolingMode
+        from fbgemm_gpu.split_table_batched_embeddings_ops_inference import IntNBitTableBatchedEmbeddingBagsCodegen
+        dim = emb_l[0].weight.shape[1]
+        assert dim * 4 % 16 == 0, "Rows of the TBE are aligned to 16 bytes"
+        specs = [("table_%d" % i, emb.weight.shape[0], dim, SparseType.FP32, EmbeddingLocation.HOST) for i, emb in enumerate(emb_l)]
+        self.tbe = IntNBitTableBatchedEmbeddingBagsCodegen(specs, device="cpu", pooling_mode=PoolingMode.SUM, output_dtype=SparseType.FP32)
+        self.tbe.initialize_weights()
+        buffer = emb_l.concat_buffer
+        assert self.tbe.weights_host.numel() == buffer.numel() * buffer.element_size()
+        self.tbe.weights_host = buffer.view(-1).view(torch.uint8)
+
+    def __call__(self, lS_o, lS_i):
+        # indices of all tables back to back, with the offsets of their bags shifted accordingly (T * B + 1)
+        starts = np.cumsum([0] + [indices.numel() for indices in lS_i])
+        indices = torch.cat(list(lS_i)).int()
+        offsets = torch.cat([lS_o[k] + int(starts[k]) for k in range(len(lS_i))] + [torch.tensor([int(starts[-1])])]).int()
+        return self.tbe(indices, offsets)
+
+def home_emb_on_numa_nodes(model):
+    # NUMA-partitioned tables (config.numa_tables) over the nodes of the pinned worker pool: "table"
+    # homes each table on one node (largest first, onto the node with the fewest bytes so far), "rows"
+    # also splits the tables of at least config.numa_split_rows rows into one row range per node.
+    # The kernels then run the rows of a node on its threads. emb.numa_layout keeps (row_ends, nodes)
+    # to home the state indexed by the same rows (e.g., the HT, home_rows_like)
+    if config.numa_tables == "none":
+        return
+    nodes = sorted(set(custom_api_cpp.numa_nodes()))
+    assert len(nodes) > 0, "NUMA-partitioned tables need a pinned worker pool (--pool-cpus)"
+    emb_l = [emb for emb in model.emb_l if emb.weight.device.type == "cpu"]
+    node_bytes = {node: 0 for node in nodes}
+    for emb in sorted(emb_l, key=lambda emb: -emb.weight.numel() * emb.weight.element_size()):
+        n_rows = emb.weight.shape[0]
+        row_bytes = emb.weight.numel() // max(n_rows, 1) * emb.weight.element_size()
+        if config.numa_tables == "rows" and n_rows >= config.numa_split_rows:
+            row_ends = [n_rows * (k + 1) // len(nodes) for k in range(len(nodes))]
+            layout = (row_ends, nodes)
+            for node in nodes:
+                node_bytes[node] += n_rows // len(nodes) * row_bytes
+        elif config.numa_tables in ["table", "rows"]:
+            node = min(nodes, key=lambda node: node_bytes[node])
+            layout = ([n_rows], [node])
+            node_bytes[node] += n_rows * row_bytes
+        else:
+            assert False, "Wrong numa_tables"
+        custom_api_cpp.numa_home_rows(emb.weight.data, layout[0], layout[1])
+        emb.numa_layout = layout
+
+def replicate_read_mostly(model):
+    # per-node replicas of the CPU tables of at most config.numa_replica_bytes (config.numa_replicas, the alias
+    # tables are replicated by AliasSampler.replicate()), refreshed by sync_numa_replicas(). emb.numa_replicated
+    # marks them. Returns the replicated tables
+    if not config.numa_replicas:
+        return []
+    replicated = []
+    for i, emb in enumerate(model.emb_l):
+        weight = emb.weight.data
+        if weight.device.type == "cpu" and weight.numel() * weight.element_size() <= config.numa_replica_bytes:
+            custom_api_cpp.numa_replicate(weight)
+            emb.numa_replicated = True
+            replicated.append(i)
+    return replicated
+
+def sync_numa_replicas(model):
+    # the replicas of the small tables take their update, before the lookups of the next iteration
+    weights = [emb.weight.data for emb in model.emb_l if getattr(emb, "numa_replicated", False)]
+    if len(weights) > 0:
+        custom_api_cpp.numa_sync_replicas(weights, config.emb_forward_nthreads)
+
+def expected_unique_rows(n_rows, n_lookups, pdf=None):
+    # expected number of distinct rows of "n_lookups" independent lookups of a table, uniform without "pdf"
+    p = np.full(1, 1 / n_rows) if pdf is None else np.asarray(pdf, dtype=np.float64)
+    touched = -np.expm1(n_lookups * np.log1p(-np.minimum(p, 1 - 1e-12)))
+    return float(touched.sum() * (n_rows if pdf is None else 1))
+
+def predicted_table_time(n_rows, row_bytes, n_lookups, n_bags, unique_rows, on_gpu):
+    # seconds per iteration of a table: lookup (rows read, bags written), noise of the next rows, coalescing of
+    # the noise with the per-sample gradient, SGD update and the HT gather/scatter (4 bytes per row); the
+    # outputs and their gradients cross PCIe for a CPU table, the indices for a GPU table
+    lookup = (n_lookups + n_bags) * row_bytes
+    update = (6 * unique_rows + 2 * n_lookups) * row_bytes + 8 * unique_rows
+    if on_gpu:
+        return (lookup + update) / config.placement_gpu_bw + 8 * n_lookups / config.placement_pcie_bw
+    return (lookup + update) / config.placement_cpu_bw + 2 * n_bags * row_bytes / config.placement_pcie_bw
+
+def place_emb_tables(model, access_pdfs, batch_size, device):
+    # Moves tables of "model" into HBM (config.table_placement == "auto"): tables are taken by predicted saving
+    # per byte (table and HT) while they fit in config.placement_hbm_bytes, with the rows touched per iteration
+    # from access_pdfs (uniform when empty). The HT of a table follows its weight. Returns the moved tables
+    # "managed" moves every table into CUDA Unified Memory instead (move_emb_to_managed_memory)
+    if config.table_placement == "none":
+        return []
+    elif config.table_placement == "managed":
+        return move_emb_to_managed_memory(model, device)
+    elif config.table_placement != "auto":
+        assert False, "Wrong table_placement"
+    budget = config.placement_hbm_bytes
+    if budget == 0:
+        budget = torch.cuda.mem_get_info(device)[0] // 2
+    candidates = []
+    for i, emb in enumerate(model.emb_l):
+        n_rows, dim = emb.weight.shape
+        row_bytes = dim * emb.weight.element_size()
+        n_lookups = batch_size * min(config.num_gathers, n_rows) # same as config.num_gathers_list
+        unique_rows = expected_unique_rows(n_rows, n_lookups, access_pdfs[i] if len(access_pdfs) > 0 else None)
+        saving = predicted_table_time(n_rows, row_bytes, n_lookups, batch_size, unique_rows, False) - \
+                 predicted_table_time(n_rows, row_bytes, n_lookups, batch_size, unique_rows, True)
+        n_bytes = n_rows * (row_bytes + 4)
+        if saving > 0:
+            candidates.append((saving / n_bytes, n_bytes, i))
+    placed = []
+    for _, n_bytes, i in sorted(candidates, reverse=True):
+        if n_bytes <= budget:
+            model.emb_l[i].to(device)
+            budget -= n_bytes
+            placed.append(i)
+    return sorted(placed)
+
+def move_emb_to_managed_memory(model, device):
+    # Tables of "model" in CUDA managed memory of "device" (config.table_placement == "managed"), taking the
+    # CUDA paths of the tables in HBM while the driver migrates their pages, so that the tables may exceed the
+    # HBM. The rows are prefetched and advised by groups of config.um_group_bytes (DPOptimizer.prefetch_managed()
+    # and advise_managed()), emb.managed_group_rows. Returns the moved tables
+    assert custom_api_cuda is not None, "custom_api_cuda is not built"
+    for emb in model.emb_l:
+        weight = emb.weight.data
+        assert weight.device.type == "cpu" and weight.dtype == torch.float
+        emb.weight.data = custom_api_cuda.managed_from(weight.contiguous(), device.index if device.index is not None else torch.cuda.current_device())
+        emb.managed_group_rows = max(config.um_group_bytes // (weight.shape[1] * weight.element_size()), 1)
+    return list(range(len(model.emb_l)))
+
+def home_rows_like(tensor, emb):
+    # binds the rows of "tensor" (e.g., the HT of "emb") to the nodes of the rows of "emb"
+    layout = getattr(emb, "numa_layout", None)
+    if layout is not None and tensor.device.type == "cpu":
+        custom_api_cpp.numa_home_rows(tensor, layout[0], layout[1])
+
+def remap_rows(emb, indices):
+    # row indices in the original order -> rows of the reordered table (see RowReorder)
+    row_remap = getattr(emb, "row_remap", None)
+    return indices if row_remap is None else row_remap[indices]
+
+class AccessDistributionCache:
+    # Access distributions (float32 pmf over the rows) of the tables of a --locality "source" and their alias
+    # tables (custom_api_cpp.AliasSampler), one per table size, kept as .npy files in "path" across runs and
+    # mmapped: they are derived once, and the tables of the same size share the same pages
+    def __init__(self, path, source):
+        os.makedirs(path, exist_ok=True)
+        self.path = path
+        self.source = source
+        self.pmfs = dict()
+
+    def _file(self, n_rows, kind):
+        return os.path.join(self.path, "%s_%d_%s.npy" % (self.source, n_rows, kind))
+
+    def _load(self, path, make):
+        # written under a temporary name first, concurrent runs may derive the same file
+        if not os.path.exists(path):
+            tmp_path = "%s.%d.tmp" % (path, os.getpid())
+            with open(tmp_path, "wb") as f:
+                np.save(f, make())
+            os.replace(tmp_path, path)
+        return np.load(path, mmap_mode="r")
+
+    def pmf(self, n_rows, make_pmf):
+        # pmf of a table of "n_rows" rows, make_pmf(n_rows) if it is not cached yet
+        if n_rows not in self.pmfs:
+            self.pmfs[n_rows] = self._load(self._file(n_rows, "pmf"), lambda: np.asarray(make_pmf(n_rows), dtype=np.float32))
+        return self.pmfs[n_rows]
+
+    def alias_sampler(self, pmfs, n_cores):
+        # AliasSampler of the tables of "pmfs" (from pmf()), the alias tables held by it are the mmapped files
+        tables = dict()
+        for pmf in pmfs:
+            n_rows = len(pmf)
+            if n_rows in tables:
+                continue
+            paths = (self._file(n_rows, "alias_prob"), self._file(n_rows, "alias"))
+            if not all(os.path.exists(path) for path in paths):
+                prob, alias = custom_api_cpp.AliasSampler([torch.from_numpy(np.array(pmf))], n_cores).alias_tables()[0]
+                self._load(paths[0], lambda: prob.numpy())
+                self._load(paths[1], lambda: alias.numpy())
+            with warnings.catch_warnings():
+                # read-only mappings, the sampler never writes them
+                warnings.simplefilter("ignore", UserWarning)
+                tables[n_rows] = tuple(torch.from_numpy(np.load(path, mmap_mode="r")) for path in paths)
+        return custom_api_cpp.AliasSampler([tables[len(pmf)][0] for pmf in pmfs], [tables[len(pmf)][1] for pmf in pmfs])
+
+class RowReorder:
+    # Frequency-aware row order of the embedding tables: each table is permuted so that its hot rows
+    # are contiguous, so the unique rows of an iteration touch fewer pages and cache lines in the gather,
+    # the HT and the sparse update. emb.row_remap maps the original indices to the permuted rows
+    # (remap_rows), and restore() brings back the original order (e.g., before saving the model).
+    # Frequencies come from the access distribution (e.g., Kaggle_train_distribution.csv) or from
+    # the access counts observed by a previous run (observe() and save_counts())
+    def __init__(self, emb_l):
+        self.emb_l = emb_l
+        self.counts = [torch.zeros(emb.weight.shape[0]) for emb in emb_l]
+
+    def observe(self, lS_i):
+        # indices in the original order
+        for k, indices in enumerate(lS_i):
+            self.counts[k].index_add_(0, indices.reshape(-1), torch.ones(indices.numel()))
+
+    def set_counts_from_pdfs(self, pdfs):
+        self.counts = [torch.from_numpy(np.array(pdf, dtype=np.float32)) for pdf in pdfs] # copies, the pdfs may be read-only mappings
+
+    def save_counts(self, path):
+        torch.save(self.counts, path)
+
+    def load_counts(self, path):
+        counts = torch.load(path)
+        assert [c.shape[0] for c in counts] == [emb.weight.shape[0] for emb in self.emb_l]
+        self.counts = counts
+
+    def _permute(self, k, src, optimizer):
+        # row j of k-th table (and of its per-row optimizer state) becomes its current row src[j]
+        emb = self.emb_l[k]
+        int8_table = getattr(emb, "int8_table", None)
+        storage = int8_table.qweight if int8_table is not None else emb.weight.data
+        storage.copy_(storage[src])
+        if optimizer is not None:
+            optimizer.permute_emb_rows(k, src)
+
+    def apply(self, optimizer=None):
+        with torch.no_grad():
+            for k, emb in enumerate(self.emb_l):
+                perm = torch.sort(self.counts[k], descending=True, stable=True).indices
+                row_remap = getattr(emb, "row_remap", None)
+                self._permute(k, perm if row_remap is None else row_remap[perm], optimizer)
+                emb.row_remap = torch.empty_like(perm)
+                emb.row_remap[perm] = torch.arange(perm.numel())
+
+    def restore(self, optimizer=None):
+        with torch.no_grad():
+            for k, emb in enumerate(self.emb_l):
+                if getattr(emb, "row_remap", None) is not None:
+                    self._permute(k, emb.row_remap, optimizer)
+                    emb.row_remap = None
+
+class _RowwiseInt8EmbeddingBag(torch.autograd.Function):
+    # sum-pooled lookup of a row-wise int8 table, with the (uncoalesced) sparse gradient of the
+    # fp32 placeholder "weight" as in F.embedding_bag(..., sparse=True)
+    @staticmethod
+    def forward(ctx, qweight, weight, input, offsets):
+        ctx.save_for_backward(input, offsets)
+        ctx.shape = weight.shape
+        return torch.ops.quantized.embedding_bag_byte_rowwise_offsets(qweight, input, offsets)
+
+    @staticmethod
+    def backward(ctx, grad_output):
+        input, offsets = ctx.saved_tensors
+        lengths = torch.diff(offsets, append=torch.tensor([input.numel()], dtype=offsets.dtype))
+        bag_ids = torch.repeat_interleave(torch.arange(offsets.shape[0]), lengths)
+        grad_weight = torch.sparse_coo_tensor(input.view(1, -1), grad_output[bag_ids], ctx.shape)
+        return None, grad_weight, None, None
+
+class RowwiseInt8Table:
+    # Training-time row-wise int8 storage of an embedding table in the format of embedding_bag_byte_prepack
+    # (per row, the uint8 values followed by fp32 scale and bias). emb.weight becomes a zero-stride
+    # placeholder which only carries the shape and the sparse gradient, and the touched rows are
+    # dequantized, updated and requantized by custom_api_cpp.fused_delayed_noise_sgd_update.
+    def __init__(self, emb):
+        assert emb.mode == "sum"
+        n_rows, dim = emb.weight.shape
+        self.qweight = torch.ops.quantized.embedding_bag_byte_prepack(emb.weight.data)
+        emb.weight = torch.nn.Parameter(torch.zeros(1, 1).expand(n_rows, dim))
+        # EmbeddingBag.forward() (customized_sparse.py) is redirected to forward() below
+        emb.int8_table = self
+
+    def forward(self, emb, input, emb_bias, offsets, per_sample_weights):
+        assert per_sample_weights is None
+        V = _RowwiseInt8EmbeddingBag.apply(self.qweight, emb.weight, input, offsets)
+        return torch.nn.modules.sparse.anchored_output(V, emb_bias)
+
+    def dequantize(self):
+        return torch.ops.quantized.embedding_bag_byte_unpack(self.qweight)
+
+def dequantize_emb(model):
+    # fp32 tables back from the row-wise int8 ones (e.g., to save the model)
+    for emb in model.emb_l:
+        if getattr(emb, "int8_table", None) is not None:
+            emb.weight = torch.nn.Parameter(emb.int8_table.dequantize())
+            emb.int8_table = None
+
+def move_emb_to_precision(model):
+    # store the embedding tables of "model" in config.emb_precision (before move_emb_to_huge_pages)
+    if config.emb_precision == "fp32":
+        return
+    elif config.emb_precision == "int8":
+        # one table at a time, so that only a single fp32 table is alive besides the int8 ones
+        for emb in model.emb_l:
+            RowwiseInt8Table(emb)
+        return
+    elif config.emb_precision == "bf16":
+        dtype = torch.bfloat16
+    elif config.emb_precision == "fp16":
+        dtype = torch.float16
+    else:
+        assert False
+    for emb in model.emb_l:
+        emb.weight = torch.nn.Parameter(emb.weight.data.to(dtype))
+
+def save_model_with_table_files(model, path):
+    # Each embedding table of "model" goes to the raw table file "path.emb<k>", and the rest
+    # of the model is pickled to "path" without the tables (see load_model_with_table_files).
+    # The tables are written in parallel (custom_api_cpp.write_table_files)
+    weights = [emb.weight for emb in model.emb_l]
+    custom_api_cpp.write_table_files(["%s.emb%d" %(path, k) for k in range(len(weights))], [weight.data.contiguous() for weight in weights], torch.get_num_threads())
+    for k, weight in enumerate(weights):
+        model.emb_l[k].weight = torch.nn.Parameter(torch.empty(0, weight.shape[1], dtype=weight.dtype))
+    torch.save(model, path)
+    for k, weight in enumerate(weights):
+        model.emb_l[k].weight = weight
+
+def move_emb_to_table_files(model, path):
+    # Out-of-core embedding tables: each table is written to "path/emb<k>" and mapped back with
+    # writes going to the file, so the tables are paged in from (and out to) the storage on demand
+    for k, emb in enumerate(model.emb_l):
+        table_path = "%s/emb%d" %(path, k)
+        custom_api_cpp.write_table_file(table_path, emb.weight.data.contiguous(), torch.empty(0, dtype=torch.int))
+        emb.map_table_file(table_path, shared=True)
+
+def is_hugetlbfs(directory):
+    # whether "directory" is on a hugetlbfs mount (the longest mount point of /proc/mounts that contains it)
+    directory = os.path.realpath(directory)
+    fs_type, longest = None, -1
+    with open("/proc/mounts") as f:
+        for line in f:
+            fields = line.split()
+            mount_point = fields[1]
+            if (directory == mount_point or directory.startswith(mount_point.rstrip("/") + "/")) and len(mount_point) > longest:
+                fs_type, longest = fields[2], len(mount_point)
+    return fs_type == "hugetlbfs"
+
+def copy_table_files(path, stage, n_tables):
+    # copies the raw table files "path.emb<k>" to "stage.emb<k>". Files of a hugetlbfs cannot be written, so
+    # there they are sized to whole huge pages and filled through a mapping (map_table_file ignores the tail)
+    hugetlbfs = is_hugetlbfs(os.path.dirname(os.path.abspath(stage)))
+    for k in range(n_tables):
+        source, target = "%s.emb%d" %(path, k), "%s.emb%d" %(stage, k)
+        if not hugetlbfs:
+            shutil.copyfile(source, target + ".tmp")
+            os.rename(target + ".tmp", target)
+            continue
+        size = os.path.getsize(source)
+        page = os.statvfs(os.path.dirname(os.path.abspath(stage))).f_bsize
+        with open(source, "rb") as src, open(target + ".tmp", "w+b") as dst:
+            os.ftruncate(dst.fileno(), (size + page - 1) // page * page)
+            with mmap.mmap(dst.fileno(), (size + page - 1) // page * page) as mapping:
+                view = memoryview(mapping)
+                for offset in range(0, size, 1 << 30):
+                    src.readinto(view[offset:min(offset + (1 << 30), size)])
+                view.release()
+        os.rename(target + ".tmp", target)
+
+staged_models = dict() # model path -> staged path (config.sweep_table_dir), kept across the runs of a sweep
+table_server_connections = [] # held until the exit, the table server keeps the staged tables of this process
+
+def staged_table_files(path, n_tables):
+    # In-process sweeps (bench/sweep.py): the raw table files of the model are copied once into the tmpfs
+    # config.sweep_table_dir, from which each run maps them copy-on-write. A run then starts from the pristine
+    # tables without reading them, and its updates are dropped with the mapping. Only the model of the
+    # current run stays staged (the runs of a sweep are grouped by model)
+    if path in staged_models:
+        return staged_models[path]
+    for other, stage in list(staged_models.items()):
+        for k in range(n_tables):
+            if os.path.isfile("%s.emb%d" %(stage, k)):
+                os.remove("%s.emb%d" %(stage, k))
+        del staged_models[other]
+    os.makedirs(config.sweep_table_dir, exist_ok=True)
+    stage = "%s/%s" %(config.sweep_table_dir, os.path.basename(path))
+    copy_table_files(path, stage, n_tables)
+    staged_models[path] = stage
+    return stage
+
+def served_table_files(path, n_tables):
+    # The staged tables of the model from the table server (bench/table_server.py, config.table_server), which
+    # keeps them in /dev/shm or a hugetlbfs while a connection holds them: the process maps them copy-on-write,
+    # so it starts without reading the tables and several processes share one physical copy
+    connection = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    connection.connect(config.table_server)
+    connection.sendall((json.dumps({"path": os.path.abspath(path), "n_tables": n_tables}) + "\n").encode())
+    reply = json.loads(connection.makefile("r").readline())
+    assert "stage" in reply, reply.get("error")
+    table_server_connections.append(connection)
+    return reply["stage"]
+
+def load_model_with_table_files(path, shared=False, mmap=True):
+    # Inverse of save_model_with_table_files: the embedding tables are memory-mapped, not read,
+    # or read in parallel if not "mmap" (custom_api_cpp.read_table_files)
+    model = torch.load(path)
+    if config.table_server is not None:
+        assert not shared
+        path, mmap = served_table_files(path, len(model.emb_l)), True
+    elif config.sweep_table_dir is not None:
+        assert not shared
+        path, mmap = staged_table_files(path, len(model.emb_l)), True
+    if not mmap:
+        weights = custom_api_cpp.read_table_files(["%s.emb%d" %(path, k) for k in range(len(model.emb_l))], torch.get_num_threads())
+        for emb, weight in zip(model.emb_l, weights):
+            emb.weight = torch.nn.Parameter(weight)
+        return model
+    for k, emb in enumerate(model.emb_l):
+        emb.map_table_file("%s.emb%d" %(path, k), shared)
+    return model
+
+def export_serving_model(model, path, bits):
+    # Serving format of a trained model (with its delayed noise settled): each embedding table is quantized
+    # row-wise to "bits" by torch.ops.quantized.embedding_bag_{byte,4bit}_prepack and written to the raw
+    # table file "path.emb<k>" (uint8 rows), the rest of the state dict is saved to "path" (see load_serving_model)
+    assert bits in [4, 8]
+    prepack = torch.ops.quantized.embedding_bag_byte_prepack if bits == 8 else torch.ops.quantized.embedding_bag_4bit_prepack
+    model = getattr(model, "_module", model) # GradSampleModule
+    for k, emb in enumerate(model.emb_l):
+        # one table at a time, so that only a single fp32 copy is alive besides the model
+        weight = emb.int8_table.dequantize() if getattr(emb, "int8_table", None) is not None else emb.weight.data
+        packed = prepack(weight.float().cpu().contiguous())
+        custom_api_cpp.write_table_file("%s.emb%d" %(path, k), packed, torch.empty(0, dtype=torch.int))
+    module_state_dict = {name: v.cpu() for name, v in model.state_dict().items() if not name.startswith("emb_l.")}
+    torch.save({"bits": bits, "dims": [emb.embedding_dim for emb in model.emb_l], "module_state_dict": module_state_dict}, path)
+
+def load_serving_model(model, path):
+    # Inverse of export_serving_model on a model of the same configuration: the quantized tables are mapped
+    # (read-only use, copy-on-write) into model.emb_l_q in place of the fp32 tables, which are released,
+    # and the lookups go through its quantized path. Returns the bytes of the quantized tables
+    exported = torch.load(path)
+    model.load_state_dict(exported["module_state_dict"], strict=False)
+    n_bytes = 0
+    model.emb_l_q = []
+    for k, emb in enumerate(model.emb_l):
+        assert emb.embedding_dim == exported["dims"][k]
+        weight, _ = custom_api_cpp.map_table_file("%s.emb%d" %(path, k), False)
+        model.emb_l_q.append(weight)
+        n_bytes += weight.numel()
+        emb.weight = torch.nn.Parameter(torch.empty(0, emb.embedding_dim))
+    model.quantize_emb = True
+    model.quantize_bits = exported["bits"]
+    return n_bytes
+
+def lazydp_checkpoint_snapshot(model, optimizer, extra=None):
+    # (tables, HT, rest) of a LazyDP checkpoint at this iteration: the embedding tables (not copied),
+    # the HT of each table and the rest of the model, the optimizer, the LazyDP state
+    # (DPOptimizer.lazydp_state_dict) and "extra" (e.g., the pending batch)
+    state = optimizer.lazydp_state_dict()
+    HT = state.pop("HT")
+    emb_weights = [emb.weight for emb in model.emb_l]
+    module_state_dict = model.state_dict(keep_vars=True)
+    module_state_dict = {name: v.detach() for name, v in module_state_dict.items() if not any(v is weight for weight in emb_weights)}
+    rest = {"module_state_dict": module_state_dict, "optimizer_state_dict": optimizer.state_dict(),
+            "lazydp_state_dict": state, "extra": extra}
+    return [weight.data for weight in emb_weights], HT, rest
+
+def write_table_files_with_HT(path, tables, HT):
+    for k, table in enumerate(tables):
+        custom_api_cpp.write_table_file("%s.emb%d" %(path, k), table.cpu().contiguous(), HT[k].contiguous())
+
+def save_lazydp_checkpoint(path, model, optimizer, extra=None):
+    # Checkpoint of a LazyDP run without settling the delayed noise: each embedding table is written
+    # with its HT to the raw table file "path.emb<k>", the rest (lazydp_checkpoint_snapshot) to "path"
+    tables, HT, rest = lazydp_checkpoint_snapshot(model, optimizer, extra)
+    write_table_files_with_HT(path, tables, HT)
+    torch.save(rest, path)
+
+def load_lazydp_checkpoint(path, model, optimizer, deltas=[]):
+    # Inverse of save_lazydp_checkpoint, returns "extra". The CPU tables are replaced by the copy-on-write
+    # mapping of their files (that of the parameter, so the optimizer keeps referring to it) unless they
+    # are in huge pages or homed on NUMA nodes, in which case they are copied like the GPU tables.
+    # "deltas": incremental checkpoints on top of it (IncrementalCheckpointer), applied in order;
+    # the state other than the tables and the HT is then that of the last one
+    checkpoint = torch.load(deltas[-1] if len(deltas) > 0 else path)
+    delta_rows = [load_streamed_parameters(delta + ".rows") for delta in deltas]
+    model.load_state_dict(checkpoint["module_state_dict"], strict=False)
+    optimizer.load_state_dict(checkpoint["optimizer_state_dict"])
+    state = checkpoint["lazydp_state_dict"]
+    state["HT"] = []
+    with torch.no_grad():
+        for k, emb in enumerate(model.emb_l):
+            weight, HT = custom_api_cpp.map_table_file("%s.emb%d" %(path, k), False)
+            assert weight.shape == emb.weight.shape and weight.dtype == emb.weight.dtype
+            for rows in delta_rows:
+                indices, values, HT_values = rows[3 * k:3 * k + 3]
+                weight[indices] = values
+                HT[indices] = HT_values
+            if emb.weight.device.type == "cpu" and config.huge_pages == "none" and config.numa_tables == "none":
+                emb.weight.data = weight
+            else:
+                emb.weight.data.copy_(weight)
+            state["HT"].append(HT)
+    optimizer.load_lazydp_state_dict(state)
+    return checkpoint["extra"]
+
+class IncrementalCheckpointer:
+    # Incremental LazyDP checkpoints: a base snapshot at "path" (save_lazydp_checkpoint) followed by the
+    # deltas "path.delta<n>", which hold only the rows updated since the previous checkpoint, i.e.,
+    # (index, row, HT) of the rows with HT[row] > the last iteration it covered (the other rows of
+    # LazyDP are bit-identical). Every "compact_interval" deltas are folded into the base table files
+    # in place (0: never). "path.manifest.json" lists the deltas (load_incremental_checkpoint).
+    #
+    # With "async_op", save() only takes the snapshot and training continues while it is written: the
+    # dirty rows, their HT and the rest are copied and written (and compacted) by a background thread.
+    # The tables of the base snapshot are written by a fork()-ed child, i.e., from a copy-on-write
+    # image of the process taken with the HT at the same iteration, if "fork_tables" (CPU tables
+    # which are not MAP_SHARED file mappings), and synchronously otherwise.
+    # A save waits for the previous one, the manifest only lists complete checkpoints.
+    def __init__(self, path, compact_interval, async_op=False, fork_tables=False):
+        self.path = path
+        self.compact_interval = compact_interval
+        self.async_op = async_op
+        self.fork_tables = fork_tables
+        self.deltas = []
+        self.last_iter = None
+        self.writer_thread = None
+        self.writer_pid = None
+
+    def save(self, model, optimizer, extra=None):
+        self.wait()
+        tables, HT, rest = lazydp_checkpoint_snapshot(model, optimizer, extra)
+        last_iter, self.last_iter = self.last_iter, optimizer.cnt_iter - 1
+        if last_iter is None:
+            # the rest is small and may be on the GPU, which a forked child must not touch
+            torch.save(rest, self.path)
+            if self.async_op and self.fork_tables and all(table.device.type == "cpu" for table in tables):
+                pid = os.fork()
+                if pid == 0:
+                    status = 1
+                    try:
+                        write_table_files_with_HT(self.path, tables, HT)
+                        status = 0
+                    finally:
+                        os._exit(status)
+                self.writer_pid = pid
+            else:
+                write_table_files_with_HT(self.path, tables, HT)
+                self._write_manifest()
+        else:
+            delta = "%s.delta%d" %(self.path, len(self.deltas))
+            rows = []
+            for k, table in enumerate(tables):
+                # rows updated by the last iteration have HT == cnt_iter - 1 (set_HT_increase_cnt_iter)
+                indices = (HT[k] > last_iter).nonzero().view(-1)
+                rows += [indices, table[indices.to(table.device)].cpu(), HT[k][indices]]
+            if self.async_op:
+                # parameters and optimizer state keep changing while the thread writes them
+                rest = copy.deepcopy(rest)
+                self.writer_thread = threading.Thread(target=self._write_delta, args=(delta, rows, rest))
+                self.writer_thread.start()
+            else:
+                self._write_delta(delta, rows, rest)
+
+    def _write_delta(self, delta, rows, rest):
+        writer = StreamedParameterWriter(delta + ".rows")
+        for tensor in rows:
+            writer.write(tensor)
+        writer.close()
+        torch.save(rest, delta)
+        self.deltas.append(delta)
+        if self.compact_interval > 0 and len(self.deltas) >= self.compact_interval:
+            self.compact()
+        self._write_manifest()
+
+    def _write_manifest(self):
+        with open(self.path + ".manifest.json", "w") as f:
+            json.dump({"deltas": self.deltas, "last_iter": self.last_iter}, f)
+
+    def wait(self):
+        if self.writer_thread is not None:
+            self.writer_thread.join()
+            self.writer_thread = None
+        if self.writer_pid is not None:
+            _, status = os.waitpid(self.writer_pid, 0)
+            assert status == 0, "Writing the tables of the checkpoint failed"
+            self.writer_pid = None
+            self._write_manifest()
+
+    def compact(self):
+        # the base files are mapped with writes going to them, only the rows of the deltas are written
+        for delta in self.deltas:
+            rows = load_streamed_parameters(delta + ".rows")
+            for k in range(len(rows) // 3):
+                weight, HT = custom_api_cpp.map_table_file("%s.emb%d" %(self.path, k), True)
+                indices, values, HT_values = rows[3 * k:3 * k + 3]
+                weight[indices] = values
+                HT[indices] = HT_values
+                del weight, HT
+        if len(self.deltas) > 0:
+            os.replace(self.deltas[-1], self.path)
+        for delta in self.deltas:
+            if os.path.exists(delta):
+                os.remove(delta)
+            os.remove(delta + ".rows")
+            os.remove(delta + ".rows.json")
+        self.deltas = []
+
+def load_incremental_checkpoint(path, model, optimizer):
+    # Inverse of IncrementalCheckpointer.save: the base snapshot with the deltas of the manifest, if any
+    deltas = []
+    if os.path.exists(path + ".manifest.json"):
+        with open(path + ".manifest.json") as f:
+            deltas = json.load(f)["deltas"]
+    return load_lazydp_checkpoint(path, model, optimizer, deltas)
+
+class HotRowCache:
+    # Software-managed GPU cache of the hot rows of the CPU-resident embedding tables (cpu-gpu system).
+    # The cached copy of a row is the up-to-date one and the CPU copy is written back on eviction.
+    # Rows are admitted by their access frequency (decayed at every refresh) observed by set_lS_i().
+    # The HT keeps tracking the delayed noise of every row wherever it lives, so an evicted row gets
+    # its delayed noise applied on the CPU at its next access as usual.
+    def __init__(self, emb_l, n_rows, refresh_interval, decay, device):
+        self.emb_l = emb_l
+        self.device = device
+        self.capacity = [min(n_rows, emb.weight.shape[0]) for emb in emb_l]
+        self.refresh_interval = refresh_interval
+        self.decay = decay
+        self.freq = [torch.zeros(emb.weight.shape[0]) for emb in emb_l]
+        self.slot = [torch.full((emb.weight.shape[0],), -1, dtype=torch.int32) for emb in emb_l]
+        self.rows = [torch.empty(0, dtype=torch.int64) for _ in emb_l]
+        self.weight = [torch.empty(0, emb.weight.shape[1], device=device, requires_grad=True) for emb in emb_l]
+        self.n_misses = [0] * len(emb_l)
+        self.n_observed = 0
+        for k, emb in enumerate(emb_l):
+            # EmbeddingBag.forward() (customized_sparse.py) is redirected to forward() below
+            emb.row_cache = (self, k)
+
+    def observe(self, uniques):
+        # unique rows of the next batch of each table
+        for k, rows in enumerate(uniques):
+            self.freq[k][rows] += 1
+        self.n_observed += 1
+
+    def refresh_due(self):
+        return self.n_observed % self.refresh_interval == 0
+
+    def refresh(self):
+        # re-admit the most frequent rows of each table
+        with torch.no_grad():
+            self.write_back()
+            for k, emb in enumerate(self.emb_l):
+                self.freq[k] *= self.decay
+                if self.capacity[k] == 0:
+                    continue
+                rows = torch.topk(self.freq[k], self.capacity[k]).indices
+                rows = rows[self.freq[k][rows] > 0].sort().values
+                self.rows[k] = rows
+                self.slot[k][rows] = torch.arange(rows.numel(), dtype=torch.int32)
+                self.weight[k] = emb.weight.data[rows].to(self.device).requires_grad_()
+
+    def write_back(self):
+        # evict every row (e.g., before settling the delayed noise of the CPU tables)
+        with torch.no_grad():
+            for k, emb in enumerate(self.emb_l):
+                if self.rows[k].numel() > 0:
+                    emb.weight.data[self.rows[k]] = self.weight[k].detach().cpu()
+                    self.slot[k][self.rows[k]] = -1
+                self.rows[k] = torch.empty(0, dtype=torch.int64)
+                self.weight[k] = torch.empty(0, emb.weight.shape[1], device=self.device, requires_grad=True)
+
+    def _offsets(self, bag_ids, n_bags):
+        counts = torch.bincount(bag_ids, minlength=n_bags)
+        return torch.cumsum(counts, 0) - counts
+
+    def forward(self, k, emb, input, emb_bias, offsets, per_sample_weights):
+        # Same as emb(input, emb_bias, offsets): cached rows are gathered on the GPU and only their
+        # pooled sum is copied back, the other rows are gathered from the CPU table
+        assert per_sample_weights is None and emb.mode == "sum"
+        slots = self.slot[k][input].long()
+        hit = slots >= 0
+        n_bags = offsets.shape[0]
+        lengths = torch.diff(offsets, append=torch.tensor([input.numel()], dtype=offsets.dtype))
+        bag_ids = torch.repeat_interleave(torch.arange(n_bags), lengths)
+        self.n_misses[k] = int((~hit).sum().item())
+        V = F.embedding_bag(input[~hit], emb.weight, self._offsets(bag_ids[~hit], n_bags), mode="sum", sparse=emb.sparse)
+        if self.n_misses[k] < input.numel():
+            V_hit = F.embedding_bag(slots[hit].to(self.device), self.weight[k], self._offsets(bag_ids[hit], n_bags).to(self.device), mode="sum", sparse=True)
+            V = V + V_hit.cpu()
+        return torch.nn.modules.sparse.anchored_output(V, emb_bias)
+
+class SharedBatch(NamedTuple):
+    # a batch written by a loader worker into slot "slot" of a SharedBatchRing
+    slot: int
+    batch_size: int
+    n_tables: int
+
+class SharedBatchRing:
+    # Multi-worker loading of the training batches (--num-workers > 0) without copies: the workers collate
+    # the samples of CustomDataset (X, lS_o, lS_i, T, one index per bag) directly into the slots of buffers
+    # allocated in shared memory by the main process before the workers are forked, pinned with
+    # cudaHostRegister when "pin", and return only the slot (SharedBatch). SharedBatchLoader hands views of
+    # the slot to the training loop, so X goes to the GPU from pinned memory and lS_i reaches set_lS_i as is.
+    #
+    # Each worker cycles over its own slots, the number of which covers the batches it has in flight
+    # ("prefetch_factor") and the SHARED_BATCH_HOLD batches the main process may still use (the current one,
+    # the LazyDP lookahead and the previous one, whose update may still be running), so a slot is never
+    # rewritten while in use and nothing is handed back. The position of each worker is kept in shared
+    # memory across the epochs. Batches of more than "capacity" samples (Poisson sampling) or empty ones
+    # are collated by "collate_fn" as regular tensors.
+    SHARED_BATCH_HOLD = 3
+
+    def __init__(self, collate_fn, n_workers, prefetch_factor, capacity, n_tables, n_dense, pin):
+        self.collate_fn = collate_fn
+        self.capacity = capacity
+        self.slots_per_worker = prefetch_factor + self.SHARED_BATCH_HOLD + 1
+        n_slots = n_workers * self.slots_per_worker
+        self.X = torch.empty(n_slots, capacity * n_dense).share_memory_()
+        self.lS_o = torch.empty(n_slots, n_tables * capacity, dtype=torch.long).share_memory_()
+        self.lS_i = torch.empty(n_slots, n_tables * capacity, dtype=torch.long).share_memory_()
+        self.T = torch.empty(n_slots, capacity).share_memory_()
+        self.n_dense = n_dense
+        self.positions = torch.zeros(n_workers, dtype=torch.long).share_memory_()
+        if pin:
+            for buffer in [self.X, self.lS_o, self.lS_i, self.T]:
+                assert int(torch.cuda.cudart().cudaHostRegister(buffer.data_ptr(), buffer.numel() * buffer.element_size(), 0)) == 0
+
+    def collate(self, batch):
+        # runs in a worker, in place of "collate_fn"
+        B = len(batch)
+        worker = torch.utils.data.get_worker_info()
+        if worker is None or B == 0 or B > self.capacity:
+            return self.collate_fn(batch)
+        n_tables = len(batch[0][1])
+        slot = worker.id * self.slots_per_worker + int(self.positions[worker.id]) % self.slots_per_worker
+        self.positions[worker.id] += 1
+        X, lS_o, lS_i, T = self.views(SharedBatch(slot, B, n_tables))
+        torch.stack([sample[0] for sample in batch], out=X)
+        lS_o.copy_(torch.arange(B))
+        for t in range(n_tables):
+            torch.cat([sample[1][t] for sample in batch], out=lS_i[t])
+        torch.cat([sample[2] for sample in batch], out=T.view(-1))
+        return SharedBatch(slot, B, n_tables)
+
+    def views(self, batch):
+        B, n_tables = batch.batch_size, batch.n_tables
+        return (self.X[batch.slot, :B * self.n_dense].view(B, self.n_dense),
+                self.lS_o[batch.slot, :n_tables * B].view(n_tables, B),
+                self.lS_i[batch.slot, :n_tables * B].view(n_tables, B),
+                self.T[batch.slot, :B].view(B, 1))
+
+class SharedBatchLoader:
+    # "loader" (e.g., the DPDataLoader of make_private) whose batches are SharedBatchRing slots
+    def __init__(self, loader, ring):
+        self.loader = loader
+        self.ring = ring
+
+    def __len__(self):
+        return len(self.loader)
+
+    def __iter__(self):
+        for batch in self.loader:
+            if isinstance(batch, SharedBatch):
+                X, lS_o, lS_i, T = self.ring.views(batch)
+                batch = (X, lS_o, list(lS_i.unbind(0)), T)
+            yield batch
+
+class PrefetchIterator:
+    # Iterates "iterable" (e.g., the preparation of the test batches) on a background thread, up to
+    # "depth" items ahead of the consumer, so that the loader overlaps the forward of the previous batch.
+    # An exception of the thread is raised by the consumer
+    def __init__(self, iterable, depth=2):
+        self.items = queue.Queue(maxsize=depth)
+        self.thread = threading.Thread(target=self._produce, args=(iterable,), daemon=True)
+        self.thread.start()
+
+    def _produce(self, iterable):
+        try:
+            for item in iterable:
+                self.items.put((item, None))
+        except Exception as error:
+            self.items.put((None, error))
+        self.items.put((None, StopIteration()))
+
+    def __iter__(self):
+        return self
+
+    def __next__(self):
+        item, error = self.items.get()
+        if error is not None:
+            self.thread.join()
+            raise error
+        return item
+
+class LookaheadIterator:
+    # Iterates "iterable" with "prepare" applied to each item "depth" items ahead of the consumer, on the
+    # consumer's thread (the preparation may use the optimizer or collectives): with depth 1 an item is
+    # prepared when it is drawn, with depth k the asynchronous work started by "prepare" (e.g., routing,
+    # readahead) has k - 1 more items of the consumer to complete
+    def __init__(self, iterable, prepare, depth=1):
+        assert depth >= 1
+        self.iterator = iter(iterable)
+        self.prepare = prepare
+        self.depth = depth
+        self.ready = collections.deque()
+
+    def __iter__(self):
+        return self
+
+    def __next__(self):
+        while len(self.ready) < self.depth:
+            try:
+                item = next(self.iterator)
+            except StopIteration:
+                break
+            self.ready.append(self.prepare(item))
+        if not self.ready:
+            raise StopIteration
+        return self.ready.popleft()
+
+class _PackedEmbTransfer(torch.autograd.Function):
+    # CPU embedding outputs -> GPU with a single copy through a pinned staging buffer,
+    # and their gradients back the same way (see EmbOutputTransfer)
+    @staticmethod
+    def forward(ctx, transfer, *ly):
+        ctx.transfer = transfer
+        return tuple(transfer.to_device(ly))
+
+    @staticmethod
+    def backward(ctx, *grads):
+        return (None,) + tuple(ctx.transfer.to_host(grads))
+
+class EmbOutputTransfer:
+    # Transfer of the embedding outputs (cpu-gpu system) packed into one contiguous pinned buffer and
+    # copied asynchronously on a dedicated stream, so that the copy overlaps the bottom MLP still running
+    # on the compute stream, instead of a pageable (bounced) copy per table on the default stream.
+    # The staging buffers are reused once their previous copy has completed.
+    # With a "dtype" of bf16/fp16 (config.emb_transfer_dtype), the outputs and gradients cross in that dtype
+    # and are upcast on arrival; the per-example norms of the gradients are taken in fp32 on the device
+    # before the downcast, and handed to the hooks of "modules" (the nn.EmbeddingBag of each output).
+    # With "device_norms" (config.emb_ghost_norms == "device"), these norms are taken in any dtype and stay on
+    # the device, where the clipping factors are reduced (SquaredNormBuffer.to_device())
+    def __init__(self, device, dtype=torch.float, modules=None, device_norms=False):
+        self.device = device
+        self.dtype = dtype
+        self.modules = modules
+        self.device_norms = device_norms
+        self.stream = torch.cuda.Stream(device)
+        self.host_buffer = [torch.empty(0, dtype=dtype, pin_memory=True) for _ in range(2)] # host -> device, device -> host
+        self.norm_buffer = torch.empty(0, pin_memory=True) # fp32 norms of the gradients, device -> host
+        self.copied = [None, None] # events of the last copy from/to each buffer
+
+    def _staging(self, direction, shape):
+        if self.copied[direction] is not None:
+            self.copied[direction].synchronize()
+        if self.host_buffer[direction].numel() < np.prod(shape):
+            # 1/8 headroom for the (Poisson-sampled) batches slightly larger than the previous ones
+            self.host_buffer[direction] = torch.empty(int(np.prod(shape)) * 9 // 8, dtype=self.dtype, pin_memory=True)
+        return self.host_buffer[direction][: int(np.prod(shape))].view(shape)
+
+    def _norm_staging(self, shape):
+        # synchronized with the gradients by _staging(1, ...)
+        if self.norm_buffer.numel() < np.prod(shape):
+            self.norm_buffer = torch.empty(int(np.prod(shape)) * 9 // 8, pin_memory=True)
+        return self.norm_buffer[: int(np.prod(shape))].view(shape)
+
+    def to_device(self, ly):
+        staging = self._staging(0, (len(ly),) + tuple(ly[0].shape))
+        if self.dtype == torch.float:
+            torch.stack([V.detach() for V in ly], out=staging)
+        else:
+            # downcast while packing
+            for i, V in enumerate(ly):
+                staging[i].copy_(V.detach())
+        with torch.cuda.stream(self.stream):
+            packed = staging.to(self.device, non_blocking=True)
+            self.copied[0] = torch.cuda.Event()
+            self.copied[0].record(self.stream)
+        torch.cuda.current_stream(self.device).wait_stream(self.stream)
+        packed.record_stream(torch.cuda.current_stream(self.device))
+        return packed.float().unbind(0)
+
+    def to_host(self, grads):
+        packed = torch.stack(grads)
+        norms = None
+        if self.dtype != torch.float or self.device_norms:
+            # a single reduction over the gradients of all tables
+            norms = packed.float().norm(2, dim=-1)
+        if self.dtype != torch.float:
+            packed = packed.to(self.dtype)
+        if norms is not None and not self.device_norms:
+            norm_staging = self._norm_staging(tuple(norms.shape))
+        staging = self._staging(1, tuple(packed.shape))
+        self.stream.wait_stream(torch.cuda.current_stream(self.device))
+        with torch.cuda.stream(self.stream):
+            staging.copy_(packed, non_blocking=True)
+            packed.record_stream(self.stream)
+            if norms is not None and not self.device_norms:
+                norm_staging.copy_(norms, non_blocking=True)
+                norms.record_stream(self.stream)
+            self.copied[1] = torch.cuda.Event()
+            self.copied[1].record(self.stream)
+        # the CPU backward of the embedding tables reads the gradients right away; they stay valid
+        # until the next backward (the hooks consume the backprops before the second backward)
+        self.copied[1].synchronize()
+        if norms is not None and self.modules is not None and len(self.modules) == len(grads):
+            for module, module_norms in zip(self.modules, (norms if self.device_norms else norm_staging).unbind(0)):
+                module.backprop_norms = module_norms
+        return staging.unbind(0) if self.dtype == torch.float else staging.float().unbind(0)
+
+    def __call__(self, ly):
+        # falls back to a copy per table when the outputs cannot be packed (e.g., different dims)
+        if any(V.shape != ly[0].shape or V.dtype != torch.float for V in ly):
+            return [V.to(self.device) for V in ly]
+        return list(_PackedEmbTransfer.apply(self, *ly))
+
+class _DotInteraction(torch.autograd.Function):
+    # DLRM dot interaction with the lower triangle packed by a single kernel each way (custom_api_cuda)
+    @staticmethod
+    def forward(ctx, itself, x, *ly):
+        features = [x.contiguous()] + [V.contiguous() for V in ly]
+        ctx.itself = itself
+        ctx.save_for_backward(*features)
+        return custom_api_cuda.dot_interaction_forward(features, itself)
+
+    @staticmethod
+    def backward(ctx, grad):
+        grads = custom_api_cuda.dot_interaction_backward(grad.contiguous(), list(ctx.saved_tensors), ctx.itself)
+        return (None,) + tuple(grads.unbind(0))
+
+def fused_dot_interaction(x, ly, itself):
+    # (config.interaction_optimize == "fused") the "dot" interact_features() of DLRM without the concatenated T,
+    # the full T T^T and the gather of its lower triangle; None when the features do not fit the kernel
+    # (not CUDA fp32, different shapes, or more than 48KB of features per example in shared memory)
+    features = [x] + list(ly)
+    if custom_api_cuda is None or any(not V.is_cuda or V.dtype != torch.float or V.shape != x.shape for V in features):
+        return None
+    if len(features) * x.shape[1] * 4 > 48 * 1024:
+        return None
+    return _DotInteraction.apply(itself, x, *ly)
+
+def mlp_autocast():
+    # (config.mlp_amp) autocast of the MLPs and the interaction, a no-op for "none"; on the CPU (config.cpu_only)
+    # the bf16 GEMMs of autocast are oneDNN ones
+    dtype = torch.bfloat16 if config.mlp_amp == "bf16" else torch.float16
+    return torch.autocast(device_type=config.device.type, dtype=dtype, enabled=config.mlp_amp != "none")
+
+def norm_backward(outputs, leaves, grad_outputs=None):
+    # the first (norm-only) backward of DP-SGD(F)/LazyDP: only the per-example activations and backprops of the
+    # hooks are needed, so the graph is walked only towards the leaves the outputs are anchored to (the anchors
+    # of customized_sparse.anchored_output, or zero biases); the weight gradients of the MLPs and the sparse
+    # gradients of the tables are never built, and with autograd.grad nothing is accumulated into the .grad of
+    # the leaves either (each shared leaf once)
+    unique = list({id(leaf): leaf for leaf in leaves if leaf is not None}.values())
+    torch.autograd.grad(outputs, unique, grad_outputs=grad_outputs, retain_graph=True, allow_unused=True)
+
+class DenseStepGraph:
+    # (config.cuda_graph) the GPU side of an iteration of DP-SGD(F)/LazyDP with fixed shapes, captured into two
+    # CUDA graphs once and replayed: (1) bottom MLP, interaction, top MLP, per-example losses and the first
+    # backward, whose hooks write the ghost norms of the MLPs, and (2) the backward of the re-weighted loss
+    # sum(losses * clip_factor) into the gradients of the MLPs. The embedding outputs cross into static buffers
+    # and their gradients cross out, the CPU side (tables, their hooks) runs eagerly around the replays.
+    # The first "warmup_iters" iterations, and any batch of another shape, run the same steps eagerly.
+    def __init__(self, dense_fn, loss_fn, mlp_params, warmup_iters=3):
+        self.dense_fn = dense_fn # (dense_x, ly) -> output
+        self.loss_fn = loss_fn # (output, T) -> per-example losses
+        self.mlp_params = mlp_params
+        self.warmup_iters = warmup_iters
+        self.n_iters = 0
+        self.forward_graph = self.backward_graph = None
+
+    def _forward_norms(self, x, ly, T, mlp_bias):
+        losses = self.loss_fn(self.dense_fn(torch.nn.modules.sparse.anchored_output(x, mlp_bias), ly), T)
+        ly_grads = torch.autograd.grad(losses.mean(), ly + [mlp_bias], retain_graph=True)[:-1]
+        return losses, ly_grads
+
+    def _clipped_backward(self, losses, ly, clip_factor):
+        loss = (losses.reshape(1, -1) * clip_factor).sum()
+        torch.autograd.backward(loss, inputs=self.mlp_params + ly, retain_graph=True)
+        return [V.grad for V in ly]
+
+    def _capture_forward(self, dense_x, ly, T, mlp_bias):
+        # static inputs, captured after the warm-up iterations (cuBLAS workspaces, autograd caches)
+        self.static_x, self.static_T = dense_x.clone(), T.clone()
+        self.static_ly = [V.clone().requires_grad_() for V in ly]
+        self.static_clip = torch.ones(dense_x.shape[0], device=dense_x.device)
+        self.forward_graph = torch.cuda.CUDAGraph()
+        with torch.cuda.graph(self.forward_graph):
+            self.static_losses, self.static_ly_grads = self._forward_norms(self.static_x, self.static_ly, self.static_T, mlp_bias)
+        # attributes written by the hooks during the capture, refreshed in place by every replay
+        self.norms = [(p, p.grad_sample_norms) for p in self.mlp_params]
+
+    def _capture_backward(self):
+        self.backward_graph = torch.cuda.CUDAGraph()
+        with torch.cuda.graph(self.backward_graph, pool=self.forward_graph.pool()):
+            self.static_ly_clipped_grads = self._clipped_backward(self.static_losses, self.static_ly, self.static_clip)
+        self.grads = [(p, p.grad) for p in self.mlp_params]
+
+    def forward_and_norms(self, dense_x, ly_host, T, mlp_bias, emb_biases):
+        # per-example losses of the batch, once the ghost norms of the MLPs (graph) and of the tables
+        # (eager backward of the CPU-resident tables) are written
+        ly = [V.detach().to(dense_x.device) for V in ly_host]
+        if self.forward_graph is None and self.n_iters == self.warmup_iters:
+            self._capture_forward(dense_x, ly, T, mlp_bias)
+        self.n_iters += 1
+        self.replayed = self.forward_graph is not None and dense_x.shape == self.static_x.shape
+        if self.replayed:
+            self.static_x.copy_(dense_x)
+            self.static_T.copy_(T)
+            for S, V in zip(self.static_ly, ly):
+                S.detach().copy_(V)
+            self.forward_graph.replay()
+            for p, norms in self.norms:
+                p.grad_sample_norms = norms
+            self.losses, ly_grads = self.static_losses, self.static_ly_grads
+        else:
+            self.ly = [V.requires_grad_() for V in ly]
+            self.losses, ly_grads = self._forward_norms(dense_x, self.ly, T, mlp_bias)
+        self.ly_host = ly_host
+        norm_backward(ly_host, emb_biases, [g.cpu() for g in ly_grads])
+        return self.losses
+
+    def clipped_backward(self, clip_factor):
+        # gradients of the MLPs (graph) and of the tables (eager backward) of sum(losses * clip_factor)
+        if self.replayed:
+            if self.backward_graph is None:
+                self._capture_backward()
+            self.static_clip.copy_(clip_factor.view(-1))
+            self.backward_graph.replay()
+            for p, grad in self.grads:
+                p.grad = grad
+            ly_grads = self.static_ly_clipped_grads
+        else:
+            ly_grads = self._clipped_backward(self.losses, self.ly, clip_factor.view(-1))
+        torch.autograd.backward(self.ly_host, [g.cpu() for g in ly_grads])
+        self.ly_host = self.ly = self.losses = None
 
 def aggregate(mean_records: torch.Tensor, indices: list):
         result = 0
@@ -53,8 +1460,60 @@ def aggregate(mean_records: torch.Tensor, indices: list):
             result += mean_records[i].item()
         return result * 1000 # unit: msec
     
+def steady_state_start(times: torch.Tensor, window: int = 5, tolerance: float = 0.05):
+    # first iteration from which the mean of "window" iterations is within "tolerance" of the median of
+    # the second half of the run, i.e., the number of warmup iterations
+    steady = times[times.shape[0] // 2:].median().item()
+    for i in range(max(times.shape[0] - window, 0) + 1):
+        if times[i:i + window].mean().item() <= steady * (1 + tolerance):
+            return i
+    return 0
+
+class NullLatencyMeter:
+    # Stand-in of LatencyMeter which records nothing (and does not synchronize the device), e.g., for the
+    # part of an iteration which runs concurrently on several threads
+    def start(self, column):
+        pass
+
+    def end(self, column):
+        pass
+
+    def start_l2(self, column):
+        pass
+
+    def end_l2(self, column):
+        pass
+
+    def add_bytes(self, column, n_bytes):
+        pass
+
+    def add_memory(self, name, n_bytes):
+        pass
+
+    def record_memory(self, name, n_bytes):
+        pass
+
 class LatencyMeter:
-    def __init__(self, mode, result_name, iters, description, result_path):
+    # timing "sync": torch.cuda.synchronize() at every boundary, i.e., wall time of each range
+    # timing "events": no synchronization, CUDA events (GPU) and a monotonic clock (CPU) are recorded and
+    # the time of a range (the longer of the two) is resolved lazily, at save() or when too many are pending
+    # native_trace: the hot paths of custom_api_cpp are traced too and dumped by save() as Chrome trace JSON
+    # next to the detailed breakdown
+    # bandwidth: the bytes moved in each range (add_bytes()) are reported by save() as the achieved GB/s of
+    # the update stages, against the peak of the STREAM triad measured here
+    # throughput: save() also reports the samples/sec and the p50/p95/p99 latency of each stage over the
+    # steady-state iterations (warmup detected by steady_state_start()), with the peak RSS and GPU memory
+    # memory: the sizes of the training state (add_memory()) and the high-water marks of each iteration
+    # (record_memory(), the categories of custom_api_cpp.memory_stats() and the GPU) are reported by save()
+    # nvtx: each range is also an NVTX range named as its column, in which the ranges of custom_api_cpp and
+    # custom_api_cuda nest when built with LAZYDP_NVTX=1 (Nsight Systems timelines by stage)
+    # itt: the hot paths of custom_api_cpp (built with LAZYDP_ITT=1) are ITT tasks, for the VTune analyses
+    # perf_stages: the hardware counters "perf_events" (custom_api_cpp.PerfCounters, the available ones) are
+    # read around these columns (CPU side, also with the "events" timing) and reported by save()
+    # energy: the joules of the RAPL zones and the GPUs (custom_api_cpp.EnergyCounters) are read around every
+    # range and at increase_iter(), and save() reports the joules per iteration and per stage in the merged result
+    def __init__(self, mode, result_name, iters, description, result_path, timing="sync", native_trace=False, bandwidth=False, throughput=False, memory=False, nvtx=False, itt=False,
+                 perf_stages=None, perf_events=None, energy=False):
         if(mode == "sgd" or mode == "dpsgd_b" or mode == "dpsgd_r" or mode == "dpsgd_f" or mode == "lazydp" or mode == "eana"):
             self.mode = mode
         else:
@@ -93,26 +1552,128 @@ class LatencyMeter:
         self.current_column = None
         self.start_time_l2 = None
         self.current_column_l2 = None
+
+        assert timing in ["sync", "events"]
+        self.timing = timing
+        self.use_events = timing == "events" and torch.cuda.is_available()
+        self.start_event = None
+        self.start_event_l2 = None
+        self.pending = [] # (row, iteration, accumulate, cpu time, start event, end event)
+
+        self.bytes = torch.zeros(self.columns_num, self.iters, dtype=torch.float64)
+        self.bandwidth = bandwidth
+        self.peak_bandwidth = custom_api_cpp.stream_triad_bandwidth(1 << 30, config.noise_final_nthreads) if bandwidth else 0
+
+        self.throughput = throughput
+        self.iter_end_times = [] # wall clock at each increase_iter()
+
+        self.memory = memory
+        self.memory_sizes = dict() # structure -> bytes
+        self.memory_records = dict() # structure -> high-water bytes of each iteration
+        if memory:
+            custom_api_cpp.memory_reset_peak()
+            if torch.cuda.is_available():
+                torch.cuda.reset_peak_memory_stats()
+
+        self.nvtx = nvtx
+        if itt:
+            assert custom_api_cpp.itt_enable(True), "custom_api_cpp is not built with LAZYDP_ITT=1"
+
+        self.perf_stages = perf_stages if perf_stages is not None else []
+        self.perf_start = dict() # column -> counts at its start()
+        if self.perf_stages:
+            assert all(stage in self.columns for stage in self.perf_stages), "unknown stage of perf_stages"
+            self.perf_counters = custom_api_cpp.PerfCounters(perf_events)
+            self.perf_events = self.perf_counters.events()
+            # (stage, event, iteration)
+            self.perf = torch.zeros(len(self.perf_stages), len(self.perf_events), self.iters, dtype=torch.float64)
+
+        self.energy = energy
+        self.energy_start = dict() # column -> joules at its start()
+        if energy:
+            self.energy_counters = custom_api_cpp.EnergyCounters()
+            self.energy_domains = self.energy_counters.domains()
+            assert len(self.energy_domains) > 0, "no readable RAPL zone or NVML GPU"
+            # (domain, column, iteration) and (domain, iteration)
+            self.energy_records = torch.zeros(len(self.energy_domains), self.columns_num, self.iters, dtype=torch.float64)
+            self.energy_iters = torch.zeros(len(self.energy_domains), self.iters, dtype=torch.float64)
+            self.energy_last = self.energy_counters.read()
+        self.native_trace = native_trace
+        if native_trace:
+            custom_api_cpp.trace_clear()
+            custom_api_cpp.trace_enable(True)
         
         self.result_name = result_name
         self.description = description
         self.result_path = result_path
         self.merged_file_path = "%s/merged_result/%s.csv" %(self.result_path, self.description)
         self.detailed_file_path = "%s/detailed_latency_breakdown/%s.csv" %(self.result_path, self.result_name)
+        # live metrics of the run (MetricsExporter), updated by increase_iter()
+        self.exporter = None
     
+    def add_bytes(self, column, n_bytes):
+        # bytes read and written in the range "column" of the current iteration
+        self.bytes[self.columns.index(column)][self.cur_iter] += n_bytes
+
+    def _event(self):
+        if not self.use_events:
+            return None
+        event = torch.cuda.Event(enable_timing=True)
+        event.record()
+        return event
+
+    def _record(self, row, accumulate, t, start_event):
+        if self.timing == "sync":
+            if accumulate:
+                self.records[row][self.cur_iter] += t
+            else:
+                self.records[row][self.cur_iter] = t
+            return
+        self.pending.append((row, self.cur_iter, accumulate, t, start_event, self._event()))
+        if len(self.pending) >= 4096:
+            self._resolve()
+
+    def _resolve(self):
+        # times of the ranges recorded by the "events" timing
+        if self.use_events:
+            torch.cuda.synchronize()
+        for row, iteration, accumulate, t, start_event, end_event in self.pending:
+            if start_event is not None:
+                t = max(t, start_event.elapsed_time(end_event) / 1000)
+            if accumulate:
+                self.records[row][iteration] += t
+            else:
+                self.records[row][iteration] = t
+        self.pending = []
+
     def start(self, column):
         assert self.start_time == None, "invalid start-end pair (start)"
         assert self.current_column == None, "invalid start-end pair (start), column"
         self.current_column = column
-        torch.cuda.synchronize()
-        self.start_time = time.time()
+        if self.timing == "sync":
+            torch.cuda.synchronize()
+        if self.nvtx:
+            torch.cuda.nvtx.range_push(column)
+        if column in self.perf_stages:
+            self.perf_start[column] = self.perf_counters.read()
+        if self.energy:
+            self.energy_start[column] = self.energy_counters.read()
+        self.start_event = self._event()
+        self.start_time = time.perf_counter()
     
     def end(self, column):
-        torch.cuda.synchronize()
-        t = time.time() - self.start_time
+        if self.timing == "sync":
+            torch.cuda.synchronize()
         assert self.start_time != None, "invalid start-end pair (end), time"
+        t = time.perf_counter() - self.start_time
+        if self.nvtx:
+            torch.cuda.nvtx.range_pop()
+        if column in self.perf_stages:
+            self.perf[self.perf_stages.index(column), :, self.cur_iter] += self.perf_counters.read() - self.perf_start.pop(column)
+        if self.energy:
+            self.energy_records[:, self.columns.index(column), self.cur_iter] += self.energy_counters.read() - self.energy_start.pop(column)
         assert self.current_column == column, "invalid start-end pair (end)"
-        self.records[self.columns.index(column)][self.cur_iter] = t
+        self._record(self.columns.index(column), False, t, self.start_event)
         self.start_time = None
         self.current_column = None
         
@@ -122,97 +1683,261 @@ class LatencyMeter:
         assert self.start_time_l2 == None, "invalid start-end pair (start)"
         assert self.current_column_l2 == None, "invalid start-end pair (start), column"
         self.current_column_l2 = column
-        torch.cuda.synchronize()
-        self.start_time_l2 = time.time()
+        if self.timing == "sync":
+            torch.cuda.synchronize()
+        if self.nvtx:
+            torch.cuda.nvtx.range_push(column)
+        if column in self.perf_stages:
+            self.perf_start[column] = self.perf_counters.read()
+        if self.energy:
+            self.energy_start[column] = self.energy_counters.read()
+        self.start_event_l2 = self._event()
+        self.start_time_l2 = time.perf_counter()
     
     def end_l2(self, column):
-        torch.cuda.synchronize()
-        t = time.time() - self.start_time_l2
+        if self.timing == "sync":
+            torch.cuda.synchronize()
         assert self.start_time_l2 != None, "invalid start-end pair (end), time"
+        t = time.perf_counter() - self.start_time_l2
+        if self.nvtx:
+            torch.cuda.nvtx.range_pop()
+        if column in self.perf_stages:
+            self.perf[self.perf_stages.index(column), :, self.cur_iter] += self.perf_counters.read() - self.perf_start.pop(column)
+        if self.energy:
+            self.energy_records[:, self.columns.index(column), self.cur_iter] += self.energy_counters.read() - self.energy_start.pop(column)
         assert self.current_column_l2 == column, "invalid start-end pair (end)"
-        self.records[self.columns.index(column)][self.cur_iter] += t
+        self._record(self.columns.index(column), True, t, self.start_event_l2)
         self.start_time_l2 = None
         self.current_column_l2 = None
     
+    def add_memory(self, name, n_bytes):
+        # size of a structure of the training state (e.g., the weight of a table), reported by save()
+        self.memory_sizes[name] = self.memory_sizes.get(name, 0) + n_bytes
+
+    def record_memory(self, name, n_bytes):
+        # bytes of a structure alive in the current iteration (e.g., the per-sample gradients)
+        if name not in self.memory_records:
+            self.memory_records[name] = torch.zeros(self.iters, dtype=torch.float64)
+        self.memory_records[name][self.cur_iter] = max(self.memory_records[name][self.cur_iter].item(), n_bytes)
+
+    def _record_memory_peaks(self):
+        for category, (_, peak) in custom_api_cpp.memory_stats().items():
+            self.record_memory("native_%s" % category, peak)
+        custom_api_cpp.memory_reset_peak()
+        if torch.cuda.is_available():
+            self.record_memory("gpu", torch.cuda.max_memory_allocated())
+            torch.cuda.reset_peak_memory_stats()
+
+    def save_memory(self, df):
+        # per-iteration high-water marks (MB) as rows of the detailed breakdown, and the sizes of the
+        # structures with the largest high-water mark of each in "<result_name>_memory.csv" next to it
+        for name, records in self.memory_records.items():
+            df.loc["mem_%s (MB)" % name] = (records[:self.iters] / 2**20).tolist()
+        index = list(self.memory_sizes.keys()) + ["peak mem_%s" % name for name in self.memory_records]
+        result = [n_bytes / 2**20 for n_bytes in self.memory_sizes.values()] + [records[:self.iters].max().item() / 2**20 for records in self.memory_records.values()]
+        pd.DataFrame({"MB": result}, index=index).to_csv("%s_memory.csv" % os.path.splitext(self.detailed_file_path)[0])
+
+    def save_delay_stats(self, stats):
+        # optimizer.stats() of LazyDP in "<result_name>_delay_stats.csv" next to the detailed breakdown, one
+        # column per table: the counters, then the rows of each delay of the histogram
+        histogram = stats["delay_histogram"]
+        index = ["unique_rows", "delayed_iters", "noise_avoided"] + ["delay_%d" % d for d in range(histogram.shape[1])]
+        columns = {"table_%d" % i: [stats["unique_rows"][i], stats["delayed_iters"][i], stats["noise_avoided"][i]] + histogram[i].tolist() for i in range(histogram.shape[0])}
+        pd.DataFrame(columns, index=index).to_csv("%s_delay_stats.csv" % os.path.splitext(self.detailed_file_path)[0])
+
     def increase_iter(self):
+        if self.memory:
+            self._record_memory_peaks()
+        if self.energy:
+            joules = self.energy_counters.read()
+            self.energy_iters[:, self.cur_iter] = joules - self.energy_last
+            self.energy_last = joules
         self.cur_iter += 1
+        self.iter_end_times.append(time.perf_counter())
+        if self.exporter is not None and self.cur_iter % self.exporter.interval == 0:
+            self.exporter.update()
+
+    def truncate(self):
+        # the run stopped before "iters" iterations (e.g., the wall-clock limit of --bench-seconds)
+        self.iters = self.cur_iter
+        self.records = self.records[:, :self.iters]
+        self.bytes = self.bytes[:, :self.iters]
+        if self.perf_stages:
+            self.perf = self.perf[:, :, :self.iters]
+        if self.energy:
+            self.energy_records = self.energy_records[:, :, :self.iters]
+            self.energy_iters = self.energy_iters[:, :self.iters]
+
+    def save_perf(self, df, window):
+        # counts of each event per iteration as rows of the detailed breakdown, and the mean of the
+        # iterations of "window" per stage (with the IPC and the memory bandwidth over the time of the
+        # stage) in "<result_name>_perf.csv" next to it
+        for s, stage in enumerate(self.perf_stages):
+            for e, event in enumerate(self.perf_events):
+                df.loc["perf_%s_%s" % (stage, event)] = self.perf[s, e].tolist()
+        summary = pd.DataFrame(index=self.perf_events + ["ipc", "mem_GB/s"])
+        for s, stage in enumerate(self.perf_stages):
+            counts = dict(zip(self.perf_events, self.perf[s, :, window].mean(dim=1).tolist()))
+            t = self.records[self.columns.index(stage), window].mean().item()
+            mem_bytes = counts.get("mem_read_bytes", 0) + counts.get("mem_write_bytes", 0)
+            counts["ipc"] = counts["instructions"] / counts["cycles"] if counts.get("cycles", 0) > 0 and "instructions" in counts else float("nan")
+            counts["mem_GB/s"] = mem_bytes / t / 1e9 if t > 0 and "mem_read_bytes" in counts else float("nan")
+            summary[stage] = [counts.get(name, float("nan")) for name in summary.index]
+        summary.to_csv("%s_perf.csv" % os.path.splitext(self.detailed_file_path)[0])
+
+    def save_energy(self, stage_rows, window):
+        # joules per iteration (each domain and their sum) and per stage, averaged over the iterations of
+        # "window", and the samples per joule, one column per run as in the merged result
+        path = "%s/merged_result/%s_energy.csv" % (self.result_path, self.description)
+        iters = self.energy_iters[:, window].mean(dim=1)
+        records = self.energy_records[:, :, window].mean(dim=2).sum(dim=0)
+        index = ["Iteration %s (J)" % domain for domain in self.energy_domains] + ["Iteration (J)"]
+        result = iters.tolist() + [iters.sum().item()]
+        for stage, rows in stage_rows.items():
+            index.append("%s (J)" % stage)
+            result.append(records[rows].sum().item())
+        index.append("Samples/J")
+        result.append(config.batch_size / iters.sum().item() if iters.sum().item() > 0 else 0)
+        df = pd.DataFrame({self.result_name: result}, index=index)
+        if os.path.isfile(path):
+            df = pd.concat([pd.read_csv(path, header=0, index_col=0), df], axis=1)
+        df.to_csv(path)
+
+    def save_throughput(self, stage_rows):
+        # samples/sec and latency percentiles (ms) of each stage over the steady-state iterations, one
+        # column per run as in the merged result. The wall time of an iteration is the time between two
+        # increase_iter() (the first one has none), LazyDP's last iteration (no next batch) is excluded
+        path = "%s/merged_result/%s_throughput.csv" % (self.result_path, self.description)
+        n = self.iters - 1 if self.mode == "lazydp" else self.iters
+        assert n >= 2, "too few iterations"
+        end_times = torch.tensor(self.iter_end_times[:n], dtype=torch.float64)
+        wall = end_times[1:] - end_times[:-1] # iterations 1 ~ n-1
+        w = steady_state_start(wall)
+        warmup = w + 1
+
+        index = ["Samples/sec", "Warmup iterations", "Steady-state iterations"]
+        result = [config.batch_size * (n - warmup) / wall[w:].sum().item(), warmup, n - warmup]
+        stages = {"Iteration": wall.view(1, -1) * 1000}
+        for stage, rows in stage_rows.items():
+            stages[stage] = torch.tensor([[aggregate(self.records[:, t], rows) for t in range(1, n)]], dtype=torch.float64)
+        for stage, times in stages.items():
+            steady = times[0, w:]
+            for q in [50, 95, 99]:
+                index.append("%s p%d (ms)" % (stage, q))
+                result.append(torch.quantile(steady, q / 100).item())
+        index += ["Peak RSS (MB)", "Peak GPU memory (MB)"]
+        result.append(resource.getrusage(resource.RUSAGE_SELF).ru_maxrss / 1024)
+        result.append(torch.cuda.max_memory_allocated() / 2**20 if torch.cuda.is_available() else 0)
+
+        df = pd.DataFrame({self.result_name: result}, index=index)
+        if os.path.isfile(path):
+            df = pd.concat([pd.read_csv(path, header=0, index_col=0), df], axis=1)
+        df.to_csv(path)
     
+    def save_bandwidth(self, mean_records, mean_bytes, stage_columns):
+        # achieved GB/s of the update stages (bytes moved / time) and the STREAM triad peak,
+        # one column per run as in the merged result
+        path = "%s/merged_result/%s_bandwidth.csv" % (self.result_path, self.description)
+        index = ["%s (GB/s)" % stage for stage in stage_columns] + ["Peak (GB/s)"]
+        result = []
+        for stage, columns in stage_columns.items():
+            t = aggregate(mean_records, columns)
+            result.append(float(aggregate(mean_bytes, columns)) / t / 1e9 if t > 0 else 0)
+        result.append(self.peak_bandwidth)
+        df = pd.DataFrame({self.result_name: result}, index=index)
+        if os.path.isfile(path):
+            df = pd.concat([pd.read_csv(path, header=0, index_col=0), df], axis=1)
+        df.to_csv(path)
+
     def save(self):
         assert self.cur_iter == self.iters, "save only all iterations are done"
+        self._resolve()
         index = self.columns
         columns = torch.arange(self.iters).tolist()
         df = pd.DataFrame(self.records, columns=columns, index=index)
+        if self.memory:
+            self.save_memory(df)
+        if self.perf_stages:
+            # the steady-state iterations of the mean breakdown below
+            self.save_perf(df, slice(-11, -1) if self.mode == "lazydp" else slice(-10, None))
         df.to_csv("%s" %self.detailed_file_path)
+        if self.native_trace:
+            custom_api_cpp.trace_dump("%s_trace.json" % os.path.splitext(self.detailed_file_path)[0])
         
         if self.mode != "lazydp":
             mean_records = self.records[:, -10:].mean(dim=1)
+            mean_bytes = self.bytes[:, -10:].mean(dim=1)
         elif self.mode == "lazydp":
             mean_records = self.records[:, -11:-1].mean(dim=1)
+            mean_bytes = self.bytes[:, -11:-1].mean(dim=1)
         else:
             assert False
             
         assert mean_records.shape[0] == self.columns_num
         
         # Entire breakdown
-        fwd = aggregate(mean_records, [0, 1, 2, 3, 4, 5, 6, 7])
         if self.mode == "sgd":
-            bwd_example = 0
-            bwd_batch = aggregate(mean_records, [11])
-            update = aggregate(mean_records, [8, 12, 10])
+            bwd_example_rows = []
+            bwd_batch_rows = [11]
+            update_rows = [8, 12, 10]
         elif self.mode == "dpsgd_b":
-            bwd_example = aggregate(mean_records, [9, 10, 14])
-            bwd_batch = 0
-            update = aggregate(mean_records, [8, 15, 16, 17, 18, 19, 20, 13]) # 12 -> 17, 18, 19, 20
+            bwd_example_rows = [9, 10, 14]
+            bwd_batch_rows = []
+            update_rows = [8, 15, 16, 17, 18, 19, 20, 13] # 12 -> 17, 18, 19, 20
         elif self.mode in ["dpsgd_r", "dpsgd_f", "eana"]:
-            bwd_example = aggregate(mean_records, [9, 10, 11])
-            bwd_batch = aggregate(mean_records, [16])
-            update = aggregate(mean_records, [8, 17, 13, 18, 19, 20, 21, 15]) # 14 -> 18, 19, 20, 21
+            bwd_example_rows = [9, 10, 11]
+            bwd_batch_rows = [16]
+            update_rows = [8, 17, 13, 18, 19, 20, 21, 15] # 14 -> 18, 19, 20, 21
         elif self.mode == "lazydp":
-            bwd_example = aggregate(mean_records, [9, 11, 12])
-            bwd_batch = aggregate(mean_records, [20])
-            update = aggregate(mean_records, [8, 10, 14, 21, 22, 23, 16, 24, 25, 26, 18, 19]) # 15 -> 21, 22, 23 / 17 -> 24, 25, 26
+            bwd_example_rows = [9, 11, 12]
+            bwd_batch_rows = [20]
+            update_rows = [8, 10, 14, 21, 22, 23, 16, 24, 25, 26, 18, 19] # 15 -> 21, 22, 23 / 17 -> 24, 25, 26
         else:
             assert False
+        fwd = aggregate(mean_records, [0, 1, 2, 3, 4, 5, 6, 7])
+        bwd_example = aggregate(mean_records, bwd_example_rows)
+        bwd_batch = aggregate(mean_records, bwd_batch_rows)
+        update = aggregate(mean_records, update_rows)
             
         # Update breakdown
         if self.mode == "sgd":
-            coalesce = aggregate(mean_records, [12])
+            stage_columns = {"Gradient coalesce": [12], "Noise sampling": [], "Noisy gradient generation": [], "Model parameter update": [10]}
             noise_identify = aggregate(mean_records, [])
-            noise_sampling = aggregate(mean_records, [])
-            merging = aggregate(mean_records, [])
-            model_parameter_update = aggregate(mean_records, [10])
             metadata_update = aggregate(mean_records, [])
             overhead = noise_identify + metadata_update
             else_ = aggregate(mean_records, [8])
         elif self.mode == "dpsgd_b":
-            coalesce = aggregate(mean_records, [15])
+            stage_columns = {"Gradient coalesce": [15], "Noise sampling": [17, 19], "Noisy gradient generation": [18, 20], "Model parameter update": [13]}
             noise_identify = aggregate(mean_records, [])
-            noise_sampling = aggregate(mean_records, [17, 19])
-            merging = aggregate(mean_records, [18, 20])
-            model_parameter_update = aggregate(mean_records, [13])
             metadata_update = aggregate(mean_records, [])
             overhead = noise_identify + metadata_update
             else_ = aggregate(mean_records, [8, 16])
         elif self.mode in ["dpsgd_r", "dpsgd_f", "eana"]:
-            coalesce = aggregate(mean_records, [17])
+            stage_columns = {"Gradient coalesce": [17], "Noise sampling": [18, 20], "Noisy gradient generation": [19, 21], "Model parameter update": [15]}
             noise_identify = aggregate(mean_records, [])
-            noise_sampling = aggregate(mean_records, [18, 20])
-            merging = aggregate(mean_records, [19, 21])
-            model_parameter_update = aggregate(mean_records, [15])
             metadata_update = aggregate(mean_records, [])
             overhead = noise_identify + metadata_update
             else_ = aggregate(mean_records, [8, 13])
         elif self.mode == "lazydp":
-            coalesce = aggregate(mean_records, [26])
+            stage_columns = {"Gradient coalesce": [26], "Noise sampling": [21, 24], "Noisy gradient generation": [22, 25], "Model parameter update": [18]}
             noise_identify = aggregate(mean_records, [16])
-            noise_sampling = aggregate(mean_records, [21, 24])
-            merging = aggregate(mean_records, [22, 25])
-            model_parameter_update = aggregate(mean_records, [18])
             metadata_update = aggregate(mean_records, [10, 19])
             overhead = noise_identify + metadata_update
             else_ = aggregate(mean_records, [8, 23, 14])
         else:
             assert False
+        coalesce = aggregate(mean_records, stage_columns["Gradient coalesce"])
+        noise_sampling = aggregate(mean_records, stage_columns["Noise sampling"])
+        merging = aggregate(mean_records, stage_columns["Noisy gradient generation"])
+        model_parameter_update = aggregate(mean_records, stage_columns["Model parameter update"])
+        if self.bandwidth:
+            self.save_bandwidth(mean_records, mean_bytes, stage_columns)
+        stage_rows = {"Fwd": [0, 1, 2, 3, 4, 5, 6, 7], "Bwd(per-example)": bwd_example_rows, "Bwd(per-batch)": bwd_batch_rows, "Update": update_rows}
+        stage_rows.update(stage_columns)
+        if self.throughput:
+            self.save_throughput(stage_rows)
+        if self.energy:
+            self.save_energy(stage_rows, slice(-11, -1) if self.mode == "lazydp" else slice(-10, None))
             
         if os.path.isfile(self.merged_file_path):
             past_result = pd.read_csv(self.merged_file_path, header=0, index_col=0)
@@ -227,4 +1952,164 @@ class LatencyMeter:
         new_result = torch.cat([past_result_value, additional_result], dim=1)
         df_2 = pd.DataFrame(new_result, columns=past_columns + ["%s" % self.result_name], index=["Fwd", "Bwd(per-example)", "Bwd(per-batch)", "Update", "Gradient coalesce", "Noise sampling", "Noisy gradient generation", "Model parameter update", "Overhead", "Else", "test"])
         df_2.to_csv(self.merged_file_path)
-    
\ No newline at end of file
+    
+class MetricsExporter:
+    # Live metrics of a run in the Prometheus text format, served at http://<host>:<port>/metrics and/or
+    # pushed to a Pushgateway ("push_url", e.g. http://gateway:9091) every "push_seconds":
+    # the latency histogram of each stage of the LatencyMeter (and of the iteration), the bytes moved in
+    # each stage (add_bytes(), e.g. the noise sampled in generate_noise_*), the samples/sec since the last
+    # update and, from the callables given, the epsilon spent, the unique rows of each table in the last
+    # batch and the counters of the delayed noise (optimizer.stats()).
+    # update() is called by LatencyMeter.increase_iter() every "interval" iterations only: it folds the
+    # records of the finished iterations into the histograms (resolving the pending ranges of the "events"
+    # timing, i.e., one synchronization per interval) and renders the page, which the HTTP and push threads
+    # only read
+    BUCKETS = [1e-4 * 2**i for i in range(18)] # 0.1 ms ~ 13 s
+
+    def __init__(self, profiler, port=None, push_url=None, push_seconds=15, interval=10, labels=None, epsilon=None, unique_rows=None, delay_stats=None):
+        assert port is not None or push_url is not None
+        self.profiler = profiler
+        self.interval = interval
+        self.labels = dict(labels) if labels is not None else dict()
+        self.epsilon = epsilon
+        self.unique_rows = unique_rows
+        self.delay_stats = delay_stats
+
+        n = profiler.columns_num
+        self.bounds = torch.tensor(self.BUCKETS, dtype=torch.float64)
+        self.stage_counts = torch.zeros(n, len(self.BUCKETS) + 1, dtype=torch.int64) # the last bucket is +Inf
+        self.stage_sums = torch.zeros(n, dtype=torch.float64)
+        self.stage_bytes = torch.zeros(n, dtype=torch.float64)
+        self.stage_seen = torch.zeros(n, dtype=torch.bool)
+        self.iter_counts = torch.zeros(len(self.BUCKETS) + 1, dtype=torch.int64)
+        self.iter_sum = 0.0
+        self.done = 0 # iterations folded into the histograms
+        self.last_end = None
+        self.samples_per_sec = 0.0
+
+        self.lock = threading.Lock()
+        self.page = b""
+        self.closed = threading.Event()
+        self.server = None
+        if port is not None:
+            import http.server
+            exporter = self
+
+            class Handler(http.server.BaseHTTPRequestHandler):
+                def do_GET(self):
+                    if self.path.split("?")[0] != "/metrics":
+                        self.send_error(404)
+                        return
+                    with exporter.lock:
+                        page = exporter.page
+                    self.send_response(200)
+                    self.send_header("Content-Type", "text/plain; version=0.0.4")
+                    self.send_header("Content-Length", str(len(page)))
+                    self.end_headers()
+                    self.wfile.write(page)
+
+                def log_message(self, format, *args):
+                    pass
+
+            self.server = http.server.ThreadingHTTPServer(("", port), Handler)
+            self.server.daemon_threads = True
+            threading.Thread(target=self.server.serve_forever, daemon=True).start()
+        self.push_thread = None
+        if push_url is not None:
+            url = "%s/metrics/job/lazydp" % push_url.rstrip("/")
+            for name, value in self.labels.items():
+                url += "/%s/%s" % (name, value)
+            self.push_thread = threading.Thread(target=self._push, args=(url, push_seconds), daemon=True)
+            self.push_thread.start()
+
+    def _push(self, url, seconds):
+        import urllib.request
+        while True:
+            stop = self.closed.wait(seconds)
+            with self.lock:
+                page = self.page
+            if page:
+                try:
+                    urllib.request.urlopen(urllib.request.Request(url, data=page, method="PUT"), timeout=seconds)
+                except OSError as e:
+                    warnings.warn("metrics push to %s failed: %s" % (url, e))
+            if stop:
+                return
+
+    def _bucket_counts(self, times):
+        # number of the values of each row of "times" in each bucket (upper bounds inclusive, as "le")
+        buckets = torch.searchsorted(self.bounds, times.contiguous())
+        counts = torch.zeros(times.shape[0], len(self.BUCKETS) + 1, dtype=torch.int64)
+        return counts.scatter_add_(1, buckets, torch.ones_like(buckets))
+
+    def update(self):
+        p = self.profiler
+        if p.pending:
+            p._resolve()
+        lo, hi = self.done, p.cur_iter
+        if hi > lo:
+            records = p.records[:, lo:hi].double()
+            self.stage_counts += self._bucket_counts(records)
+            self.stage_sums += records.sum(dim=1)
+            self.stage_bytes += p.bytes[:, lo:hi].sum(dim=1)
+            self.stage_seen |= (records > 0).any(dim=1)
+            end_times = ([] if self.last_end is None else [self.last_end]) + p.iter_end_times[lo:hi]
+            if len(end_times) >= 2:
+                wall = torch.tensor(end_times, dtype=torch.float64).diff()
+                self.iter_counts += self._bucket_counts(wall.view(1, -1))[0]
+                self.iter_sum += wall.sum().item()
+                self.samples_per_sec = config.batch_size * wall.numel() / wall.sum().item()
+            self.last_end = end_times[-1]
+            self.done = hi
+        page = self._render().encode()
+        with self.lock:
+            self.page = page
+
+    def _label(self, **labels):
+        labels = {**self.labels, **labels}
+        return "{%s}" % ",".join('%s="%s"' % item for item in labels.items()) if labels else ""
+
+    def _histogram(self, lines, name, counts, total, **labels):
+        cumulative = counts.cumsum(0).tolist()
+        for bound, n in zip(self.BUCKETS + ["+Inf"], cumulative):
+            lines.append("%s_bucket%s %d" % (name, self._label(**labels, le=bound if bound == "+Inf" else "%g" % bound), n))
+        lines.append("%s_sum%s %.9g" % (name, self._label(**labels), total))
+        lines.append("%s_count%s %d" % (name, self._label(**labels), cumulative[-1]))
+
+    def _render(self):
+        lines = ["# TYPE lazydp_iterations_total counter", "lazydp_iterations_total%s %d" % (self._label(), self.done)]
+        lines += ["# TYPE lazydp_samples_per_second gauge", "lazydp_samples_per_second%s %.6g" % (self._label(), self.samples_per_sec)]
+        lines.append("# TYPE lazydp_iteration_seconds histogram")
+        self._histogram(lines, "lazydp_iteration_seconds", self.iter_counts, self.iter_sum)
+        lines.append("# TYPE lazydp_stage_seconds histogram")
+        for i in self.stage_seen.nonzero().view(-1).tolist():
+            self._histogram(lines, "lazydp_stage_seconds", self.stage_counts[i], self.stage_sums[i].item(), stage=self.profiler.columns[i])
+        lines.append("# TYPE lazydp_stage_bytes_total counter")
+        for i in (self.stage_bytes > 0).nonzero().view(-1).tolist():
+            lines.append("lazydp_stage_bytes_total%s %.17g" % (self._label(stage=self.profiler.columns[i]), self.stage_bytes[i].item()))
+        if self.epsilon is not None:
+            lines += ["# TYPE lazydp_epsilon gauge", "lazydp_epsilon%s %.6g" % (self._label(), self.epsilon())]
+        if self.unique_rows is not None:
+            rows = self.unique_rows()
+            if rows is not None:
+                lines.append("# TYPE lazydp_unique_rows gauge")
+                lines += ["lazydp_unique_rows%s %d" % (self._label(table=i), n) for i, n in enumerate(rows)]
+        if self.delay_stats is not None:
+            stats = self.delay_stats()
+            for key, name in [("unique_rows", "noised_rows"), ("delayed_iters", "delayed_iterations"), ("noise_avoided", "noise_avoided_elements")]:
+                lines.append("# TYPE lazydp_%s_total counter" % name)
+                lines += ["lazydp_%s_total%s %d" % (name, self._label(table=i), n) for i, n in enumerate(stats[key])]
+            lines.append("# TYPE lazydp_delay_rows gauge")
+            for i, histogram in enumerate(stats["delay_histogram"].tolist()):
+                lines += ["lazydp_delay_rows%s %d" % (self._label(table=i, delay=d), n) for d, n in enumerate(histogram) if n > 0]
+        return "\n".join(lines) + "\n"
+
+    def close(self):
+        # the last update is rendered (and pushed) before the threads stop
+        self.update()
+        self.closed.set()
+        if self.push_thread is not None:
+            self.push_thread.join()
+        if self.server is not None:
+            self.server.shutdown()
+            self.server.server_close()
@@ -262,11 +262,23 @@ def _single_tensor_sgd(params: List[Tensor],
                 d_p = buf
 
         if d_p.is_sparse:
-            param[d_p.indices().view(-1)] += (d_p.values()*(-lr))
+            if not _native_sparse_add_(param, d_p, -lr):
+                param[d_p.indices().view(-1)] += (d_p.values()*(-lr))
         else:
             param.add_(d_p, alpha=-lr)
 
 
+def _native_sparse_add_(param: Tensor, grad: Tensor, alpha: float) -> bool:
+    # param += alpha * grad for the coalesced sparse gradient of a CPU fp32 table, by
+    # custom_api_cpp.sparse_sgd_update (parallel over rows, with software prefetching). False if not applicable
+    if not (grad.is_coalesced() and param.device.type == 'cpu' and param.dtype == torch.float and param.dim() == 2
+            and param.is_contiguous() and grad.values().dtype == torch.float):
+        return False
+    import custom_api_cpp
+    custom_api_cpp.sparse_sgd_update(param.data, grad.indices().view(-1), grad.values().contiguous(), -alpha, torch.get_num_threads())
+    return True
+
+
 def _multi_tensor_sgd(params: List[Tensor],
                       grads: List[Tensor],
                       momentum_buffer_list: List[Optional[Tensor]],
@@ -332,4 +344,5 @@ def _multi_tensor_sgd(params: List[Tensor],
         else:
             # foreach APIs don't support sparse
             for i in range(len(device_params)):
-                device_params[i].add_(device_grads[i], alpha=-lr)
+                if not (device_grads[i].is_sparse and _native_sparse_add_(device_params[i], device_grads[i], -lr)):
+                    device_params[i].add_(device_grads[i], alpha=-lr)
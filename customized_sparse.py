@@ -223,6 +223,75 @@ class Embedding(Module):
         return embedding
 
 
+class _OutputAnchor(torch.autograd.Function):
+    # Identity on the output of a layer, connected to a zero-size leaf (the anchor). A backward towards
+    # the anchor walks the graph through the output, so that the backward hooks of the layer see
+    # dL/d(output), without adding a zero bias to it (an elementwise kernel and an output per layer).
+    @staticmethod
+    def forward(ctx, output, anchor):
+        return output.view_as(output)
+
+    @staticmethod
+    def backward(ctx, grad_output):
+        return grad_output, grad_output.new_zeros(0)
+
+
+def output_anchor(device=None) -> Tensor:
+    r"""Returns a zero-size leaf for :func:`anchored_output` (the ``emb_bias`` of :meth:`EmbeddingBag.forward`)."""
+    return torch.zeros(0, device=device, requires_grad=True)
+
+
+def anchored_output(output: Tensor, anchor: Optional[Tensor]) -> Tensor:
+    r"""Connects :attr:`output` to :attr:`anchor`: an :func:`output_anchor`, or a zero bias added to the output."""
+    if anchor is None:
+        return output
+    if anchor.numel() == 0:
+        return _OutputAnchor.apply(output, anchor)
+    return anchor + output
+
+
+class _PooledEmbeddingBag(torch.autograd.Function):
+    # Output of a sum-mode, sparse EmbeddingBag computed beforehand (e.g., by
+    # custom_api_cpp.embedding_bag_multi_table for all tables at once). The gradient of the weight
+    # is the uncoalesced sparse gradient of F.embedding_bag(..., sparse=True): a row per index.
+    @staticmethod
+    def forward(ctx, weight, pooled, input, offsets):
+        ctx.save_for_backward(input, offsets)
+        ctx.weight_shape = weight.shape
+        return pooled
+
+    @staticmethod
+    def backward(ctx, grad_output):
+        input, offsets = ctx.saved_tensors
+        lengths = torch.diff(offsets.long(), append=torch.tensor([input.numel()]))
+        bag_of_index = torch.repeat_interleave(torch.arange(offsets.numel()), lengths)
+        grad_weight = torch.sparse_coo_tensor(input.long().view(1, -1), grad_output.index_select(0, bag_of_index), ctx.weight_shape)
+        return grad_weight, None, None, None
+
+
+class _DedupEmbeddingBag(torch.autograd.Function):
+    # Sum-mode, sparse EmbeddingBag reading each distinct row once: the unique rows of the input are
+    # gathered into a compact buffer, which the bags are pooled from through the inverse of the input.
+    # The gradient of the weight is coalesced by construction (a row per unique index, summed through
+    # the inverse), instead of the row per index of F.embedding_bag(..., sparse=True).
+    @staticmethod
+    def forward(ctx, weight, input, offsets, unique, inverse):
+        compact = weight.index_select(0, unique)
+        ctx.save_for_backward(input, offsets, unique, inverse)
+        ctx.weight_shape = weight.shape
+        return F.embedding_bag(inverse.view(-1), compact, offsets, mode="sum")
+
+    @staticmethod
+    def backward(ctx, grad_output):
+        input, offsets, unique, inverse = ctx.saved_tensors
+        lengths = torch.diff(offsets.long(), append=torch.tensor([input.numel()], device=offsets.device))
+        bag_of_index = torch.repeat_interleave(torch.arange(offsets.numel(), device=offsets.device), lengths)
+        values = grad_output.new_zeros((unique.numel(), grad_output.shape[1]))
+        values.index_add_(0, inverse.view(-1), grad_output.index_select(0, bag_of_index))
+        grad_weight = torch.sparse_coo_tensor(unique.long().view(1, -1), values, ctx.weight_shape)._coalesced_(True)
+        return grad_weight, None, None, None, None
+
+
 class EmbeddingBag(Module):
     r"""Computes sums or means of 'bags' of embeddings, without instantiating the
     intermediate embeddings.
@@ -355,7 +424,18 @@ class EmbeddingBag(Module):
             with torch.no_grad():
                 self.weight[self.padding_idx].fill_(0)
 
-    def forward(self, input: Tensor, emb_bias: Tensor = None, offsets: Optional[Tensor] = None, per_sample_weights: Optional[Tensor] = None) -> Tensor:
+    def map_table_file(self, path: str, shared: bool = False) -> None:
+        r"""Replaces the weight with a raw table file (``custom_api_cpp.write_table_file``)
+        mapped via mmap, without reading or copying it. With ``shared=False`` the mapping
+        is copy-on-write, so training never modifies the file.
+        """
+        import custom_api_cpp
+        weight, _ = custom_api_cpp.map_table_file(path, shared)
+        assert list(weight.shape) == [self.num_embeddings, self.embedding_dim], \
+            'Shape of weight does not match num_embeddings and embedding_dim'
+        self.weight = Parameter(weight)
+
+    def forward(self, input: Tensor, emb_bias: Tensor = None, offsets: Optional[Tensor] = None, per_sample_weights: Optional[Tensor] = None, pooled: Optional[Tensor] = None, dedup: Optional[tuple] = None) -> Tensor:
         """Forward pass of EmbeddingBag.
 
         Args:
@@ -385,19 +465,48 @@ class EmbeddingBag(Module):
               starting index positions of each bag in :attr:`input`. Therefore, for :attr:`offsets` of shape `(B)`,
               :attr:`input` will be viewed as having ``B`` bags. Empty bags (i.e., having 0-length) will have
               returned vectors filled by zeros.
+
+            - :attr:`emb_bias`, if given, connects the output to a leaf for the norm-only backward of
+              DP-SGD(F)/LazyDP (:func:`anchored_output`): an :func:`output_anchor`, or a zero bias added to it.
+
+            - :attr:`pooled`, if given, is the output already pooled from :attr:`input` and :attr:`offsets`
+              (``mode="sum"``, ``sparse=True``, no :attr:`per_sample_weights`), which is only connected to
+              the weight for the backward pass.
+
+            - :attr:`dedup`, if given, is the (sorted unique indices, inverse) of :attr:`input`
+              (``mode="sum"``, ``sparse=True``, no :attr:`per_sample_weights`): each unique row is read once
+              and the gradient of the weight is coalesced over the unique indices.
         """
-        if emb_bias is None:
-            return F.embedding_bag(input, self.weight, offsets,
+        # the weights of this forward are read by the hooks of GradSampleModule (per-sample gradient norms)
+        self.per_sample_weights = per_sample_weights.detach() if per_sample_weights is not None else None
+        if pooled is not None:
+            assert self.mode == "sum" and self.sparse and per_sample_weights is None
+            output = _PooledEmbeddingBag.apply(self.weight, pooled, input, offsets)
+            return anchored_output(output, emb_bias)
+        if dedup is not None:
+            assert self.mode == "sum" and self.sparse and per_sample_weights is None
+            output = _DedupEmbeddingBag.apply(self.weight, input, offsets, *dedup)
+            return anchored_output(output, emb_bias)
+        if getattr(self, "row_cache", None) is not None:
+            # hot rows held by custom_utils.HotRowCache
+            cache, k = self.row_cache
+            return cache.forward(k, self, input, emb_bias, offsets, per_sample_weights)
+        if getattr(self, "int8_table", None) is not None:
+            # row-wise int8 table (custom_utils.RowwiseInt8Table)
+            return self.int8_table.forward(self, input, emb_bias, offsets, per_sample_weights)
+        if self.weight.dtype != torch.float:
+            # reduced-precision tables (config.emb_precision): the pooled output is upcasted to fp32
+            output = F.embedding_bag(input, self.weight, offsets,
                                self.max_norm, self.norm_type,
                                self.scale_grad_by_freq, self.mode, self.sparse,
                                per_sample_weights, self.include_last_offset,
-                               self.padding_idx)
-        else:
-            return emb_bias + F.embedding_bag(input, self.weight, offsets,
+                               self.padding_idx).float()
+            return anchored_output(output, emb_bias)
+        return anchored_output(F.embedding_bag(input, self.weight, offsets,
                                self.max_norm, self.norm_type,
                                self.scale_grad_by_freq, self.mode, self.sparse,
                                per_sample_weights, self.include_last_offset,
-                               self.padding_idx)
+                               self.padding_idx), emb_bias)
 
     def extra_repr(self) -> str:
         s = '{num_embeddings}, {embedding_dim}'
@@ -240,6 +240,51 @@ class CriteoBinDataset(Dataset):
         self.file.close()
 
 
+class CriteoBinLoader:
+    """
+    Native reader of the binary dataset (same file as CriteoBinDataset) yielding
+    (X, lS_o, lS_i split per table, T), with the next batch decoded in the background
+    while the current one is consumed. With Poisson sampling, each batch takes every
+    row of the dataset independently with probability batch_size / n_samples.
+    With shuffle_buffer > 0, the file is streamed instead (out-of-core): chunks of
+    chunk_rows rows in a random order feed a shuffle buffer of shuffle_buffer rows.
+    """
+
+    def __init__(self, data_file, batch_size, num_batches=0, max_ind_range=-1,
+                 poisson_sampling=False, seed=0, int32_indices=False, nthreads=32,
+                 shuffle_buffer=0, chunk_rows=1 << 20):
+        import custom_api_cpp  # only this loader needs the extension
+        tot_fea = 1 + 13 + 26
+        self.n_samples = os.path.getsize(data_file) // (4 * tot_fea)
+        self.stream = None
+        if shuffle_buffer > 0:
+            # a shuffle buffer does not sample batches uniformly at random
+            assert not poisson_sampling
+            self.stream = custom_api_cpp.CriteoBinStream(data_file, batch_size, shuffle_buffer, chunk_rows, max_ind_range, seed, int32_indices, nthreads)
+            self.reader = self.stream
+        else:
+            sample_rate = batch_size / self.n_samples if poisson_sampling else 0.0
+            self.reader = custom_api_cpp.CriteoBinReader(data_file, batch_size, max_ind_range, sample_rate, seed, int32_indices, nthreads)
+        self.batch_size = batch_size
+        self.num_batches = num_batches if num_batches > 0 else self.reader.n_batches()
+        self.m_den = 13
+
+    def __iter__(self):
+        if self.stream is not None:
+            for k in range(self.num_batches):
+                yield self.stream.next()
+            return
+        self.reader.submit(0)
+        for k in range(self.num_batches):
+            batch = self.reader.wait()
+            if k + 1 < self.num_batches:
+                self.reader.submit(k + 1)
+            yield batch
+
+    def __len__(self):
+        return self.num_batches
+
+
 def numpy_to_binary(input_files, output_file_path, split='train'):
     """Convert the data to a binary format to be read with CriteoBinDataset."""
 
@@ -730,12 +730,18 @@ def make_random_data_and_loader(args, ln_emb, m_den,
         rand_seed=args.numpy_rand_seed
     )  # WARNING: generates a batch of lookups at once
 
+    # test batches of --test-mini-batch-size (e.g., larger than the training ones for the evaluation
+    # passes), as many samples as the training set
+    test_mini_batch_size = args.test_mini_batch_size if args.test_mini_batch_size > 0 else args.mini_batch_size
+    test_num_batches = args.num_batches
+    if args.num_batches > 0:
+        test_num_batches = max(1, args.num_batches * args.mini_batch_size // test_mini_batch_size)
     test_data = RandomDataset(
         m_den,
         ln_emb,
         args.data_size,
-        args.num_batches,
-        args.mini_batch_size,
+        test_num_batches,
+        test_mini_batch_size,
         args.num_indices_per_lookup,
         args.num_indices_per_lookup_fixed,
         1,  # num_targets
@@ -770,7 +776,7 @@ def make_random_data_and_loader(args, ln_emb, m_den,
         test_data,
         batch_size=1,
         shuffle=False,
-        num_workers=args.num_workers,
+        num_workers=args.test_num_workers if args.test_num_workers >= 0 else args.num_workers,
         collate_fn=collate_wrapper_random,
         pin_memory=False,
         drop_last=False,  # True
@@ -132,8 +132,9 @@ else:
 
 import config
 from config import MODE_SGD, MODE_DPSGD_B, MODE_DPSGD_R, MODE_DPSGD_F, MODE_EANA
-from custom_utils import LatencyMeter
+from custom_utils import LatencyMeter, norm_backward, fused_dot_interaction, mlp_autocast, coalesce, init_pool, move_emb_to_huge_pages, prefault_emb_tables, save_model_with_table_files, load_model_with_table_files, SharedBatchRing, SharedBatchLoader
 from opacus import PrivacyEngine
+from opacus.layers import DPLinear
 
 from torch.utils.data import DataLoader, Dataset
 
@@ -289,7 +290,7 @@ class DLRM_Net(nn.Module):
             m = ln[i + 1]
 
             # construct fully connected operator
-            LL = nn.Linear(int(n), int(m), bias=True)
+            LL = (DPLinear if config.mlp_layer == "dp_linear" else nn.Linear)(int(n), int(m), bias=True)
 
             # initialize the weights
             # with torch.no_grad():
@@ -575,6 +576,12 @@ class DLRM_Net(nn.Module):
 
     def interact_features(self, x, ly):
 
+        if self.arch_interaction_op == "dot" and config.interaction_optimize == "fused":
+            # a single CUDA kernel (None when the features do not fit it)
+            R = fused_dot_interaction(x, ly, self.arch_interaction_itself)
+            if R is not None:
+                return R
+
         if self.arch_interaction_op == "dot":
             # concatenate dense and sparse features
             (batch_size, d) = x.shape
@@ -682,7 +689,8 @@ class DLRM_Net(nn.Module):
     def sequential_forward(self, dense_x, lS_o, lS_i, emb_biases):
         # process dense features (using bottom mlp), resulting in a row vector
         config.profiler.start("FW_bottom_mlp")
-        x = self.apply_mlp(dense_x, self.bot_l)
+        with mlp_autocast():
+            x = self.apply_mlp(dense_x, self.bot_l)
         config.profiler.end("FW_bottom_mlp")
         # debug prints
         # print("intermediate")
@@ -704,13 +712,15 @@ class DLRM_Net(nn.Module):
         config.profiler.end("FW_emb_cpu_to_gpu")
 
         config.profiler.start("FW_interact")
-        z = self.interact_features(x, ly)
+        with mlp_autocast():
+            z = self.interact_features(x, ly)
         config.profiler.end("FW_interact")
         # print(z.detach().cpu().numpy())
 
         # obtain probability of a click (using top mlp)
         config.profiler.start("FW_top_mlp")
-        p = self.apply_mlp(z, self.top_l)
+        with mlp_autocast():
+            p = self.apply_mlp(z, self.top_l).float()
         config.profiler.end("FW_top_mlp")
         
         # clamp output if needed
@@ -1015,6 +1025,8 @@ def set_config(args):
     if config.num_gathers >= 10:
         config.coalesce_optimize = "multi_thread_openmp"
         config.unique_optimize = "multi_thread"
+    if args.coalesce_optimize is not None:
+        config.coalesce_optimize = args.coalesce_optimize
         
     # training algoirthm
     if args.dpsgd_mode == "sgd":
@@ -1048,7 +1060,10 @@ def set_config(args):
         
     result_name = "%s_%s_s_%.3f_B_%d_L_%d_%s" % (args.model_config, args.locality, args.emb_scale, args.mini_batch_size, args.num_indices_per_lookup, args.dpsgd_mode)
         
-    config.profiler = LatencyMeter(args.dpsgd_mode, result_name, args.num_batches, args.description, "%s/result" %args.path_lazydp)
+    perf_stages = args.perf_stages.split(",") if args.perf_stages is not None else None
+    config.profiler = LatencyMeter(args.dpsgd_mode, result_name, args.num_batches, args.description, "%s/result" %args.path_lazydp, args.profiler_timing, args.native_trace, args.report_bandwidth,
+                                   args.report_throughput or args.bench_seconds > 0, args.report_memory, args.nvtx, args.itt,
+                                   perf_stages, args.perf_events.split(","), args.report_energy)
 
     config.disable_poisson_sampling = args.disable_poisson_sampling #TODO:
     if not config.disable_poisson_sampling:
@@ -1056,6 +1071,75 @@ def set_config(args):
         
     config.is_debugging = args.is_debugging
     config.debugging_type = args.debugging_type
+
+    config.noise_rng = args.noise_rng
+    config.noise_seed = args.noise_seed
+    # the noise pool (config.noise_rng == "pool") is a LazyDP-only experiment
+    assert config.noise_rng in ["torch", "philox"]
+    config.eana_noise_optimize = args.eana_noise_optimize
+    if config.eana_noise_optimize == "fused":
+        # the noise of a row is keyed by its index, sampled in the coalesce of the CPU-resident tables
+        assert config.dpsgd_mode == MODE_EANA and config.noise_rng == "philox" and config.use_cpu and not config.is_debugging
+    elif config.eana_noise_optimize != "baseline":
+        assert False
+    config.dense_noise_optimize = args.dense_noise_optimize
+    if config.dense_noise_optimize == "streaming":
+        # the tables are updated in add_noise() (custom_api_cpp.dense_noise_sgd_update), fp32 and vanilla SGD
+        assert config.dpsgd_mode in [MODE_DPSGD_B, MODE_DPSGD_R, MODE_DPSGD_F] and config.use_cpu and not config.is_debugging
+    elif config.dense_noise_optimize != "baseline":
+        assert False
+    config.mlp_noise_optimize = args.mlp_noise_optimize
+    if config.mlp_noise_optimize == "fused":
+        # one multi-tensor kernel for the noise and the SGD update of the MLPs in HBM, Philox noise and vanilla SGD
+        assert config.noise_rng == "philox" and args.use_gpu and not config.is_debugging
+    elif config.mlp_noise_optimize != "baseline":
+        assert False
+    if args.secure_mode:
+        # the native 4-sum noise (custom_api_cpp.normal_secure) keyed by a secret of the secure generator (torchcsprng)
+        assert config.noise_seed is None and not config.is_debugging and config.eana_noise_optimize == "baseline"
+        assert config.dense_noise_optimize == "baseline" and config.mlp_noise_optimize == "baseline"
+    config.clip_backward = args.clip_backward
+    config.interaction_optimize = args.interaction_optimize
+    if config.interaction_optimize == "fused":
+        assert args.use_gpu and args.arch_interaction_op == "dot"
+    elif config.interaction_optimize != "baseline":
+        assert False
+    config.mlp_amp = args.mlp_amp
+    if config.mlp_amp in ["bf16", "fp16"]:
+        # ghost norms only, the hooks read the autocast activations and backprops in fp32
+        assert args.use_gpu and args.dpsgd_mode in ["dpsgd_f", "lazydp", "eana"]
+        if config.mlp_amp == "fp16":
+            config.amp_loss_scale = args.amp_loss_scale
+    elif config.mlp_amp != "none":
+        assert False
+    config.mlp_layer = args.mlp_layer
+    if config.mlp_layer == "dp_linear":
+        # ghost norms only (no per-sample gradients of DP-SGD(B)/(R)), plain fp32 nn.Linear
+        assert args.dpsgd_mode in ["dpsgd_f", "lazydp", "eana"]
+    elif config.mlp_layer != "linear":
+        assert False
+    if config.clip_backward == "per_layer":
+        # each layer clipped by its own norm in the hooks of the first backward (plain nn.Linear and fp32 nn.EmbeddingBag)
+        assert config.dpsgd_mode in [MODE_DPSGD_F, MODE_EANA] and config.eana_noise_optimize == "baseline"
+    elif config.clip_backward != "reweight":
+        assert False
+    config.adaptive_clipping = args.adaptive_clipping
+    if config.adaptive_clipping:
+        # the threshold is updated once per (physical) batch, from the ghost norms of the flat clipping
+        assert config.clip_backward != "per_layer"
+        config.adaclip_target_unclipped_quantile = args.target_unclipped_quantile
+        config.adaclip_clipbound_learning_rate = args.clipbound_learning_rate
+        config.adaclip_unclipped_num_std = args.unclipped_num_std
+        config.adaclip_min_clipbound = args.min_clipbound
+    config.huge_pages = args.huge_pages
+    config.prefault_tables = args.prefault_tables
+    config.mlock_tables = args.mlock_tables
+    assert not config.mlock_tables or config.prefault_tables != "none"
+    config.table_server = args.table_server
+    if args.tbb_cpus is not None or args.torch_cpus is not None:
+        assert args.pool_cpus is not None
+    if args.pool_cpus is not None:
+        init_pool(args.pool_cpus, args.tbb_cpus, args.torch_cpus)
     
 def run():
     ### parse arguments ###
@@ -1181,6 +1265,17 @@ def run():
     parser.add_argument("--multi-gpu", action="store_true", default=False)
     parser.add_argument("--system", type=str, default="gpu_only")
     parser.add_argument("--description", type=str, default="")
+    parser.add_argument("--report-bandwidth", action="store_true", default=False) # report the achieved GB/s of the update stages against the STREAM triad peak (merged_result/<description>_bandwidth.csv)
+    parser.add_argument("--report-memory", action="store_true", default=False) # report the sizes of the tables and the per-iteration high-water marks (detailed_latency_breakdown/<result>_memory.csv and mem_* rows)
+    parser.add_argument("--report-throughput", action="store_true", default=False) # report samples/sec and p50/p95/p99 of each stage over the steady-state iterations (merged_result/<description>_throughput.csv)
+    parser.add_argument("--bench-seconds", type=float, default=0) # > 0: stop training after this wall-clock time (at most --num-batches iterations) and report the throughput
+    parser.add_argument("--native-trace", action="store_true", default=False) # trace the hot paths of custom_api_cpp into a Chrome trace JSON next to the detailed breakdown
+    parser.add_argument("--nvtx", action="store_true", default=False) # NVTX ranges of the LatencyMeter stages (and of the extension kernels built with LAZYDP_NVTX=1) for Nsight Systems
+    parser.add_argument("--itt", action="store_true", default=False) # ITT tasks of the hot paths of custom_api_cpp (built with LAZYDP_ITT=1) for VTune
+    parser.add_argument("--perf-stages", type=str, default=None) # comma-separated LatencyMeter columns around which hardware counters are read (e.g. Update_delayed_noise_update,coalesce)
+    parser.add_argument("--perf-events", type=str, default="cycles,instructions,llc_misses,dtlb_misses,mem_read_bytes,mem_write_bytes") # counters of --perf-stages, the unavailable ones are dropped
+    parser.add_argument("--report-energy", action="store_true", default=False) # joules (RAPL package/DRAM, NVML GPU) per iteration and per stage in merged_result/<description>_energy.csv
+    parser.add_argument("--profiler-timing", type=str, default="sync", choices=["sync", "events"]) # "events" times the breakdown with CUDA events without synchronizing at every boundary
     parser.add_argument("--path-lazydp", type=str, default="/")
     parser.add_argument("--emb-scale", type=float, default=1.0)
     parser.add_argument("--model-config", type=str, default="basic") # basic, mlperf, rmc1, rmc2, rmc3
@@ -1189,6 +1284,30 @@ def run():
     parser.add_argument("--path-model-weight", type=str, default="/")
     parser.add_argument("--is-debugging", action="store_true", default=False)
     parser.add_argument("--debugging-type", type=str, default="without_noise") # without_noise, one_as_noise, without_noise_clipping
+    parser.add_argument("--coalesce-optimize", type=str, default=None) # baseline, multi_thread_openmp, multi_thread_embeddingbag, radix, hash, hash_unsorted, dense, auto
+    parser.add_argument("--noise-rng", type=str, default="torch") # torch, philox
+    parser.add_argument("--noise-seed", type=int, default=None)
+    parser.add_argument("--secure-mode", action="store_true", default=False) # PrivacyEngine(secure_mode=True), requires torchcsprng
+    parser.add_argument("--eana-noise-optimize", type=str, default="baseline") # baseline, fused
+    parser.add_argument("--dense-noise-optimize", type=str, default="baseline") # baseline, streaming
+    parser.add_argument("--mlp-noise-optimize", type=str, default="baseline") # baseline, fused
+    parser.add_argument("--clip-backward", type=str, choices=["reweight", "per_layer"], default="reweight") # "per_layer" clips each layer by its own norm without the second backward of DP-SGD(F)
+    parser.add_argument("--mlp-layer", type=str, default="linear", choices=["linear", "dp_linear"]) # "dp_linear" derives the ghost norms of the MLPs in its own backward instead of the module hooks
+    parser.add_argument("--mlp-amp", type=str, default="none", choices=["none", "bf16", "fp16"]) # autocast of the GPU MLPs and the interaction (fp32 ghost norms and clip factors)
+    parser.add_argument("--amp-loss-scale", type=float, default=1024.0) # static loss scale of --mlp-amp fp16 (a power of two)
+    parser.add_argument("--interaction-optimize", type=str, default="baseline", choices=["baseline", "fused"]) # "fused" runs the dot interaction (forward and backward) as a single CUDA kernel each way
+    parser.add_argument("--adaptive-clipping", action="store_true", default=False) # adapt the clipping threshold to a target quantile of unclipped examples (fused into the clip factor kernel on the GPU)
+    parser.add_argument("--target-unclipped-quantile", type=float, default=0.5)
+    parser.add_argument("--clipbound-learning-rate", type=float, default=0.2)
+    parser.add_argument("--unclipped-num-std", type=float, default=1.0) # std of the noise of the count of unclipped examples
+    parser.add_argument("--min-clipbound", type=float, default=0.01) # the threshold stays within [--min-clipbound, max grad norm]
+    parser.add_argument("--huge-pages", type=str, choices=["none", "thp", "hugetlb"], default="none") # back the embedding tables (and HT, optimizer state) with huge pages
+    parser.add_argument("--prefault-tables", type=str, choices=["none", "read", "write"], default="none") # touch the pages of the CPU tables (and optimizer state) in parallel before the first iteration
+    parser.add_argument("--mlock-tables", action="store_true", default=False) # lock the prefaulted pages in memory
+    parser.add_argument("--table-server", type=str, default=None) # socket of bench/table_server.py, the tables of the cached model are mapped copy-on-write from its staged copy
+    parser.add_argument("--pool-cpus", type=str, default=None) # e.g., 0-31: pin the worker pool of custom_api_cpp to these cores
+    parser.add_argument("--tbb-cpus", type=str, default=None) # e.g., 32-39: limit the TBB threads (parallel sorts / scans) of custom_api_cpp to these cores
+    parser.add_argument("--torch-cpus", type=str, default=None) # e.g., 40-47: pin the intra-op threads of PyTorch to these cores
     
     global args
     global nbatches
@@ -1499,12 +1618,14 @@ def run():
     
     global dlrm
     dlrm_path = "%s/%s_%f" %(args.path_model_weight, args.model_config, args.emb_scale)
+    # embedding tables are stored in raw table files next to the model (written and read in parallel)
+    dlrm_path += "_tables"
         
     if os.path.isfile(dlrm_path):
         with open(log_name, 'a') as f:
             f.write(">> Loading DLRM...\n")
 
-        dlrm = torch.load(dlrm_path)
+        dlrm = load_model_with_table_files(dlrm_path, mmap=False)
         with open(log_name, 'a') as f:
             f.write(">> DLRM load is done\n")
             f.write(">> Model to GPU...\n")
@@ -1537,7 +1658,7 @@ def run():
         # Generate instance of DLRM at very first execution
         # Save this instance and reuse in next execution to
         # save experiment time
-        torch.save(dlrm, dlrm_path)
+        save_model_with_table_files(dlrm, dlrm_path)
 
         with open(log_name, 'a') as f:
             f.write(">> DLRM generation is done\n")
@@ -1572,6 +1693,7 @@ def run():
             if dlrm.weighted_pooling == "fixed":
                 for k, w in enumerate(dlrm.v_W_l):
                     dlrm.v_W_l[k] = w.cuda()
+    move_emb_to_huge_pages(dlrm)
     with open(log_name, 'a') as f:
         f.write(">> Model migration is done\n")
 
@@ -1765,7 +1887,7 @@ def run():
     writer = SummaryWriter(tb_file)
     
     if args.dpsgd_mode != "sgd":
-        privacy_engine = PrivacyEngine()
+        privacy_engine = PrivacyEngine(secure_mode=args.secure_mode)
 
         MAX_GRAD_NORM = 0.4
         # MAX_GRAD_NORM = 1.2
@@ -1775,7 +1897,14 @@ def run():
         if not args.disable_poisson_sampling: #TODO:
             assert(config.num_gathers == 1)
             custom_dataset = CustomDataset(args.num_batches * args.mini_batch_size, ln_emb, config.num_gathers)
-            train_ld = DataLoader(custom_dataset, batch_size=args.mini_batch_size, shuffle=False, collate_fn=collate_fn)
+            batch_ring = None
+            if args.num_workers > 0:
+                # the workers collate into shared (pinned) buffers handed to the training loop without copies,
+                # room for the Poisson-sampled batches up to 8 standard deviations above the mean
+                batch_ring = SharedBatchRing(collate_fn, args.num_workers, 2, args.mini_batch_size + 8 * int(np.sqrt(args.mini_batch_size)) + 16,
+                                             len(ln_emb), 13, use_gpu)
+            train_ld = DataLoader(custom_dataset, batch_size=args.mini_batch_size, shuffle=False, num_workers=args.num_workers,
+                                  collate_fn=collate_fn if batch_ring is None else batch_ring.collate)
             
         dlrm, optimizer, train_ld = privacy_engine.make_private_with_epsilon(
             module=dlrm,
@@ -1787,6 +1916,8 @@ def run():
             max_grad_norm=MAX_GRAD_NORM,
             disable_poisson_sampling=args.disable_poisson_sampling
         )
+        if not args.disable_poisson_sampling and batch_ring is not None:
+            train_ld = SharedBatchLoader(train_ld, batch_ring)
         
         print("%s training" %args.dpsgd_mode)
         print(f"Using sigma={optimizer.noise_multiplier} and C={MAX_GRAD_NORM}")
@@ -1865,7 +1996,19 @@ def run():
         assert True # Skip
     else:
         assert False, "Wrong locality"
+    # alias tables of the access distributions (O(1) per sampled index)
+    alias_sampler = None
+    if args.locality != "uniform":
+        alias_sampler = custom_api_cpp.AliasSampler([torch.from_numpy(pdf) for pdf in access_pdfs], config.data_gen_nthreads)
+    if args.report_memory:
+        # sizes of the training state, reported with the per-iteration high-water marks by LatencyMeter.save()
+        for i, emb in enumerate(dlrm.emb_l):
+            config.profiler.add_memory("emb_weight[%d]" % i, emb.weight.numel() * emb.weight.element_size())
+        for i, pdf in enumerate(access_pdfs):
+            config.profiler.add_memory("access_pdfs[%d]" % i, pdf.nbytes)
+        config.profiler.add_memory("mlp", sum(p.numel() * p.element_size() for name, p in dlrm.named_parameters() if not name.startswith("emb_l")))
         
+    prefault_emb_tables(dlrm, optimizer)
     ext_dist.barrier()
     with torch.autograd.profiler.profile(
         args.enable_profiling, use_cuda=use_gpu, record_shapes=True
@@ -1873,6 +2016,7 @@ def run():
         if not args.inference_only:
             k = 0
             total_time_begin = 0
+            bench_deadline = time.time() + args.bench_seconds if args.bench_seconds > 0 else None
             while k < args.nepochs:
                 if args.mlperf_logging:
                     assert False, "do not use mlper_logging"
@@ -1908,10 +2052,8 @@ def run():
 
                     X, lS_o, lS_i, T, W, CBPP = unpack_batch(inputBatch)
                     if args.locality != "uniform" and config.num_gathers == 1:
-                        lS_i = list()
-                        for table_idx in range(len(dlrm.emb_l)):
-                            lS_i_table = np.random.choice(dlrm.emb_l[table_idx].weight.shape[0], config.batch_size, replace=True, p=access_pdfs[table_idx])
-                            lS_i.append(torch.from_numpy(lS_i_table))
+                        seed = int(torch.randint(0, 2**62, (1,)).item())
+                        lS_i, _ = alias_sampler.sample(config.batch_size, [1] * len(dlrm.emb_l), seed, config.data_gen_nthreads)
                     elif args.locality != "uniform" and config.num_gathers != 1:
                         # Exclude the case whose num_gathers > 1 and args.a > 0
                         # because it takes too long to generate synthetic dataset
@@ -1955,6 +2097,8 @@ def run():
                     # early exit if nbatches was set by the user and has been exceeded
                     if nbatches > 0 and j >= nbatches:
                         break
+                    if bench_deadline is not None and time.time() > bench_deadline:
+                        break
 
                     # Skip the batch if batch size not multiple of total ranks
                     if ext_dist.my_size > 1 and X.size(0) % ext_dist.my_size != 0:
@@ -1978,6 +2122,7 @@ def run():
                         ndevices=ndevices,
                     )
                     config.cur_batch_size = T.shape[0]
+                    config.cur_num_indices_list = [lS_i_table.numel() for lS_i_table in lS_i]
                     
                     if ext_dist.my_size > 1:
                         T = T[ext_dist.get_my_slice(mbs)]
@@ -2023,24 +2168,15 @@ def run():
                         if args.dpsgd_mode in ["dpsgd_r", "dpsgd_f", "eana"]:
                             # to eliminate calculations of per-batch weight gradients
                             # to do backward twice
-                            E.backward(retain_graph=True, inputs=emb_biases+[mlp_bias]) 
+                            norm_backward(E * config.amp_loss_scale, emb_biases+[mlp_bias])
                         elif args.dpsgd_mode == "sgd":
                             config.profiler.start_l2("backward")
                             E.backward()
                             config.profiler.end_l2("backward")
                             
                             config.profiler.start_l2("coalesce")
-                            if config.coalesce_optimize == "baseline":
-                                for param in dlrm.emb_l.parameters():
-                                    param.grad = param.grad.coalesce()
-                            elif config.coalesce_optimize == "multi_thread_openmp":
-                                for param in dlrm.emb_l.parameters():
-                                    param.grad = custom_api_cpp.coalesce_multi_thread_openmp(param.grad, config.coalesce_nthreads)
-                            elif config.coalesce_optimize == "multi_thread_embeddingbag":
-                                for param in dlrm.emb_l.parameters():
-                                    param.grad = custom_api_cpp.coalesce_multi_thread_embeddingbag(param.grad, config.coalesce_nthreads)
-                            else:
-                                assert False
+                            for param in dlrm.emb_l.parameters():
+                                param.grad = coalesce(param.grad)
                             config.profiler.end_l2("coalesce")
                         elif args.dpsgd_mode == "dpsgd_b":
                             E.backward(inputs=emb_biases+[mlp_bias])
@@ -2246,9 +2382,13 @@ def run():
                 use_gpu,
             )
     
-    torch.cuda.synchronize()
+    if use_gpu:
+        torch.cuda.synchronize()
     end_time = time.time()
     
+    if config.profiler.cur_iter < config.profiler.iters:
+        assert args.bench_seconds > 0
+        config.profiler.truncate()
     config.profiler.save()
     if config.is_debugging:
         if config.dpsgd_mode == config.MODE_DPSGD_B:
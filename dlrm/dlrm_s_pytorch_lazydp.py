@@ -58,6 +58,7 @@ import argparse
 # miscellaneous
 import builtins
 import datetime
+import itertools
 import json
 import sys
 import time
@@ -70,6 +71,7 @@ warnings.simplefilter("ignore")
 
 # data generation
 import dlrm_data_pytorch as dp
+import data_loader_terabyte
 
 # For distributed run
 import extend_distributed as ext_dist
@@ -132,8 +134,10 @@ else:
 
 import config
 from config import MODE_LAZYDP
-from custom_utils import LatencyMeter
+from custom_utils import LatencyMeter, norm_backward, JaggedSparse, fused_dot_interaction, mlp_autocast, DenseStepGraph, init_pool, parse_cpu_list, local_cpu_list, AccessDistributionCache, save_model_with_table_files, load_model_with_table_files, IncrementalCheckpointer, load_incremental_checkpoint, move_emb_to_precision, dequantize_emb, export_serving_model, load_serving_model, move_emb_to_huge_pages, prefault_emb_tables, map_dynamic_ids, materialize_emb_rows, materialize_emb_tables, move_emb_to_cold_tier, compact_cold_rows, cold_tier_stats, home_emb_on_numa_nodes, concat_emb_tables, place_emb_tables, move_emb_to_table_files, TBELookup, HotRowCache, RowReorder, remap_rows, EmbOutputTransfer, CoalesceTuner, steady_state_start, NullLatencyMeter, PrefetchIterator, LookaheadIterator, SharedBatchRing, SharedBatchLoader, MetricsExporter, replicate_read_mostly, sync_numa_replicas
 from opacus import PrivacyEngine
+from opacus.layers import DPLinear
+from opacus.utils.batch_memory_manager import wrap_data_loader
 
 from torch.utils.data import DataLoader, Dataset
 
@@ -203,7 +207,11 @@ def dlrm_wrap(X, lS_o, lS_i, use_gpu, device, emb_biases, mlp_bias, ndevices=1):
             
             config.profiler.start("FW_input_to_gpu")
             if config.use_cpu == False:
-                if ndevices == 1:
+                if ndevices == 1 and isinstance(lS_i, list) and not isinstance(lS_o, list):
+                    # the indices of all tables in one copy (custom_utils.JaggedSparse)
+                    lS_jagged = JaggedSparse.pack(lS_i, lS_o).to(device)
+                    lS_i, lS_o = lS_jagged.tables(), lS_jagged.offsets
+                elif ndevices == 1:
                     lS_i = (
                         [S_i.to(device) for S_i in lS_i]
                         if isinstance(lS_i, list)
@@ -218,13 +226,147 @@ def dlrm_wrap(X, lS_o, lS_i, use_gpu, device, emb_biases, mlp_bias, ndevices=1):
             config.profiler.end("FW_input_to_gpu")
             
             config.profiler.start("FW_add_mlp_bias")
-            if mlp_bias != None:
-                X = X + mlp_bias
+            # anchored for the norm-only first backward (no add, customized_sparse.anchored_output)
+            X = torch.nn.modules.sparse.anchored_output(X, mlp_bias)
             config.profiler.end("FW_add_mlp_bias")
             
         return dlrm(X, lS_o, lS_i, emb_biases)
 
 
+def route_sparse_features(lS_o, lS_i, async_op=False):
+    # distributed LazyDP: each rank sends the bags of its batch slice to the owners of the tables
+    # and gets the bags of its own tables for the whole batch (ext_dist.alltoall_sparse_features,
+    # async_op: a request, whose wait() gives them)
+    # (data-parallel tables: each rank keeps the bags of its batch slice for all tables)
+    if ext_dist.my_size == 1:
+        return lS_o, lS_i
+    my_bags = ext_dist.get_my_slice(lS_o.shape[1])
+    slice_lS_i = []
+    for t in range(len(lS_i)):
+        end = lS_o[t, my_bags.stop].item() if my_bags.stop < lS_o.shape[1] else lS_i[t].numel()
+        slice_lS_i.append(lS_i[t][lS_o[t, my_bags.start].item():end])
+    slice_lS_o = lS_o[:, my_bags] - lS_o[:, my_bags.start:my_bags.start + 1]
+    if config.dist_mode == "data_parallel":
+        return slice_lS_o, slice_lS_i
+    # tables are split over the ranks as DLRM_Net.n_emb_per_rank
+    return ext_dist.alltoall_sparse_features(slice_lS_o, slice_lS_i, dist_table_splits(config.dist_table_rows), async_op)
+
+def dist_table_splits(table_rows):
+    # tables of each rank of model-parallel LazyDP, contiguous in rank order (None: evenly split):
+    # the same number per rank ("count"), or about the same rows per rank ("rows", e.g., the DRAM and
+    # the update bandwidth of the hosts of a multi-host CPU-only run), at least one table per rank
+    n_emb = len(table_rows)
+    if config.dist_table_split == "count":
+        return ext_dist.get_split_lengths(n_emb)[1]
+    elif config.dist_table_split != "rows":
+        assert False, "Wrong dist_table_split"
+    cumulative = np.cumsum(table_rows)
+    ends = []
+    for r in range(1, ext_dist.my_size):
+        target = cumulative[-1] * r / ext_dist.my_size
+        end = int(np.searchsorted(cumulative, target))
+        # the table crossing the target goes to the side it mostly falls on
+        if cumulative[end] - target < target - (cumulative[end - 1] if end > 0 else 0):
+            end += 1
+        ends.append(min(max(end, (ends[-1] if ends else 0) + 1), n_emb - (ext_dist.my_size - r)))
+    ends.append(n_emb)
+    return [end - start for start, end in zip([0] + ends[:-1], ends)]
+
+def expand_sparse_features(model, lS_o, lS_i):
+    # the bags of each sparse feature as the bags of its sub-tables in emb_l (DLRM_Net.emb_features):
+    # the quotient and the remainder of the indices of a QR embedding, the same indices otherwise
+    # the bags of the dense tables (config.dense_emb_rows) follow those of emb_l
+    model = getattr(model, "_module", model) # GradSampleModule
+    if not (model.qr_flag or model.md_flag or len(model.dense_emb_l) > 0):
+        return lS_o, lS_i
+    sub_lS_o, sub_lS_i = [], []
+    dense_lS_o, dense_lS_i = [], []
+    for k, (kind, _, _) in enumerate(model.emb_features):
+        if kind == "qr":
+            sub_lS_i += [torch.div(lS_i[k], model.qr_collisions, rounding_mode="floor"), torch.remainder(lS_i[k], model.qr_collisions)]
+            sub_lS_o += [lS_o[k], lS_o[k]]
+        elif kind == "dense":
+            dense_lS_i.append(lS_i[k])
+            dense_lS_o.append(lS_o[k])
+        else:
+            sub_lS_i.append(lS_i[k])
+            sub_lS_o.append(lS_o[k])
+    sub_lS_o, sub_lS_i = sub_lS_o + dense_lS_o, sub_lS_i + dense_lS_i
+    return (torch.stack(sub_lS_o) if torch.is_tensor(lS_o) else sub_lS_o), sub_lS_i
+
+def emb_anchor_per_table(emb_l, device):
+    # the leaf each output of the tables is anchored to for the norm-only first backward (an identity node
+    # instead of the add of a zero bias, customized_sparse.anchored_output), one per device of the tables,
+    # the tables in HBM (config.table_placement) on theirs
+    anchors = dict()
+    for E in emb_l:
+        key = E.weight.device if E.weight.is_cuda else device
+        if key not in anchors:
+            anchors[key] = torch.nn.modules.sparse.output_anchor(key)
+    return [anchors[E.weight.device if E.weight.is_cuda else device] for E in emb_l]
+
+def convert_pmf(original_pmf, new_length):
+    error = 0.000001
+    
+    original_length = len(original_pmf)
+    original_x = np.linspace(0, 1, original_length + 1)
+    original_cdf = np.insert(np.cumsum(original_pmf), 0, 0)
+    assert abs(original_cdf[-1] - 1) < error
+    assert len(original_x) == len(original_cdf)
+    
+    new_x = np.linspace(0, 1, new_length + 1)
+    new_cdf = np.interp(new_x, original_x, original_cdf)
+    assert abs(new_cdf[-1] - 1) < error
+    
+    new_pmf = np.diff(new_cdf)
+    assert len(new_pmf) == new_length
+    assert abs(new_pmf.sum() - 1) < error
+    
+    return new_pmf
+
+access_caches = dict()
+
+def access_distribution_cache(locality):
+    # distributions of --locality and their alias tables, cached across runs in --access-cache-dir
+    if locality not in access_caches:
+        path = args.access_cache_dir if args.access_cache_dir is not None else "%s/result/access_cache" % args.path_lazydp
+        access_caches[locality] = AccessDistributionCache(path, locality)
+    return access_caches[locality]
+
+def table_access_pdfs(locality, table_rows):
+    # access distribution of each table of "table_rows" rows by --locality (empty for "uniform"), the tables
+    # of the same size share one (mmapped) array
+    access_pdfs = list()
+    if locality.startswith("zipf"): # locality with zipf distribution
+        a = float(locality.split("_")[-1])
+        def zipf_pmf(n):
+            pdf = 1/((np.arange(n) + 1) ** a)
+            return pdf / pdf.sum()
+        for n in table_rows:
+            access_pdfs.append(access_distribution_cache(locality).pmf(n, zipf_pmf))
+    elif locality.startswith("kaggle"): # Criteo Kaggle DAC dataset (chose 1 table's distribution and use it for all tables)
+        target_table_idx = int(locality.split("_")[-1])
+        pmf_original = list()
+        def kaggle_pmf(n):
+            # the csv is only read if a size is not cached yet
+            if len(pmf_original) == 0:
+                dist_path = "%s/Kaggle_train_distribution.csv" %args.path_lazydp
+                df = pd.read_csv(dist_path)
+                counts = df.iloc[:, target_table_idx].dropna().values.astype(float)
+                pmf_original.append(counts/counts.sum())
+            return convert_pmf(pmf_original[0], n)
+        for n in table_rows:
+            access_pdfs.append(access_distribution_cache(locality).pmf(n, kaggle_pmf))
+    elif locality == "uniform":
+        assert True # Skip
+    else:
+        assert False, "Wrong locality"
+    return access_pdfs
+
+def lazydp_checkpoint_path(path):
+    # each rank saves the tables it holds (and its slice of the pending batch)
+    return "%s.rank%d" %(path, ext_dist.my_rank) if ext_dist.my_size > 1 else path
+
 def loss_fn_wrap(Z, T, use_gpu, device):
     with record_function("DLRM loss compute"):
         if args.loss_function == "mse" or args.loss_function == "bce":
@@ -289,7 +431,7 @@ class DLRM_Net(nn.Module):
             m = ln[i + 1]
 
             # construct fully connected operator
-            LL = nn.Linear(int(n), int(m), bias=True)
+            LL = (DPLinear if config.mlp_layer == "dp_linear" else nn.Linear)(int(n), int(m), bias=True)
 
             # initialize the weights
             # with torch.no_grad():
@@ -322,16 +464,26 @@ class DLRM_Net(nn.Module):
         return torch.nn.Sequential(*layers)
 
     def create_emb(self, m, ln, weighted_pooling=None):
+        # QR and MD embeddings are made of plain nn.EmbeddingBag sub-tables in emb_l (each with its own
+        # grad sampler, HT and delayed noise), combined per sparse feature by combine_emb():
+        # emb_features[k] = (kind, ids of the sub-tables in emb_l, dim of the MD sub-table if projected).
+        # Tables of at most config.dense_emb_rows rows are dense parameters ("dense", ids in dense_emb_l)
+        # with the MLPs, which are registered after the tables (self.dense_tables until then)
         emb_l = nn.ModuleList()
         v_W_l = []
+        self.dense_tables = []
+        self.emb_features = []
+        if self.md_flag:
+            base = max(m)
         for i in range(0, ln.size):
-            if ext_dist.my_size > 1:
+            if ext_dist.my_size > 1 and config.dist_mode == "model_parallel":
                 if i not in self.local_emb_indices:
                     continue
             n = ln[i]
 
             # construct embedding operator
             if self.qr_flag and n > self.qr_threshold:
+                # same initialization as QREmbeddingBag
                 EE = QREmbeddingBag(
                     n,
                     m,
@@ -340,15 +492,46 @@ class DLRM_Net(nn.Module):
                     mode="sum",
                     sparse=True,
                 )
-            elif self.md_flag and n > self.md_threshold:
-                base = max(m)
+                self.emb_features.append(("qr", [len(emb_l), len(emb_l) + 1], None))
+                for W in [EE.weight_q.data, EE.weight_r.data]:
+                    emb_l.append(nn.EmbeddingBag(W.shape[0], W.shape[1], mode="sum", sparse=True, _weight=W))
+                    v_W_l.append(None)
+                continue
+            elif self.md_flag:
                 _m = m[i] if n > self.md_threshold else base
-                EE = PrEmbeddingBag(n, _m, base)
+                EE = nn.EmbeddingBag(n, _m, mode="sum", sparse=True)
                 # use np initialization as below for consistency...
                 W = np.random.uniform(
                     low=-np.sqrt(1 / n), high=np.sqrt(1 / n), size=(n, _m)
                 ).astype(np.float32)
-                EE.embs.weight.data = torch.tensor(W, requires_grad=True)
+                EE.weight.data = torch.tensor(W, requires_grad=True)
+                self.emb_features.append(("md", [len(emb_l)], _m if _m < base else None))
+                emb_l.append(EE)
+                v_W_l.append(None)
+                continue
+            elif n <= config.dense_emb_rows:
+                EE = nn.EmbeddingBag(n, m, mode="sum", sparse=False)
+                W = np.random.uniform(
+                    low=-np.sqrt(1 / n), high=np.sqrt(1 / n), size=(n, m)
+                ).astype(np.float32)
+                EE.weight.data = torch.tensor(W, requires_grad=True)
+                self.emb_features.append(("dense", [len(self.dense_tables)], None))
+                self.dense_tables.append(EE)
+                continue
+            elif config.dynamic_emb_tables:
+                # rows of the raw ids in the order they appear, initialized as init_table keyed by the id
+                dynamic_table = custom_api_cpp.DynamicEmbeddingTable(config.dynamic_emb_capacity, m, -np.sqrt(1 / n), np.sqrt(1 / n), config.emb_init_seed, i)
+                EE = nn.EmbeddingBag(config.dynamic_emb_capacity, m, mode="sum", sparse=True, _weight=dynamic_table.weight())
+                EE.dynamic_table = dynamic_table
+            elif config.virtual_emb_tables:
+                # the weights of init_table below, each row initialized when the batches first access it
+                virtual_table = custom_api_cpp.VirtualTable(n, m, False, -np.sqrt(1 / n), np.sqrt(1 / n), config.emb_init_seed, i)
+                EE = nn.EmbeddingBag(n, m, mode="sum", sparse=True, _weight=virtual_table.weight())
+                EE.virtual_table = virtual_table
+            elif config.parallel_emb_init:
+                # same distribution as below, filled in parallel (and without init.normal_ of reset_parameters)
+                W = custom_api_cpp.init_table(n, m, False, -np.sqrt(1 / n), np.sqrt(1 / n), config.emb_init_seed, i, config.emb_init_nthreads)
+                EE = nn.EmbeddingBag(n, m, mode="sum", sparse=True, _weight=W)
             else:
                 EE = nn.EmbeddingBag(n, m, mode="sum", sparse=True)
                 # initialize embeddings
@@ -366,11 +549,51 @@ class DLRM_Net(nn.Module):
                 v_W_l.append(None)
             else:
                 v_W_l.append(torch.ones(n, dtype=torch.float32))
+            self.emb_features.append(("plain", [len(emb_l)], None))
             emb_l.append(EE)
             with open(log_name, 'a') as f:
                 f.write(">>     Creation of EMB #%d is done\n" %(i+1))
         return emb_l, v_W_l
 
+    def create_md_proj(self, m):
+        # projections of the MD sub-tables to the base dimension (as PrEmbeddingBag), dense
+        # parameters after the tables
+        md_proj_l = nn.ModuleList()
+        if not self.md_flag:
+            return md_proj_l
+        for kind, _, dim in self.emb_features:
+            if kind == "md" and dim is not None:
+                proj = nn.Linear(dim, max(m), bias=False)
+                torch.nn.init.xavier_uniform_(proj.weight)
+                md_proj_l.append(proj)
+        return md_proj_l
+
+    def combine_emb(self, ly, dense_ly=[]):
+        # outputs of the sparse features from those of the sub-tables (emb_features) and the dense tables
+        if not (self.qr_flag or self.md_flag or len(self.dense_emb_l) > 0):
+            return ly
+        out = []
+        n_proj = 0
+        for kind, ids, dim in self.emb_features:
+            if kind == "qr":
+                V_q, V_r = ly[ids[0]], ly[ids[1]]
+                if self.qr_operation == "concat":
+                    out.append(torch.cat((V_q, V_r), dim=1))
+                elif self.qr_operation == "add":
+                    out.append(V_q + V_r)
+                elif self.qr_operation == "mult":
+                    out.append(V_q * V_r)
+                else:
+                    assert False
+            elif kind == "md" and dim is not None:
+                out.append(self.md_proj_l[n_proj](ly[ids[0]]))
+                n_proj += 1
+            elif kind == "dense":
+                out.append(dense_ly[ids[0]])
+            else:
+                out.append(ly[ids[0]])
+        return out
+
     def __init__(
         self,
         m_spa=None,
@@ -429,7 +652,7 @@ class DLRM_Net(nn.Module):
                 self.md_threshold = md_threshold
 
             # If running distributed, get local slice of embedding tables
-            if ext_dist.my_size > 1:
+            if ext_dist.my_size > 1 and config.dist_mode == "model_parallel":
                 n_emb = len(ln_emb)
                 if n_emb < ext_dist.my_size:
                     sys.exit(
@@ -437,15 +660,23 @@ class DLRM_Net(nn.Module):
                         % (n_emb, ext_dist.my_size)
                     )
                 self.n_global_emb = n_emb
-                self.n_local_emb, self.n_emb_per_rank = ext_dist.get_split_lengths(
-                    n_emb
-                )
-                self.local_emb_slice = ext_dist.get_my_slice(n_emb)
+                config.dist_table_rows = [int(n) for n in ln_emb]
+                self.n_emb_per_rank = dist_table_splits(config.dist_table_rows)
+                if self.n_emb_per_rank is None:
+                    self.n_local_emb = n_emb // ext_dist.my_size
+                    self.local_emb_slice = ext_dist.get_my_slice(n_emb)
+                else:
+                    self.n_local_emb = self.n_emb_per_rank[ext_dist.my_rank]
+                    start = sum(self.n_emb_per_rank[:ext_dist.my_rank])
+                    self.local_emb_slice = slice(start, start + self.n_local_emb, 1)
                 self.local_emb_indices = list(range(n_emb))[self.local_emb_slice]
 
             # create operators
             if ndevices <= 1:
                 self.emb_l, w_list = self.create_emb(m_spa, ln_emb, weighted_pooling)
+                # after the tables, which stay the first parameters (DPOptimizer)
+                self.md_proj_l = self.create_md_proj(m_spa)
+                self.dense_emb_l = nn.ModuleList(self.dense_tables)
                 if self.weighted_pooling == "learned":
                     self.v_W_l = nn.ParameterList()
                     for w in w_list:
@@ -459,6 +690,17 @@ class DLRM_Net(nn.Module):
             with open(log_name, 'a') as f:
                 f.write(">>     Creation of top_MLP is done\n")
 
+            # packed pinned transfer of the embedding outputs (config.emb_transfer == "pinned")
+            self.emb_transfer = None
+            # outputs of the next forward pooled by the LazyDP update (config.update_pool_optimize == "fused")
+            self.prepooled = None
+            # FBGEMM's table-batched lookup of the concatenated tables (config.emb_forward == "tbe")
+            self.tbe_lookup = None
+            # (unique rows, inverse) of each table for the next forward (config.emb_forward == "dedup")
+            self.dedup_sets = None
+            # waits for the update of a table by the last step (config.emb_early_release, DPOptimizer.wait_emb_table)
+            self.emb_update_wait = None
+
             # quantization
             self.quantize_emb = False
             self.emb_l_q = []
@@ -495,9 +737,44 @@ class DLRM_Net(nn.Module):
         # 2. for each embedding the lookups are further organized into a batch
         # 3. for a list of embedding tables there is a list of batched lookups
 
+        # all tables pooled by a single kernel (config.emb_forward == "batched"), with the indices of the
+        # reordered tables, a slice per table is then passed to each EmbeddingBag (for its backward and hooks)
+        pooled = None
+        prepooled, self.prepooled = self.prepooled, None
+        dedup_sets, self.dedup_sets = self.dedup_sets, None
+        if dedup_sets is not None and len(dedup_sets) != len(lS_i):
+            dedup_sets = None
+        if prepooled is not None:
+            # pooled from the rows as they were updated by the last step (DPOptimizer.pop_pooled_nxt)
+            assert not self.quantize_emb and all(v_W is None for v_W in v_W_l)
+            ly = []
+            for k, (indices, offsets, pooled_k) in enumerate(prepooled):
+                assert indices.numel() == lS_i[k].numel()
+                ly.append(emb_l[k](indices, emb_biases[k] if emb_biases is not None else None, offsets, pooled=pooled_k))
+            return ly
+        if config.emb_forward == "batched" and self.quantize_emb and emb_l is not None and all(v_W is None for v_W in v_W_l):
+            # quantized serving tables (custom_utils.load_serving_model) pooled by a single kernel
+            dim = emb_l[0].embedding_dim
+            pooled = custom_api_cpp.embedding_bag_rowwise_multi_table(self.emb_l_q, list(lS_i), [lS_o[k] for k in range(len(lS_i))],
+                                                                      self.quantize_bits, dim, config.emb_forward_nthreads)
+            return list(pooled.split(dim, dim=1))
+        if config.emb_forward == "batched" and self._batched_emb_supported(emb_l, v_W_l):
+            lS_i = [remap_rows(emb_l[k], lS_i[k]) for k in range(len(lS_i))]
+            pooled = custom_api_cpp.embedding_bag_multi_table([E.weight.detach() for E in emb_l], list(lS_i),
+                                                              [lS_o[k] for k in range(len(lS_i))], config.emb_forward_nthreads)
+            dim = emb_l[0].weight.shape[1]
+        elif config.emb_forward == "tbe":
+            if self.tbe_lookup is None:
+                self.tbe_lookup = TBELookup(emb_l)
+            pooled = self.tbe_lookup(lS_o, lS_i)
+            dim = emb_l[0].weight.shape[1]
+
         ly = []
         for k, sparse_index_group_batch in enumerate(lS_i):
             sparse_offset_group_batch = lS_o[k]
+            if self.emb_update_wait is not None:
+                # the lookups of this table start once its own update is done, the larger tables are still updated
+                self.emb_update_wait(k)
 
             # embedding lookup
             # We are using EmbeddingBag, which implicitly uses sum operator.
@@ -511,10 +788,6 @@ class DLRM_Net(nn.Module):
                 per_sample_weights = None
 
             if self.quantize_emb:
-                s1 = self.emb_l_q[k].element_size() * self.emb_l_q[k].nelement()
-                s2 = self.emb_l_q[k].element_size() * self.emb_l_q[k].nelement()
-                print("quantized emb sizes:", s1, s2)
-
                 if self.quantize_bits == 4:
                     QV = ops.quantized.embedding_bag_4bit_rowwise_offsets(
                         self.emb_l_q[k],
@@ -533,6 +806,37 @@ class DLRM_Net(nn.Module):
                 ly.append(QV)
             else:
                 E = emb_l[k]
+                if pooled is not None:
+                    V = E(
+                        sparse_index_group_batch,
+                        emb_biases[k] if emb_biases is not None else None,
+                        sparse_offset_group_batch,
+                        pooled=pooled[:, k * dim:(k + 1) * dim],
+                    )
+                    ly.append(V)
+                    continue
+                if E.weight.is_cuda and not sparse_index_group_batch.is_cuda:
+                    # table in HBM (config.table_placement)
+                    sparse_index_group_batch = sparse_index_group_batch.to(E.weight.device)
+                    sparse_offset_group_batch = sparse_offset_group_batch.to(E.weight.device)
+                # rows of the reordered table (custom_utils.RowReorder)
+                sparse_index_group_batch = remap_rows(E, sparse_index_group_batch)
+                if config.emb_forward == "dedup" and self._dedup_emb_supported(E, per_sample_weights):
+                    if dedup_sets is not None and not E.weight.is_cuda:
+                        # derived by set_lS_i() of the last iteration
+                        dedup = dedup_sets[k]
+                    elif E.weight.is_cuda:
+                        dedup = torch.unique(sparse_index_group_batch, sorted=True, return_inverse=True)
+                    else:
+                        dedup = custom_api_cpp.unique_with_inverse_and_counts(sparse_index_group_batch.long().contiguous(), config.unique_nthreads)[:2]
+                    V = E(
+                        sparse_index_group_batch,
+                        emb_biases[k] if emb_biases is not None else None,
+                        sparse_offset_group_batch,
+                        dedup=dedup,
+                    )
+                    ly.append(V)
+                    continue
                 if emb_biases is not None:
                     V = E(
                         sparse_index_group_batch,
@@ -553,6 +857,24 @@ class DLRM_Net(nn.Module):
         # print(ly)
         return ly
 
+    def _dedup_emb_supported(self, E, per_sample_weights):
+        # tables which _DedupEmbeddingBag can pool (fp32, plain lookups, sum pooling, no per-sample weights)
+        if per_sample_weights is not None or getattr(E, "row_cache", None) is not None or getattr(E, "int8_table", None) is not None:
+            return False
+        return E.weight.dtype == torch.float and E.mode == "sum" and E.sparse
+
+    def _batched_emb_supported(self, emb_l, v_W_l):
+        # tables which custom_api_cpp.embedding_bag_multi_table can pool (fp32 on the CPU, same dim, plain lookups)
+        if self.quantize_emb or any(v_W is not None for v_W in v_W_l):
+            return False
+        dim = emb_l[0].weight.shape[1]
+        for E in emb_l:
+            if getattr(E, "row_cache", None) is not None or getattr(E, "int8_table", None) is not None:
+                return False
+            if E.weight.dtype != torch.float or E.weight.is_cuda or E.weight.shape[1] != dim or E.mode != "sum" or not E.sparse:
+                return False
+        return True
+
     #  using quantizing functions from caffe2/aten/src/ATen/native/quantized/cpu
     def quantize_embedding(self, bits):
 
@@ -575,6 +897,12 @@ class DLRM_Net(nn.Module):
 
     def interact_features(self, x, ly):
 
+        if self.arch_interaction_op == "dot" and config.interaction_optimize == "fused":
+            # a single CUDA kernel (None when the features do not fit it)
+            R = fused_dot_interaction(x, ly, self.arch_interaction_itself)
+            if R is not None:
+                return R
+
         if self.arch_interaction_op == "dot":
             # concatenate dense and sparse features
             (batch_size, d) = x.shape
@@ -610,9 +938,12 @@ class DLRM_Net(nn.Module):
 
     def forward(self, dense_x, lS_o, lS_i, emb_biases):
 
-        if ext_dist.my_size > 1:
-            assert False, "Exclude the multi-node multi-device training"
-            return self.distributed_forward(dense_x, lS_o, lS_i)
+        if ext_dist.my_size > 1 and config.dist_mode == "model_parallel":
+            # distributed LazyDP: tables are sharded over the ranks (route_sparse_features)
+            return self.distributed_forward(dense_x, lS_o, lS_i, emb_biases)
+        elif ext_dist.my_size > 1:
+            # data-parallel tables: lS_o and lS_i are already those of the batch slice of this rank
+            return self.sequential_forward(dense_x[ext_dist.get_my_slice(dense_x.size()[0])], lS_o, lS_i, emb_biases)
         elif self.ndevices <= 1:
             # single device run
             return self.sequential_forward(dense_x, lS_o, lS_i, emb_biases)
@@ -620,7 +951,7 @@ class DLRM_Net(nn.Module):
             assert False, "Exclude the single-node multi-device training"
             return self.parallel_forward(dense_x, lS_o, lS_i)
 
-    def distributed_forward(self, dense_x, lS_o, lS_i):
+    def distributed_forward(self, dense_x, lS_o, lS_i, emb_biases):
         batch_size = dense_x.size()[0]
         # WARNING: # of ranks must be <= batch size in distributed_forward call
         if batch_size < ext_dist.my_size:
@@ -635,8 +966,7 @@ class DLRM_Net(nn.Module):
             )
 
         dense_x = dense_x[ext_dist.get_my_slice(batch_size)]
-        lS_o = lS_o[self.local_emb_slice]
-        lS_i = lS_i[self.local_emb_slice]
+        # lS_o and lS_i are already those of the local tables for the whole batch (route_sparse_features)
 
         if (len(self.emb_l) != len(lS_o)) or (len(self.emb_l) != len(lS_i)):
             sys.exit(
@@ -644,8 +974,9 @@ class DLRM_Net(nn.Module):
             )
 
         # embeddings
-        with record_function("DLRM embedding forward"):
-            ly = self.apply_emb(lS_o, lS_i, self.emb_l, self.v_W_l)
+        config.profiler.start("FW_emb")
+        ly = self.apply_emb(lS_o, lS_i, self.emb_l, self.v_W_l, emb_biases)
+        config.profiler.end("FW_emb")
 
         # WARNING: Note that at this point we have the result of the embedding lookup
         # for the entire batch on each rank. We would like to obtain partial results
@@ -655,21 +986,29 @@ class DLRM_Net(nn.Module):
         if len(self.emb_l) != len(ly):
             sys.exit("ERROR: corrupted intermediate result in distributed_forward call")
 
+        # the transfer of the embeddings is their alltoall: the local tables for the whole batch ->
+        # all tables for the local batch slice
+        config.profiler.start("FW_emb_cpu_to_gpu")
+        if config.use_cpu:
+            ly = [y.to(config.device) for y in ly]
         a2a_req = ext_dist.alltoall(ly, self.n_emb_per_rank)
+        ly = list(a2a_req.wait())
+        config.profiler.end("FW_emb_cpu_to_gpu")
 
-        with record_function("DLRM bottom nlp forward"):
+        config.profiler.start("FW_bottom_mlp")
+        with mlp_autocast():
             x = self.apply_mlp(dense_x, self.bot_l)
+        config.profiler.end("FW_bottom_mlp")
 
-        ly = a2a_req.wait()
-        ly = list(ly)
-
-        # interactions
-        with record_function("DLRM interaction forward"):
+        config.profiler.start("FW_interact")
+        with mlp_autocast():
             z = self.interact_features(x, ly)
+        config.profiler.end("FW_interact")
 
-        # top mlp
-        with record_function("DLRM top nlp forward"):
-            p = self.apply_mlp(z, self.top_l)
+        config.profiler.start("FW_top_mlp")
+        with mlp_autocast():
+            p = self.apply_mlp(z, self.top_l).float()
+        config.profiler.end("FW_top_mlp")
 
         # clamp output if needed
         if 0.0 < self.loss_threshold and self.loss_threshold < 1.0:
@@ -679,10 +1018,16 @@ class DLRM_Net(nn.Module):
 
         return z
 
+    def split_dense_features(self, lS_o, lS_i):
+        # (bags of emb_l, bags of the dense tables), which follow those of emb_l (expand_sparse_features)
+        n_emb = len(self.emb_l)
+        return lS_o[:n_emb], lS_i[:n_emb], lS_o[n_emb:], lS_i[n_emb:]
+
     def sequential_forward(self, dense_x, lS_o, lS_i, emb_biases):
         # process dense features (using bottom mlp), resulting in a row vector
         config.profiler.start("FW_bottom_mlp")
-        x = self.apply_mlp(dense_x, self.bot_l)
+        with mlp_autocast():
+            x = self.apply_mlp(dense_x, self.bot_l)
         config.profiler.end("FW_bottom_mlp")
         # debug prints
         # print("intermediate")
@@ -690,6 +1035,7 @@ class DLRM_Net(nn.Module):
 
         # process sparse features(using embeddings), resulting in a list of row vectors
         config.profiler.start("FW_emb")
+        lS_o, lS_i, dense_lS_o, dense_lS_i = self.split_dense_features(lS_o, lS_i)
         ly = self.apply_emb(lS_o, lS_i, self.emb_l, self.v_W_l, emb_biases)
         config.profiler.end("FW_emb")
         
@@ -698,19 +1044,29 @@ class DLRM_Net(nn.Module):
 
         # interact features (dense and sparse)
         config.profiler.start("FW_emb_cpu_to_gpu")
-        if config.use_cpu:
+        if config.use_cpu and config.emb_transfer == "pinned":
+            if self.emb_transfer is None:
+                dtype = {"fp32": torch.float, "bf16": torch.bfloat16, "fp16": torch.float16}[config.emb_transfer_dtype]
+                self.emb_transfer = EmbOutputTransfer(config.device, dtype, self.emb_l, config.emb_ghost_norms == "device")
+            ly = self.emb_transfer(ly)
+        elif config.use_cpu:
             for i in range(len(ly)):
                 ly[i] = ly[i].to(config.device)
         config.profiler.end("FW_emb_cpu_to_gpu")
 
         config.profiler.start("FW_interact")
-        z = self.interact_features(x, ly)
+        # the dense tables are next to the MLPs
+        dense_ly = [E(dense_lS_i[k].to(config.device), None, dense_lS_o[k].to(config.device)) for k, E in enumerate(self.dense_emb_l)]
+        ly = self.combine_emb(ly, dense_ly)
+        with mlp_autocast():
+            z = self.interact_features(x, ly)
         config.profiler.end("FW_interact")
         # print(z.detach().cpu().numpy())
 
         # obtain probability of a click (using top mlp)
         config.profiler.start("FW_top_mlp")
-        p = self.apply_mlp(z, self.top_l)
+        with mlp_autocast():
+            p = self.apply_mlp(z, self.top_l).float()
         config.profiler.end("FW_top_mlp")
 
 
@@ -722,6 +1078,20 @@ class DLRM_Net(nn.Module):
 
         return z
 
+    def emb_forward(self, lS_o, lS_i, emb_biases):
+        # CPU side of sequential_forward(): outputs of the CPU-resident tables (config.cuda_graph, no dense tables)
+        lS_o, lS_i, _, _ = self.split_dense_features(lS_o, lS_i)
+        return self.apply_emb(lS_o, lS_i, self.emb_l, self.v_W_l, emb_biases)
+
+    def dense_forward(self, x, ly):
+        # GPU side of sequential_forward() from the embedding outputs in HBM (config.cuda_graph)
+        x = self.apply_mlp(x, self.bot_l)
+        z = self.interact_features(x, ly)
+        p = self.apply_mlp(z, self.top_l)
+        if 0.0 < self.loss_threshold and self.loss_threshold < 1.0:
+            p = torch.clamp(p, min=self.loss_threshold, max=(1.0 - self.loss_threshold))
+        return p
+
     def parallel_forward(self, dense_x, lS_o, lS_i):
         ### prepare model (overwrite) ###
         # WARNING: # of devices must be >= batch size in parallel_forward call
@@ -867,6 +1237,43 @@ def dash_separated_floats(value):
     return value
 
 
+def serving_benchmark(args, dlrm, train_ld, device, use_gpu, table_bytes):
+    # latency of the forward of each batch (--inference-only with --serving-model), its percentiles over the
+    # steady-state batches and the memory of the served model, one column per run in
+    # merged_result/<description>_serving.csv. The resident set is measured after the run, i.e., with the
+    # pages of the mapped tables the lookups touched
+    latency = []
+    with torch.no_grad():
+        for j, inputBatch in enumerate(train_ld):
+            if j >= args.num_batches:
+                break
+            X, lS_o, lS_i, _, _, _ = unpack_batch(inputBatch)
+            lS_o, lS_i = expand_sparse_features(dlrm, lS_o, lS_i)
+            start = time_wrap(use_gpu)
+            dlrm_wrap(X, lS_o, lS_i, use_gpu, device, None, None)
+            latency.append(time_wrap(use_gpu) - start)
+    assert len(latency) >= 2, "too few batches"
+    latency = torch.tensor(latency, dtype=torch.float64) * 1000
+    w = steady_state_start(latency)
+    steady = latency[w:]
+
+    index = ["Samples/sec", "Warmup batches", "Steady-state batches"]
+    result = [args.mini_batch_size * steady.numel() / (steady.sum().item() / 1000), w, steady.numel()]
+    for q in [50, 95, 99]:
+        index.append("Latency p%d (ms)" % q)
+        result.append(torch.quantile(steady, q / 100).item())
+    with open("/proc/self/statm") as f:
+        rss = int(f.read().split()[1]) * os.sysconf("SC_PAGE_SIZE")
+    index += ["Table bits", "Table memory (MB)", "RSS (MB)", "GPU memory (MB)"]
+    result += [dlrm.quantize_bits, table_bytes / 2**20, rss / 2**20, torch.cuda.memory_allocated() / 2**20 if use_gpu else 0]
+    path = "%s/result/merged_result/%s_serving.csv" % (args.path_lazydp, args.description)
+    df = pd.DataFrame({os.path.basename(args.serving_model): result}, index=index)
+    if os.path.isfile(path):
+        df = pd.concat([pd.read_csv(path, header=0, index_col=0), df], axis=1)
+    df.to_csv(path)
+    print(df)
+
+
 def inference(
     args,
     dlrm,
@@ -877,7 +1284,11 @@ def inference(
     use_gpu,
     log_iter=-1,
 ):
-    assert False, "This research only treats training, not inference"
+    # Evaluation fast path of the periodic test passes (--test-freq): the per-sample gradient hooks of the
+    # GradSampleModule are disabled and the bare model runs under torch.inference_mode with the batched
+    # multi-table lookup (config.emb_forward "batched" unless "tbe"), while the next test batch
+    # (--test-mini-batch-size) is prepared on a background thread. The test forward is not profiled.
+    # Under LazyDP, the rows not accessed since their last update are evaluated without their delayed noise
     test_accu = 0
     test_samp = 0
 
@@ -885,29 +1296,40 @@ def inference(
         scores = []
         targets = []
 
-    for i, testBatch in enumerate(test_ld):
-        # early exit if nbatches was set by the user and was exceeded
-        if nbatches > 0 and i >= nbatches:
-            break
-
+    model = getattr(dlrm, "_module", dlrm) # GradSampleModule
+    if model is not dlrm:
+        dlrm.disable_hooks()
+    profiler, config.profiler = config.profiler, NullLatencyMeter()
+    emb_forward, config.emb_forward = config.emb_forward, "tbe" if config.emb_forward == "tbe" else "batched"
+    # outputs pooled by the LazyDP update for the next training forward (config.update_pool_optimize == "fused")
+    prepooled, model.prepooled = model.prepooled, None
+    # staging buffers of the test batches, allocated under inference_mode, apart from those of training
+    emb_transfer, model.emb_transfer = model.emb_transfer, getattr(model, "test_emb_transfer", None)
+
+    def prepare(testBatch):
         X_test, lS_o_test, lS_i_test, T_test, W_test, CBPP_test = unpack_batch(
             testBatch
         )
+        lS_o_test, lS_i_test = expand_sparse_features(model, lS_o_test, lS_i_test)
+        lS_i_test, _ = map_dynamic_ids(model, lS_i_test)
+        materialize_emb_rows(model, lS_i_test)
+        return X_test, lS_o_test, lS_i_test, T_test
 
+    test_batches = PrefetchIterator(map(prepare, itertools.islice(test_ld, nbatches_test if nbatches_test > 0 else None)))
+    for i, (X_test, lS_o_test, lS_i_test, T_test) in enumerate(test_batches):
         # Skip the batch if batch size not multiple of total ranks
         if ext_dist.my_size > 1 and X_test.size(0) % ext_dist.my_size != 0:
             print("Warning: Skiping the batch %d with size %d" % (i, X_test.size(0)))
             continue
 
         # forward pass
-        Z_test = dlrm_wrap(
-            X_test,
-            lS_o_test,
-            lS_i_test,
-            use_gpu,
-            device,
-            ndevices=ndevices,
-        )
+        with torch.inference_mode():
+            if use_gpu:
+                X_test = X_test.to(device, non_blocking=True)
+                if not config.use_cpu:
+                    lS_i_test = [S_i.to(device) for S_i in lS_i_test]
+                    lS_o_test = [S_o.to(device) for S_o in lS_o_test]
+            Z_test = model(X_test, lS_o_test, lS_i_test, None)
         ### gather the distributed results on each rank ###
         # For some reason it requires explicit sync before all_gather call if
         # tensor is on GPU memory
@@ -934,6 +1356,13 @@ def inference(
                 test_accu += A_test
                 test_samp += mbs_test
 
+    model.prepooled = prepooled
+    model.test_emb_transfer, model.emb_transfer = model.emb_transfer, emb_transfer
+    config.emb_forward = emb_forward
+    config.profiler = profiler
+    if model is not dlrm:
+        dlrm.enable_hooks()
+
     if args.mlperf_logging:
         with record_function("DLRM mlperf sklearn metrics compute"):
             scores = np.concatenate(scores, axis=0)
@@ -1016,6 +1445,14 @@ def set_config(args):
     if config.num_gathers >= 10:
         config.coalesce_optimize = "multi_thread_openmp"
         config.unique_optimize = "multi_thread"
+    if args.coalesce_optimize is not None:
+        config.coalesce_optimize = args.coalesce_optimize
+    config.coalesce_async = args.coalesce_async
+    if config.coalesce_async:
+        # the per-table loop of the baseline update, with the kernels of coalesce_with (no autotuning)
+        assert args.dpsgd_mode == "lazydp" and args.delayed_noise_update_optimize == "baseline" and not args.coalesce_autotune
+    if args.unique_optimize is not None:
+        config.unique_optimize = args.unique_optimize
     
     # training algoirthm
     if args.dpsgd_mode == "sgd":
@@ -1042,14 +1479,56 @@ def set_config(args):
     # CPU-GPU system or not
     if args.system == "cpu_gpu":
         config.use_cpu = True
+    elif args.system == "cpu_only":
+        # the MLPs (intra-op threads of PyTorch, --torch-cpus) and the tables (worker pool, --pool-cpus) on disjoint cores
+        config.use_cpu = True
+        config.cpu_only = True
+        assert not args.use_gpu and args.gpu_cache_rows == 0 and args.emb_transfer == "baseline" and not args.cuda_graph
+        assert args.pool_cpus is not None and args.torch_cpus is not None
+        assert len(set(parse_cpu_list(args.pool_cpus)) & set(parse_cpu_list(args.torch_cpus))) == 0
     elif args.system == "gpu_only":
         config.use_cpu = False
     else:
         assert False, "Invalid system %s" %(args.system)
   
     result_name = "%s_%s_s_%.3f_B_%d_L_%d_%s" % (args.model_config, args.locality, args.emb_scale, args.mini_batch_size, args.num_indices_per_lookup, args.dpsgd_mode)
+    if args.run_tag != "":
+        # e.g., the thread count and NUMA placement of a sweep (bench/run_thread_scaling.sh)
+        result_name += "_%s" % args.run_tag
+    if args.noise_rng == "pool":
+        # a prefix, the training mode stays the suffix of the column (bench/perf_ci.py)
+        result_name = "NONSECURE_noise_pool_" + result_name
+    world_size = ext_dist.env2int(["PMI_SIZE", "OMPI_COMM_WORLD_SIZE", "MV2_COMM_WORLD_SIZE", "WORLD_SIZE"], 1)
+    config.dist_mode = args.dist_mode
+    config.dist_sparse_grad = args.dist_sparse_grad
+    config.dist_mlp_allreduce = args.dist_mlp_allreduce
+    config.dist_bucket_mb = args.dist_bucket_mb
+    config.dist_table_split = args.dist_table_split
+    assert config.dist_mlp_allreduce in ["serial", "overlapped"] and (world_size > 1 or config.dist_mlp_allreduce == "serial")
+    if world_size > 1:
+        # distributed LazyDP: model-parallel tables (each rank profiles its own tables) or data-parallel
+        # tables (each rank profiles its batch slice, opacus.optimizers.DistributedLazyDPOptimizer)
+        assert args.dpsgd_mode == "lazydp" and args.system in ["cpu_gpu", "cpu_only"] and args.clip_backward == "reweight" and not args.concurrent_step
+        if args.system == "cpu_only":
+            # multi-host CPU-only: one rank per host (or socket), the pooled embeddings and their gradients
+            # go through the alltoall of a CPU backend (point-to-point without all_to_all_single)
+            assert args.dist_backend in ["", "gloo", "mpi", "ccl"]
+        assert args.locality == "uniform" and args.load_trace is None and args.save_trace is None and not args.batch_queue
+        assert args.gpu_cache_rows == 0 and args.path_ssd_tables is None and args.save_row_counts is None and args.test_freq <= 0
+        if config.dist_mode == "data_parallel":
+            # the delayed noise of the replicas is keyed by the row, and derived once the rows of all ranks are known
+            assert args.noise_rng == "philox" and not args.noise_producer and not args.pipeline_lS_i
+        elif config.dist_mode != "model_parallel":
+            assert False
+        if config.dist_mlp_allreduce == "overlapped":
+            # every rank adds the same noise to the summed gradients of the MLPs
+            assert args.noise_rng == "philox" and args.mlp_noise_optimize == "baseline" and not args.secure_mode
+        result_name += "_rank%d" % ext_dist.env2int(["PMI_RANK", "OMPI_COMM_WORLD_RANK", "MV2_COMM_WORLD_RANK", "RANK"], 0)
     
-    config.profiler = LatencyMeter(args.dpsgd_mode, result_name, args.num_batches, args.description, "%s/result" %args.path_lazydp)
+    perf_stages = args.perf_stages.split(",") if args.perf_stages is not None else None
+    config.profiler = LatencyMeter(args.dpsgd_mode, result_name, args.num_batches, args.description, "%s/result" %args.path_lazydp, args.profiler_timing, args.native_trace, args.report_bandwidth,
+                                   args.report_throughput or args.bench_seconds > 0, args.report_memory, args.nvtx, args.itt,
+                                   perf_stages, args.perf_events.split(","), args.report_energy)
     
     config.disable_poisson_sampling = args.disable_poisson_sampling #TODO:
     if not config.disable_poisson_sampling:
@@ -1057,6 +1536,370 @@ def set_config(args):
         
     config.is_debugging = args.is_debugging
     config.debugging_type = args.debugging_type
+
+    config.delayed_noise_update_optimize = args.delayed_noise_update_optimize
+    config.shard_rows = args.shard_rows
+    config.graph_nthreads = args.graph_nthreads
+    if config.delayed_noise_update_optimize in ["sharded", "graph", "engine"]:
+        # the shards (graph nodes, engine) own the baseline HT slices of fp32 CPU tables, and set their HT within the update
+        assert args.ht_optimize == "baseline" and args.emb_precision == "fp32" and args.gpu_cache_rows == 0
+    if config.delayed_noise_update_optimize == "engine":
+        # the engine derives the unique rows itself, one iteration at a time
+        assert not args.pipeline_lS_i and args.emb_layout == "per_table" and args.accumulation_steps == 1
+    config.update_pool_optimize = args.update_pool_optimize
+    if config.update_pool_optimize == "fused":
+        # the fp32 host tables are final once updated: no GPU cache, no micro-batches, one process
+        assert config.delayed_noise_update_optimize == "fused" and args.emb_precision == "fp32" and args.gpu_cache_rows == 0
+        assert args.system == "cpu_gpu" and world_size == 1 and args.accumulation_steps == 1 and args.max_physical_batch_size is None
+        assert args.path_ssd_tables is None and not args.concurrent_step
+    elif config.update_pool_optimize != "baseline":
+        assert False
+    config.llc_prefetch = args.llc_prefetch
+    config.llc_prefetch_bytes = args.llc_prefetch_bytes
+    if config.llc_prefetch:
+        # host tables and HT, the rows of the next iteration are known one iteration ahead
+        assert args.dpsgd_mode == "lazydp" and args.system == "cpu_gpu" and args.ht_device == "cpu" and args.path_ssd_tables is None
+    config.noise_precision = args.noise_precision
+    config.table_server = args.table_server
+    config.noise_std_optimize = args.noise_std_optimize
+    config.delay_stats = args.delay_stats
+    config.delay_stats_max_delay = args.delay_stats_max_delay
+    if config.delay_stats:
+        assert args.dpsgd_mode == "lazydp" and args.delay_stats_max_delay > 0
+    config.record_unique_sets = args.record_unique_sets
+    if config.record_unique_sets is not None:
+        assert args.dpsgd_mode == "lazydp" and world_size == 1
+    config.noise_group_min_rows = args.noise_group_min_rows
+    if config.noise_std_optimize == "grouped":
+        # the noise rows are reordered, so only the coalescing of the concatenated COO "baseline" takes them
+        assert args.dpsgd_mode == "lazydp" and config.delayed_noise_update_optimize == "baseline" and config.ht_optimize == "baseline"
+        assert args.ht_device == "cpu" and args.noise_rng == "torch" and not args.secure_mode and not args.noise_producer and config.noise_group_min_rows > 0
+    elif config.noise_std_optimize not in ["baseline", "fused"]:
+        assert False
+    config.ht_optimize = args.ht_optimize
+    config.ht_bits = args.ht_bits
+    config.ht_hot_set = args.ht_hot_set
+    if config.ht_hot_set:
+        # the counters of the hot rows are in the bitmap of custom_api_cpp.HistoryTable
+        assert args.dpsgd_mode == "lazydp" and config.ht_optimize == "native" and config.ht_bits == 32
+    config.ht_blocked = args.ht_blocked
+    if config.ht_blocked:
+        # the lags are the 16/8-bit counters, flushed by rebase() when they overflow
+        assert args.dpsgd_mode == "lazydp" and config.ht_optimize == "native" and config.ht_bits != 32
+    config.pipeline_lS_i = args.pipeline_lS_i
+    assert args.lookahead >= 1
+    if args.lookahead > 1:
+        # the arenas of the dynamic tables keep the mapping of a single next batch (prepare_next()), and the
+        # flags of gradient accumulation are queued one batch ahead
+        assert not args.dynamic_emb_tables and args.max_physical_batch_size is None
+    config.batch_queue = args.batch_queue
+    config.index_dtype = args.index_dtype
+    if config.index_dtype == "int32":
+        # the other HT, the row reordering, the row cache and the readahead index with int64
+        assert config.ht_optimize == "native" and args.reorder_rows == "none" and args.gpu_cache_rows == 0
+        assert args.path_ssd_tables is None
+    elif config.index_dtype != "int64":
+        assert False
+    config.batch_queue_producers = args.batch_queue_producers
+    config.noise_producer = args.noise_producer
+    config.parallel_emb_init = args.parallel_emb_init
+    config.emb_init_seed = args.numpy_rand_seed
+    config.virtual_emb_tables = args.virtual_emb_tables
+    if config.virtual_emb_tables:
+        # only the rows of the local batches are materialized, and any pass over whole tables (a copy to another
+        # storage, precision or layout, prefaulting, the background drain of the noise) would commit all of them
+        assert args.dpsgd_mode in ["lazydp", "sgd"] and world_size == 1 and config.use_cpu and not args.is_debugging
+        assert args.emb_precision == "fp32" and args.huge_pages == "none" and args.numa_tables == "none" and args.emb_layout == "per_table"
+        assert args.path_ssd_tables is None and args.prefault_tables == "none" and args.reorder_rows == "none" and args.gpu_cache_rows == 0
+        assert args.table_placement == "none" and not args.noise_drain and args.load_model == ""
+        assert args.save_lazydp_checkpoint is None and args.resume_lazydp_checkpoint is None
+    config.dynamic_emb_tables = args.dynamic_emb_tables
+    config.dynamic_emb_capacity = args.dynamic_emb_capacity
+    config.dynamic_evict_ttl = args.dynamic_evict_ttl
+    config.dynamic_evict_lfu = args.dynamic_evict_lfu
+    config.dynamic_evict_high_water = args.dynamic_evict_high_water
+    config.dynamic_evict_scan = args.dynamic_evict_scan
+    config.dynamic_evict_cold_dir = args.dynamic_evict_cold_dir
+    if config.dynamic_evict_ttl > 0 or config.dynamic_evict_lfu > 0:
+        # the settled noise of an evicted row is keyed as the update of its last iteration
+        assert config.ht_optimize == "inline" and args.noise_rng == "philox" and 0 <= config.dynamic_evict_high_water <= 1 and config.dynamic_evict_scan > 0
+        if config.dynamic_evict_cold_dir is not None:
+            os.makedirs(config.dynamic_evict_cold_dir, exist_ok=True)
+    assert config.ht_optimize != "inline" or (config.dynamic_emb_tables and args.dpsgd_mode == "lazydp")
+    if config.dynamic_emb_tables:
+        # every table is dynamic, the ids of a batch are mapped when it is fetched, and the update of LazyDP (vanilla
+        # SGD) takes the unique rows and their delays from the tables instead of deriving and gathering them
+        assert args.dpsgd_mode in ["lazydp", "sgd"] and (config.ht_optimize == "inline") == (args.dpsgd_mode == "lazydp")
+        assert world_size == 1 and config.use_cpu and not args.is_debugging and not args.flush_noise_at_end and config.index_dtype == "int64"
+        assert not args.qr_flag and not args.md_flag and args.dense_emb_rows == 0 and not config.virtual_emb_tables
+        assert args.delayed_noise_update_optimize in ["baseline", "fused"] and args.noise_std_optimize == "baseline" and args.unique_optimize not in ["multi_thread_inverse", "sort_plan"]
+        assert args.optimizer == "sgd" and args.momentum == 0 and args.accumulation_steps == 1 and args.emb_weight_decay == 0
+        assert args.lr_num_warmup_steps == 0 and args.lr_num_decay_steps == 0 and args.batch_queue == 0 and not args.pipeline_lS_i
+        assert not args.noise_producer and not args.noise_drain and not args.delay_stats and args.record_unique_sets is None and not args.llc_prefetch
+        assert args.emb_precision == "fp32" and args.huge_pages == "none" and args.numa_tables == "none" and args.emb_layout == "per_table"
+        assert args.path_ssd_tables is None and args.reorder_rows == "none" and args.gpu_cache_rows == 0 and args.ht_device == "cpu"
+        assert args.table_placement == "none" and args.load_model == "" and args.save_lazydp_checkpoint is None and args.resume_lazydp_checkpoint is None
+    config.cold_rows = args.cold_rows
+    config.cold_rows_min_age = args.cold_rows_min_age
+    config.cold_rows_block = args.cold_rows_block
+    config.cold_rows_scan = args.cold_rows_scan
+    config.cold_rows_nthreads = args.cold_rows_nthreads
+    if config.cold_rows != "none":
+        # the released pages of the packed rows read as zeros until restored, so every access goes through the
+        # restore of the rows of its batch (materialize_emb_rows), and passes over whole tables restore all first
+        assert args.dpsgd_mode == "lazydp" and config.ht_optimize == "baseline" and args.ht_device == "cpu" and config.use_cpu and not args.is_debugging
+        assert args.emb_precision == "fp32" and args.huge_pages != "hugetlb" and args.path_ssd_tables is None and args.reorder_rows == "none" and args.gpu_cache_rows == 0
+        assert args.table_placement == "none" and not config.virtual_emb_tables and not config.dynamic_emb_tables and not args.noise_drain and args.save_lazydp_checkpoint is None and args.save_model == ""
+        # the rows of the batches prepared ahead are protected for cold_rows_min_age iterations, until their HT is set
+        assert config.cold_rows_min_age > args.lookahead + 1 and config.cold_rows_block > 0 and config.cold_rows_scan > 0
+    config.noise_producer_pinned = args.noise_producer and args.use_gpu
+    config.noise_drain = args.noise_drain
+    config.noise_drain_nthreads = args.noise_drain_nthreads
+    # threads of the update sub-stages (config.py defaults if not given)
+    if args.coalesce_nthreads is not None:
+        config.coalesce_nthreads = args.coalesce_nthreads
+    if args.noise_nthreads is not None:
+        config.noise_base_nthreads = config.noise_final_nthreads = args.noise_nthreads
+    if args.unique_nthreads is not None:
+        config.unique_nthreads = args.unique_nthreads
+    if args.ht_nthreads is not None:
+        config.ht_nthreads = args.ht_nthreads
+    config.noise_drain_rows = args.noise_drain_rows
+    config.noise_drain_threshold = args.noise_drain_threshold
+    config.noise_rng = args.noise_rng
+    config.noise_seed = args.noise_seed
+    config.mlp_noise_optimize = args.mlp_noise_optimize
+    if config.mlp_noise_optimize == "fused":
+        # one multi-tensor kernel for the noise and the SGD update of the MLPs in HBM, Philox noise and vanilla SGD
+        assert config.noise_rng == "philox" and args.use_gpu and not config.is_debugging
+    elif config.mlp_noise_optimize != "baseline":
+        assert False
+    # under a learning-rate schedule, the delayed noise follows the lr of every skipped iteration
+    lr_scheduled = args.lr_num_warmup_steps > 0 or args.lr_num_decay_steps > 0
+    config.lr_schedule_noise = "prefix_sum" if args.dpsgd_mode == "lazydp" and lr_scheduled else "constant"
+    if config.lr_schedule_noise == "prefix_sum":
+        # the stds of set_emb_to_noise_update() from the host HT, for the vanilla SGD of fp32 tables
+        assert config.delayed_noise_update_optimize in ["baseline", "merge", "fused", "batched"] and config.noise_std_optimize == "baseline"
+        assert config.use_cpu and args.ht_device == "cpu" and args.gpu_cache_rows == 0 and not args.noise_producer and not args.pipeline_lS_i
+        assert not config.noise_drain and not args.flush_noise_at_end and args.emb_precision == "fp32" and world_size == 1
+        assert args.optimizer == "sgd" and args.momentum == 0 and args.accumulation_steps == 1 and args.max_physical_batch_size is None
+    config.emb_weight_decay = args.emb_weight_decay
+    if config.emb_weight_decay > 0:
+        # lazy weight decay of the rows of fp32 tables by vanilla SGD, with the stds from the host HT
+        assert args.dpsgd_mode == "lazydp" and config.lr_schedule_noise == "constant"
+        assert config.delayed_noise_update_optimize in ["baseline", "merge"] and config.noise_std_optimize == "baseline" and config.ht_optimize != "native"
+        assert config.use_cpu and args.ht_device == "cpu" and args.gpu_cache_rows == 0 and not args.noise_producer and not args.pipeline_lS_i
+        assert not config.noise_drain and args.emb_precision == "fp32" and world_size == 1 and config.noise_rng in ["torch", "philox"] and not args.secure_mode
+        assert args.optimizer == "sgd" and args.momentum == 0 and args.accumulation_steps == 1 and args.max_physical_batch_size is None
+    elif config.emb_weight_decay < 0:
+        assert False
+    config.noise_pool_size = args.noise_pool_size
+    if config.noise_rng == "pool":
+        # NOT secure: only the (host) noise of the baseline and merge updates of the tables reads from the pool
+        assert config.delayed_noise_update_optimize in ["baseline", "merge"] and config.noise_precision == "fp32" and config.noise_std_optimize == "baseline"
+        assert config.use_cpu and args.ht_device == "cpu" and args.gpu_cache_rows == 0 and not args.noise_producer and not config.is_debugging
+        assert args.optimizer == "sgd" and args.momentum == 0 and args.accumulation_steps == 1
+        print("WARNING: --noise-rng pool reads overlapping, repeated samples of a Gaussian pool, the model is NOT differentially private")
+    elif config.noise_rng not in ["torch", "philox"]:
+        assert False
+    if args.secure_mode:
+        # the native 4-sum noise (custom_api_cpp.normal_secure_with_extra) of the baseline and merge updates of
+        # the host tables, keyed by a secret of the secure generator (torchcsprng)
+        assert config.delayed_noise_update_optimize in ["baseline", "merge"] and config.noise_precision == "fp32" and config.noise_std_optimize == "baseline"
+        assert config.use_cpu and args.ht_device == "cpu" and args.gpu_cache_rows == 0 and not args.noise_producer and not config.is_debugging
+        assert config.noise_seed is None and config.noise_rng != "pool" and config.mlp_noise_optimize == "baseline" and not config.noise_drain
+        assert args.optimizer == "sgd" and args.momentum == 0 and args.accumulation_steps == 1 and not args.flush_noise_at_end
+    config.huge_pages = args.huge_pages
+    config.prefault_tables = args.prefault_tables
+    config.mlock_tables = args.mlock_tables
+    assert not config.mlock_tables or config.prefault_tables != "none"
+    assert config.prefault_tables == "none" or args.path_ssd_tables is None # rows of the table files are read ahead per iteration
+    config.emb_precision = args.emb_precision
+    config.stochastic_rounding = args.stochastic_rounding
+    if config.emb_precision != "fp32":
+        # only the fused update upcasts the tables (and rounds them back), noise is not settled elsewhere
+        assert config.delayed_noise_update_optimize == "fused" and args.gpu_cache_rows == 0
+        assert not config.noise_drain and not args.flush_noise_at_end and config.ht_bits == 32
+        assert config.emb_precision != "int8" or (config.huge_pages == "none" and args.path_ssd_tables is None)
+    config.clip_backward = args.clip_backward
+    config.cuda_graph = args.cuda_graph
+    if config.cuda_graph:
+        # fixed shapes and a single GPU side between the embedding outputs and the loss
+        assert args.disable_poisson_sampling and args.use_gpu and config.use_cpu and args.dpsgd_mode == "lazydp"
+        assert args.clip_backward == "reweight" and args.dense_emb_rows == 0 and args.emb_transfer == "baseline" and world_size == 1
+        assert args.accumulation_steps == 1 and args.max_physical_batch_size is None and not args.is_debugging and not args.adaptive_clipping
+        assert args.mlp_amp == "none"
+    config.interaction_optimize = args.interaction_optimize
+    if config.interaction_optimize == "fused":
+        assert args.use_gpu and args.arch_interaction_op == "dot"
+    elif config.interaction_optimize != "baseline":
+        assert False
+    config.mlp_amp = args.mlp_amp
+    if config.mlp_amp in ["bf16", "fp16"]:
+        # ghost norms only, the hooks read the autocast activations and backprops in fp32
+        assert (args.use_gpu or config.cpu_only) and args.dpsgd_mode in ["dpsgd_f", "lazydp", "eana"]
+        if config.mlp_amp == "fp16":
+            assert args.use_gpu
+            config.amp_loss_scale = args.amp_loss_scale
+    elif config.mlp_amp != "none":
+        assert False
+    config.mlp_layer = args.mlp_layer
+    if config.mlp_layer == "dp_linear":
+        # ghost norms only (no per-sample gradients of DP-SGD(B)/(R)), plain fp32 nn.Linear
+        assert args.dpsgd_mode in ["dpsgd_f", "lazydp", "eana"]
+    elif config.mlp_layer != "linear":
+        assert False
+    config.dense_emb_rows = args.dense_emb_rows
+    if config.dense_emb_rows > 0:
+        # the bags of the dense tables follow those of emb_l, so the generators and consumers of per-table bags stay on emb_l
+        assert not args.qr_flag and not args.md_flag and args.weighted_pooling is None and world_size == 1 and config.clip_backward == "reweight"
+        assert args.locality == "uniform" and args.load_trace is None and not args.batch_queue and args.quantize_emb_with_bit == 32
+        assert args.reorder_rows == "none" and args.save_row_counts is None and args.gpu_cache_rows == 0
+    elif config.dense_emb_rows < 0:
+        assert False
+    config.table_placement = args.table_placement
+    config.placement_hbm_bytes = args.placement_hbm_bytes
+    config.um_group_bytes = args.um_group_bytes
+    config.um_advise_interval = args.um_advise_interval
+    config.um_hot_window = args.um_hot_window
+    if config.table_placement in ["auto", "managed"]:
+        # the tables in HBM take the CUDA paths of the gpu_only system (HT next to the table, Philox noise, coalescing)
+        assert config.use_cpu and args.use_gpu and args.dpsgd_mode == "lazydp" and world_size == 1
+        assert args.delayed_noise_update_optimize == "baseline" and args.ht_optimize == "baseline" and args.ht_device == "cpu"
+        assert args.noise_std_optimize == "baseline" and not args.noise_producer and not args.llc_prefetch
+        assert args.gpu_cache_rows == 0 and args.emb_precision == "fp32" and args.emb_transfer != "pinned"
+        assert args.weighted_pooling is None and args.reorder_rows == "none" and args.path_ssd_tables is None
+        assert config.clip_backward == "reweight" and config.emb_weight_decay == 0
+    if config.table_placement == "managed":
+        # the tables are allocated with cudaMallocManaged from the plain fp32 CPU tables
+        assert args.huge_pages == "none" and args.numa_tables == "none"
+        assert config.um_group_bytes > 0 and config.um_advise_interval > 0 and config.um_hot_window > 0
+    elif config.table_placement not in ["none", "auto"]:
+        assert False
+    config.emb_layout = args.emb_layout
+    if config.emb_layout == "concat":
+        # one fp32 buffer of the plain CPU tables, updated over the global rows with the baseline HT
+        assert config.use_cpu and args.dpsgd_mode == "lazydp" and world_size == 1 and not args.qr_flag and not args.md_flag
+        assert config.delayed_noise_update_optimize == "global" and args.ht_optimize == "baseline" and args.ht_device == "cpu"
+        assert args.noise_std_optimize == "baseline" and not args.secure_mode and args.noise_rng in ["torch", "philox"]
+        assert not args.noise_producer and not args.pipeline_lS_i and not args.batch_queue and not args.llc_prefetch
+        assert args.gpu_cache_rows == 0 and args.emb_precision == "fp32" and args.reorder_rows == "none" and args.numa_tables == "none"
+        assert args.path_ssd_tables is None and config.emb_weight_decay == 0 and config.lr_schedule_noise == "constant"
+        assert config.table_placement == "none" and args.optimizer == "sgd" and args.momentum == 0 and args.accumulation_steps == 1
+    elif config.emb_layout != "per_table":
+        assert False
+    if config.delayed_noise_update_optimize == "global":
+        assert config.emb_layout == "concat"
+    config.emb_transfer = args.emb_transfer
+    config.emb_forward = args.emb_forward
+    config.emb_forward_nthreads = args.emb_forward_nthreads
+    if config.emb_forward == "tbe":
+        # plain fp32 sum-pooled bags of the concatenated tables
+        assert config.emb_layout == "concat" and args.weighted_pooling is None and args.quantize_emb_with_bit == 32
+    config.emb_backward = args.emb_backward
+    assert config.emb_backward == "per_table" or config.clip_backward == "cached"
+    config.emb_grad_format = args.emb_grad_format
+    if config.emb_grad_format == "rows":
+        # the SGD step of the fp32 host tables is done by the merge update, p.grad of the tables stays None
+        assert args.dpsgd_mode == "lazydp" and config.delayed_noise_update_optimize == "merge" and config.use_cpu
+        assert args.ht_device == "cpu" and args.gpu_cache_rows == 0 and args.emb_precision == "fp32" and config.table_placement == "none"
+        assert args.optimizer == "sgd" and args.momentum == 0 and args.accumulation_steps == 1 and args.max_physical_batch_size is None
+    elif config.emb_grad_format != "coo":
+        assert False
+    config.concurrent_step = args.concurrent_step
+    if config.concurrent_step:
+        # the worker thread only touches the CPU-resident tables (no GPU cache, no offloaded noise producer)
+        assert config.use_cpu and args.gpu_cache_rows == 0 and not config.noise_producer and not args.is_debugging
+    config.async_emb_update = args.async_emb_update
+    if config.async_emb_update:
+        # the worker thread only updates fp32 CPU-resident rows that nothing else touches before it is joined
+        assert args.dpsgd_mode == "lazydp" and config.delayed_noise_update_optimize == "fused" and config.use_cpu
+        assert args.emb_precision == "fp32" and args.gpu_cache_rows == 0 and not config.noise_producer and not args.noise_drain
+        assert not args.concurrent_step and not args.is_debugging and args.cold_rows == "none"
+    config.emb_early_release = args.emb_early_release
+    if config.emb_early_release:
+        # the engine updates the tables in the background, the lookups of each table in the loop of apply_emb() wait for it
+        assert config.delayed_noise_update_optimize == "engine" and config.emb_forward in ["per_table", "dedup"]
+        assert not config.async_emb_update and not args.concurrent_step
+    if config.emb_transfer == "pinned":
+        assert config.use_cpu and args.use_gpu
+    config.emb_transfer_dtype = args.emb_transfer_dtype
+    if config.emb_transfer_dtype != "fp32":
+        assert config.emb_transfer == "pinned"
+    config.emb_ghost_norms = args.emb_ghost_norms
+    if config.emb_ghost_norms == "device":
+        # the norms are multiplied into the squared norms of the tables in the SquaredNormBuffer of the grad sample module
+        assert config.emb_transfer == "pinned" and args.dpsgd_mode in ["dpsgd_f", "lazydp", "eana"] and config.clip_backward != "per_layer"
+    elif config.emb_ghost_norms != "host":
+        assert False
+    if config.clip_backward == "cached":
+        # the cached gradients are those of the plain nn.Linear and fp32 nn.EmbeddingBag
+        assert config.emb_precision == "fp32" and args.gpu_cache_rows == 0
+    elif config.clip_backward == "per_layer":
+        # the gradients formed in the hooks are those of the plain nn.Linear and fp32 nn.EmbeddingBag, clipped locally
+        assert args.dpsgd_mode in ["dpsgd_f", "lazydp", "eana"] and config.emb_precision == "fp32" and args.gpu_cache_rows == 0
+        assert config.emb_backward == "per_table" and config.emb_grad_format == "coo" and world_size == 1
+    config.adaptive_clipping = args.adaptive_clipping
+    if config.adaptive_clipping:
+        # the threshold is updated once per (physical) batch, from the ghost norms of the flat clipping
+        assert config.clip_backward != "per_layer" and args.accumulation_steps == 1
+        config.adaclip_target_unclipped_quantile = args.target_unclipped_quantile
+        config.adaclip_clipbound_learning_rate = args.clipbound_learning_rate
+        config.adaclip_unclipped_num_std = args.unclipped_num_std
+        config.adaclip_min_clipbound = args.min_clipbound
+    config.numa_tables = args.numa_tables
+    config.numa_replicas = args.numa_replicas
+    config.numa_replica_bytes = args.numa_replica_bytes
+    if config.numa_replicas:
+        # the replicas are refreshed once the step is over, nothing updates the tables after it; only the
+        # "batched" lookups read them
+        assert args.pool_cpus is not None and config.emb_forward == "batched" and args.emb_precision == "fp32"
+        assert not args.concurrent_step and not args.async_emb_update and not args.emb_early_release and args.cold_rows == "none"
+    config.ht_device = args.ht_device
+    if config.ht_device == "gpu":
+        # the HT kernels of custom_api_cuda with the baseline HT, the noise rows shipped in fp32 to the CPU update
+        assert config.use_cpu and args.use_gpu and args.dpsgd_mode == "lazydp" and args.ht_optimize == "baseline"
+        assert args.delayed_noise_update_optimize in ["baseline", "merge"] and args.noise_precision == "fp32" and args.emb_precision == "fp32"
+        assert args.gpu_cache_rows == 0 and not args.noise_producer and not args.pipeline_lS_i and not args.noise_drain and not args.concurrent_step
+        assert args.optimizer == "sgd" and args.momentum == 0
+    elif config.ht_device != "cpu":
+        assert False
+    if not config.use_cpu and args.dpsgd_mode == "lazydp":
+        # tables and HT in HBM: the kernels of custom_api_cuda cover the baseline HT, the fp32 noise and the coalesce
+        assert args.use_gpu and args.delayed_noise_update_optimize == "baseline" and args.ht_optimize == "baseline"
+        assert args.emb_precision == "fp32" and args.noise_precision == "fp32" and args.unique_optimize not in ["multi_thread_inverse", "sort_plan"]
+        assert args.gpu_cache_rows == 0 and not args.noise_producer and not args.pipeline_lS_i and args.optimizer == "sgd" and args.momentum == 0
+    if args.qr_flag or args.md_flag:
+        # sub-tables in emb_l (DLRM_Net.create_emb), on a single rank; the packed transfer and the
+        # prebuilt unique indices of BatchQueue assume one table of one dimension per sparse feature
+        assert args.emb_transfer != "pinned" and args.batch_queue == 0 and args.reorder_rows != "pdf"
+        assert not (args.qr_flag and args.md_flag)
+    assert args.accumulation_steps >= 1
+    if args.max_physical_batch_size is not None:
+        # the logical batches of the loader are split instead (BatchSplittingSampler), not sampled by CriteoBinLoader
+        assert args.accumulation_steps == 1 and args.data_generation != "criteo_bin" and args.max_physical_batch_size > 0
+    if args.accumulation_steps > 1 or args.max_physical_batch_size is not None:
+        # the rows of the micro-batches are caught up on the CPU-resident tables and their HT one by one
+        # (DPOptimizer.catch_up_micro_batch), without the background and per-batch derivations of lS_i_nxt
+        assert config.use_cpu and config.ht_device == "cpu" and args.gpu_cache_rows == 0 and args.emb_precision == "fp32"
+        assert not args.noise_producer and not args.pipeline_lS_i and not args.concurrent_step and args.unique_optimize not in ["multi_thread_inverse", "sort_plan"]
+        assert args.ht_optimize == "baseline" or args.ht_bits == 32
+        assert args.save_lazydp_checkpoint is None and args.resume_lazydp_checkpoint is None
+    config.numa_split_rows = args.numa_split_rows
+    if config.numa_tables != "none":
+        # the rows are homed on the nodes of the pinned pool, file-backed tables are not migrated
+        assert args.pool_cpus is not None and args.path_ssd_tables is None
+    if args.tbb_cpus is not None or args.torch_cpus is not None:
+        assert args.pool_cpus is not None
+    if args.split_cpus_per_local_rank:
+        # hybrid parallelism: the ranks of a host (one per GPU) share its cores and DRAM, each pins its pools
+        # to its own share of the cores (and homes its tables there with --numa-tables)
+        assert args.pool_cpus is not None
+        local_rank = ext_dist.env2int(["MPI_LOCALRANKID", "OMPI_COMM_WORLD_LOCAL_RANK", "MV2_COMM_WORLD_LOCAL_RANK", "LOCAL_RANK"], 0)
+        local_size = ext_dist.env2int(["MPI_LOCALNRANKS", "OMPI_COMM_WORLD_LOCAL_SIZE", "MV2_COMM_WORLD_LOCAL_SIZE", "LOCAL_WORLD_SIZE"], 1)
+        args.pool_cpus, args.tbb_cpus, args.torch_cpus = [local_cpu_list(cpu_list, local_rank, local_size) for cpu_list in [args.pool_cpus, args.tbb_cpus, args.torch_cpus]]
+    if args.pool_cpus is not None:
+        init_pool(args.pool_cpus, args.tbb_cpus, args.torch_cpus)
     
 def run():
     ### parse arguments ###
@@ -1118,6 +1961,9 @@ def run():
     parser.add_argument("--num-indices-per-lookup-fixed", type=bool, default=False)
     parser.add_argument("--num-workers", type=int, default=0)
     parser.add_argument("--memory-map", action="store_true", default=False)
+    parser.add_argument("--criteo-bin-counts", type=str, default="") # day_fea_count.npz of --processed-data-file (--data-generation criteo_bin)
+    parser.add_argument("--criteo-bin-shuffle-buffer", type=int, default=0) # rows; > 0 streams the file (out-of-core) through a shuffle buffer
+    parser.add_argument("--criteo-bin-chunk-rows", type=int, default=1 << 20) # rows read ahead at once in the streaming mode
     # training
     parser.add_argument("--mini-batch-size", type=int, default=1)
     parser.add_argument("--nepochs", type=int, default=1)
@@ -1126,6 +1972,7 @@ def run():
     parser.add_argument("--numpy-rand-seed", type=int, default=123)
     parser.add_argument("--sync-dense-params", type=bool, default=True)
     parser.add_argument("--optimizer", type=str, default="sgd")
+    parser.add_argument("--momentum", type=float, default=0.0) # sgd only
     parser.add_argument(
         "--dataset-multiprocessing",
         action="store_true",
@@ -1147,6 +1994,11 @@ def run():
     # distributed
     parser.add_argument("--local_rank", type=int, default=-1)
     parser.add_argument("--dist-backend", type=str, default="")
+    parser.add_argument("--dist-mode", type=str, default="model_parallel") # tables of distributed LazyDP: model_parallel / data_parallel
+    parser.add_argument("--dist-sparse-grad", type=str, default="all_gather") # data_parallel: all_gather / alltoallv
+    parser.add_argument("--dist-mlp-allreduce", type=str, default="serial", choices=["serial", "overlapped"]) # "overlapped" sums the MLP gradients in buckets during the second backward
+    parser.add_argument("--dist-bucket-mb", type=int, default=25)
+    parser.add_argument("--dist-table-split", type=str, default="count", choices=["count", "rows"]) # model_parallel: same number of tables / about the same rows per rank
     # debugging and profiling
     parser.add_argument("--print-freq", type=int, default=1)
     parser.add_argument("--test-freq", type=int, default=-1)
@@ -1180,16 +2032,158 @@ def run():
     parser.add_argument("--dpsgd-mode", type=str, default="sgd")
     parser.add_argument("--disable-poisson-sampling", action="store_true", default=False)
     parser.add_argument("--multi-gpu", action="store_true", default=False)
-    parser.add_argument("--system", type=str, default="gpu_only")
+    parser.add_argument("--system", type=str, default="gpu_only") # gpu_only, cpu_gpu, cpu_only (no --use-gpu, with --pool-cpus and --torch-cpus)
     parser.add_argument("--description", type=str, default="")
+    parser.add_argument("--report-bandwidth", action="store_true", default=False) # report the achieved GB/s of the update stages against the STREAM triad peak (merged_result/<description>_bandwidth.csv)
+    parser.add_argument("--report-memory", action="store_true", default=False) # report the sizes of the training state and the per-iteration high-water marks (detailed_latency_breakdown/<result>_memory.csv and mem_* rows)
+    parser.add_argument("--report-throughput", action="store_true", default=False) # report samples/sec and p50/p95/p99 of each stage over the steady-state iterations (merged_result/<description>_throughput.csv)
+    parser.add_argument("--bench-seconds", type=float, default=0) # > 0: stop training after this wall-clock time (at most --num-batches iterations) and report the throughput
+    parser.add_argument("--native-trace", action="store_true", default=False) # trace the hot paths of custom_api_cpp into a Chrome trace JSON next to the detailed breakdown
+    parser.add_argument("--nvtx", action="store_true", default=False) # NVTX ranges of the LatencyMeter stages (and of the extension kernels built with LAZYDP_NVTX=1) for Nsight Systems
+    parser.add_argument("--itt", action="store_true", default=False) # ITT tasks of the hot paths of custom_api_cpp (built with LAZYDP_ITT=1) for VTune
+    parser.add_argument("--perf-stages", type=str, default=None) # comma-separated LatencyMeter columns around which hardware counters are read (e.g. Update_delayed_noise_update,coalesce)
+    parser.add_argument("--perf-events", type=str, default="cycles,instructions,llc_misses,dtlb_misses,mem_read_bytes,mem_write_bytes") # counters of --perf-stages, the unavailable ones are dropped
+    parser.add_argument("--report-energy", action="store_true", default=False) # joules (RAPL package/DRAM, NVML GPU) per iteration and per stage in merged_result/<description>_energy.csv
+    parser.add_argument("--metrics-port", type=int, default=None) # serve live Prometheus metrics (stage latency histograms, samples/sec, epsilon, ...) at http://<host>:<port + rank>/metrics
+    parser.add_argument("--metrics-push-url", type=str, default=None) # push the live metrics to this Prometheus Pushgateway instead of / besides serving them
+    parser.add_argument("--metrics-interval", type=int, default=10) # iterations between two updates of the live metrics
+    parser.add_argument("--profiler-timing", type=str, default="sync", choices=["sync", "events"]) # "events" times the breakdown with CUDA events without synchronizing at every boundary
     parser.add_argument("--path-lazydp", type=str, default="/")
     parser.add_argument("--emb-scale", type=float, default=1.0)
     parser.add_argument("--model-config", type=str, default="basic") # basic, mlperf, rmc1, rmc2, rmc3
     parser.add_argument("--n-table", type=int, default=26)
     parser.add_argument("--locality", type=str, default="uniform") # uniform, kaggle_n, zipf_f
+    parser.add_argument("--access-cache-dir", type=str, default=None) # cache of the converted access distributions and alias tables of --locality ($PATH_LAZYDP/result/access_cache if not given)
     parser.add_argument("--path-model-weight", type=str, default="/")
+    parser.add_argument("--parallel-emb-init", action="store_true", default=False) # generate the embedding tables with custom_api_cpp.init_table
+    parser.add_argument("--virtual-emb-tables", action="store_true", default=False) # initialize the rows of the embedding tables on first access (custom_api_cpp.VirtualTable)
+    parser.add_argument("--dynamic-emb-tables", action="store_true", default=False) # embedding tables over unbounded raw ids (custom_api_cpp.DynamicEmbeddingTable), with --ht-optimize=inline under LazyDP
+    parser.add_argument("--dynamic-emb-capacity", type=int, default=1 << 22) # rows of the arena of each dynamic table
+    parser.add_argument("--dynamic-evict-ttl", type=int, default=0) # LazyDP: evict the ids of the dynamic tables idle for more iterations (0: off)
+    parser.add_argument("--dynamic-evict-lfu", type=int, default=0) # LazyDP: evict the ids of decayed access count below this above the high-water mark (0: off)
+    parser.add_argument("--dynamic-evict-high-water", type=float, default=0.9) # fraction of the capacity above which the LFU eviction runs
+    parser.add_argument("--dynamic-evict-scan", type=int, default=1 << 16) # entries of the map scanned per iteration and table
+    parser.add_argument("--dynamic-evict-cold-dir", type=str, default=None) # cold tier of the evicted rows (noise settled), None: dropped
+    parser.add_argument("--cold-rows", type=str, default="none", choices=["none", "bf16", "int8"]) # LazyDP: pack the blocks of rows idle for --cold-rows-min-age iterations into a compressed cold tier
+    parser.add_argument("--cold-rows-min-age", type=int, default=1000)
+    parser.add_argument("--cold-rows-block", type=int, default=64) # rows per block of the cold tier
+    parser.add_argument("--cold-rows-scan", type=int, default=1 << 14) # blocks of each table scanned per iteration
+    parser.add_argument("--cold-rows-nthreads", type=int, default=4)
+    parser.add_argument("--emb-precision", type=str, default="fp32", choices=["fp32", "bf16", "fp16", "int8"]) # storage precision of the embedding tables (with --delayed-noise-update-optimize=fused), "int8" is row-wise
+    parser.add_argument("--stochastic-rounding", action="store_true", default=False) # round the updated rows of reduced-precision tables stochastically
+    parser.add_argument("--async-emb-update", action="store_true", default=False) # update the rows of the gradient not looked up by the next batch in a worker thread during its forward pass (LazyDP, --delayed-noise-update-optimize fused)
+    parser.add_argument("--emb-early-release", action="store_true", default=False) # start the lookups of the next forward pass of each table once its update is done (--delayed-noise-update-optimize engine)
+    parser.add_argument("--concurrent-step", action="store_true", default=False) # update the CPU-resident tables in a worker thread concurrently with the GPU-resident MLPs (cpu-gpu system)
+    parser.add_argument("--emb-forward", type=str, default="per_table", choices=["per_table", "batched", "tbe", "dedup"]) # "batched" pools all CPU-resident tables with one multi-table kernel, "tbe" with FBGEMM's TBE (--emb-layout concat), "dedup" reads each unique row once (--unique-optimize multi_thread_inverse reuses the sets of LazyDP)
+    parser.add_argument("--emb-forward-nthreads", type=int, default=32)
+    parser.add_argument("--emb-backward", type=str, default="per_table", choices=["per_table", "batched"]) # "batched" derives the clipped, coalesced gradients of all tables with one kernel (--clip-backward=cached)
+    parser.add_argument("--emb-grad-format", type=str, default="coo", choices=["coo", "rows"]) # "rows" keeps the gradients of the tables as (rows, values) up to their SGD step (--delayed-noise-update-optimize=merge)
+    parser.add_argument("--emb-transfer-dtype", type=str, default="fp32", choices=["fp32", "bf16", "fp16"]) # dtype of the embedding outputs and their gradients in the transfer of --emb-transfer pinned, upcast on arrival
+    parser.add_argument("--emb-ghost-norms", type=str, default="host", choices=["host", "device"]) # "device" takes the per-example norms of the gradients of the embedding outputs on the GPU (--emb-transfer pinned)
+    parser.add_argument("--emb-transfer", type=str, default="baseline", choices=["baseline", "pinned"]) # "pinned" packs the embedding outputs (and their gradients) into one pinned buffer copied on a dedicated stream (cpu-gpu system)
+    parser.add_argument("--dense-emb-rows", type=int, default=0) # tables of at most this many rows are dense parameters next to the MLPs, 0 to disable
+    parser.add_argument("--table-placement", type=str, default="none") # none, auto (tables of the largest predicted saving in HBM, cpu-gpu system), managed (all tables in CUDA Unified Memory)
+    parser.add_argument("--placement-hbm-bytes", type=int, default=0) # HBM budget of --table-placement auto / managed (hot row groups), 0 for half of the free HBM
+    parser.add_argument("--um-group-bytes", type=int, default=65536) # --table-placement managed: bytes of the row groups prefetched and advised together
+    parser.add_argument("--um-advise-interval", type=int, default=100) # --table-placement managed: iterations between two updates of the preferred locations
+    parser.add_argument("--um-hot-window", type=int, default=100) # --table-placement managed: row groups touched in this many last iterations prefer HBM
+    parser.add_argument("--clip-backward", type=str, default="reweight", choices=["reweight", "cached", "per_layer"]) # "cached" derives the clipped gradients from the first backward instead of backpropagating the re-weighted loss, "per_layer" clips each layer by its own norm in the hooks of the first backward
+    parser.add_argument("--mlp-layer", type=str, default="linear", choices=["linear", "dp_linear"]) # "dp_linear" derives the ghost norms of the MLPs in its own backward instead of the module hooks
+    parser.add_argument("--mlp-amp", type=str, default="none", choices=["none", "bf16", "fp16"]) # autocast of the GPU MLPs and the interaction (fp32 ghost norms and clip factors)
+    parser.add_argument("--amp-loss-scale", type=float, default=1024.0) # static loss scale of --mlp-amp fp16 (a power of two)
+    parser.add_argument("--interaction-optimize", type=str, default="baseline", choices=["baseline", "fused"]) # "fused" runs the dot interaction (forward and backward) as a single CUDA kernel each way
+    parser.add_argument("--cuda-graph", action="store_true", default=False) # capture the dense forward and both backward passes of the MLPs into CUDA graphs (--disable-poisson-sampling)
+    parser.add_argument("--adaptive-clipping", action="store_true", default=False) # adapt the clipping threshold to a target quantile of unclipped examples (fused into the clip factor kernel on the GPU)
+    parser.add_argument("--target-unclipped-quantile", type=float, default=0.5)
+    parser.add_argument("--clipbound-learning-rate", type=float, default=0.2)
+    parser.add_argument("--unclipped-num-std", type=float, default=1.0) # std of the noise of the count of unclipped examples
+    parser.add_argument("--min-clipbound", type=float, default=0.01) # the threshold stays within [--min-clipbound, max grad norm]
+    parser.add_argument("--reorder-rows", type=str, default="none", choices=["none", "pdf", "counts"]) # cluster hot rows of each table by the access distribution of --locality ("pdf") or the counts of --row-counts
+    parser.add_argument("--row-counts", type=str, default=None) # access counts saved by --save-row-counts of a previous run
+    parser.add_argument("--save-row-counts", type=str, default=None) # save the access counts of this run (original row order)
+    parser.add_argument("--path-ssd-tables", type=str, default=None) # keep the embedding tables in files under this path (out-of-core, cpu-gpu system)
+    parser.add_argument("--mmap-tables", action="store_true", default=False) # mmap the raw table files of the cached model at load instead of reading them
+    parser.add_argument("--table-server", type=str, default=None) # socket of bench/table_server.py, the tables of the cached model are mapped copy-on-write from its staged copy
     parser.add_argument("--is-debugging", action="store_true", default=False)
     parser.add_argument("--debugging-type", type=str, default="without_noise") # without_noise, one_as_noise, without_noise_clipping
+    parser.add_argument("--delayed-noise-update-optimize", type=str, default="baseline") # baseline, fused, merge, batched, sharded, global (with --emb-layout concat), graph, engine
+    parser.add_argument("--emb-layout", type=str, default="per_table") # per_table, concat (all tables in one buffer with global row offsets)
+    parser.add_argument("--shard-rows", type=int, default=1 << 20) # rows of a shard of the "sharded" update
+    parser.add_argument("--graph-nthreads", type=int, default=4) # threads of each node of the "graph" update
+    parser.add_argument("--update-pool-optimize", type=str, default="baseline") # baseline, fused (pool the next batch while updating, with --delayed-noise-update-optimize=fused)
+    parser.add_argument("--llc-prefetch", action="store_true", default=False) # load the rows of the next iteration into the LLC while the GPU runs the MLPs
+    parser.add_argument("--llc-prefetch-bytes", type=int, default=16 << 20) # budget of --llc-prefetch, a share of the LLC
+    parser.add_argument("--noise-precision", type=str, default="fp32") # fp32, bf16, fp16 (only with --delayed-noise-update-optimize=merge)
+    parser.add_argument("--noise-std-optimize", type=str, default="baseline") # baseline, fused, grouped
+    parser.add_argument("--noise-group-min-rows", type=int, default=64) # rows of a delay filled with a single std (--noise-std-optimize grouped)
+    parser.add_argument("--delay-stats", action="store_true", default=False) # per-table counters of the delayed noise, saved next to the detailed breakdown
+    parser.add_argument("--delay-stats-max-delay", type=int, default=4096) # longer delays share the last bin of the --delay-stats histogram
+    parser.add_argument("--record-unique-sets", type=str, default=None) # record the unique rows, delays and lookups of every update to this file (bench/replay_update.py)
+    parser.add_argument("--mlp-noise-optimize", type=str, default="baseline") # baseline, fused
+    parser.add_argument("--ht-optimize", type=str, default="baseline") # baseline, native, inline (with --dynamic-emb-tables)
+    parser.add_argument("--ht-device", type=str, default="cpu") # cpu, gpu (HT, delays and noise of the CPU tables in HBM)
+    parser.add_argument("--ht-bits", type=int, default=32) # 32, 16, 8 (only with --ht-optimize=native)
+    parser.add_argument("--ht-blocked", action="store_true", default=False) # two-level HT of groups of 64 rows and the lags of their lagging rows (--ht-optimize=native, 16/8 bits, e.g., with --reorder-rows)
+    parser.add_argument("--ht-hot-set", action="store_true", default=False) # keep the rows of consecutive iterations in a bitmap of the HT (--ht-optimize=native, 32 bits)
+    parser.add_argument("--pipeline-lS-i", action="store_true", default=False) # derive the next unique indices and stds in the background
+    parser.add_argument("--lookahead", type=int, default=1) # prepare the sparse features (routing, row readahead) of this many next batches, the noise stays one iteration ahead
+    parser.add_argument("--batch-queue", type=int, default=0) # prepare the sparse features (and unique indices) of this many next batches in the background
+    parser.add_argument("--batch-queue-producers", type=int, default=2)
+    parser.add_argument("--index-dtype", type=str, default="int64") # int64 / int32: dtype of the sparse features, the unique indices and the native HT accesses
+    parser.add_argument("--save-trace", type=str, default=None) # write the sparse features of every batch to a binary trace (custom_api_cpp.TraceWriter)
+    parser.add_argument("--trace-raw", action="store_true", default=False) # raw int32/int64 blocks instead of delta varints
+    parser.add_argument("--load-trace", type=str, default=None) # replay the sparse features of a trace instead of generating them (wraps around)
+    parser.add_argument("--noise-producer", action="store_true", default=False) # sample the delayed noise in the background after set_lS_i
+    parser.add_argument("--noise-drain", action="store_true", default=False) # settle stale delayed noise in the background
+    parser.add_argument("--noise-drain-nthreads", type=int, default=4)
+    parser.add_argument("--coalesce-nthreads", type=int, default=None)
+    parser.add_argument("--noise-nthreads", type=int, default=None) # noise_base_nthreads and noise_final_nthreads
+    parser.add_argument("--unique-nthreads", type=int, default=None)
+    parser.add_argument("--ht-nthreads", type=int, default=None)
+    # per-table coalesce kernel and threads, timed on the first iterations (custom_utils.CoalesceTuner)
+    parser.add_argument("--coalesce-autotune", action="store_true", default=False)
+    parser.add_argument("--coalesce-autotune-iters", type=int, default=3)
+    parser.add_argument("--coalesce-autotune-kernels", type=str, default="baseline-multi_thread_openmp-multi_thread_embeddingbag-radix-hash") # "-" separated
+    parser.add_argument("--coalesce-autotune-nthreads", type=str, default="1-4-8-16-32") # "-" separated
+    parser.add_argument("--coalesce-autotune-cache", type=str, default=None) # default: <path-lazydp>/result/coalesce_autotune.json
+    parser.add_argument("--run-tag", type=str, default="") # appended to the result name (column of the merged result)
+    parser.add_argument("--save-model-weight", action="store_true", default=False) # save the weights (path-model-weight) without --is-debugging too
+    parser.add_argument("--noise-drain-rows", type=int, default=1 << 20) # rows scanned per iteration
+    parser.add_argument("--noise-drain-threshold", type=int, default=64) # minimum delay to settle
+    parser.add_argument("--flush-noise-at-end", action="store_true", default=False) # apply all delayed noise after training
+    parser.add_argument("--path-model-export", type=str, default=None) # with --flush-noise-at-end, stream the parameters to this file (custom_utils.load_streamed_parameters)
+    parser.add_argument("--export-serving", type=str, default=None) # with --flush-noise-at-end, export the model with row-wise quantized tables to this path (custom_utils.export_serving_model)
+    parser.add_argument("--serving-bits", type=int, default=8, choices=[4, 8]) # bits per element of the exported tables
+    parser.add_argument("--serving-model", type=str, default=None) # with --inference-only, benchmark the lookups and forward of this exported model (merged_result/<description>_serving.csv)
+    parser.add_argument("--save-lazydp-checkpoint", type=str, default=None) # tables with their HT, the LazyDP state and the pending batch at the end of training (custom_utils.save_lazydp_checkpoint)
+    parser.add_argument("--resume-lazydp-checkpoint", type=str, default=None) # continue the run of --save-lazydp-checkpoint without settling the delayed noise
+    parser.add_argument("--lazydp-checkpoint-interval", type=int, default=0) # iterations between the incremental checkpoints, 0: only at the end
+    parser.add_argument("--lazydp-checkpoint-compact", type=int, default=8) # deltas folded into the base snapshot at once, 0: never
+    parser.add_argument("--lazydp-checkpoint-async", action="store_true", default=False) # write the checkpoints in the background while training continues
+    parser.add_argument("--accumulation-steps", type=int, default=1) # micro-batches (mini-batch-size each) accumulated in one step of the optimizer
+    parser.add_argument("--max-physical-batch-size", type=int, default=None) # split the logical batches (mini-batch-size) into physical ones of at most this size
+    parser.add_argument("--coalesce-optimize", type=str, default=None) # baseline, multi_thread_openmp, multi_thread_embeddingbag, radix, hash, hash_unsorted, dense, auto
+    parser.add_argument("--coalesce-async", action="store_true", default=False) # coalesce each table in the background while the noise of the next one is sampled (LazyDP baseline update)
+    parser.add_argument("--unique-optimize", type=str, default=None) # baseline, multi_thread, multi_thread_inverse, sort_plan, multi_thread_batched, bitmap
+    parser.add_argument("--noise-rng", type=str, default="torch") # torch, philox, pool (NOT secure, see config.noise_rng)
+    parser.add_argument("--emb-weight-decay", type=float, default=0.0) # lazy L2 weight decay of the embedding rows (lazydp, see config.emb_weight_decay)
+    parser.add_argument("--noise-pool-size", type=int, default=1 << 24) # samples of the Gaussian pool of --noise-rng pool, power of 2
+    parser.add_argument("--noise-seed", type=int, default=None)
+    parser.add_argument("--secure-mode", action="store_true", default=False) # PrivacyEngine(secure_mode=True), requires torchcsprng
+    parser.add_argument("--gpu-cache-rows", type=int, default=0) # rows per table cached in the GPU memory (cpu-gpu system, lazydp only), 0 to disable
+    parser.add_argument("--gpu-cache-refresh", type=int, default=100) # iterations between re-admissions of the GPU cache
+    parser.add_argument("--gpu-cache-decay", type=float, default=0.5) # decay of the access frequency at every re-admission
+    parser.add_argument("--huge-pages", type=str, choices=["none", "thp", "hugetlb"], default="none") # back the embedding tables (and HT, optimizer state) with huge pages
+    parser.add_argument("--prefault-tables", type=str, choices=["none", "read", "write"], default="none") # touch the pages of the CPU tables (and HT, optimizer state) in parallel before the first iteration
+    parser.add_argument("--mlock-tables", action="store_true", default=False) # lock the prefaulted pages in memory
+    parser.add_argument("--numa-tables", type=str, choices=["none", "table", "rows"], default="none") # home the tables (or row ranges of the big ones) on the NUMA nodes of --pool-cpus
+    parser.add_argument("--numa-split-rows", type=int, default=1000000) # "rows": tables of at least this many rows are split over the nodes
+    parser.add_argument("--numa-replicas", action="store_true", default=False) # replicate the alias tables and the small tables on the NUMA nodes of --pool-cpus (--emb-forward batched)
+    parser.add_argument("--numa-replica-bytes", type=int, default=4 << 20) # --numa-replicas: CPU tables of at most this many bytes are replicated
+    parser.add_argument("--pool-cpus", type=str, default=None) # e.g., 0-31: pin the worker pool of custom_api_cpp to these cores
+    parser.add_argument("--tbb-cpus", type=str, default=None) # e.g., 32-39: limit the TBB threads (parallel sorts / scans) of custom_api_cpp to these cores
+    parser.add_argument("--torch-cpus", type=str, default=None) # e.g., 40-47: pin the intra-op threads of PyTorch to these cores
+    parser.add_argument("--split-cpus-per-local-rank", action="store_true", default=False) # the cpu lists above are those of the host, each rank on it takes its contiguous share
 
 
     global args
@@ -1229,6 +2223,9 @@ def run():
             sys.exit("ERROR: quotient remainder with weighted pooling is not supported")
         if args.md_flag:
             sys.exit("ERROR: mixed dimensions with weighted pooling is not supported")
+        if args.dpsgd_mode != "sgd" and args.weighted_pooling != "fixed":
+            # the per-sample norms cover the tables pooled with the given weights, not the gradients of the weights
+            sys.exit("ERROR: DP training with learned pooling weights is not supported")
     if args.quantize_emb_with_bit in [4, 8]:
         if args.qr_flag:
             sys.exit(
@@ -1250,17 +2247,15 @@ def run():
     torch.set_printoptions(precision=args.print_precision)
     torch.manual_seed(args.numpy_rand_seed)
 
-    """
     if args.test_mini_batch_size < 0:
         # if the parameter is not set, use the training batch size
         args.test_mini_batch_size = args.mini_batch_size
     if args.test_num_workers < 0:
         # if the parameter is not set, use the same parameter for training
         args.test_num_workers = args.num_workers
-    """
 
     use_gpu = args.use_gpu and torch.cuda.is_available()
-    assert use_gpu, "Assume CPU-GPU system for trainig DLRM"
+    assert use_gpu or config.cpu_only, "Assume CPU-GPU system for trainig DLRM"
 
     if not args.debug_mode:
         ext_dist.init_distributed(local_rank=args.local_rank, use_gpu=use_gpu, backend=args.dist_backend)
@@ -1269,9 +2264,14 @@ def run():
         torch.cuda.manual_seed_all(args.numpy_rand_seed)
         torch.backends.cudnn.deterministic = True
         if ext_dist.my_size > 1:
-            assert False, "Current experiment use only one node"
+            # distributed LazyDP: one GPU per rank
+            # (the fused MLP update of a rank would skip the reduction of the MLP gradients)
+            assert config.mlp_noise_optimize == "baseline"
+            # the tables are split over the ranks per sparse feature, not per sub-table of QR/MD embeddings
+            assert not (args.qr_flag or args.md_flag)
             ngpus = 1
             device = torch.device("cuda", ext_dist.my_local_rank)
+            config.device = device
         else:
             ngpus = torch.cuda.device_count()
             ngpus = 1 # Use single GPU in this research
@@ -1279,8 +2279,9 @@ def run():
             config.device = device
         print("Using {} GPU(s)...".format(ngpus))
     else:
-        assert False, "Assume CPU-GPU system for trainig DLRM"
+        # config.cpu_only, the whole model stays in the host memory
         device = torch.device("cpu")
+        config.device = device
         print("Using CPU...")
 
     ### prepare training data ###
@@ -1318,6 +2319,24 @@ def run():
             ln_emb = np.array(ln_emb)
         m_den = train_data.m_den
         ln_bot[0] = m_den
+    elif args.data_generation == "criteo_bin":
+        # Criteo binary dataset (data_loader_terabyte.numpy_to_binary, or bench/preprocess_criteo.py from the raw logs) read by custom_api_cpp.CriteoBinReader,
+        # Poisson-sampled by the reader unless --disable-poisson-sampling
+        assert args.locality == "uniform" and args.num_indices_per_lookup == 1
+        with np.load(args.criteo_bin_counts) as data:
+            ln_emb = data["counts"]
+        if args.max_ind_range > 0:
+            ln_emb = np.minimum(ln_emb, args.max_ind_range)
+        # the kernels of LazyDP index with int64
+        train_ld = data_loader_terabyte.CriteoBinLoader(args.processed_data_file, args.mini_batch_size, args.num_batches, args.max_ind_range,
+                                                        not args.disable_poisson_sampling, args.numpy_rand_seed, False, config.data_gen_nthreads,
+                                                        args.criteo_bin_shuffle_buffer, args.criteo_bin_chunk_rows)
+        test_ld = None
+        nbatches = len(train_ld)
+        nbatches_test = 0
+        config.data_size = train_ld.n_samples
+        m_den = train_ld.m_den
+        ln_bot[0] = m_den
     else:
         # input and target at random
         with open(log_name, 'a') as f:
@@ -1345,10 +2364,22 @@ def run():
         m_den = ln_bot[0]
         train_data, train_ld, test_data, test_ld = dp.make_random_data_and_loader(args, ln_emb, m_den)
         nbatches = args.num_batches if args.num_batches > 0 else len(train_ld)
+        nbatches_test = len(test_ld)
         with open(log_name, 'a') as f:
             f.write(">> Generation of train loader is done\n")
 
     args.ln_emb = ln_emb.tolist()
+
+    if args.coalesce_autotune:
+        # the batched update coalesces all tables with one call of coalesce_multi_table
+        assert config.delayed_noise_update_optimize not in ["batched", "global"]
+        cache_path = args.coalesce_autotune_cache
+        if cache_path is None:
+            cache_path = "%s/result/coalesce_autotune.json" %args.path_lazydp
+        key = "%s_%s_s_%.3f_B_%d_L_%d_D_%d_%s" % (args.model_config, args.locality, args.emb_scale, args.mini_batch_size, args.num_indices_per_lookup, args.arch_sparse_feature_size, args.dpsgd_mode)
+        config.coalesce_tuner = CoalesceTuner(len(args.ln_emb), args.coalesce_autotune_kernels.split("-"),
+                                              [int(n) for n in args.coalesce_autotune_nthreads.split("-")],
+                                              args.coalesce_autotune_iters, key, cache_path)
     """
     if args.mlperf_logging:
         print("command line args: ", json.dumps(vars(args)))
@@ -1501,12 +2532,19 @@ def run():
     
     global dlrm
     dlrm_path = "%s/%s_%f" %(args.path_model_weight, args.model_config, args.emb_scale)
+    # embedding tables are stored in raw table files next to the model (written and read in parallel,
+    # or mapped with --mmap-tables)
+    dlrm_path += "_tables"
+    if args.qr_flag:
+        dlrm_path += "_qr_%s_%d" %(args.qr_operation, args.qr_collisions)
+    if args.md_flag:
+        dlrm_path += "_md_%f" %args.md_temperature
     
     if os.path.isfile(dlrm_path):
         with open(log_name, 'a') as f:
             f.write(">> Loading DLRM...\n")
 
-        dlrm = torch.load(dlrm_path)
+        dlrm = load_model_with_table_files(dlrm_path, mmap=args.mmap_tables)
         with open(log_name, 'a') as f:
             f.write(">> DLRM load is done\n")
             f.write(">> Model to GPU...\n")
@@ -1539,7 +2577,7 @@ def run():
        # Generate instance of DLRM at very first execution
         # Save this instance and reuse in next execution to
         # save experiment time
-        torch.save(dlrm, dlrm_path)
+        save_model_with_table_files(dlrm, dlrm_path)
 
         with open(log_name, 'a') as f:
             f.write(">> DLRM generation is done\n")
@@ -1562,6 +2600,13 @@ def run():
             # Embedding layers in CPU, MLP layers in GPU
             dlrm.bot_l = dlrm.bot_l.to(device)
             dlrm.top_l = dlrm.top_l.to(device)
+            dlrm.md_proj_l = dlrm.md_proj_l.to(device)
+            dlrm.dense_emb_l = dlrm.dense_emb_l.to(device)
+            # tables in HBM by the predicted time of their lookup, noise and update (config.table_placement)
+            gpu_tables = place_emb_tables(dlrm, table_access_pdfs(args.locality, [E.weight.shape[0] for E in dlrm.emb_l]), args.mini_batch_size, device)
+            if len(gpu_tables) > 0:
+                with open(log_name, 'a') as f:
+                    f.write(">> Tables in %s: %s\n" % ("managed memory" if config.table_placement == "managed" else "HBM", gpu_tables))
         else:
             # Use GPU-only system to train DLRM
             # All parameters of DLRM in GPU
@@ -1574,11 +2619,24 @@ def run():
             if dlrm.weighted_pooling == "fixed":
                 for k, w in enumerate(dlrm.v_W_l):
                     dlrm.v_W_l[k] = w.cuda()
+    move_emb_to_precision(dlrm)
+    move_emb_to_huge_pages(dlrm)
+    home_emb_on_numa_nodes(dlrm)
+    concat_emb_tables(dlrm)
+    row_readahead = None
+    if args.path_ssd_tables is not None:
+        # tables live in files under this path, the rows of the next iteration are read one iteration ahead
+        assert config.use_cpu
+        move_emb_to_table_files(dlrm, args.path_ssd_tables)
+        row_readahead = custom_api_cpp.RowReadahead()
     with open(log_name, 'a') as f:
         f.write(">> Model migration is done\n")
 
     # distribute data parallel mlps
-    if ext_dist.my_size > 1:
+    if ext_dist.my_size > 1 and args.dpsgd_mode == "lazydp":
+        # the clipped gradients of the MLPs (and of data-parallel tables) are summed over the ranks by the optimizer
+        assert args.optimizer == "sgd"
+    elif ext_dist.my_size > 1:
         assert False, "Disable distribute training"
         if use_gpu:
             device_ids = [ext_dist.my_local_rank]
@@ -1619,7 +2677,10 @@ def run():
                 },
             ]
         )
-        optimizer = opts[args.optimizer](parameters, lr=args.learning_rate)
+        if args.optimizer == "sgd":
+            optimizer = opts[args.optimizer](parameters, lr=args.learning_rate, momentum=args.momentum)
+        else:
+            optimizer = opts[args.optimizer](parameters, lr=args.learning_rate)
         lr_scheduler = LRPolicyScheduler(
             optimizer,
             args.lr_num_warmup_steps,
@@ -1711,21 +2772,21 @@ def run():
             print("Testing state: accuracy = {:3.3f} %".format(ld_acc_test * 100))
 
     if args.inference_only:
-        assert False, "Current experiment only considers training"
+        # serving of a model exported by --export-serving: its quantized tables replace the ones of the
+        # model of this configuration, and the forward of the batches of train_ld is benchmarked
+        assert args.serving_model is not None, "--inference-only benchmarks an exported model (--serving-model)"
+        dlrm.eval()
+        table_bytes = load_serving_model(dlrm, args.serving_model)
+        with open(log_name, 'a') as f:
+            f.write(">> Serving %s (%d-bit tables, %.1f MB)\n" %(args.serving_model, dlrm.quantize_bits, table_bytes / 2**20))
         # Currently only dynamic quantization with INT8 and FP16 weights are
-        # supported for MLPs and INT4 and INT8 weights for EmbeddingBag
-        # post-training quantization during the inference.
-        # By default we don't do the quantization: quantize_{mlp,emb}_with_bit == 32 (FP32)
+        # supported for MLPs, the tables are quantized by the export (--serving-bits)
+        # By default we don't do the quantization: quantize_mlp_with_bit == 32 (FP32)
         assert args.quantize_mlp_with_bit in [
             8,
             16,
             32,
         ], "only support 8/16/32-bit but got {}".format(args.quantize_mlp_with_bit)
-        assert args.quantize_emb_with_bit in [
-            4,
-            8,
-            32,
-        ], "only support 4/8/32-bit but got {}".format(args.quantize_emb_with_bit)
         if args.quantize_mlp_with_bit != 32:
             if args.quantize_mlp_with_bit in [8]:
                 quantize_dtype = torch.qint8
@@ -1734,9 +2795,8 @@ def run():
             dlrm = torch.quantization.quantize_dynamic(
                 dlrm, {torch.nn.Linear}, quantize_dtype
             )
-        if args.quantize_emb_with_bit != 32:
-            dlrm.quantize_embedding(args.quantize_emb_with_bit)
-            # print(dlrm)
+        serving_benchmark(args, dlrm, train_ld, device, use_gpu, table_bytes)
+        return
 
     print("time/loss/accuracy (if enabled):")
 
@@ -1767,17 +2827,24 @@ def run():
     writer = SummaryWriter(tb_file)
     
     if args.dpsgd_mode != "sgd":
-        privacy_engine = PrivacyEngine()
+        privacy_engine = PrivacyEngine(secure_mode=args.secure_mode)
 
         MAX_GRAD_NORM = 0.4
         # MAX_GRAD_NORM = 1.2
         EPSILON = 50.0
         DELTA = 1e-5
 
-        if not args.disable_poisson_sampling: #TODO:
-            assert(config.num_gathers == 1)
+        if not args.disable_poisson_sampling and args.data_generation != "criteo_bin": #TODO:
+            # single-hot sparse features of the dataset are replaced by multi_hot_indices() for num_gathers > 1
             custom_dataset = CustomDataset(args.num_batches * args.mini_batch_size, ln_emb, config.num_gathers)
-            train_ld = DataLoader(custom_dataset, batch_size=args.mini_batch_size, shuffle=False, collate_fn=collate_fn)
+            batch_ring = None
+            if args.num_workers > 0:
+                # the workers collate into shared (pinned) buffers handed to the training loop without copies,
+                # room for the Poisson-sampled batches up to 8 standard deviations above the mean
+                batch_ring = SharedBatchRing(collate_fn, args.num_workers, 2, args.mini_batch_size + 8 * int(np.sqrt(args.mini_batch_size)) + 16,
+                                             len(ln_emb), 13, use_gpu)
+            train_ld = DataLoader(custom_dataset, batch_size=args.mini_batch_size, shuffle=False, num_workers=args.num_workers,
+                                  collate_fn=collate_fn if batch_ring is None else batch_ring.collate)
             
         dlrm, optimizer, train_ld = privacy_engine.make_private_with_epsilon(
             module=dlrm,
@@ -1787,32 +2854,65 @@ def run():
             target_epsilon=EPSILON,
             target_delta=DELTA,
             max_grad_norm=MAX_GRAD_NORM,
-            disable_poisson_sampling=args.disable_poisson_sampling
+            # CriteoBinLoader samples the batches itself (sample_rate = batch_size / data_size)
+            disable_poisson_sampling=args.disable_poisson_sampling or args.data_generation == "criteo_bin",
+            accumulation_steps=args.accumulation_steps,
         )
+        if args.max_physical_batch_size is not None:
+            # physical batches of a logical one are accumulated, the sampler queues whether each ends it
+            train_ld = wrap_data_loader(data_loader=train_ld, max_batch_size=args.max_physical_batch_size, optimizer=optimizer)
+        if not args.disable_poisson_sampling and args.data_generation != "criteo_bin" and batch_ring is not None:
+            train_ld = SharedBatchLoader(train_ld, batch_ring)
         
         print("%s training" %args.dpsgd_mode)
         print(f"Using sigma={optimizer.noise_multiplier} and C={MAX_GRAD_NORM}")
+        if config.emb_early_release:
+            getattr(dlrm, "_module", dlrm).emb_update_wait = optimizer.wait_emb_table
+        if args.gpu_cache_rows > 0:
+            # hot rows of the CPU-resident tables are cached in the GPU memory
+            assert use_gpu and config.use_cpu and config.dpsgd_mode == MODE_LAZYDP
+            optimizer.set_row_cache(HotRowCache(optimizer.module.emb_l, args.gpu_cache_rows, args.gpu_cache_refresh, args.gpu_cache_decay, device))
     else:
         print("%s training" %args.dpsgd_mode)
 
     print("ext_dist.size: %d" % ext_dist.my_size)
     print("Done")
 
+    metrics_exporter = None
+    if args.metrics_port is not None or args.metrics_push_url is not None:
+        # one endpoint (or push group) per rank, the stragglers are the ranks with the slower stages
+        rank = ext_dist.env2int(["PMI_RANK", "OMPI_COMM_WORLD_RANK", "MV2_COMM_WORLD_RANK", "RANK"], 0)
+        unique_rows = None
+        if args.dpsgd_mode == "lazydp":
+            unique_rows = lambda: [v.numel() for v in optimizer.lS_i_nxt] if getattr(optimizer, "lS_i_nxt", None) is not None else None
+        metrics_exporter = MetricsExporter(config.profiler, args.metrics_port + rank if args.metrics_port is not None else None, args.metrics_push_url,
+                                           interval=args.metrics_interval, labels={"run": args.description, "rank": rank},
+                                           epsilon=(lambda: privacy_engine.accountant.get_epsilon(delta=DELTA)) if args.dpsgd_mode != "sgd" else None,
+                                           unique_rows=unique_rows, delay_stats=optimizer.stats if config.delay_stats else None)
+        config.profiler.exporter = metrics_exporter
+
     if config.use_cpu: # GPU-CPU system
         if args.dpsgd_mode != "sgd": 
-            emb_biases = [torch.zeros(args.arch_sparse_feature_size, requires_grad=True)]*len(dlrm.emb_l)
-            mlp_bias = torch.zeros(m_den, requires_grad=True).to(device)
+            emb_biases = emb_anchor_per_table(dlrm.emb_l, torch.device("cpu"))
+            mlp_bias = torch.nn.modules.sparse.output_anchor(device)
         else:
             emb_biases = None
             mlp_bias = None
     else: # GPU-only system
         if args.dpsgd_mode != "sgd":
-            emb_biases = [torch.zeros(args.arch_sparse_feature_size, requires_grad=True).to(device)]*len(dlrm.emb_l)
-            mlp_bias = torch.zeros(m_den, requires_grad=True).to(device)
+            emb_biases = emb_anchor_per_table(dlrm.emb_l, device)
+            mlp_bias = torch.nn.modules.sparse.output_anchor(device)
         else:
             emb_biases = None
             mlp_bias = None
     
+    dense_graph = None
+    if config.cuda_graph:
+        # the GPU side of the iterations (MLPs in HBM, tables in the CPU memory) captured once and replayed
+        dense_graph = DenseStepGraph(getattr(dlrm, "_module", dlrm).dense_forward, torch.nn.MSELoss(reduce=False),
+                                     [p for p in dlrm.parameters() if p.requires_grad and p.device == device])
+        optimizer.dense_graph = dense_graph
+
     with open(log_name, 'a') as f:
         f.write(">> Training start\n")
 
@@ -1827,54 +2927,172 @@ def run():
             
     config.num_gathers_list = num_gathers_list
 
-    def convert_pmf(original_pmf, new_length):
-        error = 0.000001
-        
-        original_length = len(original_pmf)
-        original_x = np.linspace(0, 1, original_length + 1)
-        original_cdf = np.insert(np.cumsum(original_pmf), 0, 0)
-        assert abs(original_cdf[-1] - 1) < error
-        assert len(original_x) == len(original_cdf)
-        
-        new_x = np.linspace(0, 1, new_length + 1)
-        new_cdf = np.interp(new_x, original_x, original_cdf)
-        assert abs(new_cdf[-1] - 1) < error
-        
-        new_pmf = np.diff(new_cdf)
-        assert len(new_pmf) == new_length
-        assert abs(new_pmf.sum() - 1) < error
-        
-        return new_pmf
-    
-    access_pdfs = list()    
-    if args.locality.startswith("zipf"): # locality with zipf distribution
-        a = float(args.locality.split("_")[-1])
-        for i in range(len(dlrm.emb_l)):
-            pdf = 1/((np.arange(dlrm.emb_l[i].weight.shape[0]) + 1) ** a)
-            pdf /= pdf.sum()
-            access_pdfs.append(pdf)
-    elif args.locality.startswith("kaggle"): # Criteo Kaggle DAC dataset (chose 1 table's distribution and use it for all tables)
-        target_table_idx = int(args.locality.split("_")[-1])
-        dist_path = "%s/Kaggle_train_distribution.csv" %args.path_lazydp
-        df = pd.read_csv(dist_path)
-        counts = df.iloc[:, target_table_idx].dropna().values.astype(float)
-        pmf_original = counts/counts.sum()
-        
-        for i in range(len(dlrm.emb_l)):
-            pmf_final = convert_pmf(pmf_original, dlrm.emb_l[i].weight.shape[0])
-            access_pdfs.append(pmf_final)
-    elif args.locality == "uniform":
-        assert True # Skip
-    else:
-        assert False, "Wrong locality"
+    access_pdfs = table_access_pdfs(args.locality, [E.weight.shape[0] for E in dlrm.emb_l])
+    # alias tables of the access distributions (O(1) per sampled index)
+    alias_sampler = None
+    if args.locality != "uniform":
+        alias_sampler = access_distribution_cache(args.locality).alias_sampler(access_pdfs, config.data_gen_nthreads)
+        if config.numa_replicas:
+            # before the producers of the batch queue draw from it
+            alias_sampler.replicate()
+    # rows of each sparse feature (those of its QR sub-tables are derived from its indices)
+    table_sizes = [int(n) for n in ln_emb] if args.qr_flag else [emb.weight.shape[0] for emb in dlrm.emb_l]
+
+    if args.report_memory:
+        # sizes of the training state, reported with the per-iteration high-water marks by LatencyMeter.save()
+        for i, emb in enumerate(dlrm.emb_l):
+            config.profiler.add_memory("emb_weight[%d]" % i, emb.weight.numel() * emb.weight.element_size())
+            if optimizer.HT is not None:
+                config.profiler.add_memory("HT[%d]" % i, optimizer.HT[i].numel() * optimizer.HT[i].element_size())
+            else:
+                n_groups = (emb.weight.shape[0] + 63) // 64 if config.ht_blocked else 0
+                config.profiler.add_memory("HT[%d]" % i, emb.weight.shape[0] * config.ht_bits // 8 + 16 * n_groups)
+        for i, pdf in enumerate(access_pdfs):
+            # mmapped and shared by the tables of the same size, counted once
+            if all(pdf is not other for other in access_pdfs[:i]):
+                config.profiler.add_memory("access_pdfs[%d]" % i, pdf.nbytes)
+        config.profiler.add_memory("mlp", sum(p.numel() * p.element_size() for name, p in dlrm.named_parameters() if not name.startswith("emb_l")))
+        for state in optimizer.original_optimizer.state.values():
+            config.profiler.add_memory("optimizer_state", sum(v.numel() * v.element_size() for v in state.values() if torch.is_tensor(v)))
+
+    row_reorder = None
+    if args.reorder_rows != "none" or args.save_row_counts is not None:
+        # hot rows are clustered before the first iteration (the HT and the optimizer state are permuted as well)
+        assert args.gpu_cache_rows == 0
+        row_reorder = RowReorder(dlrm.emb_l)
+    if args.reorder_rows == "pdf":
+        assert args.locality != "uniform"
+        row_reorder.set_counts_from_pdfs(access_pdfs)
+        row_reorder.apply(optimizer)
+    elif args.reorder_rows == "counts":
+        row_reorder.load_counts(args.row_counts)
+        row_reorder.apply(optimizer)
+    elif args.reorder_rows != "none":
+        assert False
+
+    trace_reader = None
+    trace_writer = None
+    if args.load_trace is not None:
+        trace_reader = custom_api_cpp.TraceReader(args.load_trace)
+        pooling_factors = config.num_gathers_list.tolist() if config.num_gathers > 1 else [1] * len(dlrm.emb_l)
+        assert trace_reader.table_sizes() == table_sizes and trace_reader.pooling_factors() == pooling_factors
+        assert trace_reader.batch_size() == config.batch_size and config.batch_queue == 0
+        assert args.disable_poisson_sampling # batches of the trace have a fixed size
+    if args.save_trace is not None:
+        pooling_factors = config.num_gathers_list.tolist() if config.num_gathers > 1 else [1] * len(dlrm.emb_l)
+        trace_writer = custom_api_cpp.TraceWriter(args.save_trace, table_sizes, pooling_factors, config.batch_size, not args.trace_raw)
+
+    int32_indices = config.index_dtype == "int32"
+    batch_queue = None
+    if config.batch_queue > 0:
+        # the unique indices are derived before the rows are remapped, for batches of a fixed size
+        assert row_reorder is None and args.disable_poisson_sampling
+        pooling_factors = config.num_gathers_list.tolist() if config.num_gathers > 1 else [1] * len(dlrm.emb_l)
+        batch_queue = custom_api_cpp.BatchQueue(table_sizes, pooling_factors, config.batch_size, alias_sampler, args.numpy_rand_seed,
+                                                config.batch_queue, config.batch_queue_producers, config.data_gen_nthreads, use_gpu,
+                                                config.unique_optimize == "sort_plan")
         
+    resumed_batch = None
+    if args.resume_lazydp_checkpoint is not None:
+        # rows of the checkpoint are in their original order, those of the cache only live in the GPU memory
+        assert config.dpsgd_mode == config.MODE_LAZYDP and row_reorder is None and args.gpu_cache_rows == 0
+        with open(log_name, 'a') as f:
+            f.write(">> Resuming LazyDP from %s\n" %args.resume_lazydp_checkpoint)
+        resumed_batch = load_incremental_checkpoint(lazydp_checkpoint_path(args.resume_lazydp_checkpoint), dlrm, optimizer)
+
+    lazydp_checkpointer = None
+    if args.save_lazydp_checkpoint is not None:
+        # a base snapshot at the first save, then only the rows updated in between (custom_utils.IncrementalCheckpointer)
+        assert config.dpsgd_mode == config.MODE_LAZYDP and row_reorder is None and args.gpu_cache_rows == 0
+        # the resumed tables are private mappings of the files of their checkpoint, which must not be rewritten
+        assert args.save_lazydp_checkpoint != args.resume_lazydp_checkpoint
+        # a fork()-ed child would see the updates of MAP_SHARED file-backed tables
+        lazydp_checkpointer = IncrementalCheckpointer(lazydp_checkpoint_path(args.save_lazydp_checkpoint), args.lazydp_checkpoint_compact,
+                                                      args.lazydp_checkpoint_async, fork_tables=args.path_ssd_tables is None)
+
+    # the tables are final (loaded, resumed, reordered), their pages are faulted in before the first iteration
+    prefault_emb_tables(dlrm, optimizer)
+    move_emb_to_cold_tier(dlrm)
+    numa_replicated = replicate_read_mostly(dlrm)
+    if len(numa_replicated) > 0:
+        with open(log_name, 'a') as f:
+            f.write(">> Tables replicated on the NUMA nodes: %s\n" % numa_replicated)
     ext_dist.barrier()
+    def prepare_batch(k, j, inputBatch):
+        # the sparse features of batch j of epoch k ready for the iteration before it (set_lS_i, the lookups),
+        # prepared args.lookahead iterations ahead of that one (LookaheadIterator): the routing of model-parallel
+        # tables and the readahead of the rows of the table files start that many iterations early
+        if j == 0 and args.save_onnx:
+            assert False, "Exclude the save_onnx"
+            X_onnx, lS_o_onnx, lS_i_onnx, _, _, _ = unpack_batch(inputBatch)
+
+        X_nxt, lS_o_nxt, lS_i_nxt, T_nxt, W_nxt, CBPP_nxt = unpack_batch(inputBatch)
+        # variable with Poisson sampling
+        mbs_nxt = X_nxt.shape[0]
+        uniques_nxt = plans_nxt = None
+        if trace_reader is not None:
+            lS_i_nxt, lS_o_nxt = trace_reader.read(j % trace_reader.n_batches(), config.data_gen_nthreads)
+        elif batch_queue is not None:
+            lS_i_nxt, lS_o_nxt, uniques_nxt, plans_nxt = batch_queue.pop()
+        elif args.locality != "uniform" and config.num_gathers == 1:
+            seed = int(torch.randint(0, 2**62, (1,)).item())
+            lS_i_nxt, _ = alias_sampler.sample(mbs_nxt, [1] * len(dlrm.emb_l), seed, config.data_gen_nthreads, int32_indices=int32_indices)
+        elif config.num_gathers > 1:
+            # distinct indices per bag, uniform or from the access distributions
+            seed = int(torch.randint(0, 2**62, (1,)).item())
+            if alias_sampler is None:
+                lS_i_nxt, lS_o_nxt = custom_api_cpp.multi_hot_indices(table_sizes, config.num_gathers_list.tolist(), mbs_nxt, seed, config.data_gen_nthreads, int32_indices)
+            else:
+                lS_i_nxt, lS_o_nxt = alias_sampler.sample(mbs_nxt, config.num_gathers_list.tolist(), seed, config.data_gen_nthreads, int32_indices=int32_indices)
+        elif args.locality == "uniform":
+            assert True
+        else:
+            assert False
+        
+        if int32_indices and any(lS_i_table.dtype != torch.int for lS_i_table in lS_i_nxt):
+            # the generators already produce int32, the other loaders are converted at once
+            lS_jagged_nxt = JaggedSparse.pack(lS_i_nxt, lS_o_nxt).to(dtype=torch.int)
+            lS_i_nxt, lS_o_nxt = lS_jagged_nxt.tables(), lS_jagged_nxt.offsets
+        elif int32_indices:
+            lS_o_nxt = lS_o_nxt.int()
+
+        # one iteration ahead, so set_lS_i() of each rank sees the rows of its own tables, the
+        # exchange of model-parallel tables completes during this iteration (waited in set_lS_i)
+        lS_nxt_req = None
+        if ext_dist.my_size > 1 and config.dist_mode == "model_parallel" and not (config.pipeline_lS_i or (j == 0 and k == 0)):
+            lS_nxt_req = route_sparse_features(lS_o_nxt, lS_i_nxt, async_op=True)
+        else:
+            lS_o_nxt, lS_i_nxt = route_sparse_features(lS_o_nxt, lS_i_nxt)
+
+        if trace_writer is not None:
+            trace_writer.append(lS_i_nxt, config.data_gen_nthreads)
+
+        # the bags of the sub-tables of QR embeddings, for the forward and set_lS_i()
+        lS_o_nxt, lS_i_nxt = expand_sparse_features(dlrm, lS_o_nxt, lS_i_nxt)
+
+        if args.save_row_counts is not None:
+            row_reorder.observe(lS_i_nxt)
+
+        # the raw ids of the dynamic tables as rows of their arenas, with the unique rows of LazyDP
+        lS_i_nxt, uniques_nxt = map_dynamic_ids(dlrm, lS_i_nxt, uniques_nxt, optimizer if config.dpsgd_mode == config.MODE_LAZYDP else None)
+
+        # the rows of the virtual tables first accessed by the next batch, before its update and lookups
+        materialize_emb_rows(dlrm, lS_i_nxt)
+        if config.dpsgd_mode == config.MODE_LAZYDP:
+            # the cold blocks are packed while this iteration runs (the rows of the batch, just restored, stay hot)
+            compact_cold_rows(dlrm, optimizer)
+
+        if row_readahead is not None:
+            row_readahead.submit([emb.weight.data for emb in dlrm.emb_l], [remap_rows(emb, lS_i_table) for emb, lS_i_table in zip(dlrm.emb_l, lS_i_nxt)])
+        return X_nxt, lS_o_nxt, lS_i_nxt, T_nxt, uniques_nxt, plans_nxt, lS_nxt_req
+
     with torch.autograd.profiler.profile(
         args.enable_profiling, use_cuda=use_gpu, record_shapes=True
     ) as prof:
         if not args.inference_only:
             k = 0
             total_time_begin = 0
+            bench_deadline = time.time() + args.bench_seconds if args.bench_seconds > 0 else None
             while k < args.nepochs:
                 if args.mlperf_logging:
                     assert False, "do not use mlper_logging"
@@ -1899,53 +3117,19 @@ def run():
                     assert False, "Exclude the mlperf_logging"
                     previous_iteration_time = None
 
-                for j, inputBatch in enumerate(train_ld):
-                    
-                    if j == 0 and args.save_onnx:
-                        assert False, "Exclude the save_onnx"
-                        X_onnx, lS_o_onnx, lS_i_onnx, _, _, _ = unpack_batch(inputBatch)
+                # the next batch of an iteration, its sparse features prepared args.lookahead iterations ahead
+                batches = LookaheadIterator(((j, inputBatch) for j, inputBatch in enumerate(train_ld) if j >= skip_upto_batch),
+                                            lambda batch: (batch[0], prepare_batch(k, *batch)), args.lookahead)
+                for j, (X_nxt, lS_o_nxt, lS_i_nxt, T_nxt, uniques_nxt, plans_nxt, lS_nxt_req) in batches:
 
-                    if j < skip_upto_batch:
+                    if j == 0 and k == 0 and resumed_batch is not None:
+                        # the pending batch of the checkpoint was primed by the saved run, so it takes the place
+                        # of the first batch of the loader (the run has as many iterations as a fresh one)
+                        X, lS_o, lS_i, T = resumed_batch
                         continue
-                    
-                    X_nxt, lS_o_nxt, lS_i_nxt, T_nxt, W_nxt, CBPP_nxt = unpack_batch(inputBatch)
-                    if args.locality != "uniform" and config.num_gathers == 1:
-                        lS_i_nxt = list()
-                        for table_idx in range(len(dlrm.emb_l)):
-                            lS_i_table = np.random.choice(dlrm.emb_l[table_idx].weight.shape[0], config.batch_size, replace=True, p=access_pdfs[table_idx])
-                            lS_i_nxt.append(torch.from_numpy(lS_i_table))
-                    elif args.locality != "uniform" and config.num_gathers != 1:
-                        # Exclude the case whose num_gathers > 1 and args.a > 0
-                        # because it takes too long to generate synthetic dataset
-                        assert False
-                    elif args.locality == "uniform" and config.num_gathers > 1:
-                        lS_i_nxt = list()
-                        for table_idx in range(len(dlrm.emb_l)):
-                            lS_i_table = list()
-                            goal = config.num_gathers_list[table_idx].item()
-                            table_size = dlrm.emb_l[table_idx].weight.shape[0]
-                            for example_idx in range(config.batch_size):
-                                lS_i_example = None
-                                num = 0
-                                while num < goal:
-                                    tmp = torch.randint(0, table_size, (goal - num, ), dtype=torch.int64)
-                                    if lS_i_example != None:
-                                        lS_i_example = torch.cat([lS_i_example, tmp]).unique()
-                                    else:
-                                        lS_i_example = tmp.unique()
-                                    num = lS_i_example.shape[0]
-                                
-                                lS_i_table.append(lS_i_example)
-                            lS_i_nxt.append(torch.cat(lS_i_table))
-                        
-                        lS_o_nxt = torch.arange(config.batch_size).repeat(len(dlrm.emb_l), 1) * config.num_gathers_list.view(-1, 1)
-                    elif args.locality == "uniform":
-                        assert True
-                    else:
-                        assert False
-                    
+
                     if j == 0 and k == 0: # if this iteration is very first
-                        optimizer.set_lS_i(lS_i_nxt)
+                        optimizer.set_lS_i(lS_i_nxt, uniques_nxt, plans_nxt=plans_nxt)
                         optimizer.set_HT_increase_cnt_iter()
                         X = X_nxt
                         lS_i = lS_i_nxt
@@ -1953,6 +3137,10 @@ def run():
                         T = T_nxt
                         continue
 
+                    if config.pipeline_lS_i:
+                        # unique indices and stds of the next iteration are derived while forward/backward runs
+                        optimizer.prefetch_lS_i(lS_i_nxt)
+
                     # if args.mlperf_logging:
                     #     current_time = time_wrap(use_gpu)
                     #     if previous_iteration_time:
@@ -1966,6 +3154,8 @@ def run():
                     # early exit if nbatches was set by the user and has been exceeded
                     if nbatches > 0 and j >= nbatches:
                         break
+                    if bench_deadline is not None and time.time() > bench_deadline:
+                        break
 
                     # Skip the batch if batch size not multiple of total ranks
                     if ext_dist.my_size > 1 and X.size(0) % ext_dist.my_size != 0:
@@ -1976,28 +3166,52 @@ def run():
                         continue
 
                     mbs = T.shape[0]  # = args.mini_batch_size except maybe for last
+                    # gradient accumulation: only the last micro-batch of a logical step updates the model
+                    if args.max_physical_batch_size is not None:
+                        # the flags are queued as the loader draws the batches (one ahead), the front one is of this batch
+                        skip_step = optimizer._check_skip_next_step(pop_next=False)
+                    else:
+                        skip_step = args.accumulation_steps > 1 and j % args.accumulation_steps != 0
                     
+                    if config.update_pool_optimize == "fused":
+                        # the bags of this batch were pooled by the update of the last iteration
+                        getattr(dlrm, "_module", dlrm).prepooled = optimizer.pop_pooled_nxt()
+                    if config.emb_forward == "dedup" and config.dpsgd_mode == config.MODE_LAZYDP:
+                        # the unique rows of this batch and their inverse were derived by set_lS_i() of the last iteration
+                        getattr(dlrm, "_module", dlrm).dedup_sets = optimizer.unique_sets_nxt()
+
                     # forward pass
-                    Z = dlrm_wrap(
-                        X,
-                        lS_o,
-                        lS_i,
-                        use_gpu,
-                        device,
-                        emb_biases,
-                        mlp_bias,
-                        ndevices=ndevices,
-                    )
+                    if dense_graph is not None:
+                        # CPU-resident tables only, the GPU side is replayed with the first backward (BW_grad)
+                        config.profiler.start("FW_emb")
+                        ly_host = getattr(dlrm, "_module", dlrm).emb_forward(lS_o, lS_i, emb_biases)
+                        config.profiler.end("FW_emb")
+                    else:
+                        Z = dlrm_wrap(
+                            X,
+                            lS_o,
+                            lS_i,
+                            use_gpu,
+                            device,
+                            emb_biases,
+                            mlp_bias,
+                            ndevices=ndevices,
+                        )
                     config.cur_batch_size = T.shape[0]
+                    config.cur_num_indices_list = [lS_i_table.numel() for lS_i_table in lS_i]
                     
                     if ext_dist.my_size > 1:
-                        T = T[ext_dist.get_my_slice(mbs)]
-                        W = W[ext_dist.get_my_slice(mbs)]
+                        # the MLPs and the loss of this rank cover its slice of the batch (data-parallel: also the tables)
+                        config.dist_batch_slice = ext_dist.get_my_slice(mbs)
+                        T = T[config.dist_batch_slice]
+                        if config.dist_mode == "data_parallel":
+                            config.cur_batch_size = T.shape[0]
 
                     # loss
                     config.profiler.start("FW_loss")
-                    not_reduced_losses = torch.nn.MSELoss(reduce=False)(Z, T.to(device))
-                    E = not_reduced_losses.mean()
+                    if dense_graph is None:
+                        not_reduced_losses = torch.nn.MSELoss(reduce=False)(Z, T.to(device))
+                        E = not_reduced_losses.mean()
                     config.profiler.end("FW_loss")
                     
 
@@ -2024,33 +3238,57 @@ def run():
                             
                         # backward pass
                         config.profiler.start("BW_grad")
-                        # to eliminate calculations of per-batch weight gradients
-                        # to do backward twice
-                        E.backward(retain_graph=True, inputs=emb_biases+[mlp_bias]) 
+                        if dense_graph is not None:
+                            # dense forward, loss and first backward of the MLPs as a CUDA graph, then that of the tables
+                            not_reduced_losses = dense_graph.forward_and_norms(X.to(device), ly_host, T.to(device), mlp_bias, emb_biases)
+                        else:
+                            # to eliminate calculations of per-batch weight gradients
+                            # to do backward twice
+                            norm_backward(E * config.amp_loss_scale, emb_biases+[mlp_bias])
                         config.profiler.end("BW_grad")
                         
                         config.profiler.start("set_lS_i")
-                        optimizer.set_lS_i(lS_i_nxt)
+                        if lS_nxt_req is not None:
+                            lS_o_nxt, lS_i_nxt = lS_nxt_req.wait()
+                            lS_nxt_req = None
+                        if skip_step:
+                            # the next micro-batch is in the same logical step
+                            optimizer.catch_up_micro_batch(lS_i_nxt)
+                            if args.accumulation_steps > 1:
+                                optimizer.signal_skip_step(True)
+                        else:
+                            optimizer.set_lS_i(lS_i_nxt, uniques_nxt, lS_o_nxt, plans_nxt)
                         config.profiler.end("set_lS_i")
                         
                         # optimizer
                         if (args.mlperf_logging and (j + 1) % args.mlperf_grad_accum_iter == 0) or not args.mlperf_logging:
-                            # to do backward twice
+                            # to do backward twice (only clipping and accumulation if skip_step)
                             optimizer.step(losses=not_reduced_losses)
-                            lr_scheduler.step()
+                            if not skip_step:
+                                lr_scheduler.step()
 
-                        config.profiler.start("set_HT_increase")
-                        optimizer.set_HT_increase_cnt_iter()
-                        config.profiler.end("set_HT_increase")
+                        if not skip_step:
+                            config.profiler.start("set_HT_increase")
+                            optimizer.set_HT_increase_cnt_iter()
+                            config.profiler.end("set_HT_increase")
 
 
+                    if lS_nxt_req is not None:
+                        lS_o_nxt, lS_i_nxt = lS_nxt_req.wait()
                     X = X_nxt
                     lS_i = lS_i_nxt
                     lS_o = lS_o_nxt
                     T = T_nxt
+
+                    if len(numa_replicated) > 0:
+                        # the step is over, the replicas of the small tables take its update
+                        sync_numa_replicas(dlrm)
                     
                     config.profiler.increase_iter()
 
+                    if lazydp_checkpointer is not None and args.lazydp_checkpoint_interval > 0 and (j + 1) % args.lazydp_checkpoint_interval == 0:
+                        lazydp_checkpointer.save(dlrm, optimizer, extra=(X, lS_o, lS_i, T))
+
                         
                     """
                     if args.mlperf_logging:
@@ -2121,6 +3359,8 @@ def run():
                         print(
                             "Testing at - {}/{} of epoch {},".format(j + 1, nbatches, k)
                         )
+                        if config.async_emb_update or config.emb_early_release:
+                            optimizer.join_deferred_update()
                         model_metrics_dict, is_best = inference(
                             args,
                             dlrm,
@@ -2228,6 +3468,8 @@ def run():
                 device,
                 use_gpu,
             )
+    if config.async_emb_update or config.emb_early_release:
+        optimizer.join_deferred_update()
     if config.is_debugging:
         ########### for last iteration - start ###########
         # forward pass
@@ -2242,6 +3484,12 @@ def run():
             ndevices=ndevices,
         )
         config.cur_batch_size = T.shape[0]
+        config.cur_num_indices_list = [lS_i_table.numel() for lS_i_table in lS_i]
+        if ext_dist.my_size > 1:
+            config.dist_batch_slice = ext_dist.get_my_slice(T.shape[0])
+            T = T[config.dist_batch_slice]
+            if config.dist_mode == "data_parallel":
+                config.cur_batch_size = T.shape[0]
         
         # loss
         config.profiler.start("FW_loss")
@@ -2257,7 +3505,7 @@ def run():
         config.profiler.start("BW_grad")
         # to eliminate calculations of per-batch weight gradients
         # to do backward twice
-        E.backward(retain_graph=True, inputs=emb_biases+[mlp_bias]) 
+        norm_backward(E * config.amp_loss_scale, emb_biases+[mlp_bias])
         config.profiler.end("BW_grad")
         
         config.profiler.start("set_lS_i")
@@ -2272,21 +3520,90 @@ def run():
         ########### for last iteration - end   ###########
         
         optimizer.add_remaining_noise_for_debugging()
+    elif args.flush_noise_at_end:
+        # the noise of every row is settled
+        materialize_emb_tables(dlrm)
+        if args.path_model_export is not None:
+            # noise of each chunk is settled and the chunk is written right away
+            if row_reorder is not None:
+                row_reorder.restore(optimizer)
+            optimizer.settle_all_noise(path=args.path_model_export, params=list(dlrm.parameters()))
+        else:
+            optimizer.settle_all_noise()
     config.profiler.increase_iter()
     
-    torch.cuda.synchronize()
+    if use_gpu:
+        torch.cuda.synchronize()
     end_time = time.time()
     
+    if config.profiler.cur_iter < config.profiler.iters:
+        assert args.bench_seconds > 0
+        config.profiler.truncate()
+    if metrics_exporter is not None:
+        metrics_exporter.close()
     config.profiler.save()
-    if config.dpsgd_mode == config.MODE_LAZYDP and config.is_debugging == True:
-        torch.save(list(dlrm.parameters()), "%s/dlrm_lazydp" %args.path_model_weight)
+    if config.delay_stats:
+        delay_stats = optimizer.stats()
+        config.profiler.save_delay_stats(delay_stats)
+        n_noised, n_avoided = sum(delay_stats["unique_rows"]), sum(delay_stats["noise_avoided"])
+        with open(log_name, 'a') as f:
+            f.write(">> Delayed noise: %d rows noised, %.2f iterations per row, %.3e noise elements avoided\n" %(n_noised, sum(delay_stats["delayed_iters"]) / max(n_noised, 1), n_avoided))
+    if config.coalesce_tuner is not None:
+        with open(log_name, 'a') as f:
+            f.write(">> Coalesce kernel per table: %s\n" %", ".join(config.coalesce_tuner.summary()))
+    if trace_writer is not None:
+        trace_writer.close()
+    if config.record_unique_sets is not None:
+        optimizer.close_unique_set_recording()
+    if row_reorder is not None:
+        # the original row order for the saved model
+        row_reorder.restore(optimizer)
+        if args.save_row_counts is not None:
+            row_reorder.save_counts(args.save_row_counts)
+    if lazydp_checkpointer is not None:
+        # the last iteration of the debugging mode consumes the pending batch
+        assert not config.is_debugging
+        with open(log_name, 'a') as f:
+            f.write(">> Saving LazyDP checkpoint to %s\n" %args.save_lazydp_checkpoint)
+        lazydp_checkpointer.save(dlrm, optimizer, extra=(X, lS_o, lS_i, T))
+        lazydp_checkpointer.wait()
+    if config.noise_std_optimize == "grouped":
+        histogram = optimizer.delay_histogram_stats()
+        n_noise_rows = max(int(histogram.sum().item()), 1)
+        with open(log_name, 'a') as f:
+            f.write(">> Delay histogram: %s (delay: rows %%, %d rows)\n" %(", ".join("%d: %.2f" %(d, 100.0 * histogram[d].item() / n_noise_rows) for d in range(1, 9)), n_noise_rows))
+    if config.ht_hot_set:
+        with open(log_name, 'a') as f:
+            f.write(">> HT hot set: %s rows per table\n" %(optimizer.ht_hot_set_sizes()))
+    if config.cold_rows != "none":
+        stats = cold_tier_stats(dlrm)
+        with open(log_name, 'a') as f:
+            f.write(">> Cold tier: %d blocks packed, %d restored, %d cold (%.2f GB packed, %.2f GB of pages released)\n" %(stats["packed"], stats["restored"], stats["cold_blocks"], stats["cold_bytes"] / 2**30, stats["released_bytes"] / 2**30))
+    if config.llc_prefetch:
+        n_requested, n_prefetched = optimizer.llc_prefetch_stats()
+        with open(log_name, 'a') as f:
+            f.write(">> LLC prefetch: %d of %d rows (%.2f%%) prefetched before the update\n" %(n_prefetched, n_requested, 100.0 * n_prefetched / max(n_requested, 1)))
+    if config.dpsgd_mode == config.MODE_LAZYDP and (config.is_debugging == True or args.save_model_weight):
+        # --save-model-weight with the real noise: the weights of two runs of --run-tag (check_correctness_4.py)
+        dequantize_emb(dlrm)
+        materialize_emb_tables(dlrm)
+        weight_name = "dlrm_lazydp" if args.run_tag == "" else "dlrm_lazydp_%s" % args.run_tag
+        torch.save(list(dlrm.parameters()), "%s/%s" %(args.path_model_weight, weight_name))
     else:
         assert True
+    if args.export_serving is not None:
+        # the model as it is served: the noise of every row settled, the tables quantized row-wise
+        assert config.dpsgd_mode != config.MODE_LAZYDP or args.flush_noise_at_end or config.is_debugging
+        with open(log_name, 'a') as f:
+            f.write(">> Exporting the %d-bit serving model to %s\n" %(args.serving_bits, args.export_serving))
+        materialize_emb_tables(dlrm)
+        export_serving_model(dlrm, args.export_serving, args.serving_bits)
         
     with open(log_name, 'a') as f:
         f.write(">> Done.\n")
         f.write(">> time: %.2f min.\n" % ((end_time - start_time) / 60))
-    torch.cuda.cudart().cudaProfilerStop()
+    if use_gpu:
+        torch.cuda.cudart().cudaProfilerStop()
 
     # profiling
     if args.enable_profiling:
@@ -1048,7 +1048,10 @@ def set_config(args):
         
     result_name = "%s_%s_s_%.3f_B_%d_L_%d_%s" % (args.model_config, args.locality, args.emb_scale, args.mini_batch_size, args.num_indices_per_lookup, args.dpsgd_mode)
         
-    config.profiler = LatencyMeter(args.dpsgd_mode, result_name, args.num_batches, args.description, "%s/result" %args.path_lazydp)
+    perf_stages = args.perf_stages.split(",") if args.perf_stages is not None else None
+    config.profiler = LatencyMeter(args.dpsgd_mode, result_name, args.num_batches, args.description, "%s/result" %args.path_lazydp, args.profiler_timing, args.native_trace, args.report_bandwidth,
+                                   args.report_throughput or args.bench_seconds > 0, nvtx=args.nvtx, itt=args.itt,
+                                   perf_stages=perf_stages, perf_events=args.perf_events.split(","), energy=args.report_energy)
 
     config.disable_poisson_sampling = args.disable_poisson_sampling #TODO:
     if not config.disable_poisson_sampling:
@@ -1181,6 +1184,16 @@ def run():
     parser.add_argument("--multi-gpu", action="store_true", default=False)
     parser.add_argument("--system", type=str, default="gpu_only")
     parser.add_argument("--description", type=str, default="")
+    parser.add_argument("--report-bandwidth", action="store_true", default=False) # report the achieved GB/s of the update stages against the STREAM triad peak (merged_result/<description>_bandwidth.csv)
+    parser.add_argument("--report-throughput", action="store_true", default=False) # report samples/sec and p50/p95/p99 of each stage over the steady-state iterations (merged_result/<description>_throughput.csv)
+    parser.add_argument("--bench-seconds", type=float, default=0) # > 0: stop training after this wall-clock time (at most --num-batches iterations) and report the throughput
+    parser.add_argument("--native-trace", action="store_true", default=False) # trace the hot paths of custom_api_cpp into a Chrome trace JSON next to the detailed breakdown
+    parser.add_argument("--nvtx", action="store_true", default=False) # NVTX ranges of the LatencyMeter stages (and of the extension kernels built with LAZYDP_NVTX=1) for Nsight Systems
+    parser.add_argument("--itt", action="store_true", default=False) # ITT tasks of the hot paths of custom_api_cpp (built with LAZYDP_ITT=1) for VTune
+    parser.add_argument("--perf-stages", type=str, default=None) # comma-separated LatencyMeter columns around which hardware counters are read (e.g. Update_delayed_noise_update,coalesce)
+    parser.add_argument("--perf-events", type=str, default="cycles,instructions,llc_misses,dtlb_misses,mem_read_bytes,mem_write_bytes") # counters of --perf-stages, the unavailable ones are dropped
+    parser.add_argument("--report-energy", action="store_true", default=False) # joules (RAPL package/DRAM, NVML GPU) per iteration and per stage in merged_result/<description>_energy.csv
+    parser.add_argument("--profiler-timing", type=str, default="sync", choices=["sync", "events"]) # "events" times the breakdown with CUDA events without synchronizing at every boundary
     parser.add_argument("--path-lazydp", type=str, default="/")
     parser.add_argument("--emb-scale", type=float, default=1.0)
     parser.add_argument("--model-config", type=str, default="basic") # basic, mlperf, rmc1, rmc2, rmc3
@@ -1866,6 +1879,10 @@ def run():
         assert True # Skip
     else:
         assert False, "Wrong locality"
+    # alias tables of the access distributions (O(1) per sampled index)
+    alias_sampler = None
+    if args.locality != "uniform":
+        alias_sampler = custom_api_cpp.AliasSampler([torch.from_numpy(pdf) for pdf in access_pdfs], config.data_gen_nthreads)
         
     ext_dist.barrier()
     with torch.autograd.profiler.profile(
@@ -1874,6 +1891,7 @@ def run():
         if not args.inference_only:
             k = 0
             total_time_begin = 0
+            bench_deadline = time.time() + args.bench_seconds if args.bench_seconds > 0 else None
             while k < args.nepochs:
                 if args.mlperf_logging:
                     assert False, "do not use mlper_logging"
@@ -1909,10 +1927,8 @@ def run():
 
                     X, lS_o, lS_i, T, W, CBPP = unpack_batch(inputBatch)
                     if args.locality != "uniform" and config.num_gathers == 1:
-                        lS_i = list()
-                        for table_idx in range(len(dlrm.emb_l)):
-                            lS_i_table = np.random.choice(dlrm.emb_l[table_idx].weight.shape[0], config.batch_size, replace=True, p=access_pdfs[table_idx])
-                            lS_i.append(torch.from_numpy(lS_i_table))
+                        seed = int(torch.randint(0, 2**62, (1,)).item())
+                        lS_i, _ = alias_sampler.sample(config.batch_size, [1] * len(dlrm.emb_l), seed, config.data_gen_nthreads)
                     elif args.locality != "uniform" and config.num_gathers != 1:
                         # Exclude the case whose num_gathers > 1 and args.a > 0
                         # because it takes too long to generate synthetic dataset
@@ -1956,6 +1972,8 @@ def run():
                     # early exit if nbatches was set by the user and has been exceeded
                     if nbatches > 0 and j >= nbatches:
                         break
+                    if bench_deadline is not None and time.time() > bench_deadline:
+                        break
 
                     # Skip the batch if batch size not multiple of total ranks
                     if ext_dist.my_size > 1 and X.size(0) % ext_dist.my_size != 0:
@@ -2247,9 +2265,13 @@ def run():
                 use_gpu,
             )
     
-    torch.cuda.synchronize()
+    if use_gpu:
+        torch.cuda.synchronize()
     end_time = time.time()
     
+    if config.profiler.cur_iter < config.profiler.iters:
+        assert args.bench_seconds > 0
+        config.profiler.truncate()
     config.profiler.save()
     if config.is_debugging:
         if config.dpsgd_mode == config.MODE_DPSGD_B:
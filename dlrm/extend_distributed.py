@@ -116,6 +116,7 @@ def init_distributed(rank=-1, local_rank=-1, size=-1, use_gpu=False, backend="")
                     "MPI_LOCALNRANKS",
                     "OMPI_COMM_WORLD_LOCAL_SIZE",
                     "MV2_COMM_WORLD_LOCAL_SIZE",
+                    "LOCAL_WORLD_SIZE",
                 ],
                 1,
             )
@@ -146,6 +147,7 @@ def init_distributed(rank=-1, local_rank=-1, size=-1, use_gpu=False, backend="")
                 "MPI_LOCALNRANKS",
                 "OMPI_COMM_WORLD_LOCAL_SIZE",
                 "MV2_COMM_WORLD_LOCAL_SIZE",
+                "LOCAL_WORLD_SIZE",
             ],
             1,
         )
@@ -576,6 +578,161 @@ def alltoall(inputs, per_rank_table_splits):
     return myreq
 
 
+class _P2PWork(object):
+    # works of the point-to-point sends and receives of an alltoall, waited together
+    def __init__(self, works):
+        self.works = works
+
+    def wait(self):
+        for work in self.works:
+            work.wait()
+        return True
+
+
+def _alltoall_p2p(output, input, output_splits, input_splits):
+    # all_to_all_single by point-to-point sends and receives, for the backends without it (e.g.,
+    # gloo builds of multi-host CPU-only runs); the slice of this rank is copied locally
+    input_starts = [sum(input_splits[:r]) for r in range(my_size)]
+    output_starts = [sum(output_splits[:r]) for r in range(my_size)]
+    output[output_starts[my_rank] : output_starts[my_rank] + output_splits[my_rank]] = input[
+        input_starts[my_rank] : input_starts[my_rank] + input_splits[my_rank]
+    ]
+    works = []
+    for r in range(my_size):
+        if r == my_rank:
+            continue
+        if output_splits[r] > 0:
+            works.append(dist.irecv(output[output_starts[r] : output_starts[r] + output_splits[r]], src=r))
+        if input_splits[r] > 0:
+            works.append(dist.isend(input[input_starts[r] : input_starts[r] + input_splits[r]].contiguous(), dst=r))
+    return _P2PWork(works)
+
+
+def _alltoall_1d(input, input_splits, output_splits, async_op=False):
+    # variable-length all_to_all_single of a 1-D tensor (on the GPU for nccl), back on the CPU
+    # (async_op: the output and the input on the device, with the work of the exchange)
+    device = torch.device("cuda", my_local_rank) if dist.get_backend() == "nccl" else torch.device("cpu")
+    output = torch.empty(sum(output_splits), dtype=input.dtype, device=device)
+    input = input.to(device)
+    if alltoall_supported:
+        work = dist.all_to_all_single(output, input, output_splits, input_splits, async_op=async_op)
+    else:
+        work = _alltoall_p2p(output, input, output_splits, input_splits)
+        if not async_op:
+            work.wait()
+    if async_op:
+        return output, input, work
+    return output.cpu()
+
+
+class SparseFeaturesRequest(Request):
+    # Request of alltoall_sparse_features(async_op=True), wait() completes the exchange of the bag
+    # lengths and indices and returns the offsets and indices of the local tables
+    def __init__(self, header, n_local, offsets_dtype):
+        super(SparseFeaturesRequest, self).__init__()
+        self.header = header
+        self.n_local = n_local
+        self.offsets_dtype = offsets_dtype
+
+    def wait(self):
+        for work in self.req:
+            work.wait()
+        recv_lengths, recv_indices = self.tensor[0].cpu(), self.tensor[2].cpu()
+        ret = _local_sparse_features(self.header, recv_lengths, recv_indices, self.n_local, self.offsets_dtype)
+        self.req = None
+        self.tensor = None
+        return ret
+
+
+def _local_sparse_features(header, recv_lengths, recv_indices, n_local, offsets_dtype):
+    # the received bags of the local tables in rank order: offsets (tables x bags) and indices
+    recv_lengths = recv_lengths.split([n_local * int(header[r, 0]) for r in range(my_size)])
+    recv_indices = recv_indices.split(header[:, 1].tolist())
+    local_lengths = [[] for _ in range(n_local)]
+    local_indices = [[] for _ in range(n_local)]
+    for r in range(my_size):
+        lengths_r = recv_lengths[r].view(n_local, -1)
+        for k, indices in enumerate(recv_indices[r].split(lengths_r.sum(dim=1).tolist())):
+            local_lengths[k].append(lengths_r[k])
+            local_indices[k].append(indices)
+    lengths = torch.stack([torch.cat(lengths_k) for lengths_k in local_lengths])
+    offsets = (torch.cumsum(lengths, dim=1) - lengths).to(offsets_dtype)
+    return offsets, [torch.cat(indices_k) for indices_k in local_indices]
+
+
+def _all_gather_1d(input):
+    # variable-length all_gather of a 1-D tensor (on the GPU for nccl), the tensors of the ranks
+    # concatenated in rank order, back on the CPU
+    device = torch.device("cuda", my_local_rank) if dist.get_backend() == "nccl" else torch.device("cpu")
+    n = torch.tensor([input.numel()], dtype=torch.int64, device=device)
+    sizes = [torch.empty_like(n) for _ in range(my_size)]
+    dist.all_gather(sizes, n)
+    sizes = [int(size) for size in sizes]
+    padded = torch.empty(max(sizes), dtype=input.dtype, device=device)
+    padded[: input.numel()] = input.reshape(-1).to(device)
+    outputs = [torch.empty_like(padded) for _ in range(my_size)]
+    dist.all_gather(outputs, padded)
+    return torch.cat([output[:size] for output, size in zip(outputs, sizes)]).cpu()
+
+
+def sparse_allreduce(grad, merge=None):
+    # Sums the coalesced (sorted rows) sparse COO gradient of a replicated table over the ranks. The
+    # rows are sent (alltoallv) to the rank owning their row range (split as get_my_slice), merged
+    # there by "merge" (e.g., the coalesce kernels, torch's coalesce() by default), and the merged rows
+    # of the owners are gathered by all ranks in row order. The volume scales with the unique rows
+    # touched rather than with the table. Returns the coalesced sum, the same on every rank.
+    n_rows, dim = grad.shape
+    indices = grad._indices().view(-1)
+    values = grad._values()
+    k, m = divmod(n_rows, my_size)
+    row_ends = torch.tensor([(r + 1) * k + min(r + 1, m) for r in range(my_size - 1)], dtype=indices.dtype)
+    send_counts = torch.bincount(torch.searchsorted(row_ends, indices, right=True), minlength=my_size)
+    recv_counts = _alltoall_1d(send_counts, [1] * my_size, [1] * my_size).tolist()
+    send_counts = send_counts.tolist()
+
+    recv_indices = _alltoall_1d(indices, send_counts, recv_counts)
+    recv_values = _alltoall_1d(values.reshape(-1), [c * dim for c in send_counts], [c * dim for c in recv_counts])
+    received = torch.sparse_coo_tensor(recv_indices.view(1, -1), recv_values.view(-1, dim), (n_rows, dim))
+    merged = merge(received) if merge is not None else received.coalesce()
+
+    merged_indices = _all_gather_1d(merged._indices())
+    merged_values = _all_gather_1d(merged._values())
+    return torch.sparse_coo_tensor(merged_indices.view(1, -1), merged_values.view(-1, dim), (n_rows, dim))._coalesced_(True)
+
+
+def alltoall_sparse_features(lS_o, lS_i, per_rank_table_splits, async_op=False):
+    # Routes the sparse features of the local batch slice (lS_o: tables x bags offsets, lS_i: all
+    # tables) to the ranks owning the tables, e.g., the features of the next iteration of LazyDP,
+    # so that the HT and the delayed noise of a table stay on its owner. Returns the offsets and
+    # indices of the local tables for the whole batch, the bags of the ranks in rank order.
+    # With async_op, only the (small) header is exchanged before returning a SparseFeaturesRequest,
+    # the bag lengths and indices are exchanged in the background until its wait().
+    n_tables = len(lS_i)
+    splits = per_rank_table_splits if per_rank_table_splits else [n_tables // my_size] * my_size
+    table_starts = [sum(splits[:r]) for r in range(my_size)]
+    n_bags = lS_o.shape[1]
+
+    ends = torch.tensor([S_i.numel() for S_i in lS_i], dtype=torch.int64).view(-1, 1)
+    lengths = torch.cat([lS_o[:, 1:].long(), ends], dim=1) - lS_o.long()
+    n_indices = [sum(lS_i[t].numel() for t in range(table_starts[r], table_starts[r] + splits[r])) for r in range(my_size)]
+
+    # bags and indices sent to each rank, then the bag lengths and the indices themselves
+    header = _alltoall_1d(torch.tensor([[n_bags, n_indices[r]] for r in range(my_size)], dtype=torch.int64).view(-1), [2] * my_size, [2] * my_size).view(my_size, 2)
+    n_local = splits[my_rank]
+    lengths_splits = ([splits[r] * n_bags for r in range(my_size)], [n_local * int(header[r, 0]) for r in range(my_size)])
+    indices = torch.cat([S_i.view(-1) for S_i in lS_i])
+    if async_op:
+        req = SparseFeaturesRequest(header, n_local, lS_o.dtype)
+        recv_lengths, sent_lengths, lengths_work = _alltoall_1d(lengths.view(-1), *lengths_splits, async_op=True)
+        recv_indices, sent_indices, indices_work = _alltoall_1d(indices, n_indices, header[:, 1].tolist(), async_op=True)
+        req.req = [lengths_work, indices_work]
+        req.tensor = [recv_lengths, sent_lengths, recv_indices, sent_indices]
+        return req
+    recv_lengths = _alltoall_1d(lengths.view(-1), *lengths_splits)
+    recv_indices = _alltoall_1d(indices, n_indices, header[:, 1].tolist())
+    return _local_sparse_features(header, recv_lengths, recv_indices, n_local, lS_o.dtype)
+
+
 def all_gather(input, lengths, dim=0):
     if not lengths:
         lengths = [input.size(0)] * my_size
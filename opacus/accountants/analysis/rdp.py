@@ -44,6 +44,7 @@ Example:
 
 """
 
+import functools
 import math
 import warnings
 from typing import List, Tuple, Union
@@ -259,6 +260,98 @@ def _compute_rdp(q: float, sigma: float, alpha: float) -> float:
     return _compute_log_a(q, sigma, alpha) / (alpha - 1)
 
 
+def _compute_log_a_for_int_alphas(q: float, sigma: float, alphas: np.ndarray) -> np.ndarray:
+    r"""Computes :math:`log(A_\alpha)` for all integer ``alphas`` at once.
+
+    Same as :meth:`_compute_log_a_for_int_alpha`, with the terms ``i = 0..alpha`` of
+    every alpha evaluated on a single (alphas x max alpha + 1) grid and summed in the
+    log space.
+    """
+    i = np.arange(int(alphas.max()) + 1)
+    a = alphas.reshape(-1, 1)
+    valid = i <= a
+    log_binom = (
+        special.gammaln(a + 1)
+        - special.gammaln(i + 1)
+        - special.gammaln(np.where(valid, a - i, 0) + 1)
+    )
+    s = log_binom + i * math.log(q) + (a - i) * math.log(1 - q) + (i * i - i) / (2 * (sigma**2))
+    return special.logsumexp(np.where(valid, s, -np.inf), axis=1)
+
+
+def _compute_log_a_for_frac_alphas(q: float, sigma: float, alphas: np.ndarray) -> np.ndarray:
+    r"""Computes :math:`log(A_\alpha)` for all fractional ``alphas`` at once.
+
+    Same as :meth:`_compute_log_a_for_frac_alpha`: the series of every alpha is
+    evaluated on a grid of terms which is doubled until each series reaches its first
+    term below ``exp(-30)``, and is truncated after that term.
+
+    Raises:
+        ValueError
+            If a part of :math:`A_\alpha` is negative.
+    """
+    z0 = sigma**2 * math.log(1 / q - 1) + 0.5
+    a = alphas.reshape(-1, 1)
+    n_terms = 64
+    while True:
+        i = np.arange(n_terms)
+        j = a - i
+        coef = special.binom(a, i)
+        with np.errstate(divide="ignore"):
+            log_coef = np.log(np.abs(coef))
+
+        log_t0 = log_coef + i * math.log(q) + j * math.log(1 - q)
+        log_t1 = log_coef + j * math.log(q) + i * math.log(1 - q)
+
+        log_e0 = math.log(0.5) + _log_erfc((i - z0) / (math.sqrt(2) * sigma))
+        log_e1 = math.log(0.5) + _log_erfc((z0 - j) / (math.sqrt(2) * sigma))
+
+        log_s0 = log_t0 + (i * i - i) / (2 * (sigma**2)) + log_e0
+        log_s1 = log_t1 + (j * j - j) / (2 * (sigma**2)) + log_e1
+
+        below = np.maximum(log_s0, log_s1) < -30
+        if below.any(axis=1).all():
+            break
+        n_terms *= 2
+
+    included = i <= below.argmax(axis=1).reshape(-1, 1)
+    sign = np.sign(coef)
+    log_a0, sign0 = special.logsumexp(np.where(included, log_s0, -np.inf), b=sign, axis=1, return_sign=True)
+    log_a1, sign1 = special.logsumexp(np.where(included, log_s1, -np.inf), b=sign, axis=1, return_sign=True)
+    if (sign0 < 0).any() or (sign1 < 0).any():
+        raise ValueError("The result of subtraction must be non-negative.")
+    return np.logaddexp(log_a0, log_a1)
+
+
+@functools.lru_cache(maxsize=1024)
+def _compute_rdp_orders(q: float, sigma: float, orders: Tuple[float, ...]) -> np.ndarray:
+    r"""Computes RDP of the Sampled Gaussian Mechanism at all ``orders`` at once.
+
+    Same as :meth:`_compute_rdp` for each order, vectorized over the integer and the
+    fractional orders. Memoized on ``(q, sigma, orders)``, so that the repeated calls of
+    the accountant (e.g., the search of the noise multiplier, the logging of epsilon)
+    are free. The returned array is read-only.
+    """
+    orders_vec = np.array(orders, dtype=float)
+    if q == 0:
+        rdp = np.zeros_like(orders_vec)
+    elif sigma == 0:
+        rdp = np.full_like(orders_vec, np.inf)
+    elif q == 1.0:
+        rdp = orders_vec / (2 * sigma**2)
+    else:
+        rdp = np.full_like(orders_vec, np.inf)
+        finite = ~np.isinf(orders_vec)
+        is_int = finite & (orders_vec == np.floor(orders_vec))
+        is_frac = finite & ~is_int
+        if is_int.any():
+            rdp[is_int] = _compute_log_a_for_int_alphas(q, sigma, orders_vec[is_int]) / (orders_vec[is_int] - 1)
+        if is_frac.any():
+            rdp[is_frac] = _compute_log_a_for_frac_alphas(q, sigma, orders_vec[is_frac]) / (orders_vec[is_frac] - 1)
+    rdp.flags.writeable = False
+    return rdp
+
+
 def compute_rdp(
     *, q: float, noise_multiplier: float, steps: int, orders: Union[List[float], float]
 ) -> Union[List[float], float]:
@@ -281,7 +374,7 @@ def compute_rdp(
     if isinstance(orders, float):
         rdp = _compute_rdp(q, noise_multiplier, orders)
     else:
-        rdp = np.array([_compute_rdp(q, noise_multiplier, order) for order in orders])
+        rdp = _compute_rdp_orders(float(q), float(noise_multiplier), tuple(float(order) for order in orders))
 
     return rdp * steps
 
@@ -18,6 +18,9 @@ from typing import Dict
 import torch
 import torch.nn as nn
 
+import config
+import custom_api_cpp
+
 from .utils import register_grad_sampler
 
 
@@ -28,6 +31,11 @@ def compute_embedding_grad_sample(
     """
     Computes per sample gradients for ``nn.Embedding`` layer.
 
+    The gradient of an example is its backprop of each lookup on the looked-up row. It is kept as
+    the backprops (B x L x dim) with the looked-up rows (``layer.weight.grad_sample_lookups``, B x L)
+    instead of a B x rows x dim tensor, so its memory is O(B x L x dim) whatever the size of the table
+    (see ``lookup_grad_sample_norms()`` and ``DPOptimizer.clip_and_accumulate``)
+
     Args:
         layer: Layer
         activations: Activations
@@ -36,35 +44,127 @@ def compute_embedding_grad_sample(
     activations = activations[0]
     ret = {}
     if layer.weight.requires_grad:
-        saved = torch.backends.cudnn.deterministic
-        torch.backends.cudnn.deterministic = True
-
         batch_size = activations.shape[0]
-        if batch_size == 0:
-            ret[layer.weight] = torch.zeros_like(layer.weight).unsqueeze(0)
-            return ret
-
-        index = (
-            activations.unsqueeze(-1)
-            .expand(*activations.shape, layer.embedding_dim)
-            .reshape(batch_size, -1, layer.embedding_dim)
-        )
-        grad_sample = torch.zeros(
-            batch_size, *layer.weight.shape, device=layer.weight.device
-        )
-        grad_sample.scatter_add_(
-            1, index, backprops.reshape(batch_size, -1, layer.embedding_dim)
-        )
-        torch.backends.cudnn.deterministic = saved
-        ret[layer.weight] = grad_sample
+        ret[layer.weight] = backprops.reshape(batch_size, -1, layer.embedding_dim)
+        layer.weight.grad_sample_lookups = activations.reshape(batch_size, -1)
     return ret
 
 
 @register_grad_sampler(nn.EmbeddingBag)
 def compute_embeddingbag_gradsampler(layer, inputs, backprops):
-    # Restrict all examples to have the same value of num_gather
-    gsm = backprops.repeat(1, inputs[-1][1] - inputs[-1][0]).reshape(backprops.shape[0], -1, backprops.shape[1])
+    # With sum pooling, the gradient of an example is its backprop copied for each index of its bag
+    # (scaled by the per-sample weight of the index with weighted pooling). The copies are not
+    # materialized: the per-sample gradients are kept as the backprops (B x dim) with the bags
+    # (layer.weight.inputs) and their weights (layer.weight.bag_weights, None for unit weights),
+    # flagged by layer.weight.grad_sample_per_bag (see bag_grad_sample_norms() and
+    # custom_api_cpp.coalesce_bag_gradient)
     ret = {}
-    ret[layer.weight] = gsm
-    layer.weight.inputs = inputs
+    ret[layer.weight] = backprops
+    layer.weight.grad_sample_per_bag = True
+    layer.weight.inputs = inputs[:3]
+    layer.weight.bag_weights = bag_weights_of(inputs)
     return ret
+
+
+def bag_weights_of(activations) -> torch.Tensor:
+    """
+    Per-sample weights of the bags of ``nn.EmbeddingBag`` among its captured activations
+    (index, emb_bias, offsets, then the weights with weighted pooling), None for unit weights
+
+    Args:
+        activations: Inputs of the ``nn.EmbeddingBag`` captured by the forward hook
+    """
+    return activations[3] if len(activations) > 3 else None
+
+
+def lookup_grad_sample_norms(grad_sample: torch.Tensor, lookups: torch.Tensor) -> torch.Tensor:
+    """
+    Per-sample gradient norms of ``nn.Embedding`` from its per-lookup representation without
+    materializing the rows (ghost norm): the squared norm of an example is the sum of
+    ``<g_i, g_j>`` over the pairs of its lookups ``i``, ``j`` of the same row, so an example
+    looking up a row more than once takes the norm of their sum
+
+    Args:
+        grad_sample: Backprops of the lookups (B x L x dim)
+        lookups: Looked-up rows (B x L)
+    """
+    same_row = lookups.unsqueeze(2) == lookups.unsqueeze(1)
+    gram = torch.bmm(grad_sample, grad_sample.transpose(1, 2))
+    return (gram * same_row).sum(dim=(1, 2)).clamp(min=0).sqrt()
+
+
+def lookup_grad(grad_sample: torch.Tensor, lookups: torch.Tensor, clip_factor: torch.Tensor, n_rows: int) -> torch.Tensor:
+    """
+    Clipped summed gradient of ``nn.Embedding`` from its per-lookup representation, as an
+    uncoalesced sparse tensor over the looked-up rows only
+
+    Args:
+        grad_sample: Backprops of the lookups (B x L x dim)
+        lookups: Looked-up rows (B x L)
+        clip_factor: Clipping factor of each example
+        n_rows: Rows of the table
+    """
+    values = (grad_sample * clip_factor.to(grad_sample).view(-1, 1, 1)).reshape(-1, grad_sample.shape[-1])
+    return torch.sparse_coo_tensor(lookups.reshape(1, -1).long(), values, (n_rows, grad_sample.shape[-1]))
+
+
+def bag_grad_sample_norms(grad_sample: torch.Tensor, index: torch.Tensor, offsets: torch.Tensor, weights: torch.Tensor = None) -> torch.Tensor:
+    """
+    Per-sample gradient norms of ``nn.EmbeddingBag`` from its per-bag representation,
+    i.e., the norm of the backprop of each example times its ``bag_norm_factors``
+
+    Args:
+        grad_sample: Backprops of the bags (B x dim)
+        index: Flattened indices of all bags
+        offsets: Start position of each bag in ``index``
+        weights: Per-sample weights of the indices (weighted pooling), None for unit weights
+    """
+    return grad_sample.norm(2, dim=-1) * bag_norm_factors(index, offsets, weights).to(grad_sample.dtype)
+
+
+def bag_norm_factors(index: torch.Tensor, offsets: torch.Tensor, weights: torch.Tensor = None) -> torch.Tensor:
+    """
+    Ratio of the per-sample gradient norm of ``nn.EmbeddingBag`` to the norm of the backprop of
+    each bag: ``sqrt(sum_k c_k^2)`` where ``c_k`` is the multiplicity of the k-th distinct index
+    of the bag, or the sum of the per-sample weights of its occurrences with weighted pooling.
+    It is ``sqrt(bag length)`` (``||w_b||_2``) only when the bag has no duplicate indices
+
+    Args:
+        index: Flattened indices of all bags
+        offsets: Start position of each bag in ``index``
+        weights: Per-sample weights of the indices, None for unit weights
+    """
+    weights = torch.empty(0) if weights is None else weights.detach().cpu().float()
+    factors = custom_api_cpp.bag_norm_factors(index.cpu(), offsets.cpu(), weights, config.coalesce_nthreads)
+    return factors.to(offsets.device)
+
+
+def bag_grad(backprops: torch.Tensor, index: torch.Tensor, offsets: torch.Tensor, weights: torch.Tensor, n_rows: int) -> torch.Tensor:
+    """
+    (Clipped) summed gradient of ``nn.EmbeddingBag`` from the (scaled) backprops of its bags, the
+    same uncoalesced sparse tensor as the backward of ``embedding_bag``: a row per index, scaled by
+    its per-sample weight with weighted pooling
+
+    Args:
+        backprops: (Scaled) backprops of the bags (B x dim)
+        index: Flattened indices of all bags
+        offsets: Start position of each bag in ``index``
+        weights: Per-sample weights of the indices, None for unit weights
+        n_rows: Rows of the table
+    """
+    values = torch.repeat_interleave(backprops, bag_lengths(index, offsets), dim=0)
+    if weights is not None:
+        values = values * weights.to(values).view(-1, 1)
+    return torch.sparse_coo_tensor(index.view(1, -1), values, (n_rows, backprops.shape[-1]))
+
+
+def bag_lengths(index: torch.Tensor, offsets: torch.Tensor) -> torch.Tensor:
+    """
+    Number of indices of each bag of ``nn.EmbeddingBag``, derived from its offsets
+
+    Args:
+        index: Flattened indices of all bags
+        offsets: Start position of each bag in ``index``
+    """
+    end = torch.tensor([index.numel()], dtype=offsets.dtype, device=offsets.device)
+    return torch.diff(offsets, append=end)
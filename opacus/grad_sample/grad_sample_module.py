@@ -18,12 +18,15 @@ from __future__ import annotations
 import logging
 import warnings
 from functools import partial
-from typing import Iterable, List, Tuple
+from typing import Iterable, List, Optional, Tuple
 
 import torch
 import torch.nn as nn
 from opacus.grad_sample.functorch import ft_compute_per_sample_gradient, prepare_layer
+from opacus.grad_sample.embedding import bag_grad, bag_grad_sample_norms, bag_norm_factors, bag_weights_of, lookup_grad, lookup_grad_sample_norms
 from opacus.grad_sample.gsm_base import AbstractGradSampleModule
+from opacus.grad_sample.linear import factored_grad_sample_norms, linear_ghost_norms
+from opacus.layers.dp_linear import DPLinear
 from opacus.layers.dp_rnn import DPGRU, DPLSTM, DPRNN, RNNLinear
 from opacus.utils.module_utils import (
     has_trainable_params,
@@ -82,6 +85,91 @@ def promote_current_grad_sample(p: nn.Parameter) -> None:
         del p._current_grad_sample
 
 
+def _fp32_unscaled(activations: List, backprops: torch.Tensor):
+    # (config.mlp_amp) the autocast activations and backprops of the ghost norms in fp32, with the loss scale
+    # of the first backward taken out; index and offset tensors of the embeddings pass as they are
+    if config.mlp_amp == "none":
+        return activations, backprops
+    activations = [a.float() if torch.is_tensor(a) and a.is_floating_point() else a for a in activations]
+    return activations, backprops.float() / config.amp_loss_scale
+
+
+def _backprop_norms(module: nn.Module, backprops: torch.Tensor) -> torch.Tensor:
+    # per-example norms of the backprops, or those taken in fp32 on the GPU before a reduced-precision transfer
+    # of the backprops (custom_utils.EmbOutputTransfer with config.emb_transfer_dtype), used once
+    norms = getattr(module, "backprop_norms", None)
+    if norms is None:
+        return backprops.norm(2, dim=-1)
+    module.backprop_norms = None
+    return norms / config.amp_loss_scale if config.mlp_amp != "none" else norms
+
+
+def per_layer_clipped_grad(module: nn.Module, p: nn.Parameter, activations: List[torch.Tensor], backprops: torch.Tensor) -> torch.Tensor:
+    """
+    Summed gradient of ``p`` with each example clipped to ``p.per_layer_max_grad_norm`` by its
+    own per-sample norm (``p.grad_sample_norms``), formed from the activations and backprops
+    of the backward hook (``config.clip_backward == "per_layer"``)
+
+    Args:
+        module: nn.Linear, nn.EmbeddingBag or nn.Embedding owning ``p``
+        p: Parameter of ``module``
+        activations: Inputs of ``module`` captured by the forward hook
+        backprops: Gradient of the output of ``module``
+    """
+    clip_factor = (p.per_layer_max_grad_norm / (p.grad_sample_norms[0] + 1e-6)).clamp(max=1.0)
+    if config.is_debugging and config.debugging_type == "without_noise_clipping":
+        clip_factor = torch.ones_like(clip_factor)
+    if type(module) == nn.Embedding:
+        batch_size = activations[0].shape[0]
+        return lookup_grad(backprops.reshape(batch_size, -1, module.embedding_dim), activations[0].reshape(batch_size, -1),
+                           clip_factor, module.num_embeddings)
+    scaled_backprops = backprops * clip_factor.to(backprops).view(-1, *([1] * (backprops.dim() - 1)))
+    if type(module) == nn.EmbeddingBag:
+        # same (uncoalesced) sparse gradient as the backward of embedding_bag
+        return bag_grad(scaled_backprops, activations[0], activations[2], bag_weights_of(activations), p.shape[0])
+    if p is module.weight:
+        return torch.mm(scaled_backprops.t(), activations[0])
+    return scaled_backprops.sum(dim=0)
+
+
+class SquaredNormBuffer:
+    """
+    (B x n_params) squared per-sample gradient norms of the parameters resident off ``config.device``
+    (e.g., CPU-resident embedding tables). The hooks write the norms in place, and the whole buffer
+    is transferred to ``config.device`` with a single (pinned, asynchronous) copy. A column may hold
+    a factor of the norms instead, whose other factor is already on ``config.device`` (the norms of
+    the backprops of ``config.emb_ghost_norms == "device"``) and is multiplied in after the copy
+    """
+
+    def __init__(self, params: List[nn.Parameter]):
+        self.columns = {id(p): i for i, p in enumerate(params)}
+        self.pinned = config.device.type == "cuda"
+        self.buffer = torch.empty((0, len(params)), pin_memory=self.pinned)
+        self.device_factors = {} # column -> per-sample factor of its norms on config.device
+
+    def has(self, p: nn.Parameter) -> bool:
+        return id(p) in self.columns
+
+    def write(self, p: nn.Parameter, norms: torch.Tensor, device_factor: Optional[torch.Tensor] = None):
+        if device_factor is not None:
+            self.device_factors[self.columns[id(p)]] = device_factor
+        n = norms.shape[0]
+        if self.buffer.shape[0] < n:
+            # grows with the (Poisson-sampled) batch size, keeping the columns written so far
+            buffer = torch.empty((max(n, 2 * self.buffer.shape[0]), len(self.columns)), pin_memory=self.pinned)
+            buffer[: self.buffer.shape[0]] = self.buffer
+            self.buffer = buffer
+        self.buffer[:n, self.columns[id(p)]] = norms.square()
+
+    def to_device(self, n: int) -> torch.Tensor:
+        sq_norms = self.buffer[:n].to(config.device, non_blocking=True)
+        if len(self.device_factors) > 0:
+            columns = list(self.device_factors.keys())
+            sq_norms[:, columns] *= torch.stack([self.device_factors[c] for c in columns], dim=1).square()
+            self.device_factors = {}
+        return sq_norms
+
+
 class GradSampleModule(AbstractGradSampleModule):
     """
     Hooks-based implementation of AbstractGradSampleModule
@@ -142,6 +230,7 @@ class GradSampleModule(AbstractGradSampleModule):
             )
 
         self.hooks_enabled = False
+        self.sq_norm_buffer = None # SquaredNormBuffer, set by DPOptimizer
         self.batch_first = batch_first
         self.loss_reduction = loss_reduction
         self.force_functorch = force_functorch
@@ -204,6 +293,10 @@ class GradSampleModule(AbstractGradSampleModule):
             # Do not add hooks to DPRNN, DPLSTM or DPGRU as the hooks are handled by the `RNNLinear`
             if type(module) in [DPRNN, DPLSTM, DPGRU]:
                 continue
+            # DPLinear calls back from its own backward (no activations stashed on the module)
+            if type(module) == DPLinear:
+                module.ghost_norm_hook = self.capture_dp_linear_backprops
+                continue
 
             if force_functorch or not type(module) in self.GRAD_SAMPLERS:
                 prepare_layer(module, batch_first=batch_first)
@@ -230,6 +323,10 @@ class GradSampleModule(AbstractGradSampleModule):
         """
         self.disable_hooks()
 
+        for module in self._module.modules():
+            if type(module) == DPLinear:
+                module.ghost_norm_hook = None
+
         for p in self.parameters():
             if hasattr(p, "ddp_hooks"):
                 while p.ddp_hooks:
@@ -289,11 +386,36 @@ class GradSampleModule(AbstractGradSampleModule):
 
         if not hasattr(module, "activations"):
             module.activations = []
-        module.activations.append([t.detach() for t in forward_input])  # pyre-ignore
+        if self._norms_only(module):
+            # only what the norms need is kept until the backward hook: the norm of each input row, or the
+            # norm factors of the bags (the inputs themselves, and the int64 copy of int32 indices, are freed here)
+            module.activations.append([self._activation_norms(module, forward_input)])
+        elif type(module) == nn.EmbeddingBag:
+            # with config.index_dtype "int32", the lookup reads int32 indices and the per-sample gradient kernels int64;
+            # the per-sample weights of weighted pooling (a keyword argument, kept by EmbeddingBag.forward) follow
+            # the offsets (bag_weights_of)
+            weights = getattr(module, "per_sample_weights", None)
+            module.activations.append([t.detach().long() if t.dtype == torch.int32 else t.detach() for t in forward_input]  # pyre-ignore
+                                      + ([weights.detach()] if weights is not None else []))
+        else:
+            module.activations.append([t.detach() for t in forward_input])  # pyre-ignore
         
         for _, p in trainable_parameters(module):
             p._forward_counter += 1
         
+    def _norms_only(self, module: nn.Module) -> bool:
+        # the ghost norms of DP-SGD(F)/LazyDP with clip_backward "reweight" are all the backward hook computes
+        # for nn.Linear and nn.EmbeddingBag: the second backward recomputes the gradients through autograd
+        return (config.dpsgd_mode in [MODE_DPSGD_F, MODE_LAZYDP, MODE_EANA] and config.clip_backward == "reweight"
+                and type(module) in [nn.Linear, nn.EmbeddingBag])
+
+    def _activation_norms(self, module: nn.Module, forward_input: List[torch.Tensor]) -> torch.Tensor:
+        # activations_norm of nn.Linear, bag_norm_factors of nn.EmbeddingBag (B), of the inputs of a forward
+        if type(module) == nn.Linear:
+            return forward_input[0].detach().float().norm(2, dim=-1)
+        index, offsets = [t.detach().long() if t.dtype == torch.int32 else t.detach() for t in (forward_input[0], forward_input[2])]
+        weights = getattr(module, "per_sample_weights", None)
+        return bag_norm_factors(index, offsets, weights)
 
     def capture_backprops_hook(
         self,
@@ -364,13 +486,25 @@ class GradSampleModule(AbstractGradSampleModule):
         if config.dpsgd_mode == MODE_DPSGD_R:
             for _, p in trainable_parameters(module):
                 assert p.requires_grad == True
-                p.grad_sample_norms = [p.grad_sample.norm(2, dim=list(range(1, len(p.grad_sample.shape))))]
+                if getattr(p, "grad_sample_per_bag", False):
+                    p.grad_sample_norms = [bag_grad_sample_norms(p.grad_sample, p.inputs[0], p.inputs[-1], p.bag_weights)]
+                elif getattr(p, "grad_sample_lookups", None) is not None:
+                    p.grad_sample_norms = [lookup_grad_sample_norms(p.grad_sample, p.grad_sample_lookups)]
+                    p.grad_sample_lookups = None
+                elif getattr(p, "grad_sample_activations", None) is not None:
+                    p.grad_sample_norms = [factored_grad_sample_norms(p.grad_sample, p.grad_sample_activations)]
+                    p.grad_sample_activations = None
+                else:
+                    p.grad_sample_norms = [p.grad_sample.norm(2, dim=list(range(1, len(p.grad_sample.shape))))]
+                self._store_grad_sample_norms(p)
                 del p.grad_sample
         elif config.dpsgd_mode in [MODE_DPSGD_F, MODE_LAZYDP, MODE_EANA]:
+            activations, backprops = _fp32_unscaled(activations, backprops)
+            norms_only = self._norms_only(module)
             # input norm x output gradients norm = per-sample gradient norms
             if type(module) == nn.Linear:
-                activations_norm = activations[0].norm(2, dim=-1)
-            backprops_norm = backprops.norm(2, dim=-1)
+                activations_norm = activations[0] if norms_only else activations[0].norm(2, dim=-1)
+            backprops_norm = _backprop_norms(module, backprops)
             for _, p in trainable_parameters(module):
                 assert p.requires_grad == True
                 if type(module) == nn.Linear:
@@ -381,13 +515,24 @@ class GradSampleModule(AbstractGradSampleModule):
                     else:
                         assert False, "Never happen"
                 elif type(module) == nn.EmbeddingBag:
-                    assert config.cur_batch_size == len(activations[2])
-                    cur_num_gathers = activations[2][1].item() - activations[2][0].item()
-                    assert min(config.num_gathers, p.shape[0]) == cur_num_gathers
-                    
-                    p.grad_sample_norms = [backprops_norm * (cur_num_gathers**0.5)]
+                    assert config.cur_batch_size == len(activations[0] if norms_only else activations[2])
+                    # exact even when an example hits the same row more than once, ||g_b|| * ||w_b||_2 with weighted pooling
+                    factors = activations[0] if norms_only else bag_norm_factors(activations[0], activations[2], bag_weights_of(activations))
+                    if backprops_norm.device != factors.device:
+                        # ||g_b|| stayed on config.device (config.emb_ghost_norms == "device"), where
+                        # SquaredNormBuffer.to_device() multiplies it in
+                        assert self.sq_norm_buffer is not None and self.sq_norm_buffer.has(p)
+                        p.grad_sample_norms = [factors.float()]
+                        p.grad_sample_device_factor = backprops_norm
+                    else:
+                        p.grad_sample_norms = [backprops_norm * factors.to(backprops_norm.dtype)]
+                elif type(module) == nn.Embedding:
+                    # ghost norm over the lookups of each example, the rows of the table are not materialized
+                    batch_size = activations[0].shape[0]
+                    p.grad_sample_norms = [lookup_grad_sample_norms(backprops.reshape(batch_size, -1, module.embedding_dim), activations[0].reshape(batch_size, -1))]
                 else:
                     assert False, "unknown layer"
+                self._consume_grad_sample_norms(module, p, activations, backprops)
             
                 
             
@@ -398,6 +543,41 @@ class GradSampleModule(AbstractGradSampleModule):
                 del module.max_batch_len
 
 
+    def capture_dp_linear_backprops(self, module: DPLinear, activations: torch.Tensor, backprops: torch.Tensor):
+        # ghost_norm_hook of DPLinear, called by its autograd Function instead of the module hooks
+        if not self.hooks_enabled:
+            return
+        assert config.dpsgd_mode in [MODE_DPSGD_F, MODE_LAZYDP, MODE_EANA], "DPLinear only computes the ghost norms"
+        (activations,), backprops = _fp32_unscaled([activations], backprops)
+        weight_norms, bias_norms = linear_ghost_norms(activations, backprops)
+        for p, norms in [(module.weight, weight_norms), (module.bias, bias_norms)]:
+            if p is not None and p.requires_grad:
+                p.grad_sample_norms = [norms]
+                self._consume_grad_sample_norms(module, p, [activations], backprops)
+
+    def _consume_grad_sample_norms(self, module: nn.Module, p: nn.Parameter, activations: List[torch.Tensor], backprops: torch.Tensor):
+        # p.grad_sample_norms of the ghost-norm path, taken as config.clip_backward needs them
+        if config.clip_backward == "per_layer":
+            # clipped by the norm of this parameter alone, so no second backward is needed
+            p.per_layer_clipped_grad = per_layer_clipped_grad(module, p, activations, backprops)
+            p.grad_sample_norms = None
+            return
+        self._store_grad_sample_norms(p)
+
+        if config.clip_backward == "cached":
+            # consumed by DPOptimizer._clipped_grads_from_cache() instead of a second backward
+            p.cached_backprops = backprops
+            p.cached_activations = activations[0] if isinstance(module, nn.Linear) and p is module.weight else None
+            p.cached_bags = (activations[0], activations[2], bag_weights_of(activations)) if type(module) == nn.EmbeddingBag else None
+
+    def _store_grad_sample_norms(self, p: nn.Parameter):
+        # norms of parameters off config.device go to the shared buffer instead of p.grad_sample_norms
+        if self.sq_norm_buffer is not None and self.sq_norm_buffer.has(p):
+            assert len(p.grad_sample_norms) == 1
+            self.sq_norm_buffer.write(p, p.grad_sample_norms[0], getattr(p, "grad_sample_device_factor", None))
+            p.grad_sample_norms = None
+            p.grad_sample_device_factor = None
+
     def rearrange_grad_samples(
         self,
         *,
@@ -537,9 +717,11 @@ def _get_batch_size(*, module: nn.Module, batch_dim: int) -> int:
     max_batch_len = 0
     for out in module.activations:
         # out is typically a tuple of one element (x)
-        # for embedding bag, it is a tuple of two elements (x, offsets)
-        # where len(offsets) = batch_size
-        if out[-1].shape[batch_dim] > max_batch_len:
-            max_batch_len = out[-1].shape[batch_dim]
+        # for embedding bag, it is a tuple of two elements (x, offsets), or (x, emb_bias, offsets)
+        # with the per-sample weights of weighted pooling after the offsets (bag_weights_of)
+        # where len(offsets) = batch_size, or the norms of _activation_norms alone
+        batch = out[2] if type(module) == nn.EmbeddingBag and bag_weights_of(out) is not None else out[-1]
+        if batch.shape[batch_dim] > max_batch_len:
+            max_batch_len = batch.shape[batch_dim]
 
     return max_batch_len
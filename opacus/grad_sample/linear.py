@@ -13,11 +13,12 @@
 # See the License for the specific language governing permissions and
 # limitations under the License.
 
-from typing import Dict, List
+from typing import Dict, List, Tuple
 
 import torch
 import torch.nn as nn
 from opt_einsum import contract
+from custom_utils import custom_api_cuda
 from .utils import register_grad_sampler
 
 @register_grad_sampler(nn.Linear)
@@ -35,8 +36,43 @@ def compute_linear_grad_sample(
     activations = activations[0]
     ret = {}
     if layer.weight.requires_grad:
-        gs = contract("n...i,n...j->nij", backprops, activations)
-        ret[layer.weight] = gs
+        if activations.dim() == 2:
+            # The per-sample gradient of an example is the outer product of its backprop and activation,
+            # so it is kept factored: the backprops (B x d_out) with the activations (layer.weight.grad_sample_activations)
+            # (see factored_grad_sample_norms() and DPOptimizer.clip_and_accumulate)
+            ret[layer.weight] = backprops
+            layer.weight.grad_sample_activations = activations
+        else:
+            gs = contract("n...i,n...j->nij", backprops, activations)
+            ret[layer.weight] = gs
     if layer.bias is not None and layer.bias.requires_grad:
         ret[layer.bias] = contract("n...k->nk", backprops)
     return ret
+
+
+def factored_grad_sample_norms(grad_sample: torch.Tensor, activations: torch.Tensor) -> torch.Tensor:
+    """
+    Per-sample gradient norms of the ``nn.Linear`` weight from its factored representation,
+    i.e., ||backprop x activation^T|| = ||backprop|| * ||activation|| of each example
+
+    Args:
+        grad_sample: Backprops (B x d_out)
+        activations: Activations (B x d_in)
+    """
+    return grad_sample.norm(2, dim=-1) * activations.norm(2, dim=-1)
+
+
+def linear_ghost_norms(activations: torch.Tensor, backprops: torch.Tensor) -> Tuple[torch.Tensor, torch.Tensor]:
+    """
+    Per-sample gradient norms of the weight and the bias of ``nn.Linear``, i.e., ||backprop|| * ||activation||
+    and ||backprop|| of each example, with a single kernel for CUDA fp32 tensors (``custom_api_cuda.linear_ghost_norms``)
+
+    Args:
+        activations: Activations (B x d_in)
+        backprops: Backprops (B x d_out)
+    """
+    if activations.is_cuda and activations.dtype == torch.float and backprops.dtype == torch.float and custom_api_cuda is not None:
+        weight_norms, bias_norms = custom_api_cuda.linear_ghost_norms(activations.contiguous(), backprops.contiguous())
+        return weight_norms, bias_norms
+    bias_norms = backprops.norm(2, dim=-1)
+    return activations.norm(2, dim=-1) * bias_norms, bias_norms
@@ -13,6 +13,7 @@
 # See the License for the specific language governing permissions and
 # limitations under the License.
 
+from .dp_linear import DPLinear
 from .dp_multihead_attention import DPMultiheadAttention, SequenceBias
 from .dp_rnn import DPGRU, DPLSTM, DPRNN
 from .param_rename import RenameParamsMixin
@@ -22,6 +23,7 @@ __all__ = [
     "DPRNN",
     "DPGRU",
     "DPLSTM",
+    "DPLinear",
     "DPMultiheadAttention",
     "RenameParamsMixin",
     "SequenceBias",
@@ -0,0 +1,70 @@
+#!/usr/bin/env python3
+# Copyright (c) Meta Platforms, Inc. and affiliates.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+from typing import Callable, Optional
+
+import torch
+import torch.nn as nn
+import torch.nn.functional as F
+
+
+class _DPLinearFunction(torch.autograd.Function):
+    """
+    ``F.linear`` whose backward also hands its input and output gradient to the ghost
+    norms of the owning :class:`DPLinear` (2-D input only)
+    """
+
+    @staticmethod
+    @torch.cuda.amp.custom_fwd
+    def forward(ctx, input, weight, bias, module):
+        ctx.save_for_backward(input, weight)
+        ctx.module = module
+        return F.linear(input, weight, bias)
+
+    @staticmethod
+    @torch.cuda.amp.custom_bwd
+    def backward(ctx, grad_output):
+        input, weight = ctx.saved_tensors
+        grad_input = grad_weight = grad_bias = None
+        if ctx.needs_input_grad[0]:
+            grad_input = grad_output.mm(weight)
+        if ctx.needs_input_grad[1]:
+            grad_weight = grad_output.t().mm(input)
+        if ctx.needs_input_grad[2]:
+            grad_bias = grad_output.sum(dim=0)
+        if ctx.module.ghost_norm_hook is not None:
+            ctx.module.ghost_norm_hook(ctx.module, input, grad_output)
+        return grad_input, grad_weight, grad_bias, None
+
+
+class DPLinear(nn.Linear):
+    r"""
+    Drop-in replacement of ``nn.Linear`` for the ghost-norm path of DP-SGD(F)/LazyDP/EANA.
+
+    The per-sample gradient norms come from its own autograd Function instead of the hooks
+    of :class:`~opacus.grad_sample.GradSampleModule`: the backward passes its saved input
+    and the output gradient to ``ghost_norm_hook`` (set by ``GradSampleModule``), whose
+    ``||a|| * ||g||`` (weight) and ``||g||`` (bias) are a single kernel on the GPU
+    (``opacus.grad_sample.linear.linear_ghost_norms``). No activations are stashed on the
+    module and no hooks are called for it. Inputs are ``[batch_size, in_features]``.
+    """
+
+    def __init__(self, in_features: int, out_features: int, bias: bool = True):
+        super().__init__(in_features, out_features, bias)
+        self.ghost_norm_hook: Optional[Callable] = None
+
+    def forward(self, input: torch.Tensor) -> torch.Tensor:
+        assert input.dim() == 2, "DPLinear takes [batch_size, in_features]"
+        return _DPLinearFunction.apply(input, self.weight, self.bias, self)
@@ -17,7 +17,7 @@ from .ddp_perlayeroptimizer import (
     DistributedPerLayerOptimizer,
     SimpleDistributedPerLayerOptimizer,
 )
-from .ddpoptimizer import DistributedDPOptimizer
+from .ddpoptimizer import DistributedDPOptimizer, DistributedLazyDPOptimizer
 from .optimizer import DPOptimizer
 from .perlayeroptimizer import DPPerLayerOptimizer
 
@@ -26,14 +26,17 @@ __all__ = [
     "AdaClipDPOptimizer",
     "DistributedPerLayerOptimizer",
     "DistributedDPOptimizer",
+    "DistributedLazyDPOptimizer",
     "DPOptimizer",
     "DPPerLayerOptimizer",
     "SimpleDistributedPerLayerOptimizer",
 ]
 
 
-def get_optimizer_class(clipping: str, distributed: bool, grad_sample_mode: str = None):
-    if clipping == "flat" and distributed is False:
+def get_optimizer_class(clipping: str, distributed: bool, grad_sample_mode: str = None, lazydp_data_parallel: bool = False):
+    if clipping == "flat" and lazydp_data_parallel:
+        return DistributedLazyDPOptimizer
+    elif clipping == "flat" and distributed is False:
         return DPOptimizer
     elif clipping == "flat" and distributed is True:
         return DistributedDPOptimizer
@@ -19,7 +19,11 @@ from typing import Callable, Optional
 import torch
 from torch.optim import Optimizer
 
-from .optimizer import DPOptimizer
+import config
+from config import MODE_LAZYDP
+from custom_utils import coalesce
+
+from .optimizer import DPOptimizer, _nbytes
 
 
 class DistributedDPOptimizer(DPOptimizer):
@@ -75,3 +79,98 @@ class DistributedDPOptimizer(DPOptimizer):
             return self.original_optimizer.step(closure)
         else:
             return None
+
+
+class DistributedLazyDPOptimizer(DPOptimizer):
+    """
+    :class:`~opacus.optimizers.optimizer.DPOptimizer` of LazyDP with data-parallel
+    embedding tables: every rank holds all tables and their HT, and trains on its
+    slice of the batch (``config.dist_mode == "data_parallel"``).
+
+    The replicas stay identical without communicating any noise. The HTs of all
+    ranks see the same rows (the union of the next-iteration unique rows of the
+    ranks), the delayed noise of a row comes from the counter-based generator keyed
+    by (seed, table, row, iteration) with a seed shared by the ranks, and the sparse
+    gradients of the tables are exchanged as coalesced (index, value) pairs instead
+    of a dense all-reduce (``config.dist_sparse_grad``). The noise of the MLPs is added on the first worker before
+    their gradients are summed, as in :class:`DistributedDPOptimizer`.
+    """
+
+    def __init__(
+        self,
+        optimizer: Optimizer,
+        module,
+        *,
+        noise_multiplier: float,
+        max_grad_norm: float,
+        expected_batch_size: Optional[int],
+        loss_reduction: str = "mean",
+        generator=None,
+        secure_mode: bool = False,
+    ):
+        assert config.dpsgd_mode == MODE_LAZYDP and config.noise_rng == "philox"
+        # both derive the noise of the next iteration before its rows are known to all ranks
+        assert not config.noise_producer and not config.pipeline_lS_i
+        super().__init__(
+            optimizer,
+            module,
+            noise_multiplier=noise_multiplier,
+            max_grad_norm=max_grad_norm,
+            expected_batch_size=expected_batch_size,
+            loss_reduction=loss_reduction,
+            generator=generator,
+            secure_mode=secure_mode,
+        )
+        self.rank = torch.distributed.get_rank()
+        self.world_size = torch.distributed.get_world_size()
+
+        seed = torch.tensor([self.noise_seed], dtype=torch.int64, device=self._comm_device())
+        torch.distributed.broadcast(seed, 0)
+        self.noise_seed = int(seed.item())
+
+    def _comm_device(self):
+        return config.device if torch.distributed.get_backend() == "nccl" else torch.device("cpu")
+
+    def _all_gather_1d(self, input: torch.Tensor) -> torch.Tensor:
+        # variable-length all_gather, the tensors of the ranks concatenated in rank order on the CPU
+        device = self._comm_device()
+        n = torch.tensor([input.numel()], dtype=torch.int64, device=device)
+        sizes = [torch.empty_like(n) for _ in range(self.world_size)]
+        torch.distributed.all_gather(sizes, n)
+        sizes = [int(size) for size in sizes]
+        padded = torch.empty(max(sizes), dtype=input.dtype, device=device)
+        padded[: input.numel()] = input.reshape(-1).to(device)
+        outputs = [torch.empty_like(padded) for _ in range(self.world_size)]
+        torch.distributed.all_gather(outputs, padded)
+        return torch.cat([output[:size] for output, size in zip(outputs, sizes)]).cpu()
+
+    def set_lS_i(self, lS_i_nxt, uniques_nxt=None, lS_o_nxt=None, plans_nxt=None):
+        # the HT of every rank sees the union of the next-iteration rows of all ranks
+        if lS_i_nxt is not None:
+            lS_i_nxt = [self._all_gather_1d(lS_i.unique()) for lS_i in lS_i_nxt]
+        super().set_lS_i(lS_i_nxt, None, lS_o_nxt)
+        # the inverse and the sort plan of the union do not map the local gradient of the next iteration
+        self.lS_i_nxt_inverse = None
+        self.lS_i_nxt_plan = None
+
+    def reduce_distributed_gradients(self):
+        super().reduce_distributed_gradients()
+        # all_gather: every rank takes the coalesced gradients of all ranks, summed by the delayed noise update
+        # alltoallv: the owner of a row range sums its rows of all ranks (extend_distributed.sparse_allreduce)
+        if config.dist_sparse_grad == "alltoallv":
+            import extend_distributed as ext_dist # dlrm/, imported by the driver
+        elif config.dist_sparse_grad != "all_gather":
+            assert False
+        config.profiler.start_l2("coalesce")
+        for i in range(len(self.emb_tables)):
+            p = self.params[i]
+            grad = coalesce(p.grad, i)
+            if config.dist_sparse_grad == "alltoallv":
+                p.grad = ext_dist.sparse_allreduce(grad, lambda received: coalesce(received, i))
+            else:
+                indices = self._all_gather_1d(grad._indices())
+                values = self._all_gather_1d(grad._values()).view(-1, p.shape[1])
+                p.grad = torch.sparse_coo_tensor(indices.view(1, -1), values, p.shape)
+            config.cur_num_indices_list[i] = p.grad._indices().shape[1]
+            config.profiler.add_bytes("coalesce", _nbytes(grad, p.grad))
+        config.profiler.end_l2("coalesce")
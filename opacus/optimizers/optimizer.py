@@ -15,6 +15,9 @@
 from __future__ import annotations
 
 import logging
+import math
+import os
+import threading
 from typing import Callable, List, Optional, Union
 
 import torch
@@ -22,15 +25,20 @@ from opacus.optimizers.utils import params
 from opt_einsum.contract import contract
 from torch import nn
 from torch.optim import Optimizer
+from torch.optim.sgd import sgd
 
 import config
 from config import MODE_DPSGD_B, MODE_DPSGD_R, MODE_DPSGD_F, MODE_LAZYDP, MODE_EANA
 
 from opacus.grad_sample import AbstractGradSampleModule, GradSampleModule
+from opacus.grad_sample.grad_sample_module import SquaredNormBuffer
+from opacus.grad_sample.embedding import bag_grad, bag_grad_sample_norms, lookup_grad_sample_norms, lookup_grad
+from opacus.grad_sample.linear import factored_grad_sample_norms
 from opacus.utils.module_utils import trainable_modules, trainable_parameters
 
 import numpy as np
 import custom_api_cpp
+from custom_utils import coalesce, RowSparseGrad, StreamedParameterWriter, huge_pages_like, remap_rows, NullLatencyMeter, home_rows_like, custom_api_cuda
 
 logger = logging.getLogger(__name__)
 
@@ -62,6 +70,35 @@ def _mark_as_processed(obj: Union[torch.Tensor, List[torch.Tensor]]):
             x._processed = True
 
 
+def _nbytes(*tensors) -> int:
+    # bytes of (sparse) tensors, for the bandwidth of the update stages (LatencyMeter.add_bytes())
+    n_bytes = 0
+    for t in tensors:
+        if t is None:
+            continue
+        if t.is_sparse:
+            n_bytes += _nbytes(t._indices(), t._values())
+        else:
+            n_bytes += t.numel() * t.element_size()
+    return n_bytes
+
+
+def sparse_emb_tables(module: nn.Module) -> List[nn.Module]:
+    """
+    Embedding tables updated by LazyDP: ``emb_l`` of DLRM (in the order of its sparse features),
+    else every ``nn.Embedding``/``nn.EmbeddingBag`` with ``sparse=True`` of the model, on any
+    device and in the order of its modules (e.g., the towers of a two-tower retrieval model or
+    the vocabulary embedding of a language model). Table ``i`` takes ``lS_i_nxt[i]``
+
+    Args:
+        module: The model (or its ``GradSampleModule``)
+    """
+    emb_l = getattr(module, "emb_l", None)
+    if emb_l is not None:
+        return emb_l
+    return [m for m in module.modules() if isinstance(m, (nn.Embedding, nn.EmbeddingBag)) and m.sparse and m.weight.requires_grad]
+
+
 def _check_processed_flag_tensor(x: torch.Tensor):
     """
     Checks if this gradient tensor has been previously used in optimization step.
@@ -114,6 +151,7 @@ def _generate_noise(
     reference: torch.Tensor,
     generator=None,
     secure_mode: bool = False,
+    philox_key=None,
 ) -> torch.Tensor:
     """
     Generates noise according to a Gaussian distribution with mean 0
@@ -125,6 +163,8 @@ def _generate_noise(
         generator: The PyTorch noise generator
         secure_mode: boolean showing if "secure" noise need to be generated
             (see the notes)
+        philox_key: (seed, table, iteration) used by the counter-based generator
+            when ``config.noise_rng == "philox"``
 
     Notes:
         If `secure_mode` is enabled, the generated noise is also secure
@@ -142,6 +182,11 @@ def _generate_noise(
         In PyTorch, `p=53` and so complexity is `2^53(2n-1)`. With `n=1`, we get
         `2^53` (easy to break) but with `n=2`, we get `2^159`, which is hard
         enough for an attacker to break.
+
+        Here the 4 samples of an element are summed in registers by a native
+        kernel (``custom_api_cpp.normal_secure``, ``custom_api_cuda.normal_secure``
+        on the GPU), Philox keyed by the secret ``philox_key[0]``, so the
+        noise tensor is written once.
     """
     #zeros = torch.zeros(reference.shape, device=reference.device)
     if std == 0:
@@ -150,24 +195,16 @@ def _generate_noise(
     # TODO: handle device transfers: generator and reference tensor
     # could be on different devices
     if secure_mode:
-        assert False, "Do not consider secure_mode"
-        torch.normal(
-            mean=0,
-            std=std,
-            size=(1, 1),
-            device=reference.device,
-            generator=generator,
-        )  # generate, but throw away first generated Gaussian sample
-        sum = zeros
-        for _ in range(4):
-            sum += torch.normal(
-                mean=0,
-                std=std,
-                size=reference.shape,
-                device=reference.device,
-                generator=generator,
-            )
-        return sum / 2
+        # the 4-sum of the notes in a single pass of a native kernel (instead of 5 calls of torch.normal),
+        # keyed by the 64-bit seed drawn from the secure generator (DPOptimizer.noise_seed)
+        seed, table, iteration = philox_key
+        n_emb = reference.shape[0] if reference.dim() > 1 else 1
+        dim = reference.numel() // max(n_emb, 1)
+        if reference.is_cuda:
+            noise = custom_api_cuda.normal_secure(std, n_emb, dim, seed, table, iteration)
+        else:
+            noise = custom_api_cpp.normal_secure(std, n_emb, dim, seed, table, iteration, config.noise_base_nthreads)
+        return noise.view(reference.shape)
     else:
         if config.is_debugging and config.debugging_type in ["without_noise", "without_noise_clipping"]:
             return torch.zeros(reference.shape, device=reference.device)
@@ -178,7 +215,10 @@ def _generate_noise(
         else:
             # TODO: suppose that only parameters of embedding layers are in CPU DRAM
             if reference.device == torch.device("cpu") and config.noise_base_optimize != "baseline":
-                if config.noise_base_optimize == "multi_thread":
+                if config.noise_base_optimize == "multi_thread" and config.noise_rng == "philox":
+                    seed, table, iteration = philox_key
+                    return custom_api_cpp.normal_philox(std, reference.shape[0], reference.shape[1], seed, table, iteration, config.noise_base_nthreads)
+                elif config.noise_base_optimize == "multi_thread":
                     return custom_api_cpp.normal_multi_thread(std, reference.shape[0], reference.shape[1], config.noise_base_nthreads)
                 else:
                     assert False
@@ -192,6 +232,56 @@ def _generate_noise(
                 )
 
 
+class GradAllreduceBuckets:
+    """
+    Buckets of dense parameters whose gradients are summed over the ranks while the backward is
+    still running (``config.dist_mlp_allreduce == "overlapped"``). Buckets follow the reverse order
+    of the parameters, i.e., the order in which the backward produces their gradients; once the
+    last gradient of a bucket is accumulated, the bucket is flattened and its ``all_reduce``
+    starts asynchronously. ``wait()`` takes the sums back into ``p.grad``
+    """
+
+    def __init__(self, params: List[nn.Parameter], bucket_bytes: int):
+        self.buckets = []
+        self.bucket_of = {}
+        for p in reversed(params):
+            if len(self.buckets) == 0 or sum(_nbytes(q) for q in self.buckets[-1]) >= bucket_bytes:
+                self.buckets.append([])
+            self.bucket_of[id(p)] = len(self.buckets) - 1
+            self.buckets[-1].append(p)
+            p.register_post_accumulate_grad_hook(self._on_grad)
+        self.active = False
+
+    def start(self):
+        self.pending = [len(bucket) for bucket in self.buckets]
+        self.works = [None] * len(self.buckets)
+        self.active = True
+
+    def _on_grad(self, p: nn.Parameter):
+        if not self.active:
+            return
+        b = self.bucket_of[id(p)]
+        self.pending[b] -= 1
+        if self.pending[b] == 0:
+            flat = torch.cat([q.grad.reshape(-1) for q in self.buckets[b]])
+            self.works[b] = (flat, torch.distributed.all_reduce(flat, op=torch.distributed.ReduceOp.SUM, async_op=True))
+
+    def wait(self):
+        self.active = False
+        for bucket, work in zip(self.buckets, self.works):
+            # a bucket without gradient (unused parameters) is not reduced
+            if work is None:
+                assert all(p.grad is None for p in bucket)
+                continue
+            flat, handle = work
+            handle.wait()
+            offset = 0
+            for p in bucket:
+                p.grad = flat[offset : offset + p.numel()].view_as(p)
+                offset += p.numel()
+        self.works = None
+
+
 class DPOptimizer(Optimizer):
     """
     ``torch.optim.Optimizer`` wrapper that adds additional functionality to clip per
@@ -275,16 +365,115 @@ class DPOptimizer(Optimizer):
 
         for p in self.params:
             p.summed_grad = None
+        if config.clip_backward == "per_layer":
+            # equal split of max_grad_norm, so the clipped gradient of the whole model stays within max_grad_norm
+            # (the sensitivity of the noise), as DPPerLayerOptimizer with max_grad_norm / sqrt(n_params) for each
+            for p in self.params:
+                p.per_layer_max_grad_norm = max_grad_norm / math.sqrt(len(self.params))
         
         self.module = module
+        # the embedding tables of LazyDP (sparse_emb_tables()), registered by the identity of their parameters
+        self.emb_tables = sparse_emb_tables(module)
+        self.emb_params = [emb.weight for emb in self.emb_tables]
+        self.emb_param_index = {id(p): i for i, p in enumerate(self.emb_params)}
+
+        # squared per-sample norms of the parameters off config.device, written in place by the hooks
+        # and transferred at once in clip_and_accumulate() (instead of a transfer per parameter);
+        # not needed when each parameter is clipped by its own norm
+        off_device_params = [p for p in self.params if p.device != config.device]
+        if config.dpsgd_mode in [MODE_DPSGD_R, MODE_DPSGD_F, MODE_LAZYDP, MODE_EANA] and len(off_device_params) > 0 and config.clip_backward != "per_layer":
+            self.module.sq_norm_buffer = SquaredNormBuffer(off_device_params)
+
+        # seed and step counter of the counter-based generator (config.noise_rng == "philox")
+        if secure_mode:
+            # the key of the secure noise (_generate_noise) must not be known, a 63-bit secret of the secure generator
+            assert config.noise_seed is None and generator is not None
+            self.noise_seed = int(torch.randint(0, 2**63 - 1, (1,), generator=generator).item())
+        elif config.noise_seed is not None:
+            self.noise_seed = config.noise_seed
+        else:
+            self.noise_seed = int(torch.randint(0, 2**31 - 1, (1,)).item())
+        self.grad_buckets = None
+        self.dense_graph = None # custom_utils.DenseStepGraph (config.cuda_graph), set by the driver
+        if config.dist_mlp_allreduce == "overlapped":
+            # the gradients of the MLPs are summed during the second backward, then every rank adds the same
+            # (Philox) noise keyed by the seed of rank 0, which equals the noise added once before the sum
+            assert config.noise_rng == "philox" and torch.distributed.is_initialized()
+            seed = torch.tensor([self.noise_seed], dtype=torch.int64,
+                                device=config.device if torch.distributed.get_backend() == "nccl" else torch.device("cpu"))
+            torch.distributed.broadcast(seed, 0)
+            self.noise_seed = int(seed.item())
+            mlp_params = [p for p in self.params if p.device == config.device and id(p) not in self.emb_param_index]
+            self.grad_buckets = GradAllreduceBuckets(mlp_params, config.dist_bucket_mb << 20)
+        # the per-thread generators of the torch noise (normal_multi_thread*) follow the same seed
+        custom_api_cpp.seed_generators(self.noise_seed)
+        self.noise_step = 0
+        self.noise_pool = None # config.noise_rng == "pool", sampled at the first use
+
+        if config.adaptive_clipping:
+            # adaptive clipping on the ghost norms (as AdaClipDPOptimizer): the threshold stays on config.device
+            # and only shrinks from max_grad_norm, which keeps calibrating the noise (and the delayed noise of
+            # LazyDP); the noise multiplier pays for the noisy count (Theorem 1 of arXiv:1905.03871)
+            assert config.dpsgd_mode in [MODE_DPSGD_F, MODE_LAZYDP, MODE_EANA] and config.clip_backward != "per_layer"
+            self.clipbound = torch.full((1,), float(max_grad_norm), dtype=torch.float, device=config.device)
+            self.noise_multiplier = (
+                self.noise_multiplier ** (-2) - (2 * config.adaclip_unclipped_num_std) ** (-2)
+            ) ** (-1 / 2)
 
         if config.dpsgd_mode == MODE_LAZYDP:
             self.cnt_iter = 0
-            self.HT = list(torch.arange(len(self.module.emb_l)))
-            for i in range(len(self.module.emb_l)):
-                self.HT[i] = torch.zeros(self.module.emb_l[i].weight.shape[0], dtype=torch.int)
-            self.stds_for_delayed_noise = list(torch.arange(len(self.module.emb_l)))
-            self.lS_i_nxt = list(torch.arange(len(self.module.emb_l)))
+            if config.ht_optimize == "baseline" and config.emb_layout == "concat":
+                # one HT over the global rows of the concatenated tables, the HT of a table is a view of its rows
+                offsets = self.emb_tables.row_offsets
+                self.HT_global = huge_pages_like(torch.empty(offsets[-1], dtype=torch.int), copy=False)
+                self.HT = [self.HT_global[offsets[i]:offsets[i + 1]] for i in range(len(self.emb_tables))]
+            elif config.ht_optimize == "baseline":
+                self.HT = list(torch.arange(len(self.emb_tables)))
+                for i in range(len(self.emb_tables)):
+                    # in HBM with the tables of the gpu_only system, or alone (config.ht_device == "gpu")
+                    weight = self.emb_tables[i].weight
+                    device = config.device if config.ht_device == "gpu" else weight.device
+                    self.HT[i] = huge_pages_like(torch.empty(weight.shape[0], dtype=torch.int, device=device), copy=False)
+                    home_rows_like(self.HT[i], self.emb_tables[i])
+            elif config.ht_optimize == "native":
+                # all tables in a single allocation, self.HT_native.table(i) gives the counters of i-th table
+                self.HT_native = custom_api_cpp.HistoryTable([emb.weight.shape[0] for emb in self.emb_tables], config.ht_bits, config.ht_nthreads, config.huge_pages, config.ht_hot_set, config.ht_blocked)
+                self.HT = None
+            elif config.ht_optimize == "inline":
+                # in the entries of the dynamic tables (custom_api_cpp.DynamicEmbeddingTable), see map_dynamic_ids()
+                self.HT = None
+                if config.dynamic_evict_ttl > 0 or config.dynamic_evict_lfu > 0:
+                    for i, emb in enumerate(self.emb_tables):
+                        cold_path = "" if config.dynamic_evict_cold_dir is None else os.path.join(config.dynamic_evict_cold_dir, "table_%d.bin" % i)
+                        emb.dynamic_table.enable_eviction(config.dynamic_evict_ttl, config.dynamic_evict_lfu, config.dynamic_evict_high_water, config.dynamic_evict_scan,
+                                                          cold_path, self.noise_multiplier * self.max_grad_norm, self.noise_seed)
+            else:
+                assert False
+            self.stds_for_delayed_noise = list(torch.arange(len(self.emb_tables)))
+            self.lS_i_nxt = list(torch.arange(len(self.emb_tables)))
+            # (inverse, counts) of lS_i_nxt / of the indices of the current gradient,
+            # only with unique_optimize == "multi_thread_inverse"
+            self.lS_i_nxt_inverse = None
+            self.lS_i_cur_inverse = None
+            # (perm, starts) of the sort plan of lS_i_nxt / (unique, perm, starts) of the indices of the current
+            # gradient, only with unique_optimize == "sort_plan" (custom_api_cpp.sort_plan)
+            self.lS_i_nxt_plan = None
+            self.lS_i_cur_plan = None
+            # entry t: sums of lr^2 and lr over the iterations 1 ~ t (config.lr_schedule_noise == "prefix_sum")
+            self.lr_prefix = torch.zeros((2, 1024), dtype=torch.float64)
+            # noise rows reordered by delay and the histogram of the delays (config.noise_std_optimize == "grouped")
+            self.grouped_noise_rows = [None] * len(self.emb_tables)
+            self.delay_histogram = torch.zeros(4096 + 1, dtype=torch.int64) # NOISE_GROUP_MAX_DELAY + 1 bins
+            # per-table counters of the delayed noise (config.delay_stats), see stats()
+            self.delay_stats = None
+            # recording of the unique rows of every update (config.record_unique_sets)
+            self.unique_set_writer = None
+            # bags of lS_i_nxt pooled by the update (config.update_pool_optimize == "fused")
+            self.bags_nxt = None
+            self.pooled_nxt = None
+            self.pooled_buffers = dict()
+            self.emb_update_rule = self._emb_update_rule()
+            self.row_cache = None
             
                         
 
@@ -429,6 +618,17 @@ class DPOptimizer(Optimizer):
 
         self.step_hook = fn
 
+    def _grad_sample_norms(self, p: nn.Parameter, grad_sample: torch.Tensor) -> torch.Tensor:
+        # per-sample gradient norms of p, including the per-bag (nn.EmbeddingBag), per-lookup
+        # (nn.Embedding) and factored (nn.Linear weight) representations of the grad sampler
+        if getattr(p, "grad_sample_per_bag", False):
+            return bag_grad_sample_norms(grad_sample, p.inputs[0], p.inputs[-1], p.bag_weights)
+        if getattr(p, "grad_sample_lookups", None) is not None:
+            return lookup_grad_sample_norms(grad_sample, p.grad_sample_lookups)
+        if getattr(p, "grad_sample_activations", None) is not None:
+            return factored_grad_sample_norms(grad_sample, p.grad_sample_activations)
+        return grad_sample.reshape(len(grad_sample), -1).norm(2, dim=-1)
+
     def clip_and_accumulate(self, losses: torch.Tensor = None):
         """
         Performs gradient clipping.
@@ -442,16 +642,11 @@ class DPOptimizer(Optimizer):
                 per_sample_clip_factor = torch.zeros((0,))
             else:
                 config.profiler.start("Update_per_sample_clip_factor")
-                per_param_norms = [
-                    g.reshape(len(g), -1).norm(2, dim=-1) for g in self.grad_samples
-                ]
+                config.profiler.record_memory("grad_sample", _nbytes(*self.grad_samples))
+                per_param_norms = [self._grad_sample_norms(p, g) for p, g in zip(self.params, self.grad_samples)]
                 for i in range(len(per_param_norms)):
                     if(per_param_norms[i].device != config.device):
                         per_param_norms[i] = per_param_norms[i].to(config.device)
-                # TODO: wrong implementation:
-                # Even if num_gathers = 10, some sample might access 9 or 8 indices..
-                # Current implementation of first backward just make (num_gathers) copies of output gradients of embeding layer
-                # That means, the norm is over-valued
                 per_sample_norms = torch.stack(per_param_norms, dim=1).norm(2, dim=1)
                 per_sample_clip_factor = (
                     self.max_grad_norm / (per_sample_norms + 1e-6)
@@ -466,31 +661,41 @@ class DPOptimizer(Optimizer):
                 _check_processed_flag(p.grad_sample)
                 grad_sample = self._get_flat_grad_sample(p)
                 
-                if(not hasattr(p, 'inputs')):
+                if getattr(p, "grad_sample_activations", None) is not None:
+                    # factored nn.Linear weight: the clipped sum is a single scaled GEMM
+                    config.profiler.start_l2("clip")
+                    grad = torch.mm((grad_sample * per_sample_clip_factor.view(-1, 1)).t(), p.grad_sample_activations)
+                    p.grad_sample_activations = None
+                    config.profiler.end_l2("clip")
+                elif getattr(p, "grad_sample_lookups", None) is not None:
+                    # per-lookup gradients of nn.Embedding: clipped and coalesced over the looked-up rows only
+                    config.profiler.start_l2("coalesce")
+                    grad = coalesce(lookup_grad(grad_sample, p.grad_sample_lookups, per_sample_clip_factor, p.shape[0]))
+                    p.grad_sample_lookups = None
+                    config.profiler.add_bytes("coalesce", _nbytes(grad_sample, grad))
+                    config.profiler.end_l2("coalesce")
+                elif(not hasattr(p, 'inputs')):
                     config.profiler.start_l2("clip")
                     grad = contract("i,i...", per_sample_clip_factor, grad_sample)
                     config.profiler.end_l2("clip")
                 else: # when embedding
                     config.profiler.start_l2("clip")
                     index, tmp_emb, offset = p.inputs
-                    grad_sample = torch.einsum('i, ijk -> ijk', per_sample_clip_factor.to(torch.device("cpu")), grad_sample)
+                    clip_factor = per_sample_clip_factor.to(torch.device("cpu"), torch.float)
                     config.profiler.end_l2("clip")
                     
+                    # per-bag gradients (grad_sample_per_bag) are clipped while being coalesced
                     config.profiler.start_l2("coalesce")
-                    if config.coalesce_optimize == "baseline":
-                        grad = torch.sparse_coo_tensor(index.view(1, -1), grad_sample.view(-1, grad_sample.shape[-1]), p.shape).coalesce()
-                    elif config.coalesce_optimize == "multi_thread_openmp":
-                        grad = custom_api_cpp.coalesce_multi_thread_openmp(torch.sparse_coo_tensor(index.view(1, -1), grad_sample.view(-1, grad_sample.shape[-1]), p.shape), config.coalesce_nthreads)
-                    elif config.coalesce_optimize == "multi_thread_embeddingbag":
-                        grad = custom_api_cpp.coalesce_multi_thread_embeddingbag(torch.sparse_coo_tensor(index.view(1, -1), grad_sample.view(-1, grad_sample.shape[-1]), p.shape), config.coalesce_nthreads)
-                    else:
-                        assert False
+                    weights = p.bag_weights.cpu().float() if p.bag_weights is not None else torch.empty(0)
+                    grad = custom_api_cpp.coalesce_bag_gradient(grad_sample.contiguous(), clip_factor, index, offset, weights, p.shape[0], config.coalesce_nthreads)
+                    config.profiler.add_bytes("coalesce", _nbytes(grad_sample, index, offset, grad))
                     config.profiler.end_l2("coalesce")
 
                 config.profiler.start_l2("grad_to_summedgrad")
                 if p.summed_grad is not None:
-                    p.summed_grad += grad
-                    assert False, "Exclude RNNs"
+                    # only micro-batches of a logical step (signal_skip_step()) accumulate
+                    assert self._is_last_step_skipped, "Exclude RNNs"
+                    p.summed_grad = self._accumulate_summed_grad(p.summed_grad, grad)
                 else:
                     p.summed_grad = grad
                 config.profiler.end_l2("grad_to_summedgrad")
@@ -498,89 +703,258 @@ class DPOptimizer(Optimizer):
                 
             config.profiler.end("Update_clip_and_reduce")
         elif config.dpsgd_mode in [MODE_DPSGD_R, MODE_DPSGD_F, MODE_LAZYDP, MODE_EANA]:
-            config.profiler.start("clipping_factor")
             assert losses != None
-            per_param_norms = []
-            for p in self.params:
-                if p.device != config.device:
-                    assert len(p.grad_sample_norms) == 1
-                    per_param_norms += [p.grad_sample_norms[0].to(config.device)]
+            if config.clip_backward == "per_layer":
+                # each parameter was clipped by its own norm in the hooks of the first (and only) backward
+                config.profiler.start("2nd_backprop")
+                config.profiler.start_l2("backward")
+                for p in self.params:
+                    p.grad = p.per_layer_clipped_grad
+                    p.per_layer_clipped_grad = None
+                config.profiler.end_l2("backward")
+            else:
+                config.profiler.start("clipping_factor")
+                per_param_sq_norms = []
+                for p in self.params:
+                    if p.device != config.device:
+                        continue # in self.module.sq_norm_buffer
+                    per_param_sq_norms += [norms.square() for norms in p.grad_sample_norms]
+                batch_size = config.cur_batch_size
+                if config.dist_batch_slice is not None and config.dist_mode == "model_parallel":
+                    # distributed LazyDP: the norms of the local tables cover the whole batch, and are summed
+                    # over the ranks (all tables) before the slice of the MLPs of this rank is taken
+                    emb_sq_norms = self.module.sq_norm_buffer.to_device(batch_size).sum(dim=1)
+                    torch.distributed.all_reduce(emb_sq_norms)
+                    per_param_sq_norms += [emb_sq_norms[config.dist_batch_slice]]
+                    batch_size = per_param_sq_norms[-1].shape[0]
+                elif self.module.sq_norm_buffer is not None:
+                    per_param_sq_norms += [self.module.sq_norm_buffer.to_device(config.cur_batch_size)]
+                per_sample_norms = torch.cat([n.view(batch_size, -1) for n in per_param_sq_norms], dim=1).sum(dim=1).sqrt()
+                if config.adaptive_clipping:
+                    per_sample_clip_factor = self._adaptive_clip_factor(per_sample_norms)
                 else:
-                    per_param_norms += p.grad_sample_norms
-            per_sample_norms = torch.stack(per_param_norms, dim=1).norm(2, dim=1)
-            per_sample_clip_factor = (self.max_grad_norm / (per_sample_norms + 1e-6)).clamp(
-                max=1.0
-            )
-            config.profiler.end("clipping_factor")
+                    per_sample_clip_factor = (self.max_grad_norm / (per_sample_norms + 1e-6)).clamp(
+                        max=1.0
+                    )
+                config.profiler.end("clipping_factor")
             
-            if config.is_debugging and config.debugging_type == "without_noise_clipping":
-                per_sample_clip_factor = torch.ones_like(per_sample_clip_factor)
+                if config.is_debugging and config.debugging_type == "without_noise_clipping":
+                    per_sample_clip_factor = torch.ones_like(per_sample_clip_factor)
                 
-            config.profiler.start("loss_clipping")
-            # Use sum(), not mean(), to derive gradients in summed manner across mini-batch
-            # This is to match with implementation of DP-SGD (B), summed gradients are added
-            # with noise first, and then averaged 
-            loss = (losses.reshape(1, -1)*per_sample_clip_factor).sum()
-            config.profiler.end("loss_clipping")
-            
-            config.profiler.start("2nd_backprop")
-            config.profiler.start_l2("backward")
-            self.module.disable_hooks()
-            loss.backward()
-            config.profiler.end_l2("backward")
+                if config.clip_backward == "cached":
+                    config.profiler.start("2nd_backprop")
+                    config.profiler.start_l2("backward")
+                    self._clipped_grads_from_cache(per_sample_clip_factor)
+                    config.profiler.end_l2("backward")
+                elif config.clip_backward == "reweight" and self.dense_graph is not None:
+                    # replay of the captured backward of the re-weighted loss (config.cuda_graph)
+                    config.profiler.start("2nd_backprop")
+                    config.profiler.start_l2("backward")
+                    self.module.disable_hooks()
+                    self.dense_graph.clipped_backward(per_sample_clip_factor)
+                    config.profiler.end_l2("backward")
+                    self.module.enable_hooks()
+                elif config.clip_backward == "reweight":
+                    config.profiler.start("loss_clipping")
+                    # Use sum(), not mean(), to derive gradients in summed manner across mini-batch
+                    # This is to match with implementation of DP-SGD (B), summed gradients are added
+                    # with noise first, and then averaged 
+                    loss = (losses.reshape(1, -1)*per_sample_clip_factor).sum() * config.amp_loss_scale
+                    config.profiler.end("loss_clipping")
+                
+                    config.profiler.start("2nd_backprop")
+                    config.profiler.start_l2("backward")
+                    self.module.disable_hooks()
+                    if self.grad_buckets is not None:
+                        self.grad_buckets.start()
+                    loss.backward()
+                    if self.grad_buckets is not None:
+                        self.grad_buckets.wait()
+                    if config.amp_loss_scale != 1.0:
+                        # static loss scale of config.mlp_amp "fp16", a power of two so exact
+                        for p in self.params:
+                            p.grad.mul_(1.0 / config.amp_loss_scale)
+                    config.profiler.end_l2("backward")
+                    self.module.enable_hooks()
+                else:
+                    assert False
 
             # In LazyDP, do coalescing after merging (sparse) gradient and (sparse) noise
             if config.dpsgd_mode != MODE_LAZYDP:
                 config.profiler.start_l2("coalesce")
-                if config.coalesce_optimize == "baseline":
-                    for param in self.module.emb_l.parameters():
-                        param.grad = param.grad.coalesce()
-                elif config.coalesce_optimize == "multi_thread_openmp":
-                    for param in self.module.emb_l.parameters():
-                        param.grad = custom_api_cpp.coalesce_multi_thread_openmp(param.grad, config.coalesce_nthreads)
-                elif config.coalesce_optimize == "multi_thread_embeddingbag":
-                    for param in self.module.emb_l.parameters():
-                        param.grad = custom_api_cpp.coalesce_multi_thread_embeddingbag(param.grad, config.coalesce_nthreads)
+                for i, param in enumerate(self.emb_params):
+                    grad = param.grad
+                    if config.dpsgd_mode == MODE_EANA and config.eana_noise_optimize == "fused":
+                        # noise of the coalesced rows is sampled in the same pass (see add_noise)
+                        param.grad = custom_api_cpp.coalesce_radix_with_noise(grad, self.noise_multiplier * self.max_grad_norm,
+                                                                              self.noise_seed, i, self.noise_step, config.coalesce_nthreads)
+                    else:
+                        param.grad = coalesce(grad, i)
+                    config.profiler.add_bytes("coalesce", _nbytes(grad, param.grad))
                 config.profiler.end_l2("coalesce")
 
-            self.module.enable_hooks()
             config.profiler.end("2nd_backprop")
 
             config.profiler.start("summedgrad_to_grad")
-            for p in self.params:
-                p.summed_grad = p.grad
+            for i, p in enumerate(self.params):
+                if self._is_last_step_skipped and p.summed_grad is not None:
+                    # gradient accumulation: merged into the running (coalesced) gradient of the logical step
+                    p.summed_grad = self._accumulate_summed_grad(p.summed_grad, p.grad)
+                    if p.summed_grad.is_sparse and id(p) in self.emb_param_index:
+                        # the raw gradient rows staged by the delayed noise update of LazyDP
+                        config.cur_num_indices_list[self.emb_param_index[id(p)]] = p.summed_grad._nnz()
+                else:
+                    p.summed_grad = p.grad
                 p.grad = None
             config.profiler.end("summedgrad_to_grad")
         else:
             assert False, "Invalid mode of DP-SGD"
 
-    def add_noise(self):
+    def _adaptive_clip_factor(self, per_sample_norms: torch.Tensor) -> torch.Tensor:
+        """
+        Clipping factors against the adaptive threshold ``self.clipbound``, which is then updated
+        for the next iteration from the noisy fraction of unclipped examples. On the GPU both are
+        done by a single launch (``custom_api_cuda.adaptive_clip_factor``), without a host sync
+
+        Args:
+            per_sample_norms: Ghost norm of each example
+        """
+        args = (config.adaclip_target_unclipped_quantile, config.adaclip_clipbound_learning_rate, config.adaclip_unclipped_num_std,
+                config.adaclip_min_clipbound, self.max_grad_norm)
+        if per_sample_norms.is_cuda:
+            return custom_api_cuda.adaptive_clip_factor(per_sample_norms.float().contiguous(), self.clipbound, *args,
+                                                        self.noise_seed, self.noise_step)
+        quantile, lr, unclipped_num_std, min_clipbound, max_clipbound = args
+        per_sample_clip_factor = (self.clipbound / (per_sample_norms + 1e-6)).clamp(max=1.0)
+        unclipped_num = (per_sample_clip_factor >= 1).sum() + torch.randn(1, generator=self.generator) * unclipped_num_std
+        unclipped_frac = unclipped_num / len(per_sample_norms)
+        self.clipbound = (self.clipbound * torch.exp(-lr * (unclipped_frac - quantile))).clamp(min_clipbound, max_clipbound)
+        return per_sample_clip_factor
+
+    def _accumulate_summed_grad(self, summed_grad: torch.Tensor, grad: torch.Tensor) -> torch.Tensor:
+        # the clipped gradient of a micro-batch added to the gradient accumulated in the logical step;
+        # the sparse gradients of the tables are coalesced together, so the accumulator stays one row per index
+        if not grad.is_sparse:
+            return summed_grad + grad
+        config.profiler.start_l2("coalesce")
+        merged = torch.sparse_coo_tensor(torch.cat([summed_grad._indices(), grad._indices()], dim=1),
+                                         torch.cat([summed_grad._values(), grad._values()]), grad.shape)
+        merged = coalesce(merged)
+        config.profiler.add_bytes("coalesce", _nbytes(summed_grad, grad, merged))
+        config.profiler.end_l2("coalesce")
+        return merged
+
+    def _clipped_grads_from_cache(self, per_sample_clip_factor: torch.Tensor):
+        """
+        Derives the clipped summed gradients (``p.grad``) from the activations and backprops
+        cached by the first backward (``config.clip_backward == "cached"``), which is the gradient
+        of ``sum(losses * per_sample_clip_factor)`` without running the backward again
+
+        Args:
+            per_sample_clip_factor: Clipping factor of each example
+        """
+        params = self.params
+        if config.emb_backward == "batched":
+            # clipped and coalesced gradients of all CPU-resident tables with a single kernel, bucketed
+            # with the unique indices of set_lS_i() when they were kept (unique_optimize "multi_thread_inverse")
+            # (the bags of weighted pooling go through bag_grad below)
+            tables = [p for p in params if p.cached_bags is not None and p.cached_bags[2] is None and p.device == torch.device("cpu")]
+            inverse = getattr(self, "lS_i_cur_inverse", None)
+            if inverse is None or len(tables) != len(inverse):
+                inverse = []
+            backprops = [p.cached_backprops.contiguous() for p in tables]
+            bag_args = (backprops, per_sample_clip_factor.to(torch.device("cpu"), torch.float),
+                        [p.cached_bags[0] for p in tables], [p.cached_bags[1] for p in tables])
+            inverse_args = ([u for u, _, _ in inverse], [v for _, v, _ in inverse], [c for _, _, c in inverse], config.coalesce_nthreads)
+            if config.emb_grad_format == "rows":
+                # kept as (rows, values) for do_delayed_noise_update(), p.grad of the tables stays None
+                grads = custom_api_cpp.bag_grad_multi_table_rows(*bag_args, *inverse_args)
+                for p, (rows, values) in zip(tables, grads):
+                    p.row_grad = RowSparseGrad(rows, values, p.shape[0])
+            else:
+                grads = custom_api_cpp.bag_grad_multi_table(*bag_args, [p.shape[0] for p in tables], *inverse_args)
+                for p, grad in zip(tables, grads):
+                    p.grad = grad
+            for p in tables:
+                p.cached_backprops = p.cached_activations = p.cached_bags = None
+            params = [p for p in params if p.cached_backprops is not None]
+        for p in params:
+            clip_factor = per_sample_clip_factor.to(p.device)
+            scaled_backprops = p.cached_backprops * clip_factor.view(-1, *([1] * (p.cached_backprops.dim() - 1)))
+            if p.cached_bags is not None:
+                # nn.EmbeddingBag: same (uncoalesced) sparse gradient as the backward of embedding_bag
+                p.grad = bag_grad(scaled_backprops, *p.cached_bags, p.shape[0])
+            elif p.cached_activations is not None:
+                # nn.Linear weight: backprops^T @ activations
+                p.grad = torch.mm(scaled_backprops.t(), p.cached_activations)
+            else:
+                # nn.Linear bias
+                p.grad = scaled_backprops.sum(dim=0)
+            p.cached_backprops = p.cached_activations = p.cached_bags = None
+
+    def add_noise(self, on_device: Optional[bool] = None):
         """
         Adds noise to clipped gradients. Stores clipped and noised result in ``p.grad``
+
+        Args:
+            on_device: If set, only the parameters on (``True``) or off (``False``) ``config.device``
+                are processed, and the caller advances ``self.noise_step``
         """
         config.profiler.start("Update_noise")
-        for p in self.params:
+        fused_mlp = config.mlp_noise_optimize == "fused" and on_device is not False
+        if fused_mlp:
+            self._fused_mlp_noise_update()
+        for i, p in enumerate(self.params):
+            if on_device is not None and (p.device == config.device) != on_device:
+                continue
+            if fused_mlp and self._is_fused_mlp_param(i, p):
+                continue
             _check_processed_flag(p.summed_grad)
             # TODO: suppose that only parameters of embedding layers are in CPU DRAM
-            if p.device == torch.device('cpu') and (config.dpsgd_mode in [MODE_LAZYDP, MODE_EANA]): # emgedding layer
-                if config.dpsgd_mode == MODE_EANA: # when MODE_EANA
+            if self._is_emb_table(i, p) and (config.dpsgd_mode in [MODE_LAZYDP, MODE_EANA]): # emgedding layer
+                if config.dpsgd_mode == MODE_EANA and config.eana_noise_optimize == "fused":
+                    # already noised while coalescing (clip_and_accumulate)
+                    config.profiler.start_l2("add_noise_emb")
+                    p.grad = p.summed_grad
+                    config.profiler.end_l2("add_noise_emb")
+                elif config.dpsgd_mode == MODE_EANA: # when MODE_EANA
                     config.profiler.start_l2("generate_noise_emb")
                     noise = _generate_noise(
                         std=self.noise_multiplier * self.max_grad_norm,
                         reference=p.summed_grad.values(),
                         generator=self.generator,
                         secure_mode=self.secure_mode,
+                        philox_key=(self.noise_seed, i, self.noise_step),
                     )
+                    config.profiler.add_bytes("generate_noise_emb", _nbytes(noise))
                     config.profiler.end_l2("generate_noise_emb")
                     
                     config.profiler.start_l2("add_noise_emb")
                     p.summed_grad.values().add_(noise)
                     p.grad = p.summed_grad
+                    config.profiler.add_bytes("add_noise_emb", 3 * _nbytes(noise))
                     config.profiler.end_l2("add_noise_emb")
                 else: # when MODE_LAZYDP
                     config.profiler.start_l2("bypass_emb")
                     p.grad = p.summed_grad
                     config.profiler.end_l2("bypass_emb")
+            elif p.device == torch.device('cpu') and config.dpsgd_mode in [MODE_DPSGD_B, MODE_DPSGD_R, MODE_DPSGD_F] and config.dense_noise_optimize == "streaming":
+                # the table is updated here with the noise streamed in chunks of rows, its p.grad is cleared
+                # before original_optimizer.step()
+                config.profiler.start_l2("add_noise_emb")
+                seed = self.noise_seed if config.noise_rng == "philox" else -1
+                grad = coalesce(p.summed_grad, i)
+                with torch.no_grad():
+                    custom_api_cpp.dense_noise_sgd_update(p.data, grad, self.noise_multiplier * self.max_grad_norm, self._get_lr(p),
+                                                          seed, i, self.noise_step, config.noise_base_nthreads)
+                p.grad = None
+                config.profiler.add_bytes("add_noise_emb", 2 * _nbytes(p) + _nbytes(grad))
+                config.profiler.end_l2("add_noise_emb")
+            elif config.dist_batch_slice is not None and torch.distributed.get_rank() != 0 and self.grad_buckets is None:
+                # distributed LazyDP: the noise of the MLPs is added once (rank 0) before the sum over the ranks
+                config.profiler.start_l2("add_noise_mlp")
+                p.grad = p.summed_grad
+                config.profiler.end_l2("add_noise_mlp")
             else: #  for MLP layers or other DP-SGD algorithms (DP-SGD(B, R))
                 if p.device == torch.device('cpu'):
                     config.profiler.start_l2("generate_noise_emb")
@@ -592,8 +966,11 @@ class DPOptimizer(Optimizer):
                     reference=p.summed_grad,
                     generator=self.generator,
                     secure_mode=self.secure_mode,
+                    philox_key=(self.noise_seed, i, self.noise_step),
                 ) 
                 
+                noise_columns = ("generate_noise_emb", "add_noise_emb") if p.device == torch.device('cpu') else ("generate_noise_mlp", "add_noise_mlp")
+                config.profiler.add_bytes(noise_columns[0], _nbytes(noise))
                 if p.device == torch.device('cpu'):
                     config.profiler.end_l2("generate_noise_emb")
                     config.profiler.start_l2("add_noise_emb")
@@ -606,6 +983,7 @@ class DPOptimizer(Optimizer):
                     p.grad = noise
                 else:
                     p.grad = noise.add_(p.summed_grad)
+                config.profiler.add_bytes(noise_columns[1], 2 * _nbytes(noise) + _nbytes(p.summed_grad))
                 
                 if p.device == torch.device('cpu'):
                     config.profiler.end_l2("add_noise_emb")
@@ -613,9 +991,63 @@ class DPOptimizer(Optimizer):
                     config.profiler.end_l2("add_noise_mlp")
 
             _mark_as_processed(p.summed_grad)
+        if config.dist_batch_slice is not None and on_device is not False:
+            self.reduce_distributed_gradients()
+        if on_device is None:
+            self.noise_step += 1
         config.profiler.end("Update_noise")
         
 
+    def _emb_dim(self, i):
+        return self.emb_tables[i].weight.shape[1]
+
+    def _uniform_emb_dim(self):
+        # the multi-table kernels take a single dimension (not the sub-tables of MD embeddings)
+        dims = set(self._emb_dim(i) for i in range(len(self.emb_tables)))
+        assert len(dims) == 1, "Tables of different dimensions"
+        return dims.pop()
+
+    def _is_fused_mlp_param(self, i, p):
+        return p.is_cuda and not self._is_emb_table(i, p)
+
+    def _fused_mlp_noise_update(self):
+        # (config.mlp_noise_optimize == "fused") noise, gradient and SGD update of all MLP parameters with
+        # a single multi-tensor kernel (custom_api_cuda.noise_sgd_update_multi_tensor), the noise of i-th
+        # parameter keyed by (noise_seed, i, element / 4, noise_step); their p.grad is cleared before
+        # original_optimizer.step()
+        config.profiler.start_l2("add_noise_mlp")
+        mlp = [(i, p) for i, p in enumerate(self.params) if self._is_fused_mlp_param(i, p)]
+        for _, p in mlp:
+            _check_processed_flag(p.summed_grad)
+        lrs = set(self._get_lr(p) for _, p in mlp)
+        assert len(lrs) <= 1, "Fused update of the MLPs needs a single learning rate"
+        with torch.no_grad():
+            custom_api_cuda.noise_sgd_update_multi_tensor([p.data for _, p in mlp], [p.summed_grad.contiguous() for _, p in mlp], [i for i, _ in mlp],
+                                                          self.noise_multiplier * self.max_grad_norm, lrs.pop() if len(lrs) > 0 else 0.0, self.noise_seed, self.noise_step)
+        for _, p in mlp:
+            config.profiler.add_bytes("add_noise_mlp", 3 * _nbytes(p))
+            p.grad = None
+            _mark_as_processed(p.summed_grad)
+        config.profiler.end_l2("add_noise_mlp")
+
+    def _is_emb_table(self, i, p):
+        # tables are the parameters of sparse_emb_tables() on any device (CPU-resident in the cpu_gpu system,
+        # in HBM in the gpu_only system or when placed there by config.table_placement)
+        return id(p) in self.emb_param_index
+
+    def reduce_distributed_gradients(self):
+        # distributed LazyDP: sums the (clipped, noised on rank 0) gradients of the MLPs over the ranks,
+        # the tables are model-parallel and their gradients already cover the whole batch
+        # (data-parallel tables: DistributedLazyDPOptimizer)
+        if self.grad_buckets is not None:
+            # already summed during the second backward (GradAllreduceBuckets)
+            return
+        config.profiler.start_l2("add_noise_mlp")
+        for p in self.params:
+            if p.device == config.device and p.grad is not None:
+                torch.distributed.all_reduce(p.grad, op=torch.distributed.ReduceOp.SUM)
+        config.profiler.end_l2("add_noise_mlp")
+
     def scale_grad(self):
         """
         Applies given ``loss_reduction`` to ``p.grad``.
@@ -624,8 +1056,41 @@ class DPOptimizer(Optimizer):
         ``self.expected_batch_size`` if ``loss_reduction="mean"``
         """
         if self.loss_reduction == "mean":
-            for p in self.params:
-                p.grad /= self.expected_batch_size * self.accumulated_iterations
+            for group in self.original_optimizer.param_groups:
+                # the groups of SGD without weight decay take the scale in their lr (_step_with_lr_scale())
+                if self._lr_foldable(group):
+                    continue
+                for p in group["params"]:
+                    # p.grad is None for the embedding tables already updated by the fused kernel
+                    if p.grad is not None:
+                        p.grad /= self.expected_batch_size * self.accumulated_iterations
+
+    def _lr_scale(self):
+        # same as "scale_grad()", as a factor of the learning rate
+        if config.is_debugging and self.loss_reduction == "mean":
+            return 1.0 / (self.expected_batch_size * self.accumulated_iterations)
+        return 1.0
+
+    def _lr_foldable(self, group):
+        # SGD is linear in the gradient without weight decay (the momentum buffer as well), so
+        # p.grad / s is the same as lr / s
+        return isinstance(self.original_optimizer, torch.optim.SGD) and group["weight_decay"] == 0
+
+    def _step_with_lr_scale(self):
+        # original_optimizer.step() with the lr of the foldable groups scaled by _lr_scale()
+        # instead of a pass over their gradients
+        scale = self._lr_scale()
+        if scale == 1.0:
+            return self.original_optimizer.step()
+        lrs = [group["lr"] for group in self.original_optimizer.param_groups]
+        for group in self.original_optimizer.param_groups:
+            if self._lr_foldable(group):
+                group["lr"] *= scale
+        try:
+            return self.original_optimizer.step()
+        finally:
+            for group, lr in zip(self.original_optimizer.param_groups, lrs):
+                group["lr"] = lr
 
     def zero_grad(self, set_to_none: bool = False):
         """
@@ -690,8 +1155,8 @@ class DPOptimizer(Optimizer):
             config.profiler.end("Update_delayed_noise_update")
         
 
-        # TODO: This can be merged in learning rate
-        # New learining rate = original learning rate / batch size
+        # New learning rate = original learning rate / batch size (_step_with_lr_scale()),
+        # only the gradients of the groups that cannot take it in the lr are scaled
         if config.is_debugging:
             self.scale_grad()
 
@@ -706,14 +1171,96 @@ class DPOptimizer(Optimizer):
             with torch.enable_grad():
                 closure()
 
+        if config.concurrent_step:
+            return self._concurrent_step(losses)
+
         if self.pre_step(losses=losses):
             config.profiler.start("Update_original")
-            ret = self.original_optimizer.step()
+            # read the gradient, read and write the (touched rows of the) parameter
+            config.profiler.add_bytes("Update_original", sum(_nbytes(p.grad) + 2 * (_nbytes(p) if not p.grad.is_sparse else _nbytes(p.grad._values())) for p in self.params if p.grad is not None))
+            ret = self._step_with_lr_scale()
             config.profiler.end("Update_original")
             return ret
         else:
             return None
 
+    def _concurrent_step(self, losses: torch.Tensor = None) -> Optional[float]:
+        # (config.concurrent_step) same as pre_step() + original_optimizer.step(), except that the update of
+        # the parameters off config.device (the CPU-resident embedding tables: noise, delayed noise update,
+        # sparse update) runs in a host worker thread while the noise and update kernels of the parameters on
+        # config.device (the MLPs) are launched asynchronously, so the step takes the longer of the two.
+        self.clip_and_accumulate(losses)
+        if self._check_skip_next_step():
+            self._is_last_step_skipped = True
+            return None
+        assert not config.is_debugging and isinstance(self.original_optimizer, torch.optim.SGD)
+
+        if self.step_hook:
+            self.step_hook(self)
+
+        # the profiler synchronizes the device at every record and is not thread-safe,
+        # so the concurrent part is recorded as a whole in "Update_original"
+        profiler = config.profiler
+        profiler.start("Update_original")
+        config.profiler = NullLatencyMeter()
+        errors = []
+
+        def host_update():
+            try:
+                self.add_noise(on_device=False)
+                if config.dpsgd_mode == MODE_LAZYDP:
+                    self.set_emb_to_noise_update()
+                    self.do_delayed_noise_update()
+                self._original_step(on_device=False)
+            except BaseException as e:
+                errors.append(e)
+
+        worker = threading.Thread(target=host_update)
+        worker.start()
+        try:
+            self.add_noise(on_device=True)
+            self._original_step(on_device=True)
+        finally:
+            worker.join()
+            config.profiler = profiler
+        profiler.end("Update_original")
+        if len(errors) > 0:
+            raise errors[0]
+
+        self.noise_step += 1
+        self._is_last_step_skipped = False
+        return None
+
+    def _original_step(self, on_device: bool):
+        # original_optimizer.step() (torch.optim.SGD) restricted to the parameters on (on_device)
+        # or off config.device, so that both sets can be updated concurrently
+        for group in self.original_optimizer.param_groups:
+            params_with_grad = []
+            d_p_list = []
+            momentum_buffer_list = []
+            for p in group["params"]:
+                if p.grad is None or (p.device == config.device) != on_device:
+                    continue
+                params_with_grad.append(p)
+                d_p_list.append(p.grad)
+                momentum_buffer_list.append(self.state[p].get("momentum_buffer"))
+
+            with torch.no_grad():
+                sgd(params_with_grad,
+                    d_p_list,
+                    momentum_buffer_list,
+                    weight_decay=group["weight_decay"],
+                    momentum=group["momentum"],
+                    lr=group["lr"],
+                    dampening=group["dampening"],
+                    nesterov=group["nesterov"],
+                    maximize=group["maximize"],
+                    has_sparse_grad=any(d_p.is_sparse for d_p in d_p_list),
+                    foreach=False)
+
+            for p, momentum_buffer in zip(params_with_grad, momentum_buffer_list):
+                self.state[p]["momentum_buffer"] = momentum_buffer
+
     def __repr__(self):
         return self.original_optimizer.__repr__()
 
@@ -723,84 +1270,1419 @@ class DPOptimizer(Optimizer):
     def load_state_dict(self, state_dict) -> None:
         self.original_optimizer.load_state_dict(state_dict)
 
+    def lazydp_state_dict(self):
+        # State of LazyDP beyond state_dict(), taken between two iterations: the HT (an int32 tensor
+        # per table), the iteration counters, the unique rows of the pending batch and the state of the
+        # generators, so that a run resumes without settling the delayed noise (custom_utils.save_lazydp_checkpoint)
+        assert config.dpsgd_mode == MODE_LAZYDP
+        self.join_noise_drain()
+        self.join_deferred_update()
+        assert not getattr(self, "noise_in_production", False)
+        # cached rows are only up to date in the GPU memory
+        assert self.row_cache is None, "Checkpoint does not support the GPU row cache"
+        if config.ht_optimize == "native":
+            HT = [self.HT_native.table(i).clone() for i in range(len(self.emb_tables))]
+        else:
+            HT = [HT_table.cpu() for HT_table in self.HT]
+        return {
+            "HT": HT,
+            "cnt_iter": self.cnt_iter,
+            "noise_step": self.noise_step,
+            "noise_seed": self.noise_seed,
+            "lr_prefix": self.lr_prefix,
+            "clipbound": self.clipbound.cpu() if config.adaptive_clipping else None,
+            "lS_i_nxt": self.lS_i_nxt,
+            "lS_i_nxt_HT": getattr(self, "lS_i_nxt_HT", None),
+            "lS_i_nxt_inverse": self.lS_i_nxt_inverse,
+            "lS_i_nxt_plan": self.lS_i_nxt_plan,
+            "generator": self.generator.get_state() if self.generator is not None else None,
+            "torch_rng": torch.get_rng_state(),
+            "cuda_rng": torch.cuda.get_rng_state_all() if torch.cuda.is_available() else None,
+        }
+
+    def load_lazydp_state_dict(self, state_dict) -> None:
+        # Inverse of lazydp_state_dict(): the HT is copied into its allocation (huge pages, NUMA homes)
+        assert config.dpsgd_mode == MODE_LAZYDP
+        assert len(state_dict["HT"]) == len(self.emb_tables)
+        with torch.no_grad():
+            for i, HT_table in enumerate(state_dict["HT"]):
+                if config.ht_optimize == "native":
+                    # table() is a copy of the compressed counters
+                    assert config.ht_bits == 32, "Checkpoint does not support the compressed HT"
+                    self.HT_native.table(i).copy_(HT_table)
+                else:
+                    self.HT[i].copy_(HT_table)
+        self.cnt_iter = state_dict["cnt_iter"]
+        self.noise_step = state_dict["noise_step"]
+        self.noise_seed = state_dict["noise_seed"]
+        self.lr_prefix = state_dict.get("lr_prefix", self.lr_prefix)
+        if config.adaptive_clipping and state_dict.get("clipbound") is not None:
+            self.clipbound.copy_(state_dict["clipbound"])
+        self.lS_i_nxt = state_dict["lS_i_nxt"]
+        self.lS_i_nxt_HT = state_dict["lS_i_nxt_HT"]
+        self.lS_i_nxt_inverse = state_dict["lS_i_nxt_inverse"]
+        self.lS_i_nxt_plan = state_dict.get("lS_i_nxt_plan")
+        if self.generator is not None and state_dict["generator"] is not None:
+            self.generator.set_state(state_dict["generator"])
+        torch.set_rng_state(state_dict["torch_rng"])
+        if torch.cuda.is_available() and state_dict["cuda_rng"] is not None:
+            torch.cuda.set_rng_state_all(state_dict["cuda_rng"])
+
     def set_emb_to_noise_update(self):
-        if self.lS_i_nxt == None:
+        self.join_noise_drain()
+        self.join_deferred_update()
+        if getattr(self, "llc_prefetcher", None) is not None:
+            # the HT gather and the update take over the prefetched rows
+            self.llc_prefetcher.stop()
+        if config.lr_schedule_noise == "prefix_sum":
+            self._record_lr_prefix()
+        if self.lS_i_nxt == None or getattr(self, "noise_in_production", False) or self.emb_update_rule != "sgd":
             return
         
         lS_i_nxt = self.lS_i_nxt
 
+        if getattr(self, "stds_prefetched", None) is not None:
+            self.stds_for_delayed_noise = self.stds_prefetched
+            self.stds_prefetched = None
+            return
+
+        if self._fuse_std_noise() or config.delayed_noise_update_optimize in ["sharded", "graph", "engine"]:
+            # stds are derived in-register by the noise kernel (do_delayed_noise_update)
+            return
+
+        if config.ht_optimize == "inline":
+            # delays of the unique rows, kept by the dynamic tables when the ids of the batch were mapped
+            for i in range(len(lS_i_nxt)):
+                table = self.emb_tables[i].dynamic_table
+                assert table.iteration() == self.cnt_iter
+                self.stds_for_delayed_noise[i] = (table.delays()**(1/2))*self.noise_multiplier*self.max_grad_norm
+            return
+
+        if config.ht_optimize == "native":
+            self.stds_for_delayed_noise = self.HT_native.gather_stds(list(range(len(lS_i_nxt))), list(self.lS_i_nxt_HT), self.cnt_iter, self.noise_multiplier*self.max_grad_norm)
+            return
+
+        if config.emb_weight_decay > 0:
+            constant_noise = config.is_debugging and config.debugging_type == "one_as_noise"
+            self.delays_for_weight_decay = [self._gather_delays(i, self.lS_i_nxt_HT[i]) for i in range(len(lS_i_nxt))]
+            for i in range(len(lS_i_nxt)):
+                ratio = self._decayed_noise_ratio(i, self.delays_for_weight_decay[i], constant_noise)
+                # _noise_for_debugging() squares the std back
+                self.stds_for_delayed_noise[i] = (ratio ** (1/2) * self.noise_multiplier * self.max_grad_norm).float()
+            return
+
+        if config.lr_schedule_noise == "prefix_sum":
+            for i in range(len(lS_i_nxt)):
+                self.stds_for_delayed_noise[i] = self._scheduled_stds(self._gather_delays(i, self.lS_i_nxt_HT[i]))
+            return
+
+        if config.delayed_noise_update_optimize == "global":
+            # a single gather of the global HT, the stds of a table are a view of its rows
+            std = ((self.cnt_iter - self.HT_global[self.lS_i_nxt_global])**(1/2))*self.noise_multiplier*self.max_grad_norm
+            self.stds_for_delayed_noise = list(std.split([unique.shape[0] for unique in lS_i_nxt]))
+            return
+
         for i in range(len(lS_i_nxt)):
+            if self.HT[i].is_cuda:
+                self.stds_for_delayed_noise[i] = custom_api_cuda.gather_stds(self.HT[i], self.lS_i_nxt_HT[i], self.cnt_iter, self.noise_multiplier*self.max_grad_norm)
+                continue
             self.stds_for_delayed_noise[i] = ((self.cnt_iter - self.HT[i][self.lS_i_nxt[i]])**(1/2))*self.noise_multiplier*self.max_grad_norm
                 
+    def _record_lr_prefix(self):
+        # the lr of this iteration (cnt_iter), the same for all tables
+        lr = self._get_lr(self.emb_params[0])
+        assert lr > 0
+        while self.lr_prefix.shape[1] <= self.cnt_iter:
+            self.lr_prefix = torch.cat([self.lr_prefix, torch.zeros_like(self.lr_prefix)], dim=1)
+        self.lr_prefix[0, self.cnt_iter] = self.lr_prefix[0, self.cnt_iter - 1] + lr * lr
+        self.lr_prefix[1, self.cnt_iter] = self.lr_prefix[1, self.cnt_iter - 1] + lr
+
+    def _scheduled_stds(self, delays):
+        # std of the delayed noise of rows last updated at (cnt_iter - delays): the noise of a skipped
+        # iteration t is scaled by its lr_t, so that the noise applied with the current lr has the
+        # variance of sum(lr_t^2) / lr^2 iterations (sum(lr_t) / lr for the constant debugging noise)
+        c = self.cnt_iter
+        lr = self.lr_prefix[1, c] - self.lr_prefix[1, c - 1]
+        if config.is_debugging and config.debugging_type == "one_as_noise":
+            # _noise_for_debugging() squares the std back
+            ratio = (self.lr_prefix[1, c] - self.lr_prefix[1][c - delays.long()]) / lr
+        else:
+            ratio = (self.lr_prefix[0, c] - self.lr_prefix[0][c - delays.long()]) / (lr * lr)
+        return (ratio ** (1/2) * self.noise_multiplier * self.max_grad_norm).float()
+
+    def _decay_base(self, i):
+        # the factor (1 - lr*wd) of one iteration of the lazy weight decay of i-th table
+        a = 1 - self._get_lr(self.emb_params[i]) * config.emb_weight_decay
+        assert 0 < a < 1
+        return a
+
+    def _decayed_noise_ratio(self, i, delays, constant_noise):
+        # the noise of k iterations ago is decayed by a^k, so the delayed noise of "delays" iterations has the
+        # variance of (1 - a^(2*delays)) / (1 - a^2) iterations (sum (1 - a^delays) / (1 - a) of the constant noise)
+        a = self._decay_base(i)
+        delays = delays.double()
+        if constant_noise:
+            return (1 - a ** delays) / (1 - a)
+        return (1 - a ** (2 * delays)) / (1 - a * a)
+
+    def _apply_lazy_weight_decay(self):
+        # The stored row of HT h is the row of iteration h without the decay of the iterations after h. The raw
+        # gradient of a row of the current batch (HT == cnt_iter - 1) is scaled by 1/a, so that the decay a^delay
+        # of its next update leaves it decayed by a^(delay - 1), except for the rows of lS_i_nxt, which take their
+        # pending decay a^delay (delay == 1 with the gradient) here, before their gradient and delayed noise
+        with torch.no_grad():
+            for i in range(len(self.emb_tables)):
+                a = self._decay_base(i)
+                grad = self.emb_params[i].grad
+                if grad is not None:
+                    grad_rows = grad._indices()[0]
+                    scale = torch.full(grad_rows.shape, 1 / a, dtype=grad._values().dtype)
+                    if self.lS_i_nxt != None:
+                        scale[torch.isin(grad_rows, self.lS_i_nxt[i])] = 1
+                    grad._values().mul_(scale.unsqueeze(1))
+                if self.lS_i_nxt == None:
+                    continue
+                weight = self.emb_tables[i].weight.data
+                rows = self.lS_i_nxt[i]
+                decay = (a ** self.delays_for_weight_decay[i].double()).to(weight.dtype)
+                weight.index_copy_(0, rows, weight[rows] * decay.unsqueeze(1))
+
+    def _fuse_std_noise(self):
+        return (config.noise_std_optimize in ["fused", "grouped"] and not config.is_debugging
+                and config.delayed_noise_update_optimize in ["baseline", "merge"] and config.noise_precision == "fp32")
+
+    def _delayed_noise_from_HT(self, i, dim, extra):
+        scale = self.noise_multiplier*self.max_grad_norm
+        seed = self.noise_seed if config.noise_rng == "philox" else -1
+        if config.ht_optimize == "native":
+            return self.HT_native.delayed_noise_with_extra(i, self.lS_i_nxt[i], dim, extra, self.cnt_iter, scale, seed)
+        if self.HT[i].is_cuda:
+            on_gpu = self.emb_params[i].is_cuda
+            noise = custom_api_cuda.delayed_noise_with_extra(self.HT[i], self.lS_i_nxt_HT[i], dim, extra if on_gpu else 0, self.cnt_iter, scale, self._gpu_noise_seed(), i)
+            return noise if on_gpu else self._noise_to_host(noise, extra)
+        if config.noise_std_optimize == "grouped":
+            rows, noise, histogram = custom_api_cpp.delayed_noise_grouped_with_extra(self.HT[i], self.lS_i_nxt[i], dim, extra, self.cnt_iter, scale, config.noise_group_min_rows, config.noise_final_nthreads)
+            self.grouped_noise_rows[i] = rows
+            self.delay_histogram += histogram
+            return noise
+        return custom_api_cpp.delayed_noise_with_extra(self.HT[i], self.lS_i_nxt[i], dim, extra, self.cnt_iter, scale, seed, i, config.noise_final_nthreads)
+
+    def _noise_rows(self, i):
+        # rows of the delayed noise of i-th table, reordered by delay with config.noise_std_optimize == "grouped"
+        if config.noise_std_optimize == "grouped" and self._fuse_std_noise():
+            return self.grouped_noise_rows[i]
+        return self.lS_i_nxt[i]
+
+    def delay_histogram_stats(self):
+        # rows of the delayed noise per delay so far (config.noise_std_optimize == "grouped"), the last bin for
+        # all delays >= custom_api_cpp NOISE_GROUP_MAX_DELAY
+        return self.delay_histogram
+
+    def _record_delay_stats(self):
+        # the HT is not updated for lS_i_nxt until the update (or set_HT_increase_cnt_iter()), so the delays of
+        # the noised rows are gathered here for every update path. The sums stay on the device of the HT
+        if self.delay_stats is None:
+            n_tables = len(self.emb_tables)
+            self.delay_stats = {"rows": [0] * n_tables, "avoided": [0] * n_tables, "iters": [None] * n_tables, "histogram": [None] * n_tables}
+        stats = self.delay_stats
+        for i in range(len(self.emb_tables)):
+            n_unique = self.lS_i_nxt[i].shape[0]
+            stats["rows"][i] += n_unique
+            stats["avoided"][i] += (self.emb_tables[i].weight.shape[0] - n_unique) * self._emb_dim(i)
+            if n_unique == 0:
+                continue
+            delays = self._gather_delays(i, self.lS_i_nxt_HT[i]).long()
+            histogram = torch.bincount(delays.clamp(max=config.delay_stats_max_delay), minlength=config.delay_stats_max_delay + 1)
+            if stats["histogram"][i] is None:
+                stats["iters"][i] = delays.sum()
+                stats["histogram"][i] = histogram
+            else:
+                stats["iters"][i] += delays.sum()
+                stats["histogram"][i] += histogram
+
+    def _record_unique_sets(self, lS_i_nxt):
+        # the unique rows of this update, their delays (gathered before the HT is updated, as for the delay
+        # stats) and the lookups of their batch, which make the uncoalesced gradient of the next update
+        if self.unique_set_writer is None:
+            n_tables = len(self.emb_tables)
+            self.unique_set_writer = custom_api_cpp.UniqueSetWriter(config.record_unique_sets, [self.emb_tables[i].weight.shape[0] for i in range(n_tables)],
+                                                                    [self._emb_dim(i) for i in range(n_tables)], self.noise_multiplier * self.max_grad_norm,
+                                                                    self._get_lr(self.emb_params[0]))
+        delays = [self._gather_delays(i, self.lS_i_nxt_HT[i]).cpu() for i in range(len(self.emb_tables))]
+        self.unique_set_writer.append([lS_i.cpu() for lS_i in lS_i_nxt], [unique.cpu() for unique in self.lS_i_nxt_HT], delays, config.data_gen_nthreads)
+
+    def close_unique_set_recording(self):
+        if self.unique_set_writer is not None:
+            self.unique_set_writer.close()
+
+    def stats(self):
+        # per table (config.delay_stats): unique rows noised, delayed iterations aggregated into their noise
+        # (sum of cnt_iter - HT[row]), noise elements (rows x dim) not sampled compared to DP-SGD(F) which
+        # noises every row in every iteration, and the histogram of the delays (the last bin for all
+        # delays >= config.delay_stats_max_delay)
+        assert config.delay_stats and self.delay_stats is not None
+        stats = self.delay_stats
+        histogram = [torch.zeros(config.delay_stats_max_delay + 1, dtype=torch.int64) if h is None else h.cpu() for h in stats["histogram"]]
+        return {
+            "unique_rows": list(stats["rows"]),
+            "delayed_iters": [0 if n is None else int(n.item()) for n in stats["iters"]],
+            "noise_avoided": list(stats["avoided"]),
+            "delay_histogram": torch.stack(histogram),
+        }
+
+    def _noise_to_host(self, noise, extra):
+        # noise rows sampled with the HT in HBM for a CPU table (config.ht_device == "gpu"), copied to a
+        # pinned buffer (cached by the host allocator) with "extra" more rows for the gradient
+        host = torch.empty((noise.shape[0] + extra, noise.shape[1]), pin_memory=True)
+        host[:noise.shape[0]].copy_(noise)
+        return host
+
+    def _noise_pool(self):
+        # Gaussian pool of config.noise_rng == "pool", sampled once from noise_seed (not a secure sampler)
+        if self.noise_pool is None:
+            generator = torch.Generator().manual_seed(self.noise_seed)
+            self.noise_pool = torch.randn(config.noise_pool_size, generator=generator)
+        return self.noise_pool
+
+    def _gpu_noise_seed(self):
+        # the CUDA kernels are counter-based only, a fresh seed per call unless config.noise_rng == "philox"
+        if config.noise_rng == "philox":
+            return self.noise_seed
+        return int(torch.randint(0, 2**31 - 1, (1,), generator=self.generator).item())
+
+    def _noise_for_debugging(self, std, dim, extra):
+        delays = (std/self.noise_multiplier/self.max_grad_norm)**2
+        if config.debugging_type in ["without_noise", "without_nosie_clipping"]:
+            return torch.cat([torch.zeros(std.shape[0], dim, device=std.device) * delays.unsqueeze(1), torch.zeros(extra, dim, device=std.device)])
+        elif config.debugging_type == "one_as_noise":
+            return torch.cat([torch.ones(std.shape[0], dim, device=std.device) * delays.unsqueeze(1), torch.zeros(extra, dim, device=std.device)])
+        else:
+            assert False
+
+    def _concat_noise_and_grad(self, i, v):
+        # v: (noise rows of lS_i_nxt[i]; space for the raw gradient of i-th table)
+        dim = v.shape[1]
+        sparse_grad = self.emb_params[i].grad
+        n_rows_noise = self.lS_i_nxt[i].shape[0]
+        v[n_rows_noise:] = sparse_grad._values()
+        if v.is_cuda:
+            new_indices = torch.empty([1, v.shape[0]], dtype=torch.long, device=v.device)
+        else:
+            new_indices = custom_api_cpp.workspace_empty([1, v.shape[0]], self.lS_i_nxt[i])
+        new_indices[0][:n_rows_noise] = self._noise_rows(i)
+        new_indices[0][n_rows_noise:] = sparse_grad._indices()[0]
+        n_rows_total = self.emb_params[i].shape[0]
+
+        assert config.cur_num_indices_list[i] == sparse_grad._indices().shape[1]
+        assert v.shape[0] == config.cur_num_indices_list[i] + n_rows_noise
+        return torch.sparse_coo_tensor(new_indices, v, (n_rows_total, dim))
+
+    def set_row_cache(self, row_cache):
+        # custom_utils.HotRowCache: the cached rows of the embedding tables are updated on the GPU
+        assert self.emb_update_rule == "sgd" and not config.noise_drain and not config.noise_producer
+        assert config.noise_std_optimize == "baseline"
+        self.row_cache = row_cache
+
+    def _update_cached_rows(self):
+        # Updates the rows held by the GPU cache (gradient and delayed noise), and leaves only the other
+        # rows in lS_i_nxt / stds_for_delayed_noise / config.cur_num_indices_list for the CPU path
+        cache = self.row_cache
+        lS_i_nxt, stds = [], []
+        with torch.no_grad():
+            for i in range(len(self.emb_tables)):
+                dim = self._emb_dim(i)
+                w = cache.weight[i]
+                lr = self._get_lr(self.emb_params[i])
+                if w.grad is not None:
+                    grad = w.grad.coalesce()
+                    w.index_add_(0, grad._indices()[0], grad._values(), alpha=-lr)
+                    w.grad = None
+                if self.lS_i_nxt == None:
+                    continue
+                slots = cache.slot[i][self.lS_i_nxt[i]].long()
+                cached = slots >= 0
+                std = self.stds_for_delayed_noise[i]
+                if cached.any():
+                    config.profiler.start_l2("generate_noise_emb")
+                    if config.is_debugging:
+                        noise = self._noise_for_debugging(std[cached], dim, 0).to(cache.device)
+                    else:
+                        noise = torch.randn(int(cached.sum().item()), dim, device=cache.device) * std[cached].to(cache.device).unsqueeze(1)
+                    config.profiler.end_l2("generate_noise_emb")
+                    w.index_add_(0, slots[cached].to(cache.device), noise, alpha=-lr)
+                lS_i_nxt.append(self.lS_i_nxt[i][~cached])
+                stds.append(std[~cached])
+        if self.lS_i_nxt != None:
+            self.lS_i_nxt, self.stds_for_delayed_noise = lS_i_nxt, stds
+        config.cur_num_indices_list = list(cache.n_misses)
+
     def do_delayed_noise_update(self):
-        dim = self.module.emb_l[0].weight.shape[1]
-        for i in range(len(self.module.emb_l)):
+        if self.row_cache is not None:
+            # the full lists are restored for set_HT_increase_cnt_iter()
+            lS_i_nxt, stds, n_indices = self.lS_i_nxt, self.stds_for_delayed_noise, config.cur_num_indices_list
+            self._update_cached_rows()
+            self._do_delayed_noise_update()
+            self.lS_i_nxt, self.stds_for_delayed_noise, config.cur_num_indices_list = lS_i_nxt, stds, n_indices
+        else:
+            self._do_delayed_noise_update()
+
+    def _do_delayed_noise_update(self):
+        if self.emb_update_rule != "sgd":
+            self.do_stateful_delayed_noise_update()
+            return
+        elif config.delayed_noise_update_optimize == "fused":
+            self.do_fused_delayed_noise_update()
+            return
+        elif config.delayed_noise_update_optimize == "batched":
+            self.do_batched_delayed_noise_update()
+            return
+        elif config.delayed_noise_update_optimize == "sharded":
+            self.do_sharded_delayed_noise_update()
+            return
+        elif config.delayed_noise_update_optimize == "graph":
+            self.do_graph_delayed_noise_update()
+            return
+        elif config.delayed_noise_update_optimize == "engine":
+            self.do_engine_delayed_noise_update()
+            return
+        elif config.delayed_noise_update_optimize == "global":
+            self.do_global_delayed_noise_update()
+            return
+        elif config.delayed_noise_update_optimize not in ["baseline", "merge"]:
+            assert False
+        # "merge" samples only the noise rows and merges them with the raw gradient in C++,
+        # instead of staging both in a concatenated COO tensor which is coalesced again
+        merge = config.delayed_noise_update_optimize == "merge"
+        if config.emb_weight_decay > 0:
+            self._apply_lazy_weight_decay()
+
+        produced_noise = None
+        if getattr(self, "noise_in_production", False):
+            config.profiler.start_l2("generate_noise_emb")
+            produced_noise = self.noise_producer.consume()
+            self.noise_in_production = False
+            config.profiler.end_l2("generate_noise_emb")
+        pending = [] # (table, noisy gradient, custom_api_cpp.TensorFuture) of config.coalesce_async
+        for i in range(len(self.emb_tables)):
+            # sub-tables of QR/MD embeddings differ in dimension
+            dim = self._emb_dim(i)
             if self.lS_i_nxt != None:
                 config.profiler.start_l2("generate_noise_emb")
-                std = self.stds_for_delayed_noise[i]
-                if config.is_debugging and config.debugging_type in ["without_noise", "without_nosie_clipping"]:
-                    delays = (std/self.noise_multiplier/self.max_grad_norm)**2
-                    v = torch.cat([torch.zeros(std.shape[0], dim) * delays.unsqueeze(1), torch.zeros(config.cur_batch_size * config.num_gathers_list[i], dim)])
-                elif config.is_debugging and config.debugging_type == "one_as_noise":
-                    delays = (std/self.noise_multiplier/self.max_grad_norm)**2
-                    v = torch.cat([torch.ones(std.shape[0], dim) * delays.unsqueeze(1), torch.zeros(config.cur_batch_size * config.num_gathers_list[i], dim)])
+                extra = 0 if merge else config.cur_num_indices_list[i]
+                std = None if self._fuse_std_noise() else self.stds_for_delayed_noise[i]
+                if produced_noise is not None:
+                    v = produced_noise[i]
+                elif std is None:
+                    v = self._delayed_noise_from_HT(i, dim, extra)
                 elif config.is_debugging:
+                    v = self._noise_for_debugging(std, dim, extra).to(self.emb_params[i].device)
+                    if merge and config.noise_precision != "fp32":
+                        v = v.to(torch.bfloat16 if config.noise_precision == "bf16" else torch.float16)
+                elif merge and config.noise_precision in ["bf16", "fp16"]:
+                    seed = self.noise_seed if config.noise_rng == "philox" else -1
+                    v = custom_api_cpp.normal_reduced_precision(std, self.lS_i_nxt[i], dim, config.noise_precision == "bf16", seed, i, self.cnt_iter, config.noise_final_nthreads)
+                elif merge and config.noise_precision != "fp32":
                     assert False
+                elif std.is_cuda and self.emb_params[i].is_cuda:
+                    v = custom_api_cuda.normal_philox_with_extra(std, self.lS_i_nxt[i], dim, extra, self._gpu_noise_seed(), i, self.cnt_iter)
+                elif std.is_cuda:
+                    v = self._noise_to_host(custom_api_cuda.normal_philox_with_extra(std, self.lS_i_nxt_HT[i], dim, 0, self._gpu_noise_seed(), i, self.cnt_iter), extra)
+                elif self.secure_mode:
+                    v = custom_api_cpp.normal_secure_with_extra(std, self.lS_i_nxt[i], dim, extra, self.noise_seed, i, self.cnt_iter, config.noise_final_nthreads)
+                elif config.noise_rng == "philox":
+                    v = custom_api_cpp.normal_philox_with_extra(std, self.lS_i_nxt[i], dim, extra, self.noise_seed, i, self.cnt_iter, config.noise_final_nthreads)
+                elif config.noise_rng == "pool":
+                    v = custom_api_cpp.normal_pool_with_extra(std, self.lS_i_nxt[i], self._noise_pool(), dim, extra, self.noise_seed, i, self.cnt_iter, config.noise_final_nthreads)
                 else:
-                    v = custom_api_cpp.normal_multi_thread_with_extra(std, dim, config.cur_batch_size * config.num_gathers_list[i], config.noise_final_nthreads)
+                    v = custom_api_cpp.normal_multi_thread_with_extra(std, dim, extra, config.noise_final_nthreads)
+                config.profiler.add_bytes("generate_noise_emb", _nbytes(v))
                 config.profiler.end_l2("generate_noise_emb")
+
+                if merge and config.emb_grad_format == "rows":
+                    config.profiler.start_l2("coalesce")
+                    grad = self._emb_row_grad(i)
+                    rows, values = custom_api_cpp.merge_noise_and_grad_rows(self.lS_i_nxt[i], v, grad.rows, grad.values, grad.n_rows, grad.coalesced, config.coalesce_nthreads)
+                    config.profiler.add_bytes("coalesce", _nbytes(v, grad.rows, grad.values, rows, values))
+                    config.profiler.end_l2("coalesce")
+                    self._row_sparse_sgd_update(i, RowSparseGrad(rows, values, grad.n_rows))
+                    continue
+                if merge:
+                    config.profiler.start_l2("coalesce")
+                    grad = self._coalesce_emb_grad(i) if self.lS_i_cur_inverse != None or self.lS_i_cur_plan != None else self.emb_params[i].grad
+                    self.emb_params[i].grad = custom_api_cpp.merge_noise_and_grad(self.lS_i_nxt[i], v, grad, config.coalesce_nthreads)
+                    config.profiler.add_bytes("coalesce", _nbytes(v, grad, self.emb_params[i].grad))
+                    config.profiler.end_l2("coalesce")
+                    continue
                 
                 config.profiler.start_l2("add_noise_emb")
-                sparse_grad = self.params[i].grad
-                n_rows_noise = std.shape[0]
-                v[n_rows_noise:] = sparse_grad._values()
-                new_indices = torch.empty((1, v.shape[0]), dtype=torch.int64)
-                new_indices[0][:n_rows_noise] = self.lS_i_nxt[i]
-                new_indices[0][n_rows_noise:] = sparse_grad._indices()[0]
-                n_rows_total = self.params[i].shape[0]
-                noisy_grad = torch.sparse_coo_tensor(new_indices, v, (n_rows_total, dim))
+                noisy_grad = self._concat_noise_and_grad(i, v)
+                config.profiler.add_bytes("add_noise_emb", 2 * _nbytes(self.emb_params[i].grad))
                 config.profiler.end_l2("add_noise_emb")
-
-                assert config.cur_batch_size * config.num_gathers_list[i] == sparse_grad._indices().shape[1]
-                assert v.shape[0] == config.cur_batch_size * config.num_gathers_list[i] + n_rows_noise
-                assert v.shape[1] == dim
+            elif config.emb_grad_format == "rows":
+                config.profiler.start_l2("coalesce")
+                grad = self._emb_row_grad(i)
+                if not grad.coalesced:
+                    grad = RowSparseGrad(*custom_api_cpp.coalesce_rows(grad.rows, grad.values, grad.n_rows, config.coalesce_nthreads), grad.n_rows)
+                config.profiler.end_l2("coalesce")
+                self._row_sparse_sgd_update(i, grad)
+                continue
             else:
-                noisy_grad = self.params[i].grad
+                config.profiler.start_l2("coalesce")
+                grad = self.emb_params[i].grad
+                self.emb_params[i].grad = self._coalesce_emb_grad(i)
+                config.profiler.add_bytes("coalesce", _nbytes(grad, self.emb_params[i].grad))
+                config.profiler.end_l2("coalesce")
+                continue
                 
             config.profiler.start_l2("coalesce")
-            if config.coalesce_optimize == "baseline":
-                self.params[i].grad = noisy_grad.coalesce()
-            elif config.coalesce_optimize == "multi_thread_openmp":
-                self.params[i].grad = custom_api_cpp.coalesce_multi_thread_openmp(noisy_grad, config.coalesce_nthreads)
-            elif config.coalesce_optimize == "multi_thread_embeddingbag":
-                self.params[i].grad = custom_api_cpp.coalesce_multi_thread_embeddingbag(noisy_grad, config.coalesce_nthreads)
+            if config.coalesce_async and not noisy_grad.is_cuda:
+                # waited for below, the noise of the next table is sampled meanwhile
+                pending.append((i, noisy_grad, custom_api_cpp.coalesce_async(noisy_grad, config.coalesce_optimize, config.coalesce_nthreads)))
             else:
-                assert False
+                self.emb_params[i].grad = coalesce(noisy_grad, i)
+                config.profiler.add_bytes("coalesce", _nbytes(noisy_grad, self.emb_params[i].grad))
             config.profiler.end_l2("coalesce")
-            
+
+        if len(pending) > 0:
+            config.profiler.start_l2("coalesce")
+            for i, noisy_grad, future in pending:
+                self.emb_params[i].grad = future.wait()[0]
+                config.profiler.add_bytes("coalesce", _nbytes(noisy_grad, self.emb_params[i].grad))
+            config.profiler.end_l2("coalesce")
+
+    def do_batched_delayed_noise_update(self):
+        # Same as "baseline", but noise sampling and coalescing of all tables are done by
+        # a single call of the multi-table kernels (i.e., one thread team for all tables)
+        n_tables = len(self.emb_tables)
+        dim = self._uniform_emb_dim()
+        if self.lS_i_nxt != None:
+            config.profiler.start_l2("generate_noise_emb")
+            stds = [self.stds_for_delayed_noise[i] for i in range(n_tables)]
+            extras = [config.cur_num_indices_list[i] for i in range(n_tables)]
+            if config.is_debugging:
+                vs = [self._noise_for_debugging(stds[i], dim, extras[i]) for i in range(n_tables)]
+            elif config.noise_rng == "philox":
+                vs = custom_api_cpp.normal_multi_table_with_extra(stds, list(self.lS_i_nxt), dim, extras, self.noise_seed, self.cnt_iter, config.noise_final_nthreads)
+            else:
+                vs = custom_api_cpp.normal_multi_table_with_extra(stds, [], dim, extras, -1, self.cnt_iter, config.noise_final_nthreads)
+            config.profiler.add_bytes("generate_noise_emb", _nbytes(*vs))
+            config.profiler.end_l2("generate_noise_emb")
+
+            config.profiler.start_l2("add_noise_emb")
+            noisy_grads = [self._concat_noise_and_grad(i, vs[i]) for i in range(n_tables)]
+            config.profiler.add_bytes("add_noise_emb", 2 * _nbytes(*[self.emb_params[i].grad for i in range(n_tables)]))
+            config.profiler.end_l2("add_noise_emb")
+        else:
+            noisy_grads = [self.emb_params[i].grad for i in range(n_tables)]
+
+        config.profiler.start_l2("coalesce")
+        grads = custom_api_cpp.coalesce_multi_table(noisy_grads, config.coalesce_nthreads)
+        config.profiler.add_bytes("coalesce", _nbytes(*noisy_grads, *grads))
+        for i in range(n_tables):
+            self.emb_params[i].grad = grads[i]
+        config.profiler.end_l2("coalesce")
+
+        params = [self.emb_params[i] for i in range(n_tables)]
+        groups = [self._get_group(p) for p in params]
+        if all(p.device.type == "cpu" and p.dtype == torch.float and g["momentum"] == 0 and g["weight_decay"] == 0 for p, g in zip(params, groups)):
+            # the vanilla SGD step of all tables at once, their rows scheduled longest-first across tables,
+            # instead of one sparse add per table in original_optimizer.step()
+            config.profiler.start_l2("add_noise_emb")
+            with torch.no_grad():
+                weights = [p.data for p in params]
+                custom_api_cpp.sparse_sgd_update_multi_table(weights, [g._indices().view(-1) for g in grads], [g._values().contiguous() for g in grads],
+                                                             [self._get_lr(p) for p in params], config.coalesce_nthreads)
+            config.profiler.add_bytes("add_noise_emb", _nbytes(*grads) + 2 * sum(g._values().numel() * 4 for g in grads))
+            for p in params:
+                p.grad = None
+            config.profiler.end_l2("add_noise_emb")
+
+    def do_global_delayed_noise_update(self):
+        # Same as "baseline" over the global rows of the concatenated tables (config.emb_layout == "concat"):
+        # one noise call, one coalescing and one update of the whole buffer (emb_l.concat_buffer), so the
+        # tables are already updated here and their p.grad is cleared before original_optimizer.step()
+        n_tables = len(self.emb_tables)
+        offsets = self.emb_tables.row_offsets
+        dim = self._uniform_emb_dim()
+        grads = [self.emb_params[i].grad for i in range(n_tables)]
+        grad_indices = torch.cat([grads[i]._indices()[0] + offsets[i] for i in range(n_tables)])
+        if self.lS_i_nxt != None:
+            config.profiler.start_l2("generate_noise_emb")
+            rows = self.lS_i_nxt_global
+            std = torch.cat(self.stds_for_delayed_noise)
+            extra = grad_indices.shape[0]
+            # the Philox key of table 0 over the global rows: distinct keys for the rows of all tables
+            if config.is_debugging:
+                v = self._noise_for_debugging(std, dim, extra)
+            elif config.noise_rng == "philox":
+                v = custom_api_cpp.normal_philox_with_extra(std, rows, dim, extra, self.noise_seed, 0, self.cnt_iter, config.noise_final_nthreads)
+            else:
+                v = custom_api_cpp.normal_multi_thread_with_extra(std, dim, extra, config.noise_final_nthreads)
+            config.profiler.add_bytes("generate_noise_emb", _nbytes(v))
+            config.profiler.end_l2("generate_noise_emb")
+
+            config.profiler.start_l2("add_noise_emb")
+            v[rows.shape[0]:] = torch.cat([g._values() for g in grads])
+            indices = torch.cat([rows, grad_indices]).view(1, -1)
+            config.profiler.add_bytes("add_noise_emb", 2 * _nbytes(*grads))
+            config.profiler.end_l2("add_noise_emb")
+        else:
+            v = torch.cat([g._values() for g in grads])
+            indices = grad_indices.view(1, -1)
+
+        config.profiler.start_l2("coalesce")
+        noisy_grad = torch.sparse_coo_tensor(indices, v, (offsets[-1], dim))
+        grad = coalesce(noisy_grad)
+        config.profiler.add_bytes("coalesce", _nbytes(noisy_grad, grad))
+        config.profiler.end_l2("coalesce")
+
+        config.profiler.start_l2("add_noise_emb")
+        with torch.no_grad():
+            self.emb_tables.concat_buffer.index_add_(0, grad._indices()[0], grad._values(), alpha=-self._get_lr(self.emb_params[0]))
+        for i in range(n_tables):
+            self.emb_params[i].grad = None
+        config.profiler.add_bytes("add_noise_emb", 3 * _nbytes(grad._values()))
+        config.profiler.end_l2("add_noise_emb")
+
+    def _emb_row_grad(self, i):
+        # (config.emb_grad_format == "rows") the gradient of i-th table as rows and values: kept by the batched
+        # bag gradient, or views of the sparse gradient of the backward (coalesced with the sort of set_lS_i() if kept)
+        p = self.emb_params[i]
+        grad = getattr(p, "row_grad", None)
+        if grad is None:
+            grad = RowSparseGrad.of(self._coalesce_emb_grad(i) if self.lS_i_cur_inverse != None or self.lS_i_cur_plan != None else p.grad)
+        p.row_grad = p.grad = None
+        return grad
+
+    def _row_sparse_sgd_update(self, i, grad):
+        # the vanilla SGD step of i-th (fp32 host) table from its coalesced row-sparse gradient,
+        # instead of the sparse add of a COO p.grad in original_optimizer.step()
+        p = self.emb_params[i]
+        assert p.device.type == "cpu" and p.dtype == torch.float and grad.coalesced
+        config.profiler.start_l2("add_noise_emb")
+        with torch.no_grad():
+            custom_api_cpp.sparse_sgd_update(p.data, grad.rows, grad.values, self._get_lr(p), config.coalesce_nthreads)
+        config.profiler.add_bytes("add_noise_emb", _nbytes(grad.rows) + 3 * _nbytes(grad.values))
+        config.profiler.end_l2("add_noise_emb")
+
+    def _coalesce_emb_grad(self, i):
+        # reuse the sort of set_lS_i() (or of the producer of the batch) for the gradient of i-th table if available
+        if self.lS_i_cur_plan != None and not self.emb_params[i].is_cuda:
+            unique, perm, starts = self.lS_i_cur_plan[i]
+            return custom_api_cpp.coalesce_with_sort_plan(self.emb_params[i].grad, unique, perm, starts, config.coalesce_nthreads)
+        if self.lS_i_cur_inverse != None and not self.emb_params[i].is_cuda:
+            unique, inverse, counts = self.lS_i_cur_inverse[i]
+            return custom_api_cpp.coalesce_with_inverse(self.emb_params[i].grad, unique, inverse, counts, config.coalesce_nthreads)
+        return coalesce(self.emb_params[i].grad, i)
+
+    def _get_group(self, p: torch.Tensor):
+        for group in self.original_optimizer.param_groups:
+            if any(p is q for q in group["params"]):
+                return group
+        assert False, "Parameter is not managed by the optimizer"
+
+    def _get_lr(self, p: torch.Tensor):
+        group = self._get_group(p)
+        assert group["momentum"] == 0 and group["weight_decay"] == 0, "Fused update only supports vanilla SGD"
+        return group["lr"] * self._lr_scale()
+
+    def do_fused_delayed_noise_update(self):
+        # Noise sampling, merging with the gradient, coalescing and model update are
+        # done in a single pass over each touched row, so embedding tables are already
+        # updated here and their p.grad is cleared before original_optimizer.step()
+        pooled_nxt = []
+        deferred = []
+        self.join_deferred_update()
+        with torch.no_grad():
+            for i in range(len(self.emb_tables)):
+                config.profiler.start_l2("add_noise_emb")
+                if self.lS_i_nxt != None:
+                    noise_indices = self.lS_i_nxt[i]
+                    std = self.stds_for_delayed_noise[i]
+                    if config.is_debugging and config.debugging_type in ["without_noise", "without_noise_clipping"]:
+                        std = torch.zeros_like(std)
+                    elif config.is_debugging and config.debugging_type == "one_as_noise":
+                        std = (std/self.noise_multiplier/self.max_grad_norm)**2
+                    elif config.is_debugging:
+                        assert False
+                else:
+                    noise_indices = torch.empty(0, dtype=torch.int64)
+                    std = torch.empty(0)
+
+                p = self.emb_params[i]
+                seed = self.noise_seed if config.noise_rng == "philox" else -1
+                rounding_seed = self.noise_seed if config.stochastic_rounding else -1
+                storage = self._emb_storage(i)
+                grad = p.grad
+                if config.async_emb_update and self.lS_i_nxt != None:
+                    # only the rows of the next batch are updated here, the other rows of the gradient
+                    # are updated by a worker thread while the next forward pass runs
+                    grad, grad_deferred = self._split_grad_by_rows(grad, noise_indices)
+                    deferred.append((storage, grad_deferred, self._get_lr(p), i, rounding_seed))
+                if self.bags_nxt is not None:
+                    # the bags of the next forward are pooled from the rows just updated
+                    bag_indices, bag_offsets = self.bags_nxt[i]
+                    pooled = self._pooled_buffer(i, bag_offsets.numel(), storage.shape[1])
+                    custom_api_cpp.fused_delayed_noise_sgd_update_and_pool(storage, noise_indices, std, grad, self._get_lr(p), config.is_debugging, seed, i, self.cnt_iter,
+                                                                           bag_indices, bag_offsets, pooled, config.noise_final_nthreads)
+                    pooled_nxt.append((bag_indices, bag_offsets, pooled))
+                    config.profiler.add_bytes("add_noise_emb", _nbytes(bag_indices, bag_offsets, pooled))
+                else:
+                    custom_api_cpp.fused_delayed_noise_sgd_update(storage, noise_indices, std, grad, self._get_lr(p), config.is_debugging, seed, i, self.cnt_iter, rounding_seed, config.noise_final_nthreads)
+                # the gradient, and (at most) the noise and gradient rows read and written once
+                n_rows = noise_indices.numel() + p.grad._indices().shape[1]
+                config.profiler.add_bytes("add_noise_emb", _nbytes(p.grad, noise_indices, std) + 2 * n_rows * storage[0].numel() * storage.element_size())
+                p.grad = None
+                config.profiler.end_l2("add_noise_emb")
+        self.pooled_nxt = pooled_nxt if self.bags_nxt is not None else None
+        if len(deferred) > 0:
+            self.deferred_update_thread = threading.Thread(target=self._deferred_update, args=(deferred, self.cnt_iter))
+            self.deferred_update_thread.start()
+
+    def _split_grad_by_rows(self, grad, rows):
+        # (entries of the sparse gradient on the sorted unique "rows", the other entries)
+        indices, values = grad._indices(), grad._values()
+        on_rows = torch.isin(indices[0], rows)
+        split = lambda mask: torch.sparse_coo_tensor(indices[:, mask], values[mask], grad.shape)
+        return split(on_rows), split(~on_rows)
+
+    def _deferred_update(self, deferred, cnt_iter):
+        # gradient-only update of the rows of the last batch that the next batch does not look up
+        # (config.async_emb_update): none of them is read before join_deferred_update(), and the
+        # delayed noise of these rows is untouched, so the result equals that of the synchronous update
+        noise_indices = torch.empty(0, dtype=torch.int64)
+        std = torch.empty(0)
+        seed = self.noise_seed if config.noise_rng == "philox" else -1
+        for storage, grad, lr, i, rounding_seed in deferred:
+            custom_api_cpp.fused_delayed_noise_sgd_update(storage, noise_indices, std, grad, lr, False, seed, i, cnt_iter, rounding_seed, config.noise_final_nthreads)
+
+    def join_deferred_update(self):
+        if getattr(self, "deferred_update_thread", None) is not None:
+            self.deferred_update_thread.join()
+            self.deferred_update_thread = None
+        if config.emb_early_release and getattr(self, "embedding_engine", None) is not None:
+            self.embedding_engine.wait()
+
+    def wait_emb_table(self, i):
+        # the lookups of i-th table in the next forward wait only for its own update (config.emb_early_release)
+        if getattr(self, "embedding_engine", None) is not None:
+            self.embedding_engine.wait_table(i)
+
+    def _pooled_buffer(self, i, n_bags, dim):
+        # outputs of the bags of the i-th table, pinned for their H2D copy and double-buffered, since the
+        # copy of the previous iteration's buffer may still be in flight
+        key = (i, self.cnt_iter % 2)
+        buffer = self.pooled_buffers.get(key)
+        if buffer is None or buffer.shape != (n_bags, dim):
+            buffer = torch.empty((n_bags, dim), pin_memory=torch.cuda.is_available())
+            self.pooled_buffers[key] = buffer
+        return buffer
+
+    def unique_sets_nxt(self):
+        # (sorted unique rows, inverse) of each table for the forward of the next batch (the batch of the last
+        # set_lS_i()), when they were kept (config.unique_optimize == "multi_thread_inverse"), None otherwise
+        if self.lS_i_nxt_inverse == None or self.lS_i_nxt == None:
+            return None
+        return [(self.lS_i_nxt[i], inverse) for i, (inverse, _) in enumerate(self.lS_i_nxt_inverse)]
+
+    def pop_pooled_nxt(self):
+        # (bag indices, bag offsets, pooled output) of each table for the forward of this iteration, pooled
+        # by the update of the last one (config.update_pool_optimize == "fused"), None otherwise
+        pooled, self.pooled_nxt = self.pooled_nxt, None
+        return pooled
+
+    def do_sharded_delayed_noise_update(self):
+        # Same as "fused", but all tables are updated by one call with their rows split into shards
+        # of config.shard_rows rows: each shard derives its stds from its slice of the HT and sets
+        # the HT of its noise rows, so set_HT_increase_cnt_iter() has nothing left to scatter
+        with torch.no_grad():
+            config.profiler.start_l2("add_noise_emb")
+            n_tables = len(self.emb_tables)
+            scale = self.noise_multiplier*self.max_grad_norm
+            constant_noise = config.is_debugging
+            if config.is_debugging and config.debugging_type in ["without_noise", "without_noise_clipping"]:
+                scale = 0
+            elif config.is_debugging and config.debugging_type == "one_as_noise":
+                scale = 1 # the delay itself as the noise
+            elif config.is_debugging:
+                assert False
+            noise_indices = list(self.lS_i_nxt) if self.lS_i_nxt != None else []
+            grads = [self.emb_params[i].grad for i in range(n_tables)]
+            lrs = [self._get_lr(self.emb_params[i]) for i in range(n_tables)]
+            seed = self.noise_seed if config.noise_rng == "philox" else -1
+            weights = [self.emb_tables[i].weight.data for i in range(n_tables)]
+            custom_api_cpp.sharded_delayed_noise_sgd_update(weights, list(self.HT), noise_indices, grads, lrs, self.cnt_iter, scale, constant_noise, seed, config.shard_rows, config.noise_final_nthreads)
+            self.HT_scattered = len(noise_indices) > 0
+            n_rows = sum(v.numel() for v in noise_indices) + sum(g._indices().shape[1] for g in grads)
+            config.profiler.add_bytes("add_noise_emb", _nbytes(*grads, *noise_indices) + 2 * n_rows * weights[0][0].numel() * weights[0].element_size())
+            for i in range(n_tables):
+                self.emb_params[i].grad = None
+            config.profiler.end_l2("add_noise_emb")
+
+    def do_graph_delayed_noise_update(self):
+        # Same as "sharded", with the tables updated by the per-table nodes of a TBB flow graph
+        # (custom_api_cpp.IterationGraph): the graph is only started here, and waited for by
+        # set_HT_increase_cnt_iter(), so the tables are updated while the dense parameters are
+        with torch.no_grad():
+            config.profiler.start_l2("add_noise_emb")
+            n_tables = len(self.emb_tables)
+            scale = self.noise_multiplier*self.max_grad_norm
+            constant_noise = config.is_debugging
+            if config.is_debugging and config.debugging_type in ["without_noise", "without_noise_clipping"]:
+                scale = 0
+            elif config.is_debugging and config.debugging_type == "one_as_noise":
+                scale = 1 # the delay itself as the noise
+            elif config.is_debugging:
+                assert False
+            if not hasattr(self, "update_graph"):
+                self.update_graph = custom_api_cpp.IterationGraph(config.graph_nthreads)
+            noise_indices = list(self.lS_i_nxt) if self.lS_i_nxt != None else []
+            grads = [self.emb_params[i].grad for i in range(n_tables)]
+            lrs = [self._get_lr(self.emb_params[i]) for i in range(n_tables)]
+            seed = self.noise_seed if config.noise_rng == "philox" else -1
+            weights = [self.emb_tables[i].weight.data for i in range(n_tables)]
+            self.update_graph.submit(weights, list(self.HT), noise_indices, grads, lrs, self.cnt_iter, scale, constant_noise, seed)
+            self.HT_scattered = len(noise_indices) > 0
+            n_rows = sum(v.numel() for v in noise_indices) + sum(g._indices().shape[1] for g in grads)
+            config.profiler.add_bytes("add_noise_emb", _nbytes(*grads, *noise_indices) + 2 * n_rows * weights[0][0].numel() * weights[0].element_size())
+            for i in range(n_tables):
+                self.emb_params[i].grad = None
+            config.profiler.end_l2("add_noise_emb")
+
+    def _embedding_engine(self):
+        # custom_api_cpp.LazyDPEmbeddingEngine of delayed_noise_update_optimize == "engine", over the
+        # tables and the (baseline, int32) HT of this optimizer
+        if getattr(self, "embedding_engine", None) is None:
+            scale = self.noise_multiplier*self.max_grad_norm
+            constant_noise = config.is_debugging
+            if config.is_debugging and config.debugging_type in ["without_noise", "without_noise_clipping"]:
+                scale = 0
+            elif config.is_debugging and config.debugging_type == "one_as_noise":
+                scale = 1 # the delay itself as the noise
+            elif config.is_debugging:
+                assert False
+            seed = self.noise_seed if config.noise_rng == "philox" else -1
+            weights = [self.emb_tables[i].weight.data for i in range(len(self.emb_tables))]
+            self.embedding_engine = custom_api_cpp.LazyDPEmbeddingEngine(weights, list(self.HT), scale, constant_noise, seed, self.cnt_iter, config.noise_final_nthreads)
+        return self.embedding_engine
+
+    def do_engine_delayed_noise_update(self):
+        # The tables are updated (noise, coalescing, SGD, HT of the noise rows) by a single call of the
+        # engine, which took the rows of lS_i_nxt in set_lS_i() (prepare_next). With config.emb_early_release
+        # the update runs in the background and the forward of the next batch waits per table (wait_emb_table)
+        with torch.no_grad():
+            config.profiler.start_l2("add_noise_emb")
+            engine = self._embedding_engine()
+            assert engine.iteration() == self.cnt_iter
+            n_tables = len(self.emb_tables)
+            grads = [self.emb_params[i].grad for i in range(n_tables)]
+            if config.emb_early_release:
+                engine.step_async(grads, self._get_lr(self.emb_params[0]))
+            else:
+                engine.step(grads, self._get_lr(self.emb_params[0]))
+            self.HT_scattered = self.lS_i_nxt != None
+            noise_indices = list(self.lS_i_nxt) if self.lS_i_nxt != None else []
+            n_rows = sum(v.numel() for v in noise_indices) + sum(g._indices().shape[1] for g in grads)
+            weight = self.emb_tables[0].weight
+            config.profiler.add_bytes("add_noise_emb", _nbytes(*grads, *noise_indices) + 2 * n_rows * weight[0].numel() * weight.element_size())
+            for i in range(n_tables):
+                self.emb_params[i].grad = None
+            config.profiler.end_l2("add_noise_emb")
+
+    def _emb_storage(self, i):
+        # the tensor holding the rows of i-th table (the int8 rows of custom_utils.RowwiseInt8Table)
+        int8_table = getattr(self.emb_tables[i], "int8_table", None)
+        return int8_table.qweight if int8_table is not None else self.emb_tables[i].weight.data
+
+    def _emb_update_rule(self):
+        # "sgd": the update is linear in the noise, so the noise of skipped iterations is summed
+        # into a single sample; "momentum" / "rwsadagrad": stateful, see do_stateful_delayed_noise_update()
+        name = type(self.original_optimizer).__name__
+        if name == "RWSAdagrad":
+            return "rwsadagrad"
+        elif name == "SGD" and all(group["momentum"] == 0 for group in self.original_optimizer.param_groups):
+            return "sgd"
+        elif name == "SGD":
+            return "momentum"
+        assert False, "LazyDP supports SGD, momentum SGD and row-wise sparse Adagrad"
+
+    def _gather_delays(self, i, rows):
+        if config.ht_optimize == "native":
+            return self.HT_native.gather_delays([i], [rows], self.cnt_iter)[0]
+        return self.cnt_iter - self.HT[i][rows]
+
+    def _scatter_HT(self, i, rows):
+        if config.ht_optimize == "native":
+            self.HT_native.scatter_iter([i], [rows], self.cnt_iter)
+        else:
+            self.HT[i][rows] = self.cnt_iter
+
+    def _sample_noise(self, shape, scale, constant_noise):
+        if constant_noise:
+            return torch.full(shape, float(scale))
+        return torch.randn(shape, generator=self.generator) * scale
+
+    def _emb_state(self, p: torch.Tensor):
+        # optimizer state of an embedding table, kept in self.state so that state_dict() carries it
+        group = self._get_group(p)
+        state = self.state[p]
+        if self.emb_update_rule == "momentum":
+            assert group["dampening"] == 0 and not group["nesterov"] and group["weight_decay"] == 0 and group["momentum"] < 1
+            if state.get("momentum_buffer") is None:
+                state["momentum_buffer"] = huge_pages_like(p.data, copy=False)
+            return group, state["momentum_buffer"]
+        assert group["lr_decay"] == 0 and group["weight_decay"] == 0
+        if "momentum" not in state:
+            state["momentum"] = huge_pages_like(torch.empty(p.shape[0], dtype=torch.float32), copy=False)
+            state["momentum"].fill_(group["initial_accumulator_value"])
+        return group, state["momentum"]
+
+    def _grad_scale(self):
+        # same as "scale_grad()"; applied to the gradient (not to lr) since Adagrad is not linear in it
+        return self._lr_scale()
+
+    def _catch_up_rows(self, i, rows, k):
+        # Applies k[r] noise-only iterations (no gradient) to rows[r] of i-th table in closed form
+        p = self.emb_params[i]
+        group, state = self._emb_state(p)
+        scale, constant_noise, _ = self._settle_noise_args()
+        scale *= self._grad_scale()
+        lr = group["lr"]
+        w = p.data[rows]
+        if self.emb_update_rule == "momentum":
+            # b <- mu*b + n, w <- w - lr*b for k iterations gives
+            #   w <- w - lr*(mu*(1-mu^k)/(1-mu)*b + X), b <- mu^k*b + Y
+            # with X = sum_r a_r*n_r, Y = sum_r c_r*n_r, a_r = (1-mu^r)/(1-mu), c_r = mu^(r-1) (r = 1..k),
+            # i.e., X and Y are jointly Gaussian and are sampled from their covariance
+            mu = group["momentum"]
+            b = state[rows]
+            k = k.double().unsqueeze(1)
+            mu_k, mu_2k = mu ** k, mu ** (2 * k)
+            sum_a = (k - mu * (1 - mu_k) / (1 - mu)) / (1 - mu)
+            sum_c = (1 - mu_k) / (1 - mu)
+            sum_c2 = (1 - mu_2k) / (1 - mu ** 2)
+            sum_ac = (sum_c - mu * sum_c2) / (1 - mu)
+            sum_a2 = (k - 2 * mu * sum_c + mu ** 2 * sum_c2) / (1 - mu) ** 2
+            if constant_noise:
+                X, Y = (sum_a * scale).float(), (sum_c * scale).float()
+            else:
+                z1 = self._sample_noise(w.shape, 1, False).double()
+                z2 = self._sample_noise(w.shape, 1, False).double()
+                std_X = sum_a2.sqrt()
+                cov = torch.where(std_X > 0, sum_ac / std_X.clamp(min=1e-30), torch.zeros_like(std_X))
+                X = (std_X * z1 * scale).float()
+                Y = ((cov * z1 + (sum_c2 - cov ** 2).clamp(min=0).sqrt() * z2) * scale).float()
+            w -= lr * (mu * sum_c.float() * b + X)
+            state[rows] = mu_k.float() * b + Y
+        else:
+            # the accumulator grows by mean(n^2) per iteration, which is replaced by its expectation scale^2,
+            # so sum_m n_m/sqrt(G + m*scale^2) is Gaussian with variance digamma(G/scale^2 + k + 1) - digamma(G/scale^2 + 1)
+            # (eps is ignored as sqrt(G) >= scale)
+            G = state[rows].double()
+            k = k.double()
+            if scale == 0:
+                return
+            if constant_noise:
+                X = torch.zeros_like(G)
+                for m in range(1, int(k.max().item()) + 1 if k.numel() > 0 else 1):
+                    X += torch.where(k >= m, scale / ((G + m * scale ** 2).sqrt() + group["eps"]), torch.zeros_like(G))
+                X = X.unsqueeze(1).float().expand_as(w)
+            else:
+                var = torch.digamma(G / scale ** 2 + k + 1) - torch.digamma(G / scale ** 2 + 1)
+                X = var.sqrt().unsqueeze(1).float() * self._sample_noise(w.shape, 1, False)
+            w -= lr * X
+            state[rows] = (G + k * scale ** 2).float()
+        p.data[rows] = w
+
+    def _step_rows(self, i, rows, g, noise_std, constant_noise, seed):
+        # the update of this iteration for rows with a (scaled) gradient g and noise of noise_std (per row)
+        p = self.emb_params[i]
+        group, state = self._emb_state(p)
+        lr = group["lr"]
+        if constant_noise:
+            g += noise_std.unsqueeze(1)
+            noise_std = noise_std[:0]
+        if self.emb_update_rule == "momentum":
+            if noise_std.numel() > 0:
+                g += noise_std.unsqueeze(1) * self._sample_noise(g.shape, 1, False)
+            b = group["momentum"] * state[rows] + g
+            state[rows] = b
+            p.data[rows] -= lr * b
+        else:
+            custom_api_cpp.sparse_rowwise_adagrad_update(p.data, state, rows, g.contiguous(), noise_std, lr, group["eps"], seed, i, self.cnt_iter, config.noise_final_nthreads)
+
+    def do_stateful_delayed_noise_update(self):
+        # Momentum SGD and row-wise Adagrad are not linear in the noise, so the noise of skipped
+        # iterations cannot be added as a single sample. Every row touched in this iteration
+        # (lS_i_nxt and the rows of the gradient) first catches up on the noise-only iterations it
+        # skipped (_catch_up_rows()), and rows with a gradient then take the step of this iteration.
+        # Embedding tables are updated here and their p.grad is cleared before original_optimizer.step()
+        assert not config.noise_drain and (config.ht_optimize == "baseline" or config.ht_bits == 32)
+        scale, constant_noise, seed = self._settle_noise_args()
+        with torch.no_grad():
+            for i in range(len(self.emb_tables)):
+                config.profiler.start_l2("coalesce")
+                p = self.emb_params[i]
+                grad = self._coalesce_emb_grad(i)
+                grad_indices, grad_values = grad._indices()[0], grad._values()
+                noise_indices = self.lS_i_nxt[i] if self.lS_i_nxt != None else grad_indices[:0]
+                rows, inverse = torch.cat([noise_indices, grad_indices]).unique(return_inverse=True)
+                has_grad = torch.zeros(rows.shape[0], dtype=torch.bool)
+                has_grad[inverse[noise_indices.shape[0]:]] = True
+                g = torch.zeros(rows.shape[0], grad_values.shape[1], dtype=grad_values.dtype)
+                g[inverse[noise_indices.shape[0]:]] = grad_values
+                config.profiler.end_l2("coalesce")
+
+                config.profiler.start_l2("add_noise_emb")
+                # the last of the delayed iterations of a row with a gradient is this iteration
+                delays = self._gather_delays(i, rows)
+                self._catch_up_rows(i, rows, (delays - has_grad.int()).clamp(min=0))
+                noise_std = (delays[has_grad] > 0).float() * (scale * self._grad_scale())
+                self._step_rows(i, rows[has_grad], g[has_grad] * self._grad_scale(), noise_std, constant_noise, seed)
+                self._scatter_HT(i, rows)
+                p.grad = None
+                config.profiler.end_l2("add_noise_emb")
+
+    def _settle_noise_args(self):
+        # (scale, constant_noise, seed) of the noise applied when settling delayed noise
+        scale = self.noise_multiplier*self.max_grad_norm
+        constant_noise = False
+        if config.is_debugging and config.debugging_type in ["without_noise", "without_noise_clipping"]:
+            scale = 0
+        elif config.is_debugging and config.debugging_type == "one_as_noise":
+            scale, constant_noise = 1, True
+        elif config.is_debugging:
+            assert False
+        seed = self.noise_seed if config.noise_rng == "philox" else -1
+        return scale, constant_noise, seed
+
+    def _rebase_HT(self):
+        # flush the delayed noise of HT blocks whose delta counters overflowed
+        scale, constant_noise, seed = self._settle_noise_args()
+        weights = [emb.weight.data for emb in self.emb_tables]
+        lrs = [self._get_lr(self.emb_params[i]) for i in range(len(self.emb_tables))]
+        self.HT_native.rebase(weights, lrs, self.cnt_iter, scale, constant_noise, seed)
+
+    def _settle_noise(self, i, row_start, row_end, min_delay, n_threads):
+        # apply the delayed noise of rows [row_start, row_end) of i-th table whose delay >= min_delay
+        scale, constant_noise, seed = self._settle_noise_args()
+        if self.emb_update_rule != "sgd":
+            with torch.no_grad():
+                rows = torch.arange(row_start, row_end)
+                delays = self._gather_delays(i, rows)
+                rows, delays = rows[delays >= min_delay], delays[delays >= min_delay]
+                self._catch_up_rows(i, rows, delays)
+                self._scatter_HT(i, rows)
+            return
+        if config.emb_weight_decay > 0:
+            self._settle_decayed_rows(i, row_start, row_end, min_delay, n_threads)
+            return
+        weight = self.emb_tables[i].weight.data
+        lr = self._get_lr(self.emb_params[i])
+        if config.ht_optimize == "native":
+            return self.HT_native.settle(i, weight, row_start, row_end, self.cnt_iter, lr, scale, min_delay, constant_noise, seed, n_threads)
+        return custom_api_cpp.settle_delayed_noise(weight, self.HT[i], row_start, row_end, self.cnt_iter, lr, scale, min_delay, constant_noise, seed, i, n_threads)
+
+    def _settle_decayed_rows(self, i, row_start, row_end, min_delay, n_threads):
+        # _settle_noise() under the lazy weight decay: the pending decay and the decayed delayed noise of the rows
+        scale, constant_noise, seed = self._settle_noise_args()
+        with torch.no_grad():
+            weight = self.emb_tables[i].weight.data
+            rows = torch.arange(row_start, row_end)
+            delays = self._gather_delays(i, rows)
+            rows, delays = rows[delays >= min_delay], delays[delays >= min_delay]
+            ratio = self._decayed_noise_ratio(i, delays, constant_noise).float()
+            dim = weight.shape[1]
+            if constant_noise:
+                noise = ratio.unsqueeze(1).expand(-1, dim)
+            elif seed != -1:
+                noise = custom_api_cpp.normal_philox_with_extra(scale * ratio ** (1/2), rows, dim, 0, seed, i, self.cnt_iter, n_threads)
+            else:
+                noise = torch.randn(rows.shape[0], dim, generator=self.generator) * (scale * ratio ** (1/2)).unsqueeze(1)
+            decay = (self._decay_base(i) ** delays.double()).to(weight.dtype)
+            weight.index_copy_(0, rows, weight[rows] * decay.unsqueeze(1) - self._get_lr(self.emb_params[i]) * noise)
+            self._scatter_HT(i, rows)
+
+    def settle_all_noise(self, chunk_rows: int = 1 << 16, path: Optional[str] = None, params: Optional[List[torch.Tensor]] = None):
+        """
+        Applies all outstanding delayed noise of LazyDP to the embedding tables (e.g., before
+        a checkpoint or an export) and resets their HT, walking each table in chunks of
+        ``chunk_rows`` rows.
+
+        When ``path`` is given, ``params`` (e.g., ``list(dlrm.parameters())``) are written to it
+        in order, and each chunk of an embedding table is written as soon as it is settled, so
+        no copy of a table is made (see ``custom_utils.load_streamed_parameters``).
+        """
+        self.join_noise_drain()
+        self.join_deferred_update()
+        if self.row_cache is not None:
+            self.row_cache.write_back()
+        emb_ids = {id(emb.weight): i for i, emb in enumerate(self.emb_tables)}
+        writer = StreamedParameterWriter(path) if path is not None else None
+        if config.ht_device == "gpu":
+            # the CPU tables are settled with a host copy of their HT, which is reset in place
+            HT_device = self.HT
+            self.HT = [HT.cpu() for HT in HT_device]
+        if params is None:
+            assert writer is None
+            params = [emb.weight for emb in self.emb_tables]
+
+        with torch.no_grad():
+            for p in params:
+                if id(p) not in emb_ids:
+                    if writer is not None:
+                        writer.write(p.detach().cpu())
+                    continue
+                i = emb_ids[id(p)]
+                n_rows = p.shape[0]
+                if writer is not None:
+                    writer.begin(p.shape, p.dtype)
+                for row_start in range(0, n_rows, chunk_rows):
+                    row_end = min(row_start + chunk_rows, n_rows)
+                    self._settle_noise(i, row_start, row_end, 1, config.noise_final_nthreads)
+                    if writer is not None:
+                        writer.write_rows(p.data[row_start:row_end])
+                if writer is not None:
+                    writer.end()
+        # every row is up to date, so this only resets the base of overflowed blocks
+        if config.ht_optimize == "native" and config.ht_bits != 32:
+            self._rebase_HT()
+        if config.ht_device == "gpu":
+            for HT, HT_host in zip(HT_device, self.HT):
+                HT.copy_(HT_host)
+            self.HT = HT_device
+        if writer is not None:
+            writer.close()
+
+    def start_noise_drain(self):
+        # Settle rows whose delay >= config.noise_drain_threshold in the background on spare cores,
+        # scanning config.noise_drain_rows rows per iteration (round robin over the tables).
+        # Rows read by the next forward pass were updated in this iteration (delay 1), so the
+        # drain never touches them; it is joined before the HT is read again.
+        assert config.noise_drain_threshold >= 2
+        self.join_noise_drain()
+        if not hasattr(self, "noise_drain_cursor"):
+            self.noise_drain_cursor = (0, 0)
+        if config.ht_optimize == "native" and config.ht_bits != 32:
+            # rebase() would have to run on the pool concurrently with the main thread
+            assert False, "Noise drain does not support the compressed HT"
+
+        def drain():
+            table, row = self.noise_drain_cursor
+            remaining = config.noise_drain_rows
+            while remaining > 0:
+                n_rows = self.emb_tables[table].weight.shape[0]
+                row_end = min(row + remaining, n_rows)
+                self._settle_noise(table, row, row_end, config.noise_drain_threshold, config.noise_drain_nthreads)
+                remaining -= row_end - row
+                row = row_end
+                if row == n_rows:
+                    table, row = (table + 1) % len(self.emb_tables), 0
+            self.noise_drain_cursor = (table, row)
+
+        self.noise_drain_thread = threading.Thread(target=drain)
+        self.noise_drain_thread.start()
+
+    def join_noise_drain(self):
+        if getattr(self, "noise_drain_thread", None) is not None:
+            self.noise_drain_thread.join()
+            self.noise_drain_thread = None
+
     def set_HT_increase_cnt_iter(self):
+        self.join_noise_drain()
+        if getattr(self, "update_graph", None) is not None:
+            # the tables and their HT are final once the graph of do_graph_delayed_noise_update() is done
+            self.update_graph.wait()
         lS_i_nxt = self.lS_i_nxt
-        assert len(lS_i_nxt) == len(self.module.emb_l)
-        for i in range(len(lS_i_nxt)):
-            self.HT[i][lS_i_nxt[i]] = self.cnt_iter
+        assert len(lS_i_nxt) == len(self.emb_tables)
+        if config.ht_optimize == "native":
+            self.HT_native.scatter_iter(list(range(len(lS_i_nxt))), list(self.lS_i_nxt_HT), self.cnt_iter)
+            if config.ht_bits != 32:
+                self._rebase_HT()
+        elif config.ht_optimize == "inline":
+            # already set when the ids were mapped (map_dynamic_ids)
+            pass
+        elif config.delayed_noise_update_optimize == "global":
+            self.HT_global[self.lS_i_nxt_global] = self.cnt_iter
+        elif getattr(self, "HT_scattered", False):
+            # already set by the shards of do_sharded_delayed_noise_update() (or the graph of do_graph_delayed_noise_update())
+            self.HT_scattered = False
+        else:
+            for i in range(len(lS_i_nxt)):
+                if self.HT[i].is_cuda:
+                    custom_api_cuda.scatter_iter(self.HT[i], self.lS_i_nxt_HT[i], self.cnt_iter)
+                    continue
+                self.HT[i][lS_i_nxt[i]] = self.cnt_iter
         self.cnt_iter += 1
+        if self.row_cache is not None and self.row_cache.refresh_due():
+            self.row_cache.refresh()
+        if config.noise_drain:
+            self.start_noise_drain()
+
+    def permute_emb_rows(self, i, src):
+        # row j of the per-row state of i-th table (HT, optimizer state) becomes its row src[j] (custom_utils.RowReorder)
+        with torch.no_grad():
+            if config.ht_optimize == "native":
+                assert config.ht_bits == 32
+                HT = self.HT_native.table(i)
+            else:
+                HT = self.HT[i]
+            HT.copy_(HT[src])
+            for state in self.state[self.emb_params[i]].values():
+                if torch.is_tensor(state) and state.dim() > 0 and state.shape[0] == src.shape[0]:
+                    state.copy_(state[src])
+
+    def _remap_lS_i(self, lS_i_nxt):
+        # indices of the reordered tables, same as apply_emb(), without those of the dense tables
+        # (config.dense_emb_rows) which follow them
+        if lS_i_nxt == None:
+            return None
+        return [remap_rows(self.emb_tables[i], lS_i_nxt[i]) for i in range(len(self.emb_tables))]
+
+    def prefetch_lS_i(self, lS_i_nxt):
+        # Pipelined mode: derive unique indices of lS_i_nxt and their stds in the background
+        # (the HT is not updated until set_HT_increase_cnt_iter()), consumed by set_lS_i()
+        lS_i_nxt = self._remap_lS_i(lS_i_nxt)
+        self.join_noise_drain()
+        if not hasattr(self, "prefetcher"):
+            self.prefetcher = custom_api_cpp.NextIterationPrefetcher(config.unique_nthreads)
+        scale = self.noise_multiplier*self.max_grad_norm
+        if config.ht_optimize == "native":
+            self.prefetcher.submit_native(list(lS_i_nxt), self.HT_native, self.cnt_iter, scale)
+        else:
+            self.prefetcher.submit(list(lS_i_nxt), self.HT, self.cnt_iter, scale)
+        self.prefetched_cnt_iter = self.cnt_iter
+
+    def set_lS_i(self, lS_i_nxt, uniques_nxt=None, lS_o_nxt=None, plans_nxt=None):
+        # uniques_nxt: unique indices of each table of lS_i_nxt if already derived (custom_api_cpp.BatchQueue)
+        # lS_o_nxt: offsets of the bags of lS_i_nxt, pooled by the update (config.update_pool_optimize == "fused")
+        # plans_nxt: (perm, starts) of the sort plan of each table of lS_i_nxt if already derived with uniques_nxt
+        lS_i_nxt = self._remap_lS_i(lS_i_nxt)
+        self.bags_nxt = None
+        if config.update_pool_optimize == "fused" and lS_i_nxt != None:
+            self.bags_nxt = [(lS_i_nxt[k].long(), lS_o_nxt[k].long()) for k in range(len(self.emb_tables))]
+        self._set_lS_i(lS_i_nxt, uniques_nxt, plans_nxt)
+        self.lS_i_nxt_HT = self.lS_i_nxt
+        if config.index_dtype == "int32" and self.lS_i_nxt != None:
+            # the HT is gathered/scattered with the int32 unique indices, the noise update takes int64
+            self.lS_i_nxt = [unique.long() for unique in self.lS_i_nxt]
+        if not config.use_cpu and self.lS_i_nxt != None:
+            # the unique indices are derived on the CPU, the HT and the tables are in HBM (gpu_only system)
+            self.lS_i_nxt = [unique.to(config.device) for unique in self.lS_i_nxt]
+            self.lS_i_nxt_HT = self.lS_i_nxt
+        elif config.ht_device == "gpu" and self.lS_i_nxt != None:
+            # only the HT is in HBM, the tables are updated on the CPU with the shipped noise rows
+            self.lS_i_nxt_HT = [unique.to(config.device) for unique in self.lS_i_nxt]
+        elif config.table_placement != "none" and self.lS_i_nxt != None:
+            # the tables placed in HBM keep their HT next to them
+            if config.table_placement == "managed":
+                self.advise_managed()
+                self.prefetch_managed(self.lS_i_nxt)
+            self.lS_i_nxt = [unique.to(self.emb_params[i].device) for i, unique in enumerate(self.lS_i_nxt)]
+            self.lS_i_nxt_HT = self.lS_i_nxt
+        if config.delay_stats and self.lS_i_nxt != None:
+            self._record_delay_stats()
+        if config.record_unique_sets is not None and self.lS_i_nxt != None:
+            self._record_unique_sets(lS_i_nxt)
+        if self.row_cache is not None and self.lS_i_nxt != None:
+            self.row_cache.observe(self.lS_i_nxt)
+        if self.lS_i_nxt != None and self._produce_noise_early():
+            self._start_noise_production()
+        if config.llc_prefetch and self.lS_i_nxt != None:
+            self._start_llc_prefetch()
+
+    def prefetch_managed(self, uniques):
+        # the row groups of the unique rows (CPU) of the next batch are migrated to HBM on a side stream, during
+        # the update of this iteration and ahead of the lookups of the next (config.table_placement == "managed")
+        if getattr(self, "managed_stream", None) is None:
+            self.managed_stream = torch.cuda.Stream(config.device)
+        with torch.cuda.stream(self.managed_stream):
+            for i, unique in enumerate(uniques):
+                emb = self.emb_tables[i]
+                n_bytes = custom_api_cuda.managed_prefetch(emb.weight.data, unique.long().contiguous(), emb.managed_group_rows)
+                config.profiler.add_bytes("set_lS_i", n_bytes)
+
+    def advise_managed(self):
+        # every config.um_advise_interval iterations, the row groups of the managed tables touched (HT) in the
+        # last config.um_hot_window iterations prefer HBM, the most recent first within config.placement_hbm_bytes,
+        # the others prefer the CPU DRAM. Only the groups whose advice changes are advised again
+        if self.cnt_iter % config.um_advise_interval != 0:
+            return
+        ages, group_bytes = [], []
+        for i, emb in enumerate(self.emb_tables):
+            g, HT = emb.managed_group_rows, self.HT[i]
+            pad = (-HT.numel()) % g
+            last = torch.cat([HT, HT.new_full((pad,), -2**31)]).view(-1, g).amax(dim=1)
+            ages.append(self.cnt_iter - last.long())
+            group_bytes.append(torch.full_like(ages[-1], g * emb.weight.shape[1] * emb.weight.element_size()))
+        ages, group_bytes = torch.cat(ages), torch.cat(group_bytes)
+        if getattr(self, "managed_budget", None) is None:
+            # half of the HBM free before any group is advised there
+            self.managed_budget = config.placement_hbm_bytes if config.placement_hbm_bytes > 0 else torch.cuda.mem_get_info(config.device)[0] // 2
+        budget = self.managed_budget
+        order = torch.argsort(ages, stable=True)
+        hot = torch.empty_like(ages, dtype=torch.bool)
+        hot[order] = (ages[order] <= config.um_hot_window) & (group_bytes[order].cumsum(0) <= budget)
+        hot = hot.cpu().split([ht.numel() // emb.managed_group_rows + (ht.numel() % emb.managed_group_rows > 0) for ht, emb in zip(self.HT, self.emb_tables)])
+        previous = getattr(self, "managed_hot", None)
+        if previous is None:
+            # advised nowhere yet: every group is advised
+            previous = [~h for h in hot]
+        for i, emb in enumerate(self.emb_tables):
+            custom_api_cuda.managed_advise(emb.weight.data, hot[i].contiguous(), previous[i].contiguous(), emb.managed_group_rows)
+        self.managed_hot = [h.clone() for h in hot]
+
+    def _start_llc_prefetch(self):
+        # the rows of lS_i_nxt (and their HT counters) are loaded into the LLC until set_emb_to_noise_update()
+        if getattr(self, "llc_prefetcher", None) is None:
+            self.llc_prefetcher = custom_api_cpp.LLCPrefetcher(config.llc_prefetch_bytes)
+        weights = [self._emb_storage(i) for i in range(len(self.emb_tables))]
+        HTs = list(self.HT) if config.ht_optimize == "baseline" else []
+        self.llc_prefetcher.submit(weights, list(self.lS_i_nxt), HTs)
+
+    def ht_hot_set_sizes(self):
+        # rows in the hot set of each table (config.ht_hot_set)
+        if config.ht_optimize != "native":
+            return []
+        return self.HT_native.hot_set_sizes()
+
+    def llc_prefetch_stats(self):
+        # (rows requested, rows prefetched before the update started) of config.llc_prefetch
+        if getattr(self, "llc_prefetcher", None) is None:
+            return (0, 0)
+        return tuple(self.llc_prefetcher.stats())
+
+    def _produce_noise_early(self):
+        return (config.noise_producer and not config.is_debugging and not self._fuse_std_noise() and self.emb_update_rule == "sgd"
+                and config.delayed_noise_update_optimize in ["baseline", "merge"] and config.noise_precision == "fp32")
+
+    def _start_noise_production(self):
+        # stds are known once lS_i_nxt is (the HT does not change until set_HT_increase_cnt_iter()),
+        # so the noise is sampled in the background until do_delayed_noise_update() consumes it
+        if not hasattr(self, "noise_producer"):
+            self.noise_producer = custom_api_cpp.NoiseProducer(2, config.noise_producer_pinned, config.noise_final_nthreads)
+        self.set_emb_to_noise_update()
+        n_tables = len(self.emb_tables)
+        dim = self._uniform_emb_dim()
+        merge = config.delayed_noise_update_optimize == "merge"
+        extras = [0 if merge else config.cur_num_indices_list[i] for i in range(n_tables)]
+        seed = self.noise_seed if config.noise_rng == "philox" else -1
+        self.noise_producer.produce(list(self.stds_for_delayed_noise), list(self.lS_i_nxt), dim, extras, seed, self.cnt_iter)
+        self.noise_in_production = True
+
+    def _set_lS_i(self, lS_i_nxt, uniques_nxt=None, plans_nxt=None):
+        # the gradient coalesced in this iteration is derived from the previous lS_i_nxt
+        if self.lS_i_nxt_inverse != None:
+            self.lS_i_cur_inverse = [(self.lS_i_nxt[i], inverse, counts) for i, (inverse, counts) in enumerate(self.lS_i_nxt_inverse)]
+        else:
+            self.lS_i_cur_inverse = None
+        self.lS_i_nxt_inverse = None
+        if self.lS_i_nxt_plan != None:
+            self.lS_i_cur_plan = [(self.lS_i_nxt[i], perm, starts) for i, (perm, starts) in enumerate(self.lS_i_nxt_plan)]
+        else:
+            self.lS_i_cur_plan = None
+        self.lS_i_nxt_plan = None
 
-    def set_lS_i(self, lS_i_nxt):
         if lS_i_nxt == None:
             self.lS_i_nxt = None
             return
+
+        if config.delayed_noise_update_optimize == "engine":
+            # the engine keeps the unique rows for its step(), they are returned for the HT and the bookkeeping
+            self.lS_i_nxt = self._embedding_engine().prepare_next(list(lS_i_nxt))
+            return
+
+        if config.emb_layout == "concat":
+            # a single sort over the global rows of the concatenated tables, the unique rows of a table are
+            # those between its row offsets
+            offsets = self.emb_tables.row_offsets
+            self.lS_i_nxt_global = torch.cat([lS_i_nxt[i].long() + offsets[i] for i in range(len(lS_i_nxt))]).unique()
+            bounds = torch.searchsorted(self.lS_i_nxt_global, torch.tensor(offsets)).tolist()
+            self.lS_i_nxt = [self.lS_i_nxt_global[bounds[i]:bounds[i + 1]] - offsets[i] for i in range(len(lS_i_nxt))]
+            return
         
+        if getattr(self, "prefetched_cnt_iter", None) is not None:
+            assert self.prefetched_cnt_iter == self.cnt_iter
+            self.prefetched_cnt_iter = None
+            self.lS_i_nxt, self.stds_prefetched = self.prefetcher.wait()
+            return
+        if uniques_nxt is not None and plans_nxt:
+            # sorted by the producer of the batch, which saw the indices first
+            self.lS_i_nxt, self.lS_i_nxt_plan = list(uniques_nxt), list(plans_nxt)
+            return
+        if uniques_nxt is not None and config.unique_optimize != "multi_thread_inverse":
+            self.lS_i_nxt = list(uniques_nxt)
+            return
+        if config.unique_optimize == "multi_thread_batched":
+            self.lS_i_nxt = custom_api_cpp.unique_multi_table([lS_i.contiguous() for lS_i in lS_i_nxt], config.unique_nthreads)
+            return
+        if config.unique_optimize == "multi_thread_inverse":
+            self.lS_i_nxt_inverse = list(range(len(lS_i_nxt)))
+        elif config.unique_optimize == "sort_plan":
+            self.lS_i_nxt_plan = list(range(len(lS_i_nxt)))
         for i in range(len(lS_i_nxt)):
             if config.unique_optimize == "baseline":
                 self.lS_i_nxt[i] = lS_i_nxt[i].unique()
             elif config.unique_optimize == "multi_thread":
                 self.lS_i_nxt[i] = custom_api_cpp.unique_multi_thread(lS_i_nxt[i])
+            elif config.unique_optimize == "bitmap":
+                # no sort for the tables up to a few million rows (custom_api_cpp.unique_auto)
+                self.lS_i_nxt[i] = custom_api_cpp.unique_auto(lS_i_nxt[i], self.emb_tables[i].weight.shape[0], config.unique_nthreads)
+            elif config.unique_optimize == "multi_thread_inverse":
+                self.lS_i_nxt[i], inverse, counts = custom_api_cpp.unique_with_inverse_and_counts(lS_i_nxt[i].contiguous(), config.unique_nthreads)
+                self.lS_i_nxt_inverse[i] = (inverse.view(-1), counts)
+            elif config.unique_optimize == "sort_plan":
+                self.lS_i_nxt[i], perm, starts = custom_api_cpp.sort_plan(lS_i_nxt[i].long().contiguous(), config.unique_nthreads)
+                self.lS_i_nxt_plan[i] = (perm, starts)
             else:
                 assert False
         assert True
         
+    def catch_up_micro_batch(self, lS_i_micro):
+        # Gradient accumulation (the step of this micro-batch is skipped by signal_skip_step()): the rows
+        # of the next micro-batch of the same logical step take the delayed noise they would have taken in
+        # lS_i_nxt of the last step, so the rows of the logical step are brought up to date incrementally
+        # while the HT (cnt_iter) and the noise of the other rows only advance once per logical step
+        self.join_noise_drain()
+        self.join_deferred_update()
+        lS_i_micro = self._remap_lS_i(lS_i_micro)
+        scale = self.noise_multiplier*self.max_grad_norm
+        # the HT of the rows of the last step is (cnt_iter - 1), same delays as in its set_lS_i()
+        self.cnt_iter -= 1
+        try:
+            with torch.no_grad():
+                for i in range(len(lS_i_micro)):
+                    p = self.emb_params[i]
+                    dim = self._emb_dim(i)
+                    rows = lS_i_micro[i].long().unique()
+                    delays = self._gather_delays(i, rows)
+                    rows, delays = rows[delays > 0], delays[delays > 0]
+                    if self.emb_update_rule != "sgd":
+                        self._catch_up_rows(i, rows, delays)
+                    else:
+                        std = delays.float().sqrt() * scale
+                        if config.is_debugging:
+                            noise = self._noise_for_debugging(std, dim, 0)
+                        elif config.noise_rng == "philox":
+                            noise = custom_api_cpp.normal_philox_with_extra(std, rows, dim, 0, self.noise_seed, i, self.cnt_iter, config.noise_final_nthreads)
+                        else:
+                            noise = torch.randn((rows.shape[0], dim), generator=self.generator) * std.unsqueeze(1)
+                        p.data.index_add_(0, rows, noise, alpha=-self._get_lr(p))
+                    self._scatter_HT(i, rows)
+        finally:
+            self.cnt_iter += 1
+
     def add_remaining_noise_for_debugging(self):
         assert config.is_debugging == True
+        self.join_noise_drain()
+        self.join_deferred_update()
+        if self.row_cache is not None:
+            self.row_cache.write_back()
+
+        if self.emb_update_rule != "sgd" or config.emb_weight_decay > 0:
+            # momentum keeps moving the rows even without noise, as does the pending weight decay
+            self.settle_all_noise()
+            return
         
         if config.debugging_type in ["without_noise", "without_noise_clipping"]:
             return
@@ -808,6 +2690,23 @@ class DPOptimizer(Optimizer):
         assert config.debugging_type == "one_as_noise"
         
         with torch.no_grad():
-            for i in range(len(self.module.emb_l)):
-                remaining_noise = torch.ones_like(self.module.emb_l[i].weight) * (self.cnt_iter - self.HT[i]).unsqueeze(1)
-                self.module.emb_l[i].weight.add_(remaining_noise, alpha=-self.original_optimizer.param_groups[0]["lr"]/(self.expected_batch_size * self.accumulated_iterations)) # self.expected_batch_size * self.accumulated_iterations : same as "scale_grad()"
\ No newline at end of file
+            for i in range(len(self.emb_tables)):
+                HT = self.HT_native.table(i) if config.ht_optimize == "native" else self.HT[i]
+                weight = self.emb_tables[i].weight
+                HT = HT.to(weight.device)
+                if self._emb_storage(i).dtype != torch.float:
+                    # reduced-precision tables: same update and rounding as the training iterations
+                    n_rows, dim = weight.shape
+                    no_grad = torch.sparse_coo_tensor(torch.empty((1, 0), dtype=torch.int64), torch.empty((0, dim)), (n_rows, dim))
+                    rounding_seed = self.noise_seed if config.stochastic_rounding else -1
+                    custom_api_cpp.fused_delayed_noise_sgd_update(self._emb_storage(i), torch.arange(n_rows), (self.cnt_iter - HT).float(), no_grad, self._get_lr(weight), True, -1, i, self.cnt_iter, rounding_seed, config.noise_final_nthreads)
+                    continue
+                if config.lr_schedule_noise == "prefix_sum":
+                    # the lr of each remaining iteration, the current one taking the lr of the next step
+                    if i == 0:
+                        self._record_lr_prefix()
+                    remaining_noise = torch.ones_like(weight) * (self.lr_prefix[1, self.cnt_iter] - self.lr_prefix[1][HT.long()]).float().unsqueeze(1)
+                    weight.add_(remaining_noise, alpha=-1)
+                    continue
+                remaining_noise = torch.ones_like(self.emb_tables[i].weight) * (self.cnt_iter - HT).unsqueeze(1)
+                self.emb_tables[i].weight.add_(remaining_noise, alpha=-self.original_optimizer.param_groups[0]["lr"] * self._lr_scale()) # same scale as the training iterations
\ No newline at end of file
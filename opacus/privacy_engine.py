@@ -168,10 +168,19 @@ class PrivacyEngine:
         elif noise_generator is not None:
             generator = noise_generator
 
+        # data-parallel LazyDP: replicated tables, the gradients of the ranks are summed before the
+        # averaging over the whole batch (expected_batch_size is not the per worker one)
+        lazydp_data_parallel = (
+            config.dpsgd_mode == config.MODE_LAZYDP
+            and config.dist_mode == "data_parallel"
+            and torch.distributed.is_initialized()
+            and torch.distributed.get_world_size() > 1
+        )
         optim_class = get_optimizer_class(
             clipping=clipping,
             distributed=distributed,
             grad_sample_mode=grad_sample_mode,
+            lazydp_data_parallel=lazydp_data_parallel,
         )
 
         return optim_class(
@@ -323,6 +332,7 @@ class PrivacyEngine:
         clipping: str = "flat",
         noise_generator=None,
         grad_sample_mode: str = "hooks",
+        accumulation_steps: int = 1,
     ) -> Tuple[GradSampleModule, DPOptimizer, DataLoader]:
         """
         Add privacy-related responsibilities to the main PyTorch training objects:
@@ -371,6 +381,9 @@ class PrivacyEngine:
                 implementation class for the wrapped ``module``. See
                 :class:`~opacus.grad_sample.gsm_base.AbstractGradSampleModule` for more
                 details
+            accumulation_steps: Number of batches of ``data_loader`` (micro-batches) accumulated
+                in one optimizer step (``DPOptimizer.signal_skip_step()``), which scales the
+                sample rate and the expected batch size of a step
 
         Returns:
             Tuple of (model, optimizer, data_loader).
@@ -417,6 +430,8 @@ class PrivacyEngine:
         else:
             sample_rate = config.batch_size / config.data_size
             expected_batch_size = config.batch_size
+        sample_rate *= accumulation_steps
+        expected_batch_size *= accumulation_steps
         
         # expected_batch_size is the *per worker* batch size
         if distributed:
@@ -458,6 +473,7 @@ class PrivacyEngine:
         clipping: str = "flat",
         noise_generator=None,
         grad_sample_mode: str = "hooks",
+        accumulation_steps: int = 1,
         **kwargs,
     ):
         """
@@ -496,6 +512,9 @@ class PrivacyEngine:
                 implementation class for the wrapped ``module``. See
                 :class:`~opacus.grad_sample.gsm_base.AbstractGradSampleModule` for more
                 details
+            accumulation_steps: Number of batches of ``data_loader`` (micro-batches) accumulated
+                in one optimizer step (``DPOptimizer.signal_skip_step()``), which scales the
+                sample rate and the expected batch size of a step
 
         Returns:
             Tuple of (model, optimizer, data_loader).
@@ -512,6 +531,8 @@ class PrivacyEngine:
             sample_rate = 1 / len(data_loader)
         else:
             sample_rate = config.batch_size / config.data_size
+        # one step per accumulation_steps micro-batches
+        sample_rate *= accumulation_steps
 
         if len(self.accountant) > 0:
             warnings.warn(
@@ -539,6 +560,7 @@ class PrivacyEngine:
             grad_sample_mode=grad_sample_mode,
             disable_poisson_sampling=disable_poisson_sampling,
             clipping=clipping,
+            accumulation_steps=accumulation_steps,
         )
 
     def get_epsilon(self, delta):
@@ -581,6 +603,10 @@ class PrivacyEngine:
         checkpoint_dict["privacy_accountant_state_dict"] = self.accountant.state_dict()
         if optimizer is not None:
             checkpoint_dict["optimizer_state_dict"] = optimizer.state_dict()
+            if config.dpsgd_mode == config.MODE_LAZYDP:
+                # HT, iteration counter and generators, so the delayed noise survives the checkpoint
+                # (see custom_utils.save_lazydp_checkpoint for the checkpoint with memory-mapped tables)
+                checkpoint_dict["lazydp_state_dict"] = optimizer.lazydp_state_dict()
         if noise_scheduler is not None:
             checkpoint_dict["noise_scheduler_state_dict"] = noise_scheduler.state_dict()
 
@@ -612,6 +638,10 @@ class PrivacyEngine:
                 f" but optimizer is {'' if optimizer else 'not'} provided."
             )
 
+        lazydp_state_dict = checkpoint.pop("lazydp_state_dict", None)
+        if optimizer is not None and lazydp_state_dict is not None:
+            optimizer.load_lazydp_state_dict(lazydp_state_dict)
+
         noise_scheduler_state_dict = checkpoint.pop("noise_scheduler_state_dict", {})
         if noise_scheduler is not None and len(noise_scheduler_state_dict) > 0:
             noise_scheduler.load_state_dict(noise_scheduler_state_dict)
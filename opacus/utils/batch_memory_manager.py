@@ -31,6 +31,12 @@ class BatchSplittingSampler(Sampler[List[int]]):
 
     Used to split large logical batches into physical batches of a smaller size,
     while coordinating with DPOptimizer when the logical batch has ended.
+
+    The flags are queued in the order the batches are drawn, so a training loop that
+    draws one batch ahead (the ``set_lS_i()`` lookahead of LazyDP) finds the flag of the
+    batch it steps on at the front (``optimizer._check_skip_next_step(pop_next=False)``),
+    and brings the rows of the next physical batch of the same logical one up to date
+    with ``optimizer.catch_up_micro_batch()`` instead of ``set_lS_i()``.
     """
 
     def __init__(
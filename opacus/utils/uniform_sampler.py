@@ -13,12 +13,35 @@
 # See the License for the specific language governing permissions and
 # limitations under the License.
 
+import math
 from typing import List
 
 import torch
 from torch.utils.data import Sampler
 
 
+def poisson_sample(num_samples: int, sample_rate: float, generator=None) -> torch.Tensor:
+    r"""
+    Indices of ``range(num_samples)`` each selected independently with probability ``sample_rate``,
+    drawn by geometric skip-ahead: the gaps between selected indices are i.i.d. geometric, so a step
+    costs O(num_samples * sample_rate) instead of a Bernoulli draw over the whole dataset.
+    """
+    if sample_rate >= 1:
+        return torch.arange(num_samples)
+    log_q = math.log1p(-sample_rate)
+    expected = num_samples * sample_rate
+    chunk = int(expected + 6 * math.sqrt(expected)) + 16
+    selected = []
+    last = -1
+    while last < num_samples:
+        u = torch.rand(chunk, dtype=torch.float64, generator=generator)
+        gaps = torch.floor(torch.log1p(-u) / log_q).long() + 1
+        positions = last + torch.cumsum(gaps, dim=0)
+        last = positions[-1].item()
+        selected.append(positions[positions < num_samples])
+    return torch.cat(selected)
+
+
 class UniformWithReplacementSampler(Sampler[List[int]]):
     r"""
     This sampler samples elements according to the Sampled Gaussian Mechanism.
@@ -48,11 +71,7 @@ class UniformWithReplacementSampler(Sampler[List[int]]):
     def __iter__(self):
         num_batches = int(1 / self.sample_rate)
         while num_batches > 0:
-            mask = (
-                torch.rand(self.num_samples, generator=self.generator)
-                < self.sample_rate
-            )
-            indices = mask.nonzero(as_tuple=False).reshape(-1).tolist()
+            indices = poisson_sample(self.num_samples, self.sample_rate, self.generator).tolist()
             yield indices
 
             num_batches -= 1
@@ -136,11 +155,7 @@ class DistributedUniformWithReplacementSampler(Sampler):
 
         # Now, select a batch with Poisson subsampling
         for _ in range(self.num_batches):
-            mask = (
-                torch.rand(self.num_samples, generator=self.generator)
-                < self.sample_rate
-            )
-            selected_examples = mask.nonzero(as_tuple=False).reshape(-1)
+            selected_examples = poisson_sample(self.num_samples, self.sample_rate, self.generator)
             if len(selected_examples) > 0:
                 yield indices[selected_examples]
 